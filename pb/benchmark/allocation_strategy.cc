@@ -0,0 +1,287 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/benchmark/allocation_strategy.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace pb::benchmark {
+namespace {
+
+// Each block starts with a header saying how to free it, so that a block can
+// be freed correctly no matter which strategy the freeing thread is using. Its
+// size keeps the blocks aligned as malloc() would.
+enum BlockKind : uint32_t { kMallocBlock, kPoolBlock, kArenaBlock };
+struct alignas(16) BlockHeader {
+  BlockKind kind;
+  uint32_t size_class;
+};
+constexpr std::size_t kHeaderSize = sizeof(BlockHeader);
+
+// The thread pools cache blocks of up to 1 KiB, in 16-byte size classes.
+constexpr std::size_t kSizeClassBytes = 16;
+constexpr int kSizeClassCount = 64;
+constexpr int kMaxCachedBlocksPerClass = 4096;
+
+// The arena chunks, and the largest block taken from them (larger ones are
+// malloc()'ed).
+constexpr std::size_t kArenaChunkBytes = 256 << 10;
+constexpr std::size_t kMaxArenaBlockBytes = kArenaChunkBytes / 8;
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct alignas(16) ArenaChunk {
+  ArenaChunk* next;
+};
+
+// Trivially destructible, so that it remains usable by allocations made while
+// other thread_local objects are being destroyed.
+struct ThreadState {
+  AllocationStrategy strategy;
+  AllocationCounts counts;
+
+  FreeBlock* free_lists[kSizeClassCount];
+  int32_t free_counts[kSizeClassCount];
+
+  ArenaChunk* first_chunk;
+  ArenaChunk* current_chunk;
+  char* arena_position;
+  char* arena_limit;
+
+  bool cleanup_registered;
+  bool exited;
+};
+thread_local ThreadState thread_state{};
+
+// Frees the thread's cached blocks and arena chunks when it exits. From then
+// on, its allocations go straight to malloc().
+class ThreadStateCleanup {
+ public:
+  void Register() {}
+
+  ~ThreadStateCleanup() {
+    ThreadState& state = thread_state;
+    for (int i = 0; i < kSizeClassCount; ++i) {
+      while (FreeBlock* const block = state.free_lists[i]) {
+        state.free_lists[i] = block->next;
+        std::free(reinterpret_cast<char*>(block) - kHeaderSize);
+      }
+      state.free_counts[i] = 0;
+    }
+    while (ArenaChunk* const chunk = state.first_chunk) {
+      state.first_chunk = chunk->next;
+      std::free(chunk);
+    }
+    state.current_chunk = nullptr;
+    state.arena_position = state.arena_limit = nullptr;
+    state.exited = true;
+  }
+};
+thread_local ThreadStateCleanup thread_state_cleanup;
+
+ThreadState& GetThreadState() {
+  ThreadState& state = thread_state;
+  if (!state.cleanup_registered) {
+    state.cleanup_registered = true;
+    thread_state_cleanup.Register();
+  }
+  return state;
+}
+
+// Each of these returns nullptr if out of memory.
+void* MakeBlock(void* memory, BlockKind kind, uint32_t size_class) {
+  if (!memory) {
+    return nullptr;
+  }
+  auto* const header = static_cast<BlockHeader*>(memory);
+  header->kind = kind;
+  header->size_class = size_class;
+  return static_cast<char*>(memory) + kHeaderSize;
+}
+
+void* MallocBlock(std::size_t size) {
+  return MakeBlock(std::malloc(kHeaderSize + size), kMallocBlock, 0);
+}
+
+void* PoolBlock(ThreadState& state, std::size_t size) {
+  if (size > kSizeClassBytes * kSizeClassCount) {
+    return MallocBlock(size);
+  }
+  const int size_class =
+      (size == 0) ? 0 : static_cast<int>((size - 1) / kSizeClassBytes);
+  if (FreeBlock* const block = state.free_lists[size_class]) {
+    state.free_lists[size_class] = block->next;
+    --state.free_counts[size_class];
+    return block;
+  }
+  return MakeBlock(
+      std::malloc(kHeaderSize + (size_class + 1) * kSizeClassBytes),
+      kPoolBlock, static_cast<uint32_t>(size_class));
+}
+
+void* ArenaBlock(ThreadState& state, std::size_t size) {
+  if (size > kMaxArenaBlockBytes) {
+    return MallocBlock(size);
+  }
+  const std::size_t block_bytes =
+      kHeaderSize + (size + kSizeClassBytes - 1) / kSizeClassBytes *
+                        kSizeClassBytes;
+  if (static_cast<std::size_t>(state.arena_limit - state.arena_position) <
+      block_bytes) {
+    // Move on to the next chunk, reusing those from before the last
+    // ResetThreadArena().
+    ArenaChunk* next =
+        state.current_chunk ? state.current_chunk->next : state.first_chunk;
+    if (!next) {
+      next = static_cast<ArenaChunk*>(std::malloc(kArenaChunkBytes));
+      if (!next) {
+        return nullptr;
+      }
+      next->next = nullptr;
+      if (state.current_chunk) {
+        state.current_chunk->next = next;
+      } else {
+        state.first_chunk = next;
+      }
+    }
+    state.current_chunk = next;
+    state.arena_position = reinterpret_cast<char*>(next) + sizeof(ArenaChunk);
+    state.arena_limit = reinterpret_cast<char*>(next) + kArenaChunkBytes;
+  }
+  void* const memory = state.arena_position;
+  state.arena_position += block_bytes;
+  return MakeBlock(memory, kArenaBlock, 0);
+}
+
+void* Allocate(std::size_t size) {
+  ThreadState& state = GetThreadState();
+  ++state.counts.allocations;
+  state.counts.bytes += static_cast<int64_t>(size);
+  if (state.exited) {
+    return MallocBlock(size);
+  }
+  switch (state.strategy) {
+    case AllocationStrategy::kThreadPool:
+      return PoolBlock(state, size);
+    case AllocationStrategy::kArena:
+      return ArenaBlock(state, size);
+    case AllocationStrategy::kMalloc:
+      break;
+  }
+  return MallocBlock(size);
+}
+
+void* AllocateOrAbort(std::size_t size) {
+  void* const pointer = Allocate(size);
+  if (!pointer) {
+    std::abort();
+  }
+  return pointer;
+}
+
+void Deallocate(void* pointer) {
+  if (!pointer) {
+    return;
+  }
+  char* const memory = static_cast<char*>(pointer) - kHeaderSize;
+  const BlockHeader& header = *reinterpret_cast<const BlockHeader*>(memory);
+  switch (header.kind) {
+    case kMallocBlock:
+      std::free(memory);
+      return;
+    case kPoolBlock: {
+      ThreadState& state = GetThreadState();
+      const uint32_t size_class = header.size_class;
+      if (state.exited ||
+          state.free_counts[size_class] >= kMaxCachedBlocksPerClass) {
+        std::free(memory);
+        return;
+      }
+      auto* const block = static_cast<FreeBlock*>(pointer);
+      block->next = state.free_lists[size_class];
+      state.free_lists[size_class] = block;
+      ++state.free_counts[size_class];
+      return;
+    }
+    case kArenaBlock:
+      return;  // Reclaimed by ResetThreadArena().
+  }
+}
+
+}  // namespace
+
+const char* GetAllocationStrategyName(AllocationStrategy strategy) {
+  switch (strategy) {
+    case AllocationStrategy::kMalloc:
+      return "Malloc";
+    case AllocationStrategy::kThreadPool:
+      return "ThreadPool";
+    case AllocationStrategy::kArena:
+      return "Arena";
+  }
+  return "Unknown";
+}
+
+void SetThreadAllocationStrategy(AllocationStrategy strategy) {
+  GetThreadState().strategy = strategy;
+}
+
+AllocationCounts GetThreadAllocationCounts() {
+  return thread_state.counts;
+}
+
+void ResetThreadArena() {
+  ThreadState& state = thread_state;
+  state.current_chunk = nullptr;
+  state.arena_position = state.arena_limit = nullptr;
+}
+
+}  // namespace pb::benchmark
+
+// Exceptions are disabled, and so the throwing forms abort instead of throwing
+// std::bad_alloc.
+void* operator new(std::size_t size) {
+  return pb::benchmark::AllocateOrAbort(size);
+}
+
+void* operator new[](std::size_t size) {
+  return pb::benchmark::AllocateOrAbort(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return pb::benchmark::Allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return pb::benchmark::Allocate(size);
+}
+
+void operator delete(void* pointer) noexcept {
+  pb::benchmark::Deallocate(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  pb::benchmark::Deallocate(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+  pb::benchmark::Deallocate(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+  pb::benchmark::Deallocate(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+  pb::benchmark::Deallocate(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+  pb::benchmark::Deallocate(pointer);
+}
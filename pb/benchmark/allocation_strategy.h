@@ -0,0 +1,55 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstdint>
+
+namespace pb::benchmark {
+
+// Linking allocation_strategy.cc into a program replaces the global operator
+// new and operator delete with ones that count each thread's allocations, and
+// that take their memory from one of the following strategies. This affects
+// every allocation in the program (std::string, std::vector, std::make_unique,
+// etc.), and so it is only linked into protobuf_scalability_benchmark.
+enum class AllocationStrategy {
+  // Straight to malloc() and free(): the baseline.
+  kMalloc,
+
+  // Each thread keeps a cache of freed blocks, by size class, and reuses them
+  // without taking any lock. Blocks freed by another thread join that thread's
+  // cache.
+  kThreadPool,
+
+  // Each thread bump-allocates from its own chunks, deletes do nothing, and
+  // the chunks are rewound by ResetThreadArena() once everything allocated
+  // from them is dead (e.g., after each batch of messages).
+  kArena,
+};
+
+inline constexpr AllocationStrategy kAllAllocationStrategies[] = {
+    AllocationStrategy::kMalloc, AllocationStrategy::kThreadPool,
+    AllocationStrategy::kArena};
+
+[[nodiscard]] const char* GetAllocationStrategyName(
+    AllocationStrategy strategy);
+
+// Selects the strategy for the calling thread's allocations from now on (the
+// default is kMalloc). Memory that was allocated with another strategy, or by
+// another thread, is still freed correctly.
+void SetThreadAllocationStrategy(AllocationStrategy strategy);
+
+// The number of allocations, and their total size, made by the calling thread
+// since it started.
+struct AllocationCounts {
+  int64_t allocations = 0;
+  int64_t bytes = 0;
+};
+[[nodiscard]] AllocationCounts GetThreadAllocationCounts();
+
+// Rewinds the calling thread's arena chunks, for reuse by later allocations.
+// Everything the thread allocated under the kArena strategy must be dead.
+void ResetThreadArena();
+
+}  // namespace pb::benchmark
@@ -0,0 +1,126 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/benchmark/benchmark.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+namespace pb::benchmark {
+
+double Result::NanosecondsPerIteration() const {
+  return (iterations > 0) ? (seconds * 1e9 / static_cast<double>(iterations))
+                          : 0.0;
+}
+
+double Result::MegabytesPerSecond() const {
+  return (seconds > 0.0)
+             ? (static_cast<double>(bytes_per_iteration) *
+                static_cast<double>(iterations) / seconds / (1 << 20))
+             : 0.0;
+}
+
+Runner::Runner(int argc, char* argv[]) {
+  constexpr std::string_view kFilterFlag = "--filter=";
+  constexpr std::string_view kMinTimeFlag = "--min_time=";
+  constexpr std::string_view kPerfCountersFlag = "--perf_counters";
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg.substr(0, kFilterFlag.size()) == kFilterFlag) {
+      filter_ = std::string(arg.substr(kFilterFlag.size()));
+    } else if (arg.substr(0, kMinTimeFlag.size()) == kMinTimeFlag) {
+      min_seconds_ = std::atof(argv[i] + kMinTimeFlag.size());
+    } else if (arg == kPerfCountersFlag) {
+      std::string error;
+      perf_counters_ = PerfCounters::Open(error);
+      if (!perf_counters_) {
+        std::fprintf(stderr, "Not reading performance counters: %s\n",
+                     error.c_str());
+      }
+    } else {
+      std::fprintf(stderr, "Ignoring unknown argument: %s\n", argv[i]);
+    }
+  }
+
+  std::printf("%-56s %14s %12s\n", "Benchmark", "ns/iteration", "MB/s");
+}
+
+void Runner::ReportSpeedup(const std::optional<Result>& baseline,
+                           const std::optional<Result>& candidate) const {
+  if (!baseline || !candidate || candidate->NanosecondsPerIteration() <= 0.0) {
+    return;
+  }
+  std::printf("  -> %s is %.2fx the speed of %s\n", candidate->name.c_str(),
+              baseline->NanosecondsPerIteration() /
+                  candidate->NanosecondsPerIteration(),
+              baseline->name.c_str());
+}
+
+bool Runner::IsIncluded(std::string_view name) const {
+  return name.find(filter_) != std::string_view::npos;
+}
+
+int64_t Runner::NextIterationCount(const Result& last_run) const {
+  // Aim for 20% more than the minimum time, but never grow by more than 10x
+  // from one attempt to the next (since the last run may have been too short
+  // to measure meaningfully).
+  const double target =
+      (last_run.seconds > 0.0)
+          ? (static_cast<double>(last_run.iterations) * 1.2 * min_seconds_ /
+             last_run.seconds)
+          : static_cast<double>(last_run.iterations) * 10.0;
+  return std::clamp(static_cast<int64_t>(target), last_run.iterations + 1,
+                    last_run.iterations * 10);
+}
+
+void Runner::Print(const Result& result) const {
+  if (result.bytes_per_iteration > 0) {
+    std::printf("%-56s %14.1f %12.1f\n", result.name.c_str(),
+                result.NanosecondsPerIteration(), result.MegabytesPerSecond());
+  } else {
+    std::printf("%-56s %14.1f %12s\n", result.name.c_str(),
+                result.NanosecondsPerIteration(), "-");
+  }
+  if (result.counters) {
+    PrintCounters(result);
+  }
+  std::fflush(stdout);
+}
+
+void Runner::PrintCounters(const Result& result) const {
+  const PerfCounters::Values& counters = *result.counters;
+  std::string line = "  ->";
+  char buffer[64];
+  const int64_t cycles = counters[PerfCounters::kCycles];
+  const int64_t instructions = counters[PerfCounters::kInstructions];
+  if (cycles > 0 && instructions >= 0) {
+    std::snprintf(buffer, sizeof(buffer), " IPC %.2f;",
+                  static_cast<double>(instructions) /
+                      static_cast<double>(cycles));
+    line += buffer;
+  }
+  const bool per_byte = result.bytes_per_iteration > 0;
+  const double divisor =
+      static_cast<double>(result.iterations) *
+      static_cast<double>(per_byte ? result.bytes_per_iteration : 1);
+  line += per_byte ? " per byte:" : " per iteration:";
+  const char* separator = " ";
+  for (int i = 0; i < PerfCounters::kCounterCount; ++i) {
+    const auto counter = static_cast<PerfCounters::Counter>(i);
+    if (counters[counter] < 0) {
+      continue;  // Not available.
+    }
+    std::snprintf(buffer, sizeof(buffer), "%s%.4g %s", separator,
+                  static_cast<double>(counters[counter]) / divisor,
+                  PerfCounters::GetName(counter));
+    line += buffer;
+    separator = ", ";
+  }
+  std::printf("%s\n", line.c_str());
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,112 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "pb/benchmark/perf_counters.h"
+
+namespace pb::benchmark {
+
+// Prevents the compiler from optimizing-away the computation of |value|, or
+// from assuming anything about what is in memory afterwards.
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+// The outcome of running one benchmark case.
+struct Result {
+  std::string name;
+  int64_t iterations = 0;
+  double seconds = 0.0;
+
+  // The number of input/output bytes processed by each iteration, or zero if
+  // not applicable.
+  int64_t bytes_per_iteration = 0;
+
+  // The hardware performance counters, totalled over all iterations, if the
+  // --perf_counters option was given and they could be read.
+  std::optional<PerfCounters::Values> counters = std::nullopt;
+
+  [[nodiscard]] double NanosecondsPerIteration() const;
+  [[nodiscard]] double MegabytesPerSecond() const;
+};
+
+// Runs benchmark cases, and prints their results to standard-out. Command-line
+// options:
+//
+//   --filter=SUBSTRING: Only run the cases having SUBSTRING in their name.
+//   --min_time=SECONDS: Run each case for at least this long (default: 0.5).
+//   --perf_counters: Also count CPU cycles, instructions, branch misses and
+//       cache misses (see perf_counters.h), and print IPC and the counts per
+//       byte (or per iteration, if there are no bytes).
+class Runner {
+ public:
+  Runner(int argc, char* argv[]);
+
+  // Runs |function| repeatedly, until the minimum run time has been reached,
+  // and then prints and returns the Result. Returns std::nullopt if the case
+  // was excluded by the --filter option.
+  template <typename Function>
+  std::optional<Result> Run(std::string_view name,
+                            int64_t bytes_per_iteration,
+                            Function&& function) {
+    if (!IsIncluded(name)) {
+      return std::nullopt;
+    }
+
+    Result result{.name = std::string(name),
+                  .bytes_per_iteration = bytes_per_iteration};
+    // Start with one iteration, and keep increasing the number of iterations
+    // until the run is long enough to measure precisely.
+    for (int64_t iterations = 1;;) {
+      if (perf_counters_) {
+        perf_counters_->Start();
+      }
+      const auto start_time = Clock::now();
+      for (int64_t i = 0; i < iterations; ++i) {
+        function();
+      }
+      const std::chrono::duration<double> elapsed = Clock::now() - start_time;
+      if (perf_counters_) {
+        result.counters = perf_counters_->Stop();
+      }
+      result.iterations = iterations;
+      result.seconds = elapsed.count();
+      if (result.seconds >= min_seconds_) {
+        break;
+      }
+      iterations = NextIterationCount(result);
+    }
+
+    Print(result);
+    return result;
+  }
+
+  // Prints how much faster |candidate| was than |baseline|. Does nothing if
+  // either was not run.
+  void ReportSpeedup(const std::optional<Result>& baseline,
+                     const std::optional<Result>& candidate) const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  [[nodiscard]] bool IsIncluded(std::string_view name) const;
+  [[nodiscard]] int64_t NextIterationCount(const Result& last_run) const;
+  void Print(const Result& result) const;
+  void PrintCounters(const Result& result) const;
+
+  std::string filter_;
+  double min_seconds_ = 0.5;
+  std::unique_ptr<PerfCounters> perf_counters_;
+};
+
+}  // namespace pb::benchmark
@@ -0,0 +1,26 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/suites.h"
+
+int main(int argc, char* argv[]) {
+  pb::benchmark::Runner runner(argc, argv);
+  pb::benchmark::RunParseBenchmarks(runner);
+  pb::benchmark::RunPackedFixedViewBenchmarks(runner);
+  pb::benchmark::RunSerializeBenchmarks(runner);
+  pb::benchmark::RunDynamicMessageBenchmarks(runner);
+  pb::benchmark::RunWireCompactorBenchmarks(runner);
+  pb::benchmark::RunImageBenchmarks(runner);
+  pb::benchmark::RunChecksumBenchmarks(runner);
+  pb::benchmark::RunMessageRegistryBenchmarks(runner);
+  pb::benchmark::RunJsonBenchmarks(runner);
+  pb::benchmark::RunSocketChannelBenchmarks(runner);
+  pb::benchmark::RunRecordFileBenchmarks(runner);
+  pb::benchmark::RunRecordWriterBenchmarks(runner);
+  pb::benchmark::RunRecordIndexBenchmarks(runner);
+  pb::benchmark::RunMessageStoreBenchmarks(runner);
+  pb::benchmark::RunMessageCompressionBenchmarks(runner);
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/checksum.h"
+#include "pb/codec/crc32c.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Returns a batch of |copies| times as many readings as MakeSensorBatch(), to
+// be larger than the CPU's caches.
+SensorBatch MakeLargeSensorBatch(int copies) {
+  SensorBatch batch;
+  const SensorBatch one = MakeSensorBatch();
+  for (int i = 0; i < copies; ++i) {
+    batch.readings.insert(batch.readings.end(), one.readings.begin(),
+                          one.readings.end());
+  }
+  return batch;
+}
+
+// Compares serializing and then checksumming the output in a second pass,
+// versus SerializeWithChecksum(); and likewise for verifying and then parsing,
+// versus MergeFromBufferVerified().
+template <typename Message>
+void CompareSeparateAndFusedChecksum(Runner& runner,
+                                     std::string_view name,
+                                     const Message& message) {
+  const auto size = pb::ComputeSerializedSize(message);
+  const auto byte_count = static_cast<int64_t>(size);
+  std::vector<uint8_t> buffer(static_cast<std::size_t>(size) +
+                              pb::kChecksumTrailerSize);
+
+  const auto separate_serialize = runner.Run(
+      std::string(name) + "/Serialize+Crc32c", byte_count, [&] {
+        pb::Serialize(message, buffer.data());
+        const uint32_t crc =
+            codec::ComputeCrc32c(buffer.data(), buffer.data() + size);
+        DoNotOptimize(crc);
+        DoNotOptimize(buffer);
+      });
+  const auto fused_serialize = runner.Run(
+      std::string(name) + "/SerializeWithChecksum", byte_count, [&] {
+        const uint32_t crc = pb::SerializeWithChecksum(message, buffer.data());
+        DoNotOptimize(crc);
+        DoNotOptimize(buffer);
+      });
+  runner.ReportSpeedup(separate_serialize, fused_serialize);
+
+  pb::SerializeWithChecksum(message, buffer.data());
+  const auto* const begin = buffer.data();
+  const auto* const end = begin + buffer.size();
+  const auto separate_parse = runner.Run(
+      std::string(name) + "/Crc32c+MergeFromBuffer", byte_count, [&] {
+        const uint32_t crc = codec::ComputeCrc32c(begin, begin + size);
+        Message parsed;
+        const bool success =
+            pb::MergeFromBuffer(begin, end - pb::kChecksumTrailerSize, parsed);
+        DoNotOptimize(crc);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  const auto fused_parse = runner.Run(
+      std::string(name) + "/MergeFromBufferVerified", byte_count, [&] {
+        Message parsed;
+        const bool success = pb::MergeFromBufferVerified(begin, end, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  runner.ReportSpeedup(separate_parse, fused_parse);
+}
+
+}  // namespace
+
+void RunChecksumBenchmarks(Runner& runner) {
+  CompareSeparateAndFusedChecksum(runner, "Checksum/VarintHeavy",
+                                  MakeSensorBatch());
+  CompareSeparateAndFusedChecksum(runner, "Checksum/VarintHeavyLarge",
+                                  MakeLargeSensorBatch(256));
+  CompareSeparateAndFusedChecksum(runner, "Checksum/Mixed", MakeAddressBook());
+}
+
+}  // namespace pb::benchmark
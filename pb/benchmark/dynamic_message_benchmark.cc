@@ -0,0 +1,77 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/dynamic_message.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Compares the template codec on a struct-based |Message| against the
+// table-driven codec on an equivalent DynamicMessage, for the same wire bytes.
+template <typename Message>
+void CompareStructAndDynamic(Runner& runner,
+                             std::string_view name,
+                             const Message& message) {
+  std::vector<uint8_t> wire_bytes(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(message)));
+  pb::Serialize(message, wire_bytes.data());
+  const auto* const begin = wire_bytes.data();
+  const auto* const end = begin + wire_bytes.size();
+  const auto byte_count = static_cast<int64_t>(wire_bytes.size());
+  const auto schema = pb::MakeDynamicSchema<Message>();
+
+  const auto struct_parse =
+      runner.Run(std::string(name) + "/Parse/struct", byte_count, [&] {
+        Message parsed;
+        const bool success = pb::MergeFromBuffer(begin, end, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  const auto dynamic_parse =
+      runner.Run(std::string(name) + "/Parse/DynamicMessage", byte_count, [&] {
+        pb::DynamicMessage parsed(schema);
+        const bool success = pb::MergeFromBuffer(begin, end, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  runner.ReportSpeedup(struct_parse, dynamic_parse);
+
+  pb::DynamicMessage dynamic(schema);
+  if (!pb::MergeFromBuffer(begin, end, dynamic)) {
+    return;
+  }
+  std::vector<uint8_t> output(wire_bytes.size());
+  const auto struct_serialize =
+      runner.Run(std::string(name) + "/Serialize/struct", byte_count, [&] {
+        pb::Serialize(message, output.data());
+        DoNotOptimize(output.data());
+      });
+  const auto dynamic_serialize = runner.Run(
+      std::string(name) + "/Serialize/DynamicMessage", byte_count, [&] {
+        pb::Serialize(dynamic, output.data());
+        DoNotOptimize(output.data());
+      });
+  runner.ReportSpeedup(struct_serialize, dynamic_serialize);
+}
+
+}  // namespace
+
+void RunDynamicMessageBenchmarks(Runner& runner) {
+  CompareStructAndDynamic(runner, "DynamicMessage/SensorBatch",
+                          MakeSensorBatch());
+  CompareStructAndDynamic(runner, "DynamicMessage/AddressBook",
+                          MakeAddressBook());
+}
+
+}  // namespace pb::benchmark
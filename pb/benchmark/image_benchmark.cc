@@ -0,0 +1,195 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/image.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// The same work done with each form of the address book: the total balance of
+// everyone, and the total length of their names.
+struct Totals {
+  double balance = 0.0;
+  std::size_t name_bytes = 0;
+};
+
+Totals SumOver(const AddressBook& book) {
+  Totals totals;
+  for (const Person& person : book.people) {
+    totals.balance += person.balance;
+    totals.name_bytes += person.name.size();
+  }
+  return totals;
+}
+
+Totals SumOver(const Image<AddressBook>& book) {
+  Totals totals;
+  for (const Image<Person> person : book.Get<&AddressBook::people>()) {
+    totals.balance += person.Get<&Person::balance>();
+    totals.name_bytes += person.Get<&Person::name>().size();
+  }
+  return totals;
+}
+
+// A read-only memory mapping of a temporary file holding |bytes|, as another
+// process would load a cache file.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::vector<uint8_t>& bytes) : size_(bytes.size()) {
+    char path[] = "/var/tmp/pb_image_benchmark_XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+      return;
+    }
+    unlink(path);
+    if (write(fd, bytes.data(), size_) == static_cast<ssize_t>(size_)) {
+      void* const mapped = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data_ = static_cast<const uint8_t*>(mapped);
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if (data_) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  const uint8_t* begin() const { return data_; }
+  const uint8_t* end() const { return data_ + size_; }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  std::size_t size_;
+};
+
+}  // namespace
+
+void RunImageBenchmarks(Runner& runner) {
+  const AddressBook book = MakeAddressBook();
+  std::vector<uint8_t> wire_bytes(
+      static_cast<std::size_t>(ComputeSerializedSize(book)));
+  Serialize(book, wire_bytes.data());
+  std::vector<uint8_t> image_bytes;
+  if (!WriteImage(book, image_bytes)) {
+    return;
+  }
+  const MappedFile wire_file(wire_bytes);
+  const MappedFile image_file(image_bytes);
+  if (!wire_file.begin() || !image_file.begin()) {
+    return;
+  }
+  const auto wire_size = static_cast<int64_t>(wire_bytes.size());
+  const auto image_size = static_cast<int64_t>(image_bytes.size());
+
+  // Writing: serializing, versus writing an image.
+  std::vector<uint8_t> buffer;
+  const auto serialized = runner.Run("Image/Write/Serialize", wire_size, [&] {
+    buffer.resize(static_cast<std::size_t>(ComputeSerializedSize(book)));
+    Serialize(book, buffer.data());
+    DoNotOptimize(buffer.data());
+  });
+  const auto written = runner.Run("Image/Write/WriteImage", image_size, [&] {
+    DoNotOptimize(WriteImage(book, buffer));
+  });
+  runner.ReportSpeedup(serialized, written);
+
+  // Loading a cache file, then summing over it: by parsing it into structs,
+  // versus reading the image in-place (with and without checking the bounds of
+  // its strings and repeated fields first).
+  const auto parse_and_sum = [&] {
+    AddressBook loaded;
+    if (MergeFromBuffer(wire_file.begin(), wire_file.end(), loaded)) {
+      DoNotOptimize(SumOver(loaded));
+    }
+  };
+  const auto parsed =
+      runner.Run("Image/LoadAndSum/MergeFromBuffer", wire_size, parse_and_sum);
+  const auto opened = runner.Run("Image/LoadAndSum/Open", image_size, [&] {
+    const auto image =
+        Image<AddressBook>::Open(image_file.begin(), image_file.end());
+    if (image) {
+      DoNotOptimize(SumOver(*image));
+    }
+  });
+  runner.ReportSpeedup(parsed, opened);
+  const auto trusted =
+      runner.Run("Image/LoadAndSum/OpenTrusted", image_size, [&] {
+        const auto image = Image<AddressBook>::OpenTrusted(image_file.begin(),
+                                                           image_file.end());
+        if (image) {
+          DoNotOptimize(SumOver(*image));
+        }
+      });
+  runner.ReportSpeedup(parsed, trusted);
+
+  // Loading a cache file, then reading one field of one person.
+  const auto parsed_one =
+      runner.Run("Image/LoadOne/MergeFromBuffer", wire_size, [&] {
+        AddressBook loaded;
+        if (MergeFromBuffer(wire_file.begin(), wire_file.end(), loaded)) {
+          DoNotOptimize(loaded.people[500].balance);
+        }
+      });
+  const auto trusted_one =
+      runner.Run("Image/LoadOne/OpenTrusted", image_size, [&] {
+        const auto image = Image<AddressBook>::OpenTrusted(image_file.begin(),
+                                                           image_file.end());
+        if (image) {
+          const auto people = image->Get<&AddressBook::people>();
+          DoNotOptimize(people[500].Get<&Person::balance>());
+        }
+      });
+  runner.ReportSpeedup(parsed_one, trusted_one);
+
+  const auto image =
+      Image<AddressBook>::OpenTrusted(image_file.begin(), image_file.end());
+  if (!image) {
+    return;
+  }
+
+  // Summing over structs that are already loaded, versus over the image.
+  const auto structs = runner.Run("Image/Sum/Structs", wire_size,
+                                  [&] { DoNotOptimize(SumOver(book)); });
+  const auto in_place = runner.Run("Image/Sum/Image", image_size,
+                                   [&] { DoNotOptimize(SumOver(*image)); });
+  runner.ReportSpeedup(structs, in_place);
+
+  // Converting into structs: by parsing, versus merging from the image.
+  const auto converted =
+      runner.Run("Image/ToStructs/MergeFromBuffer", wire_size, [&] {
+        AddressBook loaded;
+        DoNotOptimize(
+            MergeFromBuffer(wire_file.begin(), wire_file.end(), loaded));
+        DoNotOptimize(loaded);
+      });
+  const auto merged = runner.Run("Image/ToStructs/MergeInto", image_size, [&] {
+    AddressBook loaded;
+    image->MergeInto(loaded);
+    DoNotOptimize(loaded);
+  });
+  runner.ReportSpeedup(converted, merged);
+  if (converted) {
+    std::printf("  -> %zu people: %lld bytes serialized, %lld as an image\n",
+                book.people.size(), static_cast<long long>(wire_size),
+                static_cast<long long>(image_size));
+  }
+}
+
+}  // namespace pb::benchmark
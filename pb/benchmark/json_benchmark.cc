@@ -0,0 +1,77 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/json.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Compares JSON transcoding against the wire format, in both directions, for
+// the same |message|. Throughput is reported in terms of each format's own
+// encoded size, so the speed-up figures are per message.
+template <typename Message>
+void CompareWireFormatAndJson(Runner& runner,
+                              std::string_view name,
+                              const Message& message) {
+  std::vector<uint8_t> wire_bytes(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(message)));
+  pb::Serialize(message, wire_bytes.data());
+  std::string json;
+  if (!pb::ToJson(message, json)) {
+    return;
+  }
+  const auto wire_byte_count = static_cast<int64_t>(wire_bytes.size());
+  const auto json_byte_count = static_cast<int64_t>(json.size());
+
+  std::vector<uint8_t> wire_output(wire_bytes.size());
+  const auto wire_serialize = runner.Run(
+      std::string(name) + "/Serialize/WireFormat", wire_byte_count, [&] {
+        pb::Serialize(message, wire_output.data());
+        DoNotOptimize(wire_output.data());
+      });
+  std::string json_output;
+  const auto json_serialize = runner.Run(
+      std::string(name) + "/Serialize/Json", json_byte_count, [&] {
+        const bool success = pb::ToJson(message, json_output);
+        DoNotOptimize(success);
+        DoNotOptimize(json_output.data());
+      });
+  runner.ReportSpeedup(wire_serialize, json_serialize);
+
+  const auto wire_parse = runner.Run(
+      std::string(name) + "/Parse/WireFormat", wire_byte_count, [&] {
+        Message parsed;
+        const bool success = pb::MergeFromBuffer(
+            wire_bytes.data(), wire_bytes.data() + wire_bytes.size(), parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  const auto json_parse = runner.Run(
+      std::string(name) + "/Parse/Json", json_byte_count, [&] {
+        Message parsed;
+        const bool success = pb::FromJson(json, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  runner.ReportSpeedup(wire_parse, json_parse);
+}
+
+}  // namespace
+
+void RunJsonBenchmarks(Runner& runner) {
+  CompareWireFormatAndJson(runner, "Json/VarintHeavy", MakeSensorBatch());
+  CompareWireFormatAndJson(runner, "Json/Mixed", MakeAddressBook());
+}
+
+}  // namespace pb::benchmark
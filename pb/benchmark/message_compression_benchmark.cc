@@ -0,0 +1,117 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/parse.h"
+#include "pb/record/message_compression.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Each Person is compressed on its own, as if it were a row in a key-value
+// store or a message on the wire.
+struct Compressed {
+  std::vector<std::vector<uint8_t>> messages;
+  std::size_t total_bytes = 0;
+};
+
+Compressed CompressEach(const std::vector<Person>& people,
+                        const LzDictionary& dictionary) {
+  Compressed compressed;
+  for (const Person& person : people) {
+    std::vector<uint8_t> bytes;
+    if (!CompressMessage(person, dictionary, bytes)) {
+      return Compressed();
+    }
+    compressed.total_bytes += bytes.size();
+    compressed.messages.push_back(std::move(bytes));
+  }
+  return compressed;
+}
+
+}  // namespace
+
+void RunMessageCompressionBenchmarks(Runner& runner) {
+  // Train on the first half of the people, and compress the second half.
+  const AddressBook book = MakeAddressBook();
+  const auto half = static_cast<std::ptrdiff_t>(book.people.size() / 2);
+  const std::vector<Person> training(book.people.begin(),
+                                     book.people.begin() + half);
+  const std::vector<Person> people(book.people.begin() + half,
+                                   book.people.end());
+
+  std::vector<std::vector<uint8_t>> serialized;
+  std::vector<BufferRange> samples;
+  for (const Person& person : training) {
+    std::vector<uint8_t> bytes(
+        static_cast<std::size_t>(ComputeSerializedSize(person)));
+    Serialize(person, bytes.data());
+    serialized.push_back(std::move(bytes));
+  }
+  for (const std::vector<uint8_t>& bytes : serialized) {
+    samples.push_back(BufferRange{bytes.data(), bytes.data() + bytes.size()});
+  }
+  const LzDictionary dictionary =
+      TrainLzDictionary(samples, LzDictionaryTrainingOptions());
+  const LzDictionary no_dictionary({});
+
+  int64_t raw_bytes = 0;
+  for (const Person& person : people) {
+    raw_bytes += ComputeSerializedSize(person);
+  }
+
+  // Compressing each message, without and with the trained dictionary.
+  std::vector<uint8_t> output;
+  const auto compress = [&](const LzDictionary& against) {
+    output.clear();
+    for (const Person& person : people) {
+      DoNotOptimize(CompressMessage(person, against, output));
+    }
+    DoNotOptimize(output.data());
+  };
+  const auto plain = runner.Run("MessageCompression/Compress/NoDictionary",
+                                raw_bytes, [&] { compress(no_dictionary); });
+  const auto trained = runner.Run("MessageCompression/Compress/Dictionary",
+                                  raw_bytes, [&] { compress(dictionary); });
+  runner.ReportSpeedup(plain, trained);
+
+  const Compressed without = CompressEach(people, no_dictionary);
+  const Compressed with = CompressEach(people, dictionary);
+  if (plain || trained) {
+    std::printf(
+        "  -> %zu people, %lld bytes serialized: %zu bytes compressed "
+        "without a dictionary, %zu with one (of %zu bytes)\n",
+        people.size(), static_cast<long long>(raw_bytes), without.total_bytes,
+        with.total_bytes, dictionary.bytes().size());
+  }
+
+  // Decompressing and parsing each message.
+  const auto decompress = [&](const Compressed& compressed,
+                              const LzDictionary& against) {
+    int parsed = 0;
+    for (const std::vector<uint8_t>& bytes : compressed.messages) {
+      Person person;
+      parsed += DecompressMessage(bytes.data(), bytes.data() + bytes.size(),
+                                  against, person);
+      DoNotOptimize(person);
+    }
+    DoNotOptimize(parsed);
+  };
+  const auto plain_parse =
+      runner.Run("MessageCompression/DecompressAndParse/NoDictionary",
+                 raw_bytes, [&] { decompress(without, no_dictionary); });
+  const auto trained_parse =
+      runner.Run("MessageCompression/DecompressAndParse/Dictionary", raw_bytes,
+                 [&] { decompress(with, dictionary); });
+  runner.ReportSpeedup(plain_parse, trained_parse);
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,117 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/message_registry.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+enum TypeId : uint32_t {
+  kSensorReadingId = 1,
+  kPersonId = 2,
+  kPhoneNumberId = 3,
+};
+
+using SampleProtocol =
+    pb::MessageTypeList<pb::MessageType<SensorReading, kSensorReadingId>,
+                        pb::MessageType<Person, kPersonId>,
+                        pb::MessageType<Person::PhoneNumber, kPhoneNumberId>>;
+
+struct Frame {
+  uint32_t type_id;
+  std::vector<uint8_t> wire_bytes;
+};
+
+template <typename Message>
+Frame MakeFrame(uint32_t type_id, const Message& message) {
+  Frame frame{type_id, std::vector<uint8_t>(static_cast<std::size_t>(
+                           pb::ComputeSerializedSize(message)))};
+  pb::Serialize(message, frame.wire_bytes.data());
+  return frame;
+}
+
+// An interleaving of small messages of different types, as would be seen on a
+// multiplexed connection.
+std::vector<Frame> MakeFrames() {
+  const SensorBatch batch = MakeSensorBatch();
+  const AddressBook book = MakeAddressBook();
+  std::vector<Frame> frames;
+  for (std::size_t i = 0; i < 1000; ++i) {
+    frames.push_back(MakeFrame(kSensorReadingId,
+                               batch.readings[i % batch.readings.size()]));
+    const Person& person = book.people[i % book.people.size()];
+    frames.push_back(MakeFrame(kPersonId, person));
+    for (const Person::PhoneNumber& phone : person.phones) {
+      frames.push_back(MakeFrame(kPhoneNumberId, phone));
+    }
+  }
+  return frames;
+}
+
+// The hand-written alternative: A switch, with every codec instantiated
+// inline, and a fresh heap allocation for each message.
+template <typename Message>
+bool ParseAndDiscard(const Frame& frame) {
+  auto message = std::make_unique<Message>();
+  const bool success =
+      pb::MergeFromBuffer(frame.wire_bytes.data(),
+                          frame.wire_bytes.data() + frame.wire_bytes.size(),
+                          *message);
+  DoNotOptimize(message);
+  return success;
+}
+
+bool DispatchWithSwitch(const Frame& frame) {
+  switch (frame.type_id) {
+    case kSensorReadingId:
+      return ParseAndDiscard<SensorReading>(frame);
+    case kPersonId:
+      return ParseAndDiscard<Person>(frame);
+    case kPhoneNumberId:
+      return ParseAndDiscard<Person::PhoneNumber>(frame);
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+void RunMessageRegistryBenchmarks(Runner& runner) {
+  const std::vector<Frame> frames = MakeFrames();
+  int64_t byte_count = 0;
+  for (const Frame& frame : frames) {
+    byte_count += static_cast<int64_t>(frame.wire_bytes.size());
+  }
+
+  const auto with_switch =
+      runner.Run("MessageRegistry/Dispatch/SwitchAndNew", byte_count, [&] {
+        for (const Frame& frame : frames) {
+          DoNotOptimize(DispatchWithSwitch(frame));
+        }
+      });
+  // The registry reuses pooled instances, which keep the buffers of their
+  // strings and containers from one message to the next.
+  pb::MessageRegistry registry(SampleProtocol{});
+  const auto with_registry =
+      runner.Run("MessageRegistry/Dispatch/ParseNew", byte_count, [&] {
+        for (const Frame& frame : frames) {
+          pb::MessageRegistry::Handle message = registry.ParseNew(
+              frame.type_id, frame.wire_bytes.data(),
+              frame.wire_bytes.data() + frame.wire_bytes.size());
+          DoNotOptimize(message);
+        }
+      });
+  runner.ReportSpeedup(with_switch, with_registry);
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,190 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/record/message_store.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Each Person in the address book is stored this many times, with a unique id
+// each time.
+constexpr int kCopies = 64;
+
+// The number of updates or lookups in each benchmark iteration.
+constexpr int kOperationCount = 16;
+
+using PersonStore = MessageStore<int32_t, Person>;
+
+// A temporary directory on a local (not in-memory) filesystem, removed (with
+// its files) on destruction.
+class ScratchDirectory {
+ public:
+  ScratchDirectory() {
+    char path[] = "/var/tmp/pb_message_store_benchmark_XXXXXX";
+    if (mkdtemp(path)) {
+      path_ = path;
+    }
+  }
+  ~ScratchDirectory() {
+    if (path_.empty()) {
+      return;
+    }
+    if (DIR* const dir = opendir(path_.c_str())) {
+      while (const dirent* const entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name != "." && name != "..") {
+          unlink((path_ + "/" + name).c_str());
+        }
+      }
+      closedir(dir);
+    }
+    rmdir(path_.c_str());
+  }
+
+  const std::string& path() const { return path_; }
+
+ private:
+  std::string path_;
+};
+
+// Returns the id of the |i|-th Person updated or looked up.
+int32_t PickId(int i, int32_t person_count) {
+  return static_cast<int32_t>((int64_t{i} * 104729 + 17) % person_count);
+}
+
+}  // namespace
+
+void RunMessageStoreBenchmarks(Runner& runner) {
+  ScratchDirectory directory;
+  if (directory.path().empty()) {
+    return;
+  }
+  AddressBook book;
+  const AddressBook sample = MakeAddressBook();
+  for (int copy = 0; copy < kCopies; ++copy) {
+    for (Person person : sample.people) {
+      person.id = static_cast<int32_t>(book.people.size());
+      book.people.push_back(std::move(person));
+    }
+  }
+  const auto person_count = static_cast<int32_t>(book.people.size());
+
+  PersonStore::Options options;
+  options.background_compaction = false;
+  {
+    auto store = PersonStore::Open(directory.path(), options);
+    if (!store) {
+      return;
+    }
+    for (const Person& person : book.people) {
+      if (!store->Put(person.id, person)) {
+        return;
+      }
+    }
+  }
+
+  // Updating a few people: by re-serializing and rewriting the whole
+  // collection, versus appending one record per person.
+  const std::string collection_path = directory.path() + "/collection";
+  const int collection_fd =
+      open(collection_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (collection_fd < 0) {
+    return;
+  }
+  std::vector<uint8_t> buffer;
+  int update = 0;
+  const auto rewritten =
+      runner.Run("MessageStore/Update/RewriteCollection", 0, [&] {
+        for (int i = 0; i < kOperationCount; ++i) {
+          Person& person = book.people[static_cast<std::size_t>(
+              PickId(update++, person_count))];
+          person.balance += 1.0;
+        }
+        buffer.resize(static_cast<std::size_t>(ComputeSerializedSize(book)));
+        Serialize(book, buffer.data());
+        DoNotOptimize(pwrite(collection_fd, buffer.data(), buffer.size(), 0));
+      });
+  close(collection_fd);
+  unlink(collection_path.c_str());
+
+  auto store = PersonStore::Open(directory.path(), options);
+  if (!store) {
+    return;
+  }
+  const auto appended = runner.Run("MessageStore/Update/Put", 0, [&] {
+    for (int i = 0; i < kOperationCount; ++i) {
+      Person& person =
+          book.people[static_cast<std::size_t>(PickId(update++, person_count))];
+      person.balance += 1.0;
+      DoNotOptimize(store->Put(person.id, person));
+    }
+  });
+  runner.ReportSpeedup(rewritten, appended);
+
+  int lookup = 0;
+  runner.Run("MessageStore/Get", 0, [&] {
+    Person person;
+    int found = 0;
+    for (int i = 0; i < kOperationCount; ++i) {
+      found += store->Get(PickId(lookup++, person_count), person);
+    }
+    DoNotOptimize(found);
+  });
+
+  if (!store->Compact()) {
+    return;
+  }
+  const PersonStore::Stats stats = store->GetStats();
+  store.reset();
+
+  // Recovering the index, by scanning the segments with one thread, and with
+  // one per hardware thread. The updates above left many segments.
+  options.segment_bytes = 256 * 1024;
+  {
+    auto resegmented = PersonStore::Open(directory.path(), options);
+    if (!resegmented) {
+      return;
+    }
+    for (int copy = 0; copy < 4; ++copy) {
+      for (const Person& person : book.people) {
+        DoNotOptimize(resegmented->Put(person.id, person));
+      }
+    }
+  }
+  const auto recover = [&](int thread_count) {
+    options.recovery_threads = thread_count;
+    return runner.Run(
+        "MessageStore/Open/" + std::string(thread_count == 1
+                                               ? "OneThread"
+                                               : "AllThreads"),
+        0, [&] {
+          auto reopened = PersonStore::Open(directory.path(), options);
+          DoNotOptimize(reopened && reopened->size() == person_count);
+        });
+  };
+  const auto one_thread = recover(1);
+  const auto all_threads = recover(0);
+  if (one_thread) {
+    std::printf("  -> %d people: %lld live bytes after compaction\n",
+                person_count, static_cast<long long>(stats.live_record_bytes));
+  }
+  runner.ReportSpeedup(one_thread, all_threads);
+}
+
+}  // namespace pb::benchmark
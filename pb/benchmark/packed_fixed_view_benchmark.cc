@@ -0,0 +1,120 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/suites.h"
+#include "pb/field_list.h"
+#include "pb/packed_fixed_view.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// A large array of floats, such as an audio buffer or a tensor.
+struct Tensor {
+  std::vector<float> values;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&Tensor::values, 1>>;
+};
+
+struct TensorView {
+  pb::PackedFixedView<float> values;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&TensorView::values, 1>>;
+};
+
+std::vector<uint8_t> MakeTensorWireBytes(int element_count) {
+  Tensor tensor;
+  tensor.values.reserve(static_cast<std::size_t>(element_count));
+  for (int i = 0; i < element_count; ++i) {
+    tensor.values.push_back(static_cast<float>(i) * 0.25f);
+  }
+  std::vector<uint8_t> wire_bytes(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(tensor)));
+  pb::Serialize(tensor, wire_bytes.data());
+  return wire_bytes;
+}
+
+float Sum(const std::vector<float>& values) {
+  float sum = 0.0f;
+  for (float value : values) {
+    sum += value;
+  }
+  return sum;
+}
+
+float Sum(const pb::PackedFixedView<float>& values) {
+  float sum = 0.0f;
+  if (const float* aligned = values.aligned_data()) {
+    for (std::size_t i = 0; i < values.size(); ++i) {
+      sum += aligned[i];
+    }
+  } else {
+    for (float value : values) {
+      sum += value;
+    }
+  }
+  return sum;
+}
+
+// Compares parse-then-sum of a vector<float> field against a
+// PackedFixedView<float> field, and also serialization of each.
+void CompareVectorAndView(Runner& runner,
+                          std::string_view name,
+                          int element_count) {
+  const std::vector<uint8_t> wire_bytes = MakeTensorWireBytes(element_count);
+  const auto* const begin = wire_bytes.data();
+  const auto* const end = begin + wire_bytes.size();
+  const auto byte_count = static_cast<int64_t>(wire_bytes.size());
+
+  const auto vector_parse = runner.Run(
+      std::string(name) + "/ParseAndSum/vector", byte_count, [&] {
+        Tensor parsed;
+        const bool success = pb::MergeFromBuffer(begin, end, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(Sum(parsed.values));
+      });
+  const auto view_parse = runner.Run(
+      std::string(name) + "/ParseAndSum/PackedFixedView", byte_count, [&] {
+        TensorView parsed;
+        const bool success = pb::MergeFromBuffer(begin, end, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(Sum(parsed.values));
+      });
+  runner.ReportSpeedup(vector_parse, view_parse);
+
+  Tensor tensor;
+  TensorView tensor_view;
+  if (!pb::MergeFromBuffer(begin, end, tensor) ||
+      !pb::MergeFromBuffer(begin, end, tensor_view)) {
+    return;
+  }
+  std::vector<uint8_t> output(wire_bytes.size());
+  const auto vector_serialize = runner.Run(
+      std::string(name) + "/Serialize/vector", byte_count, [&] {
+        pb::Serialize(tensor, output.data());
+        DoNotOptimize(output.data());
+      });
+  const auto view_serialize = runner.Run(
+      std::string(name) + "/Serialize/PackedFixedView", byte_count, [&] {
+        pb::Serialize(tensor_view, output.data());
+        DoNotOptimize(output.data());
+      });
+  runner.ReportSpeedup(vector_serialize, view_serialize);
+}
+
+}  // namespace
+
+void RunPackedFixedViewBenchmarks(Runner& runner) {
+  CompareVectorAndView(runner, "PackedFixedView/1KiB", 256);
+  CompareVectorAndView(runner, "PackedFixedView/1MiB", 256 * 1024);
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,353 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/codec/parallel_varint.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/serialize.h"
+#include "pb/codec/zigzag.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Serializes |message| into a buffer that has kParseSlopBytes of padding at
+// the end. The returned vector's size() does not include the padding.
+template <typename Message>
+std::vector<uint8_t> SerializeWithPadding(const Message& message) {
+  const auto size = pb::ComputeSerializedSize(message);
+  std::vector<uint8_t> buffer(static_cast<std::size_t>(size) +
+                              pb::kParseSlopBytes);
+  pb::Serialize(message, buffer.data());
+  buffer.resize(static_cast<std::size_t>(size));  // Capacity is unchanged.
+  return buffer;
+}
+
+template <typename Message>
+void CompareExactAndPaddedParse(Runner& runner,
+                                std::string_view name,
+                                const Message& message) {
+  const std::vector<uint8_t> wire_bytes = SerializeWithPadding(message);
+  const auto* const begin = wire_bytes.data();
+  const auto* const end = begin + wire_bytes.size();
+  const auto byte_count = static_cast<int64_t>(wire_bytes.size());
+
+  const auto exact = runner.Run(
+      std::string(name) + "/MergeFromBuffer", byte_count, [&] {
+        Message parsed;
+        const bool success = pb::MergeFromBuffer(begin, end, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  const auto padded = runner.Run(
+      std::string(name) + "/MergeFromPaddedBuffer", byte_count, [&] {
+        Message parsed;
+        const bool success = pb::MergeFromPaddedBuffer(begin, end, parsed);
+        DoNotOptimize(success);
+        DoNotOptimize(parsed);
+      });
+  runner.ReportSpeedup(exact, padded);
+}
+
+// Compares decoding one huge packed sint64 field on one thread versus on as
+// many threads as pb::codec::ParsePackedRepeatedValues() would use.
+void CompareHugePackedVarintParse(Runner& runner) {
+  std::mt19937_64 random(1);
+  std::vector<uint8_t> payload;
+  for (int i = 0; i < (1 << 20); ++i) {
+    const auto value = static_cast<int64_t>(random()) >> (random() % 64);
+    uint8_t bytes[codec::kMaxVarintSize];
+    uint8_t* const end =
+        codec::SerializeValue(codec::EncodeZigZag(value), bytes);
+    payload.insert(payload.end(), bytes, end);
+  }
+  const auto* const begin = payload.data();
+  const auto* const end = begin + payload.size();
+  const auto byte_count = static_cast<int64_t>(payload.size());
+
+  const auto decode_with_chunks = [&](int chunk_count) {
+    std::vector<pb::sint64_t> values;
+    const bool success = codec::DecodeVarintChunksInParallel(
+        begin, end, chunk_count, values,
+        [](const uint8_t* chunk_begin, const uint8_t* chunk_end,
+           pb::sint64_t* output, int64_t count) {
+          return codec::ParseVarintChunk<codec::InputBounds::kExact>(
+              chunk_begin, chunk_end, output, count);
+        });
+    DoNotOptimize(success);
+    DoNotOptimize(values);
+  };
+  const auto one_thread =
+      runner.Run("Parse/HugePackedVarints/OneThread", byte_count,
+                 [&] { decode_with_chunks(1); });
+  const int chunk_count = codec::ComputeParallelVarintChunkCount(byte_count);
+  const auto parallel = runner.Run(
+      "Parse/HugePackedVarints/Parallel", byte_count,
+      [&] { decode_with_chunks(chunk_count); });
+  if (parallel) {
+    std::printf("  -> thread count: %d\n", chunk_count);
+  }
+  runner.ReportSpeedup(one_thread, parallel);
+}
+
+// A market-data quote: A tiny message of a fixed shape (see ParseBatch()).
+struct Quote {
+  uint32_t instrument;
+  pb::sint64_t price;
+  int64_t quantity;
+  pb::fixed64_t timestamp;
+  bool is_ask;
+  int32_t venue;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&Quote::instrument, 1>,
+                                       pb::Field<&Quote::price, 2>,
+                                       pb::Field<&Quote::quantity, 3>,
+                                       pb::Field<&Quote::timestamp, 4>,
+                                       pb::Field<&Quote::is_ask, 5>,
+                                       pb::Field<&Quote::venue, 6>>;
+};
+
+// Compares parsing a feed of tiny quotes one at a time versus in batches, for
+// both exact and padded buffers. The quotes are stored back-to-back in one
+// padded buffer, as they would be after reading them from a stream.
+void CompareTinyMessageBatchParse(Runner& runner) {
+  std::mt19937_64 random(1);
+  std::vector<uint8_t> feed;
+  std::vector<std::size_t> offsets = {0};
+  for (int i = 0; i < 100000; ++i) {
+    Quote quote{};
+    quote.instrument = static_cast<uint32_t>(random() % 5000);
+    quote.price = static_cast<int64_t>(random() % 2000000) - 1000000;
+    quote.quantity = static_cast<int64_t>(random() % 10000);
+    quote.timestamp = 1700000000000000000 + i * uint64_t{997};
+    quote.is_ask = random() % 2;
+    quote.venue = static_cast<int32_t>(random() % 20);
+    const auto size = pb::ComputeSerializedSize(quote);
+    feed.resize(feed.size() + static_cast<std::size_t>(size));
+    pb::Serialize(quote, feed.data() + offsets.back());
+    offsets.push_back(feed.size());
+  }
+  const auto byte_count = static_cast<int64_t>(feed.size());
+  feed.resize(feed.size() + pb::kParseSlopBytes);
+  std::vector<pb::BufferRange> ranges;
+  for (std::size_t i = 0; i + 1 < offsets.size(); ++i) {
+    ranges.push_back(pb::BufferRange{feed.data() + offsets[i],
+                                     feed.data() + offsets[i + 1]});
+  }
+
+  const auto one_at_a_time = runner.Run(
+      "Parse/TinyMessages/OneAtATime", byte_count, [&] {
+        std::vector<Quote> quotes(ranges.size());
+        bool success = true;
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+          success &= pb::MergeFromBuffer(ranges[i].begin, ranges[i].end,
+                                         quotes[i]);
+        }
+        DoNotOptimize(success);
+        DoNotOptimize(quotes);
+      });
+  const auto batch =
+      runner.Run("Parse/TinyMessages/Batch", byte_count, [&] {
+        std::vector<Quote> quotes;
+        const bool success =
+            pb::ParseBatch(ranges.data(), ranges.size(), quotes);
+        DoNotOptimize(success);
+        DoNotOptimize(quotes);
+      });
+  runner.ReportSpeedup(one_at_a_time, batch);
+
+  const auto padded_one_at_a_time = runner.Run(
+      "Parse/TinyMessages/PaddedOneAtATime", byte_count, [&] {
+        std::vector<Quote> quotes(ranges.size());
+        bool success = true;
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+          success &= pb::MergeFromPaddedBuffer(ranges[i].begin, ranges[i].end,
+                                               quotes[i]);
+        }
+        DoNotOptimize(success);
+        DoNotOptimize(quotes);
+      });
+  const auto padded_batch =
+      runner.Run("Parse/TinyMessages/PaddedBatch", byte_count, [&] {
+        std::vector<Quote> quotes;
+        const bool success =
+            pb::ParsePaddedBatch(ranges.data(), ranges.size(), quotes);
+        DoNotOptimize(success);
+        DoNotOptimize(quotes);
+      });
+  runner.ReportSpeedup(padded_one_at_a_time, padded_batch);
+}
+
+// A set that only supports adding its elements one at a time, as any set field
+// was parsed before pb::codec::BulkInsert(): It hides the member types that
+// kCanBulkInsert looks for.
+template <typename Set>
+class OneAtATimeSet {
+ public:
+  using value_type = typename Set::value_type;
+  using iterator = typename Set::iterator;
+  using const_iterator = typename Set::const_iterator;
+
+  iterator begin() { return set_.begin(); }
+  iterator end() { return set_.end(); }
+  const_iterator begin() const { return set_.begin(); }
+  const_iterator end() const { return set_.end(); }
+  std::size_t size() const { return set_.size(); }
+  iterator insert(const_iterator hint, value_type value) {
+    return set_.insert(hint, value);
+  }
+
+ private:
+  Set set_;
+};
+
+template <typename Ids>
+struct IdList {
+  Ids ids;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&IdList::ids, 1>>;
+};
+
+// Compares parsing a long list of ids, in random order and with some
+// duplicates, into set fields: one insert() at a time, versus decoding them
+// into a scratch buffer and adding them all at once. The ids are encoded both
+// packed and unpacked (one tag per id).
+void CompareSetFieldParse(Runner& runner) {
+  std::mt19937_64 random(1);
+  IdList<std::vector<uint64_t>> list;
+  for (int i = 0; i < 100000; ++i) {
+    list.ids.push_back(random() % 1000000);
+  }
+  std::vector<uint8_t> packed(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(list)));
+  pb::Serialize(list, packed.data());
+  std::vector<uint8_t> unpacked;
+  for (const uint64_t id : list.ids) {
+    uint8_t bytes[1 + codec::kMaxVarintSize] = {
+        codec::MakeTag(1, codec::WireType::kVarint)};
+    uint8_t* const end = codec::SerializeValue(id, bytes + 1);
+    unpacked.insert(unpacked.end(), bytes, end);
+  }
+
+  const auto compare = [&runner](const std::string& name,
+                                 const std::vector<uint8_t>& bytes,
+                                 auto one_at_a_time, auto bulk) {
+    const auto parse = [&bytes](auto& message) {
+      DoNotOptimize(
+          pb::MergeFromBuffer(bytes.data(), bytes.data() + bytes.size(),
+                              message));
+      DoNotOptimize(message.ids.size());
+    };
+    const auto size = static_cast<int64_t>(bytes.size());
+    const auto baseline = runner.Run(name + "/OneAtATime", size, [&] {
+      auto message = one_at_a_time;
+      parse(message);
+    });
+    const auto bulk_insert = runner.Run(name + "/BulkInsert", size, [&] {
+      auto message = bulk;
+      parse(message);
+    });
+    runner.ReportSpeedup(baseline, bulk_insert);
+  };
+  using Set = std::set<uint64_t>;
+  using HashSet = std::unordered_set<uint64_t>;
+  compare("Parse/SetField/PackedSet", packed, IdList<OneAtATimeSet<Set>>{},
+          IdList<Set>{});
+  compare("Parse/SetField/PackedHashSet", packed,
+          IdList<OneAtATimeSet<HashSet>>{}, IdList<HashSet>{});
+  compare("Parse/SetField/UnpackedSet", unpacked,
+          IdList<OneAtATimeSet<Set>>{}, IdList<Set>{});
+}
+
+// Compares two ways of merging untrusted updates into a long-lived address
+// book, such that a failed parse leaves it unchanged: backing-up a copy of the
+// whole book first, versus TryMergeFromBuffer(). Also compares a full parse
+// with TryMergeFromBuffer() against MergeFromBuffer(), to show the cost of the
+// scan that records the undo log.
+void CompareTransactionalMerge(Runner& runner) {
+  AddressBook book = MakeAddressBook();
+  AddressBook update;
+  update.people.resize(1);
+  update.people[0] = book.people[0];
+  update.people[0].name = "Someone New";
+  std::vector<uint8_t> update_bytes(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(update)));
+  pb::Serialize(update, update_bytes.data());
+  const auto update_size = static_cast<int64_t>(update_bytes.size());
+  // Keep the long-lived book from growing without bound.
+  const std::size_t people_count = book.people.size();
+
+  const auto backed_up =
+      runner.Run("Parse/TransactionalMerge/CopyThenMerge", update_size, [&] {
+        if (book.people.size() > 2 * people_count) {
+          book.people.resize(people_count);
+        }
+        AddressBook backup = book;
+        if (!pb::MergeFromBuffer(update_bytes.data(),
+                                 update_bytes.data() + update_bytes.size(),
+                                 book)) {
+          book = std::move(backup);
+        }
+        DoNotOptimize(book);
+      });
+  const auto tried = runner.Run(
+      "Parse/TransactionalMerge/TryMergeFromBuffer", update_size, [&] {
+        if (book.people.size() > 2 * people_count) {
+          book.people.resize(people_count);
+        }
+        DoNotOptimize(pb::TryMergeFromBuffer(
+            update_bytes.data(), update_bytes.data() + update_bytes.size(),
+            book));
+        DoNotOptimize(book);
+      });
+  runner.ReportSpeedup(backed_up, tried);
+
+  std::vector<uint8_t> book_bytes(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(book)));
+  pb::Serialize(book, book_bytes.data());
+  const auto book_size = static_cast<int64_t>(book_bytes.size());
+  const auto merged = runner.Run(
+      "Parse/TransactionalMerge/FullMergeFromBuffer", book_size, [&] {
+        AddressBook parsed;
+        DoNotOptimize(pb::MergeFromBuffer(
+            book_bytes.data(), book_bytes.data() + book_bytes.size(), parsed));
+        DoNotOptimize(parsed);
+      });
+  const auto full_tried = runner.Run(
+      "Parse/TransactionalMerge/FullTryMergeFromBuffer", book_size, [&] {
+        AddressBook parsed;
+        DoNotOptimize(pb::TryMergeFromBuffer(
+            book_bytes.data(), book_bytes.data() + book_bytes.size(), parsed));
+        DoNotOptimize(parsed);
+      });
+  runner.ReportSpeedup(merged, full_tried);
+}
+
+}  // namespace
+
+void RunParseBenchmarks(Runner& runner) {
+  CompareExactAndPaddedParse(runner, "Parse/VarintHeavy", MakeSensorBatch());
+  CompareExactAndPaddedParse(runner, "Parse/Mixed", MakeAddressBook());
+  CompareHugePackedVarintParse(runner);
+  CompareTinyMessageBatchParse(runner);
+  CompareSetFieldParse(runner);
+  CompareTransactionalMerge(runner);
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,164 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/benchmark/perf_counters.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+namespace pb::benchmark {
+
+namespace {
+
+#if defined(__linux__)
+
+struct CounterConfig {
+  uint32_t type;
+  uint64_t config;
+};
+
+constexpr uint64_t MakeCacheConfig(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// Indexed by PerfCounters::Counter.
+constexpr CounterConfig kCounterConfigs[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, MakeCacheConfig(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, MakeCacheConfig(PERF_COUNT_HW_CACHE_LL)},
+};
+static_assert(std::size(kCounterConfigs) == PerfCounters::kCounterCount);
+
+int OpenCounter(const CounterConfig& config, int group_fd) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = config.type;
+  attr.config = config.config;
+  attr.disabled = (group_fd < 0);  // The leader starts the group.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(
+      syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+
+#endif  // defined(__linux__)
+
+}  // namespace
+
+// static
+std::unique_ptr<PerfCounters> PerfCounters::Open(std::string& error) {
+#if defined(__linux__)
+  std::unique_ptr<PerfCounters> counters(new PerfCounters());
+  for (std::size_t i = 0; i < kCounterCount; ++i) {
+    const int group_fd = counters->fds_[kCycles];
+    const int fd = OpenCounter(kCounterConfigs[i], group_fd);
+    if (fd < 0) {
+      if (i == kCycles) {
+        error = std::string("perf_event_open() failed: ") +
+                std::strerror(errno);
+        if (errno == EACCES || errno == EPERM) {
+          error += " (see /proc/sys/kernel/perf_event_paranoid)";
+        } else if (errno == ENOENT || errno == EOPNOTSUPP) {
+          error += " (no hardware counters, e.g., in a virtual machine)";
+        }
+        return nullptr;
+      }
+      continue;  // Not supported on this CPU.
+    }
+    counters->fds_[i] = fd;
+    counters->read_indexes_[i] = counters->available_count_++;
+  }
+  return counters;
+#else
+  error = "Performance counters are only supported on Linux";
+  return nullptr;
+#endif
+}
+
+PerfCounters::PerfCounters() {
+  fds_.fill(-1);
+  read_indexes_.fill(-1);
+}
+
+PerfCounters::~PerfCounters() {
+#if defined(__linux__)
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+#endif
+}
+
+// static
+const char* PerfCounters::GetName(Counter counter) {
+  switch (counter) {
+    case kCycles:
+      return "cycles";
+    case kInstructions:
+      return "instructions";
+    case kBranchMisses:
+      return "branch-misses";
+    case kL1DataMisses:
+      return "L1-dcache-load-misses";
+    case kLastLevelCacheMisses:
+      return "LLC-load-misses";
+    case kCounterCount:
+      break;
+  }
+  return "?";
+}
+
+void PerfCounters::Start() {
+#if defined(__linux__)
+  ioctl(fds_[kCycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds_[kCycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+PerfCounters::Values PerfCounters::Stop() {
+  Values values;
+  values.counts.fill(-1);
+#if defined(__linux__)
+  ioctl(fds_[kCycles], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  // With PERF_FORMAT_GROUP, the leader reads as: the number of counters, the
+  // time enabled, the time running, and then each counter's value.
+  std::vector<uint64_t> data(static_cast<std::size_t>(3 + available_count_));
+  const auto size = static_cast<ssize_t>(data.size() * sizeof(uint64_t));
+  if (read(fds_[kCycles], data.data(), static_cast<std::size_t>(size)) !=
+          size ||
+      data[0] != static_cast<uint64_t>(available_count_) || data[2] == 0) {
+    return values;
+  }
+  const double scale =
+      static_cast<double>(data[1]) / static_cast<double>(data[2]);
+  for (std::size_t i = 0; i < kCounterCount; ++i) {
+    if (read_indexes_[i] >= 0) {
+      values.counts[i] = static_cast<int64_t>(
+          static_cast<double>(
+              data[3 + static_cast<std::size_t>(read_indexes_[i])]) *
+          scale);
+    }
+  }
+#endif
+  return values;
+}
+
+}  // namespace pb::benchmark
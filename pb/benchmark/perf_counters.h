@@ -0,0 +1,78 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace pb::benchmark {
+
+// Hardware performance counters, read with the Linux perf_event_open()
+// system call. They count only the calling thread, in user space.
+//
+// Counters the CPU (or virtual machine) does not support are left out, and
+// Open() fails altogether where perf events are not permitted (e.g., by
+// /proc/sys/kernel/perf_event_paranoid, or a container's seccomp policy), or
+// on other operating systems.
+class PerfCounters {
+ public:
+  enum Counter {
+    kCycles,
+    kInstructions,
+    kBranchMisses,
+    kL1DataMisses,
+    kLastLevelCacheMisses,
+    kCounterCount,
+  };
+
+  // The counts since Start(), or -1 where a counter is not available. If the
+  // kernel had to time-share the hardware counters with other users, the
+  // counts are scaled up to estimate what they would have been.
+  struct Values {
+    std::array<int64_t, kCounterCount> counts;
+
+    [[nodiscard]] int64_t operator[](Counter counter) const {
+      return counts[counter];
+    }
+  };
+
+  // Returns nullptr, and sets |error| to a description of why, if not even the
+  // cycle counter can be opened.
+  [[nodiscard]] static std::unique_ptr<PerfCounters> Open(std::string& error);
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  ~PerfCounters();
+
+  // Returns the name of the |counter|, as the "perf" tool spells it.
+  [[nodiscard]] static const char* GetName(Counter counter);
+
+  [[nodiscard]] bool is_available(Counter counter) const {
+    return fds_[counter] >= 0;
+  }
+
+  // Resets the counters to zero, and starts them.
+  void Start();
+
+  // Stops the counters, and returns their values.
+  [[nodiscard]] Values Stop();
+
+ private:
+  PerfCounters();
+
+  // One file descriptor per counter, or -1. The first is the group leader,
+  // which starts and stops all the counters at once.
+  std::array<int, kCounterCount> fds_;
+
+  // The position of each available counter's value, when read from the
+  // group leader.
+  std::array<int, kCounterCount> read_indexes_;
+  int available_count_ = 0;
+};
+
+}  // namespace pb::benchmark
@@ -0,0 +1,189 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/codec/serialize.h"
+#include "pb/record/lz_compression.h"
+#include "pb/record/record_file.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+constexpr int32_t kBlockBytes = 64 * 1024;
+
+// A corpus of serialized messages, each of which becomes one record.
+struct Corpus {
+  std::string name;
+  std::vector<std::vector<uint8_t>> records;
+  int64_t total_bytes = 0;
+};
+
+template <typename Message>
+Corpus MakeCorpus(std::string name,
+                  const std::vector<Message>& messages,
+                  int copies) {
+  Corpus corpus;
+  corpus.name = std::move(name);
+  for (int i = 0; i < copies; ++i) {
+    for (const Message& message : messages) {
+      std::vector<uint8_t> bytes(
+          static_cast<std::size_t>(pb::ComputeSerializedSize(message)));
+      pb::Serialize(message, bytes.data());
+      corpus.total_bytes += static_cast<int64_t>(bytes.size());
+      corpus.records.push_back(std::move(bytes));
+    }
+  }
+  return corpus;
+}
+
+// Lays out the records the way RecordFileWriter does, as uncompressed blocks.
+std::vector<std::vector<uint8_t>> MakeRawBlocks(const Corpus& corpus) {
+  std::vector<std::vector<uint8_t>> blocks(1);
+  for (const std::vector<uint8_t>& record : corpus.records) {
+    std::vector<uint8_t>& block = blocks.back();
+    uint8_t header[codec::kMaxVarintSize];
+    uint8_t* const header_end =
+        codec::SerializeValue(static_cast<uint32_t>(record.size()), header);
+    block.insert(block.end(), header, header_end);
+    block.insert(block.end(), record.begin(), record.end());
+    if (block.size() >= static_cast<std::size_t>(kBlockBytes)) {
+      blocks.emplace_back();
+    }
+  }
+  if (blocks.back().empty()) {
+    blocks.pop_back();
+  }
+  return blocks;
+}
+
+// Measures the LZ compressor alone, on in-memory blocks, and prints the
+// compression ratio.
+void RunCodecCases(Runner& runner, const Corpus& corpus) {
+  const std::vector<std::vector<uint8_t>> raw_blocks = MakeRawBlocks(corpus);
+  int64_t raw_bytes = 0;
+  std::vector<std::vector<uint8_t>> compressed_blocks;
+  for (const std::vector<uint8_t>& raw : raw_blocks) {
+    const auto raw_size = static_cast<int32_t>(raw.size());
+    raw_bytes += raw_size;
+    std::vector<uint8_t> compressed(
+        static_cast<std::size_t>(ComputeMaxLzCompressedSize(raw_size)));
+    compressed.resize(static_cast<std::size_t>(
+        LzCompress(raw.data(), raw_size, compressed.data())));
+    compressed_blocks.push_back(std::move(compressed));
+  }
+
+  std::size_t max_raw_size = 0;
+  for (const std::vector<uint8_t>& raw : raw_blocks) {
+    max_raw_size = std::max(max_raw_size, raw.size());
+  }
+  std::vector<uint8_t> output(static_cast<std::size_t>(
+      ComputeMaxLzCompressedSize(static_cast<int32_t>(max_raw_size))));
+
+  const auto compress_all = [&] {
+    for (const std::vector<uint8_t>& raw : raw_blocks) {
+      DoNotOptimize(LzCompress(raw.data(), static_cast<int32_t>(raw.size()),
+                               output.data()));
+    }
+  };
+  if (runner.Run("Lz/Compress/" + corpus.name, raw_bytes, compress_all)) {
+    for (int depth : {kMinLzSearchDepth, kDefaultLzSearchDepth, 64}) {
+      int64_t compressed_bytes = 0;
+      for (const std::vector<uint8_t>& raw : raw_blocks) {
+        compressed_bytes +=
+            LzCompress(raw.data(), static_cast<int32_t>(raw.size()),
+                       output.data(), depth);
+      }
+      std::printf("  -> With search depth %d, %s compresses to %.1f%% "
+                  "(ratio %.2f)\n",
+                  depth, corpus.name.c_str(),
+                  100.0 * static_cast<double>(compressed_bytes) /
+                      static_cast<double>(raw_bytes),
+                  static_cast<double>(raw_bytes) /
+                      static_cast<double>(compressed_bytes));
+    }
+  }
+  runner.Run("Lz/Decompress/" + corpus.name, raw_bytes, [&] {
+    for (std::size_t i = 0; i < raw_blocks.size(); ++i) {
+      const std::vector<uint8_t>& compressed = compressed_blocks[i];
+      DoNotOptimize(LzDecompress(
+          compressed.data(), static_cast<int32_t>(compressed.size()),
+          output.data(), static_cast<int32_t>(raw_blocks[i].size())));
+    }
+  });
+}
+
+// Measures writing, and then reading back, the |corpus| as a record file.
+void RunRecordFileCases(Runner& runner,
+                        const Corpus& corpus,
+                        RecordCompression compression,
+                        const char* compression_name) {
+  char path[] = "/tmp/pb_record_file_benchmark_XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    return;
+  }
+  unlink(path);
+
+  RecordFileWriter::Options options;
+  options.block_bytes = kBlockBytes;
+  options.compression = compression;
+  const auto write_file = [&] {
+    bool success = (ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    RecordFileWriter writer(fd, options);
+    for (const std::vector<uint8_t>& record : corpus.records) {
+      success &= writer.AppendBytes(record.data(),
+                                    record.data() + record.size());
+    }
+    success &= writer.Finish();
+    return success;
+  };
+  const std::string suffix = corpus.name + "/" + compression_name;
+  runner.Run("RecordFile/Write/" + suffix, corpus.total_bytes,
+             [&] { DoNotOptimize(write_file()); });
+
+  if (write_file()) {
+    const auto reader = RecordFileReader::Open(fd);
+    if (reader) {
+      runner.Run("RecordFile/Read/" + suffix, corpus.total_bytes, [&] {
+        int64_t record_count = 0;
+        const bool success = reader->ForEachRecord(
+            [&](const uint8_t*, const uint8_t*) { ++record_count; });
+        DoNotOptimize(success);
+        DoNotOptimize(record_count);
+      });
+    }
+  }
+  close(fd);
+}
+
+}  // namespace
+
+void RunRecordFileBenchmarks(Runner& runner) {
+  const AddressBook book = MakeAddressBook();
+  const SensorBatch batch = MakeSensorBatch();
+  const Corpus corpora[] = {
+      MakeCorpus("AddressBook", book.people, 8),
+      MakeCorpus("SensorBatch", batch.readings, 8),
+  };
+  for (const Corpus& corpus : corpora) {
+    RunCodecCases(runner, corpus);
+    RunRecordFileCases(runner, corpus, RecordCompression::kNone, "None");
+    RunRecordFileCases(runner, corpus, RecordCompression::kLz, "Lz");
+  }
+}
+
+}  // namespace pb::benchmark
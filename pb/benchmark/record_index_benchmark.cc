@@ -0,0 +1,188 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/parse.h"
+#include "pb/record/record_file.h"
+#include "pb/record/record_index.h"
+#include "pb/record/temp_file_for_testing.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Each Person in the address book is appended this many times, with a unique
+// id each time.
+constexpr int kCopies = 32;
+
+// The number of lookups in each benchmark iteration.
+constexpr int kLookupCount = 16;
+
+constexpr int32_t kIdFieldNumber = 2;
+
+// Returns the id of the Person in the record, or -1.
+int32_t ParseId(const uint8_t* begin, const uint8_t* end) {
+  Person person;
+  return MergeFromPaddedBuffer(begin, end, person) ? person.id : -1;
+}
+
+// Measures finding |kLookupCount| records by id: with the sorted index entries,
+// with only the per-block Bloom filters, and by scanning the whole file.
+void RunLookupCases(Runner& runner,
+                    const RecordFileReader& reader,
+                    int entries_fd,
+                    int filters_fd,
+                    int32_t person_count) {
+  const auto entries_index = RecordIndexReader::Open(entries_fd);
+  const auto filters_index = RecordIndexReader::Open(filters_fd);
+  if (!entries_index || !filters_index) {
+    return;
+  }
+  std::vector<int32_t> ids;
+  for (int i = 0; i < kLookupCount; ++i) {
+    ids.push_back(static_cast<int32_t>(
+        (int64_t{i} * 104729 + 17) % person_count));
+  }
+
+  RecordBlock block;
+  const auto look_up_with_entries = [&] {
+    int found = 0;
+    for (int32_t id : ids) {
+      entries_index->Lookup(
+          static_cast<uint64_t>(id), [&](const RecordPosition& position) {
+            const uint8_t* begin;
+            const uint8_t* end;
+            if (reader.ReadRecord(position, block, begin, end)) {
+              found += (ParseId(begin, end) == id);
+            }
+          });
+    }
+    DoNotOptimize(found);
+  };
+
+  const auto look_up_with_filters = [&] {
+    int found = 0;
+    for (int32_t id : ids) {
+      for (int64_t block_offset :
+           filters_index->FindCandidateBlocks(static_cast<uint64_t>(id))) {
+        // Find the block's index. Blocks are in file order.
+        int low = 0;
+        int high = reader.block_count();
+        while (low < high) {
+          const int middle = low + (high - low) / 2;
+          if (reader.block_info(middle).offset < block_offset) {
+            low = middle + 1;
+          } else {
+            high = middle;
+          }
+        }
+        if (!reader.ReadBlock(low, block)) {
+          continue;
+        }
+        DoNotOptimize(block.ForEachRecord(
+            [&](const uint8_t* begin, const uint8_t* end) {
+              uint64_t key;
+              if (ExtractRecordKey(begin, end, kIdFieldNumber, key) &&
+                  key == static_cast<uint64_t>(id)) {
+                found += (ParseId(begin, end) == id);
+              }
+            }));
+      }
+    }
+    DoNotOptimize(found);
+  };
+
+  const auto look_up_by_scanning = [&] {
+    int found = 0;
+    for (int32_t id : ids) {
+      DoNotOptimize(
+          reader.ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+            uint64_t key;
+            if (ExtractRecordKey(begin, end, kIdFieldNumber, key) &&
+                key == static_cast<uint64_t>(id)) {
+              found += (ParseId(begin, end) == id);
+            }
+          }));
+    }
+    DoNotOptimize(found);
+  };
+
+  const auto scanned =
+      runner.Run("RecordIndex/Lookup/FullScan", 0, look_up_by_scanning);
+  const auto filtered =
+      runner.Run("RecordIndex/Lookup/BloomFilters", 0, look_up_with_filters);
+  const auto indexed =
+      runner.Run("RecordIndex/Lookup/Entries", 0, look_up_with_entries);
+  runner.ReportSpeedup(scanned, filtered);
+  runner.ReportSpeedup(scanned, indexed);
+}
+
+}  // namespace
+
+void RunRecordIndexBenchmarks(Runner& runner) {
+  TempFile records;
+  TempFile entries_index;
+  TempFile filters_index;
+  if (records.fd() < 0 || entries_index.fd() < 0 || filters_index.fd() < 0) {
+    return;
+  }
+
+  AddressBook book = MakeAddressBook();
+  const auto person_count =
+      static_cast<int32_t>(book.people.size()) * kCopies;
+  RecordFileWriter writer(records.fd());
+  bool success = true;
+  for (int copy = 0; copy < kCopies; ++copy) {
+    for (std::size_t i = 0; i < book.people.size(); ++i) {
+      Person& person = book.people[i];
+      person.id = copy * static_cast<int32_t>(book.people.size()) +
+                  static_cast<int32_t>(i);
+      success &= writer.Append(person);
+    }
+  }
+  success &= writer.Finish();
+  const auto reader = RecordFileReader::Open(records.fd());
+  if (!success || !reader) {
+    return;
+  }
+
+  RecordIndexBuilder::Options entries_options;
+  entries_options.key_field_number = kIdFieldNumber;
+  RecordIndexBuilder::Options filters_options = entries_options;
+  filters_options.include_entries = false;
+  filters_options.bloom_bits_per_key = 10;
+  const auto build_entries_index = [&] {
+    return ftruncate(entries_index.fd(), 0) == 0 &&
+           lseek(entries_index.fd(), 0, SEEK_SET) == 0 &&
+           BuildRecordIndex(*reader, entries_options, entries_index.fd());
+  };
+  const auto build_result =
+      runner.Run("RecordIndex/Build/Entries", records.size(),
+                 [&] { DoNotOptimize(build_entries_index()); });
+  if (!build_entries_index() ||
+      !BuildRecordIndex(*reader, filters_options, filters_index.fd())) {
+    return;
+  }
+  if (build_result) {
+    std::printf("  -> %d records in %d blocks: %lld bytes; entries index "
+                "%lld bytes, Bloom filter index %lld bytes\n",
+                person_count, reader->block_count(),
+                static_cast<long long>(records.size()),
+                static_cast<long long>(entries_index.size()),
+                static_cast<long long>(filters_index.size()));
+  }
+
+  RunLookupCases(runner, *reader, entries_index.fd(), filters_index.fd(),
+                 person_count);
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,194 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/record/record_writer.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// The total number of records appended by each benchmark iteration, divided
+// evenly among the producer threads. Each producer waits for each of its
+// records to be durable before appending the next, as a database would for
+// each transaction it commits.
+constexpr int kRecordsPerIteration = 256;
+
+constexpr int kProducerCounts[] = {1, 4, 16, 64};
+
+// A temporary file on a local (not in-memory) filesystem.
+class ScratchFile {
+ public:
+  ScratchFile() {
+    char path[] = "/var/tmp/pb_record_writer_benchmark_XXXXXX";
+    fd_ = mkstemp(path);
+    if (fd_ >= 0) {
+      unlink(path);
+    }
+  }
+  ~ScratchFile() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  int fd() const { return fd_; }
+
+ private:
+  int fd_ = -1;
+};
+
+// Collects the time from appending each record until it is durable.
+class LatencyRecorder {
+ public:
+  void Add(Clock::duration latency) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    latencies_.push_back(latency);
+  }
+
+  void Print(std::string_view name) {
+    if (latencies_.empty()) {
+      return;
+    }
+    std::sort(latencies_.begin(), latencies_.end());
+    const auto percentile = [&](double fraction) {
+      const auto index = static_cast<std::size_t>(
+          fraction * static_cast<double>(latencies_.size() - 1));
+      return std::chrono::duration<double, std::micro>(latencies_[index])
+          .count();
+    };
+    std::printf("  -> %.*s latency: p50 %.0f us, p99 %.0f us, max %.0f us\n",
+                static_cast<int>(name.size()), name.data(), percentile(0.5),
+                percentile(0.99), percentile(1.0));
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<Clock::duration> latencies_;
+};
+
+// Runs |producer_count| threads, each calling |append_and_wait| with its
+// share of the |readings|.
+template <typename AppendAndWait>
+void RunProducers(int producer_count,
+                  const std::vector<SensorReading>& readings,
+                  LatencyRecorder& latencies,
+                  AppendAndWait&& append_and_wait) {
+  std::vector<std::thread> producers;
+  for (int p = 0; p < producer_count; ++p) {
+    producers.emplace_back([&, p] {
+      for (int i = p; i < kRecordsPerIteration; i += producer_count) {
+        const auto start = Clock::now();
+        const auto index = static_cast<std::size_t>(i) % readings.size();
+        append_and_wait(readings[index]);
+        latencies.Add(Clock::now() - start);
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+}
+
+int64_t ComputeBytesPerIteration(const std::vector<SensorReading>& readings) {
+  int64_t bytes = 0;
+  for (int i = 0; i < kRecordsPerIteration; ++i) {
+    bytes += pb::ComputeSerializedSize(
+        readings[static_cast<std::size_t>(i) % readings.size()]);
+  }
+  return bytes;
+}
+
+// The baseline: Each record is written with its own write() and fdatasync(),
+// under a lock shared by all producers.
+std::optional<Result> RunSyncPerRecord(
+    Runner& runner,
+    int producer_count,
+    const std::vector<SensorReading>& readings) {
+  ScratchFile file;
+  if (file.fd() < 0) {
+    return std::nullopt;
+  }
+  const std::string name =
+      "RecordWriter/SyncPerRecord/Producers:" + std::to_string(producer_count);
+  std::mutex mutex;
+  LatencyRecorder latencies;
+  const auto result =
+      runner.Run(name, ComputeBytesPerIteration(readings), [&] {
+        RunProducers(producer_count, readings, latencies,
+                     [&](const SensorReading& reading) {
+                       std::vector<uint8_t> bytes(static_cast<std::size_t>(
+                           pb::ComputeSerializedSize(reading)));
+                       pb::Serialize(reading, bytes.data());
+                       std::lock_guard<std::mutex> lock(mutex);
+                       bool success = (write(file.fd(), bytes.data(),
+                                             bytes.size()) ==
+                                       static_cast<ssize_t>(bytes.size()));
+                       success &= (fdatasync(file.fd()) == 0);
+                       DoNotOptimize(success);
+                     });
+      });
+  latencies.Print(name);
+  return result;
+}
+
+std::optional<Result> RunGroupCommit(
+    Runner& runner,
+    int producer_count,
+    const std::vector<SensorReading>& readings) {
+  ScratchFile file;
+  if (file.fd() < 0) {
+    return std::nullopt;
+  }
+  const std::string name =
+      "RecordWriter/GroupCommit/Producers:" + std::to_string(producer_count);
+  RecordWriter::Options options;
+  options.compression = RecordCompression::kNone;
+  RecordWriter writer(file.fd(), options);
+  LatencyRecorder latencies;
+  const auto result =
+      runner.Run(name, ComputeBytesPerIteration(readings), [&] {
+        RunProducers(producer_count, readings, latencies,
+                     [&](const SensorReading& reading) {
+                       const int64_t sequence = writer.Append(reading);
+                       DoNotOptimize(writer.WaitUntilDurable(sequence));
+                     });
+      });
+  latencies.Print(name);
+  DoNotOptimize(writer.Close());
+  return result;
+}
+
+}  // namespace
+
+void RunRecordWriterBenchmarks(Runner& runner) {
+  const SensorBatch batch = MakeSensorBatch();
+  for (int producer_count : kProducerCounts) {
+    const auto baseline =
+        RunSyncPerRecord(runner, producer_count, batch.readings);
+    const auto group_commit =
+        RunGroupCommit(runner, producer_count, batch.readings);
+    runner.ReportSpeedup(baseline, group_commit);
+  }
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,122 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/checksum.h"
+#include "pb/message_registry.h"
+#include "pb/parse.h"
+#include "pb/record/traffic_sampler.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+
+// Runs the parse, size, serialize and validate paths over the samples of one
+// message type in a traffic corpus (see pb/record/traffic_sampler.h). Each
+// iteration processes every sample once, so the MB/s reported is the
+// throughput for that type's real-world mix of messages. Samples that do not
+// parse as |Message| are skipped.
+template <typename Message>
+void RunReplayBenchmarksForType(Runner& runner,
+                                uint32_t type_id,
+                                const std::vector<BufferRange>& samples) {
+  if (samples.empty()) {
+    return;
+  }
+  std::vector<Message> messages;
+  std::vector<BufferRange> valid_samples;
+  int64_t byte_count = 0;
+  for (const BufferRange& sample : samples) {
+    Message message{};
+    if (pb::MergeFromBuffer(sample.begin, sample.end, message)) {
+      messages.push_back(std::move(message));
+      valid_samples.push_back(sample);
+      byte_count += sample.end - sample.begin;
+    }
+  }
+  const std::string name = "Replay/" + std::to_string(type_id);
+  std::printf("  -> %s: %zu samples (%zu skipped), %lld bytes\n", name.c_str(),
+              valid_samples.size(), samples.size() - valid_samples.size(),
+              static_cast<long long>(byte_count));
+  if (messages.empty()) {
+    return;
+  }
+
+  runner.Run(name + "/Parse", byte_count, [&] {
+    for (const BufferRange& sample : valid_samples) {
+      Message message{};
+      const bool success =
+          pb::MergeFromBuffer(sample.begin, sample.end, message);
+      DoNotOptimize(success);
+      DoNotOptimize(message);
+    }
+  });
+
+  runner.Run(name + "/Size", byte_count, [&] {
+    for (const Message& message : messages) {
+      const int32_t size = pb::ComputeSerializedSize(message);
+      DoNotOptimize(size);
+    }
+  });
+
+  int32_t max_size = 0;
+  for (const Message& message : messages) {
+    max_size =
+        std::max(max_size, pb::ComputeSerializedSizeWithChecksum(message));
+  }
+  std::vector<uint8_t> buffer(static_cast<std::size_t>(max_size));
+  runner.Run(name + "/Serialize", byte_count, [&] {
+    for (const Message& message : messages) {
+      pb::Serialize(message, buffer.data());
+      DoNotOptimize(buffer);
+    }
+  });
+
+  // Validation is the checksum-verified parse path: the samples are
+  // re-serialized with a CRC32C trailer up front, and each iteration runs
+  // MergeFromBufferVerified() over them.
+  std::vector<std::vector<uint8_t>> checksummed;
+  checksummed.reserve(messages.size());
+  for (const Message& message : messages) {
+    const int32_t size = pb::ComputeSerializedSizeWithChecksum(message);
+    std::vector<uint8_t>& copy =
+        checksummed.emplace_back(static_cast<std::size_t>(size));
+    pb::SerializeWithChecksum(message, copy.data());
+  }
+  runner.Run(name + "/Validate", byte_count, [&] {
+    for (const std::vector<uint8_t>& copy : checksummed) {
+      Message message{};
+      const bool success = pb::MergeFromBufferVerified(
+          copy.data(), copy.data() + copy.size(), message);
+      DoNotOptimize(success);
+      DoNotOptimize(message);
+    }
+  });
+}
+
+// Runs RunReplayBenchmarksForType() for each of the MessageTypes that has
+// samples in the |corpus|. Example:
+//
+//   using MyProtocol = pb::MessageTypeList<pb::MessageType<Ping, 1>,
+//                                          pb::MessageType<Chat, 7>>;
+//   pb::benchmark::RunReplayBenchmarks(runner, corpus, MyProtocol{});
+template <typename... MessageTypes>
+void RunReplayBenchmarks(Runner& runner,
+                         const TrafficCorpus& corpus,
+                         MessageTypeList<MessageTypes...>) {
+  (RunReplayBenchmarksForType<typename MessageTypes::Message>(
+       runner, MessageTypes::kTypeId,
+       corpus.GetSamples(MessageTypes::kTypeId)),
+   ...);
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,109 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Replays traffic corpus files, recorded by pb::TrafficSampler, through the
+// parse, size, serialize and validate paths, and reports the throughput for
+// each message type. Usage:
+//
+//   protobuf_replay_benchmark [runner options] CORPUS_FILE...
+//   protobuf_replay_benchmark --make_corpus=CORPUS_FILE
+//
+// The runner options are those of pb::benchmark::Runner (e.g., --filter=).
+// --make_corpus writes a corpus of the sample benchmark messages, for trying
+// this out without first recording real traffic.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/replay.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/message_registry.h"
+#include "pb/record/traffic_sampler.h"
+
+namespace {
+
+// The message types to replay, by the type id they were sampled with. Edit
+// this to match the protocol whose traffic was recorded.
+using ReplayedTypes =
+    pb::MessageTypeList<pb::MessageType<pb::benchmark::SensorBatch, 1>,
+                        pb::MessageType<pb::benchmark::AddressBook, 2>>;
+
+int MakeCorpus(const char* path) {
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::perror(path);
+    return 1;
+  }
+  pb::TrafficSampler::Options options;
+  options.sample_one_in = 1;
+  pb::TrafficSampler sampler(fd, options);
+  const pb::benchmark::SensorBatch sensor_batch =
+      pb::benchmark::MakeSensorBatch();
+  const pb::benchmark::AddressBook address_book =
+      pb::benchmark::MakeAddressBook();
+  for (int i = 0; i < 10; ++i) {
+    sampler.SampleMessage(1, sensor_batch);
+    sampler.SampleMessage(2, address_book);
+  }
+  const bool success = sampler.Close();
+  close(fd);
+  if (!success) {
+    std::fprintf(stderr, "Failed to write %s\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  constexpr std::string_view kMakeCorpusFlag = "--make_corpus=";
+
+  // Separate the corpus files from the options, which are passed on to the
+  // Runner.
+  std::vector<char*> runner_args = {argv[0]};
+  std::vector<const char*> corpus_paths;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg.substr(0, kMakeCorpusFlag.size()) == kMakeCorpusFlag) {
+      return MakeCorpus(argv[i] + kMakeCorpusFlag.size());
+    } else if (arg.substr(0, 2) == "--") {
+      runner_args.push_back(argv[i]);
+    } else {
+      corpus_paths.push_back(argv[i]);
+    }
+  }
+  if (corpus_paths.empty()) {
+    std::fprintf(stderr,
+                 "Usage: %s [runner options] CORPUS_FILE...\n"
+                 "       %s --make_corpus=CORPUS_FILE\n",
+                 argv[0], argv[0]);
+    return 1;
+  }
+
+  pb::TrafficCorpus corpus;
+  for (const char* path : corpus_paths) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      std::perror(path);
+      return 1;
+    }
+    const bool success = corpus.ReadFile(fd);
+    close(fd);
+    if (!success) {
+      std::fprintf(stderr, "Failed to read corpus file %s\n", path);
+      return 1;
+    }
+  }
+
+  pb::benchmark::Runner runner(static_cast<int>(runner_args.size()),
+                               runner_args.data());
+  pb::benchmark::RunReplayBenchmarks(runner, corpus, ReplayedTypes{});
+  return 0;
+}
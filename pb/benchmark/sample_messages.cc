@@ -0,0 +1,55 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/benchmark/sample_messages.h"
+
+#include <utility>
+
+namespace pb::benchmark {
+
+SensorBatch MakeSensorBatch() {
+  SensorBatch batch;
+  uint64_t state = 0x9e3779b97f4a7c15;
+  const auto next_random = [&state] {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  };
+  for (int i = 0; i < 1000; ++i) {
+    SensorReading reading;
+    reading.timestamp_us = 1650000000000000 + static_cast<uint64_t>(i) * 997;
+    reading.sensor_id = static_cast<int32_t>(next_random() % 100000);
+    reading.delta = static_cast<int64_t>(next_random() % 2000000) - 1000000;
+    reading.flags = static_cast<uint32_t>(next_random() >> 40);
+    for (int j = 0; j < 16; ++j) {
+      reading.samples.push_back(static_cast<int64_t>(next_random() >> 28));
+    }
+    batch.readings.push_back(std::move(reading));
+  }
+  return batch;
+}
+
+AddressBook MakeAddressBook() {
+  AddressBook book;
+  for (int i = 0; i < 1000; ++i) {
+    Person person;
+    person.name = "Person Number " + std::to_string(i);
+    person.id = i * 7919;
+    if (i % 3 != 0) {
+      person.email = "person" + std::to_string(i) + "@example.com";
+    }
+    for (int j = 0; j < i % 4; ++j) {
+      person.phones.push_back(Person::PhoneNumber{
+          .number = "+1-555-01" + std::to_string(10 + j),
+          .type = static_cast<Person::PhoneNumber::Type>(j % 3)});
+    }
+    person.balance = i * 3.25;
+    person.last_login = uint64_t{1650000000} + static_cast<uint64_t>(i);
+    book.people.push_back(std::move(person));
+  }
+  return book;
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,92 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb::benchmark {
+
+// Message types shared by the benchmark suites, and functions that populate
+// them with deterministic, representative data.
+
+// Mostly multi-byte varints: The worst case for byte-at-a-time parsing.
+struct SensorReading {
+  uint64_t timestamp_us = 0;
+  int32_t sensor_id = 0;
+  pb::sint64_t delta = 0;
+  uint32_t flags = 0;
+  std::vector<int64_t> samples;
+
+  using ProtobufFields =
+      pb::FieldList<pb::Field<&SensorReading::timestamp_us, 1>,
+                    pb::Field<&SensorReading::sensor_id, 2>,
+                    pb::Field<&SensorReading::delta, 3>,
+                    pb::Field<&SensorReading::flags, 4>,
+                    pb::Field<&SensorReading::samples, 5>>;
+};
+
+struct SensorBatch {
+  std::vector<SensorReading> readings;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&SensorBatch::readings, 1>>;
+};
+
+// A typical mix of small scalars, strings and nested messages. The fields are
+// named, for the JSON benchmarks.
+struct Person {
+  struct PhoneNumber {
+    std::string number;
+    enum Type : int32_t { kMobile = 0, kHome = 1, kWork = 2 } type = kMobile;
+
+    static constexpr char kNumberName[] = "number";
+    static constexpr char kTypeName[] = "type";
+    using ProtobufFields =
+        pb::FieldList<pb::Field<&PhoneNumber::number, 1, kNumberName>,
+                      pb::Field<&PhoneNumber::type, 2, kTypeName>>;
+  };
+
+  std::string name;
+  int32_t id = 0;
+  std::optional<std::string> email;
+  std::vector<PhoneNumber> phones;
+  double balance = 0.0;
+  pb::fixed64_t last_login;
+
+  static constexpr char kNameName[] = "name";
+  static constexpr char kIdName[] = "id";
+  static constexpr char kEmailName[] = "email";
+  static constexpr char kPhonesName[] = "phones";
+  static constexpr char kBalanceName[] = "balance";
+  static constexpr char kLastLoginName[] = "lastLogin";
+  using ProtobufFields =
+      pb::FieldList<pb::Field<&Person::name, 1, kNameName>,
+                    pb::Field<&Person::id, 2, kIdName>,
+                    pb::Field<&Person::email, 3, kEmailName>,
+                    pb::Field<&Person::phones, 4, kPhonesName>,
+                    pb::Field<&Person::balance, 5, kBalanceName>,
+                    pb::Field<&Person::last_login, 6, kLastLoginName>>;
+};
+
+struct AddressBook {
+  std::vector<Person> people;
+
+  static constexpr char kPeopleName[] = "people";
+  using ProtobufFields =
+      pb::FieldList<pb::Field<&AddressBook::people, 1, kPeopleName>>;
+};
+
+// About 1000 readings, each with 16 samples.
+SensorBatch MakeSensorBatch();
+
+// About 1000 people, with a mix of optional and repeated fields.
+AddressBook MakeAddressBook();
+
+}  // namespace pb::benchmark
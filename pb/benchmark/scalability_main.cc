@@ -0,0 +1,313 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures how parse and serialize throughput scales with the number of
+// threads, under each of the allocation strategies in allocation_strategy.h.
+// Every thread processes the same amount of work per iteration, so perfect
+// scaling would multiply the MB/s by the thread count. Usage:
+//
+//   protobuf_scalability_benchmark [--max_threads=N] [runner options]
+//
+// --max_threads defaults to the number of CPUs. The runner options are those
+// of pb::benchmark::Runner (e.g., --filter=Arena/). After each case, the
+// allocations per message, and the scaling efficiency relative to one thread,
+// are printed.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "pb/benchmark/allocation_strategy.h"
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/field_list.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb::benchmark {
+namespace {
+
+// The number of passes each thread makes over the messages per iteration.
+constexpr int kPassesPerIteration = 4;
+
+// A message whose parsing allocates through the unique_ptr adapter, as well as
+// for strings and containers.
+struct Envelope {
+  std::string topic;
+  std::unique_ptr<Person> sender;
+  std::unique_ptr<Person> recipient;
+  std::vector<std::string> labels;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&Envelope::topic, 1>,
+                                       pb::Field<&Envelope::sender, 2>,
+                                       pb::Field<&Envelope::recipient, 3>,
+                                       pb::Field<&Envelope::labels, 4>>;
+};
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(message)));
+  pb::Serialize(message, buffer.data());
+  return buffer;
+}
+
+// A fixed set of threads that each run the same task, and then wait for the
+// next one.
+class WorkerGroup {
+ public:
+  explicit WorkerGroup(int thread_count) : pending_(thread_count) {
+    for (int i = 0; i < thread_count; ++i) {
+      threads_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+    Wait();  // Until all have started.
+  }
+
+  ~WorkerGroup() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    start_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  int thread_count() const { return static_cast<int>(threads_.size()); }
+
+  // Runs |task|(thread_index) on every thread, and returns once all are done.
+  void RunOnAll(const std::function<void(int)>& task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      pending_ = thread_count();
+      ++generation_;
+    }
+    start_.notify_all();
+    Wait();
+  }
+
+ private:
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [&] { return pending_ == 0; });
+  }
+
+  void WorkerLoop(int index) {
+    int64_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      if (--pending_ == 0) {
+        done_.notify_one();
+      }
+      start_.wait(lock,
+                  [&] { return stopping_ || generation_ != seen_generation; });
+      if (stopping_) {
+        return;
+      }
+      seen_generation = generation_;
+      const std::function<void(int)>& task = *task_;
+      lock.unlock();
+      task(index);
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const std::function<void(int)>* task_ = nullptr;
+  int64_t generation_ = 0;
+  int pending_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// One workload: |process_all|() makes one pass over |message_count| messages
+// (|byte_count| wire bytes) on the calling thread.
+struct Workload {
+  std::string name;
+  int64_t message_count;
+  int64_t byte_count;
+  std::function<void()> process_all;
+};
+
+// Runs the |workload| on each of the |thread_counts|, with the |strategy|, and
+// prints the allocations per message and scaling efficiency of each.
+void RunScalingCases(Runner& runner,
+                     const Workload& workload,
+                     AllocationStrategy strategy,
+                     const std::vector<int>& thread_counts) {
+  std::optional<Result> one_thread;
+  for (const int thread_count : thread_counts) {
+    WorkerGroup workers(thread_count);
+    // Each thread's allocation counts for the latest iteration.
+    std::vector<AllocationCounts> counts(
+        static_cast<std::size_t>(thread_count));
+    const std::function<void(int)> task = [&](int index) {
+      SetThreadAllocationStrategy(strategy);
+      const AllocationCounts before = GetThreadAllocationCounts();
+      for (int pass = 0; pass < kPassesPerIteration; ++pass) {
+        workload.process_all();
+        ResetThreadArena();
+      }
+      const AllocationCounts after = GetThreadAllocationCounts();
+      counts[static_cast<std::size_t>(index)] = {
+          after.allocations - before.allocations, after.bytes - before.bytes};
+    };
+
+    const std::string name = std::string("Scaling/") +
+                             GetAllocationStrategyName(strategy) + "/" +
+                             workload.name + "/" +
+                             std::to_string(thread_count) + "threads";
+    const auto result = runner.Run(
+        name, workload.byte_count * kPassesPerIteration * thread_count,
+        [&] { workers.RunOnAll(task); });
+    if (!result) {
+      continue;
+    }
+
+    AllocationCounts total;
+    for (const AllocationCounts& thread_total : counts) {
+      total.allocations += thread_total.allocations;
+      total.bytes += thread_total.bytes;
+    }
+    const auto messages = static_cast<double>(
+        workload.message_count * kPassesPerIteration * thread_count);
+    std::printf("  -> %.2f allocations, %.0f bytes allocated per message",
+                static_cast<double>(total.allocations) / messages,
+                static_cast<double>(total.bytes) / messages);
+    if (thread_count == 1) {
+      one_thread = result;
+    } else if (one_thread && one_thread->MegabytesPerSecond() > 0.0) {
+      std::printf(", scaling efficiency %.0f%%",
+                  100.0 * result->MegabytesPerSecond() /
+                      (thread_count * one_thread->MegabytesPerSecond()));
+    }
+    std::printf("\n");
+  }
+}
+
+std::vector<Workload> MakeWorkloads() {
+  const AddressBook address_book = MakeAddressBook();
+
+  // Each person is a separate message, as are envelopes between pairs of
+  // them.
+  auto person_encodings = std::make_shared<std::vector<std::vector<uint8_t>>>();
+  auto envelope_encodings =
+      std::make_shared<std::vector<std::vector<uint8_t>>>();
+  auto people = std::make_shared<std::vector<Person>>(address_book.people);
+  int64_t person_bytes = 0;
+  int64_t max_person_bytes = 0;
+  int64_t envelope_bytes = 0;
+  for (std::size_t i = 0; i < people->size(); ++i) {
+    const Person& person = (*people)[i];
+    const auto size = static_cast<int64_t>(
+        person_encodings->emplace_back(SerializeToVector(person)).size());
+    person_bytes += size;
+    max_person_bytes = std::max(max_person_bytes, size);
+
+    Envelope envelope;
+    envelope.topic = "Message to " + person.name;
+    envelope.sender =
+        std::make_unique<Person>((*people)[(i + 1) % people->size()]);
+    envelope.recipient = std::make_unique<Person>(person);
+    envelope.labels = {"inbox", "label-" + std::to_string(i % 10),
+                       "a-somewhat-longer-label"};
+    envelope_bytes += static_cast<int64_t>(
+        envelope_encodings->emplace_back(SerializeToVector(envelope)).size());
+  }
+
+  std::vector<Workload> workloads;
+  workloads.push_back(Workload{
+      "ParsePerson", static_cast<int64_t>(people->size()), person_bytes,
+      [person_encodings] {
+        for (const std::vector<uint8_t>& encoding : *person_encodings) {
+          Person person;
+          const bool success = pb::MergeFromBuffer(
+              encoding.data(), encoding.data() + encoding.size(), person);
+          DoNotOptimize(success);
+          DoNotOptimize(person);
+        }
+      }});
+  workloads.push_back(Workload{
+      "ParseEnvelope", static_cast<int64_t>(people->size()), envelope_bytes,
+      [envelope_encodings] {
+        for (const std::vector<uint8_t>& encoding : *envelope_encodings) {
+          Envelope envelope;
+          const bool success = pb::MergeFromBuffer(
+              encoding.data(), encoding.data() + encoding.size(), envelope);
+          DoNotOptimize(success);
+          DoNotOptimize(envelope);
+        }
+      }});
+  // The output buffer is on the stack, so that serializing allocates nothing.
+  constexpr int64_t kMaxSerializedPersonBytes = 4096;
+  if (max_person_bytes <= kMaxSerializedPersonBytes) {
+    workloads.push_back(Workload{
+        "SerializePerson", static_cast<int64_t>(people->size()), person_bytes,
+        [people] {
+          uint8_t buffer[kMaxSerializedPersonBytes];
+          for (const Person& person : *people) {
+            pb::Serialize(person, buffer);
+            DoNotOptimize(buffer);
+          }
+        }});
+  }
+  return workloads;
+}
+
+// Returns 1, 2, 4, ... up to |max_threads|, and |max_threads| itself.
+std::vector<int> GetThreadCounts(int max_threads) {
+  std::vector<int> thread_counts;
+  for (int count = 1; count < max_threads; count *= 2) {
+    thread_counts.push_back(count);
+  }
+  thread_counts.push_back(max_threads);
+  return thread_counts;
+}
+
+}  // namespace
+}  // namespace pb::benchmark
+
+int main(int argc, char* argv[]) {
+  constexpr std::string_view kMaxThreadsFlag = "--max_threads=";
+
+  int max_threads = static_cast<int>(std::thread::hardware_concurrency());
+  std::vector<char*> runner_args = {argv[0]};
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg.substr(0, kMaxThreadsFlag.size()) == kMaxThreadsFlag) {
+      max_threads = std::atoi(argv[i] + kMaxThreadsFlag.size());
+    } else {
+      runner_args.push_back(argv[i]);
+    }
+  }
+  max_threads = std::max(max_threads, 1);
+
+  pb::benchmark::Runner runner(static_cast<int>(runner_args.size()),
+                               runner_args.data());
+  const std::vector<int> thread_counts =
+      pb::benchmark::GetThreadCounts(max_threads);
+  for (const pb::benchmark::Workload& workload :
+       pb::benchmark::MakeWorkloads()) {
+    for (const pb::benchmark::AllocationStrategy strategy :
+         pb::benchmark::kAllAllocationStrategies) {
+      pb::benchmark::RunScalingCases(runner, workload, strategy,
+                                     thread_counts);
+    }
+  }
+  return 0;
+}
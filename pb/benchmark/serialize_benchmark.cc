@@ -0,0 +1,173 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/field_list.h"
+#include "pb/serialize.h"
+#include "pb/wire_writer.h"
+
+namespace pb::benchmark {
+namespace {
+
+// Compares the two ways of serializing into a freshly-allocated buffer: Sizing
+// it exactly with ComputeSerializedSize(), or over-allocating it with
+// EstimateSerializedSizeUpperBound().
+template <typename Message>
+void CompareExactAndUpperBoundSerialize(Runner& runner,
+                                        std::string_view name,
+                                        const Message& message) {
+  const auto byte_count =
+      static_cast<int64_t>(pb::ComputeSerializedSize(message));
+
+  const auto exact = runner.Run(
+      std::string(name) + "/ExactSize", byte_count, [&] {
+        std::vector<uint8_t> buffer(
+            static_cast<std::size_t>(pb::ComputeSerializedSize(message)));
+        pb::Serialize(message, buffer.data());
+        DoNotOptimize(buffer);
+      });
+  const auto upper_bound = runner.Run(
+      std::string(name) + "/UpperBoundSize", byte_count, [&] {
+        std::vector<uint8_t> buffer(static_cast<std::size_t>(
+            pb::EstimateSerializedSizeUpperBound(message)));
+        uint8_t* const end =
+            pb::SerializeWithinUpperBound(message, buffer.data());
+        buffer.resize(static_cast<std::size_t>(end - buffer.data()));
+        DoNotOptimize(buffer);
+      });
+  runner.ReportSpeedup(exact, upper_bound);
+}
+
+// A large sub-message that many list entries refer to: Either each entry holds
+// its own copy, or all of them share one instance.
+struct ColumnSchema {
+  std::vector<std::string> column_names;
+  std::vector<int32_t> column_types;
+
+  using ProtobufFields =
+      pb::FieldList<pb::Field<&ColumnSchema::column_names, 1>,
+                    pb::Field<&ColumnSchema::column_types, 2>>;
+};
+
+template <typename SchemaHolder>
+struct Row {
+  int64_t row_id = 0;
+  SchemaHolder schema;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&Row::row_id, 1>,
+                                       pb::Field<&Row::schema, 2>>;
+};
+
+template <typename SchemaHolder>
+struct Table {
+  std::vector<Row<SchemaHolder>> rows;
+
+  using ProtobufFields = pb::FieldList<pb::Field<&Table::rows, 1>>;
+};
+
+// Compares re-encoding a copy of the schema for each of 1000 rows against
+// encoding one shared instance and copying its memoized bytes thereafter.
+void CompareCopiedAndSharedSubMessages(Runner& runner) {
+  ColumnSchema schema;
+  for (int i = 0; i < 64; ++i) {
+    schema.column_names.push_back("column_" + std::to_string(i));
+    schema.column_types.push_back(i % 7);
+  }
+  const auto shared_schema = std::make_shared<const ColumnSchema>(schema);
+  Table<std::optional<ColumnSchema>> copied;
+  Table<std::shared_ptr<const ColumnSchema>> shared;
+  for (int64_t i = 0; i < 1000; ++i) {
+    copied.rows.push_back({i, schema});
+    shared.rows.push_back({i, shared_schema});
+  }
+
+  const auto serialize = [](const auto& table) {
+    std::vector<uint8_t> buffer(
+        static_cast<std::size_t>(pb::ComputeSerializedSize(table)));
+    pb::Serialize(table, buffer.data());
+    DoNotOptimize(buffer);
+  };
+  const auto byte_count =
+      static_cast<int64_t>(pb::ComputeSerializedSize(copied));
+  const auto copies =
+      runner.Run("Serialize/SubMessages/Copied", byte_count,
+                 [&] { serialize(copied); });
+  const auto memoized =
+      runner.Run("Serialize/SubMessages/Shared", byte_count,
+                 [&] { serialize(shared); });
+  runner.ReportSpeedup(copies, memoized);
+}
+
+// Compares two ways to emit 1000 people from data the application already
+// has: Populating an AddressBook and serializing it, or writing each field
+// directly with a WireWriter.
+void ComparePopulateAndSerializeWithWireWriter(Runner& runner) {
+  const AddressBook book = MakeAddressBook();
+  const auto byte_count =
+      static_cast<int64_t>(pb::ComputeSerializedSize(book));
+  std::vector<uint8_t> buffer(static_cast<std::size_t>(byte_count) + 4096);
+
+  const auto populated = runner.Run(
+      "Serialize/Emit/PopulateThenSerialize", byte_count, [&] {
+        AddressBook copy;
+        for (const Person& source : book.people) {
+          Person& person = copy.people.emplace_back();
+          person.name = source.name;
+          person.id = source.id;
+          person.email = source.email;
+          for (const Person::PhoneNumber& phone : source.phones) {
+            person.phones.push_back({phone.number, phone.type});
+          }
+          person.balance = source.balance;
+          person.last_login = source.last_login;
+        }
+        pb::Serialize(copy, buffer.data());
+        DoNotOptimize(buffer);
+      });
+  const auto written = runner.Run("Serialize/Emit/WireWriter", byte_count, [&] {
+    pb::WireWriter<AddressBook> writer(buffer.data(),
+                                       buffer.data() + buffer.size());
+    for (const Person& source : book.people) {
+      writer.Nested<&AddressBook::people>([&](pb::WireWriter<Person>& person) {
+        person.Set<&Person::name>(source.name).Set<&Person::id>(source.id);
+        if (source.email) {
+          person.Set<&Person::email>(*source.email);
+        }
+        for (const Person::PhoneNumber& phone : source.phones) {
+          person.Nested<&Person::phones>(
+              [&](pb::WireWriter<Person::PhoneNumber>& number) {
+                number.Set<&Person::PhoneNumber::number>(phone.number)
+                    .Set<&Person::PhoneNumber::type>(phone.type);
+              });
+        }
+        person.Set<&Person::balance>(source.balance)
+            .Set<&Person::last_login>(source.last_login);
+      });
+    }
+    DoNotOptimize(writer.Finish());
+  });
+  runner.ReportSpeedup(populated, written);
+}
+
+}  // namespace
+
+void RunSerializeBenchmarks(Runner& runner) {
+  CompareExactAndUpperBoundSerialize(runner, "Serialize/VarintHeavy",
+                                     MakeSensorBatch());
+  CompareExactAndUpperBoundSerialize(runner, "Serialize/Mixed",
+                                     MakeAddressBook());
+  CompareCopiedAndSharedSubMessages(runner);
+  ComparePopulateAndSerializeWithWireWriter(runner);
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,128 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+#include "pb/socket_channel.h"
+
+namespace pb::benchmark {
+namespace {
+
+// The number of messages sent by each benchmark iteration. The receiving
+// process acknowledges each round, so that an iteration measures delivery, not
+// just buffering.
+constexpr int kMessagesPerRound = 4096;
+
+// Runs in the child process: Receives and parses messages until the sender
+// closes the connection, acknowledging each complete round with one byte.
+[[noreturn]] void RunReceiver(int fd, const SocketChannel::Options& options) {
+  SocketChannel channel(fd, options);
+  int64_t received_count = 0;
+  for (;;) {
+    const int frame_count =
+        channel.Receive([&](const uint8_t* begin, const uint8_t* end) {
+          SensorReading reading;
+          if (pb::MergeFromPaddedBuffer(begin, end, reading)) {
+            DoNotOptimize(reading);
+          }
+        });
+    if (frame_count < 0 || channel.is_closed()) {
+      break;
+    }
+    for (int i = 0; i < frame_count; ++i) {
+      if (++received_count % kMessagesPerRound == 0) {
+        const char ack = 1;
+        if (send(fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+          _exit(1);
+        }
+      }
+    }
+  }
+  _exit(0);
+}
+
+// Measures sending rounds of |readings| to a receiver in another process, over
+// a Unix-domain socket pair of the given |socket_type|. A |batch_bytes| of zero
+// means each message is sent with its own system call.
+std::optional<Result> RunOneCase(Runner& runner,
+                                 std::string_view name,
+                                 int socket_type,
+                                 int32_t batch_bytes,
+                                 const std::vector<SensorReading>& readings) {
+  int fds[2];
+  if (socketpair(AF_UNIX, socket_type, 0, fds) != 0) {
+    return std::nullopt;
+  }
+  SocketChannel::Options options;
+  options.batch_bytes = batch_bytes;
+  options.chunk_bytes = 16 * 1024;
+
+  const pid_t child = fork();
+  if (child == 0) {
+    close(fds[0]);
+    RunReceiver(fds[1], options);
+  }
+  close(fds[1]);
+
+  int64_t bytes_per_round = 0;
+  for (int i = 0; i < kMessagesPerRound; ++i) {
+    bytes_per_round += pb::ComputeSerializedSize(readings[i % readings.size()]);
+  }
+
+  std::optional<Result> result;
+  if (child > 0) {
+    SocketChannel channel(fds[0], options);
+    result = runner.Run(name, bytes_per_round, [&] {
+      bool success = true;
+      for (int i = 0; i < kMessagesPerRound; ++i) {
+        success &= channel.Send(readings[i % readings.size()]);
+      }
+      success &= channel.Flush();
+      char ack;
+      success &= (recv(fds[0], &ack, 1, MSG_WAITALL) == 1);
+      DoNotOptimize(success);
+    });
+  }
+  close(fds[0]);
+  if (child > 0) {
+    waitpid(child, nullptr, 0);
+  }
+  return result;
+}
+
+}  // namespace
+
+void RunSocketChannelBenchmarks(Runner& runner) {
+  const SensorBatch batch = MakeSensorBatch();
+  const auto unbatched =
+      RunOneCase(runner, "SocketChannel/Stream/OneMessagePerCall", SOCK_STREAM,
+                 0, batch.readings);
+  const auto batched_stream =
+      RunOneCase(runner, "SocketChannel/Stream/Batched", SOCK_STREAM,
+                 256 * 1024, batch.readings);
+  runner.ReportSpeedup(unbatched, batched_stream);
+
+  const auto unbatched_datagrams =
+      RunOneCase(runner, "SocketChannel/SeqPacket/OneMessagePerCall",
+                 SOCK_SEQPACKET, 0, batch.readings);
+  const auto batched_datagrams =
+      RunOneCase(runner, "SocketChannel/SeqPacket/Batched", SOCK_SEQPACKET,
+                 256 * 1024, batch.readings);
+  runner.ReportSpeedup(unbatched_datagrams, batched_datagrams);
+}
+
+}  // namespace pb::benchmark
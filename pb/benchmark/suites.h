@@ -0,0 +1,29 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include "pb/benchmark/benchmark.h"
+
+namespace pb::benchmark {
+
+// Each of these is implemented in its own *_benchmark.cc module, and is called
+// from main() in benchmark_main.cc.
+void RunChecksumBenchmarks(Runner& runner);
+void RunDynamicMessageBenchmarks(Runner& runner);
+void RunImageBenchmarks(Runner& runner);
+void RunJsonBenchmarks(Runner& runner);
+void RunMessageCompressionBenchmarks(Runner& runner);
+void RunMessageRegistryBenchmarks(Runner& runner);
+void RunMessageStoreBenchmarks(Runner& runner);
+void RunPackedFixedViewBenchmarks(Runner& runner);
+void RunParseBenchmarks(Runner& runner);
+void RunRecordFileBenchmarks(Runner& runner);
+void RunRecordIndexBenchmarks(Runner& runner);
+void RunRecordWriterBenchmarks(Runner& runner);
+void RunSerializeBenchmarks(Runner& runner);
+void RunSocketChannelBenchmarks(Runner& runner);
+void RunWireCompactorBenchmarks(Runner& runner);
+
+}  // namespace pb::benchmark
@@ -0,0 +1,123 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pb/benchmark/benchmark.h"
+#include "pb/benchmark/sample_messages.h"
+#include "pb/benchmark/suites.h"
+#include "pb/codec/serialize.h"
+#include "pb/codec/tag.h"
+#include "pb/codec/wire_type.h"
+#include "pb/codec/zigzag.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+#include "pb/wire_compactor.h"
+
+namespace pb::benchmark {
+namespace {
+
+using codec::WireType;
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(message)));
+  pb::Serialize(message, buffer.data());
+  return buffer;
+}
+
+void AppendVarint(uint64_t value, std::vector<uint8_t>& output) {
+  uint8_t buffer[10];
+  output.insert(output.end(), buffer, codec::SerializeValue(value, buffer));
+}
+
+// Appends a varint padded to 5 bytes, as some producers write them.
+void AppendOverlongVarint(uint32_t value, std::vector<uint8_t>& output) {
+  for (int i = 0; i < 4; ++i) {
+    output.push_back(static_cast<uint8_t>(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+  output.push_back(static_cast<uint8_t>(value));
+}
+
+// The wire bytes of a |batch| as a foreign producer might write them: each
+// sample as its own unpacked field, the samples before the other fields, and
+// the nested lengths and flags padded to 5-byte varints.
+std::vector<uint8_t> MakeBloatedSensorBatchBytes(const SensorBatch& batch) {
+  std::vector<uint8_t> output;
+  std::vector<uint8_t> reading_bytes;
+  for (const SensorReading& reading : batch.readings) {
+    reading_bytes.clear();
+    for (const int64_t sample : reading.samples) {
+      AppendVarint(codec::MakeTag(5, WireType::kVarint), reading_bytes);
+      AppendVarint(static_cast<uint64_t>(sample), reading_bytes);
+    }
+    AppendVarint(codec::MakeTag(1, WireType::kVarint), reading_bytes);
+    AppendVarint(reading.timestamp_us, reading_bytes);
+    AppendVarint(codec::MakeTag(2, WireType::kVarint), reading_bytes);
+    AppendVarint(static_cast<uint64_t>(int64_t{reading.sensor_id}),
+                 reading_bytes);
+    AppendVarint(codec::MakeTag(3, WireType::kVarint), reading_bytes);
+    AppendVarint(codec::EncodeZigZag(reading.delta.value()), reading_bytes);
+    AppendVarint(codec::MakeTag(4, WireType::kVarint), reading_bytes);
+    AppendOverlongVarint(reading.flags, reading_bytes);
+
+    AppendVarint(codec::MakeTag(1, WireType::kLengthDelimited), output);
+    AppendOverlongVarint(static_cast<uint32_t>(reading_bytes.size()), output);
+    output.insert(output.end(), reading_bytes.begin(), reading_bytes.end());
+  }
+  return output;
+}
+
+// Compares WireCompactor against parsing into a |Message| and serializing it.
+template <typename Message>
+void CompareCompactorAndRoundTrip(Runner& runner,
+                                  std::string_view name,
+                                  const std::vector<uint8_t>& wire_bytes) {
+  const auto* const begin = wire_bytes.data();
+  const auto* const end = begin + wire_bytes.size();
+  const auto byte_count = static_cast<int64_t>(wire_bytes.size());
+
+  std::vector<uint8_t> output;
+  output.reserve(wire_bytes.size() * 2);
+  const auto round_trip =
+      runner.Run(std::string(name) + "/ParseAndSerialize", byte_count, [&] {
+        Message message;
+        if (pb::MergeFromBuffer(begin, end, message)) {
+          output.resize(
+              static_cast<std::size_t>(pb::ComputeSerializedSize(message)));
+          pb::Serialize(message, output.data());
+        }
+        DoNotOptimize(output.data());
+      });
+  pb::WireCompactor<Message> compactor;
+  const auto compacted =
+      runner.Run(std::string(name) + "/WireCompactor", byte_count, [&] {
+        output.clear();
+        const bool success = compactor.Compact(begin, end, output);
+        DoNotOptimize(success);
+        DoNotOptimize(output.data());
+      });
+  runner.ReportSpeedup(round_trip, compacted);
+}
+
+}  // namespace
+
+void RunWireCompactorBenchmarks(Runner& runner) {
+  const SensorBatch batch = MakeSensorBatch();
+  CompareCompactorAndRoundTrip<SensorBatch>(
+      runner, "WireCompactor/SensorBatch/Minimal", SerializeToVector(batch));
+  CompareCompactorAndRoundTrip<SensorBatch>(
+      runner, "WireCompactor/SensorBatch/Bloated",
+      MakeBloatedSensorBatchBytes(batch));
+  CompareCompactorAndRoundTrip<AddressBook>(
+      runner, "WireCompactor/AddressBook/Minimal",
+      SerializeToVector(MakeAddressBook()));
+}
+
+}  // namespace pb::benchmark
@@ -0,0 +1,204 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+
+#include "pb/codec/crc32c.h"
+#include "pb/codec/field_rules.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/serialization_memo.h"
+#include "pb/codec/serialize.h"
+#include "pb/codec/tag.h"
+#include "pb/field_list.h"
+#include "pb/sparse_fields.h"
+
+namespace pb {
+
+// The number of bytes appended by SerializeWithChecksum(): the CRC32C of the
+// serialized message, in little-endian byte order.
+constexpr int32_t kChecksumTrailerSize = 4;
+
+namespace internal {
+
+// The checksum is computed over runs of at least this many bytes, just after
+// they have been written or parsed, and so while they are still in the CPU's
+// data cache.
+constexpr int64_t kChecksumRunBytes = 16 << 10;
+
+// Accumulates the CRC32C of a buffer as it is written or read, front to back.
+class ChecksumRun {
+ public:
+  explicit ChecksumRun(const uint8_t* begin) : checked_(begin) {}
+
+  // Called each time the bytes up to |position| are done with.
+  void Advance(const uint8_t* position) {
+    if ((position - checked_) >= kChecksumRunBytes) {
+      crc_ = codec::ExtendCrc32c(crc_, checked_, position);
+      checked_ = position;
+    }
+  }
+
+  // Returns the CRC32C of all the bytes up to |end|.
+  [[nodiscard]] uint32_t Finish(const uint8_t* end) {
+    crc_ = codec::ExtendCrc32c(crc_, checked_, end);
+    checked_ = end;
+    return crc_;
+  }
+
+ private:
+  uint32_t crc_ = 0;
+  const uint8_t* checked_;
+};
+
+// Same as codec::SerializeFields(), but advances the |run| after each field
+// and, since a message often has one large repeated field of sub-messages,
+// after each element of an unpacked repeated field.
+template <typename Message, typename... Fields>
+[[nodiscard]] uint8_t* SerializeFieldsWithChecksum(const Message& message,
+                                                   FieldList<Fields...>,
+                                                   uint8_t* buffer,
+                                                   ChecksumRun& run) {
+  const auto serialize_one_field = [&](auto field_list) {
+    using TheField = typename decltype(field_list)::template FieldAt<0>;
+    if constexpr (codec::IsRepeatedField<TheField>() &&
+                  !codec::CanEncodeAsAPackedRepeatedField<TheField>()) {
+      constexpr codec::Tag kTag = codec::GetTagForSerialization<TheField>();
+      for (const auto& element : TheField::GetMemberReferenceIn(message)) {
+        if (codec::IsStoringOneValue(element)) {
+          buffer = codec::SerializeValue(kTag, buffer);
+          buffer =
+              codec::SerializeValue(codec::GetTheOneValue(element), buffer);
+          run.Advance(buffer);
+        }
+      }
+    } else {
+      buffer = codec::SerializeFields(message, field_list, buffer);
+      run.Advance(buffer);
+    }
+  };
+  (serialize_one_field(FieldList<Fields>{}), ...);
+  return buffer;
+}
+
+// pb::SparseFields: Advances the |run| after each field that is present.
+template <typename Schema>
+[[nodiscard]] uint8_t* SerializeFieldsWithChecksum(
+    const SparseFields<Schema>& message,
+    SparseFieldList<Schema>,
+    uint8_t* buffer,
+    ChecksumRun& run) {
+  for (const auto& entry : message.entries()) {
+    buffer = SparseFields<Schema>::VisitEntry(
+        entry, [buffer](const auto& entry, auto field_list) {
+          return codec::SerializeFields(entry, field_list, buffer);
+        });
+    run.Advance(buffer);
+  }
+  return buffer;
+}
+
+}  // namespace internal
+
+// Returns the size of the buffer needed by SerializeWithChecksum(): the
+// serialized size of |message| plus the trailer, or -1 if the serialized size
+// would be larger than the design limit (see ComputeSerializedSize()).
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] constexpr int32_t ComputeSerializedSizeWithChecksum(
+    const Message& message) {
+  return codec::RunWithSerializationMemo<Message>([&message] {
+    const auto size = codec::ComputeSerializedSizeOfFields(
+        message, typename Message::ProtobufFields{});
+    return (size <= codec::kMaxSerializedSize - kChecksumTrailerSize)
+               ? size + kChecksumTrailerSize
+               : -1;
+  });
+}
+
+// Serializes the given |message| into the given |buffer|, followed by a
+// |kChecksumTrailerSize|-byte trailer containing the CRC32C of the serialized
+// bytes. Returns the CRC32C. The |buffer| must be at least as large as the
+// value returned by ComputeSerializedSizeWithChecksum(message).
+//
+// Rather than making a second pass over the output, the checksum is computed
+// while serializing: after each top-level field (or element of a repeated
+// field) is written, in runs of a few KiB that are still in cache. For large
+// messages, this is much cheaper than Serialize() followed by a separate
+// checksum of the result.
+//
+// WARNING: As with Serialize(), very bad things will happen if
+// ComputeSerializedSizeWithChecksum() would return -1.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+uint32_t SerializeWithChecksum(const Message& message, uint8_t* buffer) {
+  return codec::RunWithSerializationMemo<Message>([&message, buffer] {
+    assert(ComputeSerializedSizeWithChecksum(message) >= 0);
+    assert(buffer);
+    internal::ChecksumRun run(buffer);
+    uint8_t* const trailer = internal::SerializeFieldsWithChecksum(
+        message, typename Message::ProtobufFields{}, buffer, run);
+    const uint32_t crc = run.Finish(trailer);
+    trailer[0] = static_cast<uint8_t>(crc);
+    trailer[1] = static_cast<uint8_t>(crc >> 8);
+    trailer[2] = static_cast<uint8_t>(crc >> 16);
+    trailer[3] = static_cast<uint8_t>(crc >> 24);
+    assert((buffer + ComputeSerializedSizeWithChecksum(message)) ==
+           (trailer + kChecksumTrailerSize));
+    return crc;
+  });
+}
+
+// Parses the buffer given by the range |begin| to |end|, which must hold the
+// output of SerializeWithChecksum(), merging field data into the given
+// |message|. Returns false if the buffer is too short to hold the trailer, the
+// checksum does not match, or the parse failed. As with MergeFromBuffer(), a
+// failure may leave |message| partially modified.
+//
+// The checksum is verified while parsing, in runs of a few KiB, each just after
+// the parser has read them, rather than in a separate pass over the buffer.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool MergeFromBufferVerified(const uint8_t* begin,
+                                           const uint8_t* end,
+                                           Message& message) {
+  assert((begin && (begin < end)) || (begin == end));
+  if ((end - begin) < kChecksumTrailerSize) {
+    return false;
+  }
+  const uint8_t* const payload_end = end - kChecksumTrailerSize;
+
+  internal::ChecksumRun run(begin);
+  const uint8_t* buffer = begin;
+  while (buffer != payload_end) {
+    codec::Tag tag;
+    buffer = codec::ParseValue(buffer, payload_end, 0, tag);
+    if (!buffer) {
+      return false;
+    }
+    buffer = codec::ParseValueAfterTag<codec::InputBounds::kExact>(
+        buffer, payload_end, 0, codec::GetWireTypeFromTag(tag),
+        codec::GetFieldNumberFromTag(tag), message);
+    if (!buffer) {
+      return false;
+    }
+    run.Advance(buffer);
+  }
+  const uint32_t crc = run.Finish(payload_end);
+
+  const uint32_t expected_crc = uint32_t{payload_end[0]} |
+                                (uint32_t{payload_end[1]} << 8) |
+                                (uint32_t{payload_end[2]} << 16) |
+                                (uint32_t{payload_end[3]} << 24);
+  return crc == expected_crc;
+}
+
+}  // namespace pb
@@ -0,0 +1,136 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/checksum.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/codec/crc32c.h"
+#include "pb/field_list.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Inner {
+  std::string name;
+  std::vector<int64_t> values;
+
+  using ProtobufFields =
+      FieldList<Field<&Inner::name, 1>, Field<&Inner::values, 2>>;
+
+  bool operator==(const Inner& other) const {
+    return name == other.name && values == other.values;
+  }
+};
+
+struct Outer {
+  int32_t id = 0;
+  std::vector<Inner> items;
+  std::string blob;
+
+  using ProtobufFields = FieldList<Field<&Outer::id, 1>,
+                                   Field<&Outer::items, 2>,
+                                   Field<&Outer::blob, 3>>;
+
+  bool operator==(const Outer& other) const {
+    return id == other.id && items == other.items && blob == other.blob;
+  }
+};
+
+// Returns a message whose serialized size is roughly |item_count| KiB, so that
+// large counts span many checksum runs.
+Outer MakeOuter(int item_count) {
+  Outer outer;
+  outer.id = 42;
+  for (int i = 0; i < item_count; ++i) {
+    Inner& inner = outer.items.emplace_back();
+    inner.name = "item" + std::to_string(i);
+    for (int j = 0; j < 100; ++j) {
+      inner.values.push_back(int64_t{i} * j * 1000003);
+    }
+  }
+  outer.blob.assign(50000, 'x');
+  return outer;
+}
+
+std::vector<uint8_t> SerializeWithChecksumToVector(const Outer& message) {
+  const int32_t size = ComputeSerializedSizeWithChecksum(message);
+  EXPECT_GE(size, kChecksumTrailerSize);
+  std::vector<uint8_t> buffer(static_cast<std::size_t>(size));
+  const uint32_t crc = SerializeWithChecksum(message, buffer.data());
+  EXPECT_EQ(crc, codec::ComputeCrc32c(buffer.data(), buffer.data() + size -
+                                                         kChecksumTrailerSize));
+  return buffer;
+}
+
+TEST(ChecksumTest, AppendsTheCrc32cOfTheSerializedMessage) {
+  for (const int item_count : {0, 1, 10, 1000}) {
+    const Outer message = MakeOuter(item_count);
+    const std::vector<uint8_t> buffer = SerializeWithChecksumToVector(message);
+
+    // The bytes before the trailer are the same as from Serialize().
+    const auto size = static_cast<std::size_t>(ComputeSerializedSize(message));
+    ASSERT_EQ(size + kChecksumTrailerSize, buffer.size());
+    std::vector<uint8_t> plain(size);
+    Serialize(message, plain.data());
+    EXPECT_TRUE(std::equal(plain.begin(), plain.end(), buffer.begin()));
+
+    const uint32_t crc =
+        codec::ComputeCrc32c(plain.data(), plain.data() + size);
+    EXPECT_EQ(static_cast<uint8_t>(crc), buffer[size]);
+    EXPECT_EQ(static_cast<uint8_t>(crc >> 8), buffer[size + 1]);
+    EXPECT_EQ(static_cast<uint8_t>(crc >> 16), buffer[size + 2]);
+    EXPECT_EQ(static_cast<uint8_t>(crc >> 24), buffer[size + 3]);
+  }
+}
+
+TEST(ChecksumTest, RoundTrips) {
+  for (const int item_count : {0, 1, 10, 1000}) {
+    const Outer message = MakeOuter(item_count);
+    const std::vector<uint8_t> buffer = SerializeWithChecksumToVector(message);
+    Outer parsed;
+    ASSERT_TRUE(MergeFromBufferVerified(buffer.data(),
+                                        buffer.data() + buffer.size(), parsed))
+        << item_count;
+    EXPECT_EQ(message, parsed);
+  }
+
+  // An empty message is just the checksum of no bytes.
+  const uint8_t kEmpty[kChecksumTrailerSize] = {0, 0, 0, 0};
+  Outer parsed;
+  EXPECT_TRUE(MergeFromBufferVerified(kEmpty, kEmpty + 4, parsed));
+}
+
+TEST(ChecksumTest, FailsOnCorruption) {
+  const Outer message = MakeOuter(100);
+  const std::vector<uint8_t> buffer = SerializeWithChecksumToVector(message);
+  for (std::size_t i = 0; i < buffer.size(); i += buffer.size() / 97) {
+    std::vector<uint8_t> corrupted = buffer;
+    corrupted[i] ^= 0x10;
+    Outer parsed;
+    EXPECT_FALSE(MergeFromBufferVerified(
+        corrupted.data(), corrupted.data() + corrupted.size(), parsed))
+        << i;
+  }
+}
+
+TEST(ChecksumTest, FailsOnTruncation) {
+  const Outer message = MakeOuter(10);
+  const std::vector<uint8_t> buffer = SerializeWithChecksumToVector(message);
+  for (const std::size_t size : {std::size_t{0}, std::size_t{3}, std::size_t{4},
+                                 buffer.size() / 2, buffer.size() - 1}) {
+    Outer parsed;
+    EXPECT_FALSE(
+        MergeFromBufferVerified(buffer.data(), buffer.data() + size, parsed))
+        << size;
+  }
+}
+
+}  // namespace
+}  // namespace pb
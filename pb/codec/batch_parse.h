@@ -0,0 +1,498 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "pb/codec/endian.h"
+#include "pb/codec/field_rules.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/tag.h"
+#include "pb/codec/wire_type.h"
+#include "pb/codec/zigzag.h"
+#include "pb/integer_wrapper.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace pb::codec {
+
+// The bounds of one encoded message in a batch.
+struct BufferRange {
+  const uint8_t* begin;
+  const uint8_t* end;
+};
+
+// The number of messages ParseBatch() decodes in lockstep.
+constexpr int kBatchLanes = 16;
+
+// Returns true if |T| is a scalar type that is always serialized, and so always
+// appears exactly once on the wire (unlike, e.g., a std::optional<T>).
+template <typename T>
+[[nodiscard]] constexpr bool IsFixedShapeScalar() {
+  return std::is_arithmetic_v<T> || std::is_enum_v<T> ||
+         std::is_same_v<T, ::pb::sint32_t> ||
+         std::is_same_v<T, ::pb::sint64_t> ||
+         std::is_same_v<T, ::pb::fixed32_t> ||
+         std::is_same_v<T, ::pb::fixed64_t> ||
+         std::is_same_v<T, ::pb::sfixed32_t> ||
+         std::is_same_v<T, ::pb::sfixed64_t>;
+}
+
+// Describes the "fixed shape" of a |Message| whose fields are all scalars that
+// are always serialized: The encoding of every such message is the same
+// sequence of tags, each followed by one value. Only the lengths of the varint
+// values differ from one message to the next.
+template <typename Message>
+class FixedShape {
+ public:
+  using Fields = typename Message::ProtobufFields;
+
+ private:
+  template <std::size_t kIndex>
+  using FieldAt = typename Fields::template FieldAt<kIndex>;
+
+ public:
+  // The number of bytes in the varint encoding of the tag of the field at
+  // |kIndex|, or 0 if it is more than 2 bytes.
+  template <std::size_t kIndex>
+  [[nodiscard]] static constexpr int GetTagSize() {
+    constexpr Tag kTag = GetTagForSerialization<FieldAt<kIndex>>();
+    return (kTag < (1 << 7)) ? 1 : (kTag < (1 << 14)) ? 2 : 0;
+  }
+
+  // The first two bytes of the encoded tag of the field at |kIndex|, as a
+  // little-endian 16-bit value; and the mask of the bits that are part of it.
+  template <std::size_t kIndex>
+  [[nodiscard]] static constexpr uint16_t GetTagBits() {
+    constexpr Tag kTag = GetTagForSerialization<FieldAt<kIndex>>();
+    if constexpr (GetTagSize<kIndex>() == 1) {
+      return static_cast<uint16_t>(kTag);
+    } else {
+      return static_cast<uint16_t>((kTag & 0b01111111) | 0b10000000 |
+                                   ((kTag >> 7) << 8));
+    }
+  }
+  template <std::size_t kIndex>
+  [[nodiscard]] static constexpr uint16_t GetTagMask() {
+    return (GetTagSize<kIndex>() == 1) ? 0x00ff : 0xffff;
+  }
+
+ private:
+  template <std::size_t kIndex>
+  [[nodiscard]] static constexpr bool IsFieldEligible() {
+    using Member = typename FieldAt<kIndex>::Member;
+    if constexpr (IsFixedShapeScalar<Member>()) {
+      return GetTagSize<kIndex>() != 0;
+    } else {
+      return false;
+    }
+  }
+
+  template <std::size_t... kIndices>
+  [[nodiscard]] static constexpr bool AreAllFieldsEligible(
+      std::index_sequence<kIndices...>) {
+    return (IsFieldEligible<kIndices>() && ...);
+  }
+
+  template <std::size_t kIndex>
+  [[nodiscard]] static constexpr int32_t GetMaxFieldSize() {
+    using Member = typename FieldAt<kIndex>::Member;
+    if constexpr (IsFixedShapeScalar<Member>()) {
+      switch (GetWireType<Member>()) {
+        case WireType::kFixed64Bit:
+          return 2 + 8;
+        case WireType::kFixed32Bit:
+          return 2 + 4;
+        default:
+          return 2 + kMaxVarintSize;
+      }
+    } else {
+      return 0;
+    }
+  }
+
+  template <std::size_t... kIndices>
+  [[nodiscard]] static constexpr int32_t ComputeMaxSize(
+      std::index_sequence<kIndices...>) {
+    return (0 + ... + GetMaxFieldSize<kIndices>());
+  }
+
+ public:
+  // The largest possible encoding of a message that has the fixed shape.
+  // Larger encodings must contain something else (e.g., unknown fields).
+  static constexpr int32_t kMaxSize =
+      ComputeMaxSize(std::make_index_sequence<Fields::kFieldCount>());
+
+  // True if all of the |Message|'s fields are eligible, and its encodings are
+  // small enough to be staged on the stack.
+  static constexpr bool kIsFixed =
+      (Fields::kFieldCount > 0) &&
+      AreAllFieldsEligible(std::make_index_sequence<Fields::kFieldCount>()) &&
+      (kMaxSize <= 1024);
+};
+
+// A zeroed buffer that retired lanes read from (see DecodeFieldInLanes()). It
+// never matches a tag, since no tag is zero.
+inline constexpr uint8_t kRetiredLaneBytes[kParseSlopBytes] = {};
+
+// The read positions of the messages being decoded in lockstep, one per lane.
+struct BatchLanes {
+  const uint8_t* position[kBatchLanes];
+  const uint8_t* end[kBatchLanes];
+};
+
+// Returns the 8 bytes at |buffer| as a little-endian 64-bit word.
+[[nodiscard]] inline uint64_t LoadLittleEndian64(const uint8_t* buffer) {
+  uint64_t word;
+  std::memcpy(&word, buffer, sizeof(word));
+  return IsLittleEndianArchitecture() ? word : ReverseBytes64(word);
+}
+
+#if defined(__AVX2__)
+// Same as SqueezeOutContinuationBits(), for four words at once.
+[[nodiscard]] inline __m256i SqueezeOutContinuationBits(__m256i bits) {
+  const auto keep = [](int64_t mask) { return _mm256_set1_epi64x(mask); };
+  bits = _mm256_and_si256(bits, keep(0x7f7f7f7f7f7f7f7f));
+  bits = _mm256_or_si256(
+      _mm256_srli_epi64(_mm256_and_si256(bits, keep(0x7f007f007f007f00)), 1),
+      _mm256_and_si256(bits, keep(0x007f007f007f007f)));
+  bits = _mm256_or_si256(
+      _mm256_srli_epi64(_mm256_and_si256(bits, keep(0x3fff00003fff0000)), 2),
+      _mm256_and_si256(bits, keep(0x00003fff00003fff)));
+  bits = _mm256_or_si256(
+      _mm256_srli_epi64(_mm256_and_si256(bits, keep(0x0fffffff00000000)), 4),
+      _mm256_and_si256(bits, keep(0x000000000fffffff)));
+  return bits;
+}
+#endif
+
+// Decodes one field in every lane: Each lane must be at a |kTagSize|-byte tag
+// that matches |tag_bits| (under |tag_mask|), followed by a value of the
+// |kWireType|, all before the lane's end. Sets |values| to the decoded varints
+// or the raw fixed-size bits, and advances the lanes past them.
+//
+// Returns a bit mask of the lanes that did so. The others are retired: They
+// are pointed at |kRetiredLaneBytes|, so that the remaining fields can still be
+// "decoded" in every lane without branching, and without reading out of bounds.
+//
+// Since a lane's position is always before its end when its tag is read, no
+// more than |kMaxVarintSize| bytes past its end are ever read.
+//
+// Where AVX2 instructions are available, four lanes are decoded at once.
+// Otherwise, each lane is decoded without branching, by bit twiddling. Varints
+// longer than 8 bytes (e.g., negative int64 values) are rare enough that they
+// are decoded separately.
+template <int kTagSize, WireType kWireType>
+[[nodiscard]] uint32_t DecodeFieldInLanes(BatchLanes& lanes,
+                                          uint64_t tag_bits,
+                                          uint64_t tag_mask,
+                                          uint64_t (&values)[kBatchLanes]) {
+  constexpr int kFixedSize = (kWireType == WireType::kFixed64Bit)   ? 8
+                             : (kWireType == WireType::kFixed32Bit) ? 4
+                                                                    : 0;
+  constexpr uint64_t kFixedValueMask =
+      (kFixedSize == 4) ? 0xffffffff : ~uint64_t{0};
+
+  uint32_t decoded = 0;
+  uint32_t unterminated = 0;  // Varints longer than 8 bytes.
+#if defined(__AVX2__)
+  static_assert(sizeof(const uint8_t*) == sizeof(int64_t));
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i retired = _mm256_set1_epi64x(
+      static_cast<int64_t>(reinterpret_cast<intptr_t>(kRetiredLaneBytes)));
+  for (int i = 0; i < kBatchLanes; i += 4) {
+    const uint8_t* const* const position = &lanes.position[i];
+    const __m256i positions =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(position));
+    const __m256i ends =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&lanes.end[i]));
+    const auto load_lanes = [&](int offset) {
+      return _mm256_set_epi64x(
+          static_cast<int64_t>(LoadLittleEndian64(position[3] + offset)),
+          static_cast<int64_t>(LoadLittleEndian64(position[2] + offset)),
+          static_cast<int64_t>(LoadLittleEndian64(position[1] + offset)),
+          static_cast<int64_t>(LoadLittleEndian64(position[0] + offset)));
+    };
+    const __m256i heads = load_lanes(0);
+    const __m256i words = load_lanes(kTagSize);
+
+    __m256i lane_values;
+    __m256i lengths;
+    if constexpr (kFixedSize != 0) {
+      lane_values = _mm256_and_si256(
+          words, _mm256_set1_epi64x(static_cast<int64_t>(kFixedValueMask)));
+      lengths = _mm256_set1_epi64x(kFixedSize);
+    } else {
+      const __m256i terminators = _mm256_andnot_si256(
+          words, _mm256_set1_epi64x(static_cast<int64_t>(0x8080808080808080)));
+      const __m256i first_terminator =
+          _mm256_and_si256(terminators, _mm256_sub_epi64(zero, terminators));
+      const __m256i mask = _mm256_sub_epi64(
+          _mm256_slli_epi64(first_terminator, 1), _mm256_set1_epi64x(1));
+      lane_values = SqueezeOutContinuationBits(_mm256_and_si256(words, mask));
+      lengths = _mm256_sad_epu8(
+          _mm256_and_si256(mask, _mm256_set1_epi64x(0x0101010101010101)),
+          zero);
+      unterminated |= static_cast<uint32_t>(_mm256_movemask_pd(
+                          _mm256_castsi256_pd(
+                              _mm256_cmpeq_epi64(terminators, zero))))
+                      << i;
+    }
+    const __m256i next_positions = _mm256_add_epi64(
+        positions, _mm256_add_epi64(lengths, _mm256_set1_epi64x(kTagSize)));
+    const __m256i is_decoded = _mm256_andnot_si256(
+        _mm256_cmpgt_epi64(next_positions, ends),
+        _mm256_and_si256(
+            _mm256_cmpeq_epi64(
+                _mm256_and_si256(heads, _mm256_set1_epi64x(
+                                            static_cast<int64_t>(tag_mask))),
+                _mm256_set1_epi64x(static_cast<int64_t>(tag_bits))),
+            _mm256_cmpgt_epi64(ends, positions)));
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&values[i]), lane_values);
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(&lanes.position[i]),
+        _mm256_blendv_epi8(retired, next_positions, is_decoded));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&lanes.end[i]),
+                        _mm256_blendv_epi8(retired, ends, is_decoded));
+    decoded |= static_cast<uint32_t>(
+                   _mm256_movemask_pd(_mm256_castsi256_pd(is_decoded)))
+               << i;
+  }
+#else
+  for (int i = 0; i < kBatchLanes; ++i) {
+    const uint8_t* const position = lanes.position[i];
+    const uint8_t* const end = lanes.end[i];
+    const uint64_t head = LoadLittleEndian64(position);
+    const uint64_t word = LoadLittleEndian64(position + kTagSize);
+
+    uint64_t length;
+    if constexpr (kFixedSize != 0) {
+      values[i] = word & kFixedValueMask;
+      length = kFixedSize;
+    } else {
+      const uint64_t terminators = ~word & 0x8080808080808080;
+      const uint64_t mask = ((terminators & (0 - terminators)) << 1) - 1;
+      values[i] = SqueezeOutContinuationBits(word & mask);
+      length = ((mask & 0x0101010101010101) * 0x0101010101010101) >> 56;
+      unterminated |= static_cast<uint32_t>(terminators == 0) << i;
+    }
+    const uint8_t* const next_position = position + kTagSize + length;
+    const bool is_decoded = ((head & tag_mask) == tag_bits) &
+                            (position < end) & (next_position <= end);
+
+    lanes.position[i] = is_decoded ? next_position : kRetiredLaneBytes;
+    lanes.end[i] = is_decoded ? end : kRetiredLaneBytes;
+    decoded |= static_cast<uint32_t>(is_decoded) << i;
+  }
+#endif
+
+  // Each unterminated varint was skipped as if it were 8 bytes long. Finish
+  // decoding it, from where it started.
+  for (uint32_t pending = unterminated & decoded; pending != 0;
+       pending &= pending - 1) {
+    const int i = __builtin_ctz(pending);
+    const uint8_t* const after_value =
+        ParseVarintNoBoundsCheck(lanes.position[i] - 8, values[i]);
+    if (after_value && after_value <= lanes.end[i]) {
+      lanes.position[i] = after_value;
+    } else {
+      lanes.position[i] = lanes.end[i] = kRetiredLaneBytes;
+      decoded &= ~(uint32_t{1} << i);
+    }
+  }
+
+  return decoded;
+}
+
+// Stores a |value| from DecodeFieldInLanes() into a |member|, converting it
+// the same way as ParseValue() would.
+template <typename Member>
+void StoreLaneValue(uint64_t value, Member& member) {
+  if constexpr (std::is_same_v<Member, bool>) {
+    member = (value != 0);
+  } else if constexpr (std::is_enum_v<Member>) {
+    member =
+        static_cast<Member>(static_cast<std::underlying_type_t<Member>>(value));
+  } else if constexpr (std::is_integral_v<Member>) {
+    member = static_cast<Member>(value);
+  } else if constexpr (std::is_same_v<Member, double>) {
+    std::memcpy(&member, &value, sizeof(double));
+  } else if constexpr (std::is_same_v<Member, float>) {
+    const auto bits = static_cast<uint32_t>(value);
+    std::memcpy(&member, &bits, sizeof(float));
+  } else if constexpr (std::is_same_v<Member, ::pb::sint32_t> ||
+                       std::is_same_v<Member, ::pb::sint64_t>) {
+    using Bits = std::make_unsigned_t<decltype(member.value())>;
+    member = DecodeZigZag(static_cast<Bits>(value));
+  } else {
+    member = static_cast<decltype(member.value())>(value);
+  }
+}
+
+// Decodes the field at |kIndex| of a fixed-shape |Message| in every lane, and
+// clears the bits in |active| for the lanes that deviated.
+template <typename Message, std::size_t kIndex>
+void DecodeFixedShapeFieldInLanes(BatchLanes& lanes,
+                                  Message* const (&messages)[kBatchLanes],
+                                  uint32_t& active) {
+  using Shape = FixedShape<Message>;
+  using TheField = typename Shape::Fields::template FieldAt<kIndex>;
+
+  uint64_t values[kBatchLanes];
+  active &= DecodeFieldInLanes<Shape::template GetTagSize<kIndex>(),
+                               GetWireType<typename TheField::Member>()>(
+      lanes, Shape::template GetTagBits<kIndex>(),
+      Shape::template GetTagMask<kIndex>(), values);
+  for (int i = 0; i < kBatchLanes; ++i) {
+    StoreLaneValue(values[i],
+                   TheField::GetMutableMemberReferenceIn(*messages[i]));
+  }
+}
+
+template <typename Message, std::size_t... kIndices>
+void DecodeFixedShapeInLanes(BatchLanes& lanes,
+                             Message* const (&messages)[kBatchLanes],
+                             uint32_t& active,
+                             std::index_sequence<kIndices...>) {
+  (DecodeFixedShapeFieldInLanes<Message, kIndices>(lanes, messages, active),
+   ...);
+}
+
+// Parses up to |kBatchLanes| messages of a fixed shape in lockstep, one field
+// at a time. The first |count| of the |range_count| |ranges| are parsed into
+// the |messages| at the same indices, which must be default-constructed.
+// Returns a bit mask of the lanes that were fully parsed. The others deviated
+// from the fixed shape (or are invalid), and their messages are left in an
+// unspecified state.
+template <InputBounds kInputBounds, typename Message>
+[[nodiscard]] uint32_t ParseFixedShapeLanes(const BufferRange* ranges,
+                                            int count,
+                                            std::size_t range_count,
+                                            Message* messages) {
+  using Shape = FixedShape<Message>;
+  static_assert(Shape::kIsFixed);
+
+  // Unless the caller guarantees slop bytes after each buffer, a buffer is
+  // read in-place only if it is followed by at least |kParseSlopBytes| of other
+  // buffers (e.g., messages stored back-to-back). Otherwise, it is copied to a
+  // staging row followed by zeroed slop bytes.
+  constexpr bool kMayStage = (kInputBounds == InputBounds::kExact);
+  constexpr int32_t kRowSize = Shape::kMaxSize + kParseSlopBytes;
+  uint8_t staging[kMayStage ? kBatchLanes : 1][kMayStage ? kRowSize : 1];
+  bool is_followed_by_slop[kBatchLanes];
+  if constexpr (kMayStage) {
+    if (count > 0) {
+      const uint8_t* const last_end = ranges[count - 1].end;
+      const uint8_t* readable_end = last_end;
+      for (std::size_t i = static_cast<std::size_t>(count);
+           i < range_count && ranges[i].begin == readable_end &&
+           (readable_end - last_end) < kParseSlopBytes;
+           ++i) {
+        readable_end = ranges[i].end;
+      }
+      for (int i = count - 1; i >= 0; --i) {
+        if (i + 1 < count && ranges[i].end != ranges[i + 1].begin) {
+          readable_end = ranges[i].end;
+        }
+        is_followed_by_slop[i] =
+            (readable_end - ranges[i].end) >= kParseSlopBytes;
+      }
+    }
+  }
+
+  BatchLanes lanes;
+  Message* lane_messages[kBatchLanes];
+  Message spare;  // The decode target for the unused lanes.
+  uint32_t active = 0;
+  for (int i = 0; i < kBatchLanes; ++i) {
+    const auto size = (i < count) ? (ranges[i].end - ranges[i].begin) : 0;
+    if (i >= count || size > Shape::kMaxSize) {
+      lanes.position[i] = lanes.end[i] = kRetiredLaneBytes;
+      lane_messages[i] = (i < count) ? &messages[i] : &spare;
+      continue;
+    }
+    lanes.position[i] = ranges[i].begin;
+    if constexpr (kMayStage) {
+      if (!is_followed_by_slop[i]) {
+        std::memset(staging[i] + size, 0, kParseSlopBytes);
+        if (size > 0) {
+          std::memcpy(staging[i], ranges[i].begin,
+                      static_cast<std::size_t>(size));
+        }
+        lanes.position[i] = staging[i];
+      }
+    }
+    lanes.end[i] = lanes.position[i] + size;
+    lane_messages[i] = &messages[i];
+    active |= uint32_t{1} << i;
+  }
+
+  DecodeFixedShapeInLanes(
+      lanes, lane_messages, active,
+      std::make_index_sequence<Shape::Fields::kFieldCount>());
+  for (int i = 0; i < kBatchLanes; ++i) {
+    if (lanes.position[i] != lanes.end[i]) {
+      active &= ~(uint32_t{1} << i);
+    }
+  }
+  return active;
+}
+
+// Parses each of the |count| |ranges| into the message at the same index in
+// |messages|, which must be default-constructed. Returns false if any of the
+// parses failed; a failed message is left as a failed ParseFields() left it.
+//
+// For a |Message| with a fixed shape (see FixedShape), the messages are
+// decoded in groups of |kBatchLanes|, one field at a time across the whole
+// group (see ParseFixedShapeLanes()). This does away with the per-message
+// field look-up and dispatch, which dominates the time spent parsing tiny
+// messages. Any message that deviates from the fixed shape (e.g., has unknown
+// or missing fields, repeats, or is invalid) is re-parsed by ParseFields(), and
+// so the results are exactly the same as parsing each message by itself.
+template <InputBounds kInputBounds = InputBounds::kExact, typename Message>
+[[nodiscard]] bool ParseBatch(const BufferRange* ranges,
+                              std::size_t count,
+                              Message* messages) {
+  const auto parse_one = [](const BufferRange& range, Message& message) {
+    return ParseFields<kInputBounds>(range.begin, range.end, 0, message) ==
+           range.end;
+  };
+
+  bool success = true;
+  if constexpr (FixedShape<Message>::kIsFixed) {
+    for (std::size_t first = 0; first < count; first += kBatchLanes) {
+      const int group_size = static_cast<int>(
+          std::min<std::size_t>(kBatchLanes, count - first));
+      const uint32_t parsed = ParseFixedShapeLanes<kInputBounds>(
+          ranges + first, group_size, count - first, messages + first);
+      for (int i = 0; i < group_size; ++i) {
+        if (!(parsed & (uint32_t{1} << i))) {
+          Message& message = messages[first + static_cast<std::size_t>(i)];
+          message = Message{};
+          success &= parse_one(ranges[first + static_cast<std::size_t>(i)],
+                               message);
+        }
+      }
+    }
+  } else {
+    for (std::size_t i = 0; i < count; ++i) {
+      success &= parse_one(ranges[i], messages[i]);
+    }
+  }
+  return success;
+}
+
+}  // namespace pb::codec
@@ -0,0 +1,275 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/codec/batch_parse.h"
+
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/wire_type.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/serialize.h"
+
+namespace pb::codec {
+namespace {
+
+enum class Side { kBid = 0, kAsk = 1 };
+
+struct Quote {
+  uint32_t instrument;
+  pb::sint64_t price;
+  int64_t quantity;
+  pb::fixed64_t timestamp;
+  Side side;
+  bool is_implied;
+  float weight;
+  int32_t venue;  // Field number 20, so its tag is two bytes long.
+
+  bool operator==(const Quote& other) const {
+    return instrument == other.instrument && price == other.price &&
+           quantity == other.quantity && timestamp == other.timestamp &&
+           side == other.side && is_implied == other.is_implied &&
+           weight == other.weight && venue == other.venue;
+  }
+
+  using ProtobufFields = FieldList<Field<&Quote::instrument, 1>,
+                                   Field<&Quote::price, 2>,
+                                   Field<&Quote::quantity, 3>,
+                                   Field<&Quote::timestamp, 4>,
+                                   Field<&Quote::side, 5>,
+                                   Field<&Quote::is_implied, 6>,
+                                   Field<&Quote::weight, 7>,
+                                   Field<&Quote::venue, 20>>;
+};
+
+struct QuoteWithOptionalField {
+  uint32_t instrument;
+  std::optional<int64_t> quantity;
+
+  using ProtobufFields =
+      FieldList<Field<&QuoteWithOptionalField::instrument, 1>,
+                Field<&QuoteWithOptionalField::quantity, 3>>;
+};
+
+struct QuoteWithStringField {
+  uint32_t instrument;
+  std::string venue;
+
+  using ProtobufFields =
+      FieldList<Field<&QuoteWithStringField::instrument, 1>,
+                Field<&QuoteWithStringField::venue, 20>>;
+};
+
+std::vector<uint8_t> SerializeQuote(const Quote& quote) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(pb::ComputeSerializedSize(quote)));
+  pb::Serialize(quote, buffer.data());
+  return buffer;
+}
+
+// Returns the wire bytes for a mix of quotes: Mostly fixed-shape encodings,
+// with varints of all lengths, plus some that deviate from the fixed shape in
+// ways that ParseFields() accepts or rejects.
+std::vector<std::vector<uint8_t>> MakeQuoteEncodings() {
+  std::mt19937_64 random(1);
+  std::vector<std::vector<uint8_t>> encodings;
+  for (int i = 0; i < 100; ++i) {
+    Quote quote{};
+    quote.instrument = static_cast<uint32_t>(random() >> (random() % 64));
+    quote.price = static_cast<int64_t>(random()) >> (random() % 64);
+    quote.quantity = static_cast<int64_t>(random()) >> (random() % 64);
+    quote.timestamp = random();
+    quote.side = (random() % 2) ? Side::kAsk : Side::kBid;
+    quote.is_implied = random() % 2;
+    quote.weight = static_cast<float>(random() % 1000) / 8;
+    quote.venue = static_cast<int32_t>(random() % 1000) - 500;
+    encodings.push_back(SerializeQuote(quote));
+  }
+
+  std::vector<uint8_t> unknown_field = encodings[0];
+  unknown_field.insert(unknown_field.end(), {(8 << 3) | 0, 0x2a});
+  encodings[3] = unknown_field;
+
+  std::vector<uint8_t> repeated_field = encodings[1];
+  repeated_field.insert(repeated_field.end(), {(1 << 3) | 0, 0x07});
+  encodings[17] = repeated_field;
+
+  encodings[18].clear();  // All fields missing.
+
+  encodings[20] = {(3 << 3) | 0, 0x05, (1 << 3) | 0, 0x09};
+
+  // A bool encoded as an overlong, but valid, varint.
+  encodings[33] = {(6 << 3) | 0, 0x81, 0x80, 0x80, 0x00};
+
+  // A value running past the end of the buffer.
+  encodings[40].pop_back();
+
+  // A tag having the wrong wire type.
+  encodings[41][0] = (1 << 3) | 5;
+
+  return encodings;
+}
+
+template <InputBounds kInputBounds>
+void TestParseBatchMatchesParseFields() {
+  const std::vector<std::vector<uint8_t>> encodings = MakeQuoteEncodings();
+  // Each buffer is followed by garbage slop bytes, which must not matter.
+  std::vector<std::vector<uint8_t>> padded_copies;
+  std::vector<BufferRange> ranges;
+  padded_copies.reserve(encodings.size());
+  for (const std::vector<uint8_t>& encoding : encodings) {
+    std::vector<uint8_t>& copy = padded_copies.emplace_back(encoding);
+    copy.resize(copy.size() + kParseSlopBytes, 0xff);
+    ranges.push_back(
+        BufferRange{copy.data(), copy.data() + encoding.size()});
+  }
+
+  for (const std::size_t count : {std::size_t{0}, std::size_t{1},
+                                  std::size_t{16}, std::size_t{37},
+                                  encodings.size()}) {
+    SCOPED_TRACE(::testing::Message() << "count=" << count);
+    std::vector<Quote> batch(count);
+    const bool batch_success =
+        ParseBatch<kInputBounds>(ranges.data(), count, batch.data());
+
+    bool expected_success = true;
+    for (std::size_t i = 0; i < count; ++i) {
+      SCOPED_TRACE(::testing::Message() << "message #" << i);
+      Quote expected{};
+      const bool success =
+          ParseFields(ranges[i].begin, ranges[i].end, 0, expected) ==
+          ranges[i].end;
+      expected_success &= success;
+      if (success) {
+        EXPECT_EQ(expected, batch[i]);
+      }
+    }
+    EXPECT_EQ(expected_success, batch_success);
+    EXPECT_EQ(count > 40, !batch_success);
+  }
+}
+
+TEST(BatchParseTest, FixedShape) {
+  static_assert(FixedShape<Quote>::kIsFixed);
+  static_assert(FixedShape<Quote>::GetTagSize<0>() == 1);
+  static_assert(FixedShape<Quote>::GetTagSize<7>() == 2);
+  static_assert(FixedShape<Quote>::GetTagBits<7>() == 0x01a0);
+  static_assert(FixedShape<Quote>::kMaxSize ==
+                (5 * (2 + kMaxVarintSize)) + (2 + 8) + (2 + 4) +
+                    (2 + kMaxVarintSize));
+  static_assert(!FixedShape<QuoteWithOptionalField>::kIsFixed);
+  static_assert(!FixedShape<QuoteWithStringField>::kIsFixed);
+}
+
+TEST(BatchParseTest, DecodesVarintFieldInLanes) {
+  // Each lane holds the tag for field 1, followed by a varint of 1 to 10 bytes
+  // whose value is the lane's index, and then one more byte. Lane 10 has an
+  // 11-byte varint, lane 11 has the wrong tag, and lane 12's varint runs past
+  // its end.
+  uint8_t buffers[kBatchLanes][16 + kParseSlopBytes]{};
+  BatchLanes lanes;
+  for (int i = 0; i < kBatchLanes; ++i) {
+    uint8_t* const buffer = buffers[i];
+    buffer[0] = (1 << 3) | 0;
+    const int length = (i == 10) ? 11 : (i % 10) + 1;
+    for (int j = 0; j < length; ++j) {
+      buffer[1 + j] = (j == 0) ? static_cast<uint8_t>(i | 0x80) : 0x80;
+    }
+    buffer[length] &= 0x7f;
+    lanes.position[i] = buffer;
+    lanes.end[i] = buffer + 1 + length + 1;
+  }
+  buffers[11][0] = (2 << 3) | 0;
+  lanes.end[12] = lanes.position[12] + 1;
+
+  uint64_t values[kBatchLanes];
+  const uint32_t decoded = DecodeFieldInLanes<1, WireType::kVarint>(
+      lanes, (1 << 3) | 0, 0xff, values);
+  EXPECT_EQ(0xe3ffu, decoded);
+  for (int i = 0; i < kBatchLanes; ++i) {
+    SCOPED_TRACE(::testing::Message() << "lane #" << i);
+    if (decoded & (1u << i)) {
+      EXPECT_EQ(static_cast<uint64_t>(i), values[i]);
+      EXPECT_EQ(1, lanes.end[i] - lanes.position[i]);
+    } else {
+      EXPECT_EQ(lanes.end[i], lanes.position[i]);
+    }
+  }
+}
+
+TEST(BatchParseTest, DecodesFixedShapeInLockstep) {
+  const std::vector<std::vector<uint8_t>> encodings = MakeQuoteEncodings();
+  std::vector<BufferRange> ranges;
+  for (const std::vector<uint8_t>& encoding : encodings) {
+    ranges.push_back(
+        BufferRange{encoding.data(), encoding.data() + encoding.size()});
+  }
+  Quote messages[kBatchLanes]{};
+  // All but message #3, which has an unknown field, have the fixed shape.
+  EXPECT_EQ(0xfff7u, ParseFixedShapeLanes<InputBounds::kExact>(
+                         ranges.data(), kBatchLanes, ranges.size(), messages));
+  // Fewer messages than lanes: #17, #18 and #20 deviate.
+  Quote more_messages[5]{};
+  EXPECT_EQ(0b01001u, ParseFixedShapeLanes<InputBounds::kExact>(
+                          ranges.data() + 16, 5, 5, more_messages));
+}
+
+TEST(BatchParseTest, MatchesParseFields) {
+  TestParseBatchMatchesParseFields<InputBounds::kExact>();
+}
+
+TEST(BatchParseTest, MatchesParseFieldsForPaddedBuffers) {
+  TestParseBatchMatchesParseFields<InputBounds::kPadded>();
+}
+
+TEST(BatchParseTest, ReadsBackToBackBuffersInPlace) {
+  // The encodings are stored back-to-back, with nothing after the last one.
+  // Only the lanes near the end need to be staged.
+  const std::vector<std::vector<uint8_t>> encodings = MakeQuoteEncodings();
+  std::vector<uint8_t> feed;
+  for (const std::vector<uint8_t>& encoding : encodings) {
+    feed.insert(feed.end(), encoding.begin(), encoding.end());
+  }
+  std::vector<BufferRange> ranges;
+  const uint8_t* begin = feed.data();
+  for (const std::vector<uint8_t>& encoding : encodings) {
+    ranges.push_back(BufferRange{begin, begin + encoding.size()});
+    begin += encoding.size();
+  }
+
+  std::vector<Quote> batch(ranges.size());
+  EXPECT_FALSE(ParseBatch(ranges.data(), ranges.size(), batch.data()));
+  for (std::size_t i = 0; i < ranges.size(); ++i) {
+    SCOPED_TRACE(::testing::Message() << "message #" << i);
+    Quote expected{};
+    if (ParseFields(ranges[i].begin, ranges[i].end, 0, expected) ==
+        ranges[i].end) {
+      EXPECT_EQ(expected, batch[i]);
+    }
+  }
+}
+
+TEST(BatchParseTest, MessagesWithoutAFixedShape) {
+  const std::vector<uint8_t> first = {(1 << 3) | 0, 0x07};
+  const std::vector<uint8_t> second = {(1 << 3) | 0, 0x09,
+                                       (3 << 3) | 0, 0x2a};
+  const BufferRange ranges[] = {{first.data(), first.data() + first.size()},
+                                {second.data(), second.data() + second.size()}};
+  QuoteWithOptionalField messages[2]{};
+  ASSERT_TRUE(ParseBatch(ranges, 2, messages));
+  EXPECT_EQ(7u, messages[0].instrument);
+  EXPECT_FALSE(messages[0].quantity.has_value());
+  EXPECT_EQ(9u, messages[1].instrument);
+  EXPECT_EQ(std::optional<int64_t>(42), messages[1].quantity);
+}
+
+}  // namespace
+}  // namespace pb::codec
@@ -0,0 +1,128 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pb::codec {
+
+// Once a parse is done with it, a scratch buffer (see GetBulkInsertScratch())
+// whose capacity exceeds this many bytes is freed rather than kept for reuse,
+// so that one huge repeated field does not pin memory for the thread's life.
+constexpr std::size_t kMaxRetainedBulkInsertScratchBytes = 1 << 20;
+
+namespace internal {
+
+// Detects ordered set containers: std::set and std::multiset, as well as the
+// sorted "flat" sets of other libraries that share their interface (e.g.,
+// boost::container::flat_set).
+template <typename Container, typename Enable = void>
+struct OrderedSetDetector : std::false_type {};
+
+template <typename Container>
+struct OrderedSetDetector<Container,
+                          std::void_t<typename Container::key_compare>>
+    : std::is_same<typename Container::key_type,
+                   typename Container::value_type> {};
+
+// Detects hash set containers (e.g., std::unordered_set), which can reserve
+// their buckets up-front.
+template <typename Container, typename Enable = void>
+struct HashSetDetector : std::false_type {};
+
+template <typename Container>
+struct HashSetDetector<
+    Container,
+    std::void_t<typename Container::hasher,
+                decltype(std::declval<Container&>().reserve(
+                    std::declval<typename Container::size_type>()))>>
+    : std::is_same<typename Container::key_type,
+                   typename Container::value_type> {};
+
+// Detects containers that hold at most one of each key (e.g., std::set, but
+// not std::multiset): Their insert() also returns whether it inserted.
+template <typename Container>
+constexpr bool kHasUniqueKeys = !std::is_same_v<
+    decltype(std::declval<Container&>().insert(
+        std::declval<typename Container::value_type&&>())),
+    typename Container::iterator>;
+
+}  // namespace internal
+
+// True if the elements of a repeated field of type |Container| should be
+// decoded into a scratch buffer, and then added with BulkInsert(), rather than
+// inserted one at a time. This is only for sets of scalars, whose elements are
+// cheap to buffer and compare.
+template <typename Container>
+[[nodiscard]] constexpr bool CanBulkInsert() {
+  if constexpr (internal::OrderedSetDetector<Container>::value ||
+                internal::HashSetDetector<Container>::value) {
+    using Element = typename Container::value_type;
+    return std::is_trivially_copyable_v<Element> &&
+           !std::is_same_v<Element, bool>;
+  } else {
+    return false;
+  }
+}
+
+template <typename Container>
+constexpr bool kCanBulkInsert = CanBulkInsert<Container>();
+
+// Returns the calling thread's scratch buffer for decoding |Element|s, empty
+// but with the capacity left from prior parses.
+template <typename Element>
+[[nodiscard]] std::vector<Element>& GetBulkInsertScratch() {
+  thread_local std::vector<Element> scratch;
+  scratch.clear();
+  return scratch;
+}
+
+// Adds all the |elements| to the |result| set, and then empties |elements|.
+// For an ordered set, the |elements| are sorted (and deduplicated, if the set
+// has unique keys) first, so that each is placed at the end of the tree (or
+// array) instead of being searched for; and an empty set is built with its
+// range constructor. For a hash set, enough buckets for all of the |elements|
+// are reserved first, so that there is at most one rehash.
+template <typename Container>
+void BulkInsert(std::vector<typename Container::value_type>& elements,
+                Container& result) {
+  static_assert(kCanBulkInsert<Container>);
+  if constexpr (internal::OrderedSetDetector<Container>::value) {
+    const auto compare = result.key_comp();
+    std::sort(elements.begin(), elements.end(), compare);
+    auto end = elements.end();
+    if constexpr (internal::kHasUniqueKeys<Container>) {
+      // In sorted order, an element is a duplicate of the one before it if it
+      // does not compare greater.
+      end = std::unique(elements.begin(), end,
+                        [&compare](const auto& previous, const auto& element) {
+                          return !compare(previous, element);
+                        });
+    }
+    if (result.empty()) {
+      result = Container(elements.begin(), end, compare,
+                         result.get_allocator());
+    } else {
+      result.insert(elements.begin(), end);
+    }
+  } else {
+    result.reserve(result.size() + elements.size());
+    result.insert(elements.begin(), elements.end());
+  }
+
+  elements.clear();
+  if (elements.capacity() * sizeof(typename Container::value_type) >
+      kMaxRetainedBulkInsertScratchBytes) {
+    // Not shrink_to_fit(), which is only a request (and one that libstdc++
+    // ignores when exceptions are disabled).
+    std::vector<typename Container::value_type>().swap(elements);
+  }
+}
+
+}  // namespace pb::codec
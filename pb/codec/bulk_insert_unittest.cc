@@ -0,0 +1,87 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/codec/bulk_insert.h"
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb::codec {
+namespace {
+
+static_assert(kCanBulkInsert<std::set<int>>);
+static_assert(kCanBulkInsert<std::multiset<int>>);
+static_assert(kCanBulkInsert<std::set<double, std::greater<double>>>);
+static_assert(kCanBulkInsert<std::unordered_set<uint64_t>>);
+static_assert(kCanBulkInsert<std::unordered_multiset<uint64_t>>);
+static_assert(kCanBulkInsert<std::set<pb::sint32_t>>);
+static_assert(!kCanBulkInsert<std::set<bool>>);
+static_assert(!kCanBulkInsert<std::set<std::string>>);
+static_assert(!kCanBulkInsert<std::map<int, int>>);
+static_assert(!kCanBulkInsert<std::vector<int>>);
+static_assert(!kCanBulkInsert<std::list<int>>);
+static_assert(!kCanBulkInsert<int[4]>);
+
+TEST(BulkInsertTest, OrderedSets) {
+  std::vector<int>& elements = GetBulkInsertScratch<int>();
+  elements = {5, 3, 5, 1, 3};
+  std::set<int> set;
+  BulkInsert(elements, set);
+  EXPECT_EQ((std::set<int>{1, 3, 5}), set);
+  EXPECT_TRUE(elements.empty());
+
+  // Merging into a set that already has elements.
+  elements = {4, 1, 0};
+  BulkInsert(elements, set);
+  EXPECT_EQ((std::set<int>{0, 1, 3, 4, 5}), set);
+
+  // The set's comparator determines both order and duplicates.
+  std::set<int, std::greater<int>> reversed;
+  elements = {1, 3, 2, 3};
+  BulkInsert(elements, reversed);
+  EXPECT_EQ((std::vector<int>{3, 2, 1}),
+            std::vector<int>(reversed.begin(), reversed.end()));
+
+  // Multisets keep the duplicates.
+  std::multiset<int> multiset = {3};
+  elements = {3, 1, 3};
+  BulkInsert(elements, multiset);
+  EXPECT_EQ((std::multiset<int>{1, 3, 3, 3}), multiset);
+}
+
+TEST(BulkInsertTest, HashSets) {
+  std::vector<uint64_t>& elements = GetBulkInsertScratch<uint64_t>();
+  elements = {7, 300, 7, 1};
+  std::unordered_set<uint64_t> set = {2};
+  BulkInsert(elements, set);
+  EXPECT_EQ((std::unordered_set<uint64_t>{1, 2, 7, 300}), set);
+  EXPECT_TRUE(elements.empty());
+}
+
+TEST(BulkInsertTest, ScratchIsReusedUnlessHuge) {
+  std::vector<int>& elements = GetBulkInsertScratch<int>();
+  elements.assign(100, 1);
+  std::set<int> set;
+  BulkInsert(elements, set);
+  EXPECT_GE(GetBulkInsertScratch<int>().capacity(), 100u);
+
+  constexpr std::size_t kHugeCount =
+      kMaxRetainedBulkInsertScratchBytes / sizeof(int) + 1;
+  elements.assign(kHugeCount, 1);
+  BulkInsert(elements, set);
+  EXPECT_EQ(1u, set.size());
+  EXPECT_LT(GetBulkInsertScratch<int>().capacity(), kHugeCount);
+}
+
+}  // namespace
+}  // namespace pb::codec
@@ -0,0 +1,111 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "pb/codec/endian.h"
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace pb::codec {
+
+// Source: https://www.rfc-editor.org/rfc/rfc3720#appendix-B.4 (CRC32C, the
+// Castagnoli polynomial; as used by iSCSI, ext4, and others).
+
+// The CRC32C polynomial, in the bit-reversed representation.
+constexpr uint32_t kCrc32cPolynomial = 0x82f63b78;
+
+// Lookup tables for the "slice-by-8" software implementation: Table 0 is the
+// usual byte-at-a-time table, and table |k| advances the CRC of a byte over |k|
+// more zero bytes, so that 8 bytes can be folded in with 8 independent
+// lookups.
+using Crc32cTables = std::array<std::array<uint32_t, 256>, 8>;
+
+[[nodiscard]] constexpr Crc32cTables MakeCrc32cTables() {
+  Crc32cTables tables{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPolynomial : 0);
+    }
+    tables[0][i] = crc;
+  }
+  for (std::size_t k = 1; k < tables.size(); ++k) {
+    for (std::size_t i = 0; i < 256; ++i) {
+      const uint32_t previous = tables[k - 1][i];
+      tables[k][i] = (previous >> 8) ^ tables[0][previous & 0xff];
+    }
+  }
+  return tables;
+}
+
+inline constexpr Crc32cTables kCrc32cTables = MakeCrc32cTables();
+
+// Returns the CRC32C of the bytes that produced |crc|, followed by the bytes in
+// the range |begin| to |end|. Thus, a checksum can be computed incrementally,
+// starting with a |crc| of zero (the CRC32C of no bytes).
+//
+// This uses the CRC32 instructions where available (x86 SSE4.2, or ARMv8 with
+// the CRC extension), which process 8 bytes per instruction. Otherwise, it
+// falls back to the slice-by-8 tables.
+[[nodiscard]] inline uint32_t ExtendCrc32c(uint32_t crc,
+                                           const uint8_t* begin,
+                                           const uint8_t* end) {
+  crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+  uint64_t crc64 = crc;
+  for (; (end - begin) >= 8; begin += 8) {
+    uint64_t word;
+    std::memcpy(&word, begin, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; begin != end; ++begin) {
+    crc = _mm_crc32_u8(crc, *begin);
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  for (; (end - begin) >= 8; begin += 8) {
+    uint64_t word;
+    std::memcpy(&word, begin, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; begin != end; ++begin) {
+    crc = __crc32cb(crc, *begin);
+  }
+#else
+  const auto& t = kCrc32cTables;
+  for (; (end - begin) >= 8; begin += 8) {
+    uint64_t word;
+    std::memcpy(&word, begin, sizeof(word));
+    if (!IsLittleEndianArchitecture()) {
+      word = ReverseBytes64(word);
+    }
+    word ^= crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+          t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+          t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+          t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+  }
+  for (; begin != end; ++begin) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *begin) & 0xff];
+  }
+#endif
+  return ~crc;
+}
+
+// Returns the CRC32C of the bytes in the range |begin| to |end|.
+[[nodiscard]] inline uint32_t ComputeCrc32c(const uint8_t* begin,
+                                            const uint8_t* end) {
+  return ExtendCrc32c(0, begin, end);
+}
+
+}  // namespace pb::codec
@@ -0,0 +1,77 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/codec/crc32c.h"
+
+#include <cstdint>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace pb::codec {
+namespace {
+
+// Returns the CRC32C computed one bit at a time, straight from the definition.
+uint32_t ComputeCrc32cBitwise(const std::vector<uint8_t>& bytes) {
+  uint32_t crc = ~uint32_t{0};
+  for (const uint8_t byte : bytes) {
+    crc ^= byte;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPolynomial : 0);
+    }
+  }
+  return ~crc;
+}
+
+TEST(Crc32cTest, MatchesKnownValues) {
+  // Test vectors from RFC 3720, section B.4.
+  std::vector<uint8_t> bytes(32, 0x00);
+  EXPECT_EQ(0x8a9136aau, ComputeCrc32c(bytes.data(), bytes.data() + 32));
+  bytes.assign(32, 0xff);
+  EXPECT_EQ(0x62a8ab43u, ComputeCrc32c(bytes.data(), bytes.data() + 32));
+  for (uint8_t i = 0; i < 32; ++i) {
+    bytes[i] = i;
+  }
+  EXPECT_EQ(0x46dd794eu, ComputeCrc32c(bytes.data(), bytes.data() + 32));
+
+  constexpr char kDigits[] = "123456789";
+  const auto* const digits = reinterpret_cast<const uint8_t*>(kDigits);
+  EXPECT_EQ(0xe3069283u, ComputeCrc32c(digits, digits + 9));
+
+  EXPECT_EQ(0u, ComputeCrc32c(digits, digits));
+}
+
+TEST(Crc32cTest, MatchesBitwiseComputationForAllLengthsAndAlignments) {
+  std::vector<uint8_t> bytes(100);
+  for (std::size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<uint8_t>(i * 37 + 11);
+  }
+  for (std::size_t begin = 0; begin < 9; ++begin) {
+    for (std::size_t end = begin; end <= bytes.size(); ++end) {
+      const std::vector<uint8_t> range(bytes.data() + begin,
+                                       bytes.data() + end);
+      ASSERT_EQ(ComputeCrc32cBitwise(range),
+                ComputeCrc32c(bytes.data() + begin, bytes.data() + end))
+          << begin << " to " << end;
+    }
+  }
+}
+
+TEST(Crc32cTest, ExtendsIncrementally) {
+  std::vector<uint8_t> bytes(1000);
+  for (std::size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<uint8_t>(i ^ (i >> 3));
+  }
+  const uint32_t expected =
+      ComputeCrc32c(bytes.data(), bytes.data() + bytes.size());
+  for (std::size_t split = 0; split <= bytes.size(); split += 13) {
+    const uint32_t first = ComputeCrc32c(bytes.data(), bytes.data() + split);
+    EXPECT_EQ(expected, ExtendCrc32c(first, bytes.data() + split,
+                                     bytes.data() + bytes.size()))
+        << split;
+  }
+}
+
+}  // namespace
+}  // namespace pb::codec
@@ -8,11 +8,13 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <tuple>
 #include <type_traits>
 
 #include "pb/codec/iterable_util.h"
 #include "pb/field_list.h"
 #include "pb/integer_wrapper.h"
+#include "pb/packed_fixed_view.h"
 
 namespace pb::codec {
 
@@ -53,6 +55,19 @@ template <typename Field>
   return false;
 }
 
+// Returns true if |T| is a message type, having a ProtobufFields list.
+template <typename T, typename = void>
+struct IsMessageType : std::false_type {};
+
+template <typename T>
+struct IsMessageType<T, std::void_t<typename T::ProtobufFields>>
+    : std::is_class<typename T::ProtobufFields> {};
+
+template <typename T>
+[[nodiscard]] constexpr bool IsMessage() {
+  return IsMessageType<T>::value;
+}
+
 template <typename T>
 [[nodiscard]] constexpr bool IsStoringOneValue(const std::optional<T>& opt) {
   return opt.has_value();
@@ -63,6 +78,11 @@ template <typename T>
   return !!ptr;
 }
 
+template <typename T>
+[[nodiscard]] constexpr bool IsStoringOneValue(const std::shared_ptr<T>& ptr) {
+  return !!ptr;
+}
+
 template <typename T>
 [[nodiscard]] constexpr bool IsStoringOneValue(const T&) {
   return true;
@@ -84,9 +104,186 @@ template <typename T>
   return *ptr;
 }
 
+// A nested message referenced by a std::shared_ptr field. It serializes the
+// same as the message itself, except that the codec may memoize its size and
+// encoding, since the same instance is often referenced many times (see
+// SerializationMemo in pb/codec/serialization_memo.h).
+template <typename Message>
+struct SharedMessageRef {
+  const Message& message;
+};
+
+template <typename T>
+[[nodiscard]] constexpr decltype(auto) GetTheOneValue(
+    const std::shared_ptr<T>& ptr) {
+  using Value = std::remove_const_t<T>;
+  if constexpr (IsMessage<Value>()) {
+    return SharedMessageRef<Value>{*ptr};
+  } else {
+    return static_cast<const Value&>(*ptr);
+  }
+}
+
 template <typename T>
 [[nodiscard]] constexpr const T& GetTheOneValue(const T& obj) {
   return obj;
 }
 
+namespace internal {
+
+// Adds |T| to the |Visited| std::tuple of types, noting whether it was already
+// there.
+template <typename T, typename Visited>
+struct VisitedTypes;
+
+template <typename T, typename... Ts>
+struct VisitedTypes<T, std::tuple<Ts...>> {
+  static constexpr bool kAlreadyVisited = (std::is_same_v<T, Ts> || ...);
+  using type = std::tuple<T, Ts...>;
+};
+
+template <typename Visited, typename T>
+[[nodiscard]] constexpr bool ContainsSharedMessage();
+
+template <typename Visited, typename... Fields>
+[[nodiscard]] constexpr bool AnyMemberContainsSharedMessage(
+    FieldList<Fields...>) {
+  return (ContainsSharedMessage<Visited, typename Fields::Member>() || ...);
+}
+
+// Detects the std::optional and std::unique_ptr members that hold at most one
+// |Value|.
+template <typename T>
+struct OneValueHolder : std::false_type {};
+
+template <typename T>
+struct OneValueHolder<std::optional<T>> : std::true_type {
+  using Value = T;
+};
+
+template <typename T>
+struct OneValueHolder<std::unique_ptr<T>> : std::true_type {
+  using Value = T;
+};
+
+template <typename T>
+struct IsSharedPtr : std::false_type {};
+
+template <typename T>
+struct IsSharedPtr<std::shared_ptr<T>> : std::true_type {};
+
+template <typename T>
+struct IsPair : std::false_type {};
+
+template <typename First, typename Second>
+struct IsPair<std::pair<First, Second>> : std::true_type {};
+
+// Returns true if a member of type |T| is, or holds, a nested message
+// referenced by a std::shared_ptr. The |Visited| message types are not searched
+// again, which ends the search of recursive message types.
+template <typename Visited, typename T>
+[[nodiscard]] constexpr bool ContainsSharedMessage() {
+  if constexpr (IsMessage<T>()) {
+    using Search = VisitedTypes<T, Visited>;
+    if constexpr (Search::kAlreadyVisited) {
+      return false;
+    } else {
+      return AnyMemberContainsSharedMessage<typename Search::type>(
+          typename T::ProtobufFields{});
+    }
+  } else if constexpr (IsSharedPtr<T>::value) {
+    using Value = std::remove_const_t<typename T::element_type>;
+    return IsMessage<Value>() || ContainsSharedMessage<Visited, Value>();
+  } else if constexpr (OneValueHolder<T>::value) {
+    return ContainsSharedMessage<Visited, typename OneValueHolder<T>::Value>();
+  } else if constexpr (IsPair<T>::value) {
+    return ContainsSharedMessage<Visited, typename T::second_type>();
+  } else if constexpr (IsIterable<T>()) {
+    return ContainsSharedMessage<Visited, IterableValueType<T>>();
+  } else {
+    return false;
+  }
+}
+
+template <typename T>
+struct IsPackedFixedView : std::false_type {};
+
+template <typename T>
+struct IsPackedFixedView<PackedFixedView<T>> : std::true_type {};
+
+template <typename Visited, typename T>
+[[nodiscard]] constexpr bool ContainsView();
+
+template <typename Visited, typename... Fields>
+[[nodiscard]] constexpr bool AnyMemberContainsView(FieldList<Fields...>) {
+  return (ContainsView<Visited, typename Fields::Member>() || ...);
+}
+
+// Returns true if a member of type |T| is, or holds, a std::string_view or a
+// PackedFixedView, which a parse points into its input buffer. As with
+// ContainsSharedMessage(), the |Visited| message types are not searched again.
+template <typename Visited, typename T>
+[[nodiscard]] constexpr bool ContainsView() {
+  if constexpr (std::is_same_v<T, std::string_view> ||
+                IsPackedFixedView<T>::value) {
+    return true;
+  } else if constexpr (IsMessage<T>()) {
+    using Search = VisitedTypes<T, Visited>;
+    if constexpr (Search::kAlreadyVisited) {
+      return false;
+    } else {
+      return AnyMemberContainsView<typename Search::type>(
+          typename T::ProtobufFields{});
+    }
+  } else if constexpr (IsSharedPtr<T>::value) {
+    return ContainsView<Visited,
+                        std::remove_const_t<typename T::element_type>>();
+  } else if constexpr (OneValueHolder<T>::value) {
+    return ContainsView<Visited, typename OneValueHolder<T>::Value>();
+  } else if constexpr (IsPair<T>::value) {
+    using Key = std::remove_const_t<typename T::first_type>;
+    return ContainsView<Visited, Key>() ||
+           ContainsView<Visited, typename T::second_type>();
+  } else if constexpr (IsIterable<T>()) {
+    return ContainsView<Visited, IterableValueType<T>>();
+  } else {
+    return false;
+  }
+}
+
+}  // namespace internal
+
+// Returns true if the |Message|, or any message nested within it, has a field
+// that references a nested message by std::shared_ptr. Only then does a
+// serialization pass need a SerializationMemo.
+template <class Message>
+[[nodiscard]] constexpr bool HasSharedMessageFields() {
+  return internal::AnyMemberContainsSharedMessage<std::tuple<Message>>(
+      typename Message::ProtobufFields{});
+}
+
+// Returns true if the |Message|, or any message nested within it, has a
+// std::string_view or PackedFixedView field. A parse leaves those pointing into
+// its input buffer, and so it may only be parsed from a buffer that the caller
+// keeps alive for as long as the message is used.
+template <class Message>
+[[nodiscard]] constexpr bool HasViewFields() {
+  return internal::AnyMemberContainsView<std::tuple<Message>>(
+      typename Message::ProtobufFields{});
+}
+
+// Returns a new instance for a parse to merge into, in place of the one held
+// by a std::shared_ptr<const T> field. Since other owners may be sharing the
+// |current| instance, it is never modified. Instead, the new instance starts
+// as a copy of it, and so T must be copyable (or else the fields already held
+// would be lost).
+template <typename T>
+[[nodiscard]] std::shared_ptr<T> MakeSharedForMerge(
+    const std::shared_ptr<const T>& current) {
+  static_assert(std::is_copy_constructible_v<T>,
+                "A std::shared_ptr<const T> field requires a copyable T, to "
+                "merge into a copy of the instance it holds.");
+  return current ? std::make_shared<T>(*current) : std::make_shared<T>();
+}
+
 }  // namespace pb::codec
@@ -23,6 +23,19 @@ struct IterableDetector<
   constexpr static bool kIsIterable = true;
 };
 
+template <typename T, typename Enable = void>
+struct SizeMemberDetector {
+  constexpr static bool kHasSizeMember = false;
+};
+
+template <typename T>
+struct SizeMemberDetector<
+    T,
+    typename std::enable_if_t<
+        std::is_integral_v<decltype(std::declval<const T&>().size())>>> {
+  constexpr static bool kHasSizeMember = true;
+};
+
 // Removes the qualifiers from |T|.
 template <typename T, typename Enable = void>
 struct QualifierRemover {
@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <cstdint>
+#include <iterator>
+
 #include "pb/codec/iterable_util-internal.h"
 
 namespace pb::codec {
@@ -20,4 +23,17 @@ template <typename Iterable>
 using IterableValueType =
     typename internal::IterableValueTypeDetector<Iterable>::Type;
 
+// Returns the number of elements in |iterable|. If the |Iterable| provides a
+// size() member function, that is used (usually O(1)). Otherwise, this falls
+// back to walking the elements with std::distance().
+template <typename Iterable>
+[[nodiscard]] constexpr int64_t GetIterableSize(const Iterable& iterable) {
+  if constexpr (internal::SizeMemberDetector<Iterable>::kHasSizeMember) {
+    return static_cast<int64_t>(iterable.size());
+  } else {
+    return static_cast<int64_t>(
+        std::distance(std::begin(iterable), std::end(iterable)));
+  }
+}
+
 }  // namespace pb::codec
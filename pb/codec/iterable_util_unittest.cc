@@ -4,6 +4,7 @@
 
 #include "pb/codec/iterable_util.h"
 
+#include <array>
 #include <cstdint>
 #include <deque>
 #include <list>
@@ -109,4 +110,14 @@ static_assert(
 static_assert(
     std::is_same_v<std::string, IterableValueType<std::vector<std::string>>>);
 
+using pb::codec::GetIterableSize;
+
+// Uses the size() member function.
+static_assert(GetIterableSize(std::array<int, 3>{}) == 3);
+static_assert(GetIterableSize(std::array<SomeClass, 0>{}) == 0);
+
+// Falls back to std::distance(), since there is no size() member function.
+constexpr int kSomeInts[] = {1, 2, 3, 4, 5};
+static_assert(GetIterableSize(kSomeInts) == 5);
+
 }  // namespace
@@ -0,0 +1,752 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/iterable_util.h"
+#include "pb/codec/json_util.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/map_field_entry.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/packed_fixed_view.h"
+
+namespace pb::codec {
+
+// See json_serialize.h for a description of the JSON mapping.
+//
+// All the ParseJson...() functions take a |begin| pointer to the first
+// character of a JSON value (i.e., leading whitespace has already been
+// skipped), and return the following:
+//
+//   If the parse succeeds: Pointer to the first character just after the
+//   value.
+//
+//   If the parse fails: nullptr (and NOTE that the output argument may or may
+//   not have been modified!).
+
+// Returns a pointer just after |literal| if the text at |begin| starts with it,
+// or nullptr otherwise.
+[[nodiscard]] inline const char* ParseJsonLiteral(const char* begin,
+                                                  const char* end,
+                                                  std::string_view literal) {
+  if (static_cast<std::size_t>(end - begin) < literal.size() ||
+      std::memcmp(begin, literal.data(), literal.size()) != 0) {
+    return nullptr;
+  }
+  return begin + literal.size();
+}
+
+// Parses the four hex digits of a \uXXXX escape.
+[[nodiscard]] inline const char* ParseJsonHex4(const char* begin,
+                                               const char* end,
+                                               uint32_t& result) {
+  if ((end - begin) < 4) {
+    return nullptr;
+  }
+  result = 0;
+  for (int i = 0; i < 4; ++i) {
+    const char c = begin[i];
+    uint32_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = static_cast<uint32_t>(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      digit = static_cast<uint32_t>(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      digit = static_cast<uint32_t>(c - 'A' + 10);
+    } else {
+      return nullptr;
+    }
+    result = (result << 4) | digit;
+  }
+  return begin + 4;
+}
+
+// Parses the escape sequence at |begin| (just after the backslash), appending
+// the UTF-8 encoding of the character to |result|.
+[[nodiscard]] inline const char* ParseJsonEscape(const char* begin,
+                                                 const char* end,
+                                                 std::string& result) {
+  if (begin == end) {
+    return nullptr;
+  }
+  char c = *(begin++);
+  switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      break;
+    case 'b':
+      c = '\b';
+      break;
+    case 'f':
+      c = '\f';
+      break;
+    case 'n':
+      c = '\n';
+      break;
+    case 'r':
+      c = '\r';
+      break;
+    case 't':
+      c = '\t';
+      break;
+    case 'u': {
+      uint32_t code_point;
+      begin = ParseJsonHex4(begin, end, code_point);
+      if (!begin) {
+        return nullptr;
+      }
+      if (code_point >= 0xd800 && code_point <= 0xdbff) {
+        // A high surrogate must be followed by an escaped low surrogate.
+        uint32_t low;
+        if ((end - begin) < 2 || begin[0] != '\\' || begin[1] != 'u') {
+          return nullptr;
+        }
+        begin = ParseJsonHex4(begin + 2, end, low);
+        if (!begin || low < 0xdc00 || low > 0xdfff) {
+          return nullptr;
+        }
+        code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+      } else if (code_point >= 0xdc00 && code_point <= 0xdfff) {
+        return nullptr;  // Unpaired low surrogate.
+      }
+      char utf8[4];
+      result.append(utf8, AppendUtf8(code_point, utf8));
+      return begin;
+    }
+    default:
+      return nullptr;
+  }
+  result.push_back(c);
+  return begin;
+}
+
+// Parses the JSON string at |begin| (the opening quote), replacing the content
+// of |result| with its unescaped UTF-8 bytes.
+[[nodiscard]] inline const char* ParseJsonString(const char* begin,
+                                                 const char* end,
+                                                 std::string& result) {
+  if (begin == end || *begin != '"') {
+    return nullptr;
+  }
+  ++begin;
+  result.clear();
+  for (;;) {
+    const char* const run_end = FindFirstJsonSpecialByte(begin, end);
+    result.append(begin, run_end);
+    begin = run_end;
+    if (begin == end) {
+      return nullptr;  // Unterminated string.
+    }
+
+    const char c = *begin;
+    if (c == '"') {
+      return begin + 1;
+    } else if (c == '\\') {
+      begin = ParseJsonEscape(begin + 1, end, result);
+      if (!begin) {
+        return nullptr;
+      }
+    } else if (static_cast<uint8_t>(c) < 0x20) {
+      return nullptr;  // Control characters must be escaped.
+    } else {
+      const int length = GetUtf8SequenceLength(begin, end);
+      if (length == 0) {
+        return nullptr;
+      }
+      result.append(begin, static_cast<std::size_t>(length));
+      begin += length;
+    }
+  }
+}
+
+// Parses the JSON string at |begin| (the opening quote) without copying it, if
+// possible: If the string is all plain ASCII, |result| is set to point into the
+// input. Otherwise, the string is unescaped into |storage|, and |result| is set
+// to point to that.
+[[nodiscard]] inline const char* ParseJsonStringView(const char* begin,
+                                                     const char* end,
+                                                     std::string& storage,
+                                                     std::string_view& result) {
+  if (begin != end && *begin == '"') {
+    const char* const run_end = FindFirstJsonSpecialByte(begin + 1, end);
+    if (run_end != end && *run_end == '"') {
+      result = std::string_view(begin + 1,
+                                static_cast<std::size_t>(run_end - begin - 1));
+      return run_end + 1;
+    }
+  }
+  begin = ParseJsonString(begin, end, storage);
+  result = storage;
+  return begin;
+}
+
+// Skips over the JSON value at |begin|, validating its syntax.
+[[nodiscard]] inline const char* SkipJsonValue(const char* begin,
+                                               const char* end,
+                                               int nesting_level) {
+  if (begin == end) {
+    return nullptr;
+  }
+  switch (*begin) {
+    case '"': {
+      std::string unused;
+      return ParseJsonString(begin, end, unused);
+    }
+    case 't':
+      return ParseJsonLiteral(begin, end, "true");
+    case 'f':
+      return ParseJsonLiteral(begin, end, "false");
+    case 'n':
+      return ParseJsonLiteral(begin, end, "null");
+    case '[':
+    case '{': {
+      if (nesting_level >= kMaxMessageNestingDepth) {
+        return nullptr;
+      }
+      const bool is_object = (*begin == '{');
+      const char close = is_object ? '}' : ']';
+      begin = SkipJsonWhitespace(begin + 1, end);
+      if (begin != end && *begin == close) {
+        return begin + 1;
+      }
+      for (;;) {
+        if (is_object) {
+          std::string unused;
+          begin = ParseJsonString(begin, end, unused);
+          if (!begin) {
+            return nullptr;
+          }
+          begin = SkipJsonWhitespace(begin, end);
+          if (begin == end || *begin != ':') {
+            return nullptr;
+          }
+          begin = SkipJsonWhitespace(begin + 1, end);
+        }
+        begin = SkipJsonValue(begin, end, nesting_level + 1);
+        if (!begin) {
+          return nullptr;
+        }
+        begin = SkipJsonWhitespace(begin, end);
+        if (begin == end) {
+          return nullptr;
+        } else if (*begin == close) {
+          return begin + 1;
+        } else if (*begin != ',') {
+          return nullptr;
+        }
+        begin = SkipJsonWhitespace(begin + 1, end);
+      }
+    }
+    default:
+      return ScanJsonNumber(begin, end);
+  }
+}
+
+// Returns the base-10 order of magnitude of the JSON number token in the range
+// |begin| to |end| (e.g., 2 for "123.4", -2 for "0.01", and 5 for "1.5e5").
+// Zero is given the lowest possible order of magnitude.
+[[nodiscard]] inline int64_t GetJsonNumberMagnitude(const char* begin,
+                                                    const char* end) {
+  constexpr int64_t kExponentLimit = int64_t{1} << 40;
+  int64_t magnitude = 0;
+  bool seen_nonzero = false;
+  bool after_point = false;
+  for (; begin != end && *begin != 'e' && *begin != 'E'; ++begin) {
+    if (*begin == '.') {
+      after_point = true;
+    } else if (*begin == '-') {
+      continue;
+    } else if (!seen_nonzero) {
+      if (*begin != '0') {
+        seen_nonzero = true;
+      } else if (after_point) {
+        --magnitude;
+      }
+    } else if (!after_point) {
+      ++magnitude;
+    }
+  }
+  if (!seen_nonzero) {
+    return -kExponentLimit;
+  }
+  if (begin != end) {
+    ++begin;  // Skip the 'e' or 'E'.
+    const bool is_negative = (*begin == '-');
+    if (*begin == '-' || *begin == '+') {
+      ++begin;
+    }
+    int64_t exponent = 0;
+    for (; begin != end && exponent < kExponentLimit; ++begin) {
+      exponent = exponent * 10 + (*begin - '0');
+    }
+    magnitude += is_negative ? -exponent : exponent;
+  }
+  return magnitude;
+}
+
+// Parses the number in the range |begin| to |end|, which must be consumed
+// entirely. Returns false if the number is malformed or out of range.
+template <typename Number>
+[[nodiscard]] bool ParseJsonNumberToken(const char* begin,
+                                        const char* end,
+                                        Number& result) {
+  if (ScanJsonNumber(begin, end) != end) {
+    return false;
+  }
+  const auto [ptr, error] = std::from_chars(begin, end, result);
+  if (ptr != end) {
+    return false;
+  }
+  if constexpr (std::is_floating_point_v<Number>) {
+    // JSON allows values too tiny to be represented to be rounded to zero.
+    // Only values too large to be represented are errors.
+    if (error == std::errc::result_out_of_range &&
+        GetJsonNumberMagnitude(begin, end) < 0) {
+      result = (*begin == '-') ? -Number{0} : Number{0};
+      return true;
+    }
+  }
+  return error == std::errc();
+}
+
+// Parses a number that may or may not be quoted.
+template <typename Number>
+[[nodiscard]] const char* ParseJsonNumber(const char* begin,
+                                          const char* end,
+                                          Number& result) {
+  if (begin != end && *begin == '"') {
+    ++begin;
+    const char* const token_end = static_cast<const char*>(
+        std::memchr(begin, '"', static_cast<std::size_t>(end - begin)));
+    if (!token_end || !ParseJsonNumberToken(begin, token_end, result)) {
+      return nullptr;
+    }
+    return token_end + 1;
+  }
+  const char* const token_end = ScanJsonNumber(begin, end);
+  if (!token_end || !ParseJsonNumberToken(begin, token_end, result)) {
+    return nullptr;
+  }
+  return token_end;
+}
+
+// Native integers.
+template <typename Integral,
+          std::enable_if_t<std::is_integral_v<Integral> &&
+                               !std::is_same_v<Integral, bool>,
+                           int> = 0>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int,
+                                         Integral& result) {
+  return ParseJsonNumber(begin, end, result);
+}
+
+template <typename Bool, std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int,
+                                         Bool& result) {
+  if (const char* const next = ParseJsonLiteral(begin, end, "true")) {
+    result = true;
+    return next;
+  } else if (const char* const next = ParseJsonLiteral(begin, end, "false")) {
+    result = false;
+    return next;
+  }
+  return nullptr;
+}
+
+template <typename Enum, std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int,
+                                         Enum& result) {
+  std::underlying_type_t<Enum> value;
+  begin = ParseJsonNumber(begin, end, value);
+  if (begin) {
+    result = static_cast<Enum>(value);
+  }
+  return begin;
+}
+
+// ZigZag-encoded and fixed-size integer wrappers.
+template <
+    typename IntegerWrapper,
+    std::enable_if_t<std::is_same_v<IntegerWrapper, ::pb::sint32_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::sint64_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::fixed32_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::fixed64_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::sfixed32_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::sfixed64_t>,
+                     int> = 0>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int,
+                                         IntegerWrapper& result) {
+  decltype(result.value()) value;
+  begin = ParseJsonNumber(begin, end, value);
+  if (begin) {
+    result = IntegerWrapper(value);
+  }
+  return begin;
+}
+
+// Floating-point: Numbers, quoted numbers, or the quoted strings "NaN",
+// "Infinity" and "-Infinity".
+template <typename Float,
+          std::enable_if_t<std::is_same_v<Float, double> ||
+                               std::is_same_v<Float, float>,
+                           int> = 0>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int,
+                                         Float& result) {
+  if (const char* const next = ParseJsonLiteral(begin, end, "\"NaN\"")) {
+    result = std::numeric_limits<Float>::quiet_NaN();
+    return next;
+  } else if (const char* const next =
+                 ParseJsonLiteral(begin, end, "\"Infinity\"")) {
+    result = std::numeric_limits<Float>::infinity();
+    return next;
+  } else if (const char* const next =
+                 ParseJsonLiteral(begin, end, "\"-Infinity\"")) {
+    result = -std::numeric_limits<Float>::infinity();
+    return next;
+  }
+  return ParseJsonNumber(begin, end, result);
+}
+
+[[nodiscard]] inline const char* ParseJsonValue(const char* begin,
+                                                const char* end,
+                                                int,
+                                                std::string& result) {
+  return ParseJsonString(begin, end, result);
+}
+
+// A std::string_view field points into the JSON input, and so this only works
+// for strings that contain no escape sequences.
+[[nodiscard]] inline const char* ParseJsonValue(const char* begin,
+                                                const char* end,
+                                                int,
+                                                std::string_view& result) {
+  if (begin == end || *begin != '"') {
+    return nullptr;
+  }
+  ++begin;
+  const char* run_end = begin;
+  for (;;) {
+    run_end = FindFirstJsonSpecialByte(run_end, end);
+    if (run_end == end || *run_end == '\\' ||
+        static_cast<uint8_t>(*run_end) < 0x20) {
+      return nullptr;
+    } else if (*run_end == '"') {
+      break;
+    }
+    const int length = GetUtf8SequenceLength(run_end, end);
+    if (length == 0) {
+      return nullptr;
+    }
+    run_end += length;
+  }
+  result = std::string_view(begin, static_cast<std::size_t>(run_end - begin));
+  return run_end + 1;
+}
+
+// PackedFixedView fields point into wire-format bytes, and so cannot be parsed
+// from JSON.
+template <typename T>
+[[nodiscard]] const char* ParseJsonValue(const char*,
+                                         const char*,
+                                         int,
+                                         PackedFixedView<T>&) {
+  return nullptr;
+}
+
+// Forward declaration of ParseJsonValue(<nested message>).
+template <typename Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int nesting_level,
+                                         Message& message);
+
+// Adapter for optional fields.
+template <typename T>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int nesting_level,
+                                         std::optional<T>& result) {
+  if (!result) {
+    result.emplace();
+  }
+  return ParseJsonValue(begin, end, nesting_level, *result);
+}
+
+// Adapter for unique_ptr fields.
+template <typename T>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int nesting_level,
+                                         std::unique_ptr<T>& result) {
+  if (!result) {
+    result = std::make_unique<T>();
+  }
+  return ParseJsonValue(begin, end, nesting_level, *result);
+}
+
+// Adapter for shared_ptr fields. See MakeSharedForMerge().
+template <typename T>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int nesting_level,
+                                         std::shared_ptr<T>& result) {
+  if constexpr (std::is_const_v<T>) {
+    auto instance = MakeSharedForMerge(result);
+    begin = ParseJsonValue(begin, end, nesting_level, *instance);
+    if (begin) {
+      result = std::move(instance);
+    }
+    return begin;
+  } else {
+    if (!result) {
+      result = std::make_shared<T>();
+    }
+    return ParseJsonValue(begin, end, nesting_level, *result);
+  }
+}
+
+// Parses a map key, which is always quoted in JSON.
+template <typename Key>
+[[nodiscard]] const char* ParseJsonMapKey(const char* begin,
+                                          const char* end,
+                                          Key& result) {
+  if constexpr (std::is_same_v<Key, std::string> ||
+                std::is_same_v<Key, std::string_view>) {
+    return ParseJsonValue(begin, end, 0, result);
+  } else if constexpr (std::is_same_v<Key, bool>) {
+    if (const char* const next = ParseJsonLiteral(begin, end, "\"true\"")) {
+      result = true;
+      return next;
+    } else if (const char* const next =
+                   ParseJsonLiteral(begin, end, "\"false\"")) {
+      result = false;
+      return next;
+    }
+    return nullptr;
+  } else {
+    if (begin == end || *begin != '"') {
+      return nullptr;
+    }
+    return ParseJsonValue(begin, end, 0, result);
+  }
+}
+
+// Parses the JSON array or object at |begin| into the repeated or map field
+// |container|, appending elements. This supports all Containers that have:
+//
+//   iterator insert(const_iterator pos, value_type&& value);
+template <typename Container>
+[[nodiscard]] const char* ParseJsonRepeatedValues(const char* begin,
+                                                  const char* end,
+                                                  int nesting_level,
+                                                  Container& container) {
+  using ValueType = IterableValueType<Container>;
+  constexpr bool kIsMap = CouldBeAMapFieldEntry<ValueType>();
+  const char open = kIsMap ? '{' : '[';
+  const char close = kIsMap ? '}' : ']';
+  if (begin == end || *begin != open) {
+    return nullptr;
+  }
+  begin = SkipJsonWhitespace(begin + 1, end);
+  if (begin != end && *begin == close) {
+    return begin + 1;
+  }
+  for (;;) {
+    if constexpr (kIsMap) {
+      std::remove_const_t<typename ValueType::first_type> key{};
+      begin = ParseJsonMapKey(begin, end, key);
+      if (!begin) {
+        return nullptr;
+      }
+      begin = SkipJsonWhitespace(begin, end);
+      if (begin == end || *begin != ':') {
+        return nullptr;
+      }
+      begin = SkipJsonWhitespace(begin + 1, end);
+      typename ValueType::second_type value{};
+      begin = ParseJsonValue(begin, end, nesting_level, value);
+      if (!begin) {
+        return nullptr;
+      }
+      container.insert(container.end(),
+                       ValueType(std::move(key), std::move(value)));
+    } else {
+      ValueType value{};
+      begin = ParseJsonValue(begin, end, nesting_level, value);
+      if (!begin) {
+        return nullptr;
+      }
+      container.insert(container.end(), std::move(value));
+    }
+    begin = SkipJsonWhitespace(begin, end);
+    if (begin == end) {
+      return nullptr;
+    } else if (*begin == close) {
+      return begin + 1;
+    } else if (*begin != ',') {
+      return nullptr;
+    }
+    begin = SkipJsonWhitespace(begin + 1, end);
+  }
+}
+
+// Detects the members that a JSON null resets: std::optional, std::unique_ptr
+// and std::shared_ptr.
+template <typename T>
+struct IsNullableJsonMember : std::false_type {};
+
+template <typename T>
+struct IsNullableJsonMember<std::optional<T>> : std::true_type {};
+
+template <typename T>
+struct IsNullableJsonMember<std::unique_ptr<T>> : std::true_type {};
+
+template <typename T>
+struct IsNullableJsonMember<std::shared_ptr<T>> : std::true_type {};
+
+// Parses the value at |begin| for |TheField|. A JSON null resets optional and
+// pointer fields, and leaves all other fields unchanged.
+template <typename Message, typename TheField>
+[[nodiscard]] const char* ParseJsonValueForField(const char* begin,
+                                                 const char* end,
+                                                 int nesting_level,
+                                                 Message& message) {
+  using Member = typename TheField::Member;
+  Member& member = TheField::GetMutableMemberReferenceIn(message);
+  if (*begin == 'n') {
+    const char* const next = ParseJsonLiteral(begin, end, "null");
+    if constexpr (IsNullableJsonMember<Member>::value) {
+      if (next) {
+        member = Member();
+      }
+    }
+    return next;
+  }
+  if constexpr (IsRepeatedField<TheField>()) {
+    return ParseJsonRepeatedValues(begin, end, nesting_level, member);
+  } else {
+    return ParseJsonValue(begin, end, nesting_level, member);
+  }
+}
+
+// The compile-time look-up tables used to find the field for a JSON key.
+template <typename Message>
+struct JsonFieldTable {
+  using Fields = typename Message::ProtobufFields;
+  using FieldParser = const char* (*)(const char*, const char*, int, Message&);
+
+  template <std::size_t... kIndices>
+  static constexpr auto MakeKeys(std::index_sequence<kIndices...>) {
+    return std::array<std::string_view, sizeof...(kIndices)>{
+        GetJsonKey<typename Fields::template FieldAt<kIndices>>()...};
+  }
+
+  template <std::size_t... kIndices>
+  static constexpr auto MakeParsers(std::index_sequence<kIndices...>) {
+    return std::array<FieldParser, sizeof...(kIndices)>{
+        &ParseJsonValueForField<
+            Message, typename Fields::template FieldAt<kIndices>>...};
+  }
+
+  static constexpr auto kPerfectHash = MakeJsonKeyPerfectHash(
+      MakeKeys(std::make_index_sequence<Fields::kFieldCount>()));
+  static_assert(kPerfectHash.seed != UINT32_MAX,
+                "JSON keys (field names, or numbers) must be unique.");
+
+  static constexpr auto kParsers =
+      MakeParsers(std::make_index_sequence<Fields::kFieldCount>());
+};
+
+// Nested Messages: Parsed from JSON objects. Keys that do not match any field
+// are skipped.
+template <
+    typename Message,
+    std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>, int>>
+[[nodiscard]] const char* ParseJsonValue(const char* begin,
+                                         const char* end,
+                                         int nesting_level,
+                                         Message& message) {
+  using Table = JsonFieldTable<Message>;
+
+  if (nesting_level >= kMaxMessageNestingDepth) {
+    return nullptr;
+  }
+  ++nesting_level;
+
+  if (begin == end || *begin != '{') {
+    return nullptr;
+  }
+  begin = SkipJsonWhitespace(begin + 1, end);
+  if (begin != end && *begin == '}') {
+    return begin + 1;
+  }
+  std::string key_storage;
+  for (;;) {
+    std::string_view key;
+    begin = ParseJsonStringView(begin, end, key_storage, key);
+    if (!begin) {
+      return nullptr;
+    }
+    begin = SkipJsonWhitespace(begin, end);
+    if (begin == end || *begin != ':') {
+      return nullptr;
+    }
+    begin = SkipJsonWhitespace(begin + 1, end);
+    if (begin == end) {
+      return nullptr;
+    }
+
+    const int index = Table::kPerfectHash.FindIndex(key);
+    if (index >= 0) {
+      begin = Table::kParsers[static_cast<std::size_t>(index)](
+          begin, end, nesting_level, message);
+    } else {
+      begin = SkipJsonValue(begin, end, nesting_level);
+    }
+    if (!begin) {
+      return nullptr;
+    }
+
+    begin = SkipJsonWhitespace(begin, end);
+    if (begin == end) {
+      return nullptr;
+    } else if (*begin == '}') {
+      return begin + 1;
+    } else if (*begin != ',') {
+      return nullptr;
+    }
+    begin = SkipJsonWhitespace(begin + 1, end);
+  }
+}
+
+}  // namespace pb::codec
@@ -0,0 +1,368 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/iterable_util.h"
+#include "pb/codec/json_util.h"
+#include "pb/codec/map_field_entry.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb::codec {
+
+// Source: https://developers.google.com/protocol-buffers/docs/proto3#json
+//
+// The mapping follows the proto3 JSON mapping, with these differences:
+//
+//   1. Object keys are the names given to the pb::Field<>'s, or the field
+//      numbers (as decimal strings) for fields without names.
+//   2. Enums are written as numbers, since their value names are not known.
+//   3. std::string and std::string_view are written as JSON strings (rather
+//      than base64), and so must contain valid UTF-8.
+//   4. Like the wire format, non-optional fields are always written, even if
+//      they hold default values.
+
+// The output buffer for the WriteJson...() functions: A std::string that is
+// written to through a raw cursor, and grown geometrically only when needed.
+// Re-using the same std::string across many serializations means its capacity
+// is re-used too, avoiding re-allocations.
+class JsonOutput {
+ public:
+  // Replaces the content of |out|.
+  explicit JsonOutput(std::string& out) : out_(out) {
+    out_.resize(out_.capacity());
+    cursor_ = out_.data();
+    limit_ = cursor_ + out_.size();
+  }
+
+  JsonOutput(const JsonOutput&) = delete;
+  JsonOutput& operator=(const JsonOutput&) = delete;
+
+  // Returns a cursor at which at least |count| bytes may be written. The caller
+  // must then call Commit() with the position just after the last byte it
+  // wrote.
+  [[nodiscard]] char* Reserve(std::size_t count) {
+    if (static_cast<std::size_t>(limit_ - cursor_) < count) {
+      Grow(count);
+    }
+    return cursor_;
+  }
+  void Commit(char* new_cursor) { cursor_ = new_cursor; }
+
+  void Append(char c) { *Reserve(1) = c, ++cursor_; }
+  void Append(std::string_view s) {
+    char* const cursor = Reserve(s.size());
+    std::memcpy(cursor, s.data(), s.size());
+    cursor_ = cursor + s.size();
+  }
+
+  // Marks the output as invalid (e.g., because a string was not valid UTF-8).
+  void Fail() { ok_ = false; }
+
+  // Truncates the std::string to the bytes written, and returns false if Fail()
+  // was called.
+  [[nodiscard]] bool Finish() {
+    out_.resize(static_cast<std::size_t>(cursor_ - out_.data()));
+    return ok_;
+  }
+
+ private:
+  void Grow(std::size_t count) {
+    const auto offset = static_cast<std::size_t>(cursor_ - out_.data());
+    out_.resize(std::max(out_.size() * 2, offset + count));
+    cursor_ = out_.data() + offset;
+    limit_ = out_.data() + out_.size();
+  }
+
+  std::string& out_;
+  char* cursor_;
+  char* limit_;
+  bool ok_ = true;
+};
+
+// The most bytes any one number can take up, including the quotes around
+// 64-bit integers.
+constexpr std::size_t kMaxJsonNumberSize = 32;
+
+// Writes |value| as a bare JSON number, or as a quoted one.
+template <typename Number>
+void WriteJsonNumber(Number value, bool quoted, JsonOutput& out) {
+  char* cursor = out.Reserve(kMaxJsonNumberSize);
+  if (quoted) {
+    *(cursor++) = '"';
+  }
+  cursor = std::to_chars(cursor, cursor + kMaxJsonNumberSize - 2, value).ptr;
+  if (quoted) {
+    *(cursor++) = '"';
+  }
+  out.Commit(cursor);
+}
+
+// Native integers: 64-bit integers are written as quoted strings (as the
+// proto3 mapping requires, since many JSON parsers only have doubles).
+template <typename Integral,
+          std::enable_if_t<std::is_integral_v<Integral> &&
+                               !std::is_same_v<Integral, bool>,
+                           int> = 0>
+void WriteJsonValue(Integral value, JsonOutput& out) {
+  WriteJsonNumber(value, sizeof(Integral) > sizeof(int32_t), out);
+}
+
+template <typename Bool, std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
+void WriteJsonValue(Bool value, JsonOutput& out) {
+  out.Append(value ? std::string_view("true") : std::string_view("false"));
+}
+
+template <typename Enum, std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
+void WriteJsonValue(Enum value, JsonOutput& out) {
+  WriteJsonValue(static_cast<std::underlying_type_t<Enum>>(value), out);
+}
+
+// ZigZag-encoded and fixed-size integer wrappers: Same as the native integers.
+template <
+    typename IntegerWrapper,
+    std::enable_if_t<std::is_same_v<IntegerWrapper, ::pb::sint32_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::sint64_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::fixed32_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::fixed64_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::sfixed32_t> ||
+                         std::is_same_v<IntegerWrapper, ::pb::sfixed64_t>,
+                     int> = 0>
+void WriteJsonValue(IntegerWrapper value, JsonOutput& out) {
+  WriteJsonValue(value.value(), out);
+}
+
+// Floating-point: Written in the shortest form that round-trips. Non-finite
+// values are written as the quoted strings "NaN", "Infinity" and "-Infinity".
+template <typename Float,
+          std::enable_if_t<std::is_same_v<Float, double> ||
+                               std::is_same_v<Float, float>,
+                           int> = 0>
+void WriteJsonValue(Float value, JsonOutput& out) {
+  if (std::isfinite(value)) {
+    WriteJsonNumber(value, false, out);
+  } else if (std::isnan(value)) {
+    out.Append("\"NaN\"");
+  } else {
+    out.Append(value > 0 ? std::string_view("\"Infinity\"")
+                         : std::string_view("\"-Infinity\""));
+  }
+}
+
+// Writes the |string| in quotes, escaping only what must be escaped. The
+// |string| must be valid UTF-8, or else the output is marked as failed.
+inline void WriteJsonString(std::string_view string, JsonOutput& out) {
+  char* cursor = out.Reserve(string.size() * kMaxJsonEscapedBytesPerByte + 2);
+  *(cursor++) = '"';
+  const char* begin = string.data();
+  const char* const end = begin + string.size();
+  while (begin != end) {
+    const char* const run_end = FindFirstJsonSpecialByte(begin, end);
+    std::memcpy(cursor, begin, static_cast<std::size_t>(run_end - begin));
+    cursor += run_end - begin;
+    begin = run_end;
+    if (begin == end) {
+      break;
+    }
+
+    const char c = *begin;
+    if (static_cast<uint8_t>(c) >= 0x80) {
+      const int length = GetUtf8SequenceLength(begin, end);
+      if (length == 0) {
+        out.Fail();
+        break;
+      }
+      std::memcpy(cursor, begin, static_cast<std::size_t>(length));
+      cursor += length;
+      begin += length;
+      continue;
+    }
+
+    *(cursor++) = '\\';
+    switch (c) {
+      case '"':
+      case '\\':
+        *(cursor++) = c;
+        break;
+      case '\b':
+        *(cursor++) = 'b';
+        break;
+      case '\f':
+        *(cursor++) = 'f';
+        break;
+      case '\n':
+        *(cursor++) = 'n';
+        break;
+      case '\r':
+        *(cursor++) = 'r';
+        break;
+      case '\t':
+        *(cursor++) = 't';
+        break;
+      default: {
+        constexpr char kHexDigits[] = "0123456789abcdef";
+        const auto byte = static_cast<uint8_t>(c);
+        *(cursor++) = 'u';
+        *(cursor++) = '0';
+        *(cursor++) = '0';
+        *(cursor++) = kHexDigits[byte >> 4];
+        *(cursor++) = kHexDigits[byte & 0xf];
+        break;
+      }
+    }
+    ++begin;
+  }
+  *(cursor++) = '"';
+  out.Commit(cursor);
+}
+
+template <typename String,
+          std::enable_if_t<std::is_same_v<String, std::string> ||
+                               std::is_same_v<String, std::string_view>,
+                           int> = 0>
+void WriteJsonValue(const String& string, JsonOutput& out) {
+  WriteJsonString(string, out);
+}
+
+// Forward declaration of WriteJsonValue(<nested message>).
+template <typename Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+void WriteJsonValue(const Message& message, JsonOutput& out);
+
+// Shared Messages: The same as nested messages. No memoization is done.
+template <typename Message>
+void WriteJsonValue(SharedMessageRef<Message> ref, JsonOutput& out) {
+  WriteJsonValue(ref.message, out);
+}
+
+// Map keys: JSON object keys must be strings, so integer and bool keys are
+// quoted.
+template <typename Key>
+void WriteJsonMapKey(const Key& key, JsonOutput& out) {
+  if constexpr (std::is_same_v<Key, std::string> ||
+                std::is_same_v<Key, std::string_view>) {
+    WriteJsonString(key, out);
+  } else if constexpr (std::is_same_v<Key, bool>) {
+    out.Append(key ? std::string_view("\"true\"")
+                   : std::string_view("\"false\""));
+  } else if constexpr (std::is_integral_v<Key>) {
+    WriteJsonNumber(key, true, out);
+  } else {
+    WriteJsonNumber(key.value(), true, out);
+  }
+}
+
+// Writes the value of one |TheField| from the |message|.
+template <typename Message, typename TheField>
+void WriteJsonFieldValue(const Message& message, JsonOutput& out) {
+  const auto& member = TheField::GetMemberReferenceIn(message);
+  using ValueType = IterableValueType<typename TheField::Member>;
+  if constexpr (CouldBeAMapFieldEntry<ValueType>()) {
+    out.Append('{');
+    bool is_first = true;
+    for (const auto& entry : member) {
+      if (!is_first) {
+        out.Append(',');
+      }
+      is_first = false;
+      WriteJsonMapKey(entry.first, out);
+      out.Append(':');
+      WriteJsonValue(entry.second, out);
+    }
+    out.Append('}');
+  } else {
+    out.Append('[');
+    bool is_first = true;
+    for (auto it = std::begin(member), end = std::end(member); it != end;
+         ++it) {
+      // Note: The static_cast<ValueType&>(*it) below is necessary to adapt
+      // iterators that use proxy references (e.g.,
+      // std::vector<bool>::const_iterator).
+      const ValueType& element = static_cast<const ValueType&>(*it);
+      if (IsStoringOneValue(element)) {
+        if (!is_first) {
+          out.Append(',');
+        }
+        is_first = false;
+        WriteJsonValue(GetTheOneValue(element), out);
+      }
+    }
+    out.Append(']');
+  }
+}
+
+// See comments for WriteJsonFields<Message, ...>() below. This is the base
+// case, which terminates the recursion.
+template <typename Message>
+void WriteJsonFields(const Message&, FieldList<>, bool, JsonOutput&) {}
+
+// This type-system-tail-recursive function walks the fields of |message|,
+// writing each field's key+value. |is_first| is true if no field has been
+// written yet (i.e., no comma separator is needed).
+template <typename Message, typename FirstField, typename... TheRemainingFields>
+void WriteJsonFields(const Message& message,
+                     FieldList<FirstField, TheRemainingFields...>,
+                     bool is_first,
+                     JsonOutput& out) {
+  constexpr std::string_view kKey = GetJsonKey<FirstField>();
+  static_assert(IsPlainJsonKey(kKey),
+                "Field names must not require escaping in JSON.");
+
+  bool has_value;
+  if constexpr (IsRepeatedField<FirstField>()) {
+    has_value = true;
+  } else {
+    has_value = IsStoringOneValue(FirstField::GetMemberReferenceIn(message));
+  }
+
+  if (has_value) {
+    // Write the separator, quoted key and colon in one shot.
+    char* cursor = out.Reserve(kKey.size() + 4);
+    if (!is_first) {
+      *(cursor++) = ',';
+    }
+    *(cursor++) = '"';
+    std::memcpy(cursor, kKey.data(), kKey.size());
+    cursor += kKey.size();
+    *(cursor++) = '"';
+    *(cursor++) = ':';
+    out.Commit(cursor);
+
+    if constexpr (IsRepeatedField<FirstField>()) {
+      WriteJsonFieldValue<Message, FirstField>(message, out);
+    } else {
+      WriteJsonValue(GetTheOneValue(FirstField::GetMemberReferenceIn(message)),
+                     out);
+    }
+  }
+
+  WriteJsonFields(message, FieldList<TheRemainingFields...>{},
+                  is_first && !has_value, out);
+}
+
+// Nested Messages: Written as JSON objects.
+template <
+    typename Message,
+    std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>, int>>
+void WriteJsonValue(const Message& message, JsonOutput& out) {
+  out.Append('{');
+  WriteJsonFields(message, typename Message::ProtobufFields{}, true, out);
+  out.Append('}');
+}
+
+}  // namespace pb::codec
@@ -0,0 +1,331 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace pb::codec {
+
+// Source: https://www.rfc-editor.org/rfc/rfc8259 (JSON) and
+// https://www.rfc-editor.org/rfc/rfc3629 (UTF-8).
+
+// The maximum number of output bytes for one input byte of a string being
+// escaped (e.g., a control character becomes "\u001f").
+constexpr int kMaxJsonEscapedBytesPerByte = 6;
+
+// Returns true if |c| must be escaped in a JSON string, or is the start of a
+// multi-byte UTF-8 sequence (which must be validated).
+[[nodiscard]] constexpr bool IsJsonSpecialByte(char c) {
+  const auto byte = static_cast<uint8_t>(c);
+  return byte < 0x20 || byte >= 0x80 || c == '"' || c == '\\';
+}
+
+// Returns a pointer to the first byte in the range |begin| to |end| for which
+// IsJsonSpecialByte() is true, or |end| if there is none. Since strings are
+// usually mostly plain ASCII, this checks 16 bytes at a time where SIMD
+// instructions are available.
+[[nodiscard]] inline const char* FindFirstJsonSpecialByte(const char* begin,
+                                                          const char* end) {
+#if defined(__SSE2__)
+  const __m128i kQuote = _mm_set1_epi8('"');
+  const __m128i kBackslash = _mm_set1_epi8('\\');
+  const __m128i kSpace = _mm_set1_epi8(0x20);
+  while ((end - begin) >= 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    // Note: The signed less-than comparison is true for both the control
+    // characters (0x00 to 0x1f) and the non-ASCII bytes (0x80 to 0xff, which
+    // are negative).
+    const __m128i special =
+        _mm_or_si128(_mm_cmplt_epi8(chunk, kSpace),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, kQuote),
+                                  _mm_cmpeq_epi8(chunk, kBackslash)));
+    const int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return begin + __builtin_ctz(static_cast<unsigned int>(mask));
+    }
+    begin += 16;
+  }
+#endif
+  while (begin != end && !IsJsonSpecialByte(*begin)) {
+    ++begin;
+  }
+  return begin;
+}
+
+// Returns the length of the well-formed UTF-8 sequence for one code point at
+// |begin|, or 0 if the bytes are not well-formed (e.g., truncated, overlong,
+// surrogate, or out-of-range). |begin| must be before |end|.
+[[nodiscard]] constexpr int GetUtf8SequenceLength(const char* begin,
+                                                  const char* end) {
+  const auto lead = static_cast<uint8_t>(begin[0]);
+  if (lead < 0x80) {
+    return 1;
+  }
+  int length = 0;
+  uint8_t second_min = 0x80;
+  uint8_t second_max = 0xbf;
+  if (lead >= 0xc2 && lead <= 0xdf) {
+    length = 2;
+  } else if (lead >= 0xe0 && lead <= 0xef) {
+    length = 3;
+    if (lead == 0xe0) {
+      second_min = 0xa0;  // Overlong.
+    } else if (lead == 0xed) {
+      second_max = 0x9f;  // Surrogates.
+    }
+  } else if (lead >= 0xf0 && lead <= 0xf4) {
+    length = 4;
+    if (lead == 0xf0) {
+      second_min = 0x90;  // Overlong.
+    } else if (lead == 0xf4) {
+      second_max = 0x8f;  // Beyond U+10FFFF.
+    }
+  } else {
+    return 0;
+  }
+  if ((end - begin) < length) {
+    return 0;
+  }
+  const auto second = static_cast<uint8_t>(begin[1]);
+  if (second < second_min || second > second_max) {
+    return 0;
+  }
+  for (int i = 2; i < length; ++i) {
+    if ((static_cast<uint8_t>(begin[i]) & 0xc0) != 0x80) {
+      return 0;
+    }
+  }
+  return length;
+}
+
+// Returns true if the range |begin| to |end| is entirely well-formed UTF-8.
+[[nodiscard]] inline bool IsValidUtf8(const char* begin, const char* end) {
+  while (begin != end) {
+    begin = FindFirstJsonSpecialByte(begin, end);
+    if (begin == end) {
+      break;
+    }
+    const int length = GetUtf8SequenceLength(begin, end);
+    if (length == 0) {
+      return false;
+    }
+    begin += length;
+  }
+  return true;
+}
+
+// Encodes |code_point| as UTF-8 into |out|, which must have space for 4 bytes,
+// and returns a pointer just after the last byte written.
+[[nodiscard]] inline char* AppendUtf8(uint32_t code_point, char* out) {
+  if (code_point < 0x80) {
+    *(out++) = static_cast<char>(code_point);
+  } else if (code_point < 0x800) {
+    *(out++) = static_cast<char>(0xc0 | (code_point >> 6));
+    *(out++) = static_cast<char>(0x80 | (code_point & 0x3f));
+  } else if (code_point < 0x10000) {
+    *(out++) = static_cast<char>(0xe0 | (code_point >> 12));
+    *(out++) = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    *(out++) = static_cast<char>(0x80 | (code_point & 0x3f));
+  } else {
+    *(out++) = static_cast<char>(0xf0 | (code_point >> 18));
+    *(out++) = static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+    *(out++) = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    *(out++) = static_cast<char>(0x80 | (code_point & 0x3f));
+  }
+  return out;
+}
+
+[[nodiscard]] constexpr bool IsJsonWhitespace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+[[nodiscard]] inline const char* SkipJsonWhitespace(const char* begin,
+                                                    const char* end) {
+  while (begin != end && IsJsonWhitespace(*begin)) {
+    ++begin;
+  }
+  return begin;
+}
+
+// Returns a pointer just after the JSON number token at |begin|, or nullptr if
+// the text at |begin| does not follow the JSON number grammar.
+[[nodiscard]] inline const char* ScanJsonNumber(const char* begin,
+                                                const char* end) {
+  const auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+  if (begin != end && *begin == '-') {
+    ++begin;
+  }
+  if (begin == end || !is_digit(*begin)) {
+    return nullptr;
+  }
+  if (*begin == '0') {
+    ++begin;  // Leading zeros are not allowed.
+  } else {
+    while (begin != end && is_digit(*begin)) {
+      ++begin;
+    }
+  }
+  if (begin != end && *begin == '.') {
+    ++begin;
+    if (begin == end || !is_digit(*begin)) {
+      return nullptr;
+    }
+    while (begin != end && is_digit(*begin)) {
+      ++begin;
+    }
+  }
+  if (begin != end && (*begin == 'e' || *begin == 'E')) {
+    ++begin;
+    if (begin != end && (*begin == '+' || *begin == '-')) {
+      ++begin;
+    }
+    if (begin == end || !is_digit(*begin)) {
+      return nullptr;
+    }
+    while (begin != end && is_digit(*begin)) {
+      ++begin;
+    }
+  }
+  return begin;
+}
+
+// ------------------------------------------------
+
+// Compile-time perfect hashing of a message's JSON keys, so that a parser can
+// find the field for a key with one hash computation, one table look-up, and
+// one string comparison.
+
+// FNV-1a, with a |seed| to search for a collision-free variant.
+[[nodiscard]] constexpr uint32_t HashJsonKey(std::string_view key,
+                                             uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (const char c : key) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Maps the |kKeyCount| keys to their index in the original array. The table
+// has at least twice as many slots as there are keys, to make finding a seed
+// that maps each key to a distinct slot quick.
+template <std::size_t kKeyCount>
+struct JsonKeyPerfectHash {
+  static constexpr std::size_t kSlotCount = [] {
+    std::size_t count = 1;
+    while (count < 2 * kKeyCount) {
+      count *= 2;
+    }
+    return count;
+  }();
+  static constexpr int16_t kEmptySlot = -1;
+
+  std::array<std::string_view, kKeyCount> keys{};
+  uint32_t seed = 0;
+  std::array<int16_t, kSlotCount> slots{};
+
+  // Returns the index of the given |key|, or -1 if it is not one of the keys.
+  [[nodiscard]] constexpr int FindIndex(std::string_view key) const {
+    const int16_t index = slots[HashJsonKey(key, seed) & (kSlotCount - 1)];
+    if (index >= 0 && keys[static_cast<std::size_t>(index)] == key) {
+      return index;
+    }
+    return -1;
+  }
+};
+
+// Searches for a seed that produces a perfect hash of the given |keys|. The
+// keys must be distinct. If no seed was found (extremely unlikely), the
+// returned seed will be UINT32_MAX.
+template <std::size_t kKeyCount>
+[[nodiscard]] constexpr JsonKeyPerfectHash<kKeyCount> MakeJsonKeyPerfectHash(
+    const std::array<std::string_view, kKeyCount>& keys) {
+  static_assert(kKeyCount < 0x8000);
+  using PerfectHash = JsonKeyPerfectHash<kKeyCount>;
+  PerfectHash result{};
+  result.keys = keys;
+  for (uint32_t seed = 0; seed < 4096; ++seed) {
+    for (auto& slot : result.slots) {
+      slot = PerfectHash::kEmptySlot;
+    }
+    bool collision = false;
+    for (std::size_t i = 0; i < kKeyCount && !collision; ++i) {
+      const uint32_t hash = HashJsonKey(keys[i], seed);
+      auto& slot = result.slots[hash & (PerfectHash::kSlotCount - 1)];
+      if (slot == PerfectHash::kEmptySlot) {
+        slot = static_cast<int16_t>(i);
+      } else {
+        collision = true;
+      }
+    }
+    if (!collision) {
+      result.seed = seed;
+      return result;
+    }
+  }
+  result.seed = UINT32_MAX;
+  return result;
+}
+
+// Generates the decimal digits of a positive |kNumber| at compile time, for
+// use as the JSON key of a field without a name.
+template <int32_t kNumber>
+struct FieldNumberAsJsonKey {
+  static_assert(kNumber > 0);
+
+  static constexpr std::array<char, 10> kDigits = [] {
+    std::array<char, 10> digits{};
+    int32_t n = kNumber;
+    int count = 0;
+    for (int32_t x = n; x > 0; x /= 10) {
+      ++count;
+    }
+    for (int i = count - 1; i >= 0; --i) {
+      digits[static_cast<std::size_t>(i)] = static_cast<char>('0' + (n % 10));
+      n /= 10;
+    }
+    return digits;
+  }();
+
+  static constexpr std::string_view kValue = [] {
+    std::size_t length = 0;
+    while (length < kDigits.size() && kDigits[length] != '\0') {
+      ++length;
+    }
+    return std::string_view(kDigits.data(), length);
+  }();
+};
+
+// Returns the JSON key for a |Field|: Its name, if it has one; otherwise, its
+// field number as a decimal string.
+template <typename Field>
+[[nodiscard]] constexpr std::string_view GetJsonKey() {
+  if constexpr (Field::GetName().empty()) {
+    return FieldNumberAsJsonKey<Field::GetFieldNumber()>::kValue;
+  } else {
+    return Field::GetName();
+  }
+}
+
+// Returns true if the |key| can be written to JSON output without escaping.
+[[nodiscard]] constexpr bool IsPlainJsonKey(std::string_view key) {
+  for (const char c : key) {
+    if (IsJsonSpecialByte(c)) {
+      return false;
+    }
+  }
+  return !key.empty();
+}
+
+}  // namespace pb::codec
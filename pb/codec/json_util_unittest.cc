@@ -0,0 +1,117 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/codec/json_util.h"
+
+#include <array>
+#include <string>
+#include <string_view>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+
+namespace pb::codec {
+namespace {
+
+TEST(JsonUtilTest, FindsFirstSpecialByte) {
+  // Check every position, both within and beyond the first 16-byte chunk.
+  for (const char special : {'"', '\\', '\n', '\x01', '\x1f', '\x80', '\xff'}) {
+    for (std::size_t i = 0; i < 40; ++i) {
+      std::string text(40, 'a');
+      text[i] = special;
+      EXPECT_EQ(text.data() + i,
+                FindFirstJsonSpecialByte(text.data(), text.data() + 40))
+          << "special=" << static_cast<int>(special) << ", i=" << i;
+    }
+  }
+  const std::string plain(33, '~');
+  EXPECT_EQ(plain.data() + plain.size(),
+            FindFirstJsonSpecialByte(plain.data(),
+                                     plain.data() + plain.size()));
+}
+
+TEST(JsonUtilTest, ValidatesUtf8) {
+  const auto is_valid = [](std::string_view s) {
+    return IsValidUtf8(s.data(), s.data() + s.size());
+  };
+  EXPECT_TRUE(is_valid(""));
+  EXPECT_TRUE(is_valid("plain ascii"));
+  EXPECT_TRUE(is_valid("\xc3\xa9"));          // U+00E9
+  EXPECT_TRUE(is_valid("\xe2\x82\xac"));      // U+20AC
+  EXPECT_TRUE(is_valid("\xf0\x9f\x98\x80"));  // U+1F600
+  EXPECT_TRUE(is_valid("\xf4\x8f\xbf\xbf"));  // U+10FFFF
+
+  EXPECT_FALSE(is_valid("\x80"));              // Unexpected continuation.
+  EXPECT_FALSE(is_valid("\xc3"));              // Truncated.
+  EXPECT_FALSE(is_valid("\xc0\xaf"));          // Overlong.
+  EXPECT_FALSE(is_valid("\xe0\x80\xaf"));      // Overlong.
+  EXPECT_FALSE(is_valid("\xed\xa0\x80"));      // Surrogate.
+  EXPECT_FALSE(is_valid("\xf4\x90\x80\x80"));  // Beyond U+10FFFF.
+  EXPECT_FALSE(is_valid("\xe2\x82x"));         // Bad continuation.
+}
+
+TEST(JsonUtilTest, EncodesUtf8) {
+  char buffer[4];
+  for (const uint32_t code_point : {0x41u, 0xe9u, 0x20acu, 0x1f600u}) {
+    char* const end = AppendUtf8(code_point, buffer);
+    EXPECT_EQ(static_cast<int>(end - buffer),
+              GetUtf8SequenceLength(buffer, end));
+  }
+  EXPECT_EQ("\xf0\x9f\x98\x80",
+            std::string(buffer, AppendUtf8(0x1f600u, buffer)));
+}
+
+TEST(JsonUtilTest, ScansNumbers) {
+  const auto scan_length = [](std::string_view s) -> int {
+    const char* const end = ScanJsonNumber(s.data(), s.data() + s.size());
+    return end ? static_cast<int>(end - s.data()) : -1;
+  };
+  EXPECT_EQ(1, scan_length("0"));
+  EXPECT_EQ(2, scan_length("-7,"));
+  EXPECT_EQ(7, scan_length("12.5e+3}"));
+  EXPECT_EQ(1, scan_length("01"));  // Stops after the leading zero.
+  EXPECT_EQ(-1, scan_length("-"));
+  EXPECT_EQ(-1, scan_length("1."));
+  EXPECT_EQ(-1, scan_length(".5"));
+  EXPECT_EQ(-1, scan_length("1e"));
+  EXPECT_EQ(-1, scan_length("+1"));
+}
+
+TEST(JsonUtilTest, BuildsPerfectHashOfKeys) {
+  constexpr std::array<std::string_view, 5> kKeys = {"id", "name", "email",
+                                                     "phones", "1"};
+  constexpr auto kHash = MakeJsonKeyPerfectHash(kKeys);
+  static_assert(kHash.seed != UINT32_MAX);
+  static_assert(kHash.FindIndex("email") == 2);
+  for (int i = 0; i < static_cast<int>(kKeys.size()); ++i) {
+    EXPECT_EQ(i, kHash.FindIndex(kKeys[static_cast<std::size_t>(i)]));
+  }
+  EXPECT_EQ(-1, kHash.FindIndex(""));
+  EXPECT_EQ(-1, kHash.FindIndex("nam"));
+  EXPECT_EQ(-1, kHash.FindIndex("phone"));
+
+  constexpr auto kEmptyHash =
+      MakeJsonKeyPerfectHash(std::array<std::string_view, 0>{});
+  EXPECT_EQ(-1, kEmptyHash.FindIndex("id"));
+}
+
+struct Sample {
+  int a;
+  int b;
+
+  static constexpr char kBName[] = "bee";
+  using ProtobufFields =
+      FieldList<Field<&Sample::a, 1234567>, Field<&Sample::b, 2, kBName>>;
+};
+
+TEST(JsonUtilTest, UsesNamesOrNumbersAsKeys) {
+  static_assert(GetJsonKey<Sample::ProtobufFields::FieldAt<0>>() == "1234567");
+  static_assert(GetJsonKey<Sample::ProtobufFields::FieldAt<1>>() == "bee");
+  static_assert(IsPlainJsonKey("sampleRate"));
+  static_assert(!IsPlainJsonKey(""));
+  static_assert(!IsPlainJsonKey("a\"b"));
+}
+
+}  // namespace
+}  // namespace pb::codec
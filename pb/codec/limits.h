@@ -17,6 +17,10 @@ constexpr int32_t kMaxSerializedSize = 64 << 20;  // 64 megabytes.
 // Maximum message nesting depth.
 constexpr int kMaxMessageNestingDepth = 100;
 
+// Minimum number of readable bytes that must follow the end of the input when
+// parsing with InputBounds::kPadded. See pb::kParseSlopBytes.
+constexpr int32_t kParseSlopBytes = 16;
+
 // Returns true if |x| is within the range of valid field numbers.
 [[nodiscard]] constexpr bool IsValidFieldNumber(int32_t x) {
   // According to Google's public documentation, field numbers must be in the
@@ -0,0 +1,198 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace pb::codec {
+
+// A packed repeated varint field whose payload is at least this many bytes is
+// decoded by multiple threads, if there are multiple cores (see
+// ComputeParallelVarintChunkCount()). Below this, the cost of starting threads
+// outweighs the gain.
+constexpr int32_t kMinParallelPackedVarintBytes = 1 << 20;
+
+// Each thread decodes at least this many bytes of the payload.
+constexpr int32_t kMinParallelVarintChunkBytes = 256 << 10;
+
+namespace internal {
+
+inline std::atomic<int> g_max_parallel_varint_threads{0};
+
+}  // namespace internal
+
+// Sets the most threads (including the calling thread) that a parse may use to
+// decode one large packed varint field. 1 disables parallel decoding, which
+// suits programs that already parse on many threads at once (e.g., a server's
+// worker pool). 0, the default, allows one thread per core.
+inline void SetMaxParallelVarintThreads(int max_threads) {
+  internal::g_max_parallel_varint_threads.store(std::max(max_threads, 0),
+                                                std::memory_order_relaxed);
+}
+
+// Returns the number of varints that end in the range |begin| to |end|: the
+// number of bytes with the most-significant (continuation) bit clear. Where
+// SIMD instructions are available, this checks 32 or 16 bytes at a time.
+[[nodiscard]] inline int64_t CountVarintTerminators(const uint8_t* begin,
+                                                    const uint8_t* end) {
+  int64_t count = 0;
+#if defined(__AVX2__)
+  for (; (end - begin) >= 32; begin += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    count += 32 - __builtin_popcount(
+                      static_cast<unsigned int>(_mm256_movemask_epi8(chunk)));
+  }
+#elif defined(__SSE2__)
+  for (; (end - begin) >= 16; begin += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    count += 16 - __builtin_popcount(
+                      static_cast<unsigned int>(_mm_movemask_epi8(chunk)));
+  }
+#else
+  for (; (end - begin) >= 8; begin += 8) {
+    uint64_t word;
+    std::memcpy(&word, begin, sizeof(word));
+    count += 8 - __builtin_popcountll(word & 0x8080808080808080);
+  }
+#endif
+  for (; begin != end; ++begin) {
+    count += !(*begin & 0b10000000);
+  }
+  return count;
+}
+
+// Returns the number of threads that should decode a payload of |byte_count|
+// bytes. This is 1 (i.e., decode on the calling thread only) if the payload is
+// smaller than |kMinParallelPackedVarintBytes|, there is only one core, or
+// SetMaxParallelVarintThreads(1) was called.
+[[nodiscard]] inline int ComputeParallelVarintChunkCount(int64_t byte_count) {
+  if (byte_count < kMinParallelPackedVarintBytes) {
+    return 1;
+  }
+  static const int64_t core_count =
+      std::max<int64_t>(1, std::thread::hardware_concurrency());
+  int64_t thread_count = core_count;
+  const int max_threads =
+      internal::g_max_parallel_varint_threads.load(std::memory_order_relaxed);
+  if (max_threads > 0) {
+    thread_count = std::min<int64_t>(thread_count, max_threads);
+  }
+  const auto max_chunks = byte_count / kMinParallelVarintChunkBytes;
+  return static_cast<int>(std::min(max_chunks, thread_count));
+}
+
+// Decodes the packed varints in the range |begin| to |end|, appending them to
+// |result|, using |chunk_count| threads (including the calling thread).
+//
+// Since every varint ends with the first byte having its continuation bit
+// clear, the payload can be split anywhere and resynchronized: Each chunk
+// boundary is moved forward to just after such a byte. Then, the threads count
+// the varints in their chunks (see CountVarintTerminators()), |result| is
+// resized to fit them all, and each thread decodes its chunk directly into its
+// own slice of |result|, by calling:
+//
+//   bool decode_chunk(const uint8_t* chunk_begin, const uint8_t* chunk_end,
+//                     Element* output, int64_t count);
+//
+// |decode_chunk| must decode exactly |count| varints, ending exactly at
+// |chunk_end|, or return false. It may be called from any thread, and
+// concurrently with other calls.
+//
+// Returns false, and leaves |result| as it was, if the payload does not end
+// with a complete varint, or any |decode_chunk| call fails.
+template <typename Element, typename DecodeChunk>
+[[nodiscard]] bool DecodeVarintChunksInParallel(const uint8_t* begin,
+                                                const uint8_t* end,
+                                                int chunk_count,
+                                                std::vector<Element>& result,
+                                                DecodeChunk&& decode_chunk) {
+  if (begin == end) {
+    return true;
+  }
+  if (end[-1] & 0b10000000) {
+    return false;  // The last varint is incomplete.
+  }
+
+  // Split the payload at roughly equal intervals, each just after the end of
+  // a varint. Chunks may end up empty (e.g., inside a run of overlong
+  // varints), which is harmless.
+  struct Chunk {
+    const uint8_t* begin;
+    const uint8_t* end;
+    int64_t count;
+    std::size_t output_index;
+    bool success;
+  };
+  chunk_count = std::max(chunk_count, 1);
+  const auto byte_count = end - begin;
+  std::vector<Chunk> chunks(static_cast<std::size_t>(chunk_count));
+  const uint8_t* chunk_begin = begin;
+  for (int i = 0; i < chunk_count; ++i) {
+    const uint8_t* chunk_end =
+        (i + 1 == chunk_count)
+            ? end
+            : std::max(chunk_begin, begin + byte_count * (i + 1) / chunk_count);
+    while (chunk_end != end && chunk_end != begin &&
+           (chunk_end[-1] & 0b10000000)) {
+      ++chunk_end;
+    }
+    chunks[static_cast<std::size_t>(i)] = Chunk{chunk_begin, chunk_end, 0, 0,
+                                               false};
+    chunk_begin = chunk_end;
+  }
+
+  // Runs |task| for each chunk: one on this thread, and the rest on new ones.
+  const auto for_each_chunk_in_parallel = [&](auto&& task) {
+    std::vector<std::thread> threads;
+    threads.reserve(chunks.size() - 1);
+    for (std::size_t i = 1; i < chunks.size(); ++i) {
+      threads.emplace_back([&task, &chunk = chunks[i]] { task(chunk); });
+    }
+    task(chunks[0]);
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  };
+
+  for_each_chunk_in_parallel([](Chunk& chunk) {
+    chunk.count = CountVarintTerminators(chunk.begin, chunk.end);
+  });
+  const std::size_t old_size = result.size();
+  std::size_t output_index = old_size;
+  for (Chunk& chunk : chunks) {
+    chunk.output_index = output_index;
+    output_index += static_cast<std::size_t>(chunk.count);
+  }
+  result.resize(output_index);
+
+  Element* const output = result.data();
+  for_each_chunk_in_parallel([&](Chunk& chunk) {
+    chunk.success = decode_chunk(chunk.begin, chunk.end,
+                                 output + chunk.output_index, chunk.count);
+  });
+  for (const Chunk& chunk : chunks) {
+    if (!chunk.success) {
+      result.resize(old_size);
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace pb::codec
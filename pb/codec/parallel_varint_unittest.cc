@@ -0,0 +1,196 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/codec/parallel_varint.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/serialize.h"
+#include "pb/codec/zigzag.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb::codec {
+namespace {
+
+// Returns the packed encoding of |count| pseudo-random sint64 values (of
+// widely-varying magnitudes), and sets |values| to them.
+std::vector<uint8_t> MakePackedSint64s(int count,
+                                       std::vector<pb::sint64_t>& values) {
+  std::mt19937_64 random(static_cast<uint64_t>(count));
+  std::vector<uint8_t> payload;
+  values.clear();
+  for (int i = 0; i < count; ++i) {
+    const auto value = static_cast<int64_t>(random()) >> (random() % 64);
+    values.emplace_back(value);
+    uint8_t bytes[kMaxVarintSize];
+    uint8_t* const end = SerializeValue(EncodeZigZag(value), bytes);
+    payload.insert(payload.end(), bytes, end);
+  }
+  return payload;
+}
+
+// Prepends the byte count, as it appears on the wire after the tag.
+std::vector<uint8_t> AddByteCount(const std::vector<uint8_t>& payload) {
+  uint8_t bytes[kMaxVarintSize];
+  uint8_t* const end =
+      SerializeValue(static_cast<uint32_t>(payload.size()), bytes);
+  std::vector<uint8_t> field(bytes, end);
+  field.insert(field.end(), payload.begin(), payload.end());
+  return field;
+}
+
+TEST(ParallelVarintTest, CountsVarintTerminators) {
+  std::mt19937 random(1);
+  std::vector<uint8_t> bytes(1000);
+  for (uint8_t& byte : bytes) {
+    byte = static_cast<uint8_t>(random());
+  }
+  for (std::size_t begin = 0; begin < 40; ++begin) {
+    for (std::size_t end = begin; end < bytes.size(); end += 7) {
+      int64_t expected = 0;
+      for (std::size_t i = begin; i < end; ++i) {
+        expected += (bytes[i] < 0x80);
+      }
+      ASSERT_EQ(expected, CountVarintTerminators(bytes.data() + begin,
+                                                 bytes.data() + end))
+          << begin << " to " << end;
+    }
+  }
+}
+
+TEST(ParallelVarintTest, DecodesWithAnyNumberOfChunks) {
+  std::vector<pb::sint64_t> expected;
+  std::vector<uint8_t> payload = MakePackedSint64s(5000, expected);
+  // Insert an overly-long varint for zero, which is still valid, after the
+  // varint ending at or after byte 1000.
+  std::size_t offset = 1000;
+  while (payload[offset - 1] & 0x80) {
+    ++offset;
+  }
+  const auto element_index = static_cast<std::ptrdiff_t>(
+      CountVarintTerminators(payload.data(), payload.data() + offset));
+  const uint8_t kOverlongZero[] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                                   0x80, 0x80, 0x80, 0x80, 0x80, 0x00};
+  payload.insert(payload.begin() + static_cast<std::ptrdiff_t>(offset),
+                 std::begin(kOverlongZero), std::end(kOverlongZero));
+  expected.insert(expected.begin() + element_index, pb::sint64_t{0});
+
+  const uint8_t* const begin = payload.data();
+  const uint8_t* const end = begin + payload.size();
+  for (int chunk_count = 1; chunk_count <= 33; ++chunk_count) {
+    std::vector<pb::sint64_t> result{pb::sint64_t{42}};
+    ASSERT_TRUE(DecodeVarintChunksInParallel(
+        begin, end, chunk_count, result,
+        [](const uint8_t* chunk_begin, const uint8_t* chunk_end,
+           pb::sint64_t* output, int64_t count) {
+          return ParseVarintChunk<InputBounds::kExact>(chunk_begin, chunk_end,
+                                                       output, count);
+        }))
+        << chunk_count;
+    ASSERT_EQ(expected.size() + 1, result.size());
+    EXPECT_EQ(pb::sint64_t{42}, result.front());
+    EXPECT_TRUE(
+        std::equal(expected.begin(), expected.end(), result.begin() + 1))
+        << chunk_count;
+  }
+}
+
+TEST(ParallelVarintTest, FailsOnIncompleteLastVarint) {
+  const uint8_t kPayload[] = {0x01, 0x02, 0x83};
+  std::vector<int64_t> result{7};
+  EXPECT_FALSE(DecodeVarintChunksInParallel(
+      kPayload, kPayload + sizeof(kPayload), 2, result,
+      [](const uint8_t*, const uint8_t*, int64_t*, int64_t) { return true; }));
+  EXPECT_EQ(std::vector<int64_t>{7}, result);
+}
+
+TEST(ParallelVarintTest, FailsIfAnyChunkFails) {
+  const std::vector<uint8_t> payload(100, 0x01);
+  std::vector<int32_t> result{7};
+  int calls = 0;
+  EXPECT_FALSE(DecodeVarintChunksInParallel(
+      payload.data(), payload.data() + payload.size(), 1, result,
+      [&](const uint8_t*, const uint8_t*, int32_t* output, int64_t count) {
+        ++calls;
+        EXPECT_EQ(100, count);
+        output[0] = 1;
+        return false;
+      }));
+  EXPECT_EQ(1, calls);
+  EXPECT_EQ(std::vector<int32_t>{7}, result);
+}
+
+TEST(ParallelVarintTest, ChoosesChunkCount) {
+  constexpr int64_t kHugeByteCount = int64_t{1} << 30;
+  EXPECT_EQ(1, ComputeParallelVarintChunkCount(0));
+  EXPECT_EQ(1, ComputeParallelVarintChunkCount(kMinParallelPackedVarintBytes -
+                                               1));
+  const int64_t core_count = std::thread::hardware_concurrency();
+  EXPECT_EQ(std::max<int64_t>(core_count, 1),
+            ComputeParallelVarintChunkCount(kHugeByteCount));
+  // Each chunk is at least |kMinParallelVarintChunkBytes|.
+  EXPECT_GE(kMinParallelPackedVarintBytes / kMinParallelVarintChunkBytes,
+            ComputeParallelVarintChunkCount(kMinParallelPackedVarintBytes));
+
+  // Opting out.
+  SetMaxParallelVarintThreads(1);
+  EXPECT_EQ(1, ComputeParallelVarintChunkCount(kHugeByteCount));
+  SetMaxParallelVarintThreads(2);
+  EXPECT_EQ(std::min<int64_t>(std::max<int64_t>(core_count, 1), 2),
+            ComputeParallelVarintChunkCount(kHugeByteCount));
+  SetMaxParallelVarintThreads(0);
+}
+
+// Large packed fields go through DecodeVarintChunksInParallel() automatically
+// (given multiple cores), and must parse the same as small ones.
+TEST(ParallelVarintTest, ParsesLargePackedFields) {
+  std::vector<pb::sint64_t> expected;
+  const std::vector<uint8_t> payload = MakePackedSint64s(500000, expected);
+  ASSERT_GE(payload.size(), static_cast<std::size_t>(
+                                2 * kMinParallelPackedVarintBytes));
+  std::vector<uint8_t> field = AddByteCount(payload);
+  const uint8_t* const begin = field.data();
+  const uint8_t* const end = begin + field.size();
+
+  std::vector<pb::sint64_t> result;
+  EXPECT_EQ(end, (ParsePackedRepeatedValues<InputBounds::kExact,
+                                            WireType::kVarint>(begin, end,
+                                                               result)));
+  EXPECT_EQ(expected, result);
+
+  // Padded input, merging into the existing elements.
+  field.resize(field.size() + kParseSlopBytes);
+  result.resize(10);
+  EXPECT_EQ(field.data() + field.size() - kParseSlopBytes,
+            (ParsePackedRepeatedValues<InputBounds::kPadded,
+                                       WireType::kVarint>(
+                field.data(), field.data() + field.size() - kParseSlopBytes,
+                result)));
+  ASSERT_EQ(expected.size() + 10, result.size());
+  EXPECT_TRUE(std::equal(expected.begin(), expected.end(),
+                         result.begin() + 10));
+
+  // Truncating the payload leaves the last varint incomplete (unless it ended
+  // exactly there), and so the parse must fail.
+  std::vector<uint8_t> truncated = payload;
+  while (truncated.back() < 0x80) {
+    truncated.pop_back();
+  }
+  truncated = AddByteCount(truncated);
+  result.clear();
+  EXPECT_EQ(nullptr,
+            (ParsePackedRepeatedValues<InputBounds::kExact, WireType::kVarint>(
+                truncated.data(), truncated.data() + truncated.size(),
+                result)));
+}
+
+}  // namespace
+}  // namespace pb::codec
@@ -16,18 +16,22 @@
 #include <string_view>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
+#include "pb/codec/bulk_insert.h"
 #include "pb/codec/endian.h"
 #include "pb/codec/field_rules.h"
 #include "pb/codec/iterable_util.h"
 #include "pb/codec/limits.h"
 #include "pb/codec/map_field_entry.h"
 #include "pb/codec/map_field_entry_facade.h"
+#include "pb/codec/parallel_varint.h"
 #include "pb/codec/tag.h"
 #include "pb/codec/wire_type.h"
 #include "pb/codec/zigzag.h"
 #include "pb/field_list.h"
 #include "pb/integer_wrapper.h"
+#include "pb/packed_fixed_view.h"
 
 namespace pb::codec {
 
@@ -40,10 +44,93 @@ namespace pb::codec {
 //
 //   If the parse fails: nullptr (and NOTE that the output argument may or may
 //   not have been modified!).
+//
+// All of them also take an InputBounds template argument, which defaults to
+// InputBounds::kExact, and which determines when |buffer_end| is checked.
+
+// Describes what the parser may assume about the memory just after
+// |buffer_end|.
+enum class InputBounds : uint8_t {
+  // Nothing: Every read is checked against |buffer_end| before it happens.
+  kExact,
+
+  // At least |kParseSlopBytes| readable bytes follow |buffer_end|. Tags and
+  // scalar values are decoded using unchecked wide loads, and |buffer_end| is
+  // only compared against at field boundaries. Bytes past |buffer_end| may be
+  // loaded, but their values never affect the result of a parse.
+  //
+  // This works because a parse only ever starts reading a tag or value at a
+  // position before |buffer_end| (this is checked), and no tag or value is
+  // read using more than |kMaxVarintSize| unchecked bytes.
+  kPadded,
+};
+
+// The maximum number of bytes in a varint encoding of a 64-bit integer.
+constexpr int kMaxVarintSize = 10;
+static_assert(kMaxVarintSize <= kParseSlopBytes);
+
+// Given the first (up to) 8 bytes of a varint, as a little-endian 64-bit word,
+// with all bytes after its terminating byte cleared, returns its value.
+[[nodiscard]] constexpr uint64_t SqueezeOutContinuationBits(uint64_t bits) {
+  bits &= 0x7f7f7f7f7f7f7f7f;
+  bits = ((bits & 0x7f007f007f007f00) >> 1) | (bits & 0x007f007f007f007f);
+  bits = ((bits & 0x3fff00003fff0000) >> 2) | (bits & 0x00003fff00003fff);
+  bits = ((bits & 0x0fffffff00000000) >> 4) | (bits & 0x000000000fffffff);
+  return bits;
+}
+
+// Decodes the varint in |buffer|, reading up to |kMaxVarintSize| bytes without
+// checking for the end of the buffer. Returns a pointer to the first byte just
+// after the varint; or nullptr if the varint is longer than |kMaxVarintSize|
+// (but |result| is still set to the truncated 64-bit value).
+//
+// Implementation note: The 8-byte load, and the bit twiddling below that finds
+// the terminating byte and squeezes-out the continuation bits, are what make
+// this faster than the byte-by-byte loop in ParseValue() when most varints are
+// more than one byte long. Single-byte varints are still special-cased, since
+// those are the most-common on the wire (e.g., all tags for field numbers
+// 1 to 15).
+[[nodiscard]] inline const uint8_t* ParseVarintNoBoundsCheck(
+    const uint8_t* buffer,
+    uint64_t& result) {
+  if (!(buffer[0] & 0b10000000)) {
+    result = buffer[0];
+    return buffer + 1;
+  }
+
+  uint64_t word;
+  std::memcpy(&word, buffer, sizeof(word));
+  if (!IsLittleEndianArchitecture()) {
+    word = ReverseBytes64(word);
+  }
+  const uint64_t terminator_bits = ~word & 0x8080808080808080;
+  if (terminator_bits != 0) {
+    // Note: In C++20, this could be std::countr_zero().
+    const int terminator_bit_index = __builtin_ctzll(terminator_bits);
+    if (terminator_bit_index < 63) {
+      word &= (uint64_t{1} << (terminator_bit_index + 1)) - 1;
+    }
+    result = SqueezeOutContinuationBits(word);
+    return buffer + (terminator_bit_index + 1) / 8;
+  }
+
+  // Slow path: 9 or more bytes. Only the lowest bit of the 10th byte fits in
+  // the 64-bit result.
+  uint64_t bits = SqueezeOutContinuationBits(word);
+  bits |= static_cast<uint64_t>(buffer[8] & 0b01111111) << 56;
+  if (!(buffer[8] & 0b10000000)) {
+    result = bits;
+    return buffer + 9;
+  }
+  bits |= static_cast<uint64_t>(buffer[9]) << 63;
+  result = bits;
+  return (buffer[9] & 0b10000000) ? nullptr : buffer + kMaxVarintSize;
+}
 
 // Varints: This template covers (un)signed char, short, int, etc.; but NOT
 // bool. Tags are also encoded as varints.
-template <typename Integral,
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Integral,
           std::enable_if_t<std::is_integral_v<Integral> &&
                                !std::is_same_v<Integral, bool>,
                            int> = 0>
@@ -55,6 +142,22 @@ template <typename Integral,
   static constexpr auto kMaxPossibleSize =
       (std::numeric_limits<UnsignedIntegral>::digits + 6) / 7;
 
+  if constexpr (kInputBounds == InputBounds::kPadded) {
+    uint64_t bits;
+    const uint8_t* const after_varint = ParseVarintNoBoundsCheck(buffer, bits);
+    result = static_cast<Integral>(static_cast<UnsignedIntegral>(bits));
+    if (after_varint) {
+      return after_varint;
+    }
+    // Overly-long varint: Skip over the rest of it, the same as below.
+    for (buffer += kMaxVarintSize; buffer < buffer_end; ++buffer) {
+      if (!(*buffer & 0b10000000)) {
+        return buffer + 1;
+      }
+    }
+    return nullptr;  // Unexpected end-of-buffer reached.
+  }
+
   // Implementation note: Google's open-source implementation includes an
   // optimization for varint parsing. Whenever at least 10 bytes are left in the
   // buffer, the bytes are processed without checking for |buffer_end| in each
@@ -102,13 +205,15 @@ template <typename Integral,
 // explicitly states that, for int32/int64/uint32/uint64/bool, parsers must be
 // fully forwards- and backwards-compatible. Thus, this code assumes zero is
 // false and a varint of any valid length that is non-zero is true.
-template <typename Bool, std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Bool,
+          std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
 [[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
                                         const uint8_t* buffer_end,
                                         int nesting_level,
                                         Bool& result) {
   uint64_t value{};
-  buffer = ParseValue(buffer, buffer_end, nesting_level, value);
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level, value);
   // If the above returned nullptr (a parse error), that will propagate to the
   // caller of this function regardless of the post-processing below.
   result = !!value;
@@ -116,13 +221,15 @@ template <typename Bool, std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
 }
 
 // Enums: Parse as a varint into their underlying integral type.
-template <typename Enum, std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Enum,
+          std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
 [[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
                                         const uint8_t* buffer_end,
                                         int nesting_level,
                                         Enum& result) {
   std::underlying_type_t<Enum> value{};
-  buffer = ParseValue(buffer, buffer_end, nesting_level, value);
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level, value);
   // If the above returned nullptr (a parse error), that will propagate to the
   // caller of this function regardless of the post-processing below.
   result = static_cast<Enum>(value);
@@ -131,6 +238,7 @@ template <typename Enum, std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
 
 // ZigZag-encoded signed integers.
 template <
+    InputBounds kInputBounds = InputBounds::kExact,
     typename SignedIntegerWrapper,
     std::enable_if_t<std::is_same_v<SignedIntegerWrapper, ::pb::sint32_t> ||
                          std::is_same_v<SignedIntegerWrapper, ::pb::sint64_t>,
@@ -141,7 +249,7 @@ template <
                                         SignedIntegerWrapper& result) {
   using Bits = std::make_unsigned_t<decltype(result.value())>;
   Bits bits{};
-  buffer = ParseValue(buffer, buffer_end, nesting_level, bits);
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level, bits);
   // If the above returned nullptr (a parse error), that will propagate to the
   // caller of this function regardless of the post-processing below.
   result = DecodeZigZag(bits);
@@ -199,7 +307,8 @@ void ParseFixedValueNoBoundsCheck(const uint8_t* buffer, Fixed32& result) {
 }
 
 // Doubles or floats, as little-endian bytes on the wire.
-template <typename Float,
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Float,
           std::enable_if_t<std::is_same_v<Float, double> ||
                                std::is_same_v<Float, float>,
                            int> = 0>
@@ -208,15 +317,19 @@ template <typename Float,
                                         int /* nesting_level */,
                                         Float& result) {
   constexpr std::ptrdiff_t kFixedSize = sizeof(Float);
-  if ((buffer_end - buffer) < kFixedSize) {
-    return nullptr;
+  static_assert(kFixedSize <= kMaxVarintSize);
+  if constexpr (kInputBounds == InputBounds::kExact) {
+    if ((buffer_end - buffer) < kFixedSize) {
+      return nullptr;
+    }
   }
   ParseFixedValueNoBoundsCheck(buffer, result);
   return buffer + kFixedSize;
 }
 
 // Fixed-size 64- or 32-bit integers, as little-endian bytes on the wire.
-template <typename Fixed,
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Fixed,
           std::enable_if_t<std::is_same_v<Fixed, ::pb::fixed64_t> ||
                                std::is_same_v<Fixed, ::pb::sfixed64_t> ||
                                std::is_same_v<Fixed, ::pb::fixed32_t> ||
@@ -227,8 +340,11 @@ template <typename Fixed,
                                         int /* nesting_level */,
                                         Fixed& result) {
   constexpr std::ptrdiff_t kFixedSize = sizeof(result.value());
-  if ((buffer_end - buffer) < kFixedSize) {
-    return nullptr;
+  static_assert(kFixedSize <= kMaxVarintSize);
+  if constexpr (kInputBounds == InputBounds::kExact) {
+    if ((buffer_end - buffer) < kFixedSize) {
+      return nullptr;
+    }
   }
   ParseFixedValueNoBoundsCheck(buffer, result);
   return buffer + kFixedSize;
@@ -270,7 +386,8 @@ template <typename Fixed,
 }
 
 // Strings: Encoded as a length varint followed by the bytes.
-template <typename String,
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename String,
           std::enable_if_t<std::is_same_v<String, std::string> ||
                                std::is_same_v<String, std::string_view>,
                            int> = 0>
@@ -279,7 +396,8 @@ template <typename String,
                                         int nesting_level,
                                         String& result) {
   uint32_t byte_count;
-  buffer = ParseValue(buffer, buffer_end, nesting_level, byte_count);
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level,
+                                    byte_count);
   if (!IsParsedByteCountValid(buffer, buffer_end, byte_count)) {
     return nullptr;
   }
@@ -296,7 +414,8 @@ template <typename String,
 }
 
 // Forward declaration of ParseValue(<nested message>).
-template <typename Message,
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Message,
           std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
                            int> = 0>
 [[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
@@ -306,18 +425,19 @@ template <typename Message,
 
 // Pairs: Parse into the given |pair| as a MapFieldEntry message. This provides
 // the support for parsing maps.
-template <typename Pair,
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Pair,
           std::enable_if_t<CouldBeAMapFieldEntry<Pair>(), int> = 0>
 [[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
                                         const uint8_t* buffer_end,
                                         int nesting_level,
                                         Pair& pair) {
-  return ParseValue(buffer, buffer_end, nesting_level,
-                    AsMutableMapFieldEntryFacade(pair));
+  return ParseValue<kInputBounds>(buffer, buffer_end, nesting_level,
+                                  AsMutableMapFieldEntryFacade(pair));
 }
 
 // Adapter for optional fields.
-template <typename T>
+template <InputBounds kInputBounds = InputBounds::kExact, typename T>
 [[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
                                         const uint8_t* buffer_end,
                                         int nesting_level,
@@ -325,11 +445,11 @@ template <typename T>
   if (!result) {
     result.emplace();
   }
-  return ParseValue(buffer, buffer_end, nesting_level, *result);
+  return ParseValue<kInputBounds>(buffer, buffer_end, nesting_level, *result);
 }
 
 // Adapter for unique_ptr fields.
-template <typename T>
+template <InputBounds kInputBounds = InputBounds::kExact, typename T>
 [[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
                                         const uint8_t* buffer_end,
                                         int nesting_level,
@@ -337,7 +457,32 @@ template <typename T>
   if (!result) {
     result = std::make_unique<T>();
   }
-  return ParseValue(buffer, buffer_end, nesting_level, *result);
+  return ParseValue<kInputBounds>(buffer, buffer_end, nesting_level, *result);
+}
+
+// Adapter for shared_ptr fields. A std::shared_ptr<const T> is replaced with a
+// new instance (see MakeSharedForMerge()) only if the parse succeeds, while a
+// std::shared_ptr<T> is merged into in-place, affecting all of its owners.
+template <InputBounds kInputBounds = InputBounds::kExact, typename T>
+[[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
+                                        const uint8_t* buffer_end,
+                                        int nesting_level,
+                                        std::shared_ptr<T>& result) {
+  if constexpr (std::is_const_v<T>) {
+    auto instance = MakeSharedForMerge(result);
+    buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level,
+                                      *instance);
+    if (buffer) {
+      result = std::move(instance);
+    }
+    return buffer;
+  } else {
+    if (!result) {
+      result = std::make_shared<T>();
+    }
+    return ParseValue<kInputBounds>(buffer, buffer_end, nesting_level,
+                                    *result);
+  }
 }
 
 // Adapter for parsing one element when using the "unpacked repeated" encoding.
@@ -347,7 +492,8 @@ template <typename T>
 //
 // This works with all of the STL SequenceContainers (e.g., vector, deque, list)
 // as well as the AssociativeContainers (e.g., set, unordered_set).
-template <typename Container,
+template <InputBounds kInputBounds = InputBounds::kExact,
+          typename Container,
           std::enable_if_t<!(std::is_same_v<Container, std::string> ||
                              std::is_same_v<Container, std::string_view>),
                            int> = 0>
@@ -358,7 +504,7 @@ template <typename Container,
     -> decltype(result.insert(std::end(result), std::move(*std::begin(result))),
                 static_cast<const uint8_t*>(nullptr)) {
   IterableValueType<Container> element{};
-  buffer = ParseValue(buffer, buffer_end, nesting_level, element);
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level, element);
   // If the above returned nullptr (a parse error), the element being inserted
   // into |result| will be invalid. However, the nullptr will still propagate to
   // the caller of this function to indicate error.
@@ -366,14 +512,73 @@ template <typename Container,
   return buffer;
 }
 
+// Parses exactly |count| varints from the range |begin| to |end| into
+// |output|. Returns false if they do not end exactly at |end|.
+template <InputBounds kInputBounds, typename Element>
+[[nodiscard]] bool ParseVarintChunk(const uint8_t* begin,
+                                    const uint8_t* end,
+                                    Element* output,
+                                    int64_t count) {
+  for (int64_t i = 0; i < count; ++i) {
+    begin = ParseValue<kInputBounds>(begin, end, -1, output[i]);
+    if (!begin) {
+      return false;
+    }
+  }
+  return begin == end;
+}
+
+// True if a packed varint field of type |Container| can be decoded by
+// DecodeVarintChunksInParallel().
+template <typename Container>
+constexpr bool kCanParsePackedVarintsInParallel =
+    std::is_same_v<Container, std::vector<IterableValueType<Container>>> &&
+    !std::is_same_v<IterableValueType<Container>, bool>;
+
 // Called from ParsePackedRepeatedValues() to parse all the varints in the range
 // |begin| to |end| and append them to |result|.
-template <typename Container>
+template <InputBounds kInputBounds, typename Container>
 [[nodiscard]] const uint8_t* ParsePackedRepeatedVarintHelper(
     const uint8_t* begin,
     const uint8_t* end,
     Container& result) {
+  if constexpr (kCanParsePackedVarintsInParallel<Container>) {
+    const int chunk_count = ComputeParallelVarintChunkCount(end - begin);
+    if (chunk_count > 1) {
+      using Element = IterableValueType<Container>;
+      const auto parse_chunk = [end](const uint8_t* chunk_begin,
+                                     const uint8_t* chunk_end,
+                                     Element* output, int64_t count) {
+        // Except near the end of the payload, the bytes after a chunk belong
+        // to the next one, and so can be read without bounds checks.
+        if ((end - chunk_end) >= kMaxVarintSize) {
+          return ParseVarintChunk<InputBounds::kPadded>(chunk_begin, chunk_end,
+                                                        output, count);
+        }
+        return ParseVarintChunk<InputBounds::kExact>(chunk_begin, chunk_end,
+                                                     output, count);
+      };
+      return DecodeVarintChunksInParallel(begin, end, chunk_count, result,
+                                          parse_chunk)
+                 ? end
+                 : nullptr;
+    }
+  }
+
   IterableValueType<Container> element{};
+  if constexpr (kInputBounds == InputBounds::kPadded) {
+    // The last element may be decoded from bytes beyond |end|. That is only
+    // detected (as a parse failure) once the loop has finished.
+    while (begin < end) {
+      begin = ParseValue<kInputBounds>(begin, end, -1, element);
+      if (!begin) {
+        return nullptr;
+      }
+      result.insert(std::end(result), std::move(element));
+    }
+    return (begin == end) ? begin : nullptr;
+  }
+
   while (begin != end) {
     begin = ParseValue(begin, end, -1, element);
     if (!begin) {
@@ -405,21 +610,34 @@ template <uint32_t kBytesPerElement, typename Container>
 
 // Parses zero or more elements when using the "packed repeated" encoding. This
 // supports the same Containers as ParseValue<Container>() above.
-template <WireType kElementWireType, typename Container>
+template <InputBounds kInputBounds,
+          WireType kElementWireType,
+          typename Container>
 [[nodiscard]] auto ParsePackedRepeatedValues(const uint8_t* buffer,
                                              const uint8_t* buffer_end,
                                              Container& result)
     -> decltype(result.insert(std::end(result), std::move(*std::begin(result))),
                 static_cast<const uint8_t*>(nullptr)) {
+  if constexpr (kCanBulkInsert<Container>) {
+    // Decode into a scratch vector, and then add the elements all at once.
+    auto& elements = GetBulkInsertScratch<typename Container::value_type>();
+    buffer = ParsePackedRepeatedValues<kInputBounds, kElementWireType>(
+        buffer, buffer_end, elements);
+    if (buffer) {
+      BulkInsert(elements, result);
+    }
+    return buffer;
+  }
+
   uint32_t byte_count;
-  buffer = ParseValue(buffer, buffer_end, -1, byte_count);
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, -1, byte_count);
   if (!IsParsedByteCountValid(buffer, buffer_end, byte_count)) {
     return nullptr;
   }
 
   if constexpr (kElementWireType == WireType::kVarint) {
-    buffer =
-        ParsePackedRepeatedVarintHelper(buffer, buffer + byte_count, result);
+    buffer = ParsePackedRepeatedVarintHelper<kInputBounds>(
+        buffer, buffer + byte_count, result);
   } else if constexpr (kElementWireType == WireType::kFixed64Bit) {
     buffer = ParsePackedRepeatedFixedHelper<sizeof(uint64_t)>(
         buffer, byte_count, result);
@@ -435,19 +653,85 @@ template <WireType kElementWireType, typename Container>
   return buffer;
 }
 
+// Parses one element of an unpacked repeated field that kCanBulkInsert, along
+// with all the elements of the same field that immediately follow it (tagged
+// with the same |kTag|, as serializers emit them), into a scratch vector. Then,
+// adds them all at once with BulkInsert(). Returns a pointer to just after the
+// last element parsed, or nullptr if an element is malformed.
+template <InputBounds kInputBounds, Tag kTag, typename Container>
+[[nodiscard]] const uint8_t* ParseUnpackedRepeatedValues(
+    const uint8_t* buffer,
+    const uint8_t* buffer_end,
+    Container& result) {
+  static_assert(kCanBulkInsert<Container>);
+  auto& elements = GetBulkInsertScratch<typename Container::value_type>();
+  while (true) {
+    buffer = ParseValue<kInputBounds>(buffer, buffer_end, -1,
+                                      elements.emplace_back());
+    if (!buffer) {
+      return nullptr;
+    }
+    if (buffer >= buffer_end) {
+      break;
+    }
+    // Anything but another element (including a tag at the very end of the
+    // buffer) is left for ParseFields() to handle.
+    Tag tag;
+    const uint8_t* const next =
+        ParseValue<kInputBounds>(buffer, buffer_end, -1, tag);
+    if (!next || next >= buffer_end || tag != kTag) {
+      break;
+    }
+    buffer = next;
+  }
+  BulkInsert(elements, result);
+  return buffer;
+}
+
+// PackedFixedView fields: Instead of decoding the elements, the view is set to
+// reference the payload bytes in-place, replacing any prior view (similar to
+// the handling of std::string_view fields).
+template <InputBounds kInputBounds, WireType kElementWireType, typename T>
+[[nodiscard]] const uint8_t* ParsePackedRepeatedValues(
+    const uint8_t* buffer,
+    const uint8_t* buffer_end,
+    ::pb::PackedFixedView<T>& result) {
+  static_assert(kElementWireType == GetWireType<T>());
+  uint32_t byte_count;
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, -1, byte_count);
+  if (!IsParsedByteCountValid(buffer, buffer_end, byte_count) ||
+      (byte_count % sizeof(T)) != 0) {
+    return nullptr;
+  }
+  result = ::pb::PackedFixedView<T>(buffer, byte_count / sizeof(T));
+  return buffer + byte_count;
+}
+
+// PackedFixedView fields: The unpacked encoding always fails the parse, since
+// its elements are not contiguous in |buffer| and so cannot be viewed in-place.
+template <InputBounds kInputBounds = InputBounds::kExact, typename T>
+[[nodiscard]] const uint8_t* ParseValue(const uint8_t*,
+                                        const uint8_t*,
+                                        int,
+                                        ::pb::PackedFixedView<T>&) {
+  return nullptr;
+}
+
 // Skips-over the bytes comprising a value of the given |wire_type| in |buffer|,
 // and returns a pointer to the position just after the value. This is called
 // when a tag+value is encountered in the wire data for an unknown field (e.g.,
 // when the originator is newer software with additional message fields
 // defined).
-[[nodiscard]] inline const uint8_t* SkipValueAfterTag(const uint8_t* buffer,
-                                                      const uint8_t* buffer_end,
-                                                      int nesting_level,
-                                                      WireType wire_type) {
+template <InputBounds kInputBounds = InputBounds::kExact>
+[[nodiscard]] const uint8_t* SkipValueAfterTag(const uint8_t* buffer,
+                                               const uint8_t* buffer_end,
+                                               int nesting_level,
+                                               WireType wire_type) {
   switch (wire_type) {
     case WireType::kVarint: {
       uint64_t garbage;
-      return ParseValue(buffer, buffer_end, nesting_level, garbage);
+      return ParseValue<kInputBounds>(buffer, buffer_end, nesting_level,
+                                      garbage);
     }
 
     case WireType::kFixed64Bit:
@@ -456,7 +740,8 @@ template <WireType kElementWireType, typename Container>
 
     case WireType::kLengthDelimited: {
       uint32_t byte_count;
-      buffer = ParseValue(buffer, buffer_end, nesting_level, byte_count);
+      buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level,
+                                        byte_count);
       if (!IsParsedByteCountValid(buffer, buffer_end, byte_count)) {
         return nullptr;
       }
@@ -483,7 +768,7 @@ template <WireType kElementWireType, typename Container>
 // assuming the value is for |TheField|. This function also determines whether
 // the value is one element of a repeated field, multiple elements of a repeated
 // field, or [the usual] single field value.
-template <typename Message, typename TheField>
+template <InputBounds kInputBounds, typename Message, typename TheField>
 [[nodiscard]] const uint8_t* ParseValueAfterTagForField(
     const uint8_t* buffer,
     const uint8_t* buffer_end,
@@ -495,18 +780,27 @@ template <typename Message, typename TheField>
     constexpr auto kElementWireType =
         GetWireType<IterableValueType<typename TheField::Member>>();
     if (wire_type_from_tag == kElementWireType) {
+      if constexpr (kCanBulkInsert<typename TheField::Member>) {
+        // Parse a run of elements of an unpacked repeated field.
+        constexpr Tag kTag =
+            MakeTag(TheField::GetFieldNumber(), kElementWireType);
+        return ParseUnpackedRepeatedValues<kInputBounds, kTag>(
+            buffer, buffer_end, TheField::GetMutableMemberReferenceIn(message));
+      }
       // Parse one element of an unpacked repeated field.
-      return ParseValue(buffer, buffer_end, nesting_level,
-                        TheField::GetMutableMemberReferenceIn(message));
+      return ParseValue<kInputBounds>(
+          buffer, buffer_end, nesting_level,
+          TheField::GetMutableMemberReferenceIn(message));
     } else if constexpr (CanEncodeAsAPackedRepeatedField<TheField>()) {
       if (wire_type_from_tag == WireType::kLengthDelimited) {
-        return ParsePackedRepeatedValues<kElementWireType>(
+        return ParsePackedRepeatedValues<kInputBounds, kElementWireType>(
             buffer, buffer_end, TheField::GetMutableMemberReferenceIn(message));
       }
     }
   } else if (wire_type_from_tag == GetWireType<typename TheField::Member>()) {
-    return ParseValue(buffer, buffer_end, nesting_level,
-                      TheField::GetMutableMemberReferenceIn(message));
+    return ParseValue<kInputBounds>(
+        buffer, buffer_end, nesting_level,
+        TheField::GetMutableMemberReferenceIn(message));
   }
 
   // If this point is reached, the WireType was wrong.
@@ -522,7 +816,8 @@ template <typename Message, typename TheField>
 // code-generated by the compiler, ensuring O(lg N) look-up complexity for the
 // desired field at runtime. This is mainly for the benefit of messages with
 // lots of fields.
-template <typename Message,
+template <InputBounds kInputBounds,
+          typename Message,
           std::size_t kBeginIndex = 0,
           std::size_t kEndIndex = Message::ProtobufFields::kFieldCount>
 [[nodiscard]] const uint8_t* ParseValueAfterTag(const uint8_t* buffer,
@@ -540,36 +835,58 @@ template <typename Message,
         typename Message::ProtobufFields::template FieldAt<kPivotIndex>;
 
     if (field_number == PivotField::GetFieldNumber()) {
-      return ParseValueAfterTagForField<Message, PivotField>(
+      return ParseValueAfterTagForField<kInputBounds, Message, PivotField>(
           buffer, buffer_end, nesting_level, wire_type, field_number, message);
     } else if (field_number < PivotField::GetFieldNumber()) {
-      return ParseValueAfterTag<Message, kBeginIndex, kPivotIndex>(
-          buffer, buffer_end, nesting_level, wire_type, field_number, message);
+      return ParseValueAfterTag<kInputBounds, Message, kBeginIndex,
+                                kPivotIndex>(buffer, buffer_end, nesting_level,
+                                             wire_type, field_number, message);
     } else /* if (field_number > PivotField::GetFieldNumber()) */ {
-      return ParseValueAfterTag<Message, kPivotIndex + 1, kEndIndex>(
-          buffer, buffer_end, nesting_level, wire_type, field_number, message);
+      return ParseValueAfterTag<kInputBounds, Message, kPivotIndex + 1,
+                                kEndIndex>(buffer, buffer_end, nesting_level,
+                                           wire_type, field_number, message);
     }
   } else {
-    return SkipValueAfterTag(buffer, buffer_end, nesting_level, wire_type);
+    return SkipValueAfterTag<kInputBounds>(buffer, buffer_end, nesting_level,
+                                           wire_type);
   }
 }
 
 // Scans the |buffer| for encoded tag+value pairs, populating the data members
 // in |message| when matches are made (according to Message::ProtobufFields).
-template <typename Message>
+template <InputBounds kInputBounds = InputBounds::kExact, typename Message>
 [[nodiscard]] const uint8_t* ParseFields(const uint8_t* buffer,
                                          const uint8_t* buffer_end,
                                          int nesting_level,
                                          Message& message) {
+  if constexpr (kInputBounds == InputBounds::kPadded) {
+    // These are the "field boundary" checks: A tag must be followed by at least
+    // one byte of value, and a value must not have extended past |buffer_end|.
+    while (buffer < buffer_end) {
+      Tag tag;
+      buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level, tag);
+      if (!buffer || buffer >= buffer_end) {
+        return nullptr;
+      }
+      buffer = ParseValueAfterTag<kInputBounds>(
+          buffer, buffer_end, nesting_level, GetWireTypeFromTag(tag),
+          GetFieldNumberFromTag(tag), message);
+      if (!buffer || buffer > buffer_end) {
+        return nullptr;
+      }
+    }
+    return buffer;
+  }
+
   while (buffer != buffer_end) {
     Tag tag;
     buffer = ParseValue(buffer, buffer_end, nesting_level, tag);
     if (!buffer) {
       return nullptr;
     }
-    buffer = ParseValueAfterTag(buffer, buffer_end, nesting_level,
-                                GetWireTypeFromTag(tag),
-                                GetFieldNumberFromTag(tag), message);
+    buffer = ParseValueAfterTag<kInputBounds>(
+        buffer, buffer_end, nesting_level, GetWireTypeFromTag(tag),
+        GetFieldNumberFromTag(tag), message);
     if (!buffer) {
       return nullptr;
     }
@@ -580,6 +897,7 @@ template <typename Message>
 // Nested Messages: Encoded as a length varint followed by the encoded tag+value
 // pairs.
 template <
+    InputBounds kInputBounds,
     typename Message,
     std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>, int>>
 [[nodiscard]] const uint8_t* ParseValue(const uint8_t* buffer,
@@ -587,7 +905,8 @@ template <
                                         int nesting_level,
                                         Message& result) {
   uint32_t byte_count;
-  buffer = ParseValue(buffer, buffer_end, nesting_level, byte_count);
+  buffer = ParseValue<kInputBounds>(buffer, buffer_end, nesting_level,
+                                    byte_count);
   if (!IsParsedByteCountValid(buffer, buffer_end, byte_count)) {
     return nullptr;
   }
@@ -597,7 +916,8 @@ template <
   }
   ++nesting_level;
 
-  return ParseFields(buffer, buffer + byte_count, nesting_level, result);
+  return ParseFields<kInputBounds>(buffer, buffer + byte_count, nesting_level,
+                                   result);
 }
 
 }  // namespace pb::codec
@@ -4,18 +4,23 @@
 
 #include "pb/codec/parse.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <functional>
 #include <limits>
 #include <map>
 #include <memory>
 #include <optional>
+#include <set>
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <unordered_set>
 #include <vector>
 
 #include "gtest/gtest.h"
 #include "pb/codec/limits.h"
+#include "pb/codec/serialize.h"
 #include "pb/field_list.h"
 #include "pb/integer_wrapper.h"
 
@@ -584,6 +589,53 @@ TEST(ParseTest, MessageFieldRules) {
   EXPECT_EQ(3u, outer_message_4b.empties.size());
 }
 
+TEST(ParseTest, SharedMessages) {
+  struct Thing {
+    int32_t a = 0;
+    std::vector<int32_t> b;
+    using ProtobufFields = FieldList<Field<&Thing::a, 1>, Field<&Thing::b, 2>>;
+  };
+  struct Message {
+    std::shared_ptr<const Thing> const_thing;
+    std::shared_ptr<Thing> thing;
+    std::vector<std::shared_ptr<const Thing>> things;
+    using ProtobufFields = FieldList<Field<&Message::const_thing, 1>,
+                                     Field<&Message::thing, 2>,
+                                     Field<&Message::things, 3>>;
+  };
+
+  const auto* buffer = reinterpret_cast<const uint8_t*>(
+      "\x0a\x0a\x02\x10\x07\x12\x02\x08\x05\x1a\x00");
+  Message message{};
+  auto* after_it = ParseValue(buffer, buffer + 11, 0, message);
+  EXPECT_EQ(buffer + 11, after_it);
+  ASSERT_TRUE(message.const_thing);
+  EXPECT_EQ(std::vector<int32_t>{7}, message.const_thing->b);
+  ASSERT_TRUE(message.thing);
+  EXPECT_EQ(5, message.thing->a);
+  ASSERT_EQ(1u, message.things.size());
+  EXPECT_TRUE(message.things[0]);
+
+  // Merging into a shared const instance replaces it with a merged copy, so
+  // that its other owners see no change. A non-const instance is merged into
+  // in-place.
+  const auto original_const_thing = message.const_thing;
+  const auto original_thing = message.thing;
+  after_it = ParseValue(buffer, buffer + 11, 0, message);
+  EXPECT_EQ(buffer + 11, after_it);
+  EXPECT_NE(original_const_thing, message.const_thing);
+  EXPECT_EQ(std::vector<int32_t>{7}, original_const_thing->b);
+  EXPECT_EQ((std::vector<int32_t>{7, 7}), message.const_thing->b);
+  EXPECT_EQ(original_thing, message.thing);
+  EXPECT_EQ(2u, message.things.size());
+
+  // A failed parse leaves a shared const instance unchanged.
+  buffer = reinterpret_cast<const uint8_t*>("\x04\x0a\x02\x10\xff");
+  const auto before_failure = message.const_thing;
+  EXPECT_EQ(nullptr, ParseValue(buffer, buffer + 5, 0, message));
+  EXPECT_EQ(before_failure, message.const_thing);
+}
+
 TEST(ParseTest, PackedRepeatedFields) {
   struct Message {
     std::vector<int> repeated_ints;
@@ -754,6 +806,85 @@ TEST(ParseTest, UnpackedRepeatedFields) {
   EXPECT_EQ(0, message.repeated_thing_ptrs[1]->an_int);
 }
 
+TEST(ParseTest, SetLikeRepeatedFields) {
+  struct Message {
+    std::set<int> packed_set;
+    std::unordered_set<uint64_t> packed_hash_set;
+    std::multiset<pb::sint32_t> packed_multiset;
+    std::set<pb::fixed32_t, std::greater<pb::fixed32_t>> packed_reversed_set;
+    std::set<int> unpacked_set;
+    std::set<std::string> string_set;
+
+    using ProtobufFields = FieldList<Field<&Message::packed_set, 1>,
+                                     Field<&Message::packed_hash_set, 2>,
+                                     Field<&Message::packed_multiset, 3>,
+                                     Field<&Message::packed_reversed_set, 4>,
+                                     Field<&Message::unpacked_set, 5>,
+                                     Field<&Message::string_set, 6>>;
+  };
+
+  // clang-format off
+  constexpr std::string_view wire_bytes(
+      // "Field 1, length-delimited" "contains 5 bytes" "3" "1" "2" "3" "1".
+      "\x0a" "\x05" "\x03" "\x01" "\x02" "\x03" "\x01"
+      // "Field 2, length-delimited" "contains 4 bytes" "300" "7" "7".
+      "\x12" "\x04" "\xac\x02" "\x07" "\x07"
+      // "Field 3, length-delimited" "contains 4 bytes" "1" "-1" "1" "0".
+      "\x1a" "\x04" "\x02" "\x01" "\x02" "\x00"
+      // "Field 4, length-delimited" "contains 12 bytes" "5" "9" "5".
+      "\x22" "\x0c"
+      "\x05\x00\x00\x00"
+      "\x09\x00\x00\x00"
+      "\x05\x00\x00\x00"
+      // 3X: "Field 5, varint" "9" "4" "9".
+      "\x28" "\x09" "\x28" "\x04" "\x28" "\x09"
+      // 2X: "Field 6, length-delimited" "one char (varies)".
+      "\x32" "\x01" "b" "\x32" "\x01" "a"
+      // 2X: "Field 5, varint" "2" "4" (a second run of the same field).
+      "\x28" "\x02" "\x28" "\x04"
+      // "Field 5, length-delimited" "contains 1 byte" "6" (packed, instead).
+      "\x2a" "\x01" "\x06",
+      52);
+  // clang-format on
+
+  Message message{};
+  auto* const buffer = reinterpret_cast<const uint8_t*>(wire_bytes.data());
+  auto* after_it = ParseFields(buffer, buffer + wire_bytes.size(), 0, message);
+  EXPECT_EQ(after_it, buffer + wire_bytes.size());
+
+  EXPECT_EQ((std::set<int>{1, 2, 3}), message.packed_set);
+  EXPECT_EQ((std::unordered_set<uint64_t>{7, 300}), message.packed_hash_set);
+  EXPECT_EQ((std::multiset<pb::sint32_t>{-1, 0, 1, 1}),
+            message.packed_multiset);
+  EXPECT_EQ((std::vector<pb::fixed32_t>{9, 5}),
+            std::vector<pb::fixed32_t>(message.packed_reversed_set.begin(),
+                                       message.packed_reversed_set.end()));
+  EXPECT_EQ((std::set<int>{2, 4, 6, 9}), message.unpacked_set);
+  EXPECT_EQ((std::set<std::string>{"a", "b"}), message.string_set);
+
+  // Parsing again should result in "merge" behavior where elements are added
+  // to the existing containers.
+  message.packed_set = {0, 2, 5};
+  message.unpacked_set = {8};
+  after_it = ParseFields(buffer, buffer + wire_bytes.size(), 0, message);
+  EXPECT_EQ(after_it, buffer + wire_bytes.size());
+
+  EXPECT_EQ((std::set<int>{0, 1, 2, 3, 5}), message.packed_set);
+  EXPECT_EQ((std::unordered_set<uint64_t>{7, 300}), message.packed_hash_set);
+  EXPECT_EQ((std::multiset<pb::sint32_t>{-1, -1, 0, 0, 1, 1, 1, 1}),
+            message.packed_multiset);
+  EXPECT_EQ(2u, message.packed_reversed_set.size());
+  EXPECT_EQ((std::set<int>{2, 4, 6, 8, 9}), message.unpacked_set);
+
+  // A malformed element in the middle of a run fails the parse.
+  constexpr std::string_view truncated_run("\x28" "\x01" "\x28" "\x80", 4);
+  Message failed{};
+  auto* const truncated =
+      reinterpret_cast<const uint8_t*>(truncated_run.data());
+  EXPECT_EQ(nullptr, ParseFields(truncated, truncated + truncated_run.size(),
+                                 0, failed));
+}
+
 TEST(ParseTest, Maps) {
   struct Thing {
     int an_int = 0;
@@ -1141,5 +1272,245 @@ TEST(ParseTest, BackwardsCompatibility_OptionalBecomesRepeatable) {
   EXPECT_EQ("ghi", message_v2_2.strings[2]);
 }
 
+TEST(ParseTest, VarintsWithoutBoundsChecks) {
+  // Each varint is followed by garbage bytes, which must be ignored.
+  const std::string_view kGarbage("\xff\xff\xff\xff\xff\xff\xff\xff", 8);
+  const std::string_view varints[] = {
+      std::string_view("\x00", 1),
+      std::string_view("\x7f", 1),
+      std::string_view("\x80\x01", 2),
+      std::string_view("\xff\x7f", 2),
+      std::string_view("\x80\x80\x01", 3),
+      std::string_view("\xff\xff\xff\xff\x0f", 5),
+      std::string_view("\x80\x80\x80\x80\x80\x01", 6),
+      std::string_view("\xff\xff\xff\xff\xff\xff\x7f", 7),
+      std::string_view("\xff\xff\xff\xff\xff\xff\xff\x7f", 8),
+      std::string_view("\xff\xff\xff\xff\xff\xff\xff\xff\x7f", 9),
+      std::string_view("\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 10),
+      std::string_view("\x80\x80\x80\x80\x80\x80\x80\x80\x80\x00", 10),
+  };
+  for (std::string_view varint : varints) {
+    SCOPED_TRACE(::testing::Message() << "varint size " << varint.size());
+    const std::string padded = std::string(varint) + std::string(kGarbage);
+    auto* const buffer = reinterpret_cast<const uint8_t*>(padded.data());
+
+    uint64_t expected = 0;
+    auto* const expected_after_it =
+        ParseValue(buffer, buffer + varint.size(), 0, expected);
+    ASSERT_EQ(buffer + varint.size(), expected_after_it);
+
+    uint64_t result = 0;
+    EXPECT_EQ(expected_after_it, ParseVarintNoBoundsCheck(buffer, result));
+    EXPECT_EQ(expected, result);
+  }
+
+  // Varints longer than 10 bytes are not fully decoded.
+  uint64_t result;
+  EXPECT_EQ(nullptr,
+            ParseVarintNoBoundsCheck(
+                reinterpret_cast<const uint8_t*>(
+                    "\x8a\x80\x80\x80\x80\x80\x80\x80\x80\xf0\x7f\x00\x00"),
+                result));
+  EXPECT_EQ(10u, result);
+}
+
+// Parses |wire_bytes| into a |Message| using both the InputBounds::kExact and
+// InputBounds::kPadded modes, and checks that the outcomes are identical.
+template <typename Message>
+void TestPaddedParseMatchesExactParse(std::string_view wire_bytes,
+                                      uint8_t slop_byte_value) {
+  auto* const buffer = reinterpret_cast<const uint8_t*>(wire_bytes.data());
+  Message expected{};
+  const bool expected_success =
+      ParseFields(buffer, buffer + wire_bytes.size(), 0, expected) ==
+      buffer + wire_bytes.size();
+
+  std::vector<uint8_t> padded(wire_bytes.size() + kParseSlopBytes,
+                              slop_byte_value);
+  std::copy(wire_bytes.begin(), wire_bytes.end(), padded.begin());
+  Message result{};
+  const bool success =
+      ParseFields<InputBounds::kPadded>(padded.data(),
+                                        padded.data() + wire_bytes.size(), 0,
+                                        result) ==
+      padded.data() + wire_bytes.size();
+
+  ASSERT_EQ(expected_success, success);
+  if (success) {
+    // Compare the results by re-serializing them.
+    const auto size = ComputeSerializedSizeOfFields(
+        expected, typename Message::ProtobufFields{});
+    ASSERT_EQ(size, ComputeSerializedSizeOfFields(
+                        result, typename Message::ProtobufFields{}));
+    std::vector<uint8_t> expected_bytes(static_cast<std::size_t>(size));
+    SerializeFields(expected, typename Message::ProtobufFields{},
+                    expected_bytes.data());
+    std::vector<uint8_t> result_bytes(static_cast<std::size_t>(size));
+    SerializeFields(result, typename Message::ProtobufFields{},
+                    result_bytes.data());
+    EXPECT_EQ(expected_bytes, result_bytes);
+  }
+}
+
+TEST(ParseTest, PaddedInputMatchesExactInput) {
+  struct NestedMessage {
+    std::string a_string;
+    int64_t an_int64 = 0;
+    std::vector<uint32_t> some_uint32s;
+
+    using ProtobufFields = FieldList<Field<&NestedMessage::a_string, 1>,
+                                     Field<&NestedMessage::an_int64, 2>,
+                                     Field<&NestedMessage::some_uint32s, 3>>;
+  };
+
+  struct Message {
+    uint64_t an_uint64 = 0;
+    int32_t an_int32 = 0;
+    pb::sint64_t a_sint64;
+    bool a_bool = false;
+    double a_double = 0.0;
+    pb::fixed32_t a_fixed32;
+    std::vector<pb::sint32_t> packed_sints;
+    std::vector<float> packed_floats;
+    std::optional<NestedMessage> nested;
+    std::map<std::string, int32_t> a_map;
+
+    using ProtobufFields = FieldList<Field<&Message::an_uint64, 1>,
+                                     Field<&Message::an_int32, 2>,
+                                     Field<&Message::a_sint64, 3>,
+                                     Field<&Message::a_bool, 4>,
+                                     Field<&Message::a_double, 5>,
+                                     Field<&Message::a_fixed32, 6>,
+                                     Field<&Message::packed_sints, 7>,
+                                     Field<&Message::packed_floats, 8>,
+                                     Field<&Message::nested, 9>,
+                                     Field<&Message::a_map, 10>>;
+  };
+
+  // Only knows about some of the fields. The rest must be skipped-over.
+  struct OlderMessage {
+    int32_t an_int32 = 0;
+    pb::fixed32_t a_fixed32;
+
+    using ProtobufFields = FieldList<Field<&OlderMessage::an_int32, 2>,
+                                     Field<&OlderMessage::a_fixed32, 6>>;
+  };
+
+  // clang-format off
+  constexpr std::string_view wire_bytes(
+      // "Field 1, varint" "9871236".
+      "\x08" "\x84\xbf\xda\x04"
+      // "Field 2, varint" "-2".
+      "\x10" "\xfe\xff\xff\xff\xff\xff\xff\xff\xff\x01"
+      // "Field 3, varint" "zigzag{-65}".
+      "\x18" "\x81\x01"
+      // "Field 4, varint" "bool{true}", as an overly-long varint.
+      "\x20" "\x81\x80\x80\x80\x80\x80\x80\x80\x80\x80\x00"
+      // "Field 5, fixed64" "double{2.718}".
+      "\x29" "\x58\x39\xb4\xc8\x76\xbe\x05\x40"
+      // "Field 6, fixed32" "456".
+      "\x35" "\xc8\x01\x00\x00"
+      // "Field 7, length-delimited" "contains 4 bytes" "0" "-1" "-65".
+      "\x3a" "\x04" "\x00" "\x01" "\x81\x01"
+      // "Field 8, length-delimited" "contains 8 bytes" "3.14f" "2.71828f".
+      "\x42" "\x08" "\xc3\xf5\x48\x40" "\x4d\xf8\x2d\x40"
+      // "Field 9, length-delimited" "contains 17 bytes" "{"kittens", 300,
+      // {1, 128}}".
+      "\x4a" "\x11" "\x0a\x07kittens" "\x10\xac\x02" "\x1a\x03\x01\x80\x01"
+      // "Field 10, length-delimited" "contains 6 bytes" "{"a", 150}".
+      "\x52" "\x06" "\x0a\x01" "a" "\x10\x96\x01"
+      // "Field 11 (unknown), varint" "1".
+      "\x58" "\x01"
+      // "Field 2, varint" "7" (overwrites the earlier value).
+      "\x10" "\x07",
+      92);
+  // clang-format on
+
+  // Sanity-check that the complete wire bytes are parseable.
+  Message message{};
+  auto* const buffer = reinterpret_cast<const uint8_t*>(wire_bytes.data());
+  ASSERT_EQ(buffer + wire_bytes.size(),
+            ParseFields(buffer, buffer + wire_bytes.size(), 0, message));
+  EXPECT_EQ(7, message.an_int32);
+  EXPECT_EQ(-65, message.a_sint64);
+  EXPECT_TRUE(message.a_bool);
+  ASSERT_TRUE(message.nested.has_value());
+  EXPECT_EQ((std::vector<uint32_t>{1, 128}), message.nested->some_uint32s);
+  EXPECT_EQ(150, message.a_map["a"]);
+
+  for (const uint8_t slop_byte_value : {0x00, 0x80, 0xff}) {
+    SCOPED_TRACE(::testing::Message()
+                 << "slop byte value " << int{slop_byte_value});
+
+    // Every prefix of the wire bytes, most of which are truncated garbage.
+    for (std::size_t size = 0; size <= wire_bytes.size(); ++size) {
+      SCOPED_TRACE(::testing::Message() << "prefix size " << size);
+      TestPaddedParseMatchesExactParse<Message>(wire_bytes.substr(0, size),
+                                                slop_byte_value);
+      TestPaddedParseMatchesExactParse<OlderMessage>(
+          wire_bytes.substr(0, size), slop_byte_value);
+    }
+
+    // Corruptions of every single byte.
+    for (std::size_t i = 0; i < wire_bytes.size(); ++i) {
+      for (const uint8_t value : {0x00, 0x07, 0x7f, 0x80, 0xff}) {
+        SCOPED_TRACE(::testing::Message() << "byte " << i << " set to "
+                                          << int{value});
+        std::string corrupted(wire_bytes);
+        corrupted[i] = static_cast<char>(value);
+        TestPaddedParseMatchesExactParse<Message>(corrupted, slop_byte_value);
+        TestPaddedParseMatchesExactParse<OlderMessage>(corrupted,
+                                                       slop_byte_value);
+      }
+    }
+  }
+}
+
+TEST(ParseTest, PaddedInputMatchesExactInputForSets) {
+  struct Message {
+    std::set<uint32_t> packed_set;
+    std::set<int64_t> unpacked_set;
+    int32_t an_int32 = 0;
+
+    using ProtobufFields = FieldList<Field<&Message::packed_set, 1>,
+                                     Field<&Message::unpacked_set, 2>,
+                                     Field<&Message::an_int32, 3>>;
+  };
+
+  // clang-format off
+  constexpr std::string_view wire_bytes(
+      // "Field 1, length-delimited" "contains 4 bytes" "128" "1" "1".
+      "\x0a" "\x04" "\x80\x01" "\x01" "\x01"
+      // 3X: "Field 2, varint" "-1" "300" "1".
+      "\x10" "\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"
+      "\x10" "\xac\x02"
+      "\x10" "\x01"
+      // "Field 3, varint" "5".
+      "\x18" "\x05"
+      // "Field 2, varint" "7".
+      "\x10" "\x07",
+      26);
+  // clang-format on
+
+  for (const uint8_t slop_byte_value : {0x00, 0x10, 0x80, 0xff}) {
+    SCOPED_TRACE(::testing::Message()
+                 << "slop byte value " << int{slop_byte_value});
+    for (std::size_t size = 0; size <= wire_bytes.size(); ++size) {
+      SCOPED_TRACE(::testing::Message() << "prefix size " << size);
+      TestPaddedParseMatchesExactParse<Message>(wire_bytes.substr(0, size),
+                                                slop_byte_value);
+    }
+    for (std::size_t i = 0; i < wire_bytes.size(); ++i) {
+      for (const uint8_t value : {0x00, 0x10, 0x7f, 0x80, 0xff}) {
+        SCOPED_TRACE(::testing::Message() << "byte " << i << " set to "
+                                          << int{value});
+        std::string corrupted(wire_bytes);
+        corrupted[i] = static_cast<char>(value);
+        TestPaddedParseMatchesExactParse<Message>(corrupted, slop_byte_value);
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace pb::codec
@@ -0,0 +1,125 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "pb/codec/field_rules.h"
+
+namespace pb::codec {
+
+// Remembers the serialized size and encoding of each nested message referenced
+// by a std::shared_ptr field, for the duration of one serialization pass (e.g.,
+// one call to pb::Serialize()). When the same instance is referenced again,
+// the codec reuses the memoized size, and copies the memoized bytes instead of
+// re-encoding the message.
+//
+// A SerializationMemo is installed for the current thread while it is alive.
+// Only the outermost one takes effect, so that the size computations within a
+// serialization pass share the same memo. If none is installed, the codec
+// serializes shared messages the same as any other nested message.
+//
+// The memo assumes the messages are not modified while it is alive.
+class SerializationMemo {
+ public:
+  struct Entry {
+    // The size of the message's fields, or -1 if not yet computed.
+    int32_t payload_size = -1;
+
+    // EstimateSerializedSizeOfFieldsUpperBound() of the message, or -1 if not
+    // yet computed.
+    int32_t payload_size_upper_bound = -1;
+
+    // Points to the |payload_size| bytes of the message's fields, once they
+    // have been serialized; or null.
+    const uint8_t* encoding = nullptr;
+
+    // Holds a copy of the encoding, when it could not be left in the output
+    // buffer (see SetEncoding()).
+    std::unique_ptr<uint8_t[]> encoding_copy;
+  };
+
+  SerializationMemo() : is_installed_(current_ == nullptr) {
+    if (is_installed_) {
+      current_ = this;
+    }
+  }
+
+  ~SerializationMemo() {
+    if (is_installed_) {
+      current_ = nullptr;
+    }
+  }
+
+  SerializationMemo(const SerializationMemo&) = delete;
+  SerializationMemo& operator=(const SerializationMemo&) = delete;
+
+  // Returns the memo installed for the current thread, or null.
+  [[nodiscard]] static SerializationMemo* current() { return current_; }
+
+  // Returns the entry for the given |message|, adding an empty one the first
+  // time. The returned reference remains valid while the memo is alive.
+  template <typename Message>
+  [[nodiscard]] Entry& Lookup(const Message& message) {
+    return entries_[Key{&message, &kTypeKey<Message>}];
+  }
+
+  // Records the |entry|'s encoding, which was just serialized to the output
+  // buffer at [begin,begin+payload_size). If |will_move| is true, the bytes
+  // are not in their final place in the output buffer, and so are copied.
+  static void SetEncoding(Entry& entry, const uint8_t* begin, bool will_move) {
+    if (will_move) {
+      entry.encoding_copy.reset(new uint8_t[entry.payload_size]);
+      std::memcpy(entry.encoding_copy.get(), begin,
+                  static_cast<std::size_t>(entry.payload_size));
+      entry.encoding = entry.encoding_copy.get();
+    } else {
+      entry.encoding = begin;
+    }
+  }
+
+ private:
+  // The same instance is the same message only if it is also the same type.
+  // For example, a message and its first field share the same address.
+  template <typename Message>
+  static constexpr char kTypeKey = 0;
+
+  using Key = std::pair<const void*, const void*>;
+
+  struct KeyHash {
+    std::size_t operator()(const Key& key) const {
+      return std::hash<const void*>()(key.first) ^
+             (std::hash<const void*>()(key.second) << 1);
+    }
+  };
+
+  const bool is_installed_;
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+
+  static inline thread_local SerializationMemo* current_ = nullptr;
+};
+
+// Returns the result of calling |pass|, a serialization pass over a |Message|,
+// with a SerializationMemo installed. If the |Message| can not reference any
+// shared nested messages, no memo is needed: |pass| is simply called, at no
+// extra cost, and can be evaluated at compile time.
+template <class Message, typename Pass>
+constexpr decltype(auto) RunWithSerializationMemo(const Pass& pass) {
+  if constexpr (HasSharedMessageFields<Message>()) {
+    const SerializationMemo memo;
+    return pass();
+  } else {
+    return pass();
+  }
+}
+
+}  // namespace pb::codec
@@ -18,11 +18,14 @@
 #include "pb/codec/limits.h"
 #include "pb/codec/map_field_entry.h"
 #include "pb/codec/map_field_entry_facade.h"
+#include "pb/codec/serialization_memo.h"
 #include "pb/codec/tag.h"
 #include "pb/codec/wire_type.h"
 #include "pb/codec/zigzag.h"
 #include "pb/field_list.h"
 #include "pb/integer_wrapper.h"
+#include "pb/packed_fixed_view.h"
+#include "pb/sparse_fields.h"
 
 namespace pb::codec {
 
@@ -44,6 +47,20 @@ constexpr int32_t kWouldSerializeTooManyBytes = kMaxSerializedSize + 1;
 // times before a size range check occurs in the implementation.
 constexpr int32_t kWouldSerializeTooDeeply = kMaxSerializedSize + 2;
 
+// Specifies how much space the output buffer is known to have, and thus how the
+// SerializeValue() functions for nested messages produce their length prefix.
+enum class OutputBounds : uint8_t {
+  // The output buffer is exactly ComputeSerializedSize() bytes. The length of
+  // each nested message is computed before its fields are serialized.
+  kExact,
+
+  // The output buffer is at least EstimateSerializedSizeUpperBound() bytes.
+  // Each nested message's fields are serialized first, a few bytes beyond where
+  // they belong, and then its length is back-patched and the fields are slid
+  // down into place. This avoids walking nested messages more than once.
+  kUpperBound,
+};
+
 // ------------------------------------------------
 
 // Varints (unsigned): This template covers unsigned char, short, int, etc.
@@ -279,6 +296,23 @@ template <typename Message, typename FirstField, typename... TheRemainingFields>
       message, FieldList<TheRemainingFields...>{}, byte_count_so_far);
 }
 
+// pb::SparseFields: Only the fields that are present are visited, each as if
+// it were a message having only that one field.
+template <typename Schema>
+[[nodiscard]] int32_t ComputeSerializedSizeOfFields(
+    const SparseFields<Schema>& message,
+    SparseFieldList<Schema>,
+    int64_t byte_count_so_far = 0) {
+  for (const auto& entry : message.entries()) {
+    byte_count_so_far += SparseFields<Schema>::VisitEntry(
+        entry, [](const auto& entry, auto field_list) {
+          return ComputeSerializedSizeOfFields(entry, field_list);
+        });
+  }
+  return ComputeSerializedSizeOfFields(message, FieldList<>{},
+                                       byte_count_so_far);
+}
+
 // Nested Messages: Encoded as a length varint followed by the encoding of the
 // fields from the FieldsList walkers (above).
 template <
@@ -294,6 +328,212 @@ template <
           payload_size);
 }
 
+// Shared Messages: Same as nested messages, but the payload size is memoized.
+template <typename Message>
+[[nodiscard]] int32_t ComputeSerializedValueSize(
+    SharedMessageRef<Message> ref) {
+  SerializationMemo* const memo = SerializationMemo::current();
+  if (!memo) {
+    return ComputeSerializedValueSize(ref.message);
+  }
+  SerializationMemo::Entry& entry = memo->Lookup(ref.message);
+  if (entry.payload_size < 0) {
+    entry.payload_size = ComputeSerializedSizeOfFields(
+        ref.message, typename Message::ProtobufFields{});
+  }
+  return (ComputeSerializedValueSize(
+              static_cast<uint32_t>(entry.payload_size)) +
+          entry.payload_size);
+}
+
+// ------------------------------------------------
+
+// The EstimateSerializedValueSizeUpperBound...() functions return a number of
+// bytes that is never less than what ComputeSerializedValueSize() would return,
+// but is much cheaper to compute: Varints are assumed to take their maximum
+// possible encoded size, and so the elements of containers of scalars need not
+// be visited. The work is proportional to the number of fields and containers,
+// except for strings and nested messages in repeated fields (whose elements
+// must each be visited).
+
+// The maximum size of the length prefix of a nested message. This is the
+// amount of space set aside before a nested message's fields when serializing
+// with OutputBounds::kUpperBound.
+constexpr int32_t kMaxLengthPrefixSize =
+    ComputeSerializedValueSize(static_cast<uint32_t>(kMaxSerializedSize));
+
+// Returns true if |T| is a scalar type, having a maximum encoded size that is
+// known at compile time.
+template <typename T>
+[[nodiscard]] constexpr bool HasBoundedSerializedValueSize() {
+  return std::is_integral_v<T> || std::is_enum_v<T> ||
+         std::is_same_v<T, double> || std::is_same_v<T, float> ||
+         std::is_same_v<T, ::pb::sint32_t> ||
+         std::is_same_v<T, ::pb::sint64_t> ||
+         std::is_same_v<T, ::pb::fixed64_t> ||
+         std::is_same_v<T, ::pb::fixed32_t> ||
+         std::is_same_v<T, ::pb::sfixed64_t> ||
+         std::is_same_v<T, ::pb::sfixed32_t>;
+}
+
+// Returns the maximum number of bytes needed to encode any value of the scalar
+// type |T|.
+template <typename T>
+[[nodiscard]] constexpr int32_t GetMaxSerializedValueSize() {
+  static_assert(HasBoundedSerializedValueSize<T>());
+  if constexpr (std::is_same_v<T, bool>) {
+    return 1;
+  } else if constexpr (std::is_enum_v<T>) {
+    return GetMaxSerializedValueSize<std::underlying_type_t<T>>();
+  } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+    // Negative values are sign-extended to 64 bits before encoding.
+    return ComputeSerializedValueSize(T{-1});
+  } else if constexpr (std::is_integral_v<T>) {
+    return ComputeSerializedValueSize(std::numeric_limits<T>::max());
+  } else if constexpr (std::is_same_v<T, ::pb::sint32_t> ||
+                       std::is_same_v<T, ::pb::sint64_t>) {
+    return ComputeSerializedValueSize(
+        EncodeZigZag(std::numeric_limits<decltype(T{}.value())>::min()));
+  } else {
+    return ComputeSerializedValueSize(T{});
+  }
+}
+
+// Scalars: The maximum possible size.
+template <typename Scalar,
+          std::enable_if_t<HasBoundedSerializedValueSize<Scalar>(), int> = 0>
+[[nodiscard]] constexpr int32_t EstimateSerializedValueSizeUpperBound(Scalar) {
+  return GetMaxSerializedValueSize<Scalar>();
+}
+
+// Strings: The exact size, since it can be computed just as cheaply.
+template <typename String,
+          std::enable_if_t<std::is_same_v<String, std::string> ||
+                               std::is_same_v<String, std::string_view>,
+                           int> = 0>
+[[nodiscard]] constexpr int32_t EstimateSerializedValueSizeUpperBound(
+    const String& string) {
+  return ComputeSerializedValueSize(string);
+}
+
+// Forward declaration of EstimateSerializedValueSizeUpperBound(<nested
+// message>).
+template <typename Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] constexpr int32_t EstimateSerializedValueSizeUpperBound(
+    const Message& message);
+
+// Pairs: Estimated as a MapFieldEntry message.
+template <typename Pair,
+          std::enable_if_t<CouldBeAMapFieldEntry<Pair>(), int> = 0>
+[[nodiscard]] constexpr int32_t EstimateSerializedValueSizeUpperBound(
+    const Pair& pair) {
+  return EstimateSerializedValueSizeUpperBound(AsMapFieldEntryFacade(pair));
+}
+
+// See comments for EstimateSerializedSizeOfFieldsUpperBound<Message, ...>()
+// below. This is the base case, which terminates the recursion.
+template <typename Message>
+[[nodiscard]] constexpr int32_t EstimateSerializedSizeOfFieldsUpperBound(
+    const Message&,
+    FieldList<>,
+    int64_t byte_count_so_far = 0) {
+  if (byte_count_so_far > kMaxSerializedSize) {
+    return kWouldSerializeTooManyBytes;
+  }
+  return static_cast<int32_t>(byte_count_so_far);
+}
+
+// This type-system-tail-recursive function walks the fields of |message|, just
+// like ComputeSerializedSizeOfFields(), but accumulates an upper bound on the
+// encoded size of each field's tag+value into |byte_count_so_far|.
+template <typename Message, typename FirstField, typename... TheRemainingFields>
+[[nodiscard]] constexpr int32_t EstimateSerializedSizeOfFieldsUpperBound(
+    const Message& message,
+    FieldList<FirstField, TheRemainingFields...>,
+    int64_t byte_count_so_far = 0) {
+  constexpr Tag kTag = GetTagForSerialization<FirstField>();
+  constexpr int32_t kTagSize = ComputeSerializedValueSize(kTag);
+
+  if constexpr (CanEncodeAsAPackedRepeatedField<FirstField>()) {
+    using ValueType = IterableValueType<typename FirstField::Member>;
+    const int64_t count =
+        GetIterableSize(FirstField::GetMemberReferenceIn(message));
+    if (count > 0) {
+      const int64_t payload_size =
+          count * GetMaxSerializedValueSize<ValueType>();
+      byte_count_so_far += kTagSize;
+      byte_count_so_far +=
+          ComputeSerializedValueSize(static_cast<uint64_t>(payload_size));
+      byte_count_so_far += payload_size;
+    }
+  } else if constexpr (IsRepeatedField<FirstField>()) {
+    for (const auto& member : FirstField::GetMemberReferenceIn(message)) {
+      if (IsStoringOneValue(member)) {
+        byte_count_so_far += kTagSize;
+        byte_count_so_far +=
+            EstimateSerializedValueSizeUpperBound(GetTheOneValue(member));
+      }
+    }
+  } else {
+    const auto& member = FirstField::GetMemberReferenceIn(message);
+    if (IsStoringOneValue(member)) {
+      byte_count_so_far += kTagSize;
+      byte_count_so_far +=
+          EstimateSerializedValueSizeUpperBound(GetTheOneValue(member));
+    }
+  }
+
+  return EstimateSerializedSizeOfFieldsUpperBound(
+      message, FieldList<TheRemainingFields...>{}, byte_count_so_far);
+}
+
+// pb::SparseFields: See ComputeSerializedSizeOfFields(), above.
+template <typename Schema>
+[[nodiscard]] int32_t EstimateSerializedSizeOfFieldsUpperBound(
+    const SparseFields<Schema>& message,
+    SparseFieldList<Schema>,
+    int64_t byte_count_so_far = 0) {
+  for (const auto& entry : message.entries()) {
+    byte_count_so_far += SparseFields<Schema>::VisitEntry(
+        entry, [](const auto& entry, auto field_list) {
+          return EstimateSerializedSizeOfFieldsUpperBound(entry, field_list);
+        });
+  }
+  return EstimateSerializedSizeOfFieldsUpperBound(message, FieldList<>{},
+                                                  byte_count_so_far);
+}
+
+// Nested Messages: Space for the largest possible length prefix is always
+// included, since that is what OutputBounds::kUpperBound serialization sets
+// aside.
+template <
+    typename Message,
+    std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>, int>>
+[[nodiscard]] constexpr int32_t EstimateSerializedValueSizeUpperBound(
+    const Message& message) {
+  return kMaxLengthPrefixSize +
+         EstimateSerializedSizeOfFieldsUpperBound(
+             message, typename Message::ProtobufFields{});
+}
+
+// Shared Messages: Same as nested messages, but the upper bound is memoized.
+template <typename Message>
+[[nodiscard]] int32_t EstimateSerializedValueSizeUpperBound(
+    SharedMessageRef<Message> ref) {
+  SerializationMemo* const memo = SerializationMemo::current();
+  if (!memo) {
+    return EstimateSerializedValueSizeUpperBound(ref.message);
+  }
+  SerializationMemo::Entry& entry = memo->Lookup(ref.message);
+  if (entry.payload_size_upper_bound < 0) {
+    entry.payload_size_upper_bound = EstimateSerializedSizeOfFieldsUpperBound(
+        ref.message, typename Message::ProtobufFields{});
+  }
+  return kMaxLengthPrefixSize + entry.payload_size_upper_bound;
+}
+
 // ------------------------------------------------
 
 // All the SerializeValue...() functions return a pointer to the byte just after
@@ -301,7 +541,8 @@ template <
 // functions never return nullptr).
 
 // Varints (unsigned): This template covers unsigned char, short, int, etc.
-template <typename UnsignedIntegral,
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename UnsignedIntegral,
           std::enable_if_t<std::is_integral_v<UnsignedIntegral> &&
                                std::is_unsigned_v<UnsignedIntegral> &&
                                !std::is_same_v<UnsignedIntegral, bool>,
@@ -321,7 +562,8 @@ template <typename UnsignedIntegral,
 }
 
 // Varints (signed): This template covers signed char, short, int, etc.
-template <typename SignedIntegral,
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename SignedIntegral,
           std::enable_if_t<std::is_integral_v<SignedIntegral> &&
                                std::is_signed_v<SignedIntegral>,
                            int> = 0>
@@ -339,14 +581,18 @@ template <typename SignedIntegral,
 }
 
 // Bools: Always one byte.
-template <typename Bool, std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename Bool,
+          std::enable_if_t<std::is_same_v<Bool, bool>, int> = 0>
 [[nodiscard]] uint8_t* SerializeValue(Bool value, uint8_t* buffer) {
   *buffer = static_cast<uint8_t>(value);
   return buffer + 1;
 }
 
 // Enums: Simply cast to their underlying integral type and encode as a varint.
-template <typename Enum, std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename Enum,
+          std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
 [[nodiscard]] uint8_t* SerializeValue(Enum enum_value, uint8_t* buffer) {
   return SerializeValue(static_cast<std::underlying_type_t<Enum>>(enum_value),
                         buffer);
@@ -354,6 +600,7 @@ template <typename Enum, std::enable_if_t<std::is_enum_v<Enum>, int> = 0>
 
 // ZigZag-encoded signed integers.
 template <
+    OutputBounds kOutputBounds = OutputBounds::kExact,
     typename SignedIntegerWrapper,
     std::enable_if_t<std::is_same_v<SignedIntegerWrapper, ::pb::sint32_t> ||
                          std::is_same_v<SignedIntegerWrapper, ::pb::sint64_t>,
@@ -365,7 +612,8 @@ template <
 
 // Fixed64's: Doubles, or fixed-size 64-bit integers (as 8 little-endian bytes
 // on the wire).
-template <typename Fixed64,
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename Fixed64,
           std::enable_if_t<std::is_same_v<Fixed64, double> ||
                                std::is_same_v<Fixed64, ::pb::fixed64_t> ||
                                std::is_same_v<Fixed64, ::pb::sfixed64_t>,
@@ -392,7 +640,8 @@ template <typename Fixed64,
 
 // Fixed32's: Floats or fixed-size 32-bit integers (as 4 little-endian bytes on
 // the wire).
-template <typename Fixed32,
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename Fixed32,
           std::enable_if_t<std::is_same_v<Fixed32, float> ||
                                std::is_same_v<Fixed32, ::pb::fixed32_t> ||
                                std::is_same_v<Fixed32, ::pb::sfixed32_t>,
@@ -418,7 +667,8 @@ template <typename Fixed32,
 }
 
 // Strings: Encoded as a length varint followed by the bytes.
-template <typename String,
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename String,
           std::enable_if_t<std::is_same_v<String, std::string> ||
                                std::is_same_v<String, std::string_view>,
                            int> = 0>
@@ -430,16 +680,18 @@ template <typename String,
 }
 
 // Forward declaration of SerializeValue(<nested message>).
-template <typename Message,
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename Message,
           std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
                            int> = 0>
 [[nodiscard]] uint8_t* SerializeValue(const Message& message, uint8_t* buffer);
 
 // Pairs: Serialize as a MapFieldEntry, to support serializing maps.
-template <typename Pair,
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename Pair,
           std::enable_if_t<CouldBeAMapFieldEntry<Pair>(), int> = 0>
 [[nodiscard]] uint8_t* SerializeValue(const Pair& pair, uint8_t* buffer) {
-  return SerializeValue(AsMapFieldEntryFacade(pair), buffer);
+  return SerializeValue<kOutputBounds>(AsMapFieldEntryFacade(pair), buffer);
 }
 
 // See comments for SerializeFields<Message, ...>() below.
@@ -447,14 +699,17 @@ template <typename Pair,
 // This is the base case of the type-system-tail-recursive algorithm, where
 // there are no fields left to be serialized. Nothing is appended to |buffer|
 // and the recursion terminates from this point.
-template <typename Message>
+template <OutputBounds kOutputBounds = OutputBounds::kExact, typename Message>
 uint8_t* SerializeFields(const Message&, FieldList<>, uint8_t* buffer) {
   return buffer;
 }
 
 // This type-system-tail-recursive function walks the fields of |message|,
 // encoding each field's tag+value and appending it to |buffer|.
-template <typename Message, typename FirstField, typename... TheRemainingFields>
+template <OutputBounds kOutputBounds = OutputBounds::kExact,
+          typename Message,
+          typename FirstField,
+          typename... TheRemainingFields>
 uint8_t* SerializeFields(const Message& message,
                          FieldList<FirstField, TheRemainingFields...>,
                          uint8_t* buffer) {
@@ -472,39 +727,76 @@ uint8_t* SerializeFields(const Message& message,
           ComputePackedFieldPayloadSizeHelper<ValueType>(it, end);
       buffer = SerializeValue(static_cast<uint32_t>(payload_size), buffer);
 
-      // Note: The static_cast<ValueType&>(*it) below is necessary to adapt
-      // iterators that use proxy references (e.g.,
-      // std::vector<bool>::const_iterator).
-      do {
-        buffer = SerializeValue(static_cast<const ValueType&>(*it), buffer);
-        ++it;
-      } while (it != end);
+      if constexpr (std::is_same_v<typename FirstField::Member,
+                                   ::pb::PackedFixedView<ValueType>>) {
+        // The view references bytes that are already in the wire format.
+        std::memcpy(buffer, container.bytes(), container.size_in_bytes());
+        buffer += container.size_in_bytes();
+      } else {
+        // Note: The static_cast<ValueType&>(*it) below is necessary to adapt
+        // iterators that use proxy references (e.g.,
+        // std::vector<bool>::const_iterator).
+        do {
+          buffer = SerializeValue(static_cast<const ValueType&>(*it), buffer);
+          ++it;
+        } while (it != end);
+      }
     }
   } else if constexpr (IsRepeatedField<FirstField>()) {
     for (const auto& element_in_container :
          FirstField::GetMemberReferenceIn(message)) {
       if (IsStoringOneValue(element_in_container)) {
         buffer = SerializeValue(kTag, buffer);
-        buffer = SerializeValue(GetTheOneValue(element_in_container), buffer);
+        buffer = SerializeValue<kOutputBounds>(
+            GetTheOneValue(element_in_container), buffer);
       }
     }
   } else {
     const auto& member = FirstField::GetMemberReferenceIn(message);
     if (IsStoringOneValue(member)) {
       buffer = SerializeValue(kTag, buffer);
-      buffer = SerializeValue(GetTheOneValue(member), buffer);
+      buffer = SerializeValue<kOutputBounds>(GetTheOneValue(member), buffer);
     }
   }
 
-  return SerializeFields(message, FieldList<TheRemainingFields...>{}, buffer);
+  return SerializeFields<kOutputBounds>(
+      message, FieldList<TheRemainingFields...>{}, buffer);
+}
+
+// pb::SparseFields: See ComputeSerializedSizeOfFields(), above.
+template <OutputBounds kOutputBounds = OutputBounds::kExact, typename Schema>
+uint8_t* SerializeFields(const SparseFields<Schema>& message,
+                         SparseFieldList<Schema>,
+                         uint8_t* buffer) {
+  for (const auto& entry : message.entries()) {
+    buffer = SparseFields<Schema>::VisitEntry(
+        entry, [buffer](const auto& entry, auto field_list) {
+          return SerializeFields<kOutputBounds>(entry, field_list, buffer);
+        });
+  }
+  return buffer;
 }
 
 // Nested Messages: Encoded as a length varint followed by the encoding of the
 // fields from the FieldsList walkers (above).
 template <
+    OutputBounds kOutputBounds,
     typename Message,
     std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>, int>>
 [[nodiscard]] uint8_t* SerializeValue(const Message& message, uint8_t* buffer) {
+  if constexpr (kOutputBounds == OutputBounds::kUpperBound) {
+    // Serialize the fields just beyond the largest possible length prefix (this
+    // space was accounted for by EstimateSerializedValueSizeUpperBound()).
+    // Then, back-patch the length and slide the fields down to follow it.
+    uint8_t* const fields_begin = buffer + kMaxLengthPrefixSize;
+    uint8_t* const fields_end = SerializeFields<kOutputBounds>(
+        message, typename Message::ProtobufFields{}, fields_begin);
+    const auto payload_size = static_cast<uint32_t>(fields_end - fields_begin);
+    buffer = SerializeValue(payload_size, buffer);
+    std::memmove(buffer, fields_begin, payload_size);
+    return buffer + payload_size;
+  }
+
   const int32_t payload_size = ComputeSerializedSizeOfFields(
       message, typename Message::ProtobufFields{});
   buffer = SerializeValue(
@@ -513,4 +805,46 @@ template <
   return SerializeFields(message, typename Message::ProtobufFields{}, buffer);
 }
 
+// Shared Messages: The first time an instance is serialized in a pass, its
+// encoding is memoized. Thereafter, the memoized bytes are copied.
+template <OutputBounds kOutputBounds = OutputBounds::kExact, typename Message>
+[[nodiscard]] uint8_t* SerializeValue(SharedMessageRef<Message> ref,
+                                      uint8_t* buffer) {
+  SerializationMemo* const memo = SerializationMemo::current();
+  if (!memo) {
+    return SerializeValue<kOutputBounds>(ref.message, buffer);
+  }
+  SerializationMemo::Entry& entry = memo->Lookup(ref.message);
+  if (entry.encoding) {
+    const auto payload_size = static_cast<uint32_t>(entry.payload_size);
+    buffer = SerializeValue(payload_size, buffer);
+    std::memcpy(buffer, entry.encoding, payload_size);
+    return buffer + payload_size;
+  }
+
+  if constexpr (kOutputBounds == OutputBounds::kUpperBound) {
+    // The encoding is copied into the memo because an enclosing message's
+    // fields, which include these bytes, will be slid down later.
+    uint8_t* const fields_begin = buffer + kMaxLengthPrefixSize;
+    uint8_t* const fields_end = SerializeFields<kOutputBounds>(
+        ref.message, typename Message::ProtobufFields{}, fields_begin);
+    entry.payload_size = static_cast<int32_t>(fields_end - fields_begin);
+    SerializationMemo::SetEncoding(entry, fields_begin, true);
+    const auto payload_size = static_cast<uint32_t>(entry.payload_size);
+    buffer = SerializeValue(payload_size, buffer);
+    std::memmove(buffer, fields_begin, payload_size);
+    return buffer + payload_size;
+  }
+
+  if (entry.payload_size < 0) {
+    entry.payload_size = ComputeSerializedSizeOfFields(
+        ref.message, typename Message::ProtobufFields{});
+  }
+  buffer = SerializeValue(static_cast<uint32_t>(entry.payload_size), buffer);
+  uint8_t* const fields_end =
+      SerializeFields(ref.message, typename Message::ProtobufFields{}, buffer);
+  SerializationMemo::SetEncoding(entry, buffer, false);
+  return fields_end;
+}
+
 }  // namespace pb::codec
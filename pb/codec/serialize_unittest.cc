@@ -19,7 +19,9 @@
 
 #include "gtest/gtest.h"
 #include "pb/codec/limits.h"
+#include "pb/codec/serialization_memo.h"
 #include "pb/integer_wrapper.h"
+#include "pb/serialize.h"
 
 namespace pb::codec {
 namespace {
@@ -52,6 +54,18 @@ void TestSerialization(int line_num,
                   << HexDump(std::basic_string_view<uint8_t>(buffer,
                                                              expected.size()));
   }
+
+  // Serializing into a buffer sized by the upper-bound estimate must produce
+  // the same bytes, and never write beyond the estimate.
+  const int32_t upper_bound = EstimateSerializedValueSizeUpperBound(value);
+  ASSERT_LE(static_cast<int32_t>(expected.size()), upper_bound);
+  std::vector<uint8_t> bounded_buffer(static_cast<std::size_t>(upper_bound));
+  auto* const bounded_end =
+      SerializeValue<OutputBounds::kUpperBound>(value, bounded_buffer.data());
+  ASSERT_EQ(expected.size(),
+            static_cast<std::size_t>(bounded_end - bounded_buffer.data()));
+  EXPECT_EQ(0, std::memcmp(expected.data(), bounded_buffer.data(),
+                           expected.size()));
 }
 
 template <typename Integral>
@@ -461,6 +475,124 @@ TEST(SerializeTest, MessageFieldRules) {
                     std::string_view("\x06\x0a\x00\x0a\x00\x0a\x00", 7));
 }
 
+TEST(SerializeTest, SharedMessages) {
+  struct Config {
+    std::string name;
+    std::vector<int32_t> values;
+    using ProtobufFields =
+        FieldList<Field<&Config::name, 1>, Field<&Config::values, 2>>;
+  };
+  struct Entry {
+    int32_t id = 0;
+    std::shared_ptr<const Config> config;
+    using ProtobufFields =
+        FieldList<Field<&Entry::id, 1>, Field<&Entry::config, 2>>;
+  };
+  struct List {
+    std::vector<Entry> entries;
+    std::vector<std::shared_ptr<Config>> configs;
+    using ProtobufFields =
+        FieldList<Field<&List::entries, 1>, Field<&List::configs, 2>>;
+  };
+
+  Entry entry{};
+  entry.id = 1;
+  TestSerialization(__LINE__, entry, std::string_view("\x02\x08\x01", 3));
+  entry.config = std::make_shared<Config>(Config{"ab", {3}});
+  TestSerialization(
+      __LINE__, entry,
+      std::string_view("\x0b\x08\x01\x12\x07\x0a\x02"
+                       "ab\x12\x01\x03",
+                       12));
+
+  // Without a SerializationMemo, each reference is encoded separately. With
+  // one, the same bytes result, and the shared instance is encoded only once.
+  const auto shared_config = std::make_shared<Config>(Config{"ab", {3}});
+  List list{};
+  list.entries.assign(3, Entry{});
+  for (Entry& e : list.entries) {
+    e.config = shared_config;
+  }
+  list.configs = {shared_config, nullptr, shared_config};
+  const std::string_view config_bytes(
+      "\x07\x0a\x02"
+      "ab\x12\x01\x03",
+      8);
+  std::string expected(1, static_cast<char>(3 * (2 + 11) + 2 * (1 + 8)));
+  for (int i = 0; i < 3; ++i) {
+    expected += std::string_view("\x0a\x0b\x08\x00\x12", 5);
+    expected += config_bytes;
+  }
+  for (int i = 0; i < 2; ++i) {
+    expected += '\x12';
+    expected += config_bytes;
+  }
+  TestSerialization(__LINE__, list, expected);
+  {
+    const SerializationMemo memo;
+    TestSerialization(__LINE__, list, expected);
+    const SerializationMemo::Entry& memo_entry =
+        SerializationMemo::current()->Lookup(*shared_config);
+    EXPECT_EQ(7, memo_entry.payload_size);
+    EXPECT_NE(nullptr, memo_entry.encoding);
+
+    // Nested memos defer to the outermost one.
+    const SerializationMemo inner_memo;
+    EXPECT_EQ(&memo, SerializationMemo::current());
+  }
+  EXPECT_EQ(nullptr, SerializationMemo::current());
+}
+
+TEST(SerializeTest, OnlyMessagesHavingSharedFieldsUseAMemo) {
+  struct Plain {
+    int32_t id = 0;
+    int32_t count = 0;
+    using ProtobufFields =
+        FieldList<Field<&Plain::id, 1>, Field<&Plain::count, 2>>;
+  };
+  struct Node {
+    std::optional<Plain> plain;
+    std::unique_ptr<Node> next;
+    std::vector<Node> children;
+    std::map<int32_t, Node> named_children;
+    using ProtobufFields = FieldList<Field<&Node::plain, 1>,
+                                     Field<&Node::next, 2>,
+                                     Field<&Node::children, 3>,
+                                     Field<&Node::named_children, 4>>;
+  };
+  struct SharedPlain {
+    std::shared_ptr<const Plain> plain;
+    using ProtobufFields = FieldList<Field<&SharedPlain::plain, 1>>;
+  };
+  struct SharedString {
+    std::shared_ptr<const std::string> name;
+    using ProtobufFields = FieldList<Field<&SharedString::name, 1>>;
+  };
+  struct Outer {
+    std::unique_ptr<Node> node;
+    std::map<int32_t, std::vector<SharedPlain>> shared;
+    using ProtobufFields =
+        FieldList<Field<&Outer::node, 1>, Field<&Outer::shared, 2>>;
+  };
+
+  static_assert(!HasSharedMessageFields<Plain>());
+  static_assert(!HasSharedMessageFields<Node>());
+  static_assert(!HasSharedMessageFields<SharedString>());
+  static_assert(HasSharedMessageFields<SharedPlain>());
+  static_assert(HasSharedMessageFields<Outer>());
+
+  // Without a memo to build, serializing a plain message can still be done at
+  // compile time.
+  constexpr Plain kPlain{7, 300};
+  static_assert(pb::ComputeSerializedSize(kPlain) == 5);
+  static_assert(pb::EstimateSerializedSizeUpperBound(kPlain) >= 5);
+
+  uint8_t buffer[5]{};
+  pb::Serialize(kPlain, buffer);
+  EXPECT_EQ(0, std::memcmp("\x08\x07\x10\xac\x02", buffer, sizeof(buffer)));
+  EXPECT_EQ(nullptr, SerializationMemo::current());
+}
+
 TEST(SerializeTest, NullStringViewInMessageIsSkipped) {
   struct Message {
     int an_int;
@@ -766,5 +898,58 @@ TEST(SerializeTest, Maps) {
   // clang-format on
 }
 
+TEST(SerializeTest, UpperBoundsOfScalarsAreTheMaximumEncodedSizes) {
+  static_assert(GetMaxSerializedValueSize<bool>() == 1);
+  static_assert(GetMaxSerializedValueSize<uint8_t>() == 2);
+  static_assert(GetMaxSerializedValueSize<uint16_t>() == 3);
+  static_assert(GetMaxSerializedValueSize<uint32_t>() == 5);
+  static_assert(GetMaxSerializedValueSize<uint64_t>() == 10);
+  static_assert(GetMaxSerializedValueSize<int8_t>() == 10);
+  static_assert(GetMaxSerializedValueSize<int32_t>() == 10);
+  static_assert(GetMaxSerializedValueSize<pb::sint32_t>() == 5);
+  static_assert(GetMaxSerializedValueSize<pb::sint64_t>() == 10);
+  static_assert(GetMaxSerializedValueSize<float>() == 4);
+  static_assert(GetMaxSerializedValueSize<double>() == 8);
+  static_assert(GetMaxSerializedValueSize<pb::fixed32_t>() == 4);
+  static_assert(GetMaxSerializedValueSize<pb::sfixed64_t>() == 8);
+  enum class SmallEnum : uint8_t { kZero };
+  static_assert(GetMaxSerializedValueSize<SmallEnum>() == 2);
+  static_assert(kMaxLengthPrefixSize == 4);
+}
+
+TEST(SerializeTest, UpperBoundsOfRepeatedScalarsDependOnlyOnCounts) {
+  struct Message {
+    std::vector<uint32_t> packed_varints;
+    std::vector<double> packed_doubles;
+    std::vector<std::string> strings;
+
+    using ProtobufFields = FieldList<Field<&Message::packed_varints, 1>,
+                                     Field<&Message::packed_doubles, 2>,
+                                     Field<&Message::strings, 3>>;
+  };
+
+  Message message{};
+  EXPECT_EQ(0, EstimateSerializedSizeOfFieldsUpperBound(
+                   message, Message::ProtobufFields{}));
+
+  message.packed_varints.assign(100, 1);
+  message.packed_doubles.assign(10, 1.0);
+  message.strings = {"abc", "defg"};
+  const int32_t expected_bound = (1 + 2 + 100 * 5) +  // Field 1.
+                                 (1 + 1 + 10 * 8) +   // Field 2.
+                                 (1 + 1 + 3) + (1 + 1 + 4);  // Field 3.
+  EXPECT_EQ(expected_bound, EstimateSerializedSizeOfFieldsUpperBound(
+                                message, Message::ProtobufFields{}));
+  EXPECT_EQ(expected_bound - 400 - 1,
+            ComputeSerializedSizeOfFields(message, Message::ProtobufFields{}));
+
+  // The actual values of the varints make no difference.
+  message.packed_varints.assign(100, std::numeric_limits<uint32_t>::max());
+  EXPECT_EQ(expected_bound, EstimateSerializedSizeOfFieldsUpperBound(
+                                message, Message::ProtobufFields{}));
+  EXPECT_EQ(expected_bound,
+            ComputeSerializedSizeOfFields(message, Message::ProtobufFields{}));
+}
+
 }  // namespace
 }  // namespace pb::codec
@@ -0,0 +1,335 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/iterable_util.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/tag.h"
+#include "pb/codec/wire_type.h"
+#include "pb/field_list.h"
+
+namespace pb::codec {
+
+// Records the prior state of each part of a message that a parse is about to
+// modify, so that it can be restored if the parse fails. This is what makes
+// pb::TryMergeFromBuffer() cheaper than backing-up a copy of the whole
+// message: Only the fields present in the input are recorded, and most of them
+// without copying anything that could be large. A container that a parse
+// appends to is recorded as its size, and a string that a parse replaces is
+// moved into the log.
+//
+// Entries are restored in the reverse of the order they were recorded, and so
+// recording the same object more than once is harmless. Only SaveCopy() skips
+// an object it has already recorded, since the input has a tag for each map
+// entry or unpacked set element, and copying the container for every one of
+// them would take time and memory quadratic in its size.
+class UndoLog {
+ public:
+  UndoLog() = default;
+  UndoLog(const UndoLog&) = delete;
+  UndoLog& operator=(const UndoLog&) = delete;
+
+  // Saves the bytes of a small, trivially-copyable |object| (e.g., a scalar, a
+  // std::string_view, or a nested message of only scalars).
+  template <typename T>
+  void SaveBytes(T& object) {
+    static_assert(std::is_trivially_copyable_v<T> &&
+                  sizeof(T) <= sizeof(Entry::bytes));
+    Entry& entry = AddEntry(&object, [](Entry& entry, UndoLog&) {
+      std::memcpy(entry.target, entry.bytes, sizeof(T));
+    });
+    std::memcpy(entry.bytes, static_cast<const void*>(&object), sizeof(T));
+  }
+
+  // Moves the |string| into the log, leaving it empty. This is only correct
+  // for a string that the parse replaces entirely, as it does a string field.
+  void SaveString(std::string& string) {
+    AddEntry(&string, [](Entry& entry, UndoLog& log) {
+      *static_cast<std::string*>(entry.target) =
+          std::move(log.strings_[LoadIndex(entry)]);
+    });
+    StoreIndex(strings_.size(), entries_.back());
+    strings_.push_back(std::move(string));
+  }
+
+  // Saves the size of a |container| that a parse may append to (e.g., a
+  // std::vector), by truncating it back to that size.
+  template <typename Container>
+  void SaveSize(Container& container) {
+    AddEntry(&container, [](Entry& entry, UndoLog&) {
+      static_cast<Container*>(entry.target)
+          ->resize(static_cast<typename Container::size_type>(
+              LoadIndex(entry)));
+    });
+    StoreIndex(container.size(), entries_.back());
+  }
+
+  // Saves that a std::optional, std::unique_ptr, or std::shared_ptr holds no
+  // value, by resetting it.
+  template <typename Nullable>
+  void SaveReset(Nullable& nullable) {
+    AddEntry(&nullable, [](Entry& entry, UndoLog&) {
+      static_cast<Nullable*>(entry.target)->reset();
+    });
+  }
+
+  // Saves a copy of the |object|, for anything else (e.g., a std::set, which a
+  // parse may insert into anywhere). Does nothing if the |object| was already
+  // copied: The first copy is the one restored last. Keying on the address
+  // alone is safe because nothing inside a copied object is recorded.
+  template <typename T>
+  void SaveCopy(T& object) {
+    if (!copied_targets_.insert(&object).second) {
+      return;
+    }
+    AddEntry(&object, [](Entry& entry, UndoLog& log) {
+      *static_cast<T*>(entry.target) =
+          std::move(*static_cast<T*>(log.copies_[LoadIndex(entry)].get()));
+    });
+    StoreIndex(copies_.size(), entries_.back());
+    copies_.push_back(std::make_shared<T>(object));
+  }
+
+  // Restores everything recorded, in reverse order, and then clears the log.
+  void Rollback() {
+    for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+      it->restore(*it, *this);
+    }
+    Clear();
+  }
+
+  // Forgets everything recorded (e.g., once the parse has succeeded), keeping
+  // the capacity for reuse.
+  void Clear() {
+    entries_.clear();
+    strings_.clear();
+    copies_.clear();
+    copied_targets_.clear();
+  }
+
+  [[nodiscard]] bool empty() const { return entries_.empty(); }
+
+ private:
+  struct Entry {
+    void (*restore)(Entry& entry, UndoLog& log);
+    void* target;
+    alignas(8) unsigned char bytes[16];
+  };
+
+  Entry& AddEntry(void* target, void (*restore)(Entry&, UndoLog&)) {
+    Entry& entry = entries_.emplace_back();
+    entry.restore = restore;
+    entry.target = target;
+    return entry;
+  }
+
+  static void StoreIndex(std::size_t index, Entry& entry) {
+    const auto value = static_cast<uint64_t>(index);
+    std::memcpy(entry.bytes, &value, sizeof(value));
+  }
+
+  [[nodiscard]] static std::size_t LoadIndex(const Entry& entry) {
+    uint64_t value;
+    std::memcpy(&value, entry.bytes, sizeof(value));
+    return static_cast<std::size_t>(value);
+  }
+
+  std::vector<Entry> entries_;
+  std::vector<std::string> strings_;
+  std::vector<std::shared_ptr<void>> copies_;
+  std::unordered_set<const void*> copied_targets_;
+};
+
+namespace internal {
+
+// Detects the pb::Field<> instantiations, whose members are plain data members
+// that can be recorded without side-effects (unlike, e.g., the fields of a
+// pb::SparseFields, whose members are added as they are accessed).
+template <typename TheField>
+struct IsPlainFieldDetector : std::false_type {};
+
+template <auto kMemberPointer, int32_t kFieldNumber, const char* kName>
+struct IsPlainFieldDetector<::pb::Field<kMemberPointer, kFieldNumber, kName>>
+    : std::true_type {};
+
+template <typename Fields>
+struct HasOnlyPlainFieldsDetector : std::false_type {};
+
+template <typename... Fields>
+struct HasOnlyPlainFieldsDetector<::pb::FieldList<Fields...>>
+    : std::bool_constant<(IsPlainFieldDetector<Fields>::value && ...)> {};
+
+template <typename Container, typename Enable = void>
+struct ResizeDetector : std::false_type {};
+
+template <typename Container>
+struct ResizeDetector<
+    Container,
+    std::void_t<decltype(std::declval<Container&>().resize(
+        std::declval<typename Container::size_type>()))>> : std::true_type {};
+
+template <typename T>
+struct UndoNullableDetector : std::false_type {};
+
+template <typename T>
+struct UndoNullableDetector<std::optional<T>> : std::true_type {};
+
+template <typename T>
+struct UndoNullableDetector<std::unique_ptr<T>> : std::true_type {};
+
+template <typename T>
+struct UndoNullableDetector<std::shared_ptr<T>>
+    : std::bool_constant<!std::is_const_v<T>> {};
+
+}  // namespace internal
+
+// Returns true if RecordUndoForFields() can record the fields of a |Message|.
+// Otherwise, the whole message must be copied instead.
+template <typename Message>
+[[nodiscard]] constexpr bool CanRecordUndoForFields() {
+  return internal::HasOnlyPlainFieldsDetector<
+      typename Message::ProtobufFields>::value;
+}
+
+template <typename Message>
+[[nodiscard]] bool RecordUndoForFields(const uint8_t* buffer,
+                                       const uint8_t* buffer_end,
+                                       int nesting_level,
+                                       Message& message,
+                                       UndoLog& log);
+
+// Records, in the |log|, everything about the |member| that a parse of the
+// value in the range |value| to |value_end| (just after its tag) could modify.
+// Returns false if the value is malformed such that the parse is sure to fail.
+template <typename Member>
+[[nodiscard]] bool RecordUndoForValue(const uint8_t* value,
+                                      const uint8_t* value_end,
+                                      WireType wire_type,
+                                      int nesting_level,
+                                      Member& member,
+                                      UndoLog& log) {
+  constexpr bool kIsRepeated =
+      IsIterable<Member>() && !(std::is_same_v<Member, std::string> ||
+                                std::is_same_v<Member, std::string_view>);
+  if constexpr (kIsRepeated && internal::ResizeDetector<Member>::value) {
+    log.SaveSize(member);
+  } else if constexpr (std::is_trivially_copyable_v<Member> &&
+                       sizeof(Member) <= 16) {
+    log.SaveBytes(member);
+  } else if constexpr (std::is_same_v<Member, std::string>) {
+    log.SaveString(member);
+  } else if constexpr (IsMessage<Member>()) {
+    if constexpr (CanRecordUndoForFields<Member>()) {
+      // Any other wire type fails the parse without modifying the message.
+      if (wire_type != WireType::kLengthDelimited) {
+        return true;
+      }
+      if (nesting_level >= kMaxMessageNestingDepth) {
+        return false;
+      }
+      uint32_t byte_count;
+      const uint8_t* const payload =
+          ParseValue(value, value_end, nesting_level, byte_count);
+      return payload && RecordUndoForFields(payload, value_end,
+                                            nesting_level + 1, member, log);
+    } else {
+      log.SaveCopy(member);
+    }
+  } else if constexpr (internal::UndoNullableDetector<Member>::value) {
+    // A parse merges into the value held, or else into a new one.
+    if (!member) {
+      log.SaveReset(member);
+      return true;
+    }
+    return RecordUndoForValue(value, value_end, wire_type, nesting_level,
+                              *member, log);
+  } else {
+    // E.g., a std::set or std::map, or a std::shared_ptr<const T> (which a
+    // parse replaces with a new instance).
+    log.SaveCopy(member);
+  }
+  return true;
+}
+
+// Searches for the field having the given |field_number|, and calls
+// RecordUndoForValue() for its member. This is the same compile-time binary
+// search as ParseValueAfterTag().
+template <typename Message,
+          std::size_t kBeginIndex = 0,
+          std::size_t kEndIndex = Message::ProtobufFields::kFieldCount>
+[[nodiscard]] bool RecordUndoForFieldValue(const uint8_t* value,
+                                           const uint8_t* value_end,
+                                           WireType wire_type,
+                                           int32_t field_number,
+                                           int nesting_level,
+                                           Message& message,
+                                           UndoLog& log) {
+  if constexpr (kBeginIndex < kEndIndex) {
+    constexpr auto kPivotIndex = kBeginIndex + (kEndIndex - kBeginIndex) / 2;
+    using PivotField =
+        typename Message::ProtobufFields::template FieldAt<kPivotIndex>;
+
+    if (field_number == PivotField::GetFieldNumber()) {
+      return RecordUndoForValue(
+          value, value_end, wire_type, nesting_level,
+          PivotField::GetMutableMemberReferenceIn(message), log);
+    } else if (field_number < PivotField::GetFieldNumber()) {
+      return RecordUndoForFieldValue<Message, kBeginIndex, kPivotIndex>(
+          value, value_end, wire_type, field_number, nesting_level, message,
+          log);
+    } else /* if (field_number > PivotField::GetFieldNumber()) */ {
+      return RecordUndoForFieldValue<Message, kPivotIndex + 1, kEndIndex>(
+          value, value_end, wire_type, field_number, nesting_level, message,
+          log);
+    }
+  } else {
+    return true;  // An unknown field, which the parse skips.
+  }
+}
+
+// Scans the |buffer| for encoded tag+value pairs, and records each member of
+// the |message| that ParseFields() would modify. The values are skipped the
+// same way the parse skips unknown fields, and so this returns false only for
+// a |buffer| that the parse would also fail on.
+template <typename Message>
+[[nodiscard]] bool RecordUndoForFields(const uint8_t* buffer,
+                                       const uint8_t* buffer_end,
+                                       int nesting_level,
+                                       Message& message,
+                                       UndoLog& log) {
+  while (buffer != buffer_end) {
+    Tag tag;
+    buffer = ParseValue(buffer, buffer_end, nesting_level, tag);
+    if (!buffer) {
+      return false;
+    }
+    const uint8_t* const value = buffer;
+    const WireType wire_type = GetWireTypeFromTag(tag);
+    buffer = SkipValueAfterTag(buffer, buffer_end, nesting_level, wire_type);
+    if (!buffer ||
+        !RecordUndoForFieldValue(value, buffer, wire_type,
+                                 GetFieldNumberFromTag(tag), nesting_level,
+                                 message, log)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace pb::codec
@@ -0,0 +1,285 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/codec/undo_log.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+#include "pb/sparse_fields.h"
+
+namespace pb::codec {
+namespace {
+
+struct Point {
+  int32_t x = 0;
+  int32_t y = 0;
+
+  using ProtobufFields = FieldList<Field<&Point::x, 1>, Field<&Point::y, 2>>;
+};
+
+struct Label {
+  std::string text;
+  std::vector<int32_t> spans;
+
+  using ProtobufFields =
+      FieldList<Field<&Label::text, 1>, Field<&Label::spans, 2>>;
+};
+
+struct Account {
+  int64_t id = 0;
+  std::optional<int32_t> level;
+  std::string name;
+  std::vector<int32_t> scores;
+  std::vector<Label> history;
+  Label label;
+  std::unique_ptr<Label> note;
+  std::optional<Label> title;
+  std::set<int32_t> flags;
+  std::map<int32_t, std::string> names;
+  std::shared_ptr<const Point> home;
+  std::string_view alias;
+  Point position;
+  sint64_t balance;
+
+  using ProtobufFields = FieldList<Field<&Account::id, 1>,
+                                   Field<&Account::level, 2>,
+                                   Field<&Account::name, 3>,
+                                   Field<&Account::scores, 4>,
+                                   Field<&Account::history, 5>,
+                                   Field<&Account::label, 6>,
+                                   Field<&Account::note, 7>,
+                                   Field<&Account::title, 8>,
+                                   Field<&Account::flags, 9>,
+                                   Field<&Account::names, 10>,
+                                   Field<&Account::home, 11>,
+                                   Field<&Account::alias, 12>,
+                                   Field<&Account::position, 13>,
+                                   Field<&Account::balance, 14>>;
+};
+
+using SparseLabel = SparseFields<Label>;
+
+Account MakeAccount() {
+  Account account;
+  account.id = 7;
+  account.name = "long-lived account name";
+  account.scores = {1, 2, 3};
+  account.history = {Label{"first", {1}}};
+  account.label = Label{"label", {4, 5}};
+  account.title = Label{"title", {}};
+  account.flags = {10, 20};
+  account.names = {{1, "one"}};
+  account.home = std::make_shared<const Point>(Point{1, 2});
+  account.alias = "alias";
+  account.position = Point{3, 4};
+  account.balance = -100;
+  return account;
+}
+
+Account MakeUpdate() {
+  Account update;
+  update.id = 8;
+  update.level = 3;
+  update.name = "a new name";
+  update.scores = {4, 5};
+  update.history = {Label{"second", {2}}, Label{"third", {3}}};
+  update.label = Label{"relabeled", {6}};
+  update.note = std::make_unique<Label>(Label{"noted", {7}});
+  update.title = Label{"retitled", {8}};
+  update.flags = {15, 30};
+  update.names = {{1, "uno"}, {2, "two"}};
+  update.home = std::make_shared<const Point>(Point{5, 6});
+  update.alias = "other alias";
+  update.position = Point{7, 8};
+  update.balance = 200;
+  return update;
+}
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(ComputeSerializedSize(message)));
+  Serialize(message, buffer.data());
+  return buffer;
+}
+
+TEST(UndoLogTest, RestoresInReverseOrder) {
+  std::string text = "before";
+  std::vector<int32_t> values = {1, 2};
+  std::optional<int32_t> maybe;
+  int64_t number = 42;
+  std::set<int32_t> set = {1};
+
+  UndoLog log;
+  EXPECT_TRUE(log.empty());
+  log.SaveString(text);
+  log.SaveSize(values);
+  log.SaveReset(maybe);
+  log.SaveBytes(number);
+  log.SaveCopy(set);
+  // Recording again, after some modifications, is harmless.
+  text = "during";
+  number = 43;
+  log.SaveString(text);
+  log.SaveBytes(number);
+  EXPECT_FALSE(log.empty());
+
+  text = "after";
+  values.push_back(3);
+  maybe = 5;
+  number = 44;
+  set.insert(2);
+  log.Rollback();
+  EXPECT_TRUE(log.empty());
+  EXPECT_EQ("before", text);
+  EXPECT_EQ(std::vector<int32_t>({1, 2}), values);
+  EXPECT_FALSE(maybe);
+  EXPECT_EQ(42, number);
+  EXPECT_EQ(std::set<int32_t>({1}), set);
+
+  // Once cleared, nothing is restored.
+  log.SaveBytes(number);
+  number = 45;
+  log.Clear();
+  log.Rollback();
+  EXPECT_EQ(45, number);
+}
+
+TEST(UndoLogTest, TryMergeFromBufferSucceedsAsMergeFromBufferWould) {
+  const std::vector<uint8_t> update = SerializeToVector(MakeUpdate());
+  Account merged = MakeAccount();
+  ASSERT_TRUE(MergeFromBuffer(update.data(), update.data() + update.size(),
+                              merged));
+  Account tried = MakeAccount();
+  ASSERT_TRUE(TryMergeFromBuffer(update.data(), update.data() + update.size(),
+                                 tried));
+  EXPECT_EQ(SerializeToVector(merged), SerializeToVector(tried));
+  EXPECT_EQ("a new name", tried.name);
+  EXPECT_EQ(5u, tried.scores.size());
+  ASSERT_TRUE(tried.note);
+  EXPECT_EQ("noted", tried.note->text);
+}
+
+TEST(UndoLogTest, TryMergeFromBufferRestoresTheMessageOnFailure) {
+  const std::vector<uint8_t> original = SerializeToVector(MakeAccount());
+  const std::vector<uint8_t> update = SerializeToVector(MakeUpdate());
+
+  // Every field is parsed before the failure at the very end: a truncated tag.
+  std::vector<uint8_t> truncated = update;
+  truncated.push_back(0x80);
+  Account account = MakeAccount();
+  const std::shared_ptr<const Point> home = account.home;
+  EXPECT_FALSE(TryMergeFromBuffer(
+      truncated.data(), truncated.data() + truncated.size(), account));
+  EXPECT_EQ(original, SerializeToVector(account));
+  EXPECT_EQ(home, account.home);
+  EXPECT_FALSE(account.note);
+  EXPECT_FALSE(account.level);
+
+  // A field with the wrong wire type, after the others: The scan of the input
+  // succeeds, but the parse fails.
+  std::vector<uint8_t> mistyped = update;
+  mistyped.push_back(MakeTag(3, WireType::kVarint));
+  mistyped.push_back(1);
+  EXPECT_FALSE(TryMergeFromBuffer(
+      mistyped.data(), mistyped.data() + mistyped.size(), account));
+  EXPECT_EQ(original, SerializeToVector(account));
+
+  // A malformed nested message.
+  Account with_bad_label;
+  with_bad_label.label.text = "x";
+  std::vector<uint8_t> bad_label = SerializeToVector(with_bad_label);
+  bad_label.back() = 0x80;  // The label's text becomes a truncated varint.
+  bad_label.insert(bad_label.begin(), update.begin(), update.end());
+  EXPECT_FALSE(TryMergeFromBuffer(
+      bad_label.data(), bad_label.data() + bad_label.size(), account));
+  EXPECT_EQ(original, SerializeToVector(account));
+}
+
+TEST(UndoLogTest, TryMergeFromBufferMatchesMergeFromBufferOnCorruptInput) {
+  const std::vector<uint8_t> original = SerializeToVector(MakeAccount());
+  const std::vector<uint8_t> update = SerializeToVector(MakeUpdate());
+  std::mt19937 random(1);
+  int failures = 0;
+  for (int i = 0; i < 3000; ++i) {
+    std::vector<uint8_t> corrupt = update;
+    for (int j = 0, n = 1 + static_cast<int>(random() % 3); j < n; ++j) {
+      corrupt[random() % corrupt.size()] = static_cast<uint8_t>(random());
+    }
+    corrupt.resize(corrupt.size() - random() % 4);
+
+    Account merged = MakeAccount();
+    const bool merge_success = MergeFromBuffer(
+        corrupt.data(), corrupt.data() + corrupt.size(), merged);
+    Account tried = MakeAccount();
+    const bool try_success = TryMergeFromBuffer(
+        corrupt.data(), corrupt.data() + corrupt.size(), tried);
+    ASSERT_EQ(merge_success, try_success) << "iteration " << i;
+    if (try_success) {
+      ASSERT_EQ(SerializeToVector(merged), SerializeToVector(tried));
+    } else {
+      ASSERT_EQ(original, SerializeToVector(tried)) << "iteration " << i;
+      ++failures;
+    }
+  }
+  EXPECT_GT(failures, 100);
+}
+
+TEST(UndoLogTest, TryMergeFromBufferCopiesEachContainerOnce) {
+  // Each map entry has its own tag. Copying the whole (large) map for every
+  // one of them would take time and memory quadratic in its size, which is
+  // more than enough to fail this test.
+  constexpr int32_t kEntryCount = 10000;
+  Account update;
+  for (int32_t i = 0; i < kEntryCount; ++i) {
+    update.names[kEntryCount + i] = "added";
+  }
+  std::vector<uint8_t> truncated = SerializeToVector(update);
+  truncated.push_back(0x80);
+
+  Account account;
+  for (int32_t i = 0; i < kEntryCount; ++i) {
+    account.names[i] = "existing";
+  }
+  const std::vector<uint8_t> original = SerializeToVector(account);
+  EXPECT_FALSE(TryMergeFromBuffer(
+      truncated.data(), truncated.data() + truncated.size(), account));
+  EXPECT_EQ(original, SerializeToVector(account));
+
+  // The log is reused, on this thread, by a merge that succeeds.
+  truncated.pop_back();
+  ASSERT_TRUE(TryMergeFromBuffer(
+      truncated.data(), truncated.data() + truncated.size(), account));
+  EXPECT_EQ(2u * kEntryCount, account.names.size());
+  EXPECT_EQ("added", account.names[kEntryCount]);
+}
+
+TEST(UndoLogTest, TryMergeFromBufferCopiesSparseFields) {
+  SparseLabel label;
+  label.set<&Label::text>("before");
+  const std::vector<uint8_t> original = SerializeToVector(label);
+
+  std::vector<uint8_t> truncated = SerializeToVector(Label{"after", {1, 2}});
+  truncated.push_back(0x80);
+  EXPECT_FALSE(TryMergeFromBuffer(
+      truncated.data(), truncated.data() + truncated.size(), label));
+  EXPECT_EQ(original, SerializeToVector(label));
+  EXPECT_FALSE(label.has<&Label::spans>());
+}
+
+}  // namespace
+}  // namespace pb::codec
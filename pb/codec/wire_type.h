@@ -86,6 +86,14 @@ template <typename T,
   return GetWireType<typename T::element_type>();
 }
 
+template <typename T,
+          std::enable_if_t<
+              std::is_same_v<T, std::shared_ptr<typename T::element_type>>,
+              int> = 0>
+[[nodiscard]] constexpr WireType GetWireType() {
+  return GetWireType<std::remove_const_t<typename T::element_type>>();
+}
+
 template <typename Pair,
           std::enable_if_t<CouldBeAMapFieldEntry<Pair>(), int> = 0>
 [[nodiscard]] constexpr WireType GetWireType() {
@@ -0,0 +1,937 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/dynamic_message.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/serialize.h"
+#include "pb/codec/tag.h"
+#include "pb/codec/zigzag.h"
+
+namespace pb {
+
+namespace {
+
+using Type = DynamicFieldType;
+using codec::WireType;
+
+// Field numbers below this are looked up in a direct table.
+constexpr int32_t kMaxDenseFieldNumber = 2047;
+
+constexpr std::initializer_list<Type> kSignedTypes = {
+    Type::kInt32,    Type::kInt64,    Type::kSint32, Type::kSint64,
+    Type::kSfixed32, Type::kSfixed64, Type::kEnum};
+constexpr std::initializer_list<Type> kUnsignedTypes = {
+    Type::kUint32, Type::kUint64, Type::kFixed32, Type::kFixed64};
+constexpr std::initializer_list<Type> kFloatingPointTypes = {Type::kFloat,
+                                                             Type::kDouble};
+constexpr std::initializer_list<Type> kBoolType = {Type::kBool};
+constexpr std::initializer_list<Type> kStringTypes = {Type::kString,
+                                                      Type::kBytes};
+constexpr std::initializer_list<Type> kMessageType = {Type::kMessage};
+
+[[nodiscard]] constexpr WireType GetWireTypeOf(Type type) {
+  switch (type) {
+    case Type::kFixed32:
+    case Type::kSfixed32:
+    case Type::kFloat:
+      return WireType::kFixed32Bit;
+    case Type::kFixed64:
+    case Type::kSfixed64:
+    case Type::kDouble:
+      return WireType::kFixed64Bit;
+    case Type::kString:
+    case Type::kBytes:
+    case Type::kMessage:
+      return WireType::kLengthDelimited;
+    default:
+      return WireType::kVarint;
+  }
+}
+
+[[nodiscard]] constexpr bool IsScalar(Type type) {
+  return GetWireTypeOf(type) != WireType::kLengthDelimited;
+}
+
+// Converts a value set by SetInt64() or AddInt64() to how it is held.
+[[nodiscard]] uint64_t FromSigned(Type type, int64_t value) {
+  switch (type) {
+    case Type::kInt32:
+    case Type::kSint32:
+    case Type::kSfixed32:
+    case Type::kEnum:
+      return static_cast<uint64_t>(
+          static_cast<int64_t>(static_cast<int32_t>(value)));
+    default:
+      return static_cast<uint64_t>(value);
+  }
+}
+
+// Converts a value set by SetUint64() or AddUint64() to how it is held.
+[[nodiscard]] uint64_t FromUnsigned(Type type, uint64_t value) {
+  switch (type) {
+    case Type::kUint32:
+    case Type::kFixed32:
+      return static_cast<uint32_t>(value);
+    default:
+      return value;
+  }
+}
+
+// Floats are held as their 32 bits, so that they serialize exactly as parsed.
+[[nodiscard]] uint64_t FromDouble(Type type, double value) {
+  if (type == Type::kFloat) {
+    const auto f = static_cast<float>(value);
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+  }
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+[[nodiscard]] double ToDouble(Type type, uint64_t bits) {
+  if (type == Type::kFloat) {
+    const auto bits32 = static_cast<uint32_t>(bits);
+    float f;
+    std::memcpy(&f, &bits32, sizeof(f));
+    return f;
+  }
+  double d;
+  std::memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+// Only used in assertions.
+[[maybe_unused, nodiscard]] bool IsOneOf(Type type,
+                                         std::initializer_list<Type> types) {
+  return std::find(types.begin(), types.end(), type) != types.end();
+}
+
+}  // namespace
+
+// The table-driven codec for DynamicMessages. Each value is decoded, sized and
+// encoded with the same codec functions that the struct-based messages use, so
+// that the wire bytes are identical.
+class DynamicCodec {
+ public:
+  using FieldCodec = DynamicSchema::FieldCodec;
+  using Value = DynamicMessage::Value;
+
+  [[nodiscard]] static const uint8_t* ParseFields(const uint8_t* buffer,
+                                                  const uint8_t* buffer_end,
+                                                  int nesting_level,
+                                                  DynamicMessage& message) {
+    const DynamicSchema& schema = *message.schema_;
+    while (buffer != buffer_end) {
+      codec::Tag tag;
+      buffer = codec::ParseValue(buffer, buffer_end, nesting_level, tag);
+      if (!buffer) {
+        return nullptr;
+      }
+      const WireType wire_type = codec::GetWireTypeFromTag(tag);
+      const int32_t field_index =
+          schema.FindFieldIndex(codec::GetFieldNumberFromTag(tag));
+      if (field_index < 0) {
+        buffer = codec::SkipValueAfterTag(buffer, buffer_end, nesting_level,
+                                          wire_type);
+      } else {
+        buffer = ParseValueAfterTag(buffer, buffer_end, nesting_level,
+                                    wire_type, field_index, message);
+      }
+      if (!buffer) {
+        return nullptr;
+      }
+    }
+    return buffer;
+  }
+
+  // Returns the serialized size of the |message|'s fields, and saves it (and
+  // that of each nested message) for SerializeFields().
+  [[nodiscard]] static int64_t ComputeSize(const DynamicMessage& message) {
+    const DynamicSchema& schema = *message.schema_;
+    int64_t size = 0;
+    for (const Value& value : message.values_) {
+      const FieldCodec& field =
+          schema.codecs_[static_cast<std::size_t>(value.field_index)];
+      if (!field.is_repeated) {
+        size += field.tag_size + ComputeValueSize(field, value.bits, message);
+        continue;
+      }
+      const std::vector<uint64_t>& elements = message.repeated_[value.bits];
+      if (elements.empty()) {
+        continue;
+      }
+      if (field.is_packed) {
+        const int64_t payload_size = ComputePackedPayloadSize(field, elements);
+        size += field.tag_size +
+                codec::ComputeSerializedValueSize(
+                    static_cast<uint32_t>(payload_size)) +
+                payload_size;
+      } else {
+        for (const uint64_t element : elements) {
+          size += field.tag_size + ComputeValueSize(field, element, message);
+        }
+      }
+    }
+    message.cached_size_.store(static_cast<int32_t>(
+        std::min<int64_t>(size, codec::kWouldSerializeTooManyBytes)));
+    return size;
+  }
+
+  // Requires that ComputeSize() was just called on the |message|.
+  [[nodiscard]] static uint8_t* SerializeFields(const DynamicMessage& message,
+                                                uint8_t* buffer) {
+    const DynamicSchema& schema = *message.schema_;
+    for (const Value& value : message.values_) {
+      const FieldCodec& field =
+          schema.codecs_[static_cast<std::size_t>(value.field_index)];
+      if (!field.is_repeated) {
+        buffer = SerializeTag(field, buffer);
+        buffer = SerializeValue(field, value.bits, message, buffer);
+        continue;
+      }
+      const std::vector<uint64_t>& elements = message.repeated_[value.bits];
+      if (elements.empty()) {
+        continue;
+      }
+      if (field.is_packed) {
+        buffer = SerializeTag(field, buffer);
+        buffer = codec::SerializeValue(
+            static_cast<uint32_t>(ComputePackedPayloadSize(field, elements)),
+            buffer);
+        for (const uint64_t element : elements) {
+          buffer = SerializeScalar(field.type, element, buffer);
+        }
+      } else {
+        for (const uint64_t element : elements) {
+          buffer = SerializeTag(field, buffer);
+          buffer = SerializeValue(field, element, message, buffer);
+        }
+      }
+    }
+    return buffer;
+  }
+
+ private:
+  [[nodiscard]] static const uint8_t* ParseValueAfterTag(
+      const uint8_t* buffer,
+      const uint8_t* buffer_end,
+      int nesting_level,
+      WireType wire_type,
+      int32_t field_index,
+      DynamicMessage& message) {
+    const DynamicSchema& schema = *message.schema_;
+    const FieldCodec& field =
+        schema.codecs_[static_cast<std::size_t>(field_index)];
+
+    if (wire_type == field.wire_type) {
+      if (field.type == Type::kMessage) {
+        DynamicMessage* nested;
+        if (field.is_repeated) {
+          const Value& value = message.FindOrAddValue(field_index);
+          message.repeated_[value.bits].push_back(message.messages_.size());
+          nested = &message.messages_.emplace_back(
+              schema.fields_[static_cast<std::size_t>(field_index)]
+                  .message_schema);
+        } else {
+          nested = &message.messages_[message.FindOrAddValue(field_index).bits];
+        }
+        uint32_t byte_count;
+        buffer = codec::ParseValue(buffer, buffer_end, nesting_level,
+                                   byte_count);
+        if (!codec::IsParsedByteCountValid(buffer, buffer_end, byte_count) ||
+            nesting_level >= codec::kMaxMessageNestingDepth) {
+          return nullptr;
+        }
+        return ParseFields(buffer, buffer + byte_count, nesting_level + 1,
+                           *nested);
+      }
+
+      uint64_t bits;
+      if (field.type == Type::kString || field.type == Type::kBytes) {
+        uint32_t byte_count;
+        buffer = codec::ParseValue(buffer, buffer_end, nesting_level,
+                                   byte_count);
+        if (!codec::IsParsedByteCountValid(buffer, buffer_end, byte_count)) {
+          return nullptr;
+        }
+        bits = message.AppendString(buffer, byte_count);
+        buffer += byte_count;
+      } else {
+        buffer = ParseScalar(field.type, buffer, buffer_end, bits);
+        if (!buffer) {
+          return nullptr;
+        }
+      }
+      Value& value = message.FindOrAddValue(field_index);
+      if (field.is_repeated) {
+        message.repeated_[value.bits].push_back(bits);
+      } else {
+        value.bits = bits;
+      }
+      return buffer;
+    }
+
+    if (field.is_packed && wire_type == WireType::kLengthDelimited) {
+      uint32_t byte_count;
+      buffer = codec::ParseValue(buffer, buffer_end, nesting_level, byte_count);
+      if (!codec::IsParsedByteCountValid(buffer, buffer_end, byte_count)) {
+        return nullptr;
+      }
+      const uint8_t* const payload_end = buffer + byte_count;
+      std::vector<uint64_t>& elements =
+          message.repeated_[message.FindOrAddValue(field_index).bits];
+      if (field.wire_type == WireType::kFixed32Bit) {
+        elements.reserve(elements.size() + byte_count / sizeof(uint32_t));
+      } else if (field.wire_type == WireType::kFixed64Bit) {
+        elements.reserve(elements.size() + byte_count / sizeof(uint64_t));
+      }
+      while (buffer != payload_end) {
+        uint64_t bits;
+        buffer = ParseScalar(field.type, buffer, payload_end, bits);
+        if (!buffer) {
+          return nullptr;
+        }
+        elements.push_back(bits);
+      }
+      return buffer;
+    }
+
+    return nullptr;  // The WireType was wrong.
+  }
+
+  // Parses one value of a scalar |type|, into |bits| as a DynamicMessage holds
+  // it.
+  [[nodiscard]] static const uint8_t* ParseScalar(Type type,
+                                                  const uint8_t* buffer,
+                                                  const uint8_t* buffer_end,
+                                                  uint64_t& bits) {
+    switch (type) {
+      case Type::kInt32:
+      case Type::kEnum: {
+        int32_t value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = static_cast<uint64_t>(static_cast<int64_t>(value));
+        return buffer;
+      }
+      case Type::kInt64:
+      case Type::kUint64:
+        return codec::ParseValue(buffer, buffer_end, 0, bits);
+      case Type::kUint32: {
+        uint32_t value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = value;
+        return buffer;
+      }
+      case Type::kSint32: {
+        ::pb::sint32_t value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = static_cast<uint64_t>(static_cast<int64_t>(value.value()));
+        return buffer;
+      }
+      case Type::kSint64: {
+        ::pb::sint64_t value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = static_cast<uint64_t>(value.value());
+        return buffer;
+      }
+      case Type::kBool: {
+        bool value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = value;
+        return buffer;
+      }
+      case Type::kFixed32:
+      case Type::kFloat: {
+        ::pb::fixed32_t value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = value.value();
+        return buffer;
+      }
+      case Type::kSfixed32: {
+        ::pb::sfixed32_t value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = static_cast<uint64_t>(static_cast<int64_t>(value.value()));
+        return buffer;
+      }
+      case Type::kFixed64:
+      case Type::kSfixed64:
+      case Type::kDouble: {
+        ::pb::fixed64_t value{};
+        buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+        bits = value.value();
+        return buffer;
+      }
+      case Type::kString:
+      case Type::kBytes:
+      case Type::kMessage:
+        break;
+    }
+    return nullptr;
+  }
+
+  [[nodiscard]] static int32_t ComputeScalarSize(Type type, uint64_t bits) {
+    switch (type) {
+      case Type::kInt32:
+      case Type::kInt64:
+      case Type::kEnum:
+        return codec::ComputeSerializedValueSize(static_cast<int64_t>(bits));
+      case Type::kUint32:
+      case Type::kUint64:
+        return codec::ComputeSerializedValueSize(bits);
+      case Type::kSint32:
+        return codec::ComputeSerializedValueSize(
+            codec::EncodeZigZag(static_cast<int32_t>(bits)));
+      case Type::kSint64:
+        return codec::ComputeSerializedValueSize(
+            codec::EncodeZigZag(static_cast<int64_t>(bits)));
+      case Type::kBool:
+        return 1;
+      case Type::kFixed32:
+      case Type::kSfixed32:
+      case Type::kFloat:
+        return sizeof(uint32_t);
+      case Type::kFixed64:
+      case Type::kSfixed64:
+      case Type::kDouble:
+        return sizeof(uint64_t);
+      case Type::kString:
+      case Type::kBytes:
+      case Type::kMessage:
+        break;
+    }
+    return 0;
+  }
+
+  [[nodiscard]] static uint8_t* SerializeScalar(Type type,
+                                                uint64_t bits,
+                                                uint8_t* buffer) {
+    switch (type) {
+      case Type::kInt32:
+      case Type::kInt64:
+      case Type::kEnum:
+        return codec::SerializeValue(static_cast<int64_t>(bits), buffer);
+      case Type::kUint32:
+      case Type::kUint64:
+        return codec::SerializeValue(bits, buffer);
+      case Type::kSint32:
+        return codec::SerializeValue(
+            codec::EncodeZigZag(static_cast<int32_t>(bits)), buffer);
+      case Type::kSint64:
+        return codec::SerializeValue(
+            codec::EncodeZigZag(static_cast<int64_t>(bits)), buffer);
+      case Type::kBool:
+        return codec::SerializeValue(bits != 0, buffer);
+      case Type::kFixed32:
+      case Type::kSfixed32:
+      case Type::kFloat:
+        return codec::SerializeValue(
+            ::pb::fixed32_t(static_cast<uint32_t>(bits)), buffer);
+      case Type::kFixed64:
+      case Type::kSfixed64:
+      case Type::kDouble:
+        return codec::SerializeValue(::pb::fixed64_t(bits), buffer);
+      case Type::kString:
+      case Type::kBytes:
+      case Type::kMessage:
+        break;
+    }
+    return buffer;
+  }
+
+  [[nodiscard]] static int64_t ComputePackedPayloadSize(
+      const FieldCodec& field,
+      const std::vector<uint64_t>& elements) {
+    const auto count = static_cast<int64_t>(elements.size());
+    switch (field.wire_type) {
+      case WireType::kFixed32Bit:
+        return count * static_cast<int64_t>(sizeof(uint32_t));
+      case WireType::kFixed64Bit:
+        return count * static_cast<int64_t>(sizeof(uint64_t));
+      default:
+        break;
+    }
+    int64_t payload_size = 0;
+    for (const uint64_t element : elements) {
+      payload_size += ComputeScalarSize(field.type, element);
+    }
+    return payload_size;
+  }
+
+  [[nodiscard]] static int64_t ComputeValueSize(const FieldCodec& field,
+                                                uint64_t bits,
+                                                const DynamicMessage& message) {
+    if (field.type == Type::kMessage) {
+      const int64_t payload_size = ComputeSize(message.messages_[bits]);
+      return codec::ComputeSerializedValueSize(
+                 static_cast<uint32_t>(payload_size)) +
+             payload_size;
+    }
+    if (field.type == Type::kString || field.type == Type::kBytes) {
+      const auto byte_count = static_cast<uint32_t>(bits);
+      return codec::ComputeSerializedValueSize(byte_count) +
+             int64_t{byte_count};
+    }
+    return ComputeScalarSize(field.type, bits);
+  }
+
+  [[nodiscard]] static uint8_t* SerializeTag(const FieldCodec& field,
+                                             uint8_t* buffer) {
+    if (field.tag_size == 1) {
+      *buffer = field.tag_bytes[0];
+    } else {
+      std::memcpy(buffer, field.tag_bytes, field.tag_size);
+    }
+    return buffer + field.tag_size;
+  }
+
+  [[nodiscard]] static uint8_t* SerializeValue(const FieldCodec& field,
+                                               uint64_t bits,
+                                               const DynamicMessage& message,
+                                               uint8_t* buffer) {
+    if (field.type == Type::kMessage) {
+      const DynamicMessage& nested = message.messages_[bits];
+      buffer = codec::SerializeValue(
+          static_cast<uint32_t>(nested.cached_size_.load()), buffer);
+      return SerializeFields(nested, buffer);
+    }
+    if (field.type == Type::kString || field.type == Type::kBytes) {
+      return codec::SerializeValue(message.GetStringAt(bits), buffer);
+    }
+    return SerializeScalar(field.type, bits, buffer);
+  }
+};
+
+// ------------------------------------------------
+
+std::shared_ptr<const DynamicSchema> DynamicSchema::Create(
+    std::vector<DynamicFieldSpec> fields) {
+  if (fields.size() >
+      static_cast<std::size_t>(std::numeric_limits<int16_t>::max())) {
+    return nullptr;
+  }
+  std::vector<int32_t> field_numbers;
+  field_numbers.reserve(fields.size());
+  for (const DynamicFieldSpec& field : fields) {
+    if (!codec::IsValidFieldNumber(field.field_number) ||
+        ((field.type == Type::kMessage) != !!field.message_schema)) {
+      return nullptr;
+    }
+    field_numbers.push_back(field.field_number);
+  }
+  std::sort(field_numbers.begin(), field_numbers.end());
+  if (std::adjacent_find(field_numbers.begin(), field_numbers.end()) !=
+      field_numbers.end()) {
+    return nullptr;
+  }
+  return std::shared_ptr<const DynamicSchema>(
+      new DynamicSchema(std::move(fields)));
+}
+
+DynamicSchema::DynamicSchema(std::vector<DynamicFieldSpec> fields)
+    : fields_(std::move(fields)) {
+  codecs_.reserve(fields_.size());
+  int32_t max_dense_number = 0;
+  for (std::size_t i = 0; i < fields_.size(); ++i) {
+    const DynamicFieldSpec& spec = fields_[i];
+    FieldCodec field{};
+    field.type = spec.type;
+    field.is_repeated = spec.is_repeated;
+    field.is_packed = spec.is_repeated && IsScalar(spec.type);
+    field.wire_type = GetWireTypeOf(spec.type);
+    const codec::Tag tag = codec::MakeTag(
+        spec.field_number,
+        field.is_packed ? WireType::kLengthDelimited : field.wire_type);
+    field.tag_size = static_cast<uint8_t>(
+        codec::SerializeValue(tag, field.tag_bytes) - field.tag_bytes);
+    field.message_schema = spec.message_schema.get();
+    codecs_.push_back(field);
+
+    if (spec.field_number <= kMaxDenseFieldNumber) {
+      max_dense_number = std::max(max_dense_number, spec.field_number);
+    } else {
+      sparse_index_.emplace_back(spec.field_number, static_cast<int32_t>(i));
+    }
+  }
+  std::sort(sparse_index_.begin(), sparse_index_.end());
+
+  index_by_number_.assign(static_cast<std::size_t>(max_dense_number) + 1, -1);
+  for (std::size_t i = 0; i < fields_.size(); ++i) {
+    if (fields_[i].field_number <= kMaxDenseFieldNumber) {
+      index_by_number_[static_cast<std::size_t>(fields_[i].field_number)] =
+          static_cast<int16_t>(i);
+    }
+  }
+}
+
+int32_t DynamicSchema::FindSparseFieldIndex(int32_t field_number) const {
+  const auto it = std::lower_bound(
+      sparse_index_.begin(), sparse_index_.end(),
+      std::make_pair(field_number, std::numeric_limits<int32_t>::min()));
+  return (it != sparse_index_.end() && it->first == field_number) ? it->second
+                                                                  : -1;
+}
+
+// ------------------------------------------------
+
+DynamicMessage::DynamicMessage(std::shared_ptr<const DynamicSchema> schema)
+    : schema_(std::move(schema)) {
+  assert(schema_);
+}
+
+DynamicMessage::~DynamicMessage() = default;
+
+bool DynamicMessage::Has(int32_t field_number) const {
+  const int32_t field_index = schema_->FindFieldIndex(field_number);
+  assert(field_index >= 0);
+  const Value* const value = FindValue(field_index);
+  if (!value) {
+    return false;
+  }
+  if (schema_->codecs_[static_cast<std::size_t>(field_index)].is_repeated) {
+    return !repeated_[value->bits].empty();
+  }
+  return true;
+}
+
+void DynamicMessage::ClearField(int32_t field_number) {
+  const int32_t field_index = schema_->FindFieldIndex(field_number);
+  assert(field_index >= 0);
+  const auto it = std::lower_bound(
+      values_.begin(), values_.end(), field_index,
+      [](const Value& value, int32_t index) {
+        return value.field_index < index;
+      });
+  if (it == values_.end() || it->field_index != field_index) {
+    return;
+  }
+  const FieldCodec& field =
+      schema_->codecs_[static_cast<std::size_t>(field_index)];
+  if (field.is_repeated) {
+    // The elements are cleared, but kept for reuse. Their nested messages and
+    // strings remain in place until Clear().
+    repeated_[it->bits].clear();
+    return;
+  }
+  if (field.type == Type::kMessage) {
+    messages_[it->bits].Clear();
+  }
+  values_.erase(it);
+}
+
+void DynamicMessage::Clear() {
+  values_.clear();
+  repeated_.clear();
+  string_bytes_.clear();
+  messages_.clear();
+}
+
+const DynamicMessage::Value* DynamicMessage::FindValue(
+    int32_t field_index) const {
+  const auto it = std::lower_bound(
+      values_.begin(), values_.end(), field_index,
+      [](const Value& value, int32_t index) {
+        return value.field_index < index;
+      });
+  return (it != values_.end() && it->field_index == field_index) ? &*it
+                                                                 : nullptr;
+}
+
+DynamicMessage::Value& DynamicMessage::FindOrAddValue(int32_t field_index) {
+  // Fast path: The fields are usually set, and parsed, in schema order.
+  auto it = values_.end();
+  if (!values_.empty() && values_.back().field_index >= field_index) {
+    if (values_.back().field_index == field_index) {
+      return values_.back();
+    }
+    it = std::lower_bound(values_.begin(), values_.end(), field_index,
+                          [](const Value& value, int32_t index) {
+                            return value.field_index < index;
+                          });
+    if (it->field_index == field_index) {
+      return *it;
+    }
+  }
+
+  const FieldCodec& field =
+      schema_->codecs_[static_cast<std::size_t>(field_index)];
+  uint64_t bits = 0;
+  if (field.is_repeated) {
+    bits = repeated_.size();
+    repeated_.emplace_back();
+  } else if (field.type == Type::kMessage) {
+    bits = messages_.size();
+    messages_.emplace_back(
+        schema_->fields_[static_cast<std::size_t>(field_index)].message_schema);
+  }
+  return *values_.insert(it, Value{field_index, bits});
+}
+
+int32_t DynamicMessage::GetFieldIndex(int32_t field_number,
+                                      std::initializer_list<Type> types) const {
+  const int32_t field_index = schema_->FindFieldIndex(field_number);
+  assert(field_index >= 0);
+  assert(IsOneOf(
+      schema_->codecs_[static_cast<std::size_t>(field_index)].type, types));
+  static_cast<void>(types);
+  return field_index;
+}
+
+uint64_t DynamicMessage::GetSingularBits(
+    int32_t field_number,
+    std::initializer_list<Type> types) const {
+  const int32_t field_index = GetFieldIndex(field_number, types);
+  if (field_index < 0) {
+    return 0;
+  }
+  assert(!schema_->codecs_[static_cast<std::size_t>(field_index)].is_repeated);
+  const Value* const value = FindValue(field_index);
+  return value ? value->bits : 0;
+}
+
+void DynamicMessage::SetSingularBits(int32_t field_number,
+                                     std::initializer_list<Type> types,
+                                     uint64_t bits) {
+  const int32_t field_index = GetFieldIndex(field_number, types);
+  if (field_index < 0) {
+    return;
+  }
+  assert(!schema_->codecs_[static_cast<std::size_t>(field_index)].is_repeated);
+  FindOrAddValue(field_index).bits = bits;
+}
+
+const std::vector<uint64_t>* DynamicMessage::GetElements(
+    int32_t field_number,
+    std::initializer_list<Type> types) const {
+  const int32_t field_index = GetFieldIndex(field_number, types);
+  if (field_index < 0) {
+    return nullptr;
+  }
+  assert(schema_->codecs_[static_cast<std::size_t>(field_index)].is_repeated);
+  const Value* const value = FindValue(field_index);
+  return value ? &repeated_[value->bits] : nullptr;
+}
+
+std::vector<uint64_t>& DynamicMessage::GetMutableElements(
+    int32_t field_number,
+    std::initializer_list<Type> types) {
+  const int32_t field_index = GetFieldIndex(field_number, types);
+  assert(field_index >= 0);
+  assert(schema_->codecs_[static_cast<std::size_t>(field_index)].is_repeated);
+  return repeated_[FindOrAddValue(field_index).bits];
+}
+
+uint64_t DynamicMessage::AppendString(const void* data, std::size_t size) {
+  assert(size <= std::numeric_limits<uint32_t>::max());
+  const uint64_t offset = string_bytes_.size();
+  assert(offset <= std::numeric_limits<uint32_t>::max());
+  string_bytes_.append(static_cast<const char*>(data), size);
+  return (offset << 32) | size;
+}
+
+std::string_view DynamicMessage::GetStringAt(uint64_t bits) const {
+  return std::string_view(string_bytes_).substr(bits >> 32,
+                                                static_cast<uint32_t>(bits));
+}
+
+int64_t DynamicMessage::GetInt64(int32_t field_number) const {
+  return static_cast<int64_t>(GetSingularBits(field_number, kSignedTypes));
+}
+
+uint64_t DynamicMessage::GetUint64(int32_t field_number) const {
+  return GetSingularBits(field_number, kUnsignedTypes);
+}
+
+double DynamicMessage::GetDouble(int32_t field_number) const {
+  const int32_t field_index = GetFieldIndex(field_number, kFloatingPointTypes);
+  return ToDouble(schema_->fields_[static_cast<std::size_t>(field_index)].type,
+                  GetSingularBits(field_number, kFloatingPointTypes));
+}
+
+bool DynamicMessage::GetBool(int32_t field_number) const {
+  return GetSingularBits(field_number, kBoolType) != 0;
+}
+
+std::string_view DynamicMessage::GetString(int32_t field_number) const {
+  return GetStringAt(GetSingularBits(field_number, kStringTypes));
+}
+
+const DynamicMessage* DynamicMessage::GetMessage(int32_t field_number) const {
+  const int32_t field_index = GetFieldIndex(field_number, kMessageType);
+  const Value* const value = FindValue(field_index);
+  return value ? &messages_[value->bits] : nullptr;
+}
+
+void DynamicMessage::SetInt64(int32_t field_number, int64_t value) {
+  const int32_t field_index = GetFieldIndex(field_number, kSignedTypes);
+  SetSingularBits(
+      field_number, kSignedTypes,
+      FromSigned(schema_->fields_[static_cast<std::size_t>(field_index)].type,
+                 value));
+}
+
+void DynamicMessage::SetUint64(int32_t field_number, uint64_t value) {
+  const int32_t field_index = GetFieldIndex(field_number, kUnsignedTypes);
+  SetSingularBits(
+      field_number, kUnsignedTypes,
+      FromUnsigned(schema_->fields_[static_cast<std::size_t>(field_index)].type,
+                   value));
+}
+
+void DynamicMessage::SetDouble(int32_t field_number, double value) {
+  const int32_t field_index = GetFieldIndex(field_number, kFloatingPointTypes);
+  SetSingularBits(
+      field_number, kFloatingPointTypes,
+      FromDouble(schema_->fields_[static_cast<std::size_t>(field_index)].type,
+                 value));
+}
+
+void DynamicMessage::SetBool(int32_t field_number, bool value) {
+  SetSingularBits(field_number, kBoolType, value ? 1 : 0);
+}
+
+void DynamicMessage::SetString(int32_t field_number, std::string_view value) {
+  SetSingularBits(field_number, kStringTypes,
+                  AppendString(value.data(), value.size()));
+}
+
+DynamicMessage& DynamicMessage::MutableMessage(int32_t field_number) {
+  const int32_t field_index = GetFieldIndex(field_number, kMessageType);
+  assert(!schema_->codecs_[static_cast<std::size_t>(field_index)].is_repeated);
+  return messages_[FindOrAddValue(field_index).bits];
+}
+
+int32_t DynamicMessage::GetRepeatedCount(int32_t field_number) const {
+  const int32_t field_index = schema_->FindFieldIndex(field_number);
+  assert(field_index >= 0);
+  assert(schema_->codecs_[static_cast<std::size_t>(field_index)].is_repeated);
+  const Value* const value = FindValue(field_index);
+  return value ? static_cast<int32_t>(repeated_[value->bits].size()) : 0;
+}
+
+int64_t DynamicMessage::GetRepeatedInt64(int32_t field_number,
+                                         int32_t index) const {
+  const std::vector<uint64_t>* const elements =
+      GetElements(field_number, kSignedTypes);
+  assert(elements && index >= 0 &&
+         static_cast<std::size_t>(index) < elements->size());
+  return static_cast<int64_t>((*elements)[static_cast<std::size_t>(index)]);
+}
+
+uint64_t DynamicMessage::GetRepeatedUint64(int32_t field_number,
+                                           int32_t index) const {
+  const std::vector<uint64_t>* const elements =
+      GetElements(field_number, kUnsignedTypes);
+  assert(elements && index >= 0 &&
+         static_cast<std::size_t>(index) < elements->size());
+  return (*elements)[static_cast<std::size_t>(index)];
+}
+
+double DynamicMessage::GetRepeatedDouble(int32_t field_number,
+                                         int32_t index) const {
+  const int32_t field_index = GetFieldIndex(field_number, kFloatingPointTypes);
+  const std::vector<uint64_t>* const elements =
+      GetElements(field_number, kFloatingPointTypes);
+  assert(elements && index >= 0 &&
+         static_cast<std::size_t>(index) < elements->size());
+  return ToDouble(schema_->fields_[static_cast<std::size_t>(field_index)].type,
+                  (*elements)[static_cast<std::size_t>(index)]);
+}
+
+bool DynamicMessage::GetRepeatedBool(int32_t field_number,
+                                     int32_t index) const {
+  const std::vector<uint64_t>* const elements =
+      GetElements(field_number, kBoolType);
+  assert(elements && index >= 0 &&
+         static_cast<std::size_t>(index) < elements->size());
+  return (*elements)[static_cast<std::size_t>(index)] != 0;
+}
+
+std::string_view DynamicMessage::GetRepeatedString(int32_t field_number,
+                                                   int32_t index) const {
+  const std::vector<uint64_t>* const elements =
+      GetElements(field_number, kStringTypes);
+  assert(elements && index >= 0 &&
+         static_cast<std::size_t>(index) < elements->size());
+  return GetStringAt((*elements)[static_cast<std::size_t>(index)]);
+}
+
+const DynamicMessage& DynamicMessage::GetRepeatedMessage(int32_t field_number,
+                                                         int32_t index) const {
+  const std::vector<uint64_t>* const elements =
+      GetElements(field_number, kMessageType);
+  assert(elements && index >= 0 &&
+         static_cast<std::size_t>(index) < elements->size());
+  return messages_[(*elements)[static_cast<std::size_t>(index)]];
+}
+
+void DynamicMessage::AddInt64(int32_t field_number, int64_t value) {
+  const int32_t field_index = GetFieldIndex(field_number, kSignedTypes);
+  GetMutableElements(field_number, kSignedTypes)
+      .push_back(FromSigned(
+          schema_->fields_[static_cast<std::size_t>(field_index)].type, value));
+}
+
+void DynamicMessage::AddUint64(int32_t field_number, uint64_t value) {
+  const int32_t field_index = GetFieldIndex(field_number, kUnsignedTypes);
+  GetMutableElements(field_number, kUnsignedTypes)
+      .push_back(FromUnsigned(
+          schema_->fields_[static_cast<std::size_t>(field_index)].type, value));
+}
+
+void DynamicMessage::AddDouble(int32_t field_number, double value) {
+  const int32_t field_index = GetFieldIndex(field_number, kFloatingPointTypes);
+  GetMutableElements(field_number, kFloatingPointTypes)
+      .push_back(FromDouble(
+          schema_->fields_[static_cast<std::size_t>(field_index)].type, value));
+}
+
+void DynamicMessage::AddBool(int32_t field_number, bool value) {
+  GetMutableElements(field_number, kBoolType).push_back(value ? 1 : 0);
+}
+
+void DynamicMessage::AddString(int32_t field_number, std::string_view value) {
+  const uint64_t bits = AppendString(value.data(), value.size());
+  GetMutableElements(field_number, kStringTypes).push_back(bits);
+}
+
+DynamicMessage& DynamicMessage::AddMessage(int32_t field_number) {
+  const int32_t field_index = GetFieldIndex(field_number, kMessageType);
+  GetMutableElements(field_number, kMessageType).push_back(messages_.size());
+  return messages_.emplace_back(
+      schema_->fields_[static_cast<std::size_t>(field_index)].message_schema);
+}
+
+// ------------------------------------------------
+
+bool MergeFromBuffer(const uint8_t* begin,
+                     const uint8_t* end,
+                     DynamicMessage& message) {
+  assert((begin && (begin < end)) || (begin == end));
+  return DynamicCodec::ParseFields(begin, end, 0, message) == end;
+}
+
+int32_t ComputeSerializedSize(const DynamicMessage& message) {
+  const int64_t size = DynamicCodec::ComputeSize(message);
+  return (size <= codec::kMaxSerializedSize) ? static_cast<int32_t>(size) : -1;
+}
+
+void Serialize(const DynamicMessage& message, uint8_t* buffer) {
+  assert(buffer);
+  [[maybe_unused]] const int64_t size = DynamicCodec::ComputeSize(message);
+  assert(size <= codec::kMaxSerializedSize);
+  [[maybe_unused]] uint8_t* const buffer_end =
+      DynamicCodec::SerializeFields(message, buffer);
+  assert((buffer + size) == buffer_end);
+}
+
+}  // namespace pb
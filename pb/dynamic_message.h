@@ -0,0 +1,426 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/iterable_util.h"
+#include "pb/codec/map_field_entry.h"
+#include "pb/codec/wire_type.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb {
+
+class DynamicSchema;
+
+// The type of a DynamicSchema field, as it would be declared in a .proto file.
+enum class DynamicFieldType : uint8_t {
+  kInt32,
+  kInt64,
+  kUint32,
+  kUint64,
+  kSint32,
+  kSint64,
+  kBool,
+  kEnum,
+  kFixed32,
+  kFixed64,
+  kSfixed32,
+  kSfixed64,
+  kFloat,
+  kDouble,
+  kString,
+  kBytes,
+  kMessage,
+};
+
+// Describes one field of a DynamicSchema.
+struct DynamicFieldSpec {
+  int32_t field_number = 0;
+  DynamicFieldType type = DynamicFieldType::kInt32;
+  bool is_repeated = false;
+
+  // The schema of a kMessage field's messages. Must be null for other types.
+  std::shared_ptr<const DynamicSchema> message_schema;
+};
+
+// The fields of a message type that is only known at runtime (e.g., read from a
+// schema file by a generic pipeline tool), for use with DynamicMessage.
+// Example:
+//
+//   auto phone_schema = pb::DynamicSchema::Create({
+//       {1, pb::DynamicFieldType::kString, false, nullptr},
+//       {2, pb::DynamicFieldType::kEnum, false, nullptr}});
+//   auto person_schema = pb::DynamicSchema::Create({
+//       {1, pb::DynamicFieldType::kString, false, nullptr},
+//       {2, pb::DynamicFieldType::kInt32, false, nullptr},
+//       {4, pb::DynamicFieldType::kMessage, true, phone_schema}});
+//
+// As with a FieldList, the fields are serialized in the order given; and so a
+// DynamicSchema listing the same fields as a struct's ProtobufFields, in the
+// same order, produces the same wire bytes (see MakeDynamicSchema() below).
+//
+// A DynamicSchema is immutable, and so may be shared by any number of messages
+// on any number of threads.
+class DynamicSchema {
+ public:
+  // Returns null if any field number is invalid or repeated, or if a field's
+  // |message_schema| is missing (or present for a non-message field).
+  [[nodiscard]] static std::shared_ptr<const DynamicSchema> Create(
+      std::vector<DynamicFieldSpec> fields);
+
+  DynamicSchema(const DynamicSchema&) = delete;
+  DynamicSchema& operator=(const DynamicSchema&) = delete;
+
+  [[nodiscard]] const std::vector<DynamicFieldSpec>& fields() const {
+    return fields_;
+  }
+
+  // Returns the index in fields() of the field having the given
+  // |field_number|, or -1 if there is none.
+  [[nodiscard]] int32_t FindFieldIndex(int32_t field_number) const {
+    if (static_cast<uint32_t>(field_number) < index_by_number_.size()) {
+      return index_by_number_[static_cast<std::size_t>(field_number)];
+    }
+    return FindSparseFieldIndex(field_number);
+  }
+
+ private:
+  friend class DynamicCodec;
+  friend class DynamicMessage;
+
+  // Everything the codec needs to know about a field, precomputed so that it
+  // need not switch on the field's type more than once per value.
+  struct FieldCodec {
+    DynamicFieldType type;
+    bool is_repeated;
+    bool is_packed;  // A repeated scalar, serialized in the packed encoding.
+    codec::WireType wire_type;  // Of each value (element, if repeated).
+    uint8_t tag_size;
+    uint8_t tag_bytes[5];  // The encoded tag, as serialized.
+    const DynamicSchema* message_schema;
+  };
+
+  explicit DynamicSchema(std::vector<DynamicFieldSpec> fields);
+
+  [[nodiscard]] int32_t FindSparseFieldIndex(int32_t field_number) const;
+
+  const std::vector<DynamicFieldSpec> fields_;
+  std::vector<FieldCodec> codecs_;
+
+  // A direct lookup table for small field numbers (by far the most common),
+  // and a sorted list of (field number, index) for the rest.
+  std::vector<int16_t> index_by_number_;
+  std::vector<std::pair<int32_t, int32_t>> sparse_index_;
+};
+
+// A message of a type described by a DynamicSchema. It interoperates
+// byte-for-byte with struct-based messages: It parses anything they serialize,
+// and serializes the same bytes they would (given the same field values, and a
+// schema listing the fields in the same order). Example:
+//
+//   pb::DynamicMessage person(person_schema);
+//   if (!pb::MergeFromBuffer(begin, end, person)) { ... }
+//   std::string_view name = person.GetString(1);
+//   person.SetInt64(2, 42);
+//   pb::DynamicMessage& phone = person.AddMessage(4);
+//   phone.SetString(1, "+1-555-0100");
+//
+// Only the fields that are set are stored, as a vector of compact tagged
+// values sorted by field. The values of string and bytes fields are packed
+// together in one buffer, and nested messages in one vector, so that a parse
+// makes only a few allocations per message. All values are held as 64 bits:
+// sign-extended for the signed integer types (int32, int64, sint32, sint64,
+// sfixed32, sfixed64 and enum), and zero-extended for the unsigned ones
+// (uint32, uint64, fixed32, fixed64 and bool).
+//
+// A singular field is either set or not: If set, it is serialized, even if its
+// value is zero or empty. Struct fields that are not std::optional are always
+// serialized, and so they are always set after a parse. Repeated scalar fields
+// use the packed encoding, as in struct-based messages.
+//
+// The accessors must only be called with the field numbers, and for the types,
+// in the schema (this is checked by assertions). Getters return zero, or
+// empty, for fields that are not set. As with a std::vector, the references
+// returned by MutableMessage() and AddMessage() are invalidated by the next
+// call that adds a nested message to the same message.
+class DynamicMessage {
+ public:
+  explicit DynamicMessage(std::shared_ptr<const DynamicSchema> schema);
+
+  DynamicMessage(const DynamicMessage&) = default;
+  DynamicMessage(DynamicMessage&&) noexcept = default;
+  DynamicMessage& operator=(const DynamicMessage&) = default;
+  DynamicMessage& operator=(DynamicMessage&&) noexcept = default;
+  ~DynamicMessage();
+
+  [[nodiscard]] const std::shared_ptr<const DynamicSchema>& schema() const {
+    return schema_;
+  }
+
+  // Returns true if a singular field is set, or a repeated field is not empty.
+  [[nodiscard]] bool Has(int32_t field_number) const;
+
+  // Clears one field, or all of them.
+  void ClearField(int32_t field_number);
+  void Clear();
+
+  // Singular fields. The Int64 accessors are for the signed integer types and
+  // enums, the Uint64 accessors for the unsigned integer types, and the Double
+  // accessors for float and double. Setting a 32-bit field truncates the value,
+  // as a C++ cast would.
+  [[nodiscard]] int64_t GetInt64(int32_t field_number) const;
+  [[nodiscard]] uint64_t GetUint64(int32_t field_number) const;
+  [[nodiscard]] double GetDouble(int32_t field_number) const;
+  [[nodiscard]] bool GetBool(int32_t field_number) const;
+  [[nodiscard]] std::string_view GetString(int32_t field_number) const;
+  // Returns null if the field is not set.
+  [[nodiscard]] const DynamicMessage* GetMessage(int32_t field_number) const;
+
+  void SetInt64(int32_t field_number, int64_t value);
+  void SetUint64(int32_t field_number, uint64_t value);
+  void SetDouble(int32_t field_number, double value);
+  void SetBool(int32_t field_number, bool value);
+  // Overwriting a string leaves its old bytes in the message's string buffer,
+  // until Clear() is called.
+  void SetString(int32_t field_number, std::string_view value);
+  // Sets the field to an empty message, if it is not already set.
+  DynamicMessage& MutableMessage(int32_t field_number);
+
+  // Repeated fields.
+  [[nodiscard]] int32_t GetRepeatedCount(int32_t field_number) const;
+  [[nodiscard]] int64_t GetRepeatedInt64(int32_t field_number,
+                                         int32_t index) const;
+  [[nodiscard]] uint64_t GetRepeatedUint64(int32_t field_number,
+                                           int32_t index) const;
+  [[nodiscard]] double GetRepeatedDouble(int32_t field_number,
+                                         int32_t index) const;
+  [[nodiscard]] bool GetRepeatedBool(int32_t field_number,
+                                     int32_t index) const;
+  [[nodiscard]] std::string_view GetRepeatedString(int32_t field_number,
+                                                   int32_t index) const;
+  [[nodiscard]] const DynamicMessage& GetRepeatedMessage(int32_t field_number,
+                                                         int32_t index) const;
+
+  void AddInt64(int32_t field_number, int64_t value);
+  void AddUint64(int32_t field_number, uint64_t value);
+  void AddDouble(int32_t field_number, double value);
+  void AddBool(int32_t field_number, bool value);
+  void AddString(int32_t field_number, std::string_view value);
+  DynamicMessage& AddMessage(int32_t field_number);
+
+ private:
+  friend class DynamicCodec;
+
+  using FieldCodec = DynamicSchema::FieldCodec;
+
+  // One set field. For a singular field, |bits| holds the scalar value; the
+  // offset (upper 32 bits) and length (lower 32 bits) of a string in
+  // |string_bytes_|; or the index of a nested message in |messages_|. For a
+  // repeated field, |bits| is the index of its elements in |repeated_|, where
+  // each element is held the same way.
+  struct Value {
+    int32_t field_index;
+    uint64_t bits;
+  };
+
+  // The serialized size, as of the last ComputeSerializedSize(). Several
+  // threads may serialize the same const message at once, and each stores the
+  // same size, so relaxed atomic loads and stores are enough. Unlike a
+  // std::atomic, this can be copied along with the message.
+  class CachedSize {
+   public:
+    CachedSize() = default;
+    CachedSize(const CachedSize& other) noexcept : size_(other.load()) {}
+    CachedSize& operator=(const CachedSize& other) noexcept {
+      store(other.load());
+      return *this;
+    }
+
+    [[nodiscard]] int32_t load() const {
+      return size_.load(std::memory_order_relaxed);
+    }
+    void store(int32_t size) const {
+      size_.store(size, std::memory_order_relaxed);
+    }
+
+   private:
+    mutable std::atomic<int32_t> size_{0};
+  };
+
+  // Returns the Value of the given field, or null if it is not set.
+  [[nodiscard]] const Value* FindValue(int32_t field_index) const;
+
+  // Returns the Value of the given field, adding it if it is not set. For a
+  // repeated field, its elements are added too; and for a singular message
+  // field, an empty message.
+  Value& FindOrAddValue(int32_t field_index);
+
+  // Returns the index of the given field, asserting that it is in the schema
+  // and has one of the given |types|.
+  [[nodiscard]] int32_t GetFieldIndex(
+      int32_t field_number,
+      std::initializer_list<DynamicFieldType> types) const;
+
+  [[nodiscard]] uint64_t GetSingularBits(int32_t field_number,
+                                         std::initializer_list<DynamicFieldType>
+                                             types) const;
+  void SetSingularBits(int32_t field_number,
+                       std::initializer_list<DynamicFieldType> types,
+                       uint64_t bits);
+  [[nodiscard]] const std::vector<uint64_t>* GetElements(
+      int32_t field_number,
+      std::initializer_list<DynamicFieldType> types) const;
+  [[nodiscard]] std::vector<uint64_t>& GetMutableElements(
+      int32_t field_number,
+      std::initializer_list<DynamicFieldType> types);
+
+  [[nodiscard]] uint64_t AppendString(const void* data, std::size_t size);
+  [[nodiscard]] std::string_view GetStringAt(uint64_t bits) const;
+
+  std::shared_ptr<const DynamicSchema> schema_;
+  std::vector<Value> values_;  // Sorted by |field_index|.
+  std::vector<std::vector<uint64_t>> repeated_;
+  std::string string_bytes_;
+  std::vector<DynamicMessage> messages_;
+
+  // Used by Serialize() for the length prefix of nested messages.
+  CachedSize cached_size_;
+};
+
+// The same as the functions in pb/parse.h and pb/serialize.h, for
+// DynamicMessages. These are table-driven: Each field's type and encoding is
+// looked up in the schema as it is reached.
+[[nodiscard]] bool MergeFromBuffer(const uint8_t* begin,
+                                   const uint8_t* end,
+                                   DynamicMessage& message);
+[[nodiscard]] int32_t ComputeSerializedSize(const DynamicMessage& message);
+void Serialize(const DynamicMessage& message, uint8_t* buffer);
+
+namespace internal {
+
+template <typename T>
+struct DynamicSchemaValueTypeDetector {
+  using Type = T;
+};
+
+template <typename T>
+struct DynamicSchemaValueTypeDetector<std::optional<T>> {
+  using Type = T;
+};
+
+template <typename T>
+struct DynamicSchemaValueTypeDetector<std::unique_ptr<T>> {
+  using Type = T;
+};
+
+template <typename T>
+struct DynamicSchemaValueTypeDetector<std::shared_ptr<T>> {
+  using Type = std::remove_const_t<T>;
+};
+
+template <typename T>
+using DynamicSchemaValueType =
+    typename DynamicSchemaValueTypeDetector<T>::Type;
+
+template <typename... Fields>
+std::shared_ptr<const DynamicSchema> MakeDynamicSchemaFromFields(
+    FieldList<Fields...>);
+
+// Returns the DynamicFieldSpec for one value of type |Value|.
+template <typename Value>
+DynamicFieldSpec MakeDynamicFieldSpecForValue(int32_t field_number,
+                                              bool is_repeated) {
+  DynamicFieldSpec spec{field_number, DynamicFieldType::kInt32, is_repeated,
+                        nullptr};
+  if constexpr (std::is_same_v<Value, bool>) {
+    spec.type = DynamicFieldType::kBool;
+  } else if constexpr (std::is_enum_v<Value>) {
+    spec.type = DynamicFieldType::kEnum;
+  } else if constexpr (std::is_integral_v<Value>) {
+    static_assert(sizeof(Value) <= sizeof(uint64_t));
+    if constexpr (std::is_signed_v<Value>) {
+      spec.type = (sizeof(Value) <= sizeof(int32_t)) ? DynamicFieldType::kInt32
+                                                     : DynamicFieldType::kInt64;
+    } else {
+      spec.type = (sizeof(Value) <= sizeof(uint32_t))
+                      ? DynamicFieldType::kUint32
+                      : DynamicFieldType::kUint64;
+    }
+  } else if constexpr (std::is_same_v<Value, ::pb::sint32_t>) {
+    spec.type = DynamicFieldType::kSint32;
+  } else if constexpr (std::is_same_v<Value, ::pb::sint64_t>) {
+    spec.type = DynamicFieldType::kSint64;
+  } else if constexpr (std::is_same_v<Value, ::pb::fixed32_t>) {
+    spec.type = DynamicFieldType::kFixed32;
+  } else if constexpr (std::is_same_v<Value, ::pb::fixed64_t>) {
+    spec.type = DynamicFieldType::kFixed64;
+  } else if constexpr (std::is_same_v<Value, ::pb::sfixed32_t>) {
+    spec.type = DynamicFieldType::kSfixed32;
+  } else if constexpr (std::is_same_v<Value, ::pb::sfixed64_t>) {
+    spec.type = DynamicFieldType::kSfixed64;
+  } else if constexpr (std::is_same_v<Value, float>) {
+    spec.type = DynamicFieldType::kFloat;
+  } else if constexpr (std::is_same_v<Value, double>) {
+    spec.type = DynamicFieldType::kDouble;
+  } else if constexpr (std::is_same_v<Value, std::string> ||
+                       std::is_same_v<Value, std::string_view>) {
+    spec.type = DynamicFieldType::kString;
+  } else {
+    static_assert(!codec::CouldBeAMapFieldEntry<Value>(),
+                  "Map fields are not supported by DynamicSchema.");
+    static_assert(codec::IsMessage<Value>(), "Unsupported field type.");
+    spec.type = DynamicFieldType::kMessage;
+    spec.message_schema =
+        MakeDynamicSchemaFromFields(typename Value::ProtobufFields{});
+  }
+  return spec;
+}
+
+template <typename TheField>
+DynamicFieldSpec MakeDynamicFieldSpec() {
+  using Member = typename TheField::Member;
+  if constexpr (codec::IsRepeatedField<TheField>()) {
+    return MakeDynamicFieldSpecForValue<
+        DynamicSchemaValueType<codec::IterableValueType<Member>>>(
+        TheField::GetFieldNumber(), true);
+  } else {
+    return MakeDynamicFieldSpecForValue<DynamicSchemaValueType<Member>>(
+        TheField::GetFieldNumber(), false);
+  }
+}
+
+template <typename... Fields>
+std::shared_ptr<const DynamicSchema> MakeDynamicSchemaFromFields(
+    FieldList<Fields...>) {
+  return DynamicSchema::Create({MakeDynamicFieldSpec<Fields>()...});
+}
+
+}  // namespace internal
+
+// Returns the DynamicSchema equivalent to a struct-based |Message| type, whose
+// DynamicMessages are wire-compatible with it. Map fields, and message types
+// that (indirectly) contain themselves, are not supported.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] std::shared_ptr<const DynamicSchema> MakeDynamicSchema() {
+  return internal::MakeDynamicSchemaFromFields(
+      typename Message::ProtobufFields{});
+}
+
+}  // namespace pb
@@ -0,0 +1,420 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/dynamic_message.h"
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+using Type = DynamicFieldType;
+
+enum class Color : int32_t { kRed = 0, kGreen = 1, kBlue = -2 };
+
+struct Inner {
+  int32_t id = 0;
+  std::string label;
+  std::vector<double> weights;
+
+  using ProtobufFields = FieldList<Field<&Inner::id, 1>,
+                                   Field<&Inner::label, 2>,
+                                   Field<&Inner::weights, 3>>;
+};
+
+struct Everything {
+  int32_t i32 = 0;
+  int64_t i64 = 0;
+  uint32_t u32 = 0;
+  uint64_t u64 = 0;
+  sint32_t s32 = 0;
+  sint64_t s64 = 0;
+  bool flag = false;
+  Color color = Color::kRed;
+  fixed32_t f32 = 0;
+  fixed64_t f64 = 0;
+  sfixed32_t sf32 = 0;
+  sfixed64_t sf64 = 0;
+  float real32 = 0.0f;
+  double real64 = 0.0;
+  std::string text;
+  std::optional<int32_t> maybe;
+  std::vector<int32_t> packed_ints;
+  std::vector<sint64_t> packed_zigzags;
+  std::vector<fixed32_t> packed_fixeds;
+  std::vector<bool> packed_flags;
+  std::vector<std::string> texts;
+  Inner inner;
+  std::unique_ptr<Inner> maybe_inner;
+  std::vector<Inner> inners;
+  std::optional<std::string> far_away;
+
+  using ProtobufFields = FieldList<Field<&Everything::i32, 1>,
+                                   Field<&Everything::i64, 2>,
+                                   Field<&Everything::u32, 3>,
+                                   Field<&Everything::u64, 4>,
+                                   Field<&Everything::s32, 5>,
+                                   Field<&Everything::s64, 6>,
+                                   Field<&Everything::flag, 7>,
+                                   Field<&Everything::color, 8>,
+                                   Field<&Everything::f32, 9>,
+                                   Field<&Everything::f64, 10>,
+                                   Field<&Everything::sf32, 11>,
+                                   Field<&Everything::sf64, 12>,
+                                   Field<&Everything::real32, 13>,
+                                   Field<&Everything::real64, 14>,
+                                   Field<&Everything::text, 15>,
+                                   Field<&Everything::maybe, 16>,
+                                   Field<&Everything::packed_ints, 17>,
+                                   Field<&Everything::packed_zigzags, 18>,
+                                   Field<&Everything::packed_fixeds, 19>,
+                                   Field<&Everything::packed_flags, 20>,
+                                   Field<&Everything::texts, 21>,
+                                   Field<&Everything::inner, 22>,
+                                   Field<&Everything::maybe_inner, 23>,
+                                   Field<&Everything::inners, 24>,
+                                   Field<&Everything::far_away, 100000>>;
+};
+
+Everything MakeEverything() {
+  Everything message;
+  message.i32 = -7;
+  message.i64 = std::numeric_limits<int64_t>::min();
+  message.u32 = std::numeric_limits<uint32_t>::max();
+  message.u64 = std::numeric_limits<uint64_t>::max();
+  message.s32 = -300;
+  message.s64 = std::numeric_limits<int64_t>::min() + 1;
+  message.flag = true;
+  message.color = Color::kBlue;
+  message.f32 = 0xdeadbeef;
+  message.f64 = 0x0123456789abcdef;
+  message.sf32 = -5;
+  message.sf64 = -6;
+  message.real32 = 1.5f;
+  message.real64 = -2.25;
+  message.text = "hello";
+  message.maybe = 0;
+  message.packed_ints = {1, -1, 300};
+  message.packed_zigzags = {-1, 1, -65};
+  message.packed_fixeds = {1, 2};
+  message.packed_flags = {true, false, true};
+  message.texts = {"a", "", "ccc"};
+  message.inner.id = 3;
+  message.inner.label = "inner";
+  message.inner.weights = {0.5, 0.25};
+  message.maybe_inner = std::make_unique<Inner>();
+  message.maybe_inner->id = 4;
+  message.inners.resize(2);
+  message.inners[0].label = "first";
+  message.inners[1].id = -1;
+  message.inners[1].weights = {1.0};
+  message.far_away = "far";
+  return message;
+}
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  const int32_t size = ComputeSerializedSize(message);
+  EXPECT_GE(size, 0);
+  std::vector<uint8_t> buffer(static_cast<std::size_t>(size));
+  Serialize(message, buffer.data());
+  return buffer;
+}
+
+bool MergeFromVector(const std::vector<uint8_t>& buffer,
+                     DynamicMessage& message) {
+  return MergeFromBuffer(buffer.data(), buffer.data() + buffer.size(), message);
+}
+
+TEST(DynamicMessage, RoundTripsStructBytesExactly) {
+  const auto schema = MakeDynamicSchema<Everything>();
+  ASSERT_TRUE(schema);
+  const std::vector<uint8_t> expected = SerializeToVector(MakeEverything());
+
+  DynamicMessage message(schema);
+  ASSERT_TRUE(MergeFromVector(expected, message));
+  EXPECT_EQ(expected, SerializeToVector(message));
+
+  // A default-constructed struct: Only the non-optional fields are on the
+  // wire, and they must stay set after parsing.
+  const std::vector<uint8_t> defaults = SerializeToVector(Everything{});
+  DynamicMessage empty(schema);
+  ASSERT_TRUE(MergeFromVector(defaults, empty));
+  EXPECT_TRUE(empty.Has(1));
+  EXPECT_FALSE(empty.Has(16));
+  EXPECT_FALSE(empty.Has(17));
+  EXPECT_FALSE(empty.Has(23));
+  EXPECT_EQ(defaults, SerializeToVector(empty));
+}
+
+TEST(DynamicMessage, SerializesTheSameMessageOnManyThreads) {
+  const auto schema = MakeDynamicSchema<Everything>();
+  ASSERT_TRUE(schema);
+  const std::vector<uint8_t> expected = SerializeToVector(MakeEverything());
+  DynamicMessage message(schema);
+  ASSERT_TRUE(MergeFromVector(expected, message));
+
+  std::vector<std::vector<uint8_t>> results(4);
+  std::vector<std::thread> threads;
+  for (std::vector<uint8_t>& result : results) {
+    threads.emplace_back([&message, &result] {
+      for (int i = 0; i < 100; ++i) {
+        result = SerializeToVector(message);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (const std::vector<uint8_t>& result : results) {
+    EXPECT_EQ(expected, result);
+  }
+}
+
+TEST(DynamicMessage, ParsedValuesAreReadable) {
+  DynamicMessage message(MakeDynamicSchema<Everything>());
+  ASSERT_TRUE(MergeFromVector(SerializeToVector(MakeEverything()), message));
+
+  EXPECT_EQ(-7, message.GetInt64(1));
+  EXPECT_EQ(std::numeric_limits<int64_t>::min(), message.GetInt64(2));
+  EXPECT_EQ(std::numeric_limits<uint32_t>::max(), message.GetUint64(3));
+  EXPECT_EQ(std::numeric_limits<uint64_t>::max(), message.GetUint64(4));
+  EXPECT_EQ(-300, message.GetInt64(5));
+  EXPECT_EQ(std::numeric_limits<int64_t>::min() + 1, message.GetInt64(6));
+  EXPECT_TRUE(message.GetBool(7));
+  EXPECT_EQ(-2, message.GetInt64(8));
+  EXPECT_EQ(0xdeadbeefu, message.GetUint64(9));
+  EXPECT_EQ(0x0123456789abcdefu, message.GetUint64(10));
+  EXPECT_EQ(-5, message.GetInt64(11));
+  EXPECT_EQ(-6, message.GetInt64(12));
+  EXPECT_EQ(1.5, message.GetDouble(13));
+  EXPECT_EQ(-2.25, message.GetDouble(14));
+  EXPECT_EQ("hello", message.GetString(15));
+  EXPECT_TRUE(message.Has(16));
+  EXPECT_EQ(0, message.GetInt64(16));
+
+  ASSERT_EQ(3, message.GetRepeatedCount(17));
+  EXPECT_EQ(-1, message.GetRepeatedInt64(17, 1));
+  EXPECT_EQ(300, message.GetRepeatedInt64(17, 2));
+  ASSERT_EQ(3, message.GetRepeatedCount(18));
+  EXPECT_EQ(-65, message.GetRepeatedInt64(18, 2));
+  ASSERT_EQ(2, message.GetRepeatedCount(19));
+  EXPECT_EQ(2u, message.GetRepeatedUint64(19, 1));
+  ASSERT_EQ(3, message.GetRepeatedCount(20));
+  EXPECT_FALSE(message.GetRepeatedBool(20, 1));
+  ASSERT_EQ(3, message.GetRepeatedCount(21));
+  EXPECT_EQ("", message.GetRepeatedString(21, 1));
+  EXPECT_EQ("ccc", message.GetRepeatedString(21, 2));
+
+  const DynamicMessage* const inner = message.GetMessage(22);
+  ASSERT_TRUE(inner);
+  EXPECT_EQ(3, inner->GetInt64(1));
+  EXPECT_EQ("inner", inner->GetString(2));
+  ASSERT_EQ(2, inner->GetRepeatedCount(3));
+  EXPECT_EQ(0.25, inner->GetRepeatedDouble(3, 1));
+  ASSERT_TRUE(message.GetMessage(23));
+  EXPECT_EQ(4, message.GetMessage(23)->GetInt64(1));
+  ASSERT_EQ(2, message.GetRepeatedCount(24));
+  EXPECT_EQ("first", message.GetRepeatedMessage(24, 0).GetString(2));
+  EXPECT_EQ(-1, message.GetRepeatedMessage(24, 1).GetInt64(1));
+  EXPECT_EQ("far", message.GetString(100000));
+}
+
+TEST(DynamicMessage, BuiltMessagesParseAsStructs) {
+  DynamicMessage message(MakeDynamicSchema<Everything>());
+  // Set out of schema order, to exercise the sorted insertion.
+  message.SetString(100000, "far");
+  message.SetInt64(1, -7);
+  message.SetUint64(3, 0x1'0000'0005);  // Truncated to 32 bits.
+  message.SetInt64(5, -300);
+  message.SetInt64(8, static_cast<int64_t>(Color::kGreen));
+  message.SetDouble(13, 0.1);
+  message.SetString(15, "hello");
+  message.SetString(15, "world");  // Overwrites.
+  message.AddInt64(17, 5);
+  message.AddInt64(17, -5);
+  message.AddString(21, "x");
+  message.MutableMessage(22).SetString(2, "inner");
+  message.MutableMessage(22).AddDouble(3, 1.25);
+  message.AddMessage(24).SetInt64(1, 9);
+  message.AddMessage(24).SetInt64(1, 10);
+
+  Everything parsed;
+  const std::vector<uint8_t> bytes = SerializeToVector(message);
+  ASSERT_TRUE(MergeFromBuffer(bytes.data(), bytes.data() + bytes.size(),
+                              parsed));
+  EXPECT_EQ(-7, parsed.i32);
+  EXPECT_EQ(5u, parsed.u32);
+  EXPECT_EQ(-300, parsed.s32.value());
+  EXPECT_EQ(Color::kGreen, parsed.color);
+  EXPECT_EQ(0.1f, parsed.real32);
+  EXPECT_EQ("world", parsed.text);
+  EXPECT_FALSE(parsed.maybe);
+  EXPECT_EQ((std::vector<int32_t>{5, -5}), parsed.packed_ints);
+  EXPECT_EQ(std::vector<std::string>{"x"}, parsed.texts);
+  EXPECT_EQ("inner", parsed.inner.label);
+  EXPECT_EQ(std::vector<double>{1.25}, parsed.inner.weights);
+  EXPECT_FALSE(parsed.maybe_inner);
+  ASSERT_EQ(2u, parsed.inners.size());
+  EXPECT_EQ(10, parsed.inners[1].id);
+  EXPECT_EQ("far", parsed.far_away);
+
+  // The struct also serializes the fields the DynamicMessage left unset (but
+  // not its optional ones); and those bytes round-trip exactly too.
+  DynamicMessage reparsed(message.schema());
+  ASSERT_TRUE(MergeFromVector(SerializeToVector(parsed), reparsed));
+  EXPECT_EQ(SerializeToVector(parsed), SerializeToVector(reparsed));
+}
+
+TEST(DynamicMessage, AcceptsUnpackedRepeatedScalars) {
+  struct Unpacked {
+    std::vector<int32_t> values;
+    using ProtobufFields = FieldList<Field<&Unpacked::values, 1>>;
+  };
+  // Field 1 as three separate varints: tag 0x08.
+  const std::vector<uint8_t> bytes = {0x08, 0x01, 0x08, 0x7f, 0x08, 0x02};
+  DynamicMessage message(MakeDynamicSchema<Unpacked>());
+  ASSERT_TRUE(MergeFromVector(bytes, message));
+  ASSERT_EQ(3, message.GetRepeatedCount(1));
+  EXPECT_EQ(127, message.GetRepeatedInt64(1, 1));
+
+  // Re-serialized, packed.
+  const std::vector<uint8_t> packed = {0x0a, 0x03, 0x01, 0x7f, 0x02};
+  EXPECT_EQ(packed, SerializeToVector(message));
+}
+
+TEST(DynamicMessage, SkipsUnknownFieldsAndRejectsWrongWireTypes) {
+  const auto schema =
+      DynamicSchema::Create({{2, Type::kInt32, false, nullptr}});
+  ASSERT_TRUE(schema);
+
+  // Field 1 (unknown, length-delimited), then field 2.
+  const std::vector<uint8_t> with_unknown = {0x0a, 0x02, 'h', 'i', 0x10, 0x05};
+  DynamicMessage message(schema);
+  ASSERT_TRUE(MergeFromVector(with_unknown, message));
+  EXPECT_EQ(5, message.GetInt64(2));
+  EXPECT_EQ((std::vector<uint8_t>{0x10, 0x05}), SerializeToVector(message));
+
+  // Field 2 as a fixed32.
+  const std::vector<uint8_t> wrong_type = {0x15, 0x01, 0x00, 0x00, 0x00};
+  DynamicMessage other(schema);
+  EXPECT_FALSE(MergeFromVector(wrong_type, other));
+
+  // Truncated.
+  const std::vector<uint8_t> truncated = {0x10};
+  EXPECT_FALSE(MergeFromVector(truncated, other));
+}
+
+TEST(DynamicMessage, MergesSingularMessages) {
+  DynamicMessage message(MakeDynamicSchema<Everything>());
+  Everything first;
+  first.inner.id = 1;
+  first.inner.weights = {1.0};
+  Everything second;
+  second.inner.label = "second";
+  second.inner.weights = {2.0};
+  ASSERT_TRUE(MergeFromVector(SerializeToVector(first), message));
+  ASSERT_TRUE(MergeFromVector(SerializeToVector(second), message));
+
+  const DynamicMessage* const inner = message.GetMessage(22);
+  ASSERT_TRUE(inner);
+  EXPECT_EQ(0, inner->GetInt64(1));  // Overwritten by the second's zero.
+  EXPECT_EQ("second", inner->GetString(2));
+  EXPECT_EQ(2, inner->GetRepeatedCount(3));
+}
+
+TEST(DynamicMessage, ClearsFields) {
+  DynamicMessage message(MakeDynamicSchema<Everything>());
+  ASSERT_TRUE(MergeFromVector(SerializeToVector(MakeEverything()), message));
+
+  message.ClearField(15);
+  message.ClearField(17);
+  message.ClearField(22);
+  EXPECT_FALSE(message.Has(15));
+  EXPECT_FALSE(message.Has(17));
+  EXPECT_FALSE(message.GetMessage(22));
+  EXPECT_EQ("", message.GetString(15));
+
+  const std::vector<uint8_t> bytes = SerializeToVector(message);
+  Everything parsed;
+  ASSERT_TRUE(MergeFromBuffer(bytes.data(), bytes.data() + bytes.size(),
+                              parsed));
+  EXPECT_EQ("", parsed.text);
+  EXPECT_TRUE(parsed.packed_ints.empty());
+  EXPECT_EQ(0, parsed.inner.id);
+  EXPECT_EQ("far", parsed.far_away);
+
+  message.Clear();
+  EXPECT_FALSE(message.Has(1));
+  EXPECT_EQ(0, ComputeSerializedSize(message));
+}
+
+// Returns |depth| levels of field 1 as a nested message, around nothing.
+std::vector<uint8_t> MakeNestedBytes(int depth) {
+  std::vector<uint8_t> bytes;
+  for (int i = 0; i < depth; ++i) {
+    std::vector<uint8_t> wrapper = {0x0a};
+    uint8_t length[5];
+    wrapper.insert(wrapper.end(), length,
+                   codec::SerializeValue(static_cast<uint32_t>(bytes.size()),
+                                         length));
+    wrapper.insert(wrapper.end(), bytes.begin(), bytes.end());
+    bytes = std::move(wrapper);
+  }
+  return bytes;
+}
+
+TEST(DynamicMessage, EnforcesTheNestingLimit) {
+  auto schema = DynamicSchema::Create({{1, Type::kInt32, false, nullptr}});
+  for (int i = 0; i < 200; ++i) {
+    schema = DynamicSchema::Create({{1, Type::kMessage, false, schema}});
+  }
+  DynamicMessage shallow(schema);
+  EXPECT_TRUE(MergeFromVector(MakeNestedBytes(50), shallow));
+  DynamicMessage too_deep(schema);
+  EXPECT_FALSE(MergeFromVector(MakeNestedBytes(150), too_deep));
+}
+
+TEST(DynamicSchema, RejectsInvalidSchemas) {
+  const auto nested =
+      DynamicSchema::Create({{1, Type::kInt32, false, nullptr}});
+  ASSERT_TRUE(nested);
+  EXPECT_TRUE(DynamicSchema::Create({}));
+  EXPECT_FALSE(DynamicSchema::Create({{0, Type::kInt32, false, nullptr}}));
+  EXPECT_FALSE(DynamicSchema::Create({{19000, Type::kInt32, false, nullptr}}));
+  EXPECT_FALSE(DynamicSchema::Create(
+      {{1, Type::kInt32, false, nullptr}, {1, Type::kBool, false, nullptr}}));
+  EXPECT_FALSE(DynamicSchema::Create({{1, Type::kMessage, false, nullptr}}));
+  EXPECT_FALSE(DynamicSchema::Create({{1, Type::kInt32, false, nested}}));
+  EXPECT_TRUE(DynamicSchema::Create({{1, Type::kMessage, true, nested}}));
+}
+
+TEST(DynamicSchema, FindsFieldIndexes) {
+  const auto schema = DynamicSchema::Create(
+      {{3, Type::kInt32, false, nullptr},
+       {1, Type::kString, false, nullptr},
+       {5000, Type::kBool, false, nullptr}});
+  ASSERT_TRUE(schema);
+  EXPECT_EQ(0, schema->FindFieldIndex(3));
+  EXPECT_EQ(1, schema->FindFieldIndex(1));
+  EXPECT_EQ(2, schema->FindFieldIndex(5000));
+  EXPECT_EQ(-1, schema->FindFieldIndex(2));
+  EXPECT_EQ(-1, schema->FindFieldIndex(4999));
+  EXPECT_EQ(-1, schema->FindFieldIndex(-1));
+}
+
+}  // namespace
+}  // namespace pb
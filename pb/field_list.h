@@ -4,13 +4,29 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <string_view>
+#include <type_traits>
 
 #include "pb/codec/limits.h"
 
 namespace pb {
 
-template <auto member_pointer, int32_t field_number>
+// Binds a message struct/class |member_pointer| to a protobuf |field_number|.
+//
+// Optionally, a |name| may also be provided, for use as the key in the JSON
+// encoding (see pb/json.h). Since C++17 does not allow string literals as
+// template arguments, the name must be a constant with static storage. Example:
+//
+//   struct AudioConfig {
+//     int32_t sample_rate;
+//
+//     static constexpr char kSampleRateName[] = "sampleRate";
+//     using ProtobufFields = pb::FieldList<
+//         pb::Field<&AudioConfig::sample_rate, 1, kSampleRateName>>;
+//   };
+template <auto member_pointer, int32_t field_number, const char* name = nullptr>
 struct Field {
   template <typename T, class C>
   static C a_hypothetical_function(T C::*);
@@ -30,10 +46,23 @@ struct Field {
     return instance.*member_pointer;
   }
 
+  [[nodiscard]] static constexpr auto GetMemberPointer() {
+    return member_pointer;
+  }
+
   [[nodiscard]] static constexpr int32_t GetFieldNumber() {
     static_assert(codec::IsValidFieldNumber(field_number));
     return field_number;
   }
+
+  // Returns the field's name, or an empty string_view if it has none.
+  [[nodiscard]] static constexpr std::string_view GetName() {
+    if constexpr (name == nullptr) {
+      return std::string_view();
+    } else {
+      return std::string_view(name);
+    }
+  }
 };
 
 // Base-case template: Matches only for empty FieldList's.
@@ -78,4 +107,29 @@ struct FieldList<First, Rest...> {
   }
 };
 
+namespace internal {
+
+// Returns the index of the field bound to |kMemberPointer| within |Fields|, or
+// the number of fields if there is none.
+template <auto kMemberPointer, typename... Fields>
+[[nodiscard]] constexpr std::size_t FindFieldIndex(FieldList<Fields...>) {
+  constexpr bool kIsMatch[] = {
+      [] {
+        if constexpr (std::is_same_v<decltype(kMemberPointer),
+                                     decltype(Fields::GetMemberPointer())>) {
+          return kMemberPointer == Fields::GetMemberPointer();
+        } else {
+          return false;
+        }
+      }()...,
+      false};
+  std::size_t index = 0;
+  while (index < sizeof...(Fields) && !kIsMatch[index]) {
+    ++index;
+  }
+  return index;
+}
+
+}  // namespace internal
+
 }  // namespace pb
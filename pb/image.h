@@ -0,0 +1,835 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/iterable_util.h"
+#include "pb/codec/map_field_entry.h"
+#include "pb/field_list.h"
+#include "pb/packed_fixed_view.h"
+
+namespace pb {
+
+template <class Message>
+class Image;
+
+template <typename Value>
+class ImageArray;
+
+namespace internal {
+
+// "PBIM", as the first four bytes of an image.
+constexpr uint32_t kImageMagic = 0x4d494250;
+
+// Every image starts with this header, followed by the record of the top-level
+// message.
+struct ImageHeader {
+  uint32_t magic;
+  uint32_t fingerprint;  // Of the message type's layout (see ImageRecord).
+  uint32_t size;         // Of the whole image, in bytes.
+  uint32_t reserved;
+};
+
+// The slot of a string, or repeated field: the offset of its bytes or elements
+// from the start of the image, and how many there are.
+struct ImageRef {
+  uint32_t offset;
+  uint32_t count;
+};
+
+// All offsets within an image are 32 bits.
+constexpr std::size_t kMaxImageSize = std::numeric_limits<uint32_t>::max();
+
+template <typename T>
+[[nodiscard]] T LoadImageValue(const uint8_t* position) {
+  T value;
+  std::memcpy(static_cast<void*>(&value), position, sizeof(T));
+  return value;
+}
+
+template <typename T>
+void StoreImageValue(const T& value, uint8_t* position) {
+  std::memcpy(position, static_cast<const void*>(&value), sizeof(T));
+}
+
+[[nodiscard]] constexpr uint32_t AlignImageOffset(uint32_t offset,
+                                                  uint32_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// FNV-1a, over the four bytes of each |value| mixed into the |hash|.
+constexpr uint32_t kImageFingerprintSeed = 2166136261u;
+
+[[nodiscard]] constexpr uint32_t MixImageFingerprint(uint32_t hash,
+                                                     uint32_t value) {
+  for (int shift = 0; shift < 32; shift += 8) {
+    hash = (hash ^ ((value >> shift) & 0xff)) * 16777619u;
+  }
+  return hash;
+}
+
+// Appends to an image in a std::vector that may be reallocated as it grows,
+// and so everything in it is addressed by offset.
+class ImageWriter {
+ public:
+  explicit ImageWriter(std::vector<uint8_t>& image) : image_(image) {}
+
+  // Appends |size| zero bytes at the next multiple of |alignment|, and returns
+  // their offset; or sets failed() and returns zero if the image would become
+  // too large.
+  [[nodiscard]] uint32_t Allocate(std::size_t size, uint32_t alignment) {
+    const std::size_t offset =
+        (image_.size() + alignment - 1) & ~std::size_t{alignment - 1};
+    if (failed_ || offset > kMaxImageSize || size > kMaxImageSize - offset) {
+      failed_ = true;
+      return 0;
+    }
+    image_.resize(offset + size);
+    return static_cast<uint32_t>(offset);
+  }
+
+  [[nodiscard]] uint8_t* At(uint32_t offset) { return image_.data() + offset; }
+
+  [[nodiscard]] bool failed() const { return failed_; }
+
+ private:
+  std::vector<uint8_t>& image_;
+  bool failed_ = false;
+};
+
+template <class Message>
+struct ImageRecord;
+
+// Detects containers having a reserve() member (e.g., std::vector).
+template <typename Container, typename Enable = void>
+struct ImageReserveDetector {
+  static constexpr bool kHasReserve = false;
+};
+
+template <typename Container>
+struct ImageReserveDetector<
+    Container,
+    std::void_t<decltype(std::declval<Container&>().reserve(0))>> {
+  static constexpr bool kHasReserve = true;
+};
+
+// How a value of each type is held in an image, as a fixed-size "slot" in the
+// record of a message or in the elements of a repeated field.
+template <typename Value, typename Enable = void>
+struct ImageValueCodec {
+  static_assert(!codec::CouldBeAMapFieldEntry<Value>(),
+                "Map fields are not supported by pb::Image.");
+  static_assert(std::is_trivially_copyable_v<Value>,
+                "Unsupported field type.");
+
+  // Scalars (integers, enums, bools, floating-point values, and the integer
+  // wrappers) are stored as their bytes in memory.
+  static constexpr bool kIsScalar = true;
+  static constexpr uint32_t kSize = sizeof(Value);
+  static constexpr uint32_t kAlignment = alignof(Value);
+  static constexpr uint32_t kFingerprint = MixImageFingerprint(
+      kSize, (std::is_floating_point_v<Value> ? 1 : 0) |
+                 (std::is_signed_v<Value> ? 2 : 0) |
+                 (std::is_same_v<Value, bool> ? 4 : 0));
+
+  static void Write(const Value& value, ImageWriter& writer, uint32_t slot) {
+    StoreImageValue(value, writer.At(slot));
+  }
+
+  [[nodiscard]] static Value Read(const uint8_t*, const uint8_t* slot) {
+    if constexpr (std::is_same_v<Value, bool>) {
+      return *slot != 0;  // Any other byte value would be undefined behavior.
+    } else {
+      return LoadImageValue<Value>(slot);
+    }
+  }
+
+  [[nodiscard]] static bool Validate(const uint8_t*,
+                                     std::size_t,
+                                     const uint8_t*,
+                                     std::size_t&) {
+    return true;
+  }
+
+  static void MergeInto(const uint8_t* base, const uint8_t* slot,
+                        Value& value) {
+    value = Read(base, slot);
+  }
+};
+
+// Strings are an ImageRef to their bytes.
+template <typename Value>
+struct ImageValueCodec<
+    Value,
+    std::enable_if_t<std::is_same_v<Value, std::string> ||
+                     std::is_same_v<Value, std::string_view>>> {
+  static constexpr bool kIsScalar = false;
+  static constexpr uint32_t kSize = sizeof(ImageRef);
+  static constexpr uint32_t kAlignment = alignof(ImageRef);
+  static constexpr uint32_t kFingerprint = MixImageFingerprint(kSize, 8);
+
+  static void Write(std::string_view value,
+                    ImageWriter& writer,
+                    uint32_t slot) {
+    if (value.empty()) {
+      return;
+    }
+    const uint32_t bytes = writer.Allocate(value.size(), 1);
+    if (writer.failed()) {
+      return;
+    }
+    std::memcpy(writer.At(bytes), value.data(), value.size());
+    StoreImageValue(ImageRef{bytes, static_cast<uint32_t>(value.size())},
+                    writer.At(slot));
+  }
+
+  [[nodiscard]] static std::string_view Read(const uint8_t* base,
+                                             const uint8_t* slot) {
+    const auto ref = LoadImageValue<ImageRef>(slot);
+    return std::string_view(reinterpret_cast<const char*>(base + ref.offset),
+                            ref.count);
+  }
+
+  [[nodiscard]] static bool Validate(const uint8_t*,
+                                     std::size_t image_size,
+                                     const uint8_t* slot,
+                                     std::size_t&) {
+    const auto ref = LoadImageValue<ImageRef>(slot);
+    return uint64_t{ref.offset} + ref.count <= image_size;
+  }
+
+  // A std::string_view is set to reference the bytes in the image.
+  static void MergeInto(const uint8_t* base, const uint8_t* slot,
+                        Value& value) {
+    value = Read(base, slot);
+  }
+};
+
+// Nested messages are their record, inline.
+template <typename Value>
+struct ImageValueCodec<Value,
+                       std::enable_if_t<codec::IsMessage<Value>()>> {
+  static constexpr bool kIsScalar = false;
+  static constexpr uint32_t kSize = ImageRecord<Value>::kLayout.size;
+  static constexpr uint32_t kAlignment = ImageRecord<Value>::kLayout.alignment;
+  static constexpr uint32_t kFingerprint =
+      ImageRecord<Value>::kLayout.fingerprint;
+
+  static void Write(const Value& value, ImageWriter& writer, uint32_t slot) {
+    ImageRecord<Value>::Write(value, writer, slot);
+  }
+
+  [[nodiscard]] static Image<Value> Read(const uint8_t* base,
+                                         const uint8_t* slot) {
+    return Image<Value>(base, slot);
+  }
+
+  [[nodiscard]] static bool Validate(const uint8_t* base,
+                                     std::size_t image_size,
+                                     const uint8_t* slot,
+                                     std::size_t& element_bytes_left) {
+    return ImageRecord<Value>::Validate(base, image_size, slot,
+                                        element_bytes_left);
+  }
+
+  static void MergeInto(const uint8_t* base, const uint8_t* slot,
+                        Value& value) {
+    ImageRecord<Value>::MergeInto(base, slot, value);
+  }
+};
+
+// Unwraps the Value held by a std::optional, std::unique_ptr, or
+// std::shared_ptr field.
+template <typename Member>
+struct ImageMemberDetector {
+  using Value = Member;
+  static constexpr bool kIsWrapped = false;
+};
+
+template <typename T>
+struct ImageMemberDetector<std::optional<T>> {
+  using Value = T;
+  static constexpr bool kIsWrapped = true;
+};
+
+template <typename T>
+struct ImageMemberDetector<std::unique_ptr<T>> {
+  using Value = T;
+  static constexpr bool kIsWrapped = true;
+};
+
+template <typename T>
+struct ImageMemberDetector<std::shared_ptr<T>> {
+  using Value = std::remove_const_t<T>;
+  static constexpr bool kIsWrapped = true;
+};
+
+template <typename TheField, bool kIsRepeated>
+struct ImageFieldValueDetector {
+  using Type = typename ImageMemberDetector<typename TheField::Member>::Value;
+};
+
+template <typename TheField>
+struct ImageFieldValueDetector<TheField, true> {
+  using Type = codec::IterableValueType<typename TheField::Member>;
+};
+
+// How one field of a message is held in the message's record: A repeated
+// field is an ImageRef to its elements, and anything else is the slot of its
+// one value. A field that may not hold a value (a std::optional, a smart
+// pointer, or a std::string_view that is null) also has a "present" bit.
+template <typename TheField>
+struct ImageFieldCodec {
+  using Member = typename TheField::Member;
+
+  static constexpr bool kIsRepeated = codec::IsRepeatedField<TheField>();
+  using Value = typename ImageFieldValueDetector<TheField, kIsRepeated>::Type;
+  using ValueCodec = ImageValueCodec<Value>;
+  static constexpr bool kIsNullable =
+      !kIsRepeated && (ImageMemberDetector<Member>::kIsWrapped ||
+                       std::is_same_v<Member, std::string_view>);
+
+  static_assert(!kIsRepeated || !ImageMemberDetector<Value>::kIsWrapped,
+                "Repeated fields of optionals or pointers are not supported "
+                "by pb::Image.");
+  static_assert(!std::is_same_v<Member, PackedFixedView<Value>>,
+                "PackedFixedView fields are not supported by pb::Image.");
+
+  static constexpr uint32_t kSize =
+      kIsRepeated ? uint32_t{sizeof(ImageRef)} : ValueCodec::kSize;
+  static constexpr uint32_t kAlignment =
+      kIsRepeated ? uint32_t{alignof(ImageRef)} : ValueCodec::kAlignment;
+  static constexpr uint32_t kFingerprint = MixImageFingerprint(
+      MixImageFingerprint(
+          static_cast<uint32_t>(TheField::GetFieldNumber()),
+          (kIsRepeated ? 1 : 0) | (kIsNullable ? 2 : 0)),
+      ValueCodec::kFingerprint);
+};
+
+// The layout of a |Message|'s record: the "present" bits of its fields (if it
+// has any that need them), and then the slot of each field, in the order of
+// its ProtobufFields, each at the next multiple of the slot's alignment. This
+// is computed at compile time, and so a message type that (indirectly)
+// contains itself is not supported.
+template <class Message>
+struct ImageRecord {
+  using Fields = typename Message::ProtobufFields;
+  static constexpr std::size_t kFieldCount = Fields::kFieldCount;
+
+  template <std::size_t kIndex>
+  using FieldCodec =
+      ImageFieldCodec<typename Fields::template FieldAt<kIndex>>;
+
+  struct Layout {
+    uint32_t offsets[kFieldCount + 1] = {};  // Of each field's slot.
+    uint32_t size = 0;  // Including the padding to a multiple of |alignment|.
+    uint32_t alignment = 1;
+    uint32_t fingerprint = kImageFingerprintSeed;
+  };
+
+  template <std::size_t... kIndices>
+  [[nodiscard]] static constexpr Layout ComputeLayout(
+      std::index_sequence<kIndices...>) {
+    constexpr uint32_t kSizes[] = {FieldCodec<kIndices>::kSize..., 0};
+    constexpr uint32_t kAlignments[] = {FieldCodec<kIndices>::kAlignment..., 1};
+    constexpr uint32_t kFingerprints[] = {FieldCodec<kIndices>::kFingerprint...,
+                                          0};
+    constexpr bool kHasNullableField =
+        (FieldCodec<kIndices>::kIsNullable || ... || false);
+
+    Layout layout;
+    uint32_t offset = kHasNullableField ? (kFieldCount + 7) / 8 : 0;
+    for (std::size_t i = 0; i < kFieldCount; ++i) {
+      offset = AlignImageOffset(offset, kAlignments[i]);
+      layout.offsets[i] = offset;
+      offset += kSizes[i];
+      layout.alignment = std::max(layout.alignment, kAlignments[i]);
+      layout.fingerprint = MixImageFingerprint(
+          MixImageFingerprint(layout.fingerprint, layout.offsets[i]),
+          kFingerprints[i]);
+    }
+    layout.size = AlignImageOffset(offset, layout.alignment);
+    layout.fingerprint = MixImageFingerprint(layout.fingerprint, layout.size);
+    return layout;
+  }
+
+  static constexpr Layout kLayout =
+      ComputeLayout(std::make_index_sequence<kFieldCount>());
+
+  [[nodiscard]] static bool IsPresent(const uint8_t* record,
+                                      std::size_t index) {
+    return (record[index / 8] >> (index % 8)) & 1;
+  }
+
+  static void Write(const Message& message,
+                    ImageWriter& writer,
+                    uint32_t record) {
+    WriteFields(message, writer, record,
+                std::make_index_sequence<kFieldCount>());
+  }
+
+  template <std::size_t... kIndices>
+  static void WriteFields(const Message& message,
+                          ImageWriter& writer,
+                          uint32_t record,
+                          std::index_sequence<kIndices...>) {
+    (WriteField<kIndices>(message, writer, record), ...);
+  }
+
+  template <std::size_t kIndex>
+  static void WriteField(const Message& message,
+                         ImageWriter& writer,
+                         uint32_t record) {
+    using Codec = FieldCodec<kIndex>;
+    using Value = typename Codec::Value;
+    const auto& member =
+        Fields::template FieldAt<kIndex>::GetMemberReferenceIn(message);
+    const uint32_t slot = record + kLayout.offsets[kIndex];
+    if constexpr (Codec::kIsRepeated) {
+      const auto count = static_cast<uint64_t>(codec::GetIterableSize(member));
+      if (count == 0) {
+        return;
+      }
+      constexpr uint32_t kStride = Codec::ValueCodec::kSize;
+      if (count > kMaxImageSize / std::max(kStride, uint32_t{1})) {
+        static_cast<void>(writer.Allocate(kMaxImageSize + 1, 1));
+        return;
+      }
+      const uint32_t elements = writer.Allocate(
+          static_cast<std::size_t>(count) * kStride,
+          Codec::ValueCodec::kAlignment);
+      if (writer.failed()) {
+        return;
+      }
+      uint32_t element = elements;
+      for (const auto& value : member) {
+        Codec::ValueCodec::Write(static_cast<const Value&>(value), writer,
+                                 element);
+        element += kStride;
+      }
+      StoreImageValue(ImageRef{elements, static_cast<uint32_t>(count)},
+                      writer.At(slot));
+    } else if constexpr (Codec::kIsNullable) {
+      if (!codec::IsStoringOneValue(member)) {
+        return;
+      }
+      writer.At(record)[kIndex / 8] |= static_cast<uint8_t>(1 << (kIndex % 8));
+      if constexpr (std::is_same_v<typename Codec::Member, std::string_view>) {
+        Codec::ValueCodec::Write(member, writer, slot);
+      } else {
+        Codec::ValueCodec::Write(*member, writer, slot);
+      }
+    } else {
+      Codec::ValueCodec::Write(member, writer, slot);
+    }
+  }
+
+  // Checks that every string and repeated field in the |record| is within the
+  // image. The elements of repeated strings and messages are checked too, but
+  // no more than |element_bytes_left| of them in all (which is reduced by the
+  // number checked): Since each repeated field's elements are written to their
+  // own part of the image, a valid image never has more than its size in
+  // elements. So, a corrupt image cannot make the check take longer than that
+  // by referencing the same elements many times.
+  [[nodiscard]] static bool Validate(const uint8_t* base,
+                                     std::size_t image_size,
+                                     const uint8_t* record,
+                                     std::size_t& element_bytes_left) {
+    return ValidateFields(base, image_size, record, element_bytes_left,
+                          std::make_index_sequence<kFieldCount>());
+  }
+
+  template <std::size_t... kIndices>
+  [[nodiscard]] static bool ValidateFields(const uint8_t* base,
+                                           std::size_t image_size,
+                                           const uint8_t* record,
+                                           std::size_t& element_bytes_left,
+                                           std::index_sequence<kIndices...>) {
+    return (ValidateField<kIndices>(base, image_size, record,
+                                    element_bytes_left) &&
+            ...);
+  }
+
+  template <std::size_t kIndex>
+  [[nodiscard]] static bool ValidateField(const uint8_t* base,
+                                          std::size_t image_size,
+                                          const uint8_t* record,
+                                          std::size_t& element_bytes_left) {
+    using ValueCodec = typename FieldCodec<kIndex>::ValueCodec;
+    const uint8_t* const slot = record + kLayout.offsets[kIndex];
+    if constexpr (FieldCodec<kIndex>::kIsRepeated) {
+      const auto ref = LoadImageValue<ImageRef>(slot);
+      if (uint64_t{ref.offset} + uint64_t{ref.count} * ValueCodec::kSize >
+          image_size) {
+        return false;
+      }
+      // Scalar elements are always valid, and so need not be checked; and
+      // neither are the elements of a message type having no fields.
+      if constexpr (!ValueCodec::kIsScalar && ValueCodec::kSize > 0) {
+        const uint64_t byte_count = uint64_t{ref.count} * ValueCodec::kSize;
+        if (byte_count > element_bytes_left) {
+          return false;
+        }
+        element_bytes_left -= static_cast<std::size_t>(byte_count);
+        const uint8_t* element = base + ref.offset;
+        for (uint32_t i = 0; i < ref.count; ++i) {
+          if (!ValueCodec::Validate(base, image_size, element,
+                                    element_bytes_left)) {
+            return false;
+          }
+          element += ValueCodec::kSize;
+        }
+      }
+      return true;
+    } else {
+      return ValueCodec::Validate(base, image_size, slot, element_bytes_left);
+    }
+  }
+
+  static void MergeInto(const uint8_t* base,
+                        const uint8_t* record,
+                        Message& message) {
+    MergeFieldsInto(base, record, message,
+                    std::make_index_sequence<kFieldCount>());
+  }
+
+  template <std::size_t... kIndices>
+  static void MergeFieldsInto(const uint8_t* base,
+                              const uint8_t* record,
+                              Message& message,
+                              std::index_sequence<kIndices...>) {
+    (MergeFieldInto<kIndices>(base, record, message), ...);
+  }
+
+  // Merges each field as a parse of its serialized value would (see
+  // pb/codec/parse.h): Repeated fields are appended to, nested messages merged
+  // into, and any other field that is present is overwritten.
+  template <std::size_t kIndex>
+  static void MergeFieldInto(const uint8_t* base,
+                             const uint8_t* record,
+                             Message& message) {
+    using Codec = FieldCodec<kIndex>;
+    using Value = typename Codec::Value;
+    auto& member =
+        Fields::template FieldAt<kIndex>::GetMutableMemberReferenceIn(message);
+    const uint8_t* const slot = record + kLayout.offsets[kIndex];
+    if constexpr (Codec::kIsRepeated) {
+      const auto ref = LoadImageValue<ImageRef>(slot);
+      if constexpr (ImageReserveDetector<typename Codec::Member>::kHasReserve) {
+        member.reserve(member.size() + ref.count);
+      }
+      const uint8_t* element = base + ref.offset;
+      for (uint32_t i = 0; i < ref.count; ++i) {
+        if constexpr (codec::IsMessage<Value>()) {
+          Value value{};
+          Codec::ValueCodec::MergeInto(base, element, value);
+          member.insert(std::end(member), std::move(value));
+        } else {
+          member.insert(std::end(member),
+                        Value(Codec::ValueCodec::Read(base, element)));
+        }
+        element += Codec::ValueCodec::kSize;
+      }
+    } else if constexpr (Codec::kIsNullable) {
+      if (!IsPresent(record, kIndex)) {
+        return;
+      }
+      using Member = typename Codec::Member;
+      if constexpr (std::is_same_v<Member, std::string_view>) {
+        Codec::ValueCodec::MergeInto(base, slot, member);
+      } else if constexpr (std::is_same_v<Member, std::optional<Value>>) {
+        if (!member) {
+          member.emplace();
+        }
+        Codec::ValueCodec::MergeInto(base, slot, *member);
+      } else if constexpr (std::is_same_v<Member,
+                                          std::shared_ptr<const Value>>) {
+        auto instance = codec::MakeSharedForMerge(member);
+        Codec::ValueCodec::MergeInto(base, slot, *instance);
+        member = std::move(instance);
+      } else if constexpr (std::is_same_v<Member, std::shared_ptr<Value>>) {
+        if (!member) {
+          member = std::make_shared<Value>();
+        }
+        Codec::ValueCodec::MergeInto(base, slot, *member);
+      } else {
+        if (!member) {
+          member = std::make_unique<Value>();
+        }
+        Codec::ValueCodec::MergeInto(base, slot, *member);
+      }
+    } else {
+      Codec::ValueCodec::MergeInto(base, slot, member);
+    }
+  }
+};
+
+}  // namespace internal
+
+// A read-only view of the elements of a repeated field in an Image. Each
+// element is returned by value: a scalar, a std::string_view of a string's
+// bytes in the image, or an Image of a nested message.
+template <typename Value>
+class ImageArray {
+ private:
+  using ValueCodec = internal::ImageValueCodec<Value>;
+
+ public:
+  using value_type = decltype(ValueCodec::Read(nullptr, nullptr));
+
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = ImageArray::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = value_type;
+
+    const_iterator() = default;
+
+    value_type operator*() const { return ValueCodec::Read(base_, position_); }
+
+    const_iterator& operator++() {
+      position_ += ValueCodec::kSize;
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator result = *this;
+      ++*this;
+      return result;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return position_ == other.position_;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return position_ != other.position_;
+    }
+
+   private:
+    friend class ImageArray;
+
+    const_iterator(const uint8_t* base, const uint8_t* position)
+        : base_(base), position_(position) {}
+
+    const uint8_t* base_ = nullptr;
+    const uint8_t* position_ = nullptr;
+  };
+
+  ImageArray() = default;
+
+  [[nodiscard]] std::size_t size() const { return size_; }
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+
+  [[nodiscard]] value_type operator[](std::size_t index) const {
+    return ValueCodec::Read(base_, elements_ + index * ValueCodec::kSize);
+  }
+
+  [[nodiscard]] const_iterator begin() const {
+    return const_iterator(base_, elements_);
+  }
+  [[nodiscard]] const_iterator end() const {
+    return const_iterator(base_, elements_ + size_ * ValueCodec::kSize);
+  }
+
+ private:
+  template <class>
+  friend class Image;
+
+  ImageArray(const uint8_t* base, const uint8_t* elements, std::size_t size)
+      : base_(base), elements_(elements), size_(size) {}
+
+  const uint8_t* base_ = nullptr;
+  const uint8_t* elements_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+// A read-only view of a |Message| in a flat, position-independent "image" (as
+// written by WriteImage() below), for caches of messages shared between
+// processes on one host: An image is loaded by memory-mapping it, and its
+// fields are read in-place, with no parse at all. Example:
+//
+//   std::vector<uint8_t> bytes;
+//   if (!pb::WriteImage(book, bytes)) { ... }
+//   ...write the bytes to a file...
+//
+//   // ...and in any process, later:
+//   const uint8_t* begin = static_cast<const uint8_t*>(mmap(...));
+//   auto image = pb::Image<AddressBook>::Open(begin, begin + size);
+//   if (!image) { ... }
+//   for (pb::Image<Person> person : image->Get<&AddressBook::people>()) {
+//     std::string_view name = person.Get<&Person::name>();
+//     ...
+//   }
+//
+// The layout of an image is derived from the ProtobufFields at compile time,
+// much like a C++ struct's: Each message is a fixed-size record, in which each
+// scalar field is at a fixed offset, and each nested message is inline. A
+// string or repeated field is an (offset, count) reference to its bytes or
+// elements elsewhere in the image. Offsets are from the start of the image,
+// and so it may be mapped at any address.
+//
+// Images are not wire-compatible with anything: Values are in the host's byte
+// order, and the layout changes whenever the ProtobufFields do. Open() checks
+// a fingerprint of the layout, and so fails for an image of a different type,
+// or an older version of the same type. Map fields, repeated fields of
+// optionals or pointers, PackedFixedView fields, and message types that
+// (indirectly) contain themselves, are not supported.
+//
+// As with a std::string_view, an Image references the bytes it was opened on,
+// which must outlive it.
+template <class Message>
+class Image {
+ private:
+  using Record = internal::ImageRecord<Message>;
+  using Fields = typename Message::ProtobufFields;
+
+  template <auto kMemberPointer>
+  [[nodiscard]] static constexpr std::size_t GetFieldIndex() {
+    constexpr std::size_t kIndex =
+        internal::FindFieldIndex<kMemberPointer>(Fields{});
+    static_assert(kIndex < Fields::kFieldCount,
+                  "The member is not one of the Message's ProtobufFields.");
+    return kIndex;
+  }
+
+  template <auto kMemberPointer>
+  using FieldCodecFor =
+      typename Record::template FieldCodec<GetFieldIndex<kMemberPointer>()>;
+
+ public:
+  // Returns a view of the image in the range |begin| to |end|, or nullopt if
+  // it is not an image of a |Message| or is corrupt. Every string and repeated
+  // field is checked to be within the image, which takes time proportional to
+  // their number, and at most to the size of the image (but is much cheaper
+  // than a parse, since nothing is decoded or copied).
+  [[nodiscard]] static std::optional<Image> Open(const uint8_t* begin,
+                                                 const uint8_t* end) {
+    std::optional<Image> image = OpenTrusted(begin, end);
+    const auto size = static_cast<std::size_t>(end - begin);
+    std::size_t element_bytes_left = size;
+    if (image && !Record::Validate(begin, size, image->record_,
+                                   element_bytes_left)) {
+      image.reset();
+    }
+    return image;
+  }
+
+  // Same as Open(), but only checks the header and the size of the image, in
+  // constant time. For images from a trusted source, such as the same process,
+  // since a corrupt one may cause out-of-bounds reads.
+  [[nodiscard]] static std::optional<Image> OpenTrusted(const uint8_t* begin,
+                                                        const uint8_t* end) {
+    const auto size = static_cast<std::size_t>(end - begin);
+    if (size < sizeof(internal::ImageHeader) + Record::kLayout.size) {
+      return std::nullopt;
+    }
+    const auto header = internal::LoadImageValue<internal::ImageHeader>(begin);
+    if (header.magic != internal::kImageMagic ||
+        header.fingerprint != Record::kLayout.fingerprint ||
+        header.size != size) {
+      return std::nullopt;
+    }
+    return Image(begin, begin + sizeof(internal::ImageHeader));
+  }
+
+  // Returns true if an optional or pointer field holds a value, or a repeated
+  // field is not empty. Always true for any other field.
+  template <auto kMemberPointer>
+  [[nodiscard]] bool Has() const {
+    using Codec = FieldCodecFor<kMemberPointer>;
+    constexpr std::size_t kIndex = GetFieldIndex<kMemberPointer>();
+    if constexpr (Codec::kIsRepeated) {
+      return internal::LoadImageValue<internal::ImageRef>(
+                 record_ + Record::kLayout.offsets[kIndex])
+                 .count != 0;
+    } else if constexpr (Codec::kIsNullable) {
+      return Record::IsPresent(record_, kIndex);
+    } else {
+      return true;
+    }
+  }
+
+  // Returns the value of a field: a scalar; a std::string_view of a string's
+  // bytes in the image; an Image of a nested message; or an ImageArray of a
+  // repeated field's elements. For an optional or pointer field that holds no
+  // value (see Has()), returns zero, an empty string, or an Image of a message
+  // whose fields are all zero or empty.
+  template <auto kMemberPointer>
+  [[nodiscard]] auto Get() const {
+    using Codec = FieldCodecFor<kMemberPointer>;
+    const uint8_t* const slot =
+        record_ + Record::kLayout.offsets[GetFieldIndex<kMemberPointer>()];
+    if constexpr (Codec::kIsRepeated) {
+      const auto ref = internal::LoadImageValue<internal::ImageRef>(slot);
+      return ImageArray<typename Codec::Value>(base_, base_ + ref.offset,
+                                               ref.count);
+    } else {
+      return Codec::ValueCodec::Read(base_, slot);
+    }
+  }
+
+  // Merges every field into the |message|, as MergeFromBuffer() would merge
+  // the serialized message. std::string_view fields are set to reference the
+  // bytes in the image.
+  void MergeInto(Message& message) const {
+    Record::MergeInto(base_, record_, message);
+  }
+
+ private:
+  template <typename, typename>
+  friend struct internal::ImageValueCodec;
+
+  Image(const uint8_t* base, const uint8_t* record)
+      : base_(base), record_(record) {}
+
+  const uint8_t* base_;    // The start of the image.
+  const uint8_t* record_;  // The record of this message.
+};
+
+// Replaces the contents of |image| with an image of the |message| (see Image
+// above), in one pass over its fields. Returns false if the image would be
+// larger than 4 GB.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool WriteImage(const Message& message,
+                              std::vector<uint8_t>& image) {
+  using Record = internal::ImageRecord<Message>;
+  image.clear();
+  internal::ImageWriter writer(image);
+  static_cast<void>(writer.Allocate(sizeof(internal::ImageHeader),
+                                    alignof(std::max_align_t)));
+  const uint32_t record =
+      writer.Allocate(Record::kLayout.size, Record::kLayout.alignment);
+  if (!writer.failed()) {
+    Record::Write(message, writer, record);
+  }
+  if (writer.failed()) {
+    image.clear();
+    return false;
+  }
+  internal::StoreImageValue(
+      internal::ImageHeader{internal::kImageMagic, Record::kLayout.fingerprint,
+                            static_cast<uint32_t>(image.size()), 0},
+      image.data());
+  return true;
+}
+
+}  // namespace pb
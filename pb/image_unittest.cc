@@ -0,0 +1,327 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/image.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Point {
+  int32_t x = 0;
+  int32_t y = 0;
+
+  using ProtobufFields = FieldList<Field<&Point::x, 1>, Field<&Point::y, 2>>;
+};
+
+struct Shape {
+  enum Kind : int32_t { kPolygon = 0, kCircle = 1 };
+
+  int32_t id = 0;
+  std::optional<int64_t> layer;
+  std::vector<int32_t> values;
+  std::string name;
+  std::optional<std::string> label;
+  Point origin;
+  std::unique_ptr<Point> anchor;
+  std::vector<Point> points;
+  std::vector<std::string> tags;
+  std::vector<sint32_t> deltas;
+  double scale = 0.0;
+  bool visible = false;
+  Kind kind = kPolygon;
+  std::vector<bool> flags;
+  std::set<uint64_t> ids;
+  std::shared_ptr<const Point> pivot;
+  std::string_view note;
+
+  using ProtobufFields = FieldList<Field<&Shape::id, 1>,
+                                   Field<&Shape::layer, 2>,
+                                   Field<&Shape::values, 3>,
+                                   Field<&Shape::name, 4>,
+                                   Field<&Shape::label, 5>,
+                                   Field<&Shape::origin, 6>,
+                                   Field<&Shape::anchor, 7>,
+                                   Field<&Shape::points, 8>,
+                                   Field<&Shape::tags, 9>,
+                                   Field<&Shape::deltas, 10>,
+                                   Field<&Shape::scale, 11>,
+                                   Field<&Shape::visible, 12>,
+                                   Field<&Shape::kind, 13>,
+                                   Field<&Shape::flags, 14>,
+                                   Field<&Shape::ids, 15>,
+                                   Field<&Shape::pivot, 16>,
+                                   Field<&Shape::note, 17>>;
+};
+
+// The same fields as Point, but with a different type for one of them.
+struct WidePoint {
+  int64_t x = 0;
+  int32_t y = 0;
+
+  using ProtobufFields =
+      FieldList<Field<&WidePoint::x, 1>, Field<&WidePoint::y, 2>>;
+};
+
+Shape MakeShape() {
+  Shape shape;
+  shape.id = 42;
+  shape.layer = -7;
+  shape.values = {1, -2, 300000};
+  shape.name = "triangle";
+  shape.origin = Point{3, 4};
+  shape.anchor = std::make_unique<Point>(Point{5, 6});
+  shape.points = {Point{0, 0}, Point{10, 0}, Point{5, 8}};
+  shape.tags = {"red", "", "a somewhat longer tag"};
+  shape.deltas = {-1, 1};
+  shape.scale = 2.5;
+  shape.visible = true;
+  shape.kind = Shape::kCircle;
+  shape.flags = {true, false, true};
+  shape.ids = {30, 10, 20};
+  shape.pivot = std::make_shared<const Point>(Point{7, 8});
+  shape.note = "noted";
+  return shape;
+}
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(ComputeSerializedSize(message)));
+  Serialize(message, buffer.data());
+  return buffer;
+}
+
+TEST(ImageTest, ReadsFieldsInPlace) {
+  const Shape shape = MakeShape();
+  std::vector<uint8_t> bytes;
+  ASSERT_TRUE(WriteImage(shape, bytes));
+  const auto image =
+      Image<Shape>::Open(bytes.data(), bytes.data() + bytes.size());
+  ASSERT_TRUE(image);
+
+  EXPECT_EQ(42, image->Get<&Shape::id>());
+  EXPECT_TRUE(image->Has<&Shape::layer>());
+  EXPECT_EQ(-7, image->Get<&Shape::layer>());
+  EXPECT_EQ(3u, image->Get<&Shape::values>().size());
+  EXPECT_EQ(300000, image->Get<&Shape::values>()[2]);
+  EXPECT_EQ("triangle", image->Get<&Shape::name>());
+  EXPECT_FALSE(image->Has<&Shape::label>());
+  EXPECT_EQ("", image->Get<&Shape::label>());
+  EXPECT_EQ(4, image->Get<&Shape::origin>().Get<&Point::y>());
+  EXPECT_TRUE(image->Has<&Shape::anchor>());
+  EXPECT_EQ(5, image->Get<&Shape::anchor>().Get<&Point::x>());
+  int32_t sum = 0;
+  for (Image<Point> point : image->Get<&Shape::points>()) {
+    sum += point.Get<&Point::x>() + point.Get<&Point::y>();
+  }
+  EXPECT_EQ(23, sum);
+  const ImageArray<std::string> tags = image->Get<&Shape::tags>();
+  ASSERT_EQ(3u, tags.size());
+  EXPECT_EQ("red", tags[0]);
+  EXPECT_EQ("", tags[1]);
+  EXPECT_EQ("a somewhat longer tag", tags[2]);
+  EXPECT_EQ(-1, image->Get<&Shape::deltas>()[0]);
+  EXPECT_EQ(2.5, image->Get<&Shape::scale>());
+  EXPECT_TRUE(image->Get<&Shape::visible>());
+  EXPECT_EQ(Shape::kCircle, image->Get<&Shape::kind>());
+  EXPECT_EQ(std::vector<bool>({true, false, true}),
+            std::vector<bool>(image->Get<&Shape::flags>().begin(),
+                              image->Get<&Shape::flags>().end()));
+  EXPECT_EQ(std::vector<uint64_t>({10, 20, 30}),
+            std::vector<uint64_t>(image->Get<&Shape::ids>().begin(),
+                                  image->Get<&Shape::ids>().end()));
+  EXPECT_EQ(8, image->Get<&Shape::pivot>().Get<&Point::y>());
+  EXPECT_TRUE(image->Has<&Shape::note>());
+  EXPECT_EQ("noted", image->Get<&Shape::note>());
+
+  // Fields that hold no value read as zero or empty.
+  std::vector<uint8_t> empty_bytes;
+  ASSERT_TRUE(WriteImage(Shape(), empty_bytes));
+  const auto empty = Image<Shape>::Open(
+      empty_bytes.data(), empty_bytes.data() + empty_bytes.size());
+  ASSERT_TRUE(empty);
+  EXPECT_FALSE(empty->Has<&Shape::layer>());
+  EXPECT_FALSE(empty->Has<&Shape::anchor>());
+  EXPECT_EQ(0, empty->Get<&Shape::anchor>().Get<&Point::x>());
+  EXPECT_FALSE(empty->Has<&Shape::values>());
+  EXPECT_TRUE(empty->Get<&Shape::points>().empty());
+  EXPECT_FALSE(empty->Has<&Shape::note>());
+  EXPECT_TRUE(empty->Has<&Shape::id>());
+}
+
+TEST(ImageTest, MergesIntoMessagesAsAParseWould) {
+  const Shape shape = MakeShape();
+  std::vector<uint8_t> bytes;
+  ASSERT_TRUE(WriteImage(shape, bytes));
+  const auto image =
+      Image<Shape>::Open(bytes.data(), bytes.data() + bytes.size());
+  ASSERT_TRUE(image);
+
+  Shape from_image;
+  image->MergeInto(from_image);
+  EXPECT_EQ(SerializeToVector(shape), SerializeToVector(from_image));
+  // A std::string_view references the bytes in the image.
+  const auto* const note =
+      reinterpret_cast<const uint8_t*>(from_image.note.data());
+  EXPECT_TRUE(note > bytes.data() && note < bytes.data() + bytes.size());
+
+  // Merging twice appends to repeated fields, exactly as parsing twice does.
+  const std::vector<uint8_t> serialized = SerializeToVector(shape);
+  Shape parsed_twice;
+  ASSERT_TRUE(MergeFromBuffer(serialized.data(),
+                              serialized.data() + serialized.size(),
+                              parsed_twice));
+  ASSERT_TRUE(MergeFromBuffer(serialized.data(),
+                              serialized.data() + serialized.size(),
+                              parsed_twice));
+  image->MergeInto(from_image);
+  EXPECT_EQ(SerializeToVector(parsed_twice), SerializeToVector(from_image));
+
+  // Fields that hold no value are left as they were.
+  Shape partial;
+  partial.label = "kept";
+  partial.anchor = std::make_unique<Point>(Point{1, 1});
+  std::vector<uint8_t> empty_bytes;
+  ASSERT_TRUE(WriteImage(Shape(), empty_bytes));
+  Image<Shape>::Open(empty_bytes.data(),
+                     empty_bytes.data() + empty_bytes.size())
+      ->MergeInto(partial);
+  EXPECT_EQ("kept", partial.label);
+  ASSERT_TRUE(partial.anchor);
+  EXPECT_EQ(1, partial.anchor->x);
+}
+
+TEST(ImageTest, RejectsImagesOfOtherTypesAndCorruptImages) {
+  std::vector<uint8_t> bytes;
+  ASSERT_TRUE(WriteImage(Point{1, 2}, bytes));
+  const uint8_t* const begin = bytes.data();
+  const uint8_t* const end = bytes.data() + bytes.size();
+  EXPECT_TRUE(Image<Point>::Open(begin, end));
+  EXPECT_FALSE(Image<WidePoint>::Open(begin, end));
+  EXPECT_FALSE(Image<Shape>::OpenTrusted(begin, end));
+  EXPECT_FALSE(Image<Point>::Open(begin, end - 1));
+  EXPECT_FALSE(Image<Point>::Open(begin, begin));
+
+  std::vector<uint8_t> shape_bytes;
+  ASSERT_TRUE(WriteImage(MakeShape(), shape_bytes));
+  ASSERT_TRUE(Image<Shape>::Open(shape_bytes.data(),
+                                 shape_bytes.data() + shape_bytes.size()));
+  // Point each string and repeated field past the end of the image in turn:
+  // Open() notices, but OpenTrusted() does not look.
+  const auto record = shape_bytes.data() + sizeof(internal::ImageHeader);
+  for (const std::size_t index : {2u, 3u, 7u, 8u, 13u, 16u}) {
+    std::vector<uint8_t> corrupt = shape_bytes;
+    const uint32_t offset =
+        internal::ImageRecord<Shape>::kLayout.offsets[index];
+    const auto ref = internal::LoadImageValue<internal::ImageRef>(
+        record + offset);
+    internal::StoreImageValue(
+        internal::ImageRef{static_cast<uint32_t>(corrupt.size()), ref.count},
+        corrupt.data() + sizeof(internal::ImageHeader) + offset);
+    EXPECT_FALSE(
+        Image<Shape>::Open(corrupt.data(), corrupt.data() + corrupt.size()))
+        << "field index " << index;
+    EXPECT_TRUE(Image<Shape>::OpenTrusted(corrupt.data(),
+                                          corrupt.data() + corrupt.size()));
+  }
+}
+
+TEST(ImageTest, BoundsTheValidationOfAliasedElements) {
+  struct Group {
+    std::vector<std::string> names;
+    using ProtobufFields = FieldList<Field<&Group::names, 1>>;
+  };
+  struct Groups {
+    std::vector<Group> groups;
+    using ProtobufFields = FieldList<Field<&Groups::groups, 1>>;
+  };
+  Groups message;
+  message.groups.resize(100);
+  message.groups[0].names.resize(1000);
+  std::vector<uint8_t> bytes;
+  ASSERT_TRUE(WriteImage(message, bytes));
+  ASSERT_TRUE(Image<Groups>::Open(bytes.data(), bytes.data() + bytes.size()));
+
+  // Point every group's names at the first group's: Each element is still
+  // valid, but checking them all would take many times the size of the image.
+  using GroupRecord = internal::ImageRecord<Group>;
+  const uint8_t* const base = bytes.data();
+  const auto groups = internal::LoadImageValue<internal::ImageRef>(
+      base + sizeof(internal::ImageHeader) +
+      internal::ImageRecord<Groups>::kLayout.offsets[0]);
+  ASSERT_EQ(100u, groups.count);
+  const uint32_t first_names = groups.offset + GroupRecord::kLayout.offsets[0];
+  const auto names =
+      internal::LoadImageValue<internal::ImageRef>(base + first_names);
+  ASSERT_EQ(1000u, names.count);
+  for (uint32_t i = 1; i < groups.count; ++i) {
+    internal::StoreImageValue(
+        names, bytes.data() + first_names + i * GroupRecord::kLayout.size);
+  }
+  EXPECT_FALSE(Image<Groups>::Open(bytes.data(), bytes.data() + bytes.size()));
+  EXPECT_TRUE(
+      Image<Groups>::OpenTrusted(bytes.data(), bytes.data() + bytes.size()));
+}
+
+TEST(ImageTest, ReadsImagesMappedAtAnyAddress) {
+  const Shape shape = MakeShape();
+  std::vector<uint8_t> bytes;
+  ASSERT_TRUE(WriteImage(shape, bytes));
+
+  char path[] = "/tmp/pb_image_unittest_XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  unlink(path);
+  ASSERT_EQ(static_cast<ssize_t>(bytes.size()),
+            write(fd, bytes.data(), bytes.size()));
+  void* const mapped =
+      mmap(nullptr, bytes.size(), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  ASSERT_NE(MAP_FAILED, mapped);
+  const auto* const begin = static_cast<const uint8_t*>(mapped);
+
+  const auto image = Image<Shape>::Open(begin, begin + bytes.size());
+  ASSERT_TRUE(image);
+  EXPECT_EQ("a somewhat longer tag", image->Get<&Shape::tags>()[2]);
+  Shape from_image;
+  image->MergeInto(from_image);
+  EXPECT_EQ(SerializeToVector(shape), SerializeToVector(from_image));
+  munmap(mapped, bytes.size());
+
+  // The image is the same bytes wherever it is, even misaligned.
+  std::vector<uint8_t> misaligned(bytes.size() + 1);
+  std::copy(bytes.begin(), bytes.end(), misaligned.begin() + 1);
+  const auto moved = Image<Shape>::Open(misaligned.data() + 1,
+                                        misaligned.data() + misaligned.size());
+  ASSERT_TRUE(moved);
+  EXPECT_EQ("triangle", moved->Get<&Shape::name>());
+
+  // Writing the same message again produces the same bytes.
+  std::vector<uint8_t> again = {1, 2, 3};
+  ASSERT_TRUE(WriteImage(shape, again));
+  EXPECT_EQ(bytes, again);
+}
+
+}  // namespace
+}  // namespace pb
@@ -0,0 +1,55 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "pb/codec/json_parse.h"
+#include "pb/codec/json_serialize.h"
+#include "pb/codec/json_util.h"
+
+namespace pb {
+
+// Replaces the content of |json| with a JSON object representing the |message|.
+// The object keys are the field names (see pb::Field), or the field numbers for
+// fields without names. Returns false if a string field does not contain valid
+// UTF-8 (in which case |json| holds the output, but with the invalid strings
+// truncated).
+//
+// The storage of |json| is written to directly, and only grown when needed. So,
+// re-using the same std::string to serialize many messages re-uses its
+// capacity too.
+//
+// As with Serialize(), it is the responsibility of the caller to ensure the
+// message nesting depth does not exceed |pb::codec::kMaxMessageNestingDepth|.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool ToJson(const Message& message, std::string& json) {
+  codec::JsonOutput out(json);
+  codec::WriteJsonValue(message, out);
+  return out.Finish();
+}
+
+// Parses the JSON object in |json|, merging its fields into the given
+// |message|. Keys that do not match any field are ignored. Returns false if
+// the |json| is malformed, or does not match the types of the fields. A failed
+// parse may leave the |message| partially-modified.
+//
+// std::string_view fields will point into |json|, and so strings for those
+// fields must not contain escape sequences (or the parse fails).
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool FromJson(std::string_view json, Message& message) {
+  const char* const end = json.data() + json.size();
+  const char* const begin = codec::SkipJsonWhitespace(json.data(), end);
+  const char* const value_end = codec::ParseJsonValue(begin, end, 0, message);
+  return value_end && codec::SkipJsonWhitespace(value_end, end) == end;
+}
+
+}  // namespace pb
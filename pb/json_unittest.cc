@@ -0,0 +1,306 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/json.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb {
+namespace {
+
+enum class Color : int8_t { kRed = 1, kGreen = 2 };
+
+struct Inner {
+  int32_t x = 0;
+  std::string label;
+
+  static constexpr char kXName[] = "x";
+  static constexpr char kLabelName[] = "label";
+  using ProtobufFields = FieldList<Field<&Inner::x, 1, kXName>,
+                                   Field<&Inner::label, 2, kLabelName>>;
+};
+
+struct Everything {
+  bool flag = false;
+  int32_t small = 0;
+  int64_t big = 0;
+  uint64_t ubig = 0;
+  sint32_t zigzag;
+  fixed64_t fixed;
+  float ratio = 0.0f;
+  double precise = 0.0;
+  Color color = Color::kRed;
+  std::string text;
+  std::optional<int32_t> maybe;
+  std::unique_ptr<Inner> child;
+  std::vector<Inner> children;
+  std::vector<int32_t> numbers;
+  std::map<std::string, int32_t> counts;
+  std::map<int32_t, Inner> by_id;
+  int32_t unnamed = 0;
+
+  static constexpr char kFlagName[] = "flag";
+  static constexpr char kSmallName[] = "small";
+  static constexpr char kBigName[] = "big";
+  static constexpr char kUbigName[] = "ubig";
+  static constexpr char kZigzagName[] = "zigzag";
+  static constexpr char kFixedName[] = "fixed";
+  static constexpr char kRatioName[] = "ratio";
+  static constexpr char kPreciseName[] = "precise";
+  static constexpr char kColorName[] = "color";
+  static constexpr char kTextName[] = "text";
+  static constexpr char kMaybeName[] = "maybe";
+  static constexpr char kChildName[] = "child";
+  static constexpr char kChildrenName[] = "children";
+  static constexpr char kNumbersName[] = "numbers";
+  static constexpr char kCountsName[] = "counts";
+  static constexpr char kByIdName[] = "byId";
+  using ProtobufFields =
+      FieldList<Field<&Everything::flag, 1, kFlagName>,
+                Field<&Everything::small, 2, kSmallName>,
+                Field<&Everything::big, 3, kBigName>,
+                Field<&Everything::ubig, 4, kUbigName>,
+                Field<&Everything::zigzag, 5, kZigzagName>,
+                Field<&Everything::fixed, 6, kFixedName>,
+                Field<&Everything::ratio, 7, kRatioName>,
+                Field<&Everything::precise, 8, kPreciseName>,
+                Field<&Everything::color, 9, kColorName>,
+                Field<&Everything::text, 10, kTextName>,
+                Field<&Everything::maybe, 11, kMaybeName>,
+                Field<&Everything::child, 12, kChildName>,
+                Field<&Everything::children, 13, kChildrenName>,
+                Field<&Everything::numbers, 14, kNumbersName>,
+                Field<&Everything::counts, 15, kCountsName>,
+                Field<&Everything::by_id, 16, kByIdName>,
+                Field<&Everything::unnamed, 17>>;
+};
+
+std::string ToJsonOrDie(const Everything& message) {
+  std::string json;
+  EXPECT_TRUE(ToJson(message, json));
+  return json;
+}
+
+TEST(JsonTest, SerializesDefaultMessage) {
+  EXPECT_EQ(
+      R"({"flag":false,"small":0,"big":"0","ubig":"0","zigzag":0,"fixed":"0",)"
+      R"("ratio":0,"precise":0,"color":1,"text":"","children":[],"numbers":[],)"
+      R"("counts":{},"byId":{},"17":0})",
+      ToJsonOrDie(Everything{}));
+}
+
+TEST(JsonTest, SerializesAllTypes) {
+  Everything message;
+  message.flag = true;
+  message.small = -42;
+  message.big = std::numeric_limits<int64_t>::min();
+  message.ubig = std::numeric_limits<uint64_t>::max();
+  message.zigzag = -7;
+  message.fixed = 123;
+  message.ratio = 0.1f;
+  message.precise = 1e100;
+  message.color = Color::kGreen;
+  message.text = "a\"b\\c\n\x01\xc3\xa9";
+  message.maybe = 5;
+  message.child = std::make_unique<Inner>(Inner{1, "one"});
+  message.children = {Inner{2, "two"}, Inner{}};
+  message.numbers = {1, -1};
+  message.counts = {{"k", 3}};
+  message.by_id = {{-9, Inner{9, ""}}};
+  message.unnamed = 17;
+  EXPECT_EQ(
+      R"({"flag":true,"small":-42,"big":"-9223372036854775808",)"
+      R"("ubig":"18446744073709551615","zigzag":-7,"fixed":"123",)"
+      R"("ratio":0.1,"precise":1e+100,"color":2,)"
+      R"("text":"a\"b\\c\n\u0001)"
+      "\xc3\xa9"
+      R"(","maybe":5,"child":{"x":1,"label":"one"},)"
+      R"("children":[{"x":2,"label":"two"},{"x":0,"label":""}],)"
+      R"("numbers":[1,-1],"counts":{"k":3},)"
+      R"("byId":{"-9":{"x":9,"label":""}},"17":17})",
+      ToJsonOrDie(message));
+}
+
+TEST(JsonTest, SerializesNonFiniteFloats) {
+  Everything message;
+  message.ratio = std::numeric_limits<float>::infinity();
+  message.precise = std::numeric_limits<double>::quiet_NaN();
+  const std::string json = ToJsonOrDie(message);
+  EXPECT_NE(std::string::npos, json.find(R"("ratio":"Infinity")"));
+  EXPECT_NE(std::string::npos, json.find(R"("precise":"NaN")"));
+
+  Everything parsed;
+  ASSERT_TRUE(FromJson(json, parsed));
+  EXPECT_TRUE(std::isinf(parsed.ratio) && parsed.ratio > 0);
+  EXPECT_TRUE(std::isnan(parsed.precise));
+}
+
+TEST(JsonTest, FailsOnInvalidUtf8) {
+  Everything message;
+  message.text = "ok\xff";
+  std::string json;
+  EXPECT_FALSE(ToJson(message, json));
+}
+
+TEST(JsonTest, RoundTrips) {
+  Everything message;
+  message.flag = true;
+  message.big = -1234567890123;
+  message.ubig = 1ull << 63;
+  message.zigzag = std::numeric_limits<int32_t>::min();
+  message.fixed = std::numeric_limits<uint64_t>::max();
+  message.ratio = 3.14159f;
+  message.precise = 2.718281828459045;
+  message.text = "tab\there \xf0\x9f\x98\x80 \x1f";
+  message.child = std::make_unique<Inner>(Inner{7, "seven"});
+  message.children = {Inner{8, "eight"}};
+  message.numbers = {0, 1, std::numeric_limits<int32_t>::max()};
+  message.counts = {{"", 0}, {"b", 2}};
+  message.by_id = {{1, Inner{}}, {2, Inner{3, "x"}}};
+  message.unnamed = -1;
+
+  const std::string json = ToJsonOrDie(message);
+  Everything parsed;
+  ASSERT_TRUE(FromJson(json, parsed)) << json;
+  EXPECT_EQ(json, ToJsonOrDie(parsed));
+  EXPECT_EQ(message.ratio, parsed.ratio);
+  EXPECT_EQ(message.precise, parsed.precise);
+  EXPECT_EQ(message.text, parsed.text);
+}
+
+TEST(JsonTest, ParsesFlexibleInput) {
+  Everything parsed;
+  ASSERT_TRUE(FromJson(
+      " {\n"
+      R"(  "unknown": [1, {"a": null}, "é", true],)"
+      R"(  "big": 12, "ubig": "34", "ratio": "1.5", "precise": 2e-3,)"
+      R"(  "text": "é😀\/", "17" : 4,)"
+      R"(  "maybe": null, "child": null, "numbers": [5], "numbers": [6])"
+      "} \t",
+      parsed));
+  EXPECT_EQ(12, parsed.big);
+  EXPECT_EQ(34u, parsed.ubig);
+  EXPECT_EQ(1.5f, parsed.ratio);
+  EXPECT_EQ(2e-3, parsed.precise);
+  EXPECT_EQ("\xc3\xa9\xf0\x9f\x98\x80/", parsed.text);
+  EXPECT_EQ(4, parsed.unnamed);
+  EXPECT_FALSE(parsed.maybe);
+  EXPECT_FALSE(parsed.child);
+  EXPECT_EQ((std::vector<int32_t>{5, 6}), parsed.numbers);
+
+  // Merging: null resets optional fields.
+  parsed.maybe = 1;
+  ASSERT_TRUE(FromJson(R"({"maybe":null,"small":3})", parsed));
+  EXPECT_FALSE(parsed.maybe);
+  EXPECT_EQ(3, parsed.small);
+  EXPECT_EQ(12, parsed.big);
+
+  // But null leaves the other fields as they were.
+  ASSERT_TRUE(FromJson(R"({"small":null,"text":null,"numbers":null})",
+                       parsed));
+  EXPECT_EQ(3, parsed.small);
+  EXPECT_EQ("\xc3\xa9\xf0\x9f\x98\x80/", parsed.text);
+  EXPECT_EQ((std::vector<int32_t>{5, 6}), parsed.numbers);
+
+  // Values too tiny to be represented are rounded to zero.
+  ASSERT_TRUE(FromJson(R"({"precise":-1e-999,"ratio":0.00000000001e-40})",
+                       parsed));
+  EXPECT_EQ(0.0, parsed.precise);
+  EXPECT_TRUE(std::signbit(parsed.precise));
+  EXPECT_EQ(0.0f, parsed.ratio);
+}
+
+TEST(JsonTest, RejectsMalformedInput) {
+  for (const std::string_view json : {
+           "",
+           "[]",
+           "{",
+           R"({"small":1,})",
+           R"({"small":1} x)",
+           R"({"small":1.5})",
+           R"({"small":3000000000})",
+           R"({"small":01})",
+           R"({"flag":1})",
+           R"({"text":"unterminated})",
+           "{\"text\":\"control\x01\"}",
+           "{\"text\":\"bad \xff\"}",
+           R"({"text":"\ud83d"})",
+           R"({"text":"\x"})",
+           R"({"numbers":{}})",
+           R"({"counts":{"k":"v"}})",
+           R"({"byId":{"notanumber":{}}})",
+           R"({"unknown":[1,]})",
+           R"({"ratio":1e999})",
+       }) {
+    Everything parsed;
+    EXPECT_FALSE(FromJson(json, parsed)) << json;
+  }
+}
+
+TEST(JsonTest, EnforcesNestingLimit) {
+  std::string deep;
+  for (int i = 0; i < 200; ++i) {
+    deep += R"({"child":)";
+  }
+  Everything parsed;
+  EXPECT_FALSE(FromJson(deep, parsed));
+
+  std::string deep_unknown = R"({"unknown":)";
+  for (int i = 0; i < 200; ++i) {
+    deep_unknown += '[';
+  }
+  EXPECT_FALSE(FromJson(deep_unknown, parsed));
+}
+
+struct Views {
+  std::string_view name;
+
+  static constexpr char kNameName[] = "name";
+  using ProtobufFields = FieldList<Field<&Views::name, 1, kNameName>>;
+};
+
+TEST(JsonTest, ParsesStringViewsWithoutCopying) {
+  const std::string json = R"({"name":"caf)"
+                           "\xc3\xa9"
+                           R"("})";
+  Views parsed;
+  ASSERT_TRUE(FromJson(json, parsed));
+  EXPECT_EQ("caf\xc3\xa9", parsed.name);
+  EXPECT_EQ(json.data() + 9, parsed.name.data());
+
+  // Escapes cannot be represented in a view of the input.
+  EXPECT_FALSE(FromJson(R"({"name":"a\nb"})", parsed));
+
+  // Unset string_views are omitted.
+  std::string output;
+  ASSERT_TRUE(ToJson(Views{}, output));
+  EXPECT_EQ("{}", output);
+}
+
+TEST(JsonTest, ReusesOutputCapacity) {
+  Everything message;
+  message.text = std::string(1000, 'z');
+  std::string json;
+  ASSERT_TRUE(ToJson(message, json));
+  const char* const data = json.data();
+  message.text = "short";
+  ASSERT_TRUE(ToJson(message, json));
+  EXPECT_EQ(data, json.data());
+  EXPECT_EQ(std::string::npos, json.find("zzz"));
+}
+
+}  // namespace
+}  // namespace pb
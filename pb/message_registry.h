@@ -0,0 +1,367 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+
+// Associates a |Message| type with the |kTypeId| that identifies it in a
+// multiplexed stream, for use in a MessageTypeList (see MessageRegistry below).
+template <typename TheMessage, uint32_t kTheTypeId>
+struct MessageType {
+  using Message = TheMessage;
+  static constexpr uint32_t kTypeId = kTheTypeId;
+};
+
+// A compile-time list of MessageTypes.
+template <typename... MessageTypes>
+struct MessageTypeList {};
+
+// The table of type-erased functions for one message type. All |message|
+// arguments must point to an instance of the message type described by this
+// table.
+struct MessageTypeInfo {
+  uint32_t type_id;
+
+  // Unique for each C++ message type. Used by MessageRegistry::Handle::As().
+  const void* type_tag;
+
+  // See pb::ComputeSerializedSize(), pb::Serialize() and pb::MergeFromBuffer().
+  int32_t (*compute_serialized_size)(const void* message);
+  void (*serialize)(const void* message, uint8_t* buffer);
+  bool (*merge_from_buffer)(const uint8_t* begin,
+                            const uint8_t* end,
+                            void* message);
+
+  // Heap-allocates a new default-constructed message, resets an existing one to
+  // its default-constructed state (keeping the capacity of its strings and
+  // containers, if the message is copy-assignable), or deletes one.
+  void* (*create)();
+  void (*reset)(void* message);
+  void (*destroy)(void* message);
+};
+
+namespace internal {
+
+template <typename Message>
+inline constexpr char kMessageTypeTag = 0;
+
+template <typename Message>
+int32_t ComputeSerializedSizeThunk(const void* message) {
+  return ComputeSerializedSize(*static_cast<const Message*>(message));
+}
+
+template <typename Message>
+void SerializeThunk(const void* message, uint8_t* buffer) {
+  Serialize(*static_cast<const Message*>(message), buffer);
+}
+
+template <typename Message>
+bool MergeFromBufferThunk(const uint8_t* begin,
+                          const uint8_t* end,
+                          void* message) {
+  return MergeFromBuffer(begin, end, *static_cast<Message*>(message));
+}
+
+template <typename Message>
+void* CreateThunk() {
+  return new Message();
+}
+
+// Copy-assigning from a default instance, rather than move-assigning a new
+// one, reuses the buffers of the strings and containers held directly by the
+// |message| (e.g., a std::string is only re-allocated if it must grow).
+template <typename Message>
+void ResetThunk(void* message) {
+  if constexpr (std::is_copy_assignable_v<Message>) {
+    static const Message kDefault{};
+    *static_cast<Message*>(message) = kDefault;
+  } else {
+    *static_cast<Message*>(message) = Message();
+  }
+}
+
+template <typename Message>
+void DestroyThunk(void* message) {
+  delete static_cast<Message*>(message);
+}
+
+template <typename TheMessageType>
+constexpr MessageTypeInfo MakeMessageTypeInfo() {
+  using Message = typename TheMessageType::Message;
+  return MessageTypeInfo{
+      TheMessageType::kTypeId,
+      &kMessageTypeTag<Message>,
+      &ComputeSerializedSizeThunk<Message>,
+      &SerializeThunk<Message>,
+      &MergeFromBufferThunk<Message>,
+      &CreateThunk<Message>,
+      &ResetThunk<Message>,
+      &DestroyThunk<Message>,
+  };
+}
+
+// Returns the MessageTypeInfos for all |MessageTypes|, sorted by type id.
+template <typename... MessageTypes>
+constexpr std::array<MessageTypeInfo, sizeof...(MessageTypes)>
+MakeSortedMessageTypeTable() {
+  std::array<MessageTypeInfo, sizeof...(MessageTypes)> table{
+      MakeMessageTypeInfo<MessageTypes>()...};
+  // Insertion sort (std::sort() is not constexpr before C++20).
+  for (std::size_t i = 1; i < table.size(); ++i) {
+    for (std::size_t j = i; j > 0 && table[j - 1].type_id > table[j].type_id;
+         --j) {
+      const MessageTypeInfo temp = table[j];
+      table[j] = table[j - 1];
+      table[j - 1] = temp;
+    }
+  }
+  return table;
+}
+
+template <std::size_t kSize>
+constexpr bool AreTypeIdsUnique(
+    const std::array<MessageTypeInfo, kSize>& sorted_table) {
+  for (std::size_t i = 1; i < kSize; ++i) {
+    if (sorted_table[i - 1].type_id == sorted_table[i].type_id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename... MessageTypes>
+inline constexpr auto kSortedMessageTypeTable =
+    MakeSortedMessageTypeTable<MessageTypes...>();
+
+}  // namespace internal
+
+// Maps type ids to the functions that size, serialize, and parse each message
+// type, and maintains a pool of recycled message instances for each. This
+// allows a router for a multiplexed stream to parse and dispatch messages by
+// type id through a single indirect call, instead of switching on the type id
+// (and instantiating every codec inline) at each call site. Example:
+//
+//   using MyProtocol = pb::MessageTypeList<pb::MessageType<Ping, 1>,
+//                                          pb::MessageType<Pong, 2>,
+//                                          pb::MessageType<Chat, 7>>;
+//   pb::MessageRegistry registry(MyProtocol{});
+//
+//   void OnFrame(uint32_t type_id, const uint8_t* begin, const uint8_t* end) {
+//     pb::MessageRegistry::Handle message =
+//         registry.ParseNew(type_id, begin, end);
+//     if (!message) {
+//       return;  // Unknown type id, or the parse failed.
+//     }
+//     if (Chat* chat = message.As<Chat>()) {
+//       ...
+//     }
+//   }  // |message| is returned to the pool here.
+//
+// The table of functions is built at compile time from the list of message
+// types. The type ids must be unique (this is checked at compile time), but
+// need not be contiguous.
+//
+// A recycled instance keeps the buffers of its strings and containers, and so
+// parsing into it allocates only where a field outgrows the one before (for
+// a copy-assignable message; see MessageTypeInfo::reset). The buffers of the
+// elements of a repeated field are not kept.
+//
+// A MessageRegistry is not thread-safe, since its pools are not. Use one per
+// thread (or per connection).
+class MessageRegistry {
+ public:
+  // Owns a message instance acquired from a MessageRegistry, and returns it to
+  // the registry's pool when destroyed. A Handle must not outlive the registry.
+  class Handle {
+   public:
+    Handle() = default;
+    Handle(Handle&& other) noexcept
+        : registry_(std::exchange(other.registry_, nullptr)),
+          info_(std::exchange(other.info_, nullptr)),
+          message_(std::exchange(other.message_, nullptr)) {}
+    Handle& operator=(Handle&& other) noexcept {
+      if (this != &other) {
+        reset();
+        registry_ = std::exchange(other.registry_, nullptr);
+        info_ = std::exchange(other.info_, nullptr);
+        message_ = std::exchange(other.message_, nullptr);
+      }
+      return *this;
+    }
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    ~Handle() { reset(); }
+
+    [[nodiscard]] explicit operator bool() const { return !!message_; }
+
+    // The type information for the message. Must only be called on a non-null
+    // Handle.
+    [[nodiscard]] const MessageTypeInfo& type_info() const {
+      assert(info_);
+      return *info_;
+    }
+    [[nodiscard]] uint32_t type_id() const { return type_info().type_id; }
+
+    // Returns a pointer to the message if it is of type |Message|, or nullptr
+    // otherwise.
+    template <typename Message>
+    [[nodiscard]] Message* As() const {
+      if (info_ && info_->type_tag == &internal::kMessageTypeTag<Message>) {
+        return static_cast<Message*>(message_);
+      }
+      return nullptr;
+    }
+
+    // Type-erased versions of the functions in pb/serialize.h and pb/parse.h.
+    [[nodiscard]] int32_t ComputeSerializedSize() const {
+      return type_info().compute_serialized_size(message_);
+    }
+    void Serialize(uint8_t* buffer) const {
+      type_info().serialize(message_, buffer);
+    }
+    [[nodiscard]] bool MergeFromBuffer(const uint8_t* begin,
+                                       const uint8_t* end) {
+      return type_info().merge_from_buffer(begin, end, message_);
+    }
+
+    // Returns the message to the registry's pool now, making this Handle null.
+    void reset() {
+      if (message_) {
+        registry_->Recycle(*info_, std::exchange(message_, nullptr));
+        registry_ = nullptr;
+        info_ = nullptr;
+      }
+    }
+
+   private:
+    friend class MessageRegistry;
+
+    Handle(MessageRegistry* registry, const MessageTypeInfo* info,
+           void* message)
+        : registry_(registry), info_(info), message_(message) {}
+
+    MessageRegistry* registry_ = nullptr;
+    const MessageTypeInfo* info_ = nullptr;
+    void* message_ = nullptr;
+  };
+
+  // The default maximum number of idle instances of each message type kept in
+  // the pool. Beyond this, recycled instances are deleted.
+  static constexpr std::size_t kDefaultMaxPooledPerType = 64;
+
+  template <typename... MessageTypes>
+  explicit MessageRegistry(
+      MessageTypeList<MessageTypes...>,
+      std::size_t max_pooled_per_type = kDefaultMaxPooledPerType)
+      : table_(internal::kSortedMessageTypeTable<MessageTypes...>.data()),
+        table_size_(sizeof...(MessageTypes)),
+        free_lists_(sizeof...(MessageTypes)),
+        max_pooled_per_type_(max_pooled_per_type) {
+    static_assert(internal::AreTypeIdsUnique(
+                      internal::kSortedMessageTypeTable<MessageTypes...>),
+                  "Each MessageType in the list must have a unique type id.");
+  }
+
+  MessageRegistry(const MessageRegistry&) = delete;
+  MessageRegistry& operator=(const MessageRegistry&) = delete;
+
+  ~MessageRegistry() {
+    for (std::size_t i = 0; i < table_size_; ++i) {
+      for (void* message : free_lists_[i]) {
+        table_[i].destroy(message);
+      }
+    }
+  }
+
+  // Returns the type information for the given |type_id|, or nullptr if the
+  // |type_id| is not registered.
+  [[nodiscard]] const MessageTypeInfo* Find(uint32_t type_id) const {
+    std::size_t begin = 0;
+    std::size_t end = table_size_;
+    while (begin < end) {
+      const std::size_t middle = begin + (end - begin) / 2;
+      if (table_[middle].type_id < type_id) {
+        begin = middle + 1;
+      } else {
+        end = middle;
+      }
+    }
+    return (begin < table_size_ && table_[begin].type_id == type_id)
+               ? &table_[begin]
+               : nullptr;
+  }
+
+  // Returns a default-constructed message of the type with the given
+  // |type_id|, taken from the pool if possible. Returns a null Handle if the
+  // |type_id| is not registered.
+  [[nodiscard]] Handle New(uint32_t type_id) {
+    const MessageTypeInfo* const info = Find(type_id);
+    if (!info) {
+      return Handle();
+    }
+    std::vector<void*>& free_list = free_lists_[IndexOf(*info)];
+    void* message;
+    if (free_list.empty()) {
+      message = info->create();
+    } else {
+      message = free_list.back();
+      free_list.pop_back();
+    }
+    return Handle(this, info, message);
+  }
+
+  // Like New(), but also parses the message from the wire-format bytes in the
+  // range |begin| to |end|. Returns a null Handle if the |type_id| is not
+  // registered, or if the parse fails.
+  [[nodiscard]] Handle ParseNew(uint32_t type_id,
+                                const uint8_t* begin,
+                                const uint8_t* end) {
+    Handle message = New(type_id);
+    if (message && !message.MergeFromBuffer(begin, end)) {
+      message.reset();
+    }
+    return message;
+  }
+
+  // Returns the number of idle message instances of the type with the given
+  // |type_id| that are in the pool.
+  [[nodiscard]] std::size_t GetPooledCount(uint32_t type_id) const {
+    const MessageTypeInfo* const info = Find(type_id);
+    return info ? free_lists_[IndexOf(*info)].size() : 0;
+  }
+
+ private:
+  [[nodiscard]] std::size_t IndexOf(const MessageTypeInfo& info) const {
+    return static_cast<std::size_t>(&info - table_);
+  }
+
+  void Recycle(const MessageTypeInfo& info, void* message) {
+    std::vector<void*>& free_list = free_lists_[IndexOf(info)];
+    if (free_list.size() < max_pooled_per_type_) {
+      info.reset(message);
+      free_list.push_back(message);
+    } else {
+      info.destroy(message);
+    }
+  }
+
+  const MessageTypeInfo* const table_;
+  const std::size_t table_size_;
+  std::vector<std::vector<void*>> free_lists_;  // Indexed like |table_|.
+  const std::size_t max_pooled_per_type_;
+};
+
+}  // namespace pb
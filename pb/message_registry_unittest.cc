@@ -0,0 +1,151 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/message_registry.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Ping {
+  uint64_t sequence = 0;
+
+  using ProtobufFields = FieldList<Field<&Ping::sequence, 1>>;
+};
+
+struct Chat {
+  std::string from;
+  std::vector<std::string> lines;
+
+  using ProtobufFields =
+      FieldList<Field<&Chat::from, 1>, Field<&Chat::lines, 2>>;
+};
+
+struct Unregistered {
+  using ProtobufFields = FieldList<>;
+};
+
+// Deliberately not in type id order.
+using TestProtocol = MessageTypeList<MessageType<Chat, 70>,
+                                     MessageType<Ping, 3>,
+                                     MessageType<Chat, 12>>;
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  std::vector<uint8_t> result(
+      static_cast<std::size_t>(ComputeSerializedSize(message)));
+  Serialize(message, result.data());
+  return result;
+}
+
+TEST(MessageRegistryTest, FindsTypeInfoById) {
+  const MessageRegistry registry(TestProtocol{});
+  for (uint32_t type_id : {3u, 12u, 70u}) {
+    const MessageTypeInfo* const info = registry.Find(type_id);
+    ASSERT_TRUE(info);
+    EXPECT_EQ(type_id, info->type_id);
+  }
+  for (uint32_t type_id : {0u, 4u, 11u, 13u, 69u, 71u, 0xffffffffu}) {
+    EXPECT_FALSE(registry.Find(type_id));
+  }
+  EXPECT_EQ(registry.Find(12)->type_tag, registry.Find(70)->type_tag);
+  EXPECT_NE(registry.Find(3)->type_tag, registry.Find(12)->type_tag);
+}
+
+TEST(MessageRegistryTest, ParsesAndSerializesById) {
+  MessageRegistry registry(TestProtocol{});
+  const std::vector<uint8_t> wire_bytes =
+      SerializeToVector(Chat{"alice", {"hi", "bye"}});
+
+  MessageRegistry::Handle message = registry.ParseNew(
+      12, wire_bytes.data(), wire_bytes.data() + wire_bytes.size());
+  ASSERT_TRUE(message);
+  EXPECT_EQ(12u, message.type_id());
+  EXPECT_FALSE(message.As<Ping>());
+  EXPECT_FALSE(message.As<Unregistered>());
+  Chat* const chat = message.As<Chat>();
+  ASSERT_TRUE(chat);
+  EXPECT_EQ("alice", chat->from);
+  EXPECT_EQ((std::vector<std::string>{"hi", "bye"}), chat->lines);
+
+  ASSERT_EQ(static_cast<int32_t>(wire_bytes.size()),
+            message.ComputeSerializedSize());
+  std::vector<uint8_t> reserialized(wire_bytes.size());
+  message.Serialize(reserialized.data());
+  EXPECT_EQ(wire_bytes, reserialized);
+
+  // Unknown type ids and parse failures produce null handles.
+  EXPECT_FALSE(registry.ParseNew(5, wire_bytes.data(),
+                                 wire_bytes.data() + wire_bytes.size()));
+  EXPECT_FALSE(registry.ParseNew(12, wire_bytes.data(),
+                                 wire_bytes.data() + wire_bytes.size() - 1));
+  EXPECT_FALSE(registry.New(5));
+}
+
+TEST(MessageRegistryTest, RecyclesResetInstances) {
+  MessageRegistry registry(TestProtocol{}, 1);
+  EXPECT_EQ(0u, registry.GetPooledCount(3));
+
+  MessageRegistry::Handle first = registry.New(3);
+  MessageRegistry::Handle second = registry.New(3);
+  ASSERT_TRUE(first && second);
+  first.As<Ping>()->sequence = 42;
+  Ping* const first_instance = first.As<Ping>();
+
+  // Only one instance is kept in the pool; the other is deleted.
+  first.reset();
+  EXPECT_FALSE(first);
+  EXPECT_EQ(1u, registry.GetPooledCount(3));
+  second = MessageRegistry::Handle();
+  EXPECT_EQ(1u, registry.GetPooledCount(3));
+  EXPECT_EQ(0u, registry.GetPooledCount(12));
+
+  // The pooled instance is re-used, and was reset to its default state.
+  MessageRegistry::Handle reused = registry.New(3);
+  EXPECT_EQ(0u, registry.GetPooledCount(3));
+  ASSERT_EQ(first_instance, reused.As<Ping>());
+  EXPECT_EQ(0u, reused.As<Ping>()->sequence);
+
+  // Moving a Handle transfers ownership; the instance is recycled only once.
+  MessageRegistry::Handle moved = std::move(reused);
+  EXPECT_FALSE(reused);
+  EXPECT_EQ(first_instance, moved.As<Ping>());
+  moved.reset();
+  EXPECT_EQ(1u, registry.GetPooledCount(3));
+
+  // Pools are per type.
+  MessageRegistry::Handle chat = registry.New(70);
+  EXPECT_TRUE(chat.As<Chat>());
+  EXPECT_EQ(1u, registry.GetPooledCount(3));
+}
+
+TEST(MessageRegistryTest, ResetKeepsTheCapacityOfStringsAndContainers) {
+  MessageRegistry registry(TestProtocol{});
+  MessageRegistry::Handle message = registry.New(12);
+  Chat* const chat = message.As<Chat>();
+  ASSERT_TRUE(chat);
+  chat->from.assign(1000, 'x');
+  chat->lines.assign(100, "line");
+  const std::size_t from_capacity = chat->from.capacity();
+  const std::size_t lines_capacity = chat->lines.capacity();
+  message.reset();
+
+  MessageRegistry::Handle reused = registry.New(12);
+  ASSERT_EQ(chat, reused.As<Chat>());
+  EXPECT_TRUE(chat->from.empty());
+  EXPECT_TRUE(chat->lines.empty());
+  EXPECT_EQ(from_capacity, chat->from.capacity());
+  EXPECT_EQ(lines_capacity, chat->lines.capacity());
+}
+
+}  // namespace
+}  // namespace pb
@@ -0,0 +1,223 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+
+#include "pb/codec/endian.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb {
+
+// A read-only view of the elements of a packed repeated double, float,
+// (s)fixed32 or (s)fixed64 field, pointing directly into the wire-format bytes.
+// This is the repeated-field analogue of std::string_view: Parsing a field
+// bound to a PackedFixedView member only records where the packed payload is in
+// the input buffer, regardless of how many elements it contains. Each element
+// is decoded (an unaligned little-endian load) only when it is accessed.
+//
+// The same memory-management dangers described for std::string_view members
+// apply here (see README.md): The input buffer must outlive the view. In
+// addition:
+//
+//   1. If a packed payload for the field appears more than once in the wire
+//      bytes, the view will only reference the last one (i.e., the elements of
+//      the earlier ones are NOT merged-in).
+//   2. Since elements encoded using the unpacked representation cannot be
+//      referenced in-place, encountering them fails the parse.
+//
+// When serializing, the payload bytes are copied to the output as-is.
+template <typename T>
+class PackedFixedView {
+ public:
+  static_assert(std::is_same_v<T, double> || std::is_same_v<T, float> ||
+                    std::is_same_v<T, ::pb::fixed64_t> ||
+                    std::is_same_v<T, ::pb::sfixed64_t> ||
+                    std::is_same_v<T, ::pb::fixed32_t> ||
+                    std::is_same_v<T, ::pb::sfixed32_t>,
+                "PackedFixedView only supports fixed-size element types.");
+  static_assert(sizeof(T) == 4 || sizeof(T) == 8);
+
+  using value_type = T;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+
+  // Random-access iterator over the elements. Dereferencing produces a value,
+  // not a reference, since the elements are decoded on-the-fly.
+  class const_iterator {
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = T;
+
+    constexpr const_iterator() = default;
+
+    T operator*() const { return LoadElement(position_); }
+    T operator[](difference_type n) const {
+      return LoadElement(position_ + n * kElementSize);
+    }
+
+    const_iterator& operator++() {
+      position_ += kElementSize;
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator result = *this;
+      ++*this;
+      return result;
+    }
+    const_iterator& operator--() {
+      position_ -= kElementSize;
+      return *this;
+    }
+    const_iterator operator--(int) {
+      const_iterator result = *this;
+      --*this;
+      return result;
+    }
+    const_iterator& operator+=(difference_type n) {
+      position_ += n * kElementSize;
+      return *this;
+    }
+    const_iterator& operator-=(difference_type n) {
+      position_ -= n * kElementSize;
+      return *this;
+    }
+    friend const_iterator operator+(const_iterator it, difference_type n) {
+      return it += n;
+    }
+    friend const_iterator operator+(difference_type n, const_iterator it) {
+      return it += n;
+    }
+    friend const_iterator operator-(const_iterator it, difference_type n) {
+      return it -= n;
+    }
+    friend difference_type operator-(const_iterator a, const_iterator b) {
+      return (a.position_ - b.position_) / kElementSize;
+    }
+
+    friend bool operator==(const_iterator a, const_iterator b) {
+      return a.position_ == b.position_;
+    }
+    friend bool operator!=(const_iterator a, const_iterator b) {
+      return a.position_ != b.position_;
+    }
+    friend bool operator<(const_iterator a, const_iterator b) {
+      return a.position_ < b.position_;
+    }
+    friend bool operator>(const_iterator a, const_iterator b) {
+      return a.position_ > b.position_;
+    }
+    friend bool operator<=(const_iterator a, const_iterator b) {
+      return a.position_ <= b.position_;
+    }
+    friend bool operator>=(const_iterator a, const_iterator b) {
+      return a.position_ >= b.position_;
+    }
+
+   private:
+    friend class PackedFixedView;
+
+    explicit constexpr const_iterator(const uint8_t* position)
+        : position_(position) {}
+
+    const uint8_t* position_ = nullptr;
+  };
+  using iterator = const_iterator;
+
+  // Constructs a null view (no elements).
+  constexpr PackedFixedView() = default;
+
+  // Constructs a view of the |size| elements encoded in the wire-format bytes
+  // starting at |bytes|.
+  constexpr PackedFixedView(const uint8_t* bytes, size_type size)
+      : bytes_(bytes), size_(size) {}
+
+  // The number of bytes taken up by each element on the wire.
+  static constexpr difference_type kElementSize = sizeof(T);
+
+  [[nodiscard]] constexpr size_type size() const { return size_; }
+  [[nodiscard]] constexpr bool empty() const { return size_ == 0; }
+
+  // Returns the wire-format bytes being viewed, and their count.
+  [[nodiscard]] constexpr const uint8_t* bytes() const { return bytes_; }
+  [[nodiscard]] constexpr size_type size_in_bytes() const {
+    return size_ * kElementSize;
+  }
+
+  [[nodiscard]] T operator[](size_type index) const {
+    return LoadElement(bytes_ + index * kElementSize);
+  }
+  [[nodiscard]] T front() const { return (*this)[0]; }
+  [[nodiscard]] T back() const { return (*this)[size_ - 1]; }
+
+  [[nodiscard]] const_iterator begin() const { return const_iterator(bytes_); }
+  [[nodiscard]] const_iterator end() const {
+    return const_iterator(bytes_ + size_in_bytes());
+  }
+
+  // Fast path: Returns a pointer to the elements as a native T array, if the
+  // wire-format bytes can be reinterpreted as such in-place. That is the case
+  // on little-endian platforms when the payload happens to be suitably aligned
+  // in memory. Otherwise, returns nullptr, and the elements must be accessed
+  // through operator[] or the iterators.
+  //
+  // Example:
+  //
+  //   double sum = 0.0;
+  //   if (const double* values = view.aligned_data()) {
+  //     for (std::size_t i = 0; i < view.size(); ++i) {
+  //       sum += values[i];  // Compiler can vectorize this loop.
+  //     }
+  //   } else {
+  //     for (double value : view) {
+  //       sum += value;
+  //     }
+  //   }
+  [[nodiscard]] const T* aligned_data() const {
+    if (!codec::IsLittleEndianArchitecture() ||
+        (reinterpret_cast<uintptr_t>(bytes_) % alignof(T)) != 0) {
+      return nullptr;
+    }
+    return reinterpret_cast<const T*>(bytes_);
+  }
+
+ private:
+  using Bits = std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t>;
+
+  static T LoadElement(const uint8_t* position) {
+    // Implementation note: On little-endian architectures, the compiler will
+    // optimize all of the following to a simple (unaligned) load instruction.
+    Bits bits;
+    std::memcpy(&bits, position, sizeof(Bits));
+    if (!codec::IsLittleEndianArchitecture()) {
+      if constexpr (sizeof(Bits) == 8) {
+        bits = codec::ReverseBytes64(bits);
+      } else {
+        bits = codec::ReverseBytes32(bits);
+      }
+    }
+    if constexpr (std::is_floating_point_v<T>) {
+      static_assert(std::numeric_limits<T>::is_iec559);
+      T result;
+      std::memcpy(&result, &bits, sizeof(Bits));
+      return result;
+    } else {
+      return T(static_cast<decltype(T{}.value())>(bits));
+    }
+  }
+
+  const uint8_t* bytes_ = nullptr;
+  size_type size_ = 0;
+};
+
+}  // namespace pb
@@ -0,0 +1,167 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/packed_fixed_view.h"
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+TEST(PackedFixedViewTest, DecodesElementsInPlace) {
+  const uint8_t kBytes[] = {0x01, 0x00, 0x00, 0x00, 0xfe, 0xff, 0xff, 0xff,
+                            0x00, 0x00, 0x80, 0x3f};
+
+  const PackedFixedView<fixed32_t> unsigned_view(kBytes, 3);
+  EXPECT_EQ(3u, unsigned_view.size());
+  EXPECT_EQ(12u, unsigned_view.size_in_bytes());
+  EXPECT_EQ(1u, unsigned_view[0].value());
+  EXPECT_EQ(0xfffffffeu, unsigned_view[1].value());
+  EXPECT_EQ(0x3f800000u, unsigned_view.back().value());
+
+  const PackedFixedView<sfixed32_t> signed_view(kBytes, 2);
+  EXPECT_EQ(1, signed_view.front().value());
+  EXPECT_EQ(-2, signed_view[1].value());
+
+  const PackedFixedView<float> float_view(kBytes + 8, 1);
+  EXPECT_EQ(1.0f, float_view[0]);
+
+  // Iteration from a deliberately-unaligned start position.
+  const PackedFixedView<float> unaligned_view(kBytes + 1, 2);
+  std::vector<float> copied(unaligned_view.begin(), unaligned_view.end());
+  ASSERT_EQ(2u, copied.size());
+  EXPECT_EQ(unaligned_view[0], copied[0]);
+  EXPECT_EQ(unaligned_view[1], copied[1]);
+  EXPECT_EQ(2, std::distance(unaligned_view.begin(), unaligned_view.end()));
+  EXPECT_EQ(unaligned_view[1], *(unaligned_view.end() - 1));
+
+  EXPECT_TRUE(PackedFixedView<double>().empty());
+  EXPECT_EQ(PackedFixedView<double>().begin(), PackedFixedView<double>().end());
+}
+
+TEST(PackedFixedViewTest, ProvidesAlignedDataOnlyWhenAligned) {
+  alignas(double) const uint8_t kBytes[24] = {};
+  const PackedFixedView<double> aligned_view(kBytes, 2);
+  const PackedFixedView<double> unaligned_view(kBytes + 4, 2);
+  if (codec::IsLittleEndianArchitecture()) {
+    EXPECT_EQ(reinterpret_cast<const double*>(kBytes),
+              aligned_view.aligned_data());
+  } else {
+    EXPECT_EQ(nullptr, aligned_view.aligned_data());
+  }
+  EXPECT_EQ(nullptr, unaligned_view.aligned_data());
+}
+
+struct Samples {
+  int32_t id;
+  PackedFixedView<double> values;
+  PackedFixedView<sfixed64_t> timestamps;
+
+  using ProtobufFields = FieldList<Field<&Samples::id, 1>,
+                                   Field<&Samples::values, 2>,
+                                   Field<&Samples::timestamps, 3>>;
+};
+
+struct SamplesCopy {
+  int32_t id;
+  std::vector<double> values;
+  std::vector<sfixed64_t> timestamps;
+
+  using ProtobufFields = FieldList<Field<&SamplesCopy::id, 1>,
+                                   Field<&SamplesCopy::values, 2>,
+                                   Field<&SamplesCopy::timestamps, 3>>;
+};
+
+template <typename Message>
+std::basic_string<uint8_t> SerializeToString(const Message& message) {
+  std::basic_string<uint8_t> result(
+      static_cast<std::size_t>(ComputeSerializedSize(message)), uint8_t{0});
+  Serialize(message, result.data());
+  return result;
+}
+
+TEST(PackedFixedViewTest, ParsesAndSerializesLikeAVector) {
+  SamplesCopy original{42, {1.5, -2.25, 1e100}, {-1, 1234567890123}};
+  const auto wire_bytes = SerializeToString(original);
+
+  Samples viewed{};
+  ASSERT_TRUE(MergeFromBuffer(wire_bytes.data(),
+                              wire_bytes.data() + wire_bytes.size(), viewed));
+  EXPECT_EQ(42, viewed.id);
+  ASSERT_EQ(original.values.size(), viewed.values.size());
+  for (std::size_t i = 0; i < original.values.size(); ++i) {
+    EXPECT_EQ(original.values[i], viewed.values[i]);
+  }
+  ASSERT_EQ(original.timestamps.size(), viewed.timestamps.size());
+  for (std::size_t i = 0; i < original.timestamps.size(); ++i) {
+    EXPECT_EQ(original.timestamps[i].value(), viewed.timestamps[i].value());
+  }
+  // The view points into the input, rather than at a copy.
+  EXPECT_LE(wire_bytes.data(), viewed.values.bytes());
+  EXPECT_GT(wire_bytes.data() + wire_bytes.size(), viewed.values.bytes());
+
+  EXPECT_EQ(ComputeSerializedSize(original), ComputeSerializedSize(viewed));
+  EXPECT_EQ(wire_bytes, SerializeToString(viewed));
+
+  // Padded-buffer parsing produces the same views.
+  std::basic_string<uint8_t> padded = wire_bytes;
+  padded.resize(wire_bytes.size() + kParseSlopBytes);
+  Samples padded_viewed{};
+  ASSERT_TRUE(MergeFromPaddedBuffer(padded.data(),
+                                    padded.data() + wire_bytes.size(),
+                                    padded_viewed));
+  EXPECT_EQ(wire_bytes, SerializeToString(padded_viewed));
+}
+
+TEST(PackedFixedViewTest, EmptyViewsAreNotSerialized) {
+  const Samples empty{};
+  EXPECT_EQ(SerializeToString(SamplesCopy{}), SerializeToString(empty));
+}
+
+TEST(PackedFixedViewTest, LastPayloadWins) {
+  // values = [1.0], then values = [2.0, 3.0]: The view only references the
+  // second payload.
+  SamplesCopy first{0, {1.0}, {}};
+  SamplesCopy second{0, {2.0, 3.0}, {}};
+  const auto wire_bytes = SerializeToString(first) + SerializeToString(second);
+  Samples viewed{};
+  ASSERT_TRUE(MergeFromBuffer(wire_bytes.data(),
+                              wire_bytes.data() + wire_bytes.size(), viewed));
+  ASSERT_EQ(2u, viewed.values.size());
+  EXPECT_EQ(2.0, viewed.values[0]);
+  EXPECT_EQ(3.0, viewed.values[1]);
+}
+
+TEST(PackedFixedViewTest, RejectsMalformedOrUnpackedPayloads) {
+  Samples viewed{};
+
+  // Payload byte count is not a multiple of the element size.
+  constexpr uint8_t kBadByteCount[] = {0x12, 0x03, 0x00, 0x00, 0x00};
+  EXPECT_FALSE(MergeFromBuffer(std::begin(kBadByteCount),
+                               std::end(kBadByteCount), viewed));
+
+  // Payload extends beyond the end of the buffer.
+  constexpr uint8_t kTruncated[] = {0x12, 0x10, 0x00, 0x00, 0x00, 0x00};
+  EXPECT_FALSE(MergeFromBuffer(std::begin(kTruncated), std::end(kTruncated),
+                               viewed));
+
+  // One element using the unpacked encoding (wire type 1, 64-bit).
+  constexpr uint8_t kUnpacked[] = {0x11, 0x00, 0x00, 0x00, 0x00,
+                                   0x00, 0x00, 0xf0, 0x3f};
+  EXPECT_FALSE(
+      MergeFromBuffer(std::begin(kUnpacked), std::end(kUnpacked), viewed));
+}
+
+}  // namespace
+}  // namespace pb
@@ -5,14 +5,29 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <type_traits>
+#include <vector>
 
+#include "pb/codec/batch_parse.h"
+#include "pb/codec/limits.h"
 #include "pb/codec/parse.h"
+#include "pb/codec/undo_log.h"
 
 namespace pb {
 
+// The number of readable bytes that must follow the end of any buffer passed to
+// MergeFromPaddedBuffer(). Their values do not matter, and they are never
+// modified; but the parser is allowed to load them. For example, a buffer that
+// is part of a larger allocation, or that was allocated with this many extra
+// bytes, satisfies the contract.
+constexpr int32_t kParseSlopBytes = codec::kParseSlopBytes;
+
+// The bounds of one buffer passed to ParseBatch() or ParsePaddedBatch().
+using BufferRange = codec::BufferRange;
+
 // Parses the buffer given by the range |begin| to |end|, merging field data
 // into the given |message|. Returns false if the parse failed.
 template <class Message,
@@ -25,6 +40,59 @@ template <class Message,
   return codec::ParseFields(begin, end, 0, message) == end;
 }
 
+// Same as MergeFromBuffer(), but faster, for buffers followed by at least
+// |kParseSlopBytes| readable bytes (see above). Tags and scalar values are
+// decoded without checking each byte read against |end|; instead, |end| is only
+// checked at field boundaries. A successful parse produces exactly the same
+// |message| as MergeFromBuffer() would, and both functions fail for exactly the
+// same inputs. However, as with MergeFromBuffer(), a failed parse may leave
+// |message| partially modified (and not necessarily in the same way).
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool MergeFromPaddedBuffer(const uint8_t* begin,
+                                         const uint8_t* end,
+                                         Message& message) {
+  assert((begin && (begin < end)) || (begin == end));
+  return codec::ParseFields<codec::InputBounds::kPadded>(begin, end, 0,
+                                                         message) == end;
+}
+
+// Same as MergeFromBuffer(), except that a failed parse leaves the |message|
+// exactly as it was. This is for merging untrusted input into long-lived state,
+// where backing-up a copy of the whole |message| would cost far more than the
+// parse. Instead, the input is first scanned (much as an unknown field is
+// skipped) to record the prior state of only the fields present in it (see
+// UndoLog in pb/codec/undo_log.h), which is restored if the parse fails. The
+// scan mostly records scalar values and container sizes, and so its cost is
+// proportional to the number of fields in the input. However, a std::set or
+// std::map field present in the input is copied; as is the whole |message|,
+// if it is a pb::SparseFields (which must then be copyable).
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool TryMergeFromBuffer(const uint8_t* begin,
+                                      const uint8_t* end,
+                                      Message& message) {
+  assert((begin && (begin < end)) || (begin == end));
+  thread_local codec::UndoLog log;
+  log.Clear();
+  if constexpr (codec::CanRecordUndoForFields<Message>()) {
+    if (!codec::RecordUndoForFields(begin, end, 0, message, log)) {
+      log.Rollback();
+      return false;
+    }
+  } else {
+    log.SaveCopy(message);
+  }
+  if (codec::ParseFields(begin, end, 0, message) != end) {
+    log.Rollback();
+    return false;
+  }
+  log.Clear();
+  return true;
+}
+
 // Parses the buffer given by the range |begin| to |end| into a heap-allocated
 // Message. Returs "null" if the parse failed.
 //
@@ -45,4 +113,43 @@ template <class Message,
   return message;
 }
 
+// Parses each of the |count| buffers given by |ranges| into a new Message,
+// appending them to |messages| in the same order. Returns false if any of the
+// parses failed; each message that failed to parse is left as a failed
+// MergeFromBuffer() would have left it.
+//
+// This is much faster than parsing each buffer separately when the messages
+// are tiny and all have the same "fixed shape": every field is a scalar that
+// is always serialized (not optional, repeated, a string, or a nested message).
+// Groups of such messages are decoded in lockstep, one field at a time, using
+// AVX2 instructions where available (see pb/codec/batch_parse.h). Any message
+// that deviates from the shape (e.g., it has unknown fields) is parsed the
+// usual way instead. For other types of messages, this just parses each buffer
+// in turn.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool ParseBatch(const BufferRange* ranges,
+                              std::size_t count,
+                              std::vector<Message>& messages) {
+  const std::size_t first = messages.size();
+  messages.resize(first + count);
+  return codec::ParseBatch(ranges, count, messages.data() + first);
+}
+
+// Same as ParseBatch(), but faster, for buffers that are each followed by at
+// least |kParseSlopBytes| readable bytes (see MergeFromPaddedBuffer()). For
+// example, a sequence of messages stored back-to-back in one padded buffer.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool ParsePaddedBatch(const BufferRange* ranges,
+                                    std::size_t count,
+                                    std::vector<Message>& messages) {
+  const std::size_t first = messages.size();
+  messages.resize(first + count);
+  return codec::ParseBatch<codec::InputBounds::kPadded>(
+      ranges, count, messages.data() + first);
+}
+
 }  // namespace pb
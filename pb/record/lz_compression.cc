@@ -0,0 +1,444 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/lz_compression.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+namespace pb {
+
+namespace {
+
+constexpr int32_t kMinMatchLength = 4;
+
+// No match may cover the last |kEndLiteralCount| bytes of the input. This
+// guarantees the decoder always has room to copy in |kCopyStride| strides,
+// except for the final literals.
+constexpr int32_t kEndLiteralCount = 12;
+constexpr std::ptrdiff_t kCopyStride = 8;
+static_assert(kCopyStride < kEndLiteralCount);
+
+constexpr int32_t kMaxOffset = 65535;
+constexpr int32_t kWindowSize = 65536;
+
+// The hash table grows with the input size, up to 2^kMaxHashBits entries, so
+// that small inputs do not pay to initialize a large table.
+constexpr int kMinHashBits = 10;
+constexpr int kMaxHashBits = 16;
+
+// Marks an empty hash table entry. It is far enough below zero that it is
+// always out of the window, so the match finder needs no separate check.
+constexpr int32_t kNoPosition = -kWindowSize - 1;
+
+// When no match is found, the compressor skips ahead faster the longer it has
+// gone without one (so incompressible data is processed quickly).
+constexpr int kSkipStrength = 6;
+
+// The largest compressed or decompressed block this implementation supports.
+constexpr int32_t kMaxInputSize = 0x7e000000;
+
+inline uint32_t Load32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint64_t Load64(const uint8_t* p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint32_t HashFourBytes(const uint8_t* p, int hash_bits) {
+  return (Load32(p) * 2654435761u) >> (32 - hash_bits);
+}
+
+// Returns the number of bytes that match at |a| and |b|, up to |limit| bytes.
+inline int32_t CountMatchingBytes(const uint8_t* a,
+                                  const uint8_t* b,
+                                  int32_t limit) {
+  int32_t count = 0;
+  while ((limit - count) >= 8 && Load64(a + count) == Load64(b + count)) {
+    count += 8;
+  }
+  while (count < limit && a[count] == b[count]) {
+    ++count;
+  }
+  return count;
+}
+
+inline uint8_t* WriteLengthExtension(int32_t length, uint8_t* output) {
+  for (; length >= 255; length -= 255) {
+    *(output++) = 255;
+  }
+  *(output++) = static_cast<uint8_t>(length);
+  return output;
+}
+
+// Writes one sequence. A |match_length| of zero means this is the last
+// sequence, which has no match.
+uint8_t* WriteSequence(const uint8_t* literals,
+                       int32_t literal_length,
+                       int32_t match_offset,
+                       int32_t match_length,
+                       uint8_t* output) {
+  const int32_t match_code =
+      match_length ? (match_length - kMinMatchLength) : 0;
+  uint8_t* const token = output++;
+  *token = static_cast<uint8_t>((std::min(literal_length, 15) << 4) |
+                                std::min(match_code, 15));
+  if (literal_length >= 15) {
+    output = WriteLengthExtension(literal_length - 15, output);
+  }
+  if (literal_length > 0) {
+    std::memcpy(output, literals, static_cast<std::size_t>(literal_length));
+    output += literal_length;
+  }
+  if (match_length == 0) {
+    return output;
+  }
+  *(output++) = static_cast<uint8_t>(match_offset & 0xff);
+  *(output++) = static_cast<uint8_t>(match_offset >> 8);
+  if (match_code >= 15) {
+    output = WriteLengthExtension(match_code - 15, output);
+  }
+  return output;
+}
+
+// Copies in |kCopyStride| strides, possibly writing up to kCopyStride - 1 bytes
+// past |dest_end|.
+inline void WildCopy(uint8_t* dest, const uint8_t* source, uint8_t* dest_end) {
+  do {
+    std::memcpy(dest, source, kCopyStride);
+    dest += kCopyStride;
+    source += kCopyStride;
+  } while (dest < dest_end);
+}
+
+// Reads a length extension, adding it to |length|. Returns false if the input
+// ends first, or the length becomes unreasonably large.
+inline bool ReadLengthExtension(const uint8_t*& input,
+                                const uint8_t* input_end,
+                                std::ptrdiff_t& length) {
+  for (;;) {
+    if (input == input_end) {
+      return false;
+    }
+    const uint8_t byte = *(input++);
+    length += byte;
+    if (length > kMaxInputSize) {
+      return false;
+    }
+    if (byte != 255) {
+      return true;
+    }
+  }
+}
+
+// The hash chains of an LzDictionary's bytes.
+struct DictionaryTables {
+  const uint8_t* bytes;
+  int32_t size;
+  int hash_bits;
+  const int32_t* head;
+  const uint16_t* chain;
+};
+
+// Compresses the |input|, as LzCompress() does. Matches may also refer to the
+// |dictionary|, if given, as if it preceded the |input|.
+int32_t Compress(const DictionaryTables* dictionary,
+                 const uint8_t* input,
+                 int32_t input_size,
+                 uint8_t* output,
+                 int search_depth) {
+  search_depth = std::clamp(search_depth, kMinLzSearchDepth, kMaxLzSearchDepth);
+  uint8_t* const output_begin = output;
+
+  // Matches must end by |match_end_limit|, and so must start before
+  // |match_start_limit|.
+  const int32_t match_end_limit = input_size - kEndLiteralCount;
+  const int32_t match_start_limit = match_end_limit - kMinMatchLength;
+  int32_t anchor = 0;  // The start of the pending literals.
+
+  if (match_start_limit > 0) {
+    // |head| maps a hash of 4 bytes to the most-recent position having them.
+    // |chain| maps each position (modulo the window size) to the distance back
+    // to the previous position having the same hash, or 0 for none.
+    int hash_bits = kMinHashBits;
+    while (hash_bits < kMaxHashBits && (1 << hash_bits) < input_size) {
+      ++hash_bits;
+    }
+    const auto head = std::make_unique<int32_t[]>(std::size_t{1} << hash_bits);
+    std::fill_n(head.get(), std::size_t{1} << hash_bits, kNoPosition);
+    const auto chain_size = std::min(input_size, kWindowSize);
+    const auto chain =
+        std::make_unique<uint16_t[]>(static_cast<std::size_t>(chain_size));
+    // Inserts |position| into its chain, and returns the previous head.
+    const auto insert = [&](int32_t position) {
+      int32_t& head_position = head[HashFourBytes(input + position, hash_bits)];
+      const int32_t previous = head_position;
+      const int32_t distance = position - previous;
+      chain[position & (kWindowSize - 1)] =
+          static_cast<uint16_t>((distance <= kMaxOffset) ? distance : 0);
+      head_position = position;
+      return previous;
+    };
+
+    // A match at a negative position is in the dictionary, at that many bytes
+    // before its end.
+    const uint8_t* const dictionary_end =
+        dictionary ? dictionary->bytes + dictionary->size : nullptr;
+    const int32_t dictionary_size = dictionary ? dictionary->size : 0;
+
+    int32_t position = 0;
+    while (position < match_start_limit) {
+      // Search the chain of earlier positions with the same hash.
+      int32_t candidate = insert(position);
+      int32_t best_length = 0;
+      int32_t best_position = 0;
+      const uint32_t first_four = Load32(input + position);
+      for (int depth = search_depth; (position - candidate) <= kMaxOffset;) {
+        if (Load32(input + candidate) == first_four) {
+          const int32_t length =
+              kMinMatchLength +
+              CountMatchingBytes(input + candidate + kMinMatchLength,
+                                 input + position + kMinMatchLength,
+                                 match_end_limit - position - kMinMatchLength);
+          if (length > best_length) {
+            best_length = length;
+            best_position = candidate;
+            if (position + length == match_end_limit) {
+              break;  // Cannot do better.
+            }
+          }
+        }
+        const uint16_t distance = chain[candidate & (kWindowSize - 1)];
+        if (distance == 0 || --depth == 0) {
+          break;
+        }
+        candidate -= distance;
+      }
+
+      // Then, search the dictionary's chain. Matches there stop at the end of
+      // the dictionary.
+      if (dictionary && position + best_length < match_end_limit) {
+        candidate = dictionary->head[HashFourBytes(input + position,
+                                                   dictionary->hash_bits)];
+        for (int depth = search_depth;
+             candidate != kNoPosition &&
+             (position + dictionary_size - candidate) <= kMaxOffset;) {
+          if (Load32(dictionary->bytes + candidate) == first_four) {
+            const int32_t length =
+                kMinMatchLength +
+                CountMatchingBytes(
+                    dictionary->bytes + candidate + kMinMatchLength,
+                    input + position + kMinMatchLength,
+                    std::min(match_end_limit - position,
+                             dictionary_size - candidate) -
+                        kMinMatchLength);
+            if (length > best_length) {
+              best_length = length;
+              best_position = candidate - dictionary_size;
+            }
+          }
+          const uint16_t distance = dictionary->chain[candidate];
+          if (distance == 0 || --depth == 0) {
+            break;
+          }
+          candidate -= distance;
+        }
+      }
+
+      if (best_length < kMinMatchLength) {
+        position += 1 + ((position - anchor) >> kSkipStrength);
+        continue;
+      }
+
+      // Extend the match backwards into the pending literals.
+      int32_t match_start = position;
+      while (match_start > anchor && best_position > -dictionary_size &&
+             input[match_start - 1] ==
+                 (best_position > 0 ? input[best_position - 1]
+                                    : dictionary_end[best_position - 1])) {
+        --match_start;
+        --best_position;
+        ++best_length;
+      }
+
+      output = WriteSequence(input + anchor, match_start - anchor,
+                             match_start - best_position, best_length, output);
+      const int32_t match_end = match_start + best_length;
+      for (int32_t p = position + 1; p < match_end && p < match_start_limit;
+           ++p) {
+        insert(p);
+      }
+      position = anchor = match_end;
+    }
+  }
+
+  output = WriteSequence(input + anchor, input_size - anchor, 0, 0, output);
+  return static_cast<int32_t>(output - output_begin);
+}
+
+// Decompresses the |input|, as LzDecompress() does. Matches may also refer to
+// the |dictionary_size| bytes before |dictionary_end|, as if they preceded the
+// |output|.
+bool Decompress(const uint8_t* dictionary_end,
+                std::ptrdiff_t dictionary_size,
+                const uint8_t* input,
+                int32_t input_size,
+                uint8_t* output,
+                int32_t output_size) {
+  const uint8_t* const input_end = input + input_size;
+  uint8_t* const output_begin = output;
+  uint8_t* const output_end = output + output_size;
+
+  for (;;) {
+    if (input == input_end) {
+      return false;
+    }
+    const uint8_t token = *(input++);
+
+    // Copy the literals.
+    std::ptrdiff_t literal_length = token >> 4;
+    if (literal_length == 15 &&
+        !ReadLengthExtension(input, input_end, literal_length)) {
+      return false;
+    }
+    if (literal_length > (input_end - input) ||
+        literal_length > (output_end - output)) {
+      return false;
+    }
+    if ((input_end - input) >= literal_length + kCopyStride &&
+        (output_end - output) >= literal_length + kCopyStride) {
+      WildCopy(output, input, output + literal_length);
+    } else if (literal_length > 0) {
+      std::memcpy(output, input, static_cast<std::size_t>(literal_length));
+    }
+    input += literal_length;
+    output += literal_length;
+
+    // The last sequence has no match.
+    if (input == input_end) {
+      return output == output_end && (token & 0x0f) == 0;
+    }
+
+    // Copy the match.
+    if ((input_end - input) < 2) {
+      return false;
+    }
+    const std::ptrdiff_t offset = input[0] | (input[1] << 8);
+    input += 2;
+    if (offset == 0 || offset > (output - output_begin) + dictionary_size) {
+      return false;
+    }
+    std::ptrdiff_t match_length = (token & 0x0f);
+    if (match_length == 15 &&
+        !ReadLengthExtension(input, input_end, match_length)) {
+      return false;
+    }
+    match_length += kMinMatchLength;
+    if (match_length > (output_end - output)) {
+      return false;
+    }
+    const uint8_t* match = output - offset;
+    if (offset > (output - output_begin)) {
+      // The match starts in the dictionary, and may continue into the output.
+      match = dictionary_end - (offset - (output - output_begin));
+      const std::ptrdiff_t from_dictionary =
+          std::min(match_length, dictionary_end - match);
+      std::memcpy(output, match, static_cast<std::size_t>(from_dictionary));
+      output += from_dictionary;
+      match_length -= from_dictionary;
+      if (match_length == 0) {
+        continue;
+      }
+      match = output_begin;
+    }
+    if (offset >= kCopyStride &&
+        (output_end - output) >= match_length + kCopyStride) {
+      WildCopy(output, match, output + match_length);
+      output += match_length;
+    } else {
+      // Overlapping copy (e.g., a run of repeated bytes), or near the end.
+      for (uint8_t* const end = output + match_length; output != end;) {
+        *(output++) = *(match++);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+int32_t ComputeMaxLzCompressedSize(int32_t input_size) {
+  if (input_size < 0 || input_size > kMaxInputSize) {
+    return -1;
+  }
+  return input_size + input_size / 255 + 16;
+}
+
+int32_t LzCompress(const uint8_t* input,
+                   int32_t input_size,
+                   uint8_t* output,
+                   int search_depth) {
+  return Compress(nullptr, input, input_size, output, search_depth);
+}
+
+bool LzDecompress(const uint8_t* input,
+                  int32_t input_size,
+                  uint8_t* output,
+                  int32_t output_size) {
+  return Decompress(nullptr, 0, input, input_size, output, output_size);
+}
+
+LzDictionary::LzDictionary(std::vector<uint8_t> bytes)
+    : bytes_(std::move(bytes)) {
+  if (bytes_.size() > static_cast<std::size_t>(kMaxLzDictionarySize)) {
+    bytes_.erase(bytes_.begin(), bytes_.end() - kMaxLzDictionarySize);
+  }
+  const auto size = static_cast<int32_t>(bytes_.size());
+  hash_bits_ = kMinHashBits;
+  while (hash_bits_ < kMaxHashBits && (1 << hash_bits_) < size) {
+    ++hash_bits_;
+  }
+  head_.assign(std::size_t{1} << hash_bits_, kNoPosition);
+  chain_.assign(bytes_.size(), 0);
+  for (int32_t position = 0; position + kMinMatchLength <= size; ++position) {
+    int32_t& head_position =
+        head_[HashFourBytes(bytes_.data() + position, hash_bits_)];
+    if (head_position != kNoPosition) {
+      chain_[static_cast<std::size_t>(position)] =
+          static_cast<uint16_t>(position - head_position);
+    }
+    head_position = position;
+  }
+}
+
+int32_t LzCompressWithDictionary(const LzDictionary& dictionary,
+                                 const uint8_t* input,
+                                 int32_t input_size,
+                                 uint8_t* output,
+                                 int search_depth) {
+  const DictionaryTables tables{
+      dictionary.bytes_.data(), static_cast<int32_t>(dictionary.bytes_.size()),
+      dictionary.hash_bits_, dictionary.head_.data(), dictionary.chain_.data()};
+  return Compress(&tables, input, input_size, output, search_depth);
+}
+
+bool LzDecompressWithDictionary(const LzDictionary& dictionary,
+                                const uint8_t* input,
+                                int32_t input_size,
+                                uint8_t* output,
+                                int32_t output_size) {
+  const std::vector<uint8_t>& bytes = dictionary.bytes();
+  return Decompress(bytes.data() + bytes.size(),
+                    static_cast<std::ptrdiff_t>(bytes.size()), input,
+                    input_size, output, output_size);
+}
+
+}  // namespace pb
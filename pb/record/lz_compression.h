@@ -0,0 +1,109 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace pb {
+
+// A self-contained LZ77-family block compressor, in the style of LZ4: It
+// trades compression ratio for speed, especially decompression speed. Each
+// block is compressed independently, so blocks can be decompressed in any
+// order (or in parallel).
+//
+// The compressed format is a sequence of "sequences," each being:
+//
+//   1. A token byte: The high 4 bits are the literal length, and the low 4
+//      bits are the match length minus 4. A value of 15 means more length
+//      bytes follow (each adding 0-255, until a byte that is not 255).
+//   2. The literal length extension bytes, if any, then the literal bytes.
+//   3. A 2-byte little-endian match offset (1 to 65535 bytes back), then the
+//      match length extension bytes, if any.
+//
+// The last sequence has only literals (no offset). The last 12 bytes of input
+// are always encoded as literals, which lets the decoder copy literals and
+// matches in 8-byte strides without writing past the output bounds in most
+// cases.
+
+// The minimum and maximum lengths of the hash chains searched for a match.
+// Longer searches find longer matches, but take more time.
+constexpr int kMinLzSearchDepth = 1;
+constexpr int kMaxLzSearchDepth = 256;
+constexpr int kDefaultLzSearchDepth = 8;
+
+// Returns the maximum compressed size of |input_size| bytes, or -1 if
+// |input_size| is negative or too large.
+[[nodiscard]] int32_t ComputeMaxLzCompressedSize(int32_t input_size);
+
+// Compresses the |input_size| bytes at |input| into the |output| buffer, which
+// must be at least ComputeMaxLzCompressedSize(input_size) bytes. Returns the
+// compressed size. |search_depth| is clamped to the range
+// [kMinLzSearchDepth, kMaxLzSearchDepth].
+[[nodiscard]] int32_t LzCompress(const uint8_t* input,
+                                 int32_t input_size,
+                                 uint8_t* output,
+                                 int search_depth = kDefaultLzSearchDepth);
+
+// Decompresses the |input_size| bytes at |input| into the |output| buffer,
+// which must be exactly |output_size| bytes (i.e., the original size, stored by
+// the caller). Returns false if the compressed data is malformed, or would not
+// decompress to exactly |output_size| bytes. Never reads or writes out of
+// bounds, even for malicious input.
+[[nodiscard]] bool LzDecompress(const uint8_t* input,
+                                int32_t input_size,
+                                uint8_t* output,
+                                int32_t output_size);
+
+// The largest dictionary that LzDictionary uses. This leaves matches in an
+// input at least 32 KB of reach past the start of the dictionary.
+constexpr int32_t kMaxLzDictionarySize = 32 * 1024;
+
+// Bytes that many small inputs have in common (e.g., the field tags, enum
+// values, and common strings of one message type), for compressing each input
+// on its own with LzCompressWithDictionary(). The compressed format is the same
+// as above, except that a match may reach back past the start of the input,
+// into the dictionary, as if the dictionary preceded the input. Holds the
+// tables for finding matches in the dictionary, which are built once, on
+// construction. See also TrainLzDictionary() in message_compression.h.
+class LzDictionary {
+ public:
+  // Only the last kMaxLzDictionarySize of the |bytes| are used.
+  explicit LzDictionary(std::vector<uint8_t> bytes);
+
+  [[nodiscard]] const std::vector<uint8_t>& bytes() const { return bytes_; }
+
+ private:
+  friend int32_t LzCompressWithDictionary(const LzDictionary& dictionary,
+                                          const uint8_t* input,
+                                          int32_t input_size,
+                                          uint8_t* output,
+                                          int search_depth);
+
+  std::vector<uint8_t> bytes_;
+
+  // The hash chains of the positions in the dictionary (see LzCompress()).
+  int hash_bits_ = 0;
+  std::vector<int32_t> head_;
+  std::vector<uint16_t> chain_;
+};
+
+// Same as LzCompress(), but matches may also refer to the |dictionary|.
+[[nodiscard]] int32_t LzCompressWithDictionary(
+    const LzDictionary& dictionary,
+    const uint8_t* input,
+    int32_t input_size,
+    uint8_t* output,
+    int search_depth = kDefaultLzSearchDepth);
+
+// Same as LzDecompress(), for data compressed with the same |dictionary| by
+// LzCompressWithDictionary().
+[[nodiscard]] bool LzDecompressWithDictionary(const LzDictionary& dictionary,
+                                              const uint8_t* input,
+                                              int32_t input_size,
+                                              uint8_t* output,
+                                              int32_t output_size);
+
+}  // namespace pb
@@ -0,0 +1,187 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/lz_compression.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace pb {
+namespace {
+
+std::vector<uint8_t> Compress(const std::vector<uint8_t>& input,
+                              int search_depth = kDefaultLzSearchDepth) {
+  const auto input_size = static_cast<int32_t>(input.size());
+  std::vector<uint8_t> output(
+      static_cast<std::size_t>(ComputeMaxLzCompressedSize(input_size)));
+  const int32_t size =
+      LzCompress(input.data(), input_size, output.data(), search_depth);
+  EXPECT_LE(size, static_cast<int32_t>(output.size()));
+  output.resize(static_cast<std::size_t>(size));
+  return output;
+}
+
+void ExpectRoundTrip(const std::vector<uint8_t>& input,
+                     int search_depth = kDefaultLzSearchDepth) {
+  const std::vector<uint8_t> compressed = Compress(input, search_depth);
+  std::vector<uint8_t> decompressed(input.size());
+  ASSERT_TRUE(LzDecompress(compressed.data(),
+                           static_cast<int32_t>(compressed.size()),
+                           decompressed.data(),
+                           static_cast<int32_t>(decompressed.size())));
+  EXPECT_EQ(input, decompressed);
+}
+
+std::vector<uint8_t> MakeText(std::size_t size) {
+  static constexpr char kWords[][8] = {"sensor", "reading", "id",   "value",
+                                       "alpha",  "beta",    "gamma"};
+  std::mt19937 random(42);
+  std::vector<uint8_t> text;
+  while (text.size() < size) {
+    const char* const word = kWords[random() % 7];
+    text.insert(text.end(), word, word + std::char_traits<char>::length(word));
+    text.push_back(static_cast<uint8_t>(' '));
+  }
+  text.resize(size);
+  return text;
+}
+
+TEST(LzCompressionTest, RoundTripsSmallInputs) {
+  for (std::size_t size = 0; size < 40; ++size) {
+    SCOPED_TRACE(size);
+    ExpectRoundTrip(std::vector<uint8_t>(size, 'a'));
+    ExpectRoundTrip(MakeText(size));
+  }
+}
+
+TEST(LzCompressionTest, RoundTripsLargeInputs) {
+  std::mt19937 random(7);
+  std::vector<uint8_t> noise(100000);
+  for (auto& byte : noise) {
+    byte = static_cast<uint8_t>(random());
+  }
+  ExpectRoundTrip(noise);
+  ExpectRoundTrip(std::vector<uint8_t>(200000, 0));
+  for (int depth : {1, 8, 256}) {
+    ExpectRoundTrip(MakeText(300000), depth);
+  }
+
+  // Long literal runs, then long matches, then short-offset runs.
+  std::vector<uint8_t> mixed(noise.begin(), noise.begin() + 5000);
+  mixed.insert(mixed.end(), noise.begin(), noise.begin() + 5000);
+  for (int i = 0; i < 1000; ++i) {
+    mixed.push_back(static_cast<uint8_t>(i % 3));
+  }
+  ExpectRoundTrip(mixed);
+}
+
+TEST(LzCompressionTest, CompressesRedundantData) {
+  const std::vector<uint8_t> text = MakeText(65536);
+  EXPECT_LT(Compress(text).size(), text.size() / 2);
+  EXPECT_LE(Compress(text, kMaxLzSearchDepth).size(), Compress(text, 1).size());
+  EXPECT_LT(Compress(std::vector<uint8_t>(65536, 'x')).size(), 400u);
+}
+
+TEST(LzCompressionTest, RejectsMalformedInput) {
+  const std::vector<uint8_t> text = MakeText(4096);
+  const std::vector<uint8_t> compressed = Compress(text);
+  std::vector<uint8_t> output(text.size());
+  const auto output_size = static_cast<int32_t>(output.size());
+
+  // Wrong sizes.
+  EXPECT_FALSE(LzDecompress(compressed.data(),
+                            static_cast<int32_t>(compressed.size()),
+                            output.data(), output_size - 1));
+  EXPECT_FALSE(LzDecompress(compressed.data(),
+                            static_cast<int32_t>(compressed.size()) - 1,
+                            output.data(), output_size));
+  EXPECT_FALSE(LzDecompress(compressed.data(), 0, output.data(), 0));
+
+  // An offset reaching before the start of the output.
+  const uint8_t bad_offset[] = {0x10, 'a', 0x02, 0x00, 0x00};
+  EXPECT_FALSE(LzDecompress(bad_offset, sizeof(bad_offset), output.data(), 5));
+
+  // Random corruptions must never read or write out of bounds (see ASan runs).
+  std::mt19937 random(3);
+  for (int i = 0; i < 2000; ++i) {
+    std::vector<uint8_t> corrupted = compressed;
+    corrupted[random() % corrupted.size()] = static_cast<uint8_t>(random());
+    corrupted.resize(corrupted.size() - random() % 3);
+    const bool success = LzDecompress(corrupted.data(),
+                                      static_cast<int32_t>(corrupted.size()),
+                                      output.data(), output_size);
+    (void)success;
+  }
+}
+
+TEST(LzCompressionTest, MatchesIntoADictionary) {
+  const std::vector<uint8_t> text = MakeText(2000);
+  const LzDictionary dictionary(
+      std::vector<uint8_t>(text.begin(), text.begin() + 1000));
+  const auto round_trip = [&](const std::vector<uint8_t>& input) {
+    const auto input_size = static_cast<int32_t>(input.size());
+    std::vector<uint8_t> compressed(
+        static_cast<std::size_t>(ComputeMaxLzCompressedSize(input_size)));
+    compressed.resize(static_cast<std::size_t>(LzCompressWithDictionary(
+        dictionary, input.data(), input_size, compressed.data())));
+    std::vector<uint8_t> output(input.size());
+    EXPECT_TRUE(LzDecompressWithDictionary(
+        dictionary, compressed.data(), static_cast<int32_t>(compressed.size()),
+        output.data(), input_size));
+    EXPECT_EQ(input, output);
+    return compressed.size();
+  };
+
+  // A copy of part of the dictionary is almost all one match.
+  const std::vector<uint8_t> copy(text.begin() + 400, text.begin() + 700);
+  EXPECT_LT(round_trip(copy), 30u);
+  EXPECT_GT(Compress(copy).size(), 100u);
+
+  // Text that only partly matches the dictionary, and inputs too small for
+  // any match.
+  for (std::size_t size = 0; size < 300; size += 7) {
+    SCOPED_TRACE(size);
+    round_trip(std::vector<uint8_t>(text.begin() + 1000,
+                                    text.begin() + 1000 +
+                                        static_cast<std::ptrdiff_t>(size)));
+  }
+
+  // An empty dictionary is the same as none.
+  const LzDictionary empty({});
+  const auto copy_size = static_cast<int32_t>(copy.size());
+  std::vector<uint8_t> compressed(
+      static_cast<std::size_t>(ComputeMaxLzCompressedSize(copy_size)));
+  compressed.resize(static_cast<std::size_t>(LzCompressWithDictionary(
+      empty, copy.data(), copy_size, compressed.data())));
+  EXPECT_EQ(Compress(copy), compressed);
+}
+
+TEST(LzCompressionTest, DecompressesMatchesThatSpanTheDictionaryAndOutput) {
+  const std::vector<uint8_t> bytes = {'a', 'b', 'c', 'd', 'e', 'f'};
+  const LzDictionary dictionary(bytes);
+  uint8_t output[16];
+
+  // Literals "XY", then a 9-byte match 4 bytes before the output ("cdef"),
+  // which continues into the output ("XYcde"); then 5 literals.
+  const uint8_t spanning[] = {0x25, 'X', 'Y', 0x06, 0x00, 0x50,
+                              '1',  '2', '3', '4',  '5'};
+  ASSERT_TRUE(LzDecompressWithDictionary(dictionary, spanning,
+                                         sizeof(spanning), output, 16));
+  EXPECT_EQ(std::string("XYcdefXYcde12345"),
+            std::string(reinterpret_cast<const char*>(output), 16));
+
+  // Without the dictionary, and past its start, the offset is invalid.
+  EXPECT_FALSE(LzDecompress(spanning, sizeof(spanning), output, 16));
+  const uint8_t too_far[] = {0x20, 'X', 'Y', 0x09, 0x00, 0x00};
+  EXPECT_FALSE(
+      LzDecompressWithDictionary(dictionary, too_far, sizeof(too_far), output,
+                                 6));
+}
+
+}  // namespace
+}  // namespace pb
@@ -0,0 +1,208 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/message_compression.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/serialize.h"
+
+namespace pb {
+
+namespace {
+
+// Training counts the samples containing each string of this many bytes
+// ("d-mer"). Shorter strings are mostly common by chance.
+constexpr int32_t kDmerSize = 6;
+
+// No d-mer: The position is within |kDmerSize| bytes of the end of a sample.
+constexpr int32_t kNoDmer = -1;
+
+// A candidate piece of the dictionary.
+struct Segment {
+  int64_t score;
+  std::size_t begin;
+};
+
+}  // namespace
+
+LzDictionary TrainLzDictionary(const std::vector<BufferRange>& samples,
+                               const LzDictionaryTrainingOptions& options) {
+  // This is a simplified form of the "COVER" algorithm (Liao, Petri, Moffat,
+  // and Wirth, "Effective Construction of Relative Lempel-Ziv Dictionaries"):
+  // Each d-mer scores one for each sample containing it after the first, and
+  // each segment scores the sum over its distinct d-mers. The corpus is split
+  // into "epochs," and the best-scoring segment of each is taken in turn. The
+  // d-mers of a segment that is taken score zero from then on.
+  const int32_t max_bytes =
+      std::clamp(options.max_bytes, int32_t{0}, kMaxLzDictionarySize);
+  const auto segment_bytes = static_cast<std::size_t>(std::clamp(
+      options.segment_bytes, kDmerSize, std::max(kDmerSize, max_bytes)));
+
+  std::vector<uint8_t> corpus;
+  for (const BufferRange& sample : samples) {
+    corpus.insert(corpus.end(), sample.begin, sample.end);
+  }
+  if (max_bytes == 0 || corpus.size() < segment_bytes) {
+    return LzDictionary(std::move(corpus));
+  }
+
+  // Number the distinct d-mers, and count the samples containing each.
+  std::vector<int32_t> dmers(corpus.size(), kNoDmer);
+  std::vector<int64_t> scores;
+  std::vector<std::size_t> last_sample;
+  {
+    std::unordered_map<uint64_t, int32_t> ids;
+    std::size_t offset = 0;
+    for (std::size_t sample = 0; sample < samples.size(); ++sample) {
+      const auto size =
+          static_cast<std::size_t>(samples[sample].end - samples[sample].begin);
+      for (std::size_t i = 0; i + kDmerSize <= size; ++i) {
+        uint64_t key = 0;
+        for (int32_t j = 0; j < kDmerSize; ++j) {
+          key = (key << 8) | corpus[offset + i + static_cast<std::size_t>(j)];
+        }
+        const auto [it, inserted] =
+            ids.try_emplace(key, static_cast<int32_t>(scores.size()));
+        if (inserted) {
+          scores.push_back(0);
+          last_sample.push_back(sample);
+        } else if (last_sample[static_cast<std::size_t>(it->second)] !=
+                   sample) {
+          ++scores[static_cast<std::size_t>(it->second)];
+          last_sample[static_cast<std::size_t>(it->second)] = sample;
+        }
+        dmers[offset + i] = it->second;
+      }
+      offset += size;
+    }
+  }
+
+  // A segment of |segment_bytes| has this many d-mers.
+  const std::size_t window = segment_bytes - kDmerSize + 1;
+  const std::size_t last_begin = corpus.size() - segment_bytes;
+  const std::size_t epoch_count = std::max<std::size_t>(
+      1, std::min(static_cast<std::size_t>(max_bytes) / segment_bytes,
+                  corpus.size() / segment_bytes));
+  const std::size_t epoch_size = corpus.size() / epoch_count;
+
+  std::vector<int32_t> counts_in_window(scores.size(), 0);
+  int64_t window_score = 0;
+  const auto add = [&](std::size_t position) {
+    const int32_t dmer = dmers[position];
+    if (dmer != kNoDmer &&
+        counts_in_window[static_cast<std::size_t>(dmer)]++ == 0) {
+      window_score += scores[static_cast<std::size_t>(dmer)];
+    }
+  };
+  const auto remove = [&](std::size_t position) {
+    const int32_t dmer = dmers[position];
+    if (dmer != kNoDmer &&
+        --counts_in_window[static_cast<std::size_t>(dmer)] == 0) {
+      window_score -= scores[static_cast<std::size_t>(dmer)];
+    }
+  };
+
+  std::vector<Segment> taken;
+  std::size_t taken_bytes = 0;
+  const auto wanted_bytes = static_cast<std::size_t>(max_bytes);
+  bool found = true;
+  while (found && taken_bytes < wanted_bytes) {
+    found = false;
+    for (std::size_t epoch = 0;
+         epoch < epoch_count && taken_bytes < wanted_bytes; ++epoch) {
+      // Slide a window over the segments beginning in this epoch.
+      const std::size_t first = std::min(epoch * epoch_size, last_begin);
+      const std::size_t last =
+          std::min((epoch + 1) * epoch_size - 1, last_begin);
+      window_score = 0;
+      for (std::size_t i = 0; i < window; ++i) {
+        add(first + i);
+      }
+      Segment best{window_score, first};
+      for (std::size_t begin = first + 1; begin <= last; ++begin) {
+        remove(begin - 1);
+        add(begin + window - 1);
+        if (window_score > best.score) {
+          best = Segment{window_score, begin};
+        }
+      }
+      for (std::size_t i = 0; i < window; ++i) {
+        remove(last + i);
+      }
+      if (best.score <= 0) {
+        continue;
+      }
+      taken.push_back(best);
+      taken_bytes += segment_bytes;
+      found = true;
+      for (std::size_t i = 0; i < window; ++i) {
+        const int32_t dmer = dmers[best.begin + i];
+        if (dmer != kNoDmer) {
+          scores[static_cast<std::size_t>(dmer)] = 0;
+        }
+      }
+    }
+  }
+
+  // Put the best segments last, and drop the worst if there are too many.
+  std::stable_sort(taken.begin(), taken.end(),
+                   [](const Segment& a, const Segment& b) {
+                     return a.score < b.score;
+                   });
+  std::vector<uint8_t> bytes;
+  bytes.reserve(taken_bytes);
+  for (const Segment& segment : taken) {
+    const auto begin =
+        corpus.begin() + static_cast<std::ptrdiff_t>(segment.begin);
+    bytes.insert(bytes.end(), begin,
+                 begin + static_cast<std::ptrdiff_t>(segment_bytes));
+  }
+  if (bytes.size() > wanted_bytes) {
+    bytes.erase(bytes.begin(), bytes.end() - max_bytes);
+  }
+  return LzDictionary(std::move(bytes));
+}
+
+void CompressMessageBytes(const uint8_t* begin,
+                          const uint8_t* end,
+                          const LzDictionary& dictionary,
+                          std::vector<uint8_t>& output,
+                          int search_depth) {
+  const auto byte_count = static_cast<int32_t>(end - begin);
+  const std::size_t output_size = output.size();
+  output.resize(
+      output_size + codec::kMaxVarintSize +
+      static_cast<std::size_t>(ComputeMaxLzCompressedSize(byte_count)));
+  uint8_t* cursor = codec::SerializeValue(static_cast<uint32_t>(byte_count),
+                                          output.data() + output_size);
+  cursor += LzCompressWithDictionary(dictionary, begin, byte_count, cursor,
+                                     search_depth);
+  output.resize(static_cast<std::size_t>(cursor - output.data()));
+}
+
+int32_t DecompressMessageBytes(const uint8_t* begin,
+                               const uint8_t* end,
+                               const LzDictionary& dictionary,
+                               std::vector<uint8_t>& serialized) {
+  uint32_t byte_count;
+  const uint8_t* const compressed =
+      codec::ParseValue(begin, end, 0, byte_count);
+  if (!compressed ||
+      byte_count > static_cast<uint32_t>(codec::kMaxSerializedSize)) {
+    return -1;
+  }
+  serialized.resize(byte_count + static_cast<std::size_t>(kParseSlopBytes));
+  if (!LzDecompressWithDictionary(
+          dictionary, compressed, static_cast<int32_t>(end - compressed),
+          serialized.data(), static_cast<int32_t>(byte_count))) {
+    return -1;
+  }
+  return static_cast<int32_t>(byte_count);
+}
+
+}  // namespace pb
@@ -0,0 +1,132 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "pb/codec/field_rules.h"
+#include "pb/parse.h"
+#include "pb/record/lz_compression.h"
+#include "pb/serialize.h"
+
+namespace pb {
+
+// Compresses single small messages, which block compression does little for,
+// against a dictionary trained on a sample of their kind. Most of the bytes of
+// a 100-300 byte message (its field tags, enum values, and common strings) are
+// then matches into the dictionary. Example:
+//
+//   // Once, from a sample of the serialized messages (e.g., a TrafficCorpus):
+//   const pb::LzDictionary dictionary =
+//       pb::TrainLzDictionary(corpus.GetSamples(kChatTypeId), {});
+//   ...
+//   std::vector<uint8_t> compressed;
+//   if (!pb::CompressMessage(chat, dictionary, compressed)) { ... }
+//   ...
+//   Chat chat;
+//   if (!pb::DecompressMessage(begin, end, dictionary, chat)) { ... }
+//
+// The dictionary must be the same for both, and so is usually saved (from
+// LzDictionary::bytes()) alongside the compressed messages.
+
+struct LzDictionaryTrainingOptions {
+  // The size of the dictionary. At most kMaxLzDictionarySize.
+  int32_t max_bytes = 16 * 1024;
+
+  // The dictionary is made of pieces of the samples of about this size.
+  int32_t segment_bytes = 48;
+};
+
+// Builds a dictionary of the byte strings that occur in the most |samples|.
+// The dictionary is made of the segments of the samples that contain the most
+// such strings, with the best segments at the end (closest to the input being
+// compressed, and so reachable from all of it).
+[[nodiscard]] LzDictionary TrainLzDictionary(
+    const std::vector<BufferRange>& samples,
+    const LzDictionaryTrainingOptions& options);
+
+// Compresses the serialized message in the range |begin| to |end| against the
+// |dictionary|, and appends it to |output|: the serialized size as a varint,
+// then the compressed bytes.
+void CompressMessageBytes(const uint8_t* begin,
+                          const uint8_t* end,
+                          const LzDictionary& dictionary,
+                          std::vector<uint8_t>& output,
+                          int search_depth = kDefaultLzSearchDepth);
+
+// Decompresses the bytes written by CompressMessageBytes() in the range |begin|
+// to |end| into |serialized|, followed by kParseSlopBytes of padding. Returns
+// the serialized size, or -1 if the bytes are malformed.
+[[nodiscard]] int32_t DecompressMessageBytes(
+    const uint8_t* begin,
+    const uint8_t* end,
+    const LzDictionary& dictionary,
+    std::vector<uint8_t>& serialized);
+
+// Serializes the |message|, and appends it to |output| compressed (see
+// CompressMessageBytes()). Returns false if the |message| could not be
+// serialized.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool CompressMessage(const Message& message,
+                                   const LzDictionary& dictionary,
+                                   std::vector<uint8_t>& output,
+                                   int search_depth = kDefaultLzSearchDepth) {
+  const int32_t byte_count = ComputeSerializedSize(message);
+  if (byte_count < 0) {
+    return false;
+  }
+  thread_local std::vector<uint8_t> serialized;
+  serialized.resize(static_cast<std::size_t>(byte_count));
+  pb::Serialize(message, serialized.data());
+  CompressMessageBytes(serialized.data(), serialized.data() + byte_count,
+                       dictionary, output, search_depth);
+  return true;
+}
+
+// Decompresses the bytes written by CompressMessage() in the range |begin| to
+// |end| into |serialized|, and merges them into the |message|. Returns false if
+// the bytes are malformed, or the message fails to parse (see
+// MergeFromBuffer()).
+//
+// std::string_view and PackedFixedView fields will point into |serialized|,
+// and so it must outlive the |message| (and not be reused until then).
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool DecompressMessage(const uint8_t* begin,
+                                     const uint8_t* end,
+                                     const LzDictionary& dictionary,
+                                     std::vector<uint8_t>& serialized,
+                                     Message& message) {
+  const int32_t byte_count =
+      DecompressMessageBytes(begin, end, dictionary, serialized);
+  return byte_count >= 0 &&
+         MergeFromPaddedBuffer(serialized.data(),
+                               serialized.data() + byte_count, message);
+}
+
+// As above, but decompresses into a scratch buffer that is reused by the next
+// call on the same thread. So, this is only for a |Message| without view
+// fields.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] bool DecompressMessage(const uint8_t* begin,
+                                     const uint8_t* end,
+                                     const LzDictionary& dictionary,
+                                     Message& message) {
+  static_assert(!codec::HasViewFields<Message>(),
+                "Its view fields would point into a scratch buffer. Pass a "
+                "buffer that outlives the message instead.");
+  thread_local std::vector<uint8_t> serialized;
+  return DecompressMessage(begin, end, dictionary, serialized, message);
+}
+
+}  // namespace pb
@@ -0,0 +1,211 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/message_compression.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+
+namespace pb {
+namespace {
+
+struct Event {
+  enum Kind : int32_t { kClick = 0, kView = 1, kPurchase = 2 };
+
+  int64_t timestamp_us = 0;
+  Kind kind = kClick;
+  std::string page;
+  std::string user_agent;
+  std::vector<int32_t> item_ids;
+
+  using ProtobufFields = FieldList<Field<&Event::timestamp_us, 1>,
+                                   Field<&Event::kind, 2>,
+                                   Field<&Event::page, 3>,
+                                   Field<&Event::user_agent, 4>,
+                                   Field<&Event::item_ids, 5>>;
+};
+
+struct EventView {
+  std::string_view page;
+  std::vector<int32_t> item_ids;
+
+  using ProtobufFields =
+      FieldList<Field<&EventView::page, 3>, Field<&EventView::item_ids, 5>>;
+};
+
+// Returns events that share their strings and shape, but not their numbers.
+std::vector<Event> MakeEvents(int count, uint32_t seed) {
+  static const char* const kPages[] = {"/home", "/search?q=shoes",
+                                       "/cart", "/item/detail"};
+  static const char* const kUserAgents[] = {
+      "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/120.0",
+      "Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) Safari/604.1"};
+  std::mt19937 random(seed);
+  std::vector<Event> events(static_cast<std::size_t>(count));
+  for (Event& event : events) {
+    event.timestamp_us = 1700000000000000 + static_cast<int64_t>(random());
+    event.kind = static_cast<Event::Kind>(random() % 3);
+    event.page = kPages[random() % 4];
+    event.user_agent = kUserAgents[random() % 2];
+    for (int i = 0, n = static_cast<int>(random() % 4); i < n; ++i) {
+      event.item_ids.push_back(static_cast<int32_t>(random() % 100000));
+    }
+  }
+  return events;
+}
+
+std::vector<uint8_t> SerializeToVector(const Event& event) {
+  std::vector<uint8_t> bytes(
+      static_cast<std::size_t>(ComputeSerializedSize(event)));
+  Serialize(event, bytes.data());
+  return bytes;
+}
+
+LzDictionary TrainOnEvents(const std::vector<Event>& events,
+                           const LzDictionaryTrainingOptions& options) {
+  std::vector<std::vector<uint8_t>> serialized;
+  std::vector<BufferRange> samples;
+  for (const Event& event : events) {
+    serialized.push_back(SerializeToVector(event));
+  }
+  for (const std::vector<uint8_t>& bytes : serialized) {
+    samples.push_back(BufferRange{bytes.data(), bytes.data() + bytes.size()});
+  }
+  return TrainLzDictionary(samples, options);
+}
+
+void ExpectSameEvent(const Event& expected, const Event& actual) {
+  EXPECT_EQ(expected.timestamp_us, actual.timestamp_us);
+  EXPECT_EQ(expected.kind, actual.kind);
+  EXPECT_EQ(expected.page, actual.page);
+  EXPECT_EQ(expected.user_agent, actual.user_agent);
+  EXPECT_EQ(expected.item_ids, actual.item_ids);
+}
+
+TEST(MessageCompressionTest, TrainsADictionaryOfTheCommonStrings) {
+  const LzDictionary dictionary =
+      TrainOnEvents(MakeEvents(500, 1), LzDictionaryTrainingOptions());
+  EXPECT_GT(dictionary.bytes().size(), 100u);
+  EXPECT_LE(dictionary.bytes().size(), 16u * 1024);
+  const std::string bytes(dictionary.bytes().begin(), dictionary.bytes().end());
+  EXPECT_NE(std::string::npos, bytes.find("AppleWebKit"));
+  EXPECT_NE(std::string::npos, bytes.find("iPhone OS"));
+
+  LzDictionaryTrainingOptions options;
+  options.max_bytes = 256;
+  EXPECT_LE(TrainOnEvents(MakeEvents(500, 1), options).bytes().size(), 256u);
+
+  // Too few samples to find common strings in.
+  EXPECT_TRUE(TrainLzDictionary({}, options).bytes().empty());
+}
+
+TEST(MessageCompressionTest, RoundTripsMessages) {
+  const LzDictionary dictionary =
+      TrainOnEvents(MakeEvents(500, 1), LzDictionaryTrainingOptions());
+  const LzDictionary no_dictionary({});
+  std::size_t serialized_bytes = 0;
+  std::size_t compressed_bytes = 0;
+  std::size_t compressed_without_dictionary_bytes = 0;
+  for (const Event& event : MakeEvents(200, 2)) {
+    std::vector<uint8_t> compressed = {0xff};  // Appended to, not replaced.
+    ASSERT_TRUE(CompressMessage(event, dictionary, compressed));
+    ASSERT_EQ(0xff, compressed[0]);
+    Event decompressed;
+    ASSERT_TRUE(DecompressMessage(compressed.data() + 1,
+                                  compressed.data() + compressed.size(),
+                                  dictionary, decompressed));
+    ExpectSameEvent(event, decompressed);
+
+    std::vector<uint8_t> without_dictionary;
+    ASSERT_TRUE(CompressMessage(event, no_dictionary, without_dictionary));
+    Event decompressed_without_dictionary;
+    ASSERT_TRUE(DecompressMessage(
+        without_dictionary.data(),
+        without_dictionary.data() + without_dictionary.size(), no_dictionary,
+        decompressed_without_dictionary));
+    ExpectSameEvent(event, decompressed_without_dictionary);
+
+    serialized_bytes += SerializeToVector(event).size();
+    compressed_bytes += compressed.size() - 1;
+    compressed_without_dictionary_bytes += without_dictionary.size();
+  }
+  EXPECT_LT(compressed_bytes, serialized_bytes / 3);
+  EXPECT_GE(compressed_without_dictionary_bytes, serialized_bytes);
+}
+
+TEST(MessageCompressionTest, ViewFieldsPointIntoTheCallersBuffer) {
+  const std::vector<Event> events = MakeEvents(2, 3);
+  const LzDictionary dictionary =
+      TrainOnEvents(events, LzDictionaryTrainingOptions());
+  std::vector<uint8_t> first;
+  ASSERT_TRUE(CompressMessage(events[0], dictionary, first));
+  std::vector<uint8_t> second;
+  ASSERT_TRUE(CompressMessage(events[1], dictionary, second));
+
+  std::vector<uint8_t> first_buffer;
+  EventView first_view;
+  ASSERT_TRUE(DecompressMessage(first.data(), first.data() + first.size(),
+                                dictionary, first_buffer, first_view));
+  // Decompressing another message, into another buffer, leaves the first
+  // view intact.
+  std::vector<uint8_t> second_buffer;
+  EventView second_view;
+  ASSERT_TRUE(DecompressMessage(second.data(), second.data() + second.size(),
+                                dictionary, second_buffer, second_view));
+  EXPECT_EQ(events[0].page, first_view.page);
+  EXPECT_EQ(events[0].item_ids, first_view.item_ids);
+  EXPECT_EQ(events[1].page, second_view.page);
+  static_assert(codec::HasViewFields<EventView>());
+  static_assert(!codec::HasViewFields<Event>());
+}
+
+TEST(MessageCompressionTest, RejectsMalformedInput) {
+  const LzDictionary dictionary =
+      TrainOnEvents(MakeEvents(100, 1), LzDictionaryTrainingOptions());
+  const Event event = MakeEvents(1, 2)[0];
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(CompressMessage(event, dictionary, compressed));
+
+  Event decompressed;
+  // Truncated, and with the wrong size.
+  EXPECT_FALSE(DecompressMessage(compressed.data(),
+                                 compressed.data() + compressed.size() - 1,
+                                 dictionary, decompressed));
+  std::vector<uint8_t> wrong_size = compressed;
+  ++wrong_size[0];
+  EXPECT_FALSE(DecompressMessage(wrong_size.data(),
+                                 wrong_size.data() + wrong_size.size(),
+                                 dictionary, decompressed));
+  // With a different dictionary, the matches are into the wrong bytes (or out
+  // of bounds).
+  const LzDictionary other({'x', 'y', 'z'});
+  Event mismatched;
+  if (DecompressMessage(compressed.data(),
+                        compressed.data() + compressed.size(), other,
+                        mismatched)) {
+    EXPECT_NE(SerializeToVector(event), SerializeToVector(mismatched));
+  }
+  EXPECT_FALSE(DecompressMessage(compressed.data(), compressed.data(),
+                                 dictionary, decompressed));
+
+  // Random corruptions must never read or write out of bounds (see ASan runs).
+  std::mt19937 random(3);
+  for (int i = 0; i < 2000; ++i) {
+    std::vector<uint8_t> corrupted = compressed;
+    corrupted[random() % corrupted.size()] = static_cast<uint8_t>(random());
+    Event result;
+    static_cast<void>(DecompressMessage(corrupted.data(),
+                                        corrupted.data() + corrupted.size(),
+                                        dictionary, result));
+  }
+}
+
+}  // namespace
+}  // namespace pb
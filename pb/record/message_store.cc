@@ -0,0 +1,864 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/message_store.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_set>
+
+#include "pb/codec/crc32c.h"
+#include "pb/codec/endian.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/tag.h"
+#include "pb/codec/wire_type.h"
+
+namespace pb {
+
+namespace {
+
+// A segment file begins with a header:
+//
+//   magic u32, replaced segment count u32, segment id u64,
+//   replaced segment count x (segment id u64)
+//
+// followed by the framed records:
+//
+//   record size varint, CRC32C of the record u32, record
+//
+// where each record is a message with a key (field 1, bytes), a sequence
+// number (field 2, varint), and, unless it is a delete, the message (field 3,
+// bytes). All integers in the header and frames are little-endian.
+constexpr int kSegmentHeaderSize = 16;
+constexpr int kCrcSize = 4;
+
+// The most bytes in a frame before the message, other than the key: the record
+// size, the CRC32C, and the tags of the three fields, the key's size, the
+// sequence number, and the message's size.
+constexpr std::size_t kMaxFrameHeaderSize = 5 + kCrcSize + 3 + 5 + 10 + 5;
+
+constexpr uint32_t kSegmentMagic = 0x534d4250;  // "PBMS"
+
+constexpr int32_t kKeyFieldNumber = 1;
+constexpr int32_t kSequenceFieldNumber = 2;
+constexpr int32_t kMessageFieldNumber = 3;
+
+constexpr char kSegmentSuffix[] = ".pbseg";
+constexpr char kTempSuffix[] = ".tmp";
+
+// While merging, the live records are written out in chunks of about this
+// many bytes.
+constexpr std::size_t kMergeWriteBytes = 1024 * 1024;
+
+void StoreLittleEndian32(uint32_t value, uint8_t* p) {
+  if (!codec::IsLittleEndianArchitecture()) {
+    value = codec::ReverseBytes32(value);
+  }
+  std::memcpy(p, &value, sizeof(value));
+}
+
+void StoreLittleEndian64(uint64_t value, uint8_t* p) {
+  if (!codec::IsLittleEndianArchitecture()) {
+    value = codec::ReverseBytes64(value);
+  }
+  std::memcpy(p, &value, sizeof(value));
+}
+
+uint32_t LoadLittleEndian32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return codec::IsLittleEndianArchitecture() ? value
+                                             : codec::ReverseBytes32(value);
+}
+
+uint64_t LoadLittleEndian64(const uint8_t* p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return codec::IsLittleEndianArchitecture() ? value
+                                             : codec::ReverseBytes64(value);
+}
+
+int32_t ComputeVarintSize(uint64_t value) {
+  uint8_t buffer[codec::kMaxVarintSize];
+  return static_cast<int32_t>(codec::SerializeValue(value, buffer) - buffer);
+}
+
+bool WriteFullyAt(int fd,
+                  const uint8_t* data,
+                  std::size_t size,
+                  int64_t offset) {
+  while (size > 0) {
+    const ssize_t result = pwrite(fd, data, size, offset);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += result;
+    size -= static_cast<std::size_t>(result);
+    offset += result;
+  }
+  return true;
+}
+
+bool SyncDirectory(const std::string& directory) {
+  const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  const bool success = (fsync(fd) == 0);
+  close(fd);
+  return success;
+}
+
+// The fields of one framed record in a segment.
+struct ScannedRecord {
+  std::string_view key;
+  uint64_t sequence = 0;
+  int32_t record_size = 0;     // Of the frame.
+  int32_t message_offset = 0;  // From the start of the frame.
+  int32_t message_size = 0;
+  bool is_delete = true;
+};
+
+// Parses the frame at |begin|, extracting the key and sequence number from the
+// record's wire bytes without parsing the message. Returns the end of the
+// frame, or nullptr if it is torn or corrupt.
+const uint8_t* ParseFrame(const uint8_t* begin,
+                          const uint8_t* end,
+                          ScannedRecord& record) {
+  uint32_t byte_count;
+  const uint8_t* cursor = codec::ParseValue(begin, end, 0, byte_count);
+  if (!cursor || static_cast<uint64_t>(end - cursor) <
+                     uint64_t{kCrcSize} + byte_count) {
+    return nullptr;
+  }
+  const uint32_t crc = LoadLittleEndian32(cursor);
+  cursor += kCrcSize;
+  const uint8_t* const record_end = cursor + byte_count;
+  if (codec::ComputeCrc32c(cursor, record_end) != crc) {
+    return nullptr;
+  }
+
+  bool has_key = false;
+  bool has_sequence = false;
+  record.is_delete = true;
+  while (cursor != record_end) {
+    codec::Tag tag;
+    cursor = codec::ParseValue(cursor, record_end, 0, tag);
+    if (!cursor) {
+      return nullptr;
+    }
+    const codec::WireType wire_type = codec::GetWireTypeFromTag(tag);
+    const int32_t field_number = codec::GetFieldNumberFromTag(tag);
+    if (field_number == kSequenceFieldNumber &&
+        wire_type == codec::WireType::kVarint) {
+      cursor = codec::ParseValue(cursor, record_end, 0, record.sequence);
+      has_sequence = true;
+    } else if ((field_number == kKeyFieldNumber ||
+                field_number == kMessageFieldNumber) &&
+               wire_type == codec::WireType::kLengthDelimited) {
+      uint32_t size;
+      cursor = codec::ParseValue(cursor, record_end, 0, size);
+      if (!cursor || static_cast<uint32_t>(record_end - cursor) < size) {
+        return nullptr;
+      }
+      if (field_number == kKeyFieldNumber) {
+        record.key =
+            std::string_view(reinterpret_cast<const char*>(cursor), size);
+        has_key = true;
+      } else {
+        record.message_offset = static_cast<int32_t>(cursor - begin);
+        record.message_size = static_cast<int32_t>(size);
+        record.is_delete = false;
+      }
+      cursor += size;
+    } else {
+      cursor = codec::SkipValueAfterTag(cursor, record_end, 0, wire_type);
+    }
+    if (!cursor) {
+      return nullptr;
+    }
+  }
+  if (!has_key || !has_sequence) {
+    return nullptr;
+  }
+  record.record_size = static_cast<int32_t>(record_end - begin);
+  return record_end;
+}
+
+// Calls |handler| for each valid record in the |data| of a segment, stopping
+// at the first that is torn or corrupt.
+template <typename Handler>
+void ForEachFrame(const uint8_t* data,
+                  int64_t header_size,
+                  int64_t size,
+                  Handler&& handler) {
+  const uint8_t* const end = data + size;
+  const uint8_t* cursor = data + header_size;
+  ScannedRecord record;
+  while (cursor != end) {
+    const uint8_t* const next = ParseFrame(cursor, end, record);
+    if (!next) {
+      return;
+    }
+    handler(static_cast<int64_t>(cursor - data), record);
+    cursor = next;
+  }
+}
+
+}  // namespace
+
+struct SegmentLog::Segment {
+  Segment(uint64_t id,
+          int fd,
+          const uint8_t* data,
+          std::size_t mapped_size,
+          int64_t header_size,
+          int64_t size)
+      : id(id),
+        fd(fd),
+        data(data),
+        mapped_size(mapped_size),
+        header_size(header_size),
+        size(size) {}
+
+  Segment(const Segment&) = delete;
+  Segment& operator=(const Segment&) = delete;
+
+  ~Segment() {
+    munmap(const_cast<uint8_t*>(data), mapped_size);
+    close(fd);
+  }
+
+  const uint64_t id;
+  const int fd;
+  const uint8_t* const data;
+  const std::size_t mapped_size;  // May be more than the file's size.
+  const int64_t header_size;
+  int64_t size;  // Of the header and the records.
+  int64_t live_bytes = 0;
+};
+
+namespace {
+
+// Creates the temporary file for a new segment, and writes its header.
+// Returns the file descriptor, or -1 on error.
+int CreateSegmentFile(const std::string& temp_path,
+                      uint64_t segment_id,
+                      const std::vector<uint64_t>& replaced_ids,
+                      int64_t& header_size) {
+  const int fd =
+      open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  std::vector<uint8_t> header(kSegmentHeaderSize + 8 * replaced_ids.size());
+  StoreLittleEndian32(kSegmentMagic, header.data());
+  StoreLittleEndian32(static_cast<uint32_t>(replaced_ids.size()),
+                      header.data() + 4);
+  StoreLittleEndian64(segment_id, header.data() + 8);
+  for (std::size_t i = 0; i < replaced_ids.size(); ++i) {
+    StoreLittleEndian64(replaced_ids[i],
+                        header.data() + kSegmentHeaderSize + 8 * i);
+  }
+  if (!WriteFullyAt(fd, header.data(), header.size(), 0)) {
+    close(fd);
+    unlink(temp_path.c_str());
+    return -1;
+  }
+  header_size = static_cast<int64_t>(header.size());
+  return fd;
+}
+
+// Syncs the temporary file for a new segment, and renames it to its final
+// |path|. On error, removes the file, and closes |fd|.
+bool PublishSegmentFile(int fd,
+                        const std::string& temp_path,
+                        const std::string& path,
+                        const std::string& directory) {
+  if (fdatasync(fd) == 0 && rename(temp_path.c_str(), path.c_str()) == 0) {
+    if (SyncDirectory(directory)) {
+      return true;
+    }
+    unlink(path.c_str());
+  } else {
+    unlink(temp_path.c_str());
+  }
+  close(fd);
+  return false;
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<SegmentLog> SegmentLog::Open(const std::string& directory,
+                                             const Options& options) {
+  std::unique_ptr<SegmentLog> log(new SegmentLog(directory, options));
+  if (!log->Recover()) {
+    return nullptr;
+  }
+  if (options.background_compaction) {
+    log->compaction_thread_ =
+        std::thread(&SegmentLog::CompactSegments, log.get());
+  }
+  return log;
+}
+
+SegmentLog::SegmentLog(std::string directory, const Options& options)
+    : directory_(std::move(directory)), options_(options) {
+  assert(options_.segment_bytes > 0);
+  assert(options_.recovery_threads >= 0);
+}
+
+SegmentLog::~SegmentLog() {
+  {
+    std::lock_guard<std::mutex> lock(compaction_thread_mutex_);
+    closing_ = true;
+  }
+  compaction_wanted_.notify_one();
+  if (compaction_thread_.joinable()) {
+    compaction_thread_.join();
+  }
+}
+
+bool SegmentLog::Put(std::string_view key,
+                     int32_t byte_count,
+                     SerializeFunction serialize,
+                     const void* source) {
+  assert(serialize);
+  return Append(key, byte_count, serialize, source);
+}
+
+bool SegmentLog::Delete(std::string_view key) {
+  return Append(key, 0, nullptr, nullptr);
+}
+
+bool SegmentLog::Read(std::string_view key,
+                      ParseFunction parse,
+                      void* target) const {
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  const auto it = index_.find(std::string(key));
+  if (it == index_.end()) {
+    return false;
+  }
+  const Location& location = it->second;
+  const Segment& segment = *segments_.find(location.segment_id)->second;
+  const uint8_t* const begin =
+      segment.data + location.record_offset + location.message_offset;
+  return parse(begin, begin + location.message_size, target);
+}
+
+bool SegmentLog::Contains(std::string_view key) const {
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  return index_.count(std::string(key)) > 0;
+}
+
+SegmentLog::Stats SegmentLog::GetStats() const {
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  Stats stats;
+  stats.key_count = static_cast<int64_t>(index_.size());
+  stats.segment_count = static_cast<int>(segments_.size());
+  for (const auto& entry : segments_) {
+    const Segment& segment = *entry.second;
+    stats.record_bytes += segment.size - segment.header_size;
+    stats.live_record_bytes += segment.live_bytes;
+  }
+  return stats;
+}
+
+bool SegmentLog::Sync() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  return !failed_ && fdatasync(active_segment_->fd) == 0;
+}
+
+bool SegmentLog::Compact() {
+  std::lock_guard<std::mutex> compaction_lock(compaction_mutex_);
+
+  // The sealed segments are never written again, and only a merge removes
+  // them. So, they can be read without holding |index_mutex_|.
+  std::vector<const Segment*> inputs;
+  std::vector<uint64_t> input_ids;
+  {
+    std::shared_lock<std::shared_mutex> lock(index_mutex_);
+    int64_t garbage_bytes = 0;
+    for (const auto& [id, segment] : segments_) {
+      if (id != active_segment_id_) {
+        inputs.push_back(segment.get());
+        input_ids.push_back(id);
+        garbage_bytes +=
+            segment->size - segment->header_size - segment->live_bytes;
+      }
+    }
+    if (garbage_bytes == 0) {
+      return true;
+    }
+  }
+
+  const uint64_t output_id = next_segment_id_++;
+  const std::string path = GetSegmentPath(output_id);
+  const std::string temp_path = path + kTempSuffix;
+  int64_t header_size;
+  const int fd =
+      CreateSegmentFile(temp_path, output_id, input_ids, header_size);
+  if (fd < 0) {
+    return false;
+  }
+  int64_t output_size = header_size;
+
+  // Copy the records the index still points to. Deletes are dropped: Every
+  // older record for their keys is in the segments being merged, and so is
+  // dropped too.
+  struct Move {
+    std::string key;
+    uint64_t from_segment_id;
+    int64_t from_offset;
+    int64_t to_offset;
+  };
+  std::vector<Move> moves;
+  std::vector<std::pair<int64_t, ScannedRecord>> records;
+  std::vector<uint8_t> buffer;
+  bool success = true;
+  for (const Segment* input : inputs) {
+    records.clear();
+    ForEachFrame(input->data, input->header_size, input->size,
+                 [&](int64_t offset, const ScannedRecord& record) {
+                   if (!record.is_delete) {
+                     records.emplace_back(offset, record);
+                   }
+                 });
+    {
+      std::shared_lock<std::shared_mutex> lock(index_mutex_);
+      for (const auto& [offset, record] : records) {
+        std::string key(record.key);
+        const auto it = index_.find(key);
+        if (it == index_.end() || it->second.segment_id != input->id ||
+            it->second.record_offset != offset) {
+          continue;
+        }
+        const int64_t to_offset =
+            output_size + static_cast<int64_t>(buffer.size());
+        moves.push_back(Move{std::move(key), input->id, offset, to_offset});
+        buffer.insert(buffer.end(), input->data + offset,
+                      input->data + offset + record.record_size);
+      }
+    }
+    if (buffer.size() >= kMergeWriteBytes) {
+      success &= WriteFullyAt(fd, buffer.data(), buffer.size(), output_size);
+      output_size += static_cast<int64_t>(buffer.size());
+      buffer.clear();
+    }
+  }
+  success &= WriteFullyAt(fd, buffer.data(), buffer.size(), output_size);
+  output_size += static_cast<int64_t>(buffer.size());
+  if (!success) {
+    close(fd);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (!PublishSegmentFile(fd, temp_path, path, directory_)) {
+    return false;
+  }
+  void* const mapping =
+      mmap(nullptr, static_cast<std::size_t>(output_size), PROT_READ,
+           MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    unlink(path.c_str());
+    return false;
+  }
+  auto output = std::make_unique<Segment>(
+      output_id, fd, static_cast<const uint8_t*>(mapping),
+      static_cast<std::size_t>(output_size), header_size, output_size);
+
+  {
+    std::unique_lock<std::shared_mutex> lock(index_mutex_);
+    // Skip the keys that were written while merging.
+    for (const Move& move : moves) {
+      const auto it = index_.find(move.key);
+      if (it != index_.end() &&
+          it->second.segment_id == move.from_segment_id &&
+          it->second.record_offset == move.from_offset) {
+        it->second.segment_id = output_id;
+        it->second.record_offset = move.to_offset;
+        output->live_bytes += it->second.record_size;
+      }
+    }
+    for (const uint64_t id : input_ids) {
+      segments_.erase(id);
+    }
+    segments_.emplace(output_id, std::move(output));
+  }
+  // If these are not all removed (e.g., after a crash), the next Open() will
+  // remove them, because the merged segment replaces them.
+  for (const uint64_t id : input_ids) {
+    unlink(GetSegmentPath(id).c_str());
+  }
+  return true;
+}
+
+bool SegmentLog::Recover() {
+  // Find the segments, and remove any left unfinished.
+  DIR* const dir = opendir(directory_.c_str());
+  if (!dir) {
+    return false;
+  }
+  const std::string segment_suffix = kSegmentSuffix;
+  const std::string temp_suffix = segment_suffix + kTempSuffix;
+  const auto has_suffix = [](const std::string& name,
+                             const std::string& suffix) {
+    return name.size() > suffix.size() &&
+           name.compare(name.size() - suffix.size(), suffix.size(), suffix) ==
+               0;
+  };
+  std::vector<uint64_t> ids;
+  while (const dirent* const entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (has_suffix(name, temp_suffix)) {
+      unlink((directory_ + "/" + name).c_str());
+    } else if (has_suffix(name, segment_suffix)) {
+      // The name is the id, as 16 hex digits.
+      const std::string stem =
+          name.substr(0, name.size() - segment_suffix.size());
+      if (stem.size() == 16 &&
+          stem.find_first_not_of("0123456789abcdef") == std::string::npos) {
+        ids.push_back(std::strtoull(stem.c_str(), nullptr, 16));
+      }
+    }
+  }
+  closedir(dir);
+
+  // Map every segment, and check its header.
+  std::unordered_set<uint64_t> replaced_ids;
+  uint64_t max_id = 0;
+  for (const uint64_t id : ids) {
+    max_id = std::max(max_id, id);
+    const int fd = open(GetSegmentPath(id).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < kSegmentHeaderSize) {
+      close(fd);
+      return false;
+    }
+    const auto size = static_cast<std::size_t>(status.st_size);
+    void* const mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    const auto* const data = static_cast<const uint8_t*>(mapping);
+    const uint32_t replaced_count = LoadLittleEndian32(data + 4);
+    const int64_t header_size =
+        kSegmentHeaderSize + 8 * static_cast<int64_t>(replaced_count);
+    auto segment = std::make_unique<Segment>(id, fd, data, size, header_size,
+                                             status.st_size);
+    if (LoadLittleEndian32(data) != kSegmentMagic ||
+        LoadLittleEndian64(data + 8) != id || header_size > status.st_size) {
+      return false;
+    }
+    for (uint32_t i = 0; i < replaced_count; ++i) {
+      replaced_ids.insert(
+          LoadLittleEndian64(data + kSegmentHeaderSize + 8 * i));
+    }
+    segments_.emplace(id, std::move(segment));
+  }
+  for (const uint64_t id : replaced_ids) {
+    if (segments_.erase(id) > 0) {
+      unlink(GetSegmentPath(id).c_str());
+    }
+  }
+  // Also remove the segments with no records (e.g., the active segment of a
+  // log that was opened, and then closed without any writes). Their ids are
+  // not reused, because |max_id| still counts them.
+  for (auto it = segments_.begin(); it != segments_.end();) {
+    if (it->second->size == it->second->header_size) {
+      unlink(GetSegmentPath(it->first).c_str());
+      it = segments_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // Scan the segments in parallel, each thread keeping the latest record for
+  // each key it sees. Then, merge what the threads found.
+  struct Latest {
+    uint64_t sequence;
+    Location location;
+    bool is_delete;
+  };
+  using LatestByKey = std::unordered_map<std::string, Latest>;
+  std::vector<Segment*> to_scan;
+  for (const auto& entry : segments_) {
+    to_scan.push_back(entry.second.get());
+  }
+  int thread_count = options_.recovery_threads;
+  if (thread_count == 0) {
+    thread_count = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  thread_count = std::clamp(thread_count, 1,
+                            std::max(1, static_cast<int>(to_scan.size())));
+  std::vector<LatestByKey> found(static_cast<std::size_t>(thread_count));
+  std::vector<uint64_t> max_sequences(found.size(), 0);
+  std::atomic<std::size_t> next_segment{0};
+  const auto scan = [&](std::size_t thread_index) {
+    LatestByKey& latest_by_key = found[thread_index];
+    uint64_t& max_sequence = max_sequences[thread_index];
+    for (std::size_t i; (i = next_segment++) < to_scan.size();) {
+      const Segment& segment = *to_scan[i];
+      ForEachFrame(
+          segment.data, segment.header_size, segment.size,
+          [&](int64_t offset, const ScannedRecord& record) {
+            const Latest latest{
+                record.sequence,
+                Location{segment.id, offset, record.record_size,
+                         record.message_offset, record.message_size},
+                record.is_delete};
+            const auto [it, inserted] =
+                latest_by_key.try_emplace(std::string(record.key), latest);
+            if (!inserted && it->second.sequence < record.sequence) {
+              it->second = latest;
+            }
+            max_sequence = std::max(max_sequence, record.sequence);
+          });
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < thread_count; ++i) {
+    threads.emplace_back(scan, static_cast<std::size_t>(i));
+  }
+  scan(0);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (std::size_t i = 1; i < found.size(); ++i) {
+    for (auto& [key, latest] : found[i]) {
+      const auto [it, inserted] = found[0].try_emplace(key, latest);
+      if (!inserted && it->second.sequence < latest.sequence) {
+        it->second = latest;
+      }
+    }
+    found[i].clear();
+  }
+
+  index_.reserve(found[0].size());
+  for (auto& [key, latest] : found[0]) {
+    if (!latest.is_delete) {
+      segments_[latest.location.segment_id]->live_bytes +=
+          latest.location.record_size;
+      index_.emplace(key, latest.location);
+    }
+  }
+  if (!ids.empty()) {
+    next_sequence_ =
+        *std::max_element(max_sequences.begin(), max_sequences.end()) + 1;
+    next_segment_id_ = max_id + 1;
+  }
+
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  return StartSegment(0);
+}
+
+bool SegmentLog::Append(std::string_view key,
+                        int32_t byte_count,
+                        SerializeFunction serialize,
+                        const void* source) {
+  if (key.size() > static_cast<std::size_t>(codec::kMaxSerializedSize) ||
+      byte_count > codec::kMaxSerializedSize) {
+    return false;
+  }
+  const bool is_delete = (serialize == nullptr);
+
+  // Serialize the message before taking the lock, into a per-thread buffer,
+  // leaving room before it for the rest of the frame. That is written once
+  // the sequence number is known, since its size depends on it.
+  thread_local std::vector<uint8_t> frame_buffer;
+  const std::size_t max_header_size = kMaxFrameHeaderSize + key.size();
+  frame_buffer.resize(max_header_size + static_cast<std::size_t>(byte_count));
+  uint8_t* const message = frame_buffer.data() + max_header_size;
+  if (!is_delete) {
+    serialize(source, message);
+  }
+
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+  if (failed_) {
+    return false;
+  }
+  if (is_delete && !Contains(key)) {
+    return true;
+  }
+
+  // Frame the record, ending just before the |message|.
+  const uint64_t sequence = next_sequence_;
+  const auto key_size = static_cast<int32_t>(key.size());
+  int32_t record_size = 1 + ComputeVarintSize(key.size()) + key_size + 1 +
+                        ComputeVarintSize(sequence);
+  if (!is_delete) {
+    record_size += 1 + ComputeVarintSize(static_cast<uint32_t>(byte_count)) +
+                   byte_count;
+  }
+  const int32_t frame_size =
+      ComputeVarintSize(static_cast<uint32_t>(record_size)) + kCrcSize +
+      record_size;
+  const int32_t message_offset = frame_size - byte_count;
+  uint8_t* const frame = message - message_offset;
+  uint8_t* cursor =
+      codec::SerializeValue(static_cast<uint32_t>(record_size), frame);
+  uint8_t* const crc = cursor;
+  uint8_t* const record = cursor + kCrcSize;
+  cursor = record;
+  *cursor++ = static_cast<uint8_t>(
+      codec::MakeTag(kKeyFieldNumber, codec::WireType::kLengthDelimited));
+  cursor = codec::SerializeValue(static_cast<uint32_t>(key_size), cursor);
+  std::memcpy(cursor, key.data(), key.size());
+  cursor += key.size();
+  *cursor++ = static_cast<uint8_t>(
+      codec::MakeTag(kSequenceFieldNumber, codec::WireType::kVarint));
+  cursor = codec::SerializeValue(sequence, cursor);
+  if (!is_delete) {
+    *cursor++ = static_cast<uint8_t>(
+        codec::MakeTag(kMessageFieldNumber, codec::WireType::kLengthDelimited));
+    cursor = codec::SerializeValue(static_cast<uint32_t>(byte_count), cursor);
+  }
+  assert(cursor == message);
+  StoreLittleEndian32(codec::ComputeCrc32c(record, message + byte_count), crc);
+
+  // Write it to the active segment, or a new one if it is full.
+  if (active_segment_->size + frame_size >
+          static_cast<int64_t>(active_segment_->mapped_size) &&
+      !StartSegment(frame_size)) {
+    failed_ = true;
+    return false;
+  }
+  Segment& segment = *active_segment_;
+  const int64_t offset = segment.size;
+  if (!WriteFullyAt(segment.fd, frame, static_cast<std::size_t>(frame_size),
+                    offset) ||
+      (options_.sync && fdatasync(segment.fd) != 0)) {
+    failed_ = true;
+    return false;
+  }
+  ++next_sequence_;
+
+  std::unique_lock<std::shared_mutex> lock(index_mutex_);
+  segment.size += frame_size;
+  const auto it = index_.find(std::string(key));
+  if (it != index_.end()) {
+    segments_.find(it->second.segment_id)->second->live_bytes -=
+        it->second.record_size;
+  }
+  if (is_delete) {
+    index_.erase(it);
+    return true;
+  }
+  const Location location{segment.id, offset, frame_size, message_offset,
+                          byte_count};
+  if (it != index_.end()) {
+    it->second = location;
+  } else {
+    index_.emplace(key, location);
+  }
+  segment.live_bytes += frame_size;
+  return true;
+}
+
+bool SegmentLog::StartSegment(int64_t record_size) {
+  const uint64_t id = next_segment_id_++;
+  const std::string path = GetSegmentPath(id);
+  const std::string temp_path = path + kTempSuffix;
+  int64_t header_size;
+  const int fd = CreateSegmentFile(temp_path, id, {}, header_size);
+  if (fd < 0 || !PublishSegmentFile(fd, temp_path, path, directory_)) {
+    return false;
+  }
+  // Map the whole capacity now, so that the mapping never moves. Only the
+  // pages that have been written are ever read.
+  const auto mapped_size = static_cast<std::size_t>(
+      std::max(options_.segment_bytes, header_size + record_size));
+  void* const mapping =
+      mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    unlink(path.c_str());
+    return false;
+  }
+  // Reads of single records are scattered across the segment.
+  static_cast<void>(madvise(mapping, mapped_size, MADV_RANDOM));
+  auto segment =
+      std::make_unique<Segment>(id, fd, static_cast<const uint8_t*>(mapping),
+                                mapped_size, header_size, header_size);
+
+  const bool sealed_one = (active_segment_ != nullptr);
+  {
+    std::unique_lock<std::shared_mutex> lock(index_mutex_);
+    active_segment_ = segment.get();
+    active_segment_id_ = id;
+    segments_.emplace(id, std::move(segment));
+  }
+  if (sealed_one) {
+    {
+      std::lock_guard<std::mutex> lock(compaction_thread_mutex_);
+      compaction_requested_ = true;
+    }
+    compaction_wanted_.notify_one();
+  }
+  return true;
+}
+
+bool SegmentLog::ShouldCompact() const {
+  std::shared_lock<std::shared_mutex> lock(index_mutex_);
+  int64_t sealed_bytes = 0;
+  int64_t garbage_bytes = 0;
+  for (const auto& [id, segment] : segments_) {
+    if (id != active_segment_id_) {
+      const int64_t record_bytes = segment->size - segment->header_size;
+      sealed_bytes += record_bytes;
+      garbage_bytes += record_bytes - segment->live_bytes;
+    }
+  }
+  return garbage_bytes > 0 && garbage_bytes >= options_.min_compaction_bytes &&
+         static_cast<double>(garbage_bytes) >=
+             options_.compaction_garbage_ratio *
+                 static_cast<double>(sealed_bytes);
+}
+
+void SegmentLog::CompactSegments() {
+  std::unique_lock<std::mutex> lock(compaction_thread_mutex_);
+  for (;;) {
+    compaction_wanted_.wait(
+        lock, [this] { return compaction_requested_ || closing_; });
+    if (closing_) {
+      return;
+    }
+    compaction_requested_ = false;
+    lock.unlock();
+    // A merge that fails is retried once another segment is sealed.
+    if (ShouldCompact()) {
+      static_cast<void>(Compact());
+    }
+    lock.lock();
+  }
+}
+
+std::string SegmentLog::GetSegmentPath(uint64_t segment_id) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016" PRIx64 "%s", segment_id,
+                kSegmentSuffix);
+  return directory_ + "/" + name;
+}
+
+}  // namespace pb
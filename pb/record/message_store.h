@@ -0,0 +1,323 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/serialize.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+
+// A log of segment files, in one directory, that maps byte-string keys to the
+// wire bytes of messages. This is the type-erased part of MessageStore (see
+// below), which should be used instead.
+//
+// Each Put() or Delete() appends one record to the active segment: the key,
+// a sequence number, and the message (or, for a delete, no message). An
+// in-memory hash index maps each key to its latest record. Every segment is
+// memory-mapped, and so a read finds the record through the index and parses
+// the message straight from the mapping.
+//
+// Once the active segment reaches |segment_bytes|, it is sealed, and a new one
+// is started. Records in the sealed segments that have since been overwritten
+// or deleted are garbage; once enough of them are, a background thread merges
+// all the sealed segments into one new segment, with only the live records.
+// The merged segment lists the segments it replaces in its header, and only
+// becomes visible (by being renamed) once it has been written and synced. So,
+// recovery can always tell which segments are obsolete.
+//
+// Open() rebuilds the index by scanning all the segments, in parallel. Each
+// record is framed with its size and a CRC32C, and only the key and sequence
+// number are extracted from its wire bytes (the message is skipped over). A
+// record torn by a crash, and everything after it in its segment, is ignored.
+//
+// A SegmentLog is thread-safe. Reads run concurrently with each other, and
+// with the merging. Writes serialize their messages concurrently, but then
+// append them to the active segment one at a time.
+class SegmentLog {
+ public:
+  struct Options {
+    // The active segment is sealed once it has this many bytes.
+    int64_t segment_bytes = 64 * 1024 * 1024;
+
+    // If true, each write is made durable (with fdatasync()) before it
+    // returns. Otherwise, only Sync() does that.
+    bool sync = false;
+
+    // Whether a background thread merges the sealed segments. If false, only
+    // Compact() does that.
+    bool background_compaction = true;
+
+    // The sealed segments are merged once at least this fraction of their
+    // bytes, and at least |min_compaction_bytes|, are garbage.
+    double compaction_garbage_ratio = 0.5;
+    int64_t min_compaction_bytes = 1024 * 1024;
+
+    // The number of threads that scan the segments in Open(). Zero means one
+    // per hardware thread.
+    int recovery_threads = 0;
+  };
+
+  struct Stats {
+    int64_t key_count = 0;
+    int segment_count = 0;
+
+    // The bytes of records in all the segments, and those of the live ones.
+    int64_t record_bytes = 0;
+    int64_t live_record_bytes = 0;
+  };
+
+  // Serializes the object at |source| into |buffer|.
+  using SerializeFunction = void (*)(const void* source, uint8_t* buffer);
+
+  // Parses the wire bytes in the range |begin| to |end| into the object at
+  // |target|, and returns false if they are invalid.
+  using ParseFunction = bool (*)(const uint8_t* begin,
+                                 const uint8_t* end,
+                                 void* target);
+
+  // Opens the log in |directory|, which must exist (and is empty, for a new
+  // log), and recovers its index. Returns nullptr if the segments cannot be
+  // read, or a new segment cannot be created.
+  [[nodiscard]] static std::unique_ptr<SegmentLog> Open(
+      const std::string& directory,
+      const Options& options);
+
+  SegmentLog(const SegmentLog&) = delete;
+  SegmentLog& operator=(const SegmentLog&) = delete;
+
+  // Stops the background thread, and unmaps the segments.
+  ~SegmentLog();
+
+  // Appends a record mapping the |key| to a message of |byte_count| bytes,
+  // which |serialize| writes from |source|. Returns false if the write failed,
+  // in which case this and all later writes fail.
+  [[nodiscard]] bool Put(std::string_view key,
+                         int32_t byte_count,
+                         SerializeFunction serialize,
+                         const void* source);
+
+  // Appends a record deleting the |key|, if it is present. Returns false if
+  // the write failed.
+  [[nodiscard]] bool Delete(std::string_view key);
+
+  // Calls |parse| with the wire bytes of the message for the |key|. Returns
+  // false if the |key| is not present, or |parse| fails.
+  [[nodiscard]] bool Read(std::string_view key,
+                          ParseFunction parse,
+                          void* target) const;
+
+  [[nodiscard]] bool Contains(std::string_view key) const;
+
+  [[nodiscard]] Stats GetStats() const;
+
+  // Makes all the writes so far durable. Returns false on error.
+  [[nodiscard]] bool Sync();
+
+  // Merges the sealed segments now, if any of their records are garbage.
+  // Returns false on error, in which case the segments are left as they were.
+  [[nodiscard]] bool Compact();
+
+ private:
+  struct Segment;
+
+  // Where the latest record for a key is.
+  struct Location {
+    uint64_t segment_id;
+    int64_t record_offset;  // Of the frame, in the segment.
+    int32_t record_size;    // Of the frame.
+    int32_t message_offset;  // From |record_offset|.
+    int32_t message_size;
+  };
+
+  SegmentLog(std::string directory, const Options& options);
+
+  // Recovers the index from the segments in |directory_|, and then starts a
+  // new active segment.
+  [[nodiscard]] bool Recover();
+
+  // Appends the framed record to the active segment, and updates the index.
+  // A |serialize| of nullptr means a delete. The message is serialized before
+  // taking |write_mutex_|.
+  [[nodiscard]] bool Append(std::string_view key,
+                            int32_t byte_count,
+                            SerializeFunction serialize,
+                            const void* source);
+
+  // Seals the active segment, and starts a new one with room for at least
+  // |record_size| bytes. Requires |write_mutex_|.
+  [[nodiscard]] bool StartSegment(int64_t record_size);
+
+  // Returns true if enough of the sealed segments are garbage to merge them.
+  [[nodiscard]] bool ShouldCompact() const;
+
+  // The background thread's main loop.
+  void CompactSegments();
+
+  [[nodiscard]] std::string GetSegmentPath(uint64_t segment_id) const;
+
+  const std::string directory_;
+  const Options options_;
+
+  // Serializes the writers. Guards the active segment's contents, and
+  // |next_sequence_|.
+  std::mutex write_mutex_;
+  Segment* active_segment_ = nullptr;
+  uint64_t next_sequence_ = 0;
+  bool failed_ = false;
+
+  // Guards |index_|, |segments_| (and the live bytes in each), and
+  // |active_segment_id_|. Readers hold it while they parse from a segment, so
+  // a segment is only unmapped once there are none.
+  mutable std::shared_mutex index_mutex_;
+  std::unordered_map<std::string, Location> index_;
+  std::map<uint64_t, std::unique_ptr<Segment>> segments_;
+  uint64_t active_segment_id_ = 0;
+
+  std::atomic<uint64_t> next_segment_id_{0};
+
+  // Held while merging, so that only one merge runs at a time.
+  std::mutex compaction_mutex_;
+
+  std::mutex compaction_thread_mutex_;
+  std::condition_variable compaction_wanted_;
+  bool compaction_requested_ = false;
+  bool closing_ = false;
+  std::thread compaction_thread_;
+};
+
+// A persistent map from keys to messages, which writes each change as one
+// record, rather than re-serializing the whole collection. |Key| is an integer
+// type, or a string type (anything convertible to std::string_view, such as
+// std::string). See SegmentLog (above) for how it works. Example:
+//
+//   auto store = pb::MessageStore<int64_t, Account>::Open("/data/accounts");
+//   if (!store) { ... }
+//   if (!store->Put(account.id, account)) { ... }
+//   ...
+//   Account account;
+//   if (store->Get(id, account)) { ... }
+//   if (!store->Delete(id)) { ... }
+//
+// A MessageStore is thread-safe. The |Message| may not have std::string_view
+// or PackedFixedView fields: Get() parses straight from a segment's mapping,
+// which a merge later unmaps, and so those fields would be left dangling.
+template <typename Key, typename Message>
+class MessageStore {
+  static_assert((std::is_integral_v<Key> && !std::is_same_v<Key, bool>) ||
+                    std::is_convertible_v<const Key&, std::string_view>,
+                "The key must be an integer or a string.");
+  static_assert(!codec::HasViewFields<Message>(),
+                "View fields would point into memory that is later unmapped.");
+
+ public:
+  using Options = SegmentLog::Options;
+  using Stats = SegmentLog::Stats;
+
+  // See SegmentLog::Open().
+  [[nodiscard]] static std::unique_ptr<MessageStore> Open(
+      const std::string& directory,
+      const Options& options = Options()) {
+    std::unique_ptr<SegmentLog> log = SegmentLog::Open(directory, options);
+    if (!log) {
+      return nullptr;
+    }
+    return std::unique_ptr<MessageStore>(new MessageStore(std::move(log)));
+  }
+
+  MessageStore(const MessageStore&) = delete;
+  MessageStore& operator=(const MessageStore&) = delete;
+
+  // Stores the |message| for the |key|, replacing any previous one. Returns
+  // false if the |message| could not be serialized, or the write failed.
+  [[nodiscard]] bool Put(const Key& key, const Message& message) {
+    const int32_t byte_count = ComputeSerializedSize(message);
+    if (byte_count < 0) {
+      return false;
+    }
+    uint8_t buffer[codec::kMaxVarintSize];
+    return log_->Put(EncodeKey(key, buffer), byte_count,
+                     &SerializeMessage, &message);
+  }
+
+  // Removes the message for the |key|, if any. Returns false if the write
+  // failed.
+  [[nodiscard]] bool Delete(const Key& key) {
+    uint8_t buffer[codec::kMaxVarintSize];
+    return log_->Delete(EncodeKey(key, buffer));
+  }
+
+  // Replaces the |message| with the one stored for the |key|. Returns false if
+  // there is none, or it could not be parsed.
+  [[nodiscard]] bool Get(const Key& key, Message& message) const {
+    uint8_t buffer[codec::kMaxVarintSize];
+    return log_->Read(EncodeKey(key, buffer), &ParseMessage, &message);
+  }
+
+  [[nodiscard]] bool Contains(const Key& key) const {
+    uint8_t buffer[codec::kMaxVarintSize];
+    return log_->Contains(EncodeKey(key, buffer));
+  }
+
+  [[nodiscard]] int64_t size() const { return log_->GetStats().key_count; }
+  [[nodiscard]] Stats GetStats() const { return log_->GetStats(); }
+
+  // See SegmentLog::Sync() and SegmentLog::Compact().
+  [[nodiscard]] bool Sync() { return log_->Sync(); }
+  [[nodiscard]] bool Compact() { return log_->Compact(); }
+
+ private:
+  explicit MessageStore(std::unique_ptr<SegmentLog> log)
+      : log_(std::move(log)) {}
+
+  // Returns the bytes of the |key|: for an integer, its varint encoding (in
+  // |buffer|); for a string, its contents.
+  static std::string_view EncodeKey(
+      const Key& key,
+      uint8_t (&buffer)[codec::kMaxVarintSize]) {
+    if constexpr (std::is_integral_v<Key>) {
+      const uint8_t* const end =
+          codec::SerializeValue(static_cast<uint64_t>(key), buffer);
+      return std::string_view(reinterpret_cast<const char*>(buffer),
+                              static_cast<std::size_t>(end - buffer));
+    } else {
+      return std::string_view(key);
+    }
+  }
+
+  static void SerializeMessage(const void* source, uint8_t* buffer) {
+    pb::Serialize(*static_cast<const Message*>(source), buffer);
+  }
+
+  static bool ParseMessage(const uint8_t* begin,
+                           const uint8_t* end,
+                           void* target) {
+    Message& message = *static_cast<Message*>(target);
+    message = Message();
+    return MergeFromBuffer(begin, end, message);
+  }
+
+  const std::unique_ptr<SegmentLog> log_;
+};
+
+}  // namespace pb
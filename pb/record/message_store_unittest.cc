@@ -0,0 +1,351 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/message_store.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+
+namespace pb {
+namespace {
+
+struct Account {
+  int64_t id = 0;
+  std::string name;
+  std::vector<int32_t> scores;
+
+  using ProtobufFields = FieldList<Field<&Account::id, 1>,
+                                   Field<&Account::name, 2>,
+                                   Field<&Account::scores, 3>>;
+};
+
+Account MakeAccount(int64_t id, int version = 0) {
+  Account account;
+  account.id = id;
+  account.name = "account " + std::to_string(id) + " v" +
+                 std::to_string(version);
+  account.scores = {static_cast<int32_t>(id), version};
+  return account;
+}
+
+// A temporary directory, removed (with its files) on destruction.
+class TempDirectory {
+ public:
+  TempDirectory() {
+    char path[] = "/tmp/pb_message_store_unittest_XXXXXX";
+    EXPECT_NE(nullptr, mkdtemp(path));
+    path_ = path;
+  }
+  ~TempDirectory() {
+    for (const std::string& name : ListFiles()) {
+      unlink((path_ + "/" + name).c_str());
+    }
+    rmdir(path_.c_str());
+  }
+
+  const std::string& path() const { return path_; }
+
+  std::vector<std::string> ListFiles() const {
+    std::vector<std::string> names;
+    if (DIR* const dir = opendir(path_.c_str())) {
+      while (const dirent* const entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name != "." && name != "..") {
+          names.push_back(name);
+        }
+      }
+      closedir(dir);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+  }
+
+  std::string ReadFile(const std::string& name) const {
+    std::ifstream stream(path_ + "/" + name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(stream), {});
+  }
+
+  void WriteFile(const std::string& name, const std::string& contents) const {
+    std::ofstream stream(path_ + "/" + name,
+                         std::ios::binary | std::ios::trunc);
+    stream << contents;
+  }
+
+ private:
+  std::string path_;
+};
+
+using AccountStore = MessageStore<int64_t, Account>;
+
+AccountStore::Options MakeTestOptions() {
+  AccountStore::Options options;
+  options.segment_bytes = 512;
+  options.background_compaction = false;
+  options.recovery_threads = 3;
+  return options;
+}
+
+void ExpectAccount(const AccountStore& store, int64_t id, int version) {
+  Account account;
+  ASSERT_TRUE(store.Get(id, account)) << id;
+  const Account expected = MakeAccount(id, version);
+  EXPECT_EQ(expected.id, account.id);
+  EXPECT_EQ(expected.name, account.name);
+  EXPECT_EQ(expected.scores, account.scores);
+}
+
+TEST(MessageStoreTest, PutsGetsAndDeletes) {
+  TempDirectory directory;
+  const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+  ASSERT_TRUE(store);
+
+  Account account;
+  EXPECT_FALSE(store->Get(1, account));
+  ASSERT_TRUE(store->Put(1, MakeAccount(1)));
+  ASSERT_TRUE(store->Put(-2, MakeAccount(-2)));
+  ExpectAccount(*store, 1, 0);
+  ExpectAccount(*store, -2, 0);
+  EXPECT_EQ(2, store->size());
+
+  // Get() replaces the whole message, rather than merging into it.
+  ASSERT_TRUE(store->Put(1, MakeAccount(1, 1)));
+  ExpectAccount(*store, 1, 1);
+
+  ASSERT_TRUE(store->Delete(1));
+  EXPECT_FALSE(store->Contains(1));
+  EXPECT_FALSE(store->Get(1, account));
+  EXPECT_TRUE(store->Contains(-2));
+  EXPECT_EQ(1, store->size());
+
+  // Deleting an absent key writes nothing.
+  const int64_t record_bytes = store->GetStats().record_bytes;
+  ASSERT_TRUE(store->Delete(1));
+  EXPECT_EQ(record_bytes, store->GetStats().record_bytes);
+}
+
+TEST(MessageStoreTest, SupportsStringKeys) {
+  TempDirectory directory;
+  const auto store = MessageStore<std::string, Account>::Open(
+      directory.path(), MakeTestOptions());
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(store->Put("alice", MakeAccount(1)));
+  ASSERT_TRUE(store->Put("bob", MakeAccount(2)));
+  ASSERT_TRUE(store->Put(std::string(100, 'x'), MakeAccount(3)));
+  ASSERT_TRUE(store->Delete("bob"));
+
+  Account account;
+  ASSERT_TRUE(store->Get("alice", account));
+  EXPECT_EQ(1, account.id);
+  ASSERT_TRUE(store->Get(std::string(100, 'x'), account));
+  EXPECT_EQ(3, account.id);
+  EXPECT_FALSE(store->Get("bob", account));
+  EXPECT_FALSE(store->Get("", account));
+}
+
+TEST(MessageStoreTest, RecoversTheLatestRecordForEachKey) {
+  TempDirectory directory;
+  {
+    const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+    ASSERT_TRUE(store);
+    for (int version = 0; version < 3; ++version) {
+      for (int64_t id = 0; id < 50; ++id) {
+        ASSERT_TRUE(store->Put(id, MakeAccount(id, version)));
+      }
+    }
+    for (int64_t id = 0; id < 50; id += 5) {
+      ASSERT_TRUE(store->Delete(id));
+    }
+    ASSERT_TRUE(store->Put(10, MakeAccount(10, 7)));
+    ASSERT_TRUE(store->Sync());
+    EXPECT_GT(store->GetStats().segment_count, 10);
+  }
+
+  const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+  ASSERT_TRUE(store);
+  EXPECT_EQ(41, store->size());
+  for (int64_t id = 0; id < 50; ++id) {
+    if (id == 10) {
+      ExpectAccount(*store, id, 7);
+    } else if (id % 5 == 0) {
+      EXPECT_FALSE(store->Contains(id)) << id;
+    } else {
+      ExpectAccount(*store, id, 2);
+    }
+  }
+
+  // Writes continue from where the recovered log left off.
+  ASSERT_TRUE(store->Put(0, MakeAccount(0, 9)));
+  ExpectAccount(*store, 0, 9);
+}
+
+TEST(MessageStoreTest, CompactionKeepsOnlyLiveRecords) {
+  TempDirectory directory;
+  {
+    const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+    ASSERT_TRUE(store);
+    for (int version = 0; version < 4; ++version) {
+      for (int64_t id = 0; id < 30; ++id) {
+        ASSERT_TRUE(store->Put(id, MakeAccount(id, version)));
+      }
+    }
+    for (int64_t id = 0; id < 30; id += 3) {
+      ASSERT_TRUE(store->Delete(id));
+    }
+    const AccountStore::Stats before = store->GetStats();
+    ASSERT_TRUE(store->Compact());
+    const AccountStore::Stats after = store->GetStats();
+    EXPECT_EQ(20, after.key_count);
+    EXPECT_LT(after.segment_count, before.segment_count);
+    EXPECT_LT(after.record_bytes, before.record_bytes / 3);
+    EXPECT_EQ(before.live_record_bytes, after.live_record_bytes);
+
+    for (int64_t id = 0; id < 30; ++id) {
+      if (id % 3 == 0) {
+        EXPECT_FALSE(store->Contains(id)) << id;
+      } else {
+        ExpectAccount(*store, id, 3);
+      }
+    }
+    // The compacted records can still be overwritten and deleted.
+    ASSERT_TRUE(store->Put(1, MakeAccount(1, 5)));
+    ASSERT_TRUE(store->Delete(2));
+  }
+
+  // The deletes that were dropped by the merge stay deleted.
+  const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+  ASSERT_TRUE(store);
+  EXPECT_EQ(19, store->size());
+  ExpectAccount(*store, 1, 5);
+  EXPECT_FALSE(store->Contains(2));
+  EXPECT_FALSE(store->Contains(3));
+  ExpectAccount(*store, 4, 3);
+}
+
+TEST(MessageStoreTest, IgnoresSegmentsReplacedByAMerge) {
+  TempDirectory directory;
+  std::vector<std::pair<std::string, std::string>> old_segments;
+  {
+    const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+    ASSERT_TRUE(store);
+    for (int64_t id = 0; id < 20; ++id) {
+      ASSERT_TRUE(store->Put(id, MakeAccount(id)));
+    }
+    for (int64_t id = 0; id < 20; id += 2) {
+      ASSERT_TRUE(store->Delete(id));
+    }
+    for (int64_t id = 0; id < 20; ++id) {
+      ASSERT_TRUE(store->Put(100 + id, MakeAccount(100 + id)));
+    }
+    for (const std::string& name : directory.ListFiles()) {
+      old_segments.emplace_back(name, directory.ReadFile(name));
+    }
+    ASSERT_TRUE(store->Compact());
+  }
+
+  // Put back the segments that the merge removed, as if it had crashed just
+  // after renaming the merged segment.
+  for (const auto& [name, contents] : old_segments) {
+    directory.WriteFile(name, contents);
+  }
+  const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+  ASSERT_TRUE(store);
+  EXPECT_EQ(30, store->size());
+  for (int64_t id = 0; id < 20; ++id) {
+    EXPECT_EQ(id % 2 != 0, store->Contains(id)) << id;
+    ExpectAccount(*store, 100 + id, 0);
+  }
+  const AccountStore::Stats stats = store->GetStats();
+  EXPECT_EQ(stats.live_record_bytes, stats.record_bytes);
+}
+
+TEST(MessageStoreTest, IgnoresATornRecord) {
+  TempDirectory directory;
+  {
+    const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+    ASSERT_TRUE(store);
+    ASSERT_TRUE(store->Put(1, MakeAccount(1)));
+    ASSERT_TRUE(store->Put(2, MakeAccount(2)));
+  }
+  // Cut the last record short.
+  const std::vector<std::string> names = directory.ListFiles();
+  ASSERT_EQ(1u, names.size());
+  std::string contents = directory.ReadFile(names[0]);
+  contents.resize(contents.size() - 3);
+  directory.WriteFile(names[0], contents);
+
+  const auto store = AccountStore::Open(directory.path(), MakeTestOptions());
+  ASSERT_TRUE(store);
+  ExpectAccount(*store, 1, 0);
+  EXPECT_FALSE(store->Contains(2));
+
+  // A corrupt header fails the Open().
+  directory.WriteFile(names[0], "not a segment file");
+  EXPECT_FALSE(AccountStore::Open(directory.path(), MakeTestOptions()));
+}
+
+TEST(MessageStoreTest, CompactsInTheBackgroundWhileServingReads) {
+  TempDirectory directory;
+  AccountStore::Options options = MakeTestOptions();
+  options.background_compaction = true;
+  options.min_compaction_bytes = 0;
+  const auto store = AccountStore::Open(directory.path(), options);
+  ASSERT_TRUE(store);
+  constexpr int64_t kKeyCount = 16;
+  for (int64_t id = 0; id < kKeyCount; ++id) {
+    ASSERT_TRUE(store->Put(id, MakeAccount(id)));
+  }
+
+  std::atomic<bool> done{false};
+  std::atomic<int> bad_reads{0};
+  std::thread reader([&] {
+    Account account;
+    while (!done) {
+      for (int64_t id = 0; id < kKeyCount; ++id) {
+        if (!store->Get(id, account) || account.id != id) {
+          ++bad_reads;
+        }
+      }
+    }
+  });
+  int failed_puts = 0;
+  for (int version = 1; version <= 200; ++version) {
+    for (int64_t id = 0; id < kKeyCount; ++id) {
+      failed_puts += !store->Put(id, MakeAccount(id, version));
+    }
+  }
+  done = true;
+  reader.join();
+  EXPECT_EQ(0, failed_puts);
+  EXPECT_EQ(0, bad_reads);
+  for (int64_t id = 0; id < kKeyCount; ++id) {
+    ExpectAccount(*store, id, 200);
+  }
+
+  // Most of the overwritten records have been merged away, or soon will be.
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (store->GetStats().segment_count > 20 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_LE(store->GetStats().segment_count, 20);
+}
+
+}  // namespace
+}  // namespace pb
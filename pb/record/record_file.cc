@@ -0,0 +1,461 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/record_file.h"
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "pb/codec/endian.h"
+#include "pb/codec/serialize.h"
+
+namespace pb {
+
+namespace {
+
+constexpr int kBlockHeaderSize = 16;
+constexpr int kIndexEntrySize = 16;
+constexpr int kFooterSize = 16;
+
+constexpr uint32_t kBlockMagic = 0x42524250;   // "PBRB"
+constexpr uint32_t kFooterMagic = 0x46524250;  // "PBRF"
+
+// A block holds at least one record, and is flushed once it has reached the
+// block size (which is at most codec::kMaxSerializedSize). So, it can be no
+// larger than this.
+constexpr int32_t kMaxBlockSize =
+    2 * codec::kMaxSerializedSize + codec::kMaxVarintSize;
+
+void StoreLittleEndian32(uint32_t value, uint8_t* p) {
+  if (!codec::IsLittleEndianArchitecture()) {
+    value = codec::ReverseBytes32(value);
+  }
+  std::memcpy(p, &value, sizeof(value));
+}
+
+void StoreLittleEndian64(uint64_t value, uint8_t* p) {
+  if (!codec::IsLittleEndianArchitecture()) {
+    value = codec::ReverseBytes64(value);
+  }
+  std::memcpy(p, &value, sizeof(value));
+}
+
+uint32_t LoadLittleEndian32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return codec::IsLittleEndianArchitecture() ? value
+                                             : codec::ReverseBytes32(value);
+}
+
+uint64_t LoadLittleEndian64(const uint8_t* p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return codec::IsLittleEndianArchitecture() ? value
+                                             : codec::ReverseBytes64(value);
+}
+
+// Fills the buffers described by |iovs| with the bytes at |offset|.
+bool ReadFully(int fd, int64_t offset, iovec* iovs, int iov_count) {
+  while (iov_count > 0) {
+    const ssize_t result = preadv(fd, iovs, iov_count, offset);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (result == 0) {
+      return false;  // Unexpected end of file.
+    }
+    offset += result;
+
+    // Skip past what was read, for the next call after a partial read.
+    auto remaining = static_cast<std::size_t>(result);
+    while (iov_count > 0 && remaining >= iovs->iov_len) {
+      remaining -= iovs->iov_len;
+      ++iovs;
+      --iov_count;
+    }
+    if (iov_count > 0) {
+      iovs->iov_base = static_cast<uint8_t*>(iovs->iov_base) + remaining;
+      iovs->iov_len -= remaining;
+    }
+  }
+  return true;
+}
+
+bool ReadFully(int fd, int64_t offset, uint8_t* data, std::size_t size) {
+  iovec iov{data, size};
+  return ReadFully(fd, offset, &iov, 1);
+}
+
+// Returns true if a block header having the given values could have been
+// written by RecordFileWriter.
+bool IsPlausibleBlock(int64_t stored_size, int64_t raw_size) {
+  if (raw_size <= 0 || raw_size > kMaxBlockSize || stored_size <= 0) {
+    return false;
+  }
+  // Blocks that would not compress are stored as-is.
+  return stored_size == raw_size ||
+         stored_size <
+             ComputeMaxLzCompressedSize(static_cast<int32_t>(raw_size));
+}
+
+// Parses a block header, returning false if it is not valid.
+bool ParseBlockHeader(const uint8_t* header,
+                      RecordFileReader::BlockInfo& info) {
+  if (LoadLittleEndian32(header) != kBlockMagic) {
+    return false;
+  }
+  const uint32_t stored_size = LoadLittleEndian32(header + 4);
+  const uint32_t raw_size = LoadLittleEndian32(header + 8);
+  const auto compression = static_cast<RecordCompression>(header[12]);
+  if (!IsPlausibleBlock(stored_size, raw_size)) {
+    return false;
+  }
+  if ((compression == RecordCompression::kNone) != (stored_size == raw_size)) {
+    return false;
+  }
+  if (compression != RecordCompression::kNone &&
+      compression != RecordCompression::kLz) {
+    return false;
+  }
+  info.stored_size = static_cast<int32_t>(stored_size);
+  info.raw_size = static_cast<int32_t>(raw_size);
+  return true;
+}
+
+// Reads the block index, as located by the footer. Returns false if there is
+// no footer, or the index is not consistent with the file.
+bool ReadIndex(int fd,
+               int64_t file_size,
+               std::vector<RecordFileReader::BlockInfo>& blocks) {
+  if (file_size < kFooterSize) {
+    return false;
+  }
+  uint8_t footer[kFooterSize];
+  if (!ReadFully(fd, file_size - kFooterSize, footer, sizeof(footer))) {
+    return false;
+  }
+  if (LoadLittleEndian32(footer + 12) != kFooterMagic) {
+    return false;
+  }
+  const uint64_t index_offset = LoadLittleEndian64(footer);
+  const uint32_t block_count = LoadLittleEndian32(footer + 8);
+  const auto index_size = static_cast<uint64_t>(block_count) * kIndexEntrySize;
+  // The index must end at the footer. This is checked without adding to the
+  // |index_offset|, which a corrupt footer could make overflow.
+  const auto size_before_footer =
+      static_cast<uint64_t>(file_size - kFooterSize);
+  if (index_size > size_before_footer ||
+      index_offset != size_before_footer - index_size) {
+    return false;
+  }
+
+  std::vector<uint8_t> index(index_size);
+  if (index_size > 0 && !ReadFully(fd, static_cast<int64_t>(index_offset),
+                                   index.data(), index.size())) {
+    return false;
+  }
+  blocks.clear();
+  blocks.reserve(block_count);
+  int64_t expected_offset = 0;
+  for (uint32_t i = 0; i < block_count; ++i) {
+    const uint8_t* const entry = index.data() + i * kIndexEntrySize;
+    const uint64_t offset = LoadLittleEndian64(entry);
+    const uint32_t stored_size = LoadLittleEndian32(entry + 8);
+    const uint32_t raw_size = LoadLittleEndian32(entry + 12);
+    if (offset != static_cast<uint64_t>(expected_offset) ||
+        !IsPlausibleBlock(stored_size, raw_size)) {
+      return false;
+    }
+    blocks.push_back(RecordFileReader::BlockInfo{
+        expected_offset, static_cast<int32_t>(stored_size),
+        static_cast<int32_t>(raw_size)});
+    expected_offset += kBlockHeaderSize + stored_size;
+  }
+  return static_cast<uint64_t>(expected_offset) == index_offset;
+}
+
+// Finds the blocks by walking the block headers from the start of the file,
+// stopping at the first one that is invalid or incomplete.
+void ScanBlocks(int fd,
+                int64_t file_size,
+                std::vector<RecordFileReader::BlockInfo>& blocks) {
+  blocks.clear();
+  int64_t offset = 0;
+  while ((file_size - offset) >= kBlockHeaderSize) {
+    uint8_t header[kBlockHeaderSize];
+    RecordFileReader::BlockInfo info{offset, 0, 0};
+    if (!ReadFully(fd, offset, header, sizeof(header)) ||
+        !ParseBlockHeader(header, info) ||
+        (file_size - offset - kBlockHeaderSize) < info.stored_size) {
+      break;
+    }
+    blocks.push_back(info);
+    offset += kBlockHeaderSize + info.stored_size;
+  }
+}
+
+}  // namespace
+
+RecordFileWriter::RecordFileWriter(int fd)
+    : RecordFileWriter(fd, Options()) {}
+
+RecordFileWriter::RecordFileWriter(int fd, const Options& options)
+    : fd_(fd), options_(options) {
+  assert(options_.block_bytes > 0);
+  assert(options_.block_bytes <= codec::kMaxSerializedSize);
+  block_buffer_.reserve(static_cast<std::size_t>(options_.block_bytes) +
+                        codec::kMaxVarintSize);
+}
+
+bool RecordFileWriter::AppendBytes(const uint8_t* begin, const uint8_t* end) {
+  const auto byte_count = end - begin;
+  if (byte_count > codec::kMaxSerializedSize) {
+    return false;
+  }
+  uint8_t* const buffer = BeginRecord(static_cast<int32_t>(byte_count));
+  if (!buffer) {
+    return false;
+  }
+  std::copy(begin, end, buffer);
+  return EndRecord();
+}
+
+bool RecordFileWriter::FlushBlock() {
+  if (failed_) {
+    return false;
+  }
+  if (block_buffer_.empty()) {
+    return true;
+  }
+  if (!WriteBlock(block_buffer_.data(),
+                  static_cast<int32_t>(block_buffer_.size()))) {
+    return false;
+  }
+  block_buffer_.clear();
+  return true;
+}
+
+bool RecordFileWriter::AppendBlock(const uint8_t* begin, const uint8_t* end) {
+  if (finished_ || !FlushBlock()) {
+    return false;
+  }
+  if (begin == end) {
+    return true;
+  }
+  if ((end - begin) > kMaxBlockSize) {
+    return false;
+  }
+  return WriteBlock(begin, static_cast<int32_t>(end - begin));
+}
+
+bool RecordFileWriter::Finish() {
+  if (finished_ || !FlushBlock()) {
+    return false;
+  }
+  finished_ = true;
+
+  std::vector<uint8_t> trailer(index_.size() * kIndexEntrySize + kFooterSize);
+  uint8_t* p = trailer.data();
+  for (const IndexEntry& entry : index_) {
+    StoreLittleEndian64(static_cast<uint64_t>(entry.offset), p);
+    StoreLittleEndian32(static_cast<uint32_t>(entry.stored_size), p + 8);
+    StoreLittleEndian32(static_cast<uint32_t>(entry.raw_size), p + 12);
+    p += kIndexEntrySize;
+  }
+  StoreLittleEndian64(static_cast<uint64_t>(file_offset_), p);
+  StoreLittleEndian32(static_cast<uint32_t>(index_.size()), p + 8);
+  StoreLittleEndian32(kFooterMagic, p + 12);
+  iovec iov{trailer.data(), trailer.size()};
+  return WriteFully(&iov, 1);
+}
+
+uint8_t* RecordFileWriter::BeginRecord(int32_t byte_count) {
+  if (failed_ || finished_) {
+    return nullptr;
+  }
+  const auto byte_count_as_varint = static_cast<uint32_t>(byte_count);
+  const std::size_t old_size = block_buffer_.size();
+  block_buffer_.resize(
+      old_size +
+      static_cast<std::size_t>(
+          codec::ComputeSerializedValueSize(byte_count_as_varint) +
+          byte_count));
+  return codec::SerializeValue(byte_count_as_varint,
+                               block_buffer_.data() + old_size);
+}
+
+bool RecordFileWriter::EndRecord() {
+  if (block_buffer_.size() >= static_cast<std::size_t>(options_.block_bytes)) {
+    return FlushBlock();
+  }
+  return true;
+}
+
+bool RecordFileWriter::WriteBlock(const uint8_t* raw, int32_t raw_size) {
+  const uint8_t* stored = raw;
+  int32_t stored_size = raw_size;
+  auto compression = RecordCompression::kNone;
+  if (options_.compression == RecordCompression::kLz) {
+    stored_buffer_.resize(
+        static_cast<std::size_t>(ComputeMaxLzCompressedSize(raw_size)));
+    const int32_t compressed_size = LzCompress(
+        raw, raw_size, stored_buffer_.data(), options_.lz_search_depth);
+    // Store the block as-is if it did not compress.
+    if (compressed_size < raw_size) {
+      stored = stored_buffer_.data();
+      stored_size = compressed_size;
+      compression = RecordCompression::kLz;
+    }
+  }
+
+  uint8_t header[kBlockHeaderSize]{};
+  StoreLittleEndian32(kBlockMagic, header);
+  StoreLittleEndian32(static_cast<uint32_t>(stored_size), header + 4);
+  StoreLittleEndian32(static_cast<uint32_t>(raw_size), header + 8);
+  header[12] = static_cast<uint8_t>(compression);
+  iovec iovs[2] = {
+      {header, sizeof(header)},
+      {const_cast<uint8_t*>(stored), static_cast<std::size_t>(stored_size)},
+  };
+  if (!WriteFully(iovs, 2)) {
+    return false;
+  }
+
+  index_.push_back(IndexEntry{file_offset_, stored_size, raw_size});
+  file_offset_ += kBlockHeaderSize + stored_size;
+  return true;
+}
+
+bool RecordFileWriter::WriteFully(iovec* iovs, int iov_count) {
+  while (iov_count > 0) {
+    const ssize_t result = writev(fd_, iovs, iov_count);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      failed_ = true;
+      return false;
+    }
+
+    // Skip past what was written, for the next call after a partial write.
+    auto remaining = static_cast<std::size_t>(result);
+    while (iov_count > 0 && remaining >= iovs->iov_len) {
+      remaining -= iovs->iov_len;
+      ++iovs;
+      --iov_count;
+    }
+    if (iov_count > 0) {
+      iovs->iov_base = static_cast<uint8_t*>(iovs->iov_base) + remaining;
+      iovs->iov_len -= remaining;
+    }
+  }
+  return true;
+}
+
+bool RecordBlock::GetRecord(int32_t offset_in_block,
+                            const uint8_t*& begin,
+                            const uint8_t*& end) const {
+  if (offset_in_block < 0 || offset_in_block >= size_) {
+    return false;
+  }
+  return ParseRecordHeader(data() + offset_in_block, data() + size_, begin,
+                           end);
+}
+
+// static
+std::unique_ptr<RecordFileReader> RecordFileReader::Open(int fd) {
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    return nullptr;
+  }
+  const int64_t file_size = status.st_size;
+
+  std::vector<BlockInfo> blocks;
+  const bool has_index = ReadIndex(fd, file_size, blocks);
+  if (!has_index) {
+    ScanBlocks(fd, file_size, blocks);
+    if (blocks.empty() && file_size > 0) {
+      return nullptr;
+    }
+  }
+  return std::unique_ptr<RecordFileReader>(
+      new RecordFileReader(fd, std::move(blocks), has_index));
+}
+
+RecordFileReader::RecordFileReader(int fd,
+                                   std::vector<BlockInfo> blocks,
+                                   bool has_index)
+    : fd_(fd), blocks_(std::move(blocks)), has_index_(has_index) {}
+
+bool RecordFileReader::ReadBlock(int index, RecordBlock& block) const {
+  if (index < 0 || index >= block_count()) {
+    return false;
+  }
+  return ReadBlockAt(block_info(index), block);
+}
+
+bool RecordFileReader::ReadRecord(const RecordPosition& position,
+                                  RecordBlock& block,
+                                  const uint8_t*& begin,
+                                  const uint8_t*& end) const {
+  const auto it = std::lower_bound(
+      blocks_.begin(), blocks_.end(), position.block_offset,
+      [](const BlockInfo& info, int64_t offset) {
+        return info.offset < offset;
+      });
+  if (it == blocks_.end() || it->offset != position.block_offset) {
+    return false;
+  }
+  return ReadBlockAt(*it, block) &&
+         block.GetRecord(position.offset_in_block, begin, end);
+}
+
+bool RecordFileReader::ReadBlockAt(const BlockInfo& info,
+                                   RecordBlock& block) const {
+  const auto raw_size = static_cast<std::size_t>(info.raw_size);
+  const auto stored_size = static_cast<std::size_t>(info.stored_size);
+  const bool is_compressed = (stored_size != raw_size);
+  block.size_ = 0;
+  block.buffer_.resize(raw_size + codec::kParseSlopBytes);
+  if (is_compressed) {
+    block.stored_buffer_.resize(stored_size);
+  }
+
+  // Read the header and the stored bytes with one system call. Uncompressed
+  // blocks are read directly into place.
+  uint8_t header[kBlockHeaderSize];
+  iovec iovs[2] = {
+      {header, sizeof(header)},
+      {is_compressed ? block.stored_buffer_.data() : block.buffer_.data(),
+       stored_size},
+  };
+  if (!ReadFully(fd_, info.offset, iovs, 2)) {
+    return false;
+  }
+  BlockInfo header_info{info.offset, 0, 0};
+  if (!ParseBlockHeader(header, header_info) ||
+      header_info.stored_size != info.stored_size ||
+      header_info.raw_size != info.raw_size) {
+    return false;
+  }
+
+  if (is_compressed &&
+      !LzDecompress(block.stored_buffer_.data(), info.stored_size,
+                    block.buffer_.data(), info.raw_size)) {
+    return false;
+  }
+  block.size_ = info.raw_size;
+  return true;
+}
+
+}  // namespace pb
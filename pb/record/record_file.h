@@ -0,0 +1,305 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/record/lz_compression.h"
+#include "pb/serialize.h"
+
+struct iovec;
+
+namespace pb {
+
+// A record file is an append-only sequence of records (typically, serialized
+// messages), grouped into blocks that are each compressed independently:
+//
+//   block 0 | block 1 | ... | block N-1 | block index | footer
+//
+// Each block has a 16-byte header (magic, stored size, uncompressed size, and
+// compression method), followed by its stored (possibly compressed) bytes.
+// Uncompressed, a block is a sequence of records, each being a varint byte
+// count followed by that many bytes. The block index lists the file offset and
+// sizes of every block, so that a reader can reach any block with one read, and
+// decompress many blocks in parallel. The 16-byte footer locates the index.
+//
+// If the writer did not finish (e.g., the process crashed), the index and
+// footer will be missing. RecordFileReader then recovers by scanning the block
+// headers from the start of the file, up to the first incomplete block.
+//
+// All integers in the headers, index and footer are little-endian.
+
+// Identifies one record: The file offset of its block, and the offset of the
+// record's header within the uncompressed block.
+struct RecordPosition {
+  int64_t block_offset = 0;
+  int32_t offset_in_block = 0;
+
+  friend bool operator==(const RecordPosition& a, const RecordPosition& b) {
+    return a.block_offset == b.block_offset &&
+           a.offset_in_block == b.offset_in_block;
+  }
+};
+
+enum class RecordCompression : uint8_t {
+  kNone = 0,
+  kLz = 1,  // See lz_compression.h.
+};
+
+// Appends records to a new record file. Records are gathered into a block
+// buffer, which is compressed and written out once it reaches the block size.
+// Finish() must be called to write out the last block and the block index. A
+// RecordFileWriter does not own the file descriptor, and is not thread-safe.
+//
+//   pb::RecordFileWriter writer(fd);
+//   for (const Event& event : events) {
+//     if (!writer.Append(event)) { ... }
+//   }
+//   if (!writer.Finish()) { ... }
+class RecordFileWriter {
+ public:
+  struct Options {
+    // A block is written out once it holds at least this many bytes. Larger
+    // blocks compress better, but every random access must decompress a
+    // whole block.
+    int32_t block_bytes = 64 * 1024;
+
+    RecordCompression compression = RecordCompression::kLz;
+
+    // See LzCompress().
+    int lz_search_depth = kDefaultLzSearchDepth;
+  };
+
+  // |fd| must refer to an empty file, opened for writing.
+  explicit RecordFileWriter(int fd);
+  RecordFileWriter(int fd, const Options& options);
+
+  RecordFileWriter(const RecordFileWriter&) = delete;
+  RecordFileWriter& operator=(const RecordFileWriter&) = delete;
+
+  // Serializes the |message| into the current block as one record. Returns
+  // false if the |message| could not be serialized, or a write failed.
+  template <class Message,
+            std::enable_if_t<
+                std::is_class_v<typename Message::ProtobufFields>,
+                int> = 0>
+  [[nodiscard]] bool Append(const Message& message) {
+    const int32_t byte_count = ComputeSerializedSize(message);
+    if (byte_count < 0) {
+      return false;
+    }
+    uint8_t* const buffer = BeginRecord(byte_count);
+    if (!buffer) {
+      return false;
+    }
+    pb::Serialize(message, buffer);
+    return EndRecord();
+  }
+
+  // Same as Append(), but for a record containing the bytes in the range
+  // |begin| to |end|.
+  [[nodiscard]] bool AppendBytes(const uint8_t* begin, const uint8_t* end);
+
+  // Returns the position the next appended record will have.
+  [[nodiscard]] RecordPosition next_position() const {
+    return RecordPosition{file_offset_,
+                          static_cast<int32_t>(block_buffer_.size())};
+  }
+
+  // Compresses and writes out the current block now, even if it is not full.
+  // Returns false on error.
+  [[nodiscard]] bool FlushBlock();
+
+  // Writes out the current block, if any, and then the bytes in the range
+  // |begin| to |end| as a block of their own. The bytes must already be
+  // formatted as the contents of a block: a sequence of records, each a varint
+  // byte count followed by that many bytes. Returns false on error.
+  [[nodiscard]] bool AppendBlock(const uint8_t* begin, const uint8_t* end);
+
+  // Writes out the current block, then the block index and footer. Returns
+  // false on error. No more records may be appended afterwards.
+  [[nodiscard]] bool Finish();
+
+ private:
+  struct IndexEntry {
+    int64_t offset;
+    int32_t stored_size;
+    int32_t raw_size;
+  };
+
+  // Reserves space for a record of |byte_count| bytes in the block buffer,
+  // writes the record header, and returns a pointer to where the record's bytes
+  // must be written. Returns nullptr on error.
+  [[nodiscard]] uint8_t* BeginRecord(int32_t byte_count);
+
+  // Flushes the block if it has reached the block size.
+  [[nodiscard]] bool EndRecord();
+
+  // Compresses and writes out one block, whose contents are the |raw_size|
+  // bytes at |raw|.
+  [[nodiscard]] bool WriteBlock(const uint8_t* raw, int32_t raw_size);
+
+  // Writes all the bytes described by |iovs| to the end of the file, with
+  // one gathering write (unless it is only partially successful).
+  [[nodiscard]] bool WriteFully(iovec* iovs, int iov_count);
+
+  const int fd_;
+  const Options options_;
+  bool failed_ = false;
+  bool finished_ = false;
+  int64_t file_offset_ = 0;
+  std::vector<uint8_t> block_buffer_;
+  std::vector<uint8_t> stored_buffer_;
+  std::vector<IndexEntry> index_;
+};
+
+// The records of one block, uncompressed. The records are always followed by at
+// least pb::kParseSlopBytes readable bytes, and so pb::MergeFromPaddedBuffer()
+// may be used to parse them.
+class RecordBlock {
+ public:
+  RecordBlock() = default;
+
+  RecordBlock(const RecordBlock&) = delete;
+  RecordBlock& operator=(const RecordBlock&) = delete;
+
+  [[nodiscard]] const uint8_t* data() const { return buffer_.data(); }
+  [[nodiscard]] int32_t size() const { return size_; }
+
+  // Calls |handler| for each record in the block, in order:
+  //
+  //   void handler(const uint8_t* begin, const uint8_t* end);
+  //
+  // Returns false if the block contents are malformed.
+  template <typename Handler>
+  [[nodiscard]] bool ForEachRecord(Handler&& handler) const {
+    const uint8_t* cursor = data();
+    const uint8_t* const end = cursor + size_;
+    while (cursor != end) {
+      const uint8_t* record_begin;
+      const uint8_t* record_end;
+      if (!ParseRecordHeader(cursor, end, record_begin, record_end)) {
+        return false;
+      }
+      handler(record_begin, record_end);
+      cursor = record_end;
+    }
+    return true;
+  }
+
+  // Sets |begin| and |end| to the bounds of the record at |offset_in_block|
+  // (see RecordPosition). Returns false if there is no record there.
+  [[nodiscard]] bool GetRecord(int32_t offset_in_block,
+                               const uint8_t*& begin,
+                               const uint8_t*& end) const;
+
+ private:
+  friend class RecordFileReader;
+
+  static bool ParseRecordHeader(const uint8_t* cursor,
+                                const uint8_t* end,
+                                const uint8_t*& record_begin,
+                                const uint8_t*& record_end) {
+    uint32_t byte_count;
+    record_begin = codec::ParseValue(cursor, end, 0, byte_count);
+    if (!record_begin ||
+        static_cast<uint32_t>(end - record_begin) < byte_count) {
+      return false;
+    }
+    record_end = record_begin + byte_count;
+    return true;
+  }
+
+  std::vector<uint8_t> buffer_;
+  int32_t size_ = 0;
+
+  // Holds the stored bytes, while reading a compressed block.
+  std::vector<uint8_t> stored_buffer_;
+};
+
+// Reads a record file. Blocks may be read in any order, and ReadBlock() may be
+// called from multiple threads at once (each with its own RecordBlock), to
+// decompress blocks in parallel. A RecordFileReader does not own the file
+// descriptor.
+//
+//   auto reader = pb::RecordFileReader::Open(fd);
+//   if (!reader) { ... }
+//   RecordBlock block;
+//   for (int i = 0; i < reader->block_count(); ++i) {
+//     if (!reader->ReadBlock(i, block)) { ... }
+//     if (!block.ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+//           Event event;
+//           if (pb::MergeFromPaddedBuffer(begin, end, event)) { ... }
+//         })) { ... }
+//   }
+class RecordFileReader {
+ public:
+  struct BlockInfo {
+    int64_t offset;
+    int32_t stored_size;
+    int32_t raw_size;
+  };
+
+  // Returns nullptr if the file cannot be read, or has neither a valid block
+  // index nor any valid blocks.
+  [[nodiscard]] static std::unique_ptr<RecordFileReader> Open(int fd);
+
+  RecordFileReader(const RecordFileReader&) = delete;
+  RecordFileReader& operator=(const RecordFileReader&) = delete;
+
+  // Returns false if the block index was missing or invalid, and so the blocks
+  // were found by scanning the file.
+  [[nodiscard]] bool has_index() const { return has_index_; }
+
+  [[nodiscard]] int block_count() const {
+    return static_cast<int>(blocks_.size());
+  }
+  [[nodiscard]] const BlockInfo& block_info(int index) const {
+    return blocks_[static_cast<std::size_t>(index)];
+  }
+
+  // Reads and decompresses the block at |index| into |block|. Returns false on
+  // error, or if the block is corrupt.
+  [[nodiscard]] bool ReadBlock(int index, RecordBlock& block) const;
+
+  // Reads the block at |position|, and sets |begin| and |end| to the bounds of
+  // the record there. Returns false if there is no such record.
+  [[nodiscard]] bool ReadRecord(const RecordPosition& position,
+                                RecordBlock& block,
+                                const uint8_t*& begin,
+                                const uint8_t*& end) const;
+
+  // Calls |handler| for every record in the file, in order (see
+  // RecordBlock::ForEachRecord()). Returns false on error.
+  template <typename Handler>
+  [[nodiscard]] bool ForEachRecord(Handler&& handler) const {
+    RecordBlock block;
+    for (int i = 0; i < block_count(); ++i) {
+      if (!ReadBlock(i, block) || !block.ForEachRecord(handler)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  RecordFileReader(int fd, std::vector<BlockInfo> blocks, bool has_index);
+
+  // Reads and decompresses the block described by |info|.
+  [[nodiscard]] bool ReadBlockAt(const BlockInfo& info,
+                                 RecordBlock& block) const;
+
+  const int fd_;
+  const std::vector<BlockInfo> blocks_;
+  const bool has_index_;
+};
+
+}  // namespace pb
@@ -0,0 +1,289 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/record_file.h"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/parse.h"
+#include "pb/record/temp_file_for_testing.h"
+
+namespace pb {
+namespace {
+
+struct Note {
+  int32_t id = 0;
+  std::string text;
+
+  using ProtobufFields = FieldList<Field<&Note::id, 1>, Field<&Note::text, 2>>;
+};
+
+Note MakeNote(int32_t id) {
+  return Note{id, "note number " + std::to_string(id) + " of many"};
+}
+
+std::vector<Note> ReadAllNotes(const RecordFileReader& reader) {
+  std::vector<Note> notes;
+  EXPECT_TRUE(
+      reader.ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+        Note note;
+        EXPECT_TRUE(MergeFromPaddedBuffer(begin, end, note));
+        notes.push_back(std::move(note));
+      }));
+  return notes;
+}
+
+class RecordFileTest : public ::testing::TestWithParam<RecordCompression> {
+ protected:
+  RecordFileWriter::Options MakeOptions() const {
+    RecordFileWriter::Options options;
+    options.block_bytes = 4096;
+    options.compression = GetParam();
+    return options;
+  }
+};
+
+TEST_P(RecordFileTest, RoundTripsRecordsAcrossBlocks) {
+  TempFile file;
+  RecordFileWriter writer(file.fd(), MakeOptions());
+  for (int32_t i = 0; i < 5000; ++i) {
+    ASSERT_TRUE(writer.Append(MakeNote(i)));
+  }
+  ASSERT_TRUE(writer.Finish());
+  EXPECT_FALSE(writer.Append(MakeNote(0)));
+
+  const auto reader = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(reader);
+  EXPECT_TRUE(reader->has_index());
+  EXPECT_GT(reader->block_count(), 10);
+  int64_t stored_bytes = 0;
+  int64_t raw_bytes = 0;
+  for (int i = 0; i < reader->block_count(); ++i) {
+    stored_bytes += reader->block_info(i).stored_size;
+    raw_bytes += reader->block_info(i).raw_size;
+  }
+  if (GetParam() == RecordCompression::kLz) {
+    EXPECT_LT(stored_bytes * 2, raw_bytes);
+  } else {
+    EXPECT_EQ(stored_bytes, raw_bytes);
+  }
+
+  const std::vector<Note> notes = ReadAllNotes(*reader);
+  ASSERT_EQ(5000u, notes.size());
+  for (int32_t i = 0; i < 5000; ++i) {
+    EXPECT_EQ(MakeNote(i).text, notes[static_cast<std::size_t>(i)].text);
+  }
+}
+
+TEST_P(RecordFileTest, ReadsRecordsByPosition) {
+  TempFile file;
+  RecordFileWriter writer(file.fd(), MakeOptions());
+  std::vector<RecordPosition> positions;
+  for (int32_t i = 0; i < 1000; ++i) {
+    positions.push_back(writer.next_position());
+    ASSERT_TRUE(writer.Append(MakeNote(i)));
+  }
+  ASSERT_TRUE(writer.Finish());
+
+  const auto reader = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(reader);
+  RecordBlock block;
+  for (int32_t i = 999; i >= 0; i -= 37) {
+    const uint8_t* begin;
+    const uint8_t* end;
+    ASSERT_TRUE(reader->ReadRecord(positions[static_cast<std::size_t>(i)],
+                                   block, begin, end));
+    Note note;
+    ASSERT_TRUE(MergeFromPaddedBuffer(begin, end, note));
+    EXPECT_EQ(i, note.id);
+  }
+
+  // Positions that are not at a block, or are past the end of a block.
+  const uint8_t* begin;
+  const uint8_t* end;
+  EXPECT_FALSE(reader->ReadRecord(RecordPosition{1, 0}, block, begin, end));
+  EXPECT_FALSE(reader->ReadRecord(
+      RecordPosition{0, reader->block_info(0).raw_size}, block, begin, end));
+}
+
+TEST_P(RecordFileTest, ReadsBlocksInParallel) {
+  TempFile file;
+  RecordFileWriter writer(file.fd(), MakeOptions());
+  for (int32_t i = 0; i < 20000; ++i) {
+    ASSERT_TRUE(writer.Append(MakeNote(i)));
+  }
+  ASSERT_TRUE(writer.Finish());
+  const auto reader = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(reader);
+
+  constexpr int kThreadCount = 4;
+  std::vector<int64_t> id_sums(kThreadCount);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreadCount; ++t) {
+    threads.emplace_back([&, t] {
+      RecordBlock block;
+      for (int i = t; i < reader->block_count(); i += kThreadCount) {
+        ASSERT_TRUE(reader->ReadBlock(i, block));
+        ASSERT_TRUE(
+            block.ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+              Note note;
+              ASSERT_TRUE(MergeFromPaddedBuffer(begin, end, note));
+              id_sums[static_cast<std::size_t>(t)] += note.id;
+            }));
+      }
+    });
+  }
+  int64_t id_sum = 0;
+  for (int t = 0; t < kThreadCount; ++t) {
+    threads[static_cast<std::size_t>(t)].join();
+    id_sum += id_sums[static_cast<std::size_t>(t)];
+  }
+  EXPECT_EQ(int64_t{19999} * 20000 / 2, id_sum);
+}
+
+TEST_P(RecordFileTest, RecoversBlocksWithoutIndex) {
+  TempFile file;
+  RecordFileWriter writer(file.fd(), MakeOptions());
+  for (int32_t i = 0; i < 300; ++i) {
+    ASSERT_TRUE(writer.Append(MakeNote(i)));
+    if (i % 100 == 99) {
+      ASSERT_TRUE(writer.FlushBlock());
+    }
+  }
+  // Simulate a crash part-way through writing a fourth block.
+  ASSERT_TRUE(writer.Append(MakeNote(300)));
+  const int64_t complete_size = file.size();
+  ASSERT_TRUE(writer.FlushBlock());
+  ASSERT_TRUE(file.Truncate(complete_size + 20));
+
+  const auto reader = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(reader);
+  EXPECT_FALSE(reader->has_index());
+  EXPECT_EQ(3, reader->block_count());
+  const std::vector<Note> notes = ReadAllNotes(*reader);
+  ASSERT_EQ(300u, notes.size());
+  EXPECT_EQ(299, notes.back().id);
+}
+
+TEST_P(RecordFileTest, RejectsCorruptBlockHeader) {
+  TempFile file;
+  RecordFileWriter writer(file.fd(), MakeOptions());
+  for (int32_t i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(writer.Append(MakeNote(i)));
+  }
+  ASSERT_TRUE(writer.Finish());
+  const auto reader = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(reader);
+  ASSERT_GT(reader->block_count(), 1);
+
+  // Break the magic number of the second block.
+  ASSERT_TRUE(file.Overwrite(reader->block_info(1).offset, 0));
+  RecordBlock block;
+  EXPECT_TRUE(reader->ReadBlock(0, block));
+  EXPECT_FALSE(reader->ReadBlock(1, block));
+  EXPECT_FALSE(reader->ReadBlock(reader->block_count(), block));
+
+  // Without the index, only the first block can be found.
+  ASSERT_TRUE(
+      file.Truncate(reader->block_info(reader->block_count() - 1).offset));
+  const auto recovered = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(recovered);
+  EXPECT_EQ(1, recovered->block_count());
+}
+
+INSTANTIATE_TEST_SUITE_P(AllCompressions,
+                         RecordFileTest,
+                         ::testing::Values(RecordCompression::kNone,
+                                           RecordCompression::kLz));
+
+TEST(RecordFileWriterTest, StoresIncompressibleBlocksAsIs) {
+  TempFile file;
+  RecordFileWriter writer(file.fd());
+  std::mt19937 random(1);
+  std::vector<uint8_t> bytes(1000);
+  for (int i = 0; i < 100; ++i) {
+    for (uint8_t& byte : bytes) {
+      byte = static_cast<uint8_t>(random());
+    }
+    ASSERT_TRUE(writer.AppendBytes(bytes.data(), bytes.data() + bytes.size()));
+  }
+  ASSERT_TRUE(writer.Finish());
+
+  const auto reader = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(reader);
+  ASSERT_GT(reader->block_count(), 0);
+  for (int i = 0; i < reader->block_count(); ++i) {
+    EXPECT_EQ(reader->block_info(i).raw_size,
+              reader->block_info(i).stored_size);
+  }
+  int record_count = 0;
+  ASSERT_TRUE(reader->ForEachRecord([&](const uint8_t* begin,
+                                        const uint8_t* end) {
+    EXPECT_EQ(1000, end - begin);
+    ++record_count;
+  }));
+  EXPECT_EQ(100, record_count);
+}
+
+TEST(RecordFileReaderTest, OpensEmptyFiles) {
+  TempFile unfinished;
+  auto reader = RecordFileReader::Open(unfinished.fd());
+  ASSERT_TRUE(reader);
+  EXPECT_EQ(0, reader->block_count());
+
+  TempFile finished;
+  RecordFileWriter writer(finished.fd());
+  ASSERT_TRUE(writer.Finish());
+  reader = RecordFileReader::Open(finished.fd());
+  ASSERT_TRUE(reader);
+  EXPECT_TRUE(reader->has_index());
+  EXPECT_EQ(0, reader->block_count());
+}
+
+TEST(RecordFileReaderTest, IgnoresAnIndexWhoseFooterWouldOverflow) {
+  TempFile file;
+  RecordFileWriter writer(file.fd());
+  for (int32_t i = 0; i < 100; ++i) {
+    ASSERT_TRUE(writer.Append(MakeNote(i)));
+  }
+  ASSERT_TRUE(writer.Finish());
+
+  // Claim the most blocks, at an offset that makes the end of the index wrap
+  // around to the start of the footer.
+  const int64_t footer_offset = file.size() - 16;
+  const uint32_t block_count = UINT32_MAX;
+  const uint64_t index_offset = static_cast<uint64_t>(footer_offset) -
+                                uint64_t{block_count} * 16;
+  for (int i = 0; i < 8; ++i) {
+    ASSERT_TRUE(file.Overwrite(footer_offset + i,
+                               static_cast<uint8_t>(index_offset >> (8 * i))));
+  }
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(file.Overwrite(footer_offset + 8 + i,
+                               static_cast<uint8_t>(block_count >> (8 * i))));
+  }
+
+  const auto reader = RecordFileReader::Open(file.fd());
+  ASSERT_TRUE(reader);
+  EXPECT_FALSE(reader->has_index());
+  EXPECT_EQ(100u, ReadAllNotes(*reader).size());
+}
+
+TEST(RecordFileReaderTest, RejectsGarbage) {
+  TempFile file;
+  const std::string garbage(100, 'x');
+  ASSERT_EQ(100, write(file.fd(), garbage.data(), garbage.size()));
+  EXPECT_FALSE(RecordFileReader::Open(file.fd()));
+}
+
+}  // namespace
+}  // namespace pb
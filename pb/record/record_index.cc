@@ -0,0 +1,501 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/record_index.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+#include "pb/codec/endian.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/tag.h"
+#include "pb/codec/wire_type.h"
+#include "pb/integer_wrapper.h"
+
+namespace pb {
+
+namespace {
+
+// An index file consists of a 64-byte header, followed by these sections,
+// each of which may be empty:
+//
+//   entries           |entry_count| x (key u64, block offset u64, offset in
+//                     block u32, 4 zero bytes), sorted by key, then position.
+//   summary           |summary_count| x (key u64): The key of every
+//                     kEntriesPerSummaryKey-th entry.
+//   filter directory  |filter_count| x (block offset u64, first word u32, word
+//                     count u32), in file order.
+//   filter words      |filter_word_count| x (bits u64).
+//
+// The header holds the magic number, flags, the section sizes, and the number
+// of hash functions used by the Bloom filters. All integers are little-endian.
+constexpr int kHeaderSize = 64;
+constexpr int kEntrySize = 24;
+constexpr int kSummaryKeySize = 8;
+constexpr int kFilterDirectoryEntrySize = 16;
+constexpr int kFilterWordSize = 8;
+
+constexpr uint32_t kIndexMagic = 0x58524250;  // "PBRX"
+constexpr uint32_t kHasEntriesFlag = 1;
+
+// 170 entries fill just under one 4 KB page. So, a lookup reads one span of
+// entries, which straddles at most two pages.
+constexpr int64_t kEntriesPerSummaryKey = 170;
+
+constexpr int kMaxHashCount = 30;
+
+void StoreLittleEndian32(uint32_t value, uint8_t* p) {
+  if (!codec::IsLittleEndianArchitecture()) {
+    value = codec::ReverseBytes32(value);
+  }
+  std::memcpy(p, &value, sizeof(value));
+}
+
+void StoreLittleEndian64(uint64_t value, uint8_t* p) {
+  if (!codec::IsLittleEndianArchitecture()) {
+    value = codec::ReverseBytes64(value);
+  }
+  std::memcpy(p, &value, sizeof(value));
+}
+
+uint32_t LoadLittleEndian32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return codec::IsLittleEndianArchitecture() ? value
+                                             : codec::ReverseBytes32(value);
+}
+
+uint64_t LoadLittleEndian64(const uint8_t* p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return codec::IsLittleEndianArchitecture() ? value
+                                             : codec::ReverseBytes64(value);
+}
+
+// The MurmurHash3 finalizer: Every input bit affects every output bit.
+uint64_t MixBits(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdull;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ull;
+  value ^= value >> 33;
+  return value;
+}
+
+int ComputeHashCount(int bits_per_key) {
+  // The false-positive rate is lowest with bits_per_key * ln(2) hashes.
+  const auto count = static_cast<int>(std::lround(bits_per_key * 0.69));
+  return std::clamp(count, 1, kMaxHashCount);
+}
+
+// Calls |probe| with the bit index of each of the |hash_count| bits for |key|
+// in a filter of |bit_count| bits. This uses double hashing: Each bit index is
+// h1 + i*h2, which is as good as independent hashes for a Bloom filter.
+template <typename Probe>
+void ForEachFilterBit(uint64_t key,
+                      int hash_count,
+                      uint64_t bit_count,
+                      Probe&& probe) {
+  const uint64_t hash = MixBits(key);
+  uint64_t h1 = hash;
+  const uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+  for (int i = 0; i < hash_count; ++i) {
+    probe(h1 % bit_count);
+    h1 += h2;
+  }
+}
+
+bool WriteFully(int fd, const uint8_t* data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t result = write(fd, data, size);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += result;
+    size -= static_cast<std::size_t>(result);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool ExtractRecordKey(const uint8_t* begin,
+                      const uint8_t* end,
+                      int32_t field_number,
+                      uint64_t& key) {
+  bool found = false;
+  const uint8_t* cursor = begin;
+  while (cursor != end) {
+    codec::Tag tag;
+    cursor = codec::ParseValue(cursor, end, 0, tag);
+    if (!cursor) {
+      return false;
+    }
+    const codec::WireType wire_type = codec::GetWireTypeFromTag(tag);
+    if (codec::GetFieldNumberFromTag(tag) != field_number) {
+      cursor = codec::SkipValueAfterTag(cursor, end, 0, wire_type);
+      if (!cursor) {
+        return false;
+      }
+      continue;
+    }
+
+    switch (wire_type) {
+      case codec::WireType::kVarint:
+        cursor = codec::ParseValue(cursor, end, 0, key);
+        break;
+
+      case codec::WireType::kFixed64Bit: {
+        fixed64_t value;
+        cursor = codec::ParseValue(cursor, end, 0, value);
+        key = value.value();
+        break;
+      }
+
+      case codec::WireType::kLengthDelimited: {
+        uint32_t byte_count;
+        cursor = codec::ParseValue(cursor, end, 0, byte_count);
+        if (!cursor || static_cast<uint32_t>(end - cursor) < byte_count) {
+          return false;
+        }
+        key = HashRecordKeyBytes(std::string_view(
+            reinterpret_cast<const char*>(cursor), byte_count));
+        cursor += byte_count;
+        break;
+      }
+
+      case codec::WireType::kFixed32Bit: {
+        fixed32_t value;
+        cursor = codec::ParseValue(cursor, end, 0, value);
+        key = value.value();
+        break;
+      }
+
+      default:
+        return false;
+    }
+    if (!cursor) {
+      return false;
+    }
+    found = true;
+  }
+  return found;
+}
+
+uint64_t HashRecordKeyBytes(std::string_view bytes) {
+  const auto* p = reinterpret_cast<const uint8_t*>(bytes.data());
+  std::size_t remaining = bytes.size();
+  uint64_t hash = MixBits(remaining + 0x9e3779b97f4a7c15ull);
+  for (; remaining >= 8; remaining -= 8, p += 8) {
+    hash = MixBits(hash ^ LoadLittleEndian64(p));
+  }
+  if (remaining > 0) {
+    uint8_t tail[8]{};
+    std::memcpy(tail, p, remaining);
+    hash = MixBits(hash ^ LoadLittleEndian64(tail));
+  }
+  return hash;
+}
+
+RecordIndexBuilder::RecordIndexBuilder(const Options& options)
+    : options_(options) {
+  assert(options_.key_field_number > 0);
+  assert(options_.bloom_bits_per_key >= 0);
+}
+
+bool RecordIndexBuilder::AddRecord(const RecordPosition& position,
+                                   const uint8_t* begin,
+                                   const uint8_t* end) {
+  uint64_t key;
+  if (!ExtractRecordKey(begin, end, options_.key_field_number, key)) {
+    return false;
+  }
+  AddKey(key, position);
+  return true;
+}
+
+void RecordIndexBuilder::AddKey(uint64_t key, const RecordPosition& position) {
+  entries_.push_back(Entry{key, position});
+}
+
+bool RecordIndexBuilder::WriteTo(int fd) {
+  // Build the filters from the entries in file order (which is usually the
+  // order they were added in).
+  const auto in_file_order = [](const Entry& a, const Entry& b) {
+    return a.position.block_offset != b.position.block_offset
+               ? a.position.block_offset < b.position.block_offset
+               : a.position.offset_in_block < b.position.offset_in_block;
+  };
+  const int bits_per_key = options_.bloom_bits_per_key;
+  const int hash_count = bits_per_key > 0 ? ComputeHashCount(bits_per_key) : 0;
+  std::vector<uint8_t> filter_directory;
+  std::vector<uint64_t> filter_words;
+  if (bits_per_key > 0) {
+    if (!std::is_sorted(entries_.begin(), entries_.end(), in_file_order)) {
+      std::sort(entries_.begin(), entries_.end(), in_file_order);
+    }
+    for (auto block_begin = entries_.begin(); block_begin != entries_.end();) {
+      const int64_t block_offset = block_begin->position.block_offset;
+      const auto block_end = std::find_if(
+          block_begin, entries_.end(), [&](const Entry& entry) {
+            return entry.position.block_offset != block_offset;
+          });
+      const auto key_count = static_cast<uint64_t>(block_end - block_begin);
+      const uint64_t word_count =
+          std::max<uint64_t>(1, (key_count * static_cast<uint64_t>(
+                                                 bits_per_key) +
+                                 63) / 64);
+      const std::size_t first_word = filter_words.size();
+      filter_words.resize(first_word + word_count);
+      uint64_t* const words = filter_words.data() + first_word;
+      for (auto it = block_begin; it != block_end; ++it) {
+        ForEachFilterBit(it->key, hash_count, word_count * 64,
+                         [&](uint64_t bit) {
+                           words[bit / 64] |= uint64_t{1} << (bit % 64);
+                         });
+      }
+
+      uint8_t directory_entry[kFilterDirectoryEntrySize];
+      StoreLittleEndian64(static_cast<uint64_t>(block_offset),
+                          directory_entry);
+      StoreLittleEndian32(static_cast<uint32_t>(first_word),
+                          directory_entry + 8);
+      StoreLittleEndian32(static_cast<uint32_t>(word_count),
+                          directory_entry + 12);
+      filter_directory.insert(filter_directory.end(), directory_entry,
+                              directory_entry + sizeof(directory_entry));
+      block_begin = block_end;
+    }
+  }
+
+  std::sort(entries_.begin(), entries_.end(),
+            [&](const Entry& a, const Entry& b) {
+              return a.key != b.key ? a.key < b.key : in_file_order(a, b);
+            });
+  const uint64_t entry_count = options_.include_entries ? entries_.size() : 0;
+  const uint64_t summary_count =
+      (entry_count + kEntriesPerSummaryKey - 1) / kEntriesPerSummaryKey;
+  const uint64_t filter_count =
+      filter_directory.size() / kFilterDirectoryEntrySize;
+
+  std::vector<uint8_t> file(kHeaderSize + entry_count * kEntrySize +
+                            summary_count * kSummaryKeySize +
+                            filter_directory.size() +
+                            filter_words.size() * kFilterWordSize);
+  uint8_t* p = file.data();
+  StoreLittleEndian32(kIndexMagic, p);
+  StoreLittleEndian32(options_.include_entries ? kHasEntriesFlag : 0, p + 4);
+  StoreLittleEndian64(entry_count, p + 8);
+  StoreLittleEndian64(summary_count, p + 16);
+  StoreLittleEndian64(filter_count, p + 24);
+  StoreLittleEndian64(filter_words.size(), p + 32);
+  StoreLittleEndian32(static_cast<uint32_t>(hash_count), p + 40);
+  StoreLittleEndian32(static_cast<uint32_t>(options_.key_field_number),
+                      p + 44);
+  p += kHeaderSize;
+  for (uint64_t i = 0; i < entry_count; ++i, p += kEntrySize) {
+    const Entry& entry = entries_[i];
+    StoreLittleEndian64(entry.key, p);
+    StoreLittleEndian64(static_cast<uint64_t>(entry.position.block_offset),
+                        p + 8);
+    StoreLittleEndian32(static_cast<uint32_t>(entry.position.offset_in_block),
+                        p + 16);
+  }
+  for (uint64_t i = 0; i < summary_count; ++i, p += kSummaryKeySize) {
+    StoreLittleEndian64(entries_[i * kEntriesPerSummaryKey].key, p);
+  }
+  if (!filter_directory.empty()) {
+    std::memcpy(p, filter_directory.data(), filter_directory.size());
+    p += filter_directory.size();
+  }
+  for (uint64_t word : filter_words) {
+    StoreLittleEndian64(word, p);
+    p += kFilterWordSize;
+  }
+  assert(p == file.data() + file.size());
+  return WriteFully(fd, file.data(), file.size());
+}
+
+bool BuildRecordIndex(const RecordFileReader& reader,
+                      const RecordIndexBuilder::Options& options,
+                      int index_fd) {
+  RecordIndexBuilder builder(options);
+  RecordBlock block;
+  for (int i = 0; i < reader.block_count(); ++i) {
+    if (!reader.ReadBlock(i, block)) {
+      return false;
+    }
+    // Each record's position is where its header starts, which is where the
+    // previous record ended.
+    RecordPosition position{reader.block_info(i).offset, 0};
+    if (!block.ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+          static_cast<void>(builder.AddRecord(position, begin, end));
+          position.offset_in_block = static_cast<int32_t>(end - block.data());
+        })) {
+      return false;
+    }
+  }
+  return builder.WriteTo(index_fd);
+}
+
+// static
+std::unique_ptr<RecordIndexReader> RecordIndexReader::Open(int fd) {
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size < kHeaderSize) {
+    return nullptr;
+  }
+  const auto size = static_cast<std::size_t>(status.st_size);
+  void* const mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return nullptr;
+  }
+  // Lookups touch only a few pages, scattered across the file.
+  static_cast<void>(madvise(mapping, size, MADV_RANDOM));
+
+  std::unique_ptr<RecordIndexReader> reader(
+      new RecordIndexReader(static_cast<const uint8_t*>(mapping), size));
+  const uint8_t* const header = reader->data_;
+  if (LoadLittleEndian32(header) != kIndexMagic) {
+    return nullptr;
+  }
+  const uint64_t entry_count = LoadLittleEndian64(header + 8);
+  const uint64_t summary_count = LoadLittleEndian64(header + 16);
+  const uint64_t filter_count = LoadLittleEndian64(header + 24);
+  const uint64_t filter_word_count = LoadLittleEndian64(header + 32);
+  const uint32_t hash_count = LoadLittleEndian32(header + 40);
+
+  // Check each section fits in the file, before computing where the next one
+  // starts (so none of the arithmetic can overflow).
+  uint64_t offset = kHeaderSize;
+  const auto take_section = [&](uint64_t count, uint64_t element_size) {
+    if (count > (size - offset) / element_size) {
+      return static_cast<const uint8_t*>(nullptr);
+    }
+    const uint8_t* const section = header + offset;
+    offset += count * element_size;
+    return section;
+  };
+  reader->entries_ = take_section(entry_count, kEntrySize);
+  reader->summary_ = take_section(summary_count, kSummaryKeySize);
+  reader->filter_directory_ =
+      take_section(filter_count, kFilterDirectoryEntrySize);
+  reader->filter_words_ = take_section(filter_word_count, kFilterWordSize);
+  if (!reader->entries_ || !reader->summary_ || !reader->filter_directory_ ||
+      !reader->filter_words_ || offset != size) {
+    return nullptr;
+  }
+  if (summary_count != (entry_count + kEntriesPerSummaryKey - 1) /
+                           kEntriesPerSummaryKey ||
+      (filter_count > 0 && (hash_count == 0 || hash_count > kMaxHashCount))) {
+    return nullptr;
+  }
+  reader->has_entries_ = (LoadLittleEndian32(header + 4) & kHasEntriesFlag);
+  reader->entry_count_ = static_cast<int64_t>(entry_count);
+  reader->summary_count_ = static_cast<int64_t>(summary_count);
+  reader->filter_count_ = static_cast<int64_t>(filter_count);
+  reader->filter_word_count_ = static_cast<int64_t>(filter_word_count);
+  reader->hash_count_ = static_cast<int>(hash_count);
+
+  // Check that every filter lies within the filter words, so that lookups
+  // need not.
+  for (int64_t i = 0; i < reader->filter_count_; ++i) {
+    const uint8_t* const entry =
+        reader->filter_directory_ + i * kFilterDirectoryEntrySize;
+    const uint64_t first_word = LoadLittleEndian32(entry + 8);
+    const uint64_t word_count = LoadLittleEndian32(entry + 12);
+    if (word_count == 0 || first_word + word_count > filter_word_count) {
+      return nullptr;
+    }
+  }
+  return reader;
+}
+
+RecordIndexReader::RecordIndexReader(const uint8_t* data, std::size_t size)
+    : data_(data), size_(size) {}
+
+RecordIndexReader::~RecordIndexReader() {
+  munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+std::vector<int64_t> RecordIndexReader::FindCandidateBlocks(
+    uint64_t key) const {
+  std::vector<int64_t> block_offsets;
+  for (int64_t i = 0; i < filter_count_; ++i) {
+    if (FilterMayContain(i, key)) {
+      block_offsets.push_back(static_cast<int64_t>(LoadLittleEndian64(
+          filter_directory_ + i * kFilterDirectoryEntrySize)));
+    }
+  }
+  return block_offsets;
+}
+
+int64_t RecordIndexReader::FindFirstEntry(uint64_t key) const {
+  // Find the first summary key not less than |key|. The entry sought is then
+  // either in the span of entries before it, or is the entry it summarizes.
+  int64_t low = 0;
+  int64_t high = summary_count_;
+  while (low < high) {
+    const int64_t middle = low + (high - low) / 2;
+    if (LoadLittleEndian64(summary_ + middle * kSummaryKeySize) < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == 0) {
+    return 0;
+  }
+
+  // Search the span of entries before it.
+  high = std::min(low * kEntriesPerSummaryKey, entry_count_);
+  low = (low - 1) * kEntriesPerSummaryKey;
+  while (low < high) {
+    const int64_t middle = low + (high - low) / 2;
+    if (GetKey(middle) < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+uint64_t RecordIndexReader::GetKey(int64_t index) const {
+  assert(index >= 0 && index < entry_count_);
+  return LoadLittleEndian64(entries_ + index * kEntrySize);
+}
+
+RecordPosition RecordIndexReader::GetPosition(int64_t index) const {
+  assert(index >= 0 && index < entry_count_);
+  const uint8_t* const entry = entries_ + index * kEntrySize;
+  return RecordPosition{static_cast<int64_t>(LoadLittleEndian64(entry + 8)),
+                        static_cast<int32_t>(LoadLittleEndian32(entry + 16))};
+}
+
+bool RecordIndexReader::FilterMayContain(int64_t filter_index,
+                                         uint64_t key) const {
+  const uint8_t* const entry =
+      filter_directory_ + filter_index * kFilterDirectoryEntrySize;
+  const uint8_t* const words =
+      filter_words_ + LoadLittleEndian32(entry + 8) * uint64_t{kFilterWordSize};
+  const uint64_t word_count = LoadLittleEndian32(entry + 12);
+  bool may_contain = true;
+  ForEachFilterBit(key, hash_count_, word_count * 64, [&](uint64_t bit) {
+    const uint64_t word = LoadLittleEndian64(words + (bit / 64) * 8);
+    may_contain &= ((word >> (bit % 64)) & 1) != 0;
+  });
+  return may_contain;
+}
+
+}  // namespace pb
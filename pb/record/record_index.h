@@ -0,0 +1,181 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "pb/record/record_file.h"
+
+namespace pb {
+
+// A secondary index over a record file (see record_file.h), keyed by one
+// top-level field of the messages in the records. It is a separate file
+// containing:
+//
+//   1. The entries: (key, record position) pairs, sorted by key. A lookup
+//      binary-searches a small summary (the first key of every 4 KB of
+//      entries), and then only the one span of entries it points to. So, with
+//      the index memory-mapped, a cold lookup touches about two pages of
+//      entries, no matter how large the index is.
+//   2. Optionally, one Bloom filter per block of the record file, which can
+//      answer "might this block contain the key?" without the entries. The
+//      entries may be omitted, for a much smaller index that narrows a lookup
+//      down to a few blocks, which are then scanned.
+//
+// Keys are 64-bit integers, extracted directly from the wire bytes of each
+// record (without parsing the whole message) by ExtractRecordKey().
+
+// Finds the last occurrence of the top-level field with |field_number| in the
+// wire-format message in the range |begin| to |end|, and sets |key| from its
+// value: For varint fields, the value as an unsigned integer (so, the value
+// of a negative int32 or int64 is sign-extended to 64 bits, and sint32/sint64
+// values are still ZigZag-encoded). For fixed-size fields, the bits of the
+// value. For string and bytes fields, HashRecordKeyBytes() of the contents.
+// Returns false if the message has no such field, or is malformed.
+[[nodiscard]] bool ExtractRecordKey(const uint8_t* begin,
+                                    const uint8_t* end,
+                                    int32_t field_number,
+                                    uint64_t& key);
+
+// Returns the key for a string or bytes field value (see ExtractRecordKey()).
+// Different values may hash to the same key, and so a lookup by a string key
+// may find records that have a different string in the key field.
+[[nodiscard]] uint64_t HashRecordKeyBytes(std::string_view bytes);
+
+// Collects the keys of records, and writes them as an index file.
+class RecordIndexBuilder {
+ public:
+  struct Options {
+    // The top-level field whose value is the key.
+    int32_t key_field_number = 1;
+
+    // Whether to write the sorted entries (see above).
+    bool include_entries = true;
+
+    // The size of the per-block Bloom filters, in bits per key. Zero means
+    // there are no filters. At 10 bits per key, about 1% of lookups for an
+    // absent key will falsely match a block.
+    int bloom_bits_per_key = 0;
+  };
+
+  explicit RecordIndexBuilder(const Options& options);
+
+  RecordIndexBuilder(const RecordIndexBuilder&) = delete;
+  RecordIndexBuilder& operator=(const RecordIndexBuilder&) = delete;
+
+  // Extracts the key from the record at |position|, whose wire bytes are the
+  // range |begin| to |end|. Returns false (and skips the record) if it has no
+  // key field, or is malformed.
+  [[nodiscard]] bool AddRecord(const RecordPosition& position,
+                               const uint8_t* begin,
+                               const uint8_t* end);
+
+  // Adds an entry directly.
+  void AddKey(uint64_t key, const RecordPosition& position);
+
+  [[nodiscard]] int64_t key_count() const {
+    return static_cast<int64_t>(entries_.size());
+  }
+
+  // Sorts the entries, and writes the index to |fd|, which must refer to an
+  // empty file opened for writing. Returns false on error.
+  [[nodiscard]] bool WriteTo(int fd);
+
+ private:
+  struct Entry {
+    uint64_t key;
+    RecordPosition position;
+  };
+
+  const Options options_;
+  std::vector<Entry> entries_;
+};
+
+// Reads every record in the record file, and writes an index of them to
+// |index_fd|. Records without a key field are skipped. Returns false on error.
+[[nodiscard]] bool BuildRecordIndex(const RecordFileReader& reader,
+                                    const RecordIndexBuilder::Options& options,
+                                    int index_fd);
+
+// Memory-maps an index file, and looks up keys in it. Example:
+//
+//   auto index = pb::RecordIndexReader::Open(index_fd);
+//   pb::RecordBlock block;
+//   index->Lookup(key, [&](const pb::RecordPosition& position) {
+//     const uint8_t* begin;
+//     const uint8_t* end;
+//     if (records->ReadRecord(position, block, begin, end)) {
+//       Account account;
+//       if (pb::MergeFromPaddedBuffer(begin, end, account)) { ... }
+//     }
+//   });
+//
+// A RecordIndexReader is thread-safe.
+class RecordIndexReader {
+ public:
+  // Returns nullptr if the file cannot be mapped, or is not a valid index.
+  [[nodiscard]] static std::unique_ptr<RecordIndexReader> Open(int fd);
+
+  RecordIndexReader(const RecordIndexReader&) = delete;
+  RecordIndexReader& operator=(const RecordIndexReader&) = delete;
+
+  ~RecordIndexReader();
+
+  [[nodiscard]] int64_t entry_count() const { return entry_count_; }
+  [[nodiscard]] bool has_entries() const { return has_entries_; }
+  [[nodiscard]] bool has_filters() const { return filter_count_ > 0; }
+
+  // Calls |handler| with the position of each record having |key|, in file
+  // order:
+  //
+  //   void handler(const pb::RecordPosition& position);
+  //
+  // Returns the number of records found. Requires has_entries().
+  template <typename Handler>
+  int64_t Lookup(uint64_t key, Handler&& handler) const {
+    int64_t index = FindFirstEntry(key);
+    const int64_t first = index;
+    for (; index < entry_count_ && GetKey(index) == key; ++index) {
+      handler(GetPosition(index));
+    }
+    return index - first;
+  }
+
+  // Returns the file offsets of the blocks whose Bloom filters might contain
+  // |key|, in file order. Requires has_filters().
+  [[nodiscard]] std::vector<int64_t> FindCandidateBlocks(uint64_t key) const;
+
+  // Returns the index of the first entry with a key not less than |key|.
+  [[nodiscard]] int64_t FindFirstEntry(uint64_t key) const;
+
+  [[nodiscard]] uint64_t GetKey(int64_t index) const;
+  [[nodiscard]] RecordPosition GetPosition(int64_t index) const;
+
+ private:
+  RecordIndexReader(const uint8_t* data, std::size_t size);
+
+  // Returns true if the Bloom filter at |filter_index| might contain |key|.
+  [[nodiscard]] bool FilterMayContain(int64_t filter_index,
+                                      uint64_t key) const;
+
+  const uint8_t* const data_;
+  const std::size_t size_;
+  bool has_entries_ = false;
+  int64_t entry_count_ = 0;
+  const uint8_t* entries_ = nullptr;
+  int64_t summary_count_ = 0;
+  const uint8_t* summary_ = nullptr;
+  int64_t filter_count_ = 0;
+  int hash_count_ = 0;
+  const uint8_t* filter_directory_ = nullptr;
+  const uint8_t* filter_words_ = nullptr;
+  int64_t filter_word_count_ = 0;
+};
+
+}  // namespace pb
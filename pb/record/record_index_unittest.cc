@@ -0,0 +1,336 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/record_index.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/record/temp_file_for_testing.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Account {
+  std::string name;
+  int64_t id = 0;
+  fixed32_t region{};
+  fixed64_t serial{};
+  std::string email;
+
+  using ProtobufFields = FieldList<Field<&Account::name, 1>,
+                                   Field<&Account::id, 2>,
+                                   Field<&Account::region, 3>,
+                                   Field<&Account::serial, 4>,
+                                   Field<&Account::email, 5>>;
+};
+
+Account MakeAccount(int64_t id) {
+  Account account;
+  account.name = "account " + std::to_string(id);
+  account.id = id;
+  account.region = static_cast<uint32_t>(id % 7);
+  account.serial = static_cast<uint64_t>(id) * 0x100000001ull;
+  account.email = "user" + std::to_string(id) + "@example.com";
+  return account;
+}
+
+std::vector<uint8_t> SerializeToVector(const Account& account) {
+  std::vector<uint8_t> bytes(
+      static_cast<std::size_t>(ComputeSerializedSize(account)));
+  Serialize(account, bytes.data());
+  return bytes;
+}
+
+TEST(ExtractRecordKeyTest, ExtractsEachKindOfField) {
+  const Account account = MakeAccount(-42);
+  const std::vector<uint8_t> bytes = SerializeToVector(account);
+  const uint8_t* const begin = bytes.data();
+  const uint8_t* const end = begin + bytes.size();
+  uint64_t key;
+
+  ASSERT_TRUE(ExtractRecordKey(begin, end, 2, key));
+  EXPECT_EQ(static_cast<uint64_t>(int64_t{-42}), key);
+  ASSERT_TRUE(ExtractRecordKey(begin, end, 3, key));
+  EXPECT_EQ(account.region.value(), key);
+  ASSERT_TRUE(ExtractRecordKey(begin, end, 4, key));
+  EXPECT_EQ(account.serial.value(), key);
+  ASSERT_TRUE(ExtractRecordKey(begin, end, 5, key));
+  EXPECT_EQ(HashRecordKeyBytes(account.email), key);
+  EXPECT_NE(HashRecordKeyBytes(account.name), key);
+
+  EXPECT_FALSE(ExtractRecordKey(begin, end, 6, key));
+  EXPECT_FALSE(ExtractRecordKey(begin, begin, 2, key));
+}
+
+TEST(ExtractRecordKeyTest, UsesTheLastOccurrence) {
+  // Field 1 = 5, field 2 = "x", field 1 = 300.
+  const uint8_t kBytes[] = {0x08, 0x05, 0x12, 0x01, 'x', 0x08, 0xac, 0x02};
+  uint64_t key;
+  ASSERT_TRUE(ExtractRecordKey(kBytes, kBytes + sizeof(kBytes), 1, key));
+  EXPECT_EQ(300u, key);
+}
+
+TEST(ExtractRecordKeyTest, RejectsMalformedMessages) {
+  uint64_t key;
+  // Truncated string in a field before the key field.
+  const uint8_t kTruncated[] = {0x0a, 0x05, 'a', 'b', 0x10, 0x01};
+  EXPECT_FALSE(
+      ExtractRecordKey(kTruncated, kTruncated + sizeof(kTruncated), 2, key));
+  // Truncated fixed64 key.
+  const uint8_t kShortFixed[] = {0x21, 0x01, 0x02};
+  EXPECT_FALSE(
+      ExtractRecordKey(kShortFixed, kShortFixed + sizeof(kShortFixed), 4, key));
+  // Group wire type.
+  const uint8_t kGroup[] = {0x0b, 0x0c};
+  EXPECT_FALSE(ExtractRecordKey(kGroup, kGroup + sizeof(kGroup), 1, key));
+}
+
+TEST(HashRecordKeyBytesTest, DependsOnEveryByte) {
+  const std::string base = "a string key that is longer than eight bytes";
+  const uint64_t base_hash = HashRecordKeyBytes(base);
+  EXPECT_EQ(base_hash, HashRecordKeyBytes(std::string(base)));
+  for (std::size_t i = 0; i < base.size(); ++i) {
+    std::string changed = base;
+    changed[i] ^= 1;
+    EXPECT_NE(base_hash, HashRecordKeyBytes(changed)) << i;
+  }
+  EXPECT_NE(HashRecordKeyBytes(""), HashRecordKeyBytes(std::string(1, '\0')));
+  EXPECT_NE(HashRecordKeyBytes(base), HashRecordKeyBytes(base + '\0'));
+}
+
+class RecordIndexTest : public ::testing::Test {
+ protected:
+  static constexpr int64_t kAccountCount = 3000;
+
+  // Writes accounts with ids 0, 2, 4, ... (so odd ids are absent), in a
+  // shuffled order, with some ids appearing twice.
+  void SetUp() override {
+    RecordFileWriter::Options options;
+    options.block_bytes = 2048;
+    RecordFileWriter writer(records_.fd(), options);
+    for (int64_t i = 0; i < kAccountCount; ++i) {
+      const int64_t id = ((i * 7919) % kAccountCount) * 2;
+      ASSERT_TRUE(writer.Append(MakeAccount(id)));
+      if (i % 100 == 0) {
+        ASSERT_TRUE(writer.Append(MakeAccount(id)));
+      }
+    }
+    ASSERT_TRUE(writer.Finish());
+    reader_ = RecordFileReader::Open(records_.fd());
+    ASSERT_TRUE(reader_);
+    ASSERT_GT(reader_->block_count(), 10);
+  }
+
+  std::unique_ptr<RecordIndexReader> BuildIndex(
+      const RecordIndexBuilder::Options& options) {
+    EXPECT_TRUE(BuildRecordIndex(*reader_, options, index_.fd()));
+    return RecordIndexReader::Open(index_.fd());
+  }
+
+  // Returns the number of accounts with the given |id| in the block at
+  // |block_offset|.
+  int CountAccountsInBlock(int64_t block_offset, int64_t id) {
+    for (int i = 0; i < reader_->block_count(); ++i) {
+      if (reader_->block_info(i).offset != block_offset) {
+        continue;
+      }
+      RecordBlock block;
+      EXPECT_TRUE(reader_->ReadBlock(i, block));
+      int count = 0;
+      EXPECT_TRUE(
+          block.ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+            Account account;
+            EXPECT_TRUE(MergeFromPaddedBuffer(begin, end, account));
+            count += (account.id == id);
+          }));
+      return count;
+    }
+    ADD_FAILURE() << "No block at " << block_offset;
+    return 0;
+  }
+
+  TempFile records_;
+  TempFile index_;
+  std::unique_ptr<RecordFileReader> reader_;
+};
+
+TEST_F(RecordIndexTest, LooksUpEveryRecordByKey) {
+  RecordIndexBuilder::Options options;
+  options.key_field_number = 2;
+  const auto index = BuildIndex(options);
+  ASSERT_TRUE(index);
+  EXPECT_TRUE(index->has_entries());
+  EXPECT_FALSE(index->has_filters());
+  EXPECT_EQ(kAccountCount + kAccountCount / 100, index->entry_count());
+
+  // The order each id was appended in (see SetUp()).
+  std::vector<int64_t> append_order(kAccountCount);
+  for (int64_t i = 0; i < kAccountCount; ++i) {
+    append_order[static_cast<std::size_t>((i * 7919) % kAccountCount)] = i;
+  }
+
+  RecordBlock block;
+  for (int64_t id = -1; id <= kAccountCount * 2; ++id) {
+    std::vector<RecordPosition> positions;
+    const int64_t count =
+        index->Lookup(static_cast<uint64_t>(id),
+                      [&](const RecordPosition& position) {
+                        positions.push_back(position);
+                      });
+    ASSERT_EQ(count, static_cast<int64_t>(positions.size()));
+    if (id < 0 || id % 2 != 0 || id == kAccountCount * 2) {
+      EXPECT_EQ(0, count) << id;
+      continue;
+    }
+    const bool is_duplicated =
+        append_order[static_cast<std::size_t>(id / 2)] % 100 == 0;
+    EXPECT_EQ(is_duplicated ? 2 : 1, count) << id;
+    for (const RecordPosition& position : positions) {
+      const uint8_t* begin;
+      const uint8_t* end;
+      ASSERT_TRUE(reader_->ReadRecord(position, block, begin, end));
+      Account account;
+      ASSERT_TRUE(MergeFromPaddedBuffer(begin, end, account));
+      EXPECT_EQ(id, account.id);
+    }
+  }
+}
+
+TEST_F(RecordIndexTest, LooksUpStringKeys) {
+  RecordIndexBuilder::Options options;
+  options.key_field_number = 5;
+  const auto index = BuildIndex(options);
+  ASSERT_TRUE(index);
+
+  RecordBlock block;
+  for (int64_t id : {int64_t{0}, int64_t{2}, int64_t{1234}, int64_t{5998}}) {
+    const std::string email = MakeAccount(id).email;
+    int found = 0;
+    index->Lookup(HashRecordKeyBytes(email),
+                  [&](const RecordPosition& position) {
+                    const uint8_t* begin;
+                    const uint8_t* end;
+                    ASSERT_TRUE(
+                        reader_->ReadRecord(position, block, begin, end));
+                    Account account;
+                    ASSERT_TRUE(MergeFromPaddedBuffer(begin, end, account));
+                    found += (account.email == email);
+                  });
+    EXPECT_GE(found, 1) << email;
+  }
+}
+
+TEST_F(RecordIndexTest, BloomFiltersHaveNoFalseNegatives) {
+  RecordIndexBuilder::Options options;
+  options.key_field_number = 2;
+  options.include_entries = false;
+  options.bloom_bits_per_key = 10;
+  const auto index = BuildIndex(options);
+  ASSERT_TRUE(index);
+  EXPECT_FALSE(index->has_entries());
+  EXPECT_EQ(0, index->entry_count());
+  ASSERT_TRUE(index->has_filters());
+
+  int64_t false_positives = 0;
+  int64_t absent_lookups = 0;
+  for (int64_t id = 0; id < kAccountCount * 2; ++id) {
+    const std::vector<int64_t> blocks =
+        index->FindCandidateBlocks(static_cast<uint64_t>(id));
+    ASSERT_TRUE(std::is_sorted(blocks.begin(), blocks.end()));
+    int found = 0;
+    for (int64_t block_offset : blocks) {
+      const int count = CountAccountsInBlock(block_offset, id);
+      found += count;
+      false_positives += (count == 0);
+    }
+    if (id % 2 == 0) {
+      EXPECT_GE(found, 1) << id;
+    } else {
+      EXPECT_EQ(0, found);
+    }
+    absent_lookups += reader_->block_count() - static_cast<int>(found > 0);
+  }
+  // About 1% of the checks of a block for a key it lacks should pass.
+  EXPECT_LT(false_positives, absent_lookups / 40);
+}
+
+TEST_F(RecordIndexTest, CombinesEntriesAndFilters) {
+  RecordIndexBuilder::Options options;
+  options.key_field_number = 2;
+  options.bloom_bits_per_key = 8;
+  const auto index = BuildIndex(options);
+  ASSERT_TRUE(index);
+  EXPECT_TRUE(index->has_entries());
+  EXPECT_TRUE(index->has_filters());
+  index->Lookup(uint64_t{100}, [&](const RecordPosition& position) {
+    const std::vector<int64_t> blocks = index->FindCandidateBlocks(100);
+    EXPECT_NE(blocks.end(),
+              std::find(blocks.begin(), blocks.end(), position.block_offset));
+  });
+}
+
+TEST(RecordIndexBuilderTest, IndexesAddedKeys) {
+  RecordIndexBuilder builder(RecordIndexBuilder::Options{});
+  for (uint64_t key = 1000; key > 0; --key) {
+    builder.AddKey(key * 3,
+                   RecordPosition{static_cast<int64_t>(key / 64) * 4096,
+                                  static_cast<int32_t>(key % 64)});
+  }
+  const uint8_t kNoKeyField[] = {0x10, 0x01};
+  EXPECT_FALSE(builder.AddRecord(RecordPosition{}, kNoKeyField,
+                                 kNoKeyField + sizeof(kNoKeyField)));
+  EXPECT_EQ(1000, builder.key_count());
+
+  TempFile file;
+  ASSERT_TRUE(builder.WriteTo(file.fd()));
+  const auto index = RecordIndexReader::Open(file.fd());
+  ASSERT_TRUE(index);
+  ASSERT_EQ(1000, index->entry_count());
+  for (int64_t i = 1; i < index->entry_count(); ++i) {
+    EXPECT_LT(index->GetKey(i - 1), index->GetKey(i));
+  }
+  for (uint64_t key = 0; key <= 3003; ++key) {
+    const int64_t first = index->FindFirstEntry(key);
+    EXPECT_EQ(static_cast<int64_t>((key + 2) / 3) - 1 + (key == 0), first)
+        << key;
+  }
+  EXPECT_EQ(1, index->Lookup(uint64_t{300}, [](const RecordPosition& p) {
+    EXPECT_EQ((RecordPosition{4096, 36}), p);
+  }));
+}
+
+TEST(RecordIndexReaderTest, RejectsInvalidFiles) {
+  TempFile empty;
+  EXPECT_FALSE(RecordIndexReader::Open(empty.fd()));
+
+  TempFile garbage;
+  const std::vector<uint8_t> bytes(4096, 0x5a);
+  ASSERT_EQ(static_cast<ssize_t>(bytes.size()),
+            write(garbage.fd(), bytes.data(), bytes.size()));
+  EXPECT_FALSE(RecordIndexReader::Open(garbage.fd()));
+
+  // A valid index, truncated.
+  TempFile truncated;
+  RecordIndexBuilder builder(RecordIndexBuilder::Options{});
+  for (uint64_t key = 0; key < 100; ++key) {
+    builder.AddKey(key, RecordPosition{});
+  }
+  ASSERT_TRUE(builder.WriteTo(truncated.fd()));
+  EXPECT_TRUE(RecordIndexReader::Open(truncated.fd()));
+  ASSERT_TRUE(truncated.Truncate(truncated.size() - 8));
+  EXPECT_FALSE(RecordIndexReader::Open(truncated.fd()));
+}
+
+}  // namespace
+}  // namespace pb
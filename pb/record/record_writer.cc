@@ -0,0 +1,204 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/record_writer.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+
+#include "pb/codec/limits.h"
+#include "pb/codec/serialize.h"
+
+namespace pb {
+
+namespace {
+
+RecordFileWriter::Options MakeFileWriterOptions(
+    const RecordWriter::Options& options) {
+  RecordFileWriter::Options file_options;
+  file_options.block_bytes = options.block_bytes;
+  file_options.compression = options.compression;
+  file_options.lz_search_depth = options.lz_search_depth;
+  return file_options;
+}
+
+bool SyncFile(int fd) {
+  for (;;) {
+#if defined(__linux__)
+    const int result = fdatasync(fd);
+#else
+    const int result = fsync(fd);
+#endif
+    if (result == 0) {
+      return true;
+    } else if (errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+}  // namespace
+
+RecordWriter::RecordWriter(int fd) : RecordWriter(fd, Options()) {}
+
+RecordWriter::RecordWriter(int fd, const Options& options)
+    : fd_(fd),
+      options_(options),
+      file_writer_(fd, MakeFileWriterOptions(options)),
+      thread_(&RecordWriter::WriteGroups, this) {
+  assert(options_.max_pending_bytes > 0);
+}
+
+RecordWriter::~RecordWriter() {
+  static_cast<void>(Close());
+}
+
+int64_t RecordWriter::AppendBytes(const uint8_t* begin,
+                                  const uint8_t* end,
+                                  DurableCallback callback) {
+  const auto byte_count = end - begin;
+  if (byte_count > codec::kMaxSerializedSize) {
+    return -1;
+  }
+  const auto byte_count_as_varint = static_cast<uint32_t>(byte_count);
+  const auto record_size = static_cast<std::size_t>(
+      codec::ComputeSerializedValueSize(byte_count_as_varint) + byte_count);
+  const auto block_bytes = static_cast<std::size_t>(options_.block_bytes);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  space_available_.wait(lock, [&] {
+    return closing_ || failed_ ||
+           static_cast<int64_t>(filling_.bytes.size()) <
+               options_.max_pending_bytes;
+  });
+  if (closing_ || failed_) {
+    return -1;
+  }
+
+  // Start a new block if the current one is full.
+  const std::size_t old_size = filling_.bytes.size();
+  const std::size_t block_begin =
+      filling_.block_ends.empty() ? 0 : filling_.block_ends.back();
+  if ((old_size - block_begin) >= block_bytes) {
+    filling_.block_ends.push_back(old_size);
+  }
+
+  filling_.bytes.resize(old_size + record_size);
+  std::copy(begin, end,
+            codec::SerializeValue(byte_count_as_varint,
+                                  filling_.bytes.data() + old_size));
+  if (callback) {
+    filling_.callbacks.push_back(std::move(callback));
+  }
+  const int64_t sequence = next_sequence_++;
+  filling_.last_sequence = sequence;
+
+  // The background thread only needs waking for the first record of a group,
+  // or (when it is waiting out the commit delay) once a block is full.
+  const bool should_notify =
+      old_size == 0 ||
+      (old_size < block_bytes && filling_.bytes.size() >= block_bytes);
+  lock.unlock();
+  if (should_notify) {
+    group_ready_.notify_one();
+  }
+  return sequence;
+}
+
+bool RecordWriter::WaitUntilDurable(int64_t sequence) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (sequence < 0 || sequence >= next_sequence_) {
+    return false;
+  }
+  durable_.wait(lock,
+                [&] { return durable_sequence_ >= sequence || failed_; });
+  return durable_sequence_ >= sequence;
+}
+
+bool RecordWriter::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closing_) {
+      return closed_ && !failed_;
+    }
+    closing_ = true;
+  }
+  group_ready_.notify_one();
+  space_available_.notify_all();
+  thread_.join();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!failed_ &&
+      !(file_writer_.Finish() && (!options_.sync || SyncFile(fd_)))) {
+    failed_ = true;
+  }
+  closed_ = true;
+  durable_.notify_all();
+  return !failed_;
+}
+
+void RecordWriter::WriteGroups() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    group_ready_.wait(lock,
+                      [this] { return closing_ || !filling_.bytes.empty(); });
+    if (filling_.bytes.empty()) {
+      return;  // Closing, and everything has been written.
+    }
+    if (options_.commit_delay.count() > 0 && !closing_) {
+      const auto block_bytes = static_cast<std::size_t>(options_.block_bytes);
+      group_ready_.wait_for(lock, options_.commit_delay, [&] {
+        return closing_ || filling_.bytes.size() >= block_bytes;
+      });
+    }
+
+    // Take the group, so that producers can start filling the other buffer.
+    std::swap(filling_, writing_);
+    const bool already_failed = failed_;
+    lock.unlock();
+    space_available_.notify_all();
+
+    const bool success = !already_failed && WriteGroup();
+
+    lock.lock();
+    if (success) {
+      durable_sequence_ = writing_.last_sequence;
+    } else {
+      failed_ = true;
+    }
+    lock.unlock();
+    durable_.notify_all();
+    if (!success) {
+      space_available_.notify_all();
+    }
+    for (DurableCallback& callback : writing_.callbacks) {
+      callback(success);
+    }
+    writing_.bytes.clear();
+    writing_.block_ends.clear();
+    writing_.callbacks.clear();
+    lock.lock();
+  }
+}
+
+bool RecordWriter::WriteGroup() {
+  const uint8_t* const bytes = writing_.bytes.data();
+  std::size_t block_begin = 0;
+  for (std::size_t block_end : writing_.block_ends) {
+    if (!file_writer_.AppendBlock(bytes + block_begin, bytes + block_end)) {
+      return false;
+    }
+    block_begin = block_end;
+  }
+  if (!file_writer_.AppendBlock(bytes + block_begin,
+                                bytes + writing_.bytes.size())) {
+    return false;
+  }
+  return !options_.sync || SyncFile(fd_);
+}
+
+}  // namespace pb
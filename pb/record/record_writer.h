@@ -0,0 +1,161 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "pb/record/record_file.h"
+#include "pb/serialize.h"
+
+namespace pb {
+
+// Appends records to a record file (see record_file.h) from many threads, and
+// makes them durable with "group commit": A background thread writes out all
+// the records appended since its last write, and then calls fdatasync() once
+// for all of them. While it waits for the disk, the next group accumulates in
+// a second buffer. So, the more producer threads there are, the more records
+// share the cost of each fdatasync().
+//
+// Append() serializes the message into a per-thread buffer, without holding
+// the writer's lock, so that producers contend only for the copy into the
+// current group. It returns the record's sequence number (or -1 on error)
+// without waiting. The
+// caller then waits for the record to become durable either by calling
+// WaitUntilDurable() with the sequence number, or by passing a callback to
+// Append(), which is run on the background thread. Example:
+//
+//   pb::RecordWriter writer(fd);
+//   ...
+//   // On any thread:
+//   const int64_t sequence = writer.Append(transaction);
+//   if (sequence < 0 || !writer.WaitUntilDurable(sequence)) {
+//     ...  // The write failed.
+//   }
+//
+// The file can be read back with pb::RecordFileReader, even if Close() is
+// never called (e.g., after a crash), in which case the reader scans the
+// blocks instead of using the block index.
+class RecordWriter {
+ public:
+  struct Options {
+    // Each group of records is written as one or more blocks of about this
+    // many bytes.
+    int32_t block_bytes = 64 * 1024;
+
+    // Compression happens on the background thread.
+    RecordCompression compression = RecordCompression::kLz;
+    int lz_search_depth = kDefaultLzSearchDepth;
+
+    // If false, records are considered durable once written to the operating
+    // system, without calling fdatasync().
+    bool sync = true;
+
+    // Append() blocks while this many bytes are waiting to be written.
+    int64_t max_pending_bytes = 16 * 1024 * 1024;
+
+    // Once a group has its first record, the background thread waits up to
+    // this long for more records (or a full block) before writing. Zero
+    // means the group is whatever accumulated while the previous group was
+    // being written.
+    std::chrono::microseconds commit_delay{0};
+  };
+
+  // Called with true once the record is durable, or false if the write
+  // failed.
+  using DurableCallback = std::function<void(bool durable)>;
+
+  // |fd| must refer to an empty file, opened for writing.
+  explicit RecordWriter(int fd);
+  RecordWriter(int fd, const Options& options);
+
+  RecordWriter(const RecordWriter&) = delete;
+  RecordWriter& operator=(const RecordWriter&) = delete;
+
+  // Calls Close().
+  ~RecordWriter();
+
+  // Serializes the |message| as the next record, and returns its sequence
+  // number (which starts from zero, and increases by one with each record).
+  // Returns -1 if the |message| could not be serialized, or the writer has
+  // failed or been closed. If given, the |callback| is run once the record is
+  // durable (unless -1 is returned).
+  template <class Message,
+            std::enable_if_t<
+                std::is_class_v<typename Message::ProtobufFields>,
+                int> = 0>
+  [[nodiscard]] int64_t Append(const Message& message,
+                               DurableCallback callback = nullptr) {
+    const int32_t byte_count = ComputeSerializedSize(message);
+    if (byte_count < 0) {
+      return -1;
+    }
+    thread_local std::vector<uint8_t> buffer;
+    buffer.resize(static_cast<std::size_t>(byte_count));
+    pb::Serialize(message, buffer.data());
+    return AppendBytes(buffer.data(), buffer.data() + buffer.size(),
+                       std::move(callback));
+  }
+
+  // Same as Append(), but for a record containing the bytes in the range
+  // |begin| to |end|.
+  [[nodiscard]] int64_t AppendBytes(const uint8_t* begin,
+                                    const uint8_t* end,
+                                    DurableCallback callback = nullptr);
+
+  // Blocks until the record with the given |sequence| number is durable.
+  // Returns false if it never will be, because a write failed.
+  [[nodiscard]] bool WaitUntilDurable(int64_t sequence);
+
+  // Writes out all appended records, stops the background thread, and then
+  // writes the block index. Returns false if any write failed. No records may
+  // be appended afterwards.
+  [[nodiscard]] bool Close();
+
+ private:
+  // The records appended while the previous group was being written.
+  struct Group {
+    std::vector<uint8_t> bytes;
+    std::vector<std::size_t> block_ends;  // The ends of the full blocks.
+    std::vector<DurableCallback> callbacks;
+    int64_t last_sequence = -1;
+  };
+
+  // The background thread's main loop.
+  void WriteGroups();
+
+  // Writes the blocks of |writing_|, and then calls fdatasync().
+  [[nodiscard]] bool WriteGroup();
+
+  const int fd_;
+  const Options options_;
+
+  // Only used by the background thread, and by Close() once it has stopped.
+  RecordFileWriter file_writer_;
+  Group writing_;
+
+  std::mutex mutex_;
+  std::condition_variable group_ready_;      // Signalled by producers.
+  std::condition_variable space_available_;  // Signalled by the writer.
+  std::condition_variable durable_;          // Signalled by the writer.
+  Group filling_;
+  int64_t next_sequence_ = 0;
+  int64_t durable_sequence_ = -1;
+  bool failed_ = false;
+  bool closing_ = false;
+  bool closed_ = false;
+
+  std::thread thread_;
+};
+
+}  // namespace pb
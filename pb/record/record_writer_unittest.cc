@@ -0,0 +1,181 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/record_writer.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/parse.h"
+#include "pb/record/record_file.h"
+#include "pb/record/temp_file_for_testing.h"
+
+namespace pb {
+namespace {
+
+struct Entry {
+  int32_t producer = 0;
+  int32_t index = 0;
+  std::string payload;
+
+  using ProtobufFields = FieldList<Field<&Entry::producer, 1>,
+                                   Field<&Entry::index, 2>,
+                                   Field<&Entry::payload, 3>>;
+};
+
+Entry MakeEntry(int32_t producer, int32_t index) {
+  return Entry{producer, index,
+               std::string(static_cast<std::size_t>(index % 97),
+                           static_cast<char>('a' + producer))};
+}
+
+std::vector<Entry> ReadAllEntries(int fd, bool expect_index) {
+  std::vector<Entry> entries;
+  const auto reader = RecordFileReader::Open(fd);
+  EXPECT_TRUE(reader);
+  if (!reader) {
+    return entries;
+  }
+  EXPECT_EQ(expect_index, reader->has_index());
+  EXPECT_TRUE(
+      reader->ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+        Entry entry;
+        EXPECT_TRUE(MergeFromPaddedBuffer(begin, end, entry));
+        entries.push_back(std::move(entry));
+      }));
+  return entries;
+}
+
+struct WriterParams {
+  bool sync;
+  std::chrono::microseconds commit_delay;
+};
+
+class RecordWriterTest : public ::testing::TestWithParam<WriterParams> {
+ protected:
+  RecordWriter::Options MakeOptions() const {
+    RecordWriter::Options options;
+    options.block_bytes = 4096;
+    options.sync = GetParam().sync;
+    options.commit_delay = GetParam().commit_delay;
+    return options;
+  }
+};
+
+TEST_P(RecordWriterTest, AppendsFromManyThreads) {
+  constexpr int32_t kProducerCount = 8;
+  constexpr int32_t kEntriesPerProducer = 500;
+  TempFile file;
+  RecordWriter writer(file.fd(), MakeOptions());
+  std::vector<std::thread> producers;
+  for (int32_t p = 0; p < kProducerCount; ++p) {
+    producers.emplace_back([&writer, p] {
+      for (int32_t i = 0; i < kEntriesPerProducer; ++i) {
+        const int64_t sequence = writer.Append(MakeEntry(p, i));
+        ASSERT_GE(sequence, 0);
+        if (i % 50 == 0) {
+          ASSERT_TRUE(writer.WaitUntilDurable(sequence));
+        }
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  ASSERT_TRUE(writer.Close());
+  EXPECT_EQ(-1, writer.Append(MakeEntry(0, 0)));
+
+  // Each producer's entries must appear in the order they were appended.
+  const std::vector<Entry> entries = ReadAllEntries(file.fd(), true);
+  ASSERT_EQ(static_cast<std::size_t>(kProducerCount * kEntriesPerProducer),
+            entries.size());
+  std::vector<int32_t> next_index(kProducerCount);
+  for (const Entry& entry : entries) {
+    ASSERT_LT(entry.producer, kProducerCount);
+    int32_t& expected_index =
+        next_index[static_cast<std::size_t>(entry.producer)];
+    EXPECT_EQ(expected_index, entry.index);
+    EXPECT_EQ(MakeEntry(entry.producer, entry.index).payload, entry.payload);
+    expected_index = entry.index + 1;
+  }
+}
+
+TEST_P(RecordWriterTest, RunsCallbacksOnceDurable) {
+  TempFile file;
+  RecordWriter writer(file.fd(), MakeOptions());
+  std::atomic<int> durable_count{0};
+  int64_t last_sequence = -1;
+  for (int32_t i = 0; i < 1000; ++i) {
+    last_sequence = writer.Append(MakeEntry(0, i), [&](bool durable) {
+      EXPECT_TRUE(durable);
+      ++durable_count;
+    });
+    ASSERT_EQ(i, last_sequence);
+  }
+  ASSERT_TRUE(writer.WaitUntilDurable(last_sequence));
+  EXPECT_FALSE(writer.WaitUntilDurable(last_sequence + 1));  // Not appended.
+  ASSERT_TRUE(writer.Close());
+  EXPECT_EQ(1000, durable_count);
+}
+
+TEST_P(RecordWriterTest, DurableRecordsAreReadableBeforeClose) {
+  TempFile file;
+  RecordWriter writer(file.fd(), MakeOptions());
+  int64_t sequence = -1;
+  for (int32_t i = 0; i < 100; ++i) {
+    const uint8_t kProducerOne[] = {0x08, 0x01};
+    sequence = writer.AppendBytes(kProducerOne, kProducerOne + 2);
+  }
+  ASSERT_TRUE(writer.WaitUntilDurable(sequence));
+
+  const std::vector<Entry> entries = ReadAllEntries(file.fd(), false);
+  ASSERT_EQ(100u, entries.size());
+  EXPECT_EQ(1, entries.back().producer);
+  ASSERT_TRUE(writer.Close());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AllModes,
+    RecordWriterTest,
+    ::testing::Values(WriterParams{true, std::chrono::microseconds(0)},
+                      WriterParams{true, std::chrono::microseconds(200)},
+                      WriterParams{false, std::chrono::microseconds(0)}));
+
+TEST(RecordWriterFailureTest, ReportsWriteErrors) {
+  char path[] = "/tmp/pb_record_writer_unittest_XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  const int read_only_fd = open(path, O_RDONLY);
+  unlink(path);
+  ASSERT_GE(read_only_fd, 0);
+
+  {
+    RecordWriter writer(read_only_fd);
+    std::atomic<int> failure_count{0};
+    const int64_t sequence = writer.Append(MakeEntry(0, 1), [&](bool durable) {
+      EXPECT_FALSE(durable);
+      ++failure_count;
+    });
+    ASSERT_EQ(0, sequence);
+    EXPECT_FALSE(writer.WaitUntilDurable(sequence));
+    EXPECT_EQ(-1, writer.Append(MakeEntry(0, 2)));
+    EXPECT_FALSE(writer.Close());
+    EXPECT_EQ(1, failure_count);
+  }
+  close(read_only_fd);
+}
+
+}  // namespace
+}  // namespace pb
@@ -0,0 +1,58 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+
+namespace pb {
+
+// An anonymous temporary file, for the tests and benchmarks of the record
+// files. It is unlinked as soon as it is created, and closed on destruction.
+class TempFile {
+ public:
+  TempFile() {
+    char path[] = "/tmp/pb_temp_file_XXXXXX";
+    fd_ = mkstemp(path);
+    if (fd_ >= 0) {
+      unlink(path);
+    }
+  }
+
+  TempFile(const TempFile&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+
+  ~TempFile() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // The file descriptor, or -1 if the file could not be created.
+  [[nodiscard]] int fd() const { return fd_; }
+
+  [[nodiscard]] int64_t size() const {
+    struct stat status;
+    return fstat(fd_, &status) == 0 ? status.st_size : 0;
+  }
+
+  // Cuts the file to, or extends it with zeros to, |size| bytes.
+  [[nodiscard]] bool Truncate(int64_t size) {
+    return ftruncate(fd_, static_cast<off_t>(size)) == 0;
+  }
+
+  // Replaces the byte at |offset| (e.g., to corrupt a record).
+  [[nodiscard]] bool Overwrite(int64_t offset, uint8_t byte) {
+    return pwrite(fd_, &byte, 1, static_cast<off_t>(offset)) == 1;
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+}  // namespace pb
@@ -0,0 +1,124 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/traffic_sampler.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include "pb/record/record_file.h"
+
+namespace pb {
+
+namespace {
+
+RecordWriter::Options MakeWriterOptions(
+    const TrafficSampler::Options& options) {
+  RecordWriter::Options writer_options;
+  writer_options.block_bytes = options.block_bytes;
+  writer_options.compression = options.compression;
+  writer_options.sync = false;
+  return writer_options;
+}
+
+}  // namespace
+
+TrafficSampler::TrafficSampler(int fd) : TrafficSampler(fd, Options()) {}
+
+TrafficSampler::TrafficSampler(int fd, const Options& options)
+    : options_(options), writer_(fd, MakeWriterOptions(options)) {}
+
+int64_t TrafficSampler::GetSampledBytes(uint32_t type_id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = sampled_bytes_.find(type_id);
+  return (it == sampled_bytes_.end()) ? 0 : it->second;
+}
+
+bool TrafficSampler::Close() {
+  return writer_.Close();
+}
+
+uint32_t TrafficSampler::SeedRandomState() {
+  // Any non-zero value will do, as long as each thread gets a different one.
+  const auto seed = static_cast<uint32_t>(
+      std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+      static_cast<std::size_t>(
+          std::chrono::steady_clock::now().time_since_epoch().count()));
+  return (seed == 0) ? 1 : seed;
+}
+
+void TrafficSampler::Record(uint32_t type_id,
+                            const uint8_t* begin,
+                            const uint8_t* end) {
+  const auto byte_count = static_cast<int64_t>(end - begin);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t& sampled_bytes = sampled_bytes_[type_id];
+    if (sampled_bytes + byte_count > options_.max_bytes_per_type) {
+      return;
+    }
+    sampled_bytes += byte_count;
+  }
+
+  const TrafficSample sample{
+      type_id, std::string_view(reinterpret_cast<const char*>(begin),
+                                static_cast<std::size_t>(byte_count))};
+  // A failed write is reported by Close().
+  static_cast<void>(writer_.Append(sample));
+}
+
+bool TrafficCorpus::ReadFile(int fd) {
+  const std::unique_ptr<RecordFileReader> reader = RecordFileReader::Open(fd);
+  if (!reader) {
+    return false;
+  }
+  bool success = true;
+  const bool read_all =
+      reader->ForEachRecord([&](const uint8_t* begin, const uint8_t* end) {
+        TrafficSample sample;
+        if (!MergeFromBuffer(begin, end, sample)) {
+          success = false;
+          return;
+        }
+        Samples& samples = samples_by_type_[sample.type_id];
+        const std::size_t old_end = samples.ends.empty() ? 0
+                                                         : samples.ends.back();
+        samples.bytes.resize(old_end);
+        samples.bytes.insert(samples.bytes.end(), sample.wire_bytes.begin(),
+                             sample.wire_bytes.end());
+        samples.ends.push_back(samples.bytes.size());
+        samples.bytes.resize(samples.bytes.size() + kParseSlopBytes);
+      });
+  return read_all && success;
+}
+
+std::vector<uint32_t> TrafficCorpus::type_ids() const {
+  std::vector<uint32_t> type_ids;
+  type_ids.reserve(samples_by_type_.size());
+  for (const auto& [type_id, samples] : samples_by_type_) {
+    type_ids.push_back(type_id);
+  }
+  return type_ids;
+}
+
+std::vector<BufferRange> TrafficCorpus::GetSamples(uint32_t type_id) const {
+  std::vector<BufferRange> ranges;
+  const auto it = samples_by_type_.find(type_id);
+  if (it == samples_by_type_.end()) {
+    return ranges;
+  }
+  const Samples& samples = it->second;
+  ranges.reserve(samples.ends.size());
+  std::size_t begin = 0;
+  for (const std::size_t end : samples.ends) {
+    ranges.push_back(BufferRange{samples.bytes.data() + begin,
+                                 samples.bytes.data() + end});
+    begin = end;
+  }
+  return ranges;
+}
+
+}  // namespace pb
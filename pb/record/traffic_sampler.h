@@ -0,0 +1,182 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "pb/field_list.h"
+#include "pb/parse.h"
+#include "pb/record/record_writer.h"
+#include "pb/serialize.h"
+
+namespace pb {
+
+// One record in a traffic corpus file: The wire bytes of a sampled message,
+// and the type id that identifies its message type (as in a MessageTypeList).
+struct TrafficSample {
+  uint32_t type_id = 0;
+  std::string_view wire_bytes;
+
+  using ProtobufFields =
+      FieldList<Field<&TrafficSample::type_id, 1>,
+                Field<&TrafficSample::wire_bytes, 2>>;
+};
+
+// Copies a random sample of the messages passing through parse and serialize
+// call sites into a traffic corpus file, for replay by benchmarks (see
+// pb/benchmark/replay.h). The corpus file is a record file (see record_file.h)
+// of TrafficSamples. Example:
+//
+//   pb::TrafficSampler sampler(fd);  // Samples one in 1000, by default.
+//   ...
+//   // On any thread:
+//   if (pb::MergeFromBuffer(begin, end, chat)) {
+//     sampler.SampleBytes(kChatTypeId, begin, end);
+//   }
+//   ...
+//   sampler.SampleMessage(kPongTypeId, pong);
+//   const int32_t size = pb::ComputeSerializedSize(pong);
+//
+// The overhead is bounded: A message that is not sampled costs one step of a
+// thread-local random number generator. A sampled message is handed to a
+// RecordWriter, which compresses and writes it on a background thread. Once
+// |max_bytes_per_type| bytes of a type have been sampled, no more of that type
+// are, so that frequent types cannot crowd-out the rest.
+//
+// A TrafficSampler is thread-safe.
+class TrafficSampler {
+ public:
+  struct Options {
+    // Each message is sampled with a probability of one in this many. Zero
+    // disables sampling.
+    uint32_t sample_one_in = 1000;
+
+    // The maximum number of wire bytes sampled for each type id.
+    int64_t max_bytes_per_type = 16 * 1024 * 1024;
+
+    // See RecordWriter::Options. The corpus file is never synced.
+    int32_t block_bytes = 64 * 1024;
+    RecordCompression compression = RecordCompression::kLz;
+  };
+
+  // |fd| must refer to an empty file, opened for writing.
+  explicit TrafficSampler(int fd);
+  TrafficSampler(int fd, const Options& options);
+
+  TrafficSampler(const TrafficSampler&) = delete;
+  TrafficSampler& operator=(const TrafficSampler&) = delete;
+
+  // Samples the wire bytes in the range |begin| to |end| of a message of the
+  // given |type_id|, with a probability of one in |sample_one_in|.
+  void SampleBytes(uint32_t type_id, const uint8_t* begin, const uint8_t* end) {
+    if (ShouldSample()) {
+      Record(type_id, begin, end);
+    }
+  }
+
+  // Same as SampleBytes(), but for a |message| that has not been serialized
+  // (e.g., at a call site that is about to serialize it). The |message| is
+  // only serialized if it is sampled.
+  template <class Message,
+            std::enable_if_t<
+                std::is_class_v<typename Message::ProtobufFields>,
+                int> = 0>
+  void SampleMessage(uint32_t type_id, const Message& message) {
+    if (!ShouldSample()) {
+      return;
+    }
+    const int32_t byte_count = ComputeSerializedSize(message);
+    if (byte_count < 0) {
+      return;
+    }
+    thread_local std::vector<uint8_t> buffer;
+    buffer.resize(static_cast<std::size_t>(byte_count));
+    pb::Serialize(message, buffer.data());
+    Record(type_id, buffer.data(), buffer.data() + buffer.size());
+  }
+
+  // Returns the number of wire bytes sampled so far for the given |type_id|.
+  [[nodiscard]] int64_t GetSampledBytes(uint32_t type_id) const;
+
+  // Writes out all sampled messages and the block index, and closes the
+  // corpus file (see RecordWriter::Close()). Returns false if any write
+  // failed. No more messages are sampled afterwards.
+  [[nodiscard]] bool Close();
+
+ private:
+  // Returns true with a probability of one in |sample_one_in|, using a
+  // thread-local xorshift generator; or false if |sample_one_in| is zero.
+  [[nodiscard]] bool ShouldSample() {
+    if (options_.sample_one_in == 0) {
+      return false;
+    }
+    uint32_t state = random_state_;
+    if (state == 0) {
+      state = SeedRandomState();
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    random_state_ = state;
+    // Maps |state| onto [0,sample_one_in) without a division.
+    return ((uint64_t{state} * options_.sample_one_in) >> 32) == 0;
+  }
+
+  [[nodiscard]] static uint32_t SeedRandomState();
+
+  // Appends the sample to the corpus file, unless its type has reached
+  // |max_bytes_per_type|.
+  void Record(uint32_t type_id, const uint8_t* begin, const uint8_t* end);
+
+  const Options options_;
+  RecordWriter writer_;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<uint32_t, int64_t> sampled_bytes_;
+
+  static inline thread_local uint32_t random_state_ = 0;
+};
+
+// The TrafficSamples read back from one or more corpus files, grouped by type
+// id. Example:
+//
+//   pb::TrafficCorpus corpus;
+//   if (!corpus.ReadFile(fd)) { ... }
+//   for (const uint32_t type_id : corpus.type_ids()) {
+//     for (const pb::BufferRange& sample : corpus.GetSamples(type_id)) {
+//       ...
+//     }
+//   }
+class TrafficCorpus {
+ public:
+  // Reads all the samples in the corpus file |fd|, adding them to this corpus.
+  // Returns false if the file could not be read, or is not a corpus file.
+  [[nodiscard]] bool ReadFile(int fd);
+
+  // Returns the type ids that have samples, in ascending order.
+  [[nodiscard]] std::vector<uint32_t> type_ids() const;
+
+  // Returns the samples of the given |type_id|, in the order they were read.
+  // Each is followed by at least kParseSlopBytes readable bytes. They remain
+  // valid until the next call to ReadFile().
+  [[nodiscard]] std::vector<BufferRange> GetSamples(uint32_t type_id) const;
+
+ private:
+  struct Samples {
+    std::vector<uint8_t> bytes;  // Followed by kParseSlopBytes of padding.
+    std::vector<std::size_t> ends;
+  };
+
+  std::map<uint32_t, Samples> samples_by_type_;
+};
+
+}  // namespace pb
@@ -0,0 +1,188 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/record/traffic_sampler.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/parse.h"
+#include "pb/record/temp_file_for_testing.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Ping {
+  int32_t sequence = 0;
+  std::string payload;
+
+  using ProtobufFields =
+      FieldList<Field<&Ping::sequence, 1>, Field<&Ping::payload, 2>>;
+};
+
+constexpr uint32_t kPingTypeId = 1;
+constexpr uint32_t kRawTypeId = 2;
+
+std::vector<uint8_t> SerializePing(const Ping& ping) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(ComputeSerializedSize(ping)));
+  Serialize(ping, buffer.data());
+  return buffer;
+}
+
+TEST(TrafficSamplerTest, SamplesEverythingWhenOneInOne) {
+  TempFile file;
+  TrafficSampler::Options options;
+  options.sample_one_in = 1;
+  TrafficSampler sampler(file.fd(), options);
+  const uint8_t raw[] = {(1 << 3) | 0, 0x2a};
+  for (int i = 0; i < 100; ++i) {
+    sampler.SampleMessage(kPingTypeId, Ping{i, std::string(i % 7, 'x')});
+    sampler.SampleBytes(kRawTypeId, raw, raw + sizeof(raw));
+  }
+  EXPECT_EQ(200, sampler.GetSampledBytes(kRawTypeId));
+  ASSERT_TRUE(sampler.Close());
+
+  TrafficCorpus corpus;
+  ASSERT_TRUE(corpus.ReadFile(file.fd()));
+  EXPECT_EQ((std::vector<uint32_t>{kPingTypeId, kRawTypeId}),
+            corpus.type_ids());
+
+  const std::vector<BufferRange> pings = corpus.GetSamples(kPingTypeId);
+  ASSERT_EQ(100u, pings.size());
+  for (int i = 0; i < 100; ++i) {
+    SCOPED_TRACE(::testing::Message() << "ping #" << i);
+    const std::vector<uint8_t> expected =
+        SerializePing(Ping{i, std::string(i % 7, 'x')});
+    EXPECT_EQ(expected, std::vector<uint8_t>(pings[i].begin, pings[i].end));
+    // The sample can be parsed with the padded-input parser.
+    Ping ping;
+    ASSERT_TRUE(MergeFromPaddedBuffer(pings[i].begin, pings[i].end, ping));
+    EXPECT_EQ(i, ping.sequence);
+  }
+
+  const std::vector<BufferRange> raws = corpus.GetSamples(kRawTypeId);
+  ASSERT_EQ(100u, raws.size());
+  for (const BufferRange& sample : raws) {
+    EXPECT_EQ(std::vector<uint8_t>(raw, raw + sizeof(raw)),
+              std::vector<uint8_t>(sample.begin, sample.end));
+  }
+  EXPECT_TRUE(corpus.GetSamples(3).empty());
+}
+
+TEST(TrafficSamplerTest, SamplesNothingWhenDisabled) {
+  TempFile file;
+  TrafficSampler::Options options;
+  options.sample_one_in = 0;
+  TrafficSampler sampler(file.fd(), options);
+  const uint8_t raw[] = {(1 << 3) | 0, 0x2a};
+  for (int i = 0; i < 10000; ++i) {
+    sampler.SampleBytes(kRawTypeId, raw, raw + sizeof(raw));
+  }
+  ASSERT_TRUE(sampler.Close());
+  EXPECT_EQ(0, sampler.GetSampledBytes(kRawTypeId));
+
+  TrafficCorpus corpus;
+  ASSERT_TRUE(corpus.ReadFile(file.fd()));
+  EXPECT_TRUE(corpus.GetSamples(kRawTypeId).empty());
+}
+
+TEST(TrafficSamplerTest, SamplesOneInN) {
+  TempFile file;
+  TrafficSampler::Options options;
+  options.sample_one_in = 100;
+  TrafficSampler sampler(file.fd(), options);
+  const uint8_t raw[] = {(1 << 3) | 0, 0x2a};
+  constexpr int kThreadCount = 4;
+  constexpr int kMessagesPerThread = 100000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreadCount; ++i) {
+    threads.emplace_back([&] {
+      for (int j = 0; j < kMessagesPerThread; ++j) {
+        sampler.SampleBytes(kRawTypeId, raw, raw + sizeof(raw));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  ASSERT_TRUE(sampler.Close());
+
+  // The expected count is 4000, with a standard deviation of about 63.
+  const int64_t sample_count = sampler.GetSampledBytes(kRawTypeId) / 2;
+  EXPECT_GT(sample_count, 3500);
+  EXPECT_LT(sample_count, 4500);
+
+  TrafficCorpus corpus;
+  ASSERT_TRUE(corpus.ReadFile(file.fd()));
+  EXPECT_EQ(sample_count,
+            static_cast<int64_t>(corpus.GetSamples(kRawTypeId).size()));
+}
+
+TEST(TrafficSamplerTest, StopsSamplingATypeAtItsByteLimit) {
+  TempFile file;
+  TrafficSampler::Options options;
+  options.sample_one_in = 1;
+  options.max_bytes_per_type = 25;
+  TrafficSampler sampler(file.fd(), options);
+  const uint8_t raw[] = {(1 << 3) | 0, 0x2a};
+  for (int i = 0; i < 100; ++i) {
+    sampler.SampleBytes(kRawTypeId, raw, raw + sizeof(raw));
+    sampler.SampleMessage(kPingTypeId, Ping{i, "hello"});
+  }
+  EXPECT_EQ(24, sampler.GetSampledBytes(kRawTypeId));
+  EXPECT_EQ(18, sampler.GetSampledBytes(kPingTypeId));
+  ASSERT_TRUE(sampler.Close());
+
+  TrafficCorpus corpus;
+  ASSERT_TRUE(corpus.ReadFile(file.fd()));
+  EXPECT_EQ(12u, corpus.GetSamples(kRawTypeId).size());
+  EXPECT_EQ(2u, corpus.GetSamples(kPingTypeId).size());
+}
+
+TEST(TrafficSamplerTest, CorpusMergesFiles) {
+  TempFile first_file;
+  TempFile second_file;
+  TrafficSampler::Options options;
+  options.sample_one_in = 1;
+  for (const int fd : {first_file.fd(), second_file.fd()}) {
+    TrafficSampler sampler(fd, options);
+    for (int i = 0; i < 3; ++i) {
+      sampler.SampleMessage(kPingTypeId, Ping{fd * 10 + i, ""});
+    }
+    ASSERT_TRUE(sampler.Close());
+  }
+
+  TrafficCorpus corpus;
+  ASSERT_TRUE(corpus.ReadFile(first_file.fd()));
+  ASSERT_TRUE(corpus.ReadFile(second_file.fd()));
+  const std::vector<BufferRange> pings = corpus.GetSamples(kPingTypeId);
+  ASSERT_EQ(6u, pings.size());
+  for (std::size_t i = 0; i < pings.size(); ++i) {
+    Ping ping;
+    ASSERT_TRUE(MergeFromBuffer(pings[i].begin, pings[i].end, ping));
+    const int fd = (i < 3) ? first_file.fd() : second_file.fd();
+    EXPECT_EQ(fd * 10 + static_cast<int>(i % 3), ping.sequence);
+  }
+}
+
+TEST(TrafficSamplerTest, RejectsFilesThatAreNotCorpusFiles) {
+  TempFile file;
+  const char garbage[] = "not a record file";
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(garbage)),
+            write(file.fd(), garbage, sizeof(garbage)));
+  TrafficCorpus corpus;
+  EXPECT_FALSE(corpus.ReadFile(file.fd()));
+}
+
+}  // namespace
+}  // namespace pb
@@ -9,6 +9,7 @@
 #include <type_traits>
 
 #include "pb/codec/limits.h"
+#include "pb/codec/serialization_memo.h"
 #include "pb/codec/serialize.h"
 
 namespace pb {
@@ -23,13 +24,18 @@ namespace pb {
 // efficient; does not sanity-check this. It will happily serialize the message
 // structure, but other protobuf implementations will reject the wire bytes when
 // parsed.
+//
+// Nested messages referenced by std::shared_ptr fields are sized only once per
+// call, no matter how many times the same instance is referenced.
 template <class Message,
           std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
                            int> = 0>
 [[nodiscard]] constexpr int32_t ComputeSerializedSize(const Message& message) {
-  const auto size = codec::ComputeSerializedSizeOfFields(
-      message, typename Message::ProtobufFields{});
-  return (size <= codec::kMaxSerializedSize) ? size : -1;
+  return codec::RunWithSerializationMemo<Message>([&message] {
+    const auto size = codec::ComputeSerializedSizeOfFields(
+        message, typename Message::ProtobufFields{});
+    return (size <= codec::kMaxSerializedSize) ? size : -1;
+  });
 }
 
 // Serializes the given |message| into the given |buffer|. The |buffer| must be
@@ -38,15 +44,66 @@ template <class Message,
 // WARNING: Very bad things will happen if ComputeSerializedSize(), above, would
 // return -1. Note that all sanity-checking occurs there, and Serialize() is
 // made efficient by assuming there are no possible error/failure cases.
+//
+// Nested messages referenced by std::shared_ptr fields are encoded only once
+// per call. Each further reference to the same instance copies those bytes.
 template <class Message,
           std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
                            int> = 0>
 void Serialize(const Message& message, uint8_t* buffer) {
-  assert(ComputeSerializedSize(message) >= 0);
-  assert(buffer);
-  [[maybe_unused]] auto* const buffer_end = codec::SerializeFields(
-      message, typename Message::ProtobufFields{}, buffer);
-  assert((buffer + ComputeSerializedSize(message)) == buffer_end);
+  codec::RunWithSerializationMemo<Message>([&message, buffer] {
+    assert(ComputeSerializedSize(message) >= 0);
+    assert(buffer);
+    [[maybe_unused]] auto* const buffer_end = codec::SerializeFields(
+        message, typename Message::ProtobufFields{}, buffer);
+    assert((buffer + ComputeSerializedSize(message)) == buffer_end);
+  });
+}
+
+// Computes an upper bound on the size of a serialized version of |message|, in
+// bytes. This is much cheaper than ComputeSerializedSize() since the elements
+// of repeated scalar fields are not visited, and varints are assumed to take up
+// their maximum possible encoded size. Returns -1 if the upper bound would be
+// larger than the design limit (even though the exact size might not be). In
+// that case, the caller should fall back to using ComputeSerializedSize().
+//
+// This is meant to be paired with SerializeWithinUpperBound(), below, to size
+// an output buffer without walking the whole |message| twice. For example:
+//
+//   std::vector<uint8_t> buffer(pb::EstimateSerializedSizeUpperBound(message));
+//   buffer.resize(pb::SerializeWithinUpperBound(message, buffer.data()) -
+//                 buffer.data());
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] constexpr int32_t EstimateSerializedSizeUpperBound(
+    const Message& message) {
+  return codec::RunWithSerializationMemo<Message>([&message] {
+    const auto size = codec::EstimateSerializedSizeOfFieldsUpperBound(
+        message, typename Message::ProtobufFields{});
+    return (size <= codec::kMaxSerializedSize) ? size : -1;
+  });
+}
+
+// Serializes the given |message| into the given |buffer|, and returns a pointer
+// to the byte just after the last one written. The |buffer| must be at least as
+// large as the value returned by EstimateSerializedSizeUpperBound(message), and
+// all of it may be used as scratch space. The resulting bytes are identical to
+// those produced by Serialize().
+//
+// WARNING: Very bad things will happen if EstimateSerializedSizeUpperBound()
+// would return -1.
+template <class Message,
+          std::enable_if_t<std::is_class_v<typename Message::ProtobufFields>,
+                           int> = 0>
+[[nodiscard]] uint8_t* SerializeWithinUpperBound(const Message& message,
+                                                 uint8_t* buffer) {
+  return codec::RunWithSerializationMemo<Message>([&message, buffer] {
+    assert(EstimateSerializedSizeUpperBound(message) >= 0);
+    assert(buffer);
+    return codec::SerializeFields<codec::OutputBounds::kUpperBound>(
+        message, typename Message::ProtobufFields{}, buffer);
+  });
 }
 
 }  // namespace pb
@@ -0,0 +1,433 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/socket_channel.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "pb/codec/parse.h"
+#include "pb/codec/serialize.h"
+
+namespace pb {
+
+namespace {
+
+// The maximum number of bytes in a frame header (a varint byte count).
+constexpr int kMaxFrameHeaderSize = codec::kMaxVarintSize;
+
+// The maximum number of chunks sent, or datagrams received, in one system call.
+constexpr std::size_t kMaxChunksPerCall = 64;
+
+bool IsDatagramSocket(int fd) {
+  int type = SOCK_STREAM;
+  socklen_t length = sizeof(type);
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) != 0) {
+    return false;
+  }
+  return type != SOCK_STREAM;
+}
+
+bool IsWouldBlockError(int error) {
+  return error == EAGAIN || error == EWOULDBLOCK;
+}
+
+}  // namespace
+
+SocketChannel::SocketChannel(int fd) : SocketChannel(fd, Options()) {}
+
+SocketChannel::SocketChannel(int fd, const Options& options)
+    : fd_(fd), options_(options), is_datagram_(IsDatagramSocket(fd)) {
+  assert(options_.batch_bytes >= 0);
+  assert(options_.chunk_bytes > kMaxFrameHeaderSize);
+  assert(options_.receive_bytes > 0);
+  assert(options_.max_frame_bytes > 0);
+
+  const auto chunk_bytes = static_cast<std::size_t>(options_.chunk_bytes);
+  if (is_datagram_) {
+    // One slot per datagram, each followed by its own slop bytes.
+    const std::size_t slot_count = std::clamp<std::size_t>(
+        (static_cast<std::size_t>(options_.receive_bytes) + chunk_bytes - 1) /
+            chunk_bytes,
+        1, kMaxChunksPerCall);
+    receive_capacity_ = slot_count * (chunk_bytes + codec::kParseSlopBytes);
+  } else {
+    receive_capacity_ = std::max(
+        static_cast<std::size_t>(options_.receive_bytes), chunk_bytes);
+  }
+  receive_buffer_.reset(
+      new uint8_t[receive_capacity_ + codec::kParseSlopBytes]());
+}
+
+bool SocketChannel::SendBytes(const uint8_t* begin, const uint8_t* end) {
+  const auto byte_count = end - begin;
+  if (byte_count > codec::kMaxSerializedSize) {
+    return false;
+  }
+  uint8_t* const buffer = BeginFrame(static_cast<int32_t>(byte_count));
+  if (!buffer) {
+    return false;
+  }
+  std::copy(begin, end, buffer);
+  return EndFrame();
+}
+
+bool SocketChannel::Flush() {
+  if (pending_bytes_ == 0) {
+    return true;
+  }
+  const bool success = is_datagram_ ? FlushDatagrams() : FlushStream();
+  for (std::size_t i = 0; i < used_chunk_count_; ++i) {
+    chunks_[i].size = 0;
+  }
+  used_chunk_count_ = 0;
+  pending_bytes_ = 0;
+  return success;
+}
+
+bool SocketChannel::FlushIfDue() {
+  if (pending_bytes_ > 0 && Clock::now() >= flush_deadline()) {
+    return Flush();
+  }
+  return true;
+}
+
+uint8_t* SocketChannel::BeginFrame(int32_t byte_count) {
+  const auto byte_count_as_varint = static_cast<uint32_t>(byte_count);
+  const int32_t frame_size =
+      codec::ComputeSerializedValueSize(byte_count_as_varint) + byte_count;
+  if (is_datagram_ && frame_size > options_.chunk_bytes) {
+    return nullptr;
+  }
+
+  Chunk* chunk = used_chunk_count_ ? &chunks_[used_chunk_count_ - 1] : nullptr;
+  if (!chunk || (chunk->capacity - chunk->size) < frame_size) {
+    if (used_chunk_count_ == kMaxChunksPerCall && !Flush()) {
+      return nullptr;
+    }
+    if (used_chunk_count_ == chunks_.size()) {
+      chunks_.emplace_back();
+    }
+    chunk = &chunks_[used_chunk_count_++];
+    if (chunk->capacity < frame_size) {
+      // Frames larger than the chunk size get a chunk of their own (only
+      // possible for stream sockets), so that they are never copied again.
+      chunk->capacity = std::max(options_.chunk_bytes, frame_size);
+      chunk->data.reset(new uint8_t[static_cast<std::size_t>(chunk->capacity)]);
+    }
+  }
+
+  if (pending_bytes_ == 0) {
+    oldest_pending_time_ = Clock::now();
+  }
+  uint8_t* const frame = chunk->data.get() + chunk->size;
+  chunk->size += frame_size;
+  pending_bytes_ += frame_size;
+  return codec::SerializeValue(byte_count_as_varint, frame);
+}
+
+bool SocketChannel::EndFrame() {
+  if (pending_bytes_ >= options_.batch_bytes) {
+    return Flush();
+  }
+  return FlushIfDue();
+}
+
+bool SocketChannel::FlushStream() {
+  // Note: sendmsg() is used as the gathering write, rather than writev(), only
+  // to pass MSG_NOSIGNAL (to get an EPIPE error instead of a SIGPIPE).
+  iovec iovs[kMaxChunksPerCall];
+  for (std::size_t i = 0; i < used_chunk_count_; ++i) {
+    iovs[i].iov_base = chunks_[i].data.get();
+    iovs[i].iov_len = static_cast<std::size_t>(chunks_[i].size);
+  }
+  msghdr header{};
+  header.msg_iov = iovs;
+  header.msg_iovlen = used_chunk_count_;
+
+  while (header.msg_iovlen > 0) {
+    const ssize_t result = sendmsg(fd_, &header, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (IsWouldBlockError(errno) && WaitUntilWritable()) {
+        continue;
+      }
+      return false;
+    }
+
+    // Skip past what was written, for the next call after a partial write.
+    auto remaining = static_cast<std::size_t>(result);
+    while (header.msg_iovlen > 0 && remaining >= header.msg_iov->iov_len) {
+      remaining -= header.msg_iov->iov_len;
+      ++header.msg_iov;
+      --header.msg_iovlen;
+    }
+    if (header.msg_iovlen > 0) {
+      header.msg_iov->iov_base =
+          static_cast<uint8_t*>(header.msg_iov->iov_base) + remaining;
+      header.msg_iov->iov_len -= remaining;
+    }
+  }
+  return true;
+}
+
+bool SocketChannel::FlushDatagrams() {
+  iovec iovs[kMaxChunksPerCall];
+  for (std::size_t i = 0; i < used_chunk_count_; ++i) {
+    iovs[i].iov_base = chunks_[i].data.get();
+    iovs[i].iov_len = static_cast<std::size_t>(chunks_[i].size);
+  }
+
+#if defined(__linux__)
+  mmsghdr messages[kMaxChunksPerCall]{};
+  for (std::size_t i = 0; i < used_chunk_count_; ++i) {
+    messages[i].msg_hdr.msg_iov = &iovs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  std::size_t sent_count = 0;
+  while (sent_count < used_chunk_count_) {
+    const int result =
+        sendmmsg(fd_, messages + sent_count,
+                 static_cast<unsigned int>(used_chunk_count_ - sent_count),
+                 MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (IsWouldBlockError(errno) && WaitUntilWritable()) {
+        continue;
+      }
+      return false;
+    }
+    sent_count += static_cast<std::size_t>(result);
+  }
+#else
+  for (std::size_t i = 0; i < used_chunk_count_;) {
+    msghdr header{};
+    header.msg_iov = &iovs[i];
+    header.msg_iovlen = 1;
+    if (sendmsg(fd_, &header, MSG_NOSIGNAL) < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (IsWouldBlockError(errno) && WaitUntilWritable()) {
+        continue;
+      }
+      return false;
+    }
+    ++i;
+  }
+#endif
+  return true;
+}
+
+bool SocketChannel::WaitUntilWritable() {
+  pollfd poll_fd{};
+  poll_fd.fd = fd_;
+  poll_fd.events = POLLOUT;
+  for (;;) {
+    const int result = poll(&poll_fd, 1, -1);
+    if (result > 0) {
+      return true;
+    } else if (result < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+const uint8_t* SocketChannel::ParseFrameHeader(const uint8_t* begin,
+                                               const uint8_t* end,
+                                               int32_t& byte_count) {
+  uint64_t value;
+  const uint8_t* const frame_begin = codec::ParseValue(begin, end, 0, value);
+  if (!frame_begin) {
+    // A truncated header is only an error if no more bytes can arrive.
+    if (is_datagram_ || closed_ || (end - begin) >= kMaxFrameHeaderSize) {
+      failed_ = true;
+    }
+    return nullptr;
+  }
+  if (value > static_cast<uint64_t>(options_.max_frame_bytes)) {
+    failed_ = true;
+    return nullptr;
+  }
+  byte_count = static_cast<int32_t>(value);
+  if ((end - frame_begin) < byte_count) {
+    if (is_datagram_ || closed_) {
+      failed_ = true;
+    }
+    return nullptr;
+  }
+  return frame_begin;
+}
+
+bool SocketChannel::ReadIntoReceiveBuffer() {
+  received_segments_.clear();
+  if (failed_) {
+    return false;
+  }
+  if (closed_) {
+    return true;
+  }
+  const bool success = is_datagram_ ? ReadDatagrams() : ReadStream();
+  if (!success) {
+    failed_ = true;
+  }
+  return success;
+}
+
+bool SocketChannel::ReadStream() {
+  uint8_t* const buffer = receive_buffer_.get();
+  for (;;) {
+    const ssize_t result = read(fd_, buffer + receive_end_,
+                                receive_capacity_ - receive_end_);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (IsWouldBlockError(errno)) {
+        return true;
+      }
+      return false;
+    }
+    if (result == 0) {
+      closed_ = true;
+    }
+    receive_end_ += static_cast<std::size_t>(result);
+    break;
+  }
+  received_segments_.push_back(
+      Segment{buffer + receive_begin_, buffer + receive_end_});
+  return true;
+}
+
+bool SocketChannel::ReadDatagrams() {
+  const auto chunk_bytes = static_cast<std::size_t>(options_.chunk_bytes);
+  const std::size_t slot_stride = chunk_bytes + codec::kParseSlopBytes;
+  const std::size_t slot_count = receive_capacity_ / slot_stride;
+  uint8_t* const buffer = receive_buffer_.get();
+
+  iovec iovs[kMaxChunksPerCall];
+  for (std::size_t i = 0; i < slot_count; ++i) {
+    iovs[i].iov_base = buffer + i * slot_stride;
+    iovs[i].iov_len = chunk_bytes;
+  }
+
+#if defined(__linux__)
+  mmsghdr messages[kMaxChunksPerCall]{};
+  for (std::size_t i = 0; i < slot_count; ++i) {
+    messages[i].msg_hdr.msg_iov = &iovs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  int count;
+  for (;;) {
+    // Block until at least one datagram is available, then take whatever else
+    // is already queued.
+    count = recvmmsg(fd_, messages, static_cast<unsigned int>(slot_count),
+                     MSG_WAITFORONE, nullptr);
+    if (count >= 0) {
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (IsWouldBlockError(errno)) {
+      return true;
+    }
+    return false;
+  }
+#else
+  msghdr message{};
+  message.msg_iov = &iovs[0];
+  message.msg_iovlen = 1;
+  ssize_t length;
+  for (;;) {
+    length = recvmsg(fd_, &message, 0);
+    if (length >= 0) {
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (IsWouldBlockError(errno)) {
+      return true;
+    }
+    return false;
+  }
+  const int count = 1;
+#endif
+
+  for (int i = 0; i < count; ++i) {
+#if defined(__linux__)
+    const msghdr& header = messages[i].msg_hdr;
+    const std::size_t length = messages[i].msg_len;
+#else
+    const msghdr& header = message;
+#endif
+    if (header.msg_flags & MSG_TRUNC) {
+      return false;  // Larger than Options::chunk_bytes.
+    }
+    if (length == 0) {
+      closed_ = true;
+      break;
+    }
+    const auto* const datagram =
+        static_cast<const uint8_t*>(header.msg_iov->iov_base);
+    received_segments_.push_back(Segment{datagram, datagram + length});
+  }
+  return true;
+}
+
+bool SocketChannel::FinishReceive() {
+  if (failed_) {
+    return false;
+  }
+  if (is_datagram_) {
+    return true;  // ParseFrameHeader() disallowed partial frames.
+  }
+  if (received_segments_.empty()) {
+    return true;
+  }
+
+  uint8_t* const buffer = receive_buffer_.get();
+  receive_begin_ =
+      static_cast<std::size_t>(received_segments_.front().begin - buffer);
+  const std::size_t leftover_size = receive_end_ - receive_begin_;
+  if (leftover_size == 0) {
+    receive_begin_ = receive_end_ = 0;
+    return true;
+  }
+  if (closed_) {
+    failed_ = true;  // The peer closed the connection mid-frame.
+    return false;
+  }
+
+  // Move the partial frame to the front of the buffer, growing the buffer if
+  // the whole frame would not fit.
+  std::size_t required_capacity = receive_capacity_;
+  uint64_t byte_count;
+  if (const uint8_t* const frame_begin = codec::ParseValue(
+          buffer + receive_begin_, buffer + receive_end_, 0, byte_count)) {
+    required_capacity = std::max(
+        required_capacity,
+        static_cast<std::size_t>(frame_begin - (buffer + receive_begin_)) +
+            static_cast<std::size_t>(byte_count));
+  }
+  if (required_capacity > receive_capacity_) {
+    std::unique_ptr<uint8_t[]> new_buffer(
+        new uint8_t[required_capacity + codec::kParseSlopBytes]());
+    std::copy(buffer + receive_begin_, buffer + receive_end_, new_buffer.get());
+    receive_buffer_ = std::move(new_buffer);
+    receive_capacity_ = required_capacity;
+  } else if (receive_begin_ > 0) {
+    std::memmove(buffer, buffer + receive_begin_, leftover_size);
+  }
+  receive_begin_ = 0;
+  receive_end_ = leftover_size;
+  return true;
+}
+
+}  // namespace pb
@@ -0,0 +1,248 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "pb/codec/limits.h"
+#include "pb/serialize.h"
+
+namespace pb {
+
+// Sends and receives length-delimited messages over a connected local socket
+// (Unix-domain or loopback), batching many messages into each system call.
+// Each frame on the wire is a varint byte count followed by that many bytes of
+// wire-format message data.
+//
+// Send() serializes each message directly into a send buffer. The pending
+// frames are written out together, with one writev() call for stream sockets,
+// or one sendmmsg() call for datagram sockets (where each datagram carries
+// several whole frames), when:
+//
+//   1. The pending frames total at least Options::batch_bytes; or
+//   2. Send() or FlushIfDue() is called after the oldest pending frame has
+//      waited at least Options::max_flush_delay; or
+//   3. Flush() is called.
+//
+// So, an application with an event loop should call FlushIfDue() (or Flush())
+// whenever it goes idle, to bound latency when traffic stops.
+//
+// Receive() reads as much as is available in one large read() (or, for
+// datagram sockets, one recvmmsg()), and then calls a handler for each complete
+// frame, passing it a range that points into the receive buffer. The range is
+// always followed by at least pb::kParseSlopBytes readable bytes, and so the
+// handler may use pb::MergeFromPaddedBuffer(). Example:
+//
+//   pb::SocketChannel channel(fd);
+//   const int frame_count = channel.Receive(
+//       [&](const uint8_t* begin, const uint8_t* end) {
+//         Chat chat;
+//         if (pb::MergeFromPaddedBuffer(begin, end, chat)) {
+//           ...
+//         }
+//       });
+//   if (frame_count < 0) {
+//     ...  // Socket error, or a malformed frame.
+//   }
+//
+// The socket may be blocking or non-blocking. For non-blocking sockets, a
+// flush that cannot complete immediately waits (with poll()) until it can,
+// since frames must not be interleaved; and Receive() returns 0 if nothing is
+// available. A SocketChannel does not own the socket, and is not thread-safe.
+class SocketChannel {
+ public:
+  struct Options {
+    // The send buffer is flushed once the pending frames total at least this
+    // many bytes. Zero disables batching (every Send() flushes).
+    int32_t batch_bytes = 256 * 1024;
+
+    // The maximum time a frame will wait in the send buffer, as checked by
+    // Send() and FlushIfDue().
+    std::chrono::microseconds max_flush_delay{200};
+
+    // The size of each send buffer chunk. For datagram sockets, this is also
+    // the maximum datagram size (and so, the maximum frame size, including its
+    // header); and must be the same at both ends.
+    int32_t chunk_bytes = 16 * 1024;
+
+    // The maximum number of bytes read by one Receive() call. For datagram
+    // sockets, this is rounded up to a whole number of chunks.
+    int32_t receive_bytes = 256 * 1024;
+
+    // Receive() fails if the peer sends a larger frame.
+    int32_t max_frame_bytes = 16 * 1024 * 1024;
+  };
+
+  using Clock = std::chrono::steady_clock;
+
+  explicit SocketChannel(int fd);
+  SocketChannel(int fd, const Options& options);
+
+  SocketChannel(const SocketChannel&) = delete;
+  SocketChannel& operator=(const SocketChannel&) = delete;
+
+  [[nodiscard]] int fd() const { return fd_; }
+  [[nodiscard]] bool is_datagram() const { return is_datagram_; }
+
+  // Serializes the |message| into the send buffer as one frame, flushing as
+  // described above. Returns false if the |message| could not be serialized
+  // (or, for datagram sockets, the frame would not fit in a chunk), or if a
+  // flush failed.
+  template <class Message,
+            std::enable_if_t<
+                std::is_class_v<typename Message::ProtobufFields>,
+                int> = 0>
+  [[nodiscard]] bool Send(const Message& message) {
+    const int32_t byte_count = ComputeSerializedSize(message);
+    if (byte_count < 0) {
+      return false;
+    }
+    uint8_t* const buffer = BeginFrame(byte_count);
+    if (!buffer) {
+      return false;
+    }
+    pb::Serialize(message, buffer);
+    return EndFrame();
+  }
+
+  // Same as Send(), but for a frame containing the bytes in the range |begin|
+  // to |end| (e.g., an already-serialized message).
+  [[nodiscard]] bool SendBytes(const uint8_t* begin, const uint8_t* end);
+
+  // Writes out all pending frames. Returns false on error. Note that frames
+  // still pending when the SocketChannel is destroyed are discarded.
+  [[nodiscard]] bool Flush();
+
+  // Calls Flush() if the oldest pending frame has waited at least
+  // Options::max_flush_delay. Returns false on error.
+  [[nodiscard]] bool FlushIfDue();
+
+  // Returns true if there are frames in the send buffer, and the time by which
+  // FlushIfDue() will flush them.
+  [[nodiscard]] bool has_pending_frames() const { return pending_bytes_ > 0; }
+  [[nodiscard]] Clock::time_point flush_deadline() const {
+    return oldest_pending_time_ + options_.max_flush_delay;
+  }
+
+  // Reads what is available from the socket (blocking until something is, for
+  // blocking sockets), and calls |handler| for each complete frame received:
+  //
+  //   void handler(const uint8_t* begin, const uint8_t* end);
+  //
+  // Returns the number of frames handled, or -1 on socket error, or if a frame
+  // is malformed (in which case the channel should no longer be used). Returns
+  // 0 if the peer has closed the connection (see is_closed()).
+  template <typename Handler>
+  [[nodiscard]] int Receive(Handler&& handler) {
+    if (!ReadIntoReceiveBuffer()) {
+      return -1;
+    }
+
+    int frame_count = 0;
+    for (Segment& segment : received_segments_) {
+      const uint8_t* cursor = segment.begin;
+      while (cursor != segment.end) {
+        int32_t frame_byte_count;
+        const uint8_t* const frame_begin =
+            ParseFrameHeader(cursor, segment.end, frame_byte_count);
+        if (!frame_begin) {
+          if (failed_) {
+            return -1;
+          }
+          break;  // The rest of the frame has not arrived yet.
+        }
+        handler(frame_begin, frame_begin + frame_byte_count);
+        ++frame_count;
+        cursor = frame_begin + frame_byte_count;
+      }
+      segment.begin = cursor;
+    }
+
+    if (!FinishReceive()) {
+      return -1;
+    }
+    return frame_count;
+  }
+
+  // Returns true once the peer has closed the connection (stream sockets), or
+  // sent an empty datagram (datagram sockets).
+  [[nodiscard]] bool is_closed() const { return closed_; }
+
+ private:
+  // A fixed-capacity piece of the send buffer. For datagram sockets, each
+  // chunk is sent as one datagram.
+  struct Chunk {
+    std::unique_ptr<uint8_t[]> data;
+    int32_t capacity = 0;
+    int32_t size = 0;
+  };
+
+  // A range of received bytes that contains frames.
+  struct Segment {
+    const uint8_t* begin;
+    const uint8_t* end;
+  };
+
+  // Reserves space for a frame of |byte_count| bytes in the send buffer, writes
+  // the frame header, and returns a pointer to where the frame's bytes must be
+  // written. Returns nullptr if the frame is too large, or if a flush was
+  // needed and failed.
+  [[nodiscard]] uint8_t* BeginFrame(int32_t byte_count);
+
+  // Flushes if the batch size has been reached, or the delay has expired.
+  [[nodiscard]] bool EndFrame();
+
+  [[nodiscard]] bool FlushStream();
+  [[nodiscard]] bool FlushDatagrams();
+
+  // Blocks until the socket is writable (for non-blocking sockets).
+  [[nodiscard]] bool WaitUntilWritable();
+
+  // Parses the header of the frame at |begin|, returning a pointer to the
+  // frame's bytes and setting |byte_count|. Returns nullptr if the whole frame
+  // is not in the range |begin| to |end|. Sets |failed_| if the frame is
+  // malformed, or if a partial frame is not allowed.
+  [[nodiscard]] const uint8_t* ParseFrameHeader(const uint8_t* begin,
+                                                const uint8_t* end,
+                                                int32_t& byte_count);
+
+  // Reads from the socket, populating |received_segments_|.
+  [[nodiscard]] bool ReadIntoReceiveBuffer();
+  [[nodiscard]] bool ReadStream();
+  [[nodiscard]] bool ReadDatagrams();
+
+  // Retains any partial frame left over in the stream receive buffer for the
+  // next Receive() call.
+  [[nodiscard]] bool FinishReceive();
+
+  const int fd_;
+  const Options options_;
+  bool is_datagram_ = false;
+  bool closed_ = false;
+  bool failed_ = false;
+
+  // The send buffer. Only the first |used_chunk_count_| chunks hold pending
+  // frames; the rest are kept for re-use.
+  std::vector<Chunk> chunks_;
+  std::size_t used_chunk_count_ = 0;
+  int64_t pending_bytes_ = 0;
+  Clock::time_point oldest_pending_time_;
+
+  // The receive buffer. For stream sockets, the bytes in the range
+  // [receive_begin_, receive_end_) have been read but not yet handled. For
+  // datagram sockets, the buffer is divided into slots, one per datagram.
+  std::unique_ptr<uint8_t[]> receive_buffer_;
+  std::size_t receive_capacity_ = 0;  // Excluding the slop bytes.
+  std::size_t receive_begin_ = 0;
+  std::size_t receive_end_ = 0;
+  std::vector<Segment> received_segments_;
+};
+
+}  // namespace pb
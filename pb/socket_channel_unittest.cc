@@ -0,0 +1,216 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/socket_channel.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/parse.h"
+
+namespace pb {
+namespace {
+
+struct Note {
+  int32_t id = 0;
+  std::string text;
+
+  using ProtobufFields = FieldList<Field<&Note::id, 1>, Field<&Note::text, 2>>;
+};
+
+// A connected pair of sockets, closed on destruction.
+class SocketPair {
+ public:
+  explicit SocketPair(int type) {
+    EXPECT_EQ(0, socketpair(AF_UNIX, type, 0, fds_));
+  }
+  ~SocketPair() {
+    Close(0);
+    Close(1);
+  }
+
+  int fd(int index) const { return fds_[index]; }
+  void Close(int index) {
+    if (fds_[index] >= 0) {
+      close(fds_[index]);
+      fds_[index] = -1;
+    }
+  }
+  void SetNonBlocking(int index) {
+    ASSERT_EQ(0, fcntl(fds_[index], F_SETFL,
+                       fcntl(fds_[index], F_GETFL) | O_NONBLOCK));
+  }
+
+ private:
+  int fds_[2] = {-1, -1};
+};
+
+// Receives until |count| notes have arrived, or the channel fails or closes.
+std::vector<Note> ReceiveNotes(SocketChannel& channel, std::size_t count) {
+  std::vector<Note> notes;
+  while (notes.size() < count) {
+    const int result =
+        channel.Receive([&](const uint8_t* begin, const uint8_t* end) {
+          Note note;
+          EXPECT_TRUE(MergeFromPaddedBuffer(begin, end, note));
+          notes.push_back(std::move(note));
+        });
+    if (result < 0 || channel.is_closed()) {
+      break;
+    }
+  }
+  return notes;
+}
+
+class SocketChannelTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(SocketChannelTest, BatchesUntilFlushed) {
+  SocketPair sockets(GetParam());
+  SocketChannel::Options options;
+  options.max_flush_delay = std::chrono::hours(1);
+  SocketChannel sender(sockets.fd(0), options);
+  SocketChannel receiver(sockets.fd(1), options);
+  EXPECT_EQ(GetParam() != SOCK_STREAM, sender.is_datagram());
+
+  for (int32_t i = 0; i < 1000; ++i) {
+    const auto text_size = static_cast<std::size_t>(i % 50);
+    ASSERT_TRUE(sender.Send(Note{i, std::string(text_size, 'x')}));
+  }
+  EXPECT_TRUE(sender.has_pending_frames());
+
+  // Nothing has been sent yet.
+  sockets.SetNonBlocking(1);
+  EXPECT_EQ(0, receiver.Receive([](const uint8_t*, const uint8_t*) {
+    ADD_FAILURE();
+  }));
+
+  ASSERT_TRUE(sender.Flush());
+  EXPECT_FALSE(sender.has_pending_frames());
+  const std::vector<Note> notes = ReceiveNotes(receiver, 1000);
+  ASSERT_EQ(1000u, notes.size());
+  for (int32_t i = 0; i < 1000; ++i) {
+    EXPECT_EQ(i, notes[static_cast<std::size_t>(i)].id);
+    EXPECT_EQ(static_cast<std::size_t>(i % 50),
+              notes[static_cast<std::size_t>(i)].text.size());
+  }
+}
+
+TEST_P(SocketChannelTest, FlushesWhenBatchIsFullOrDelayExpires) {
+  SocketPair sockets(GetParam());
+  SocketChannel::Options options;
+  options.batch_bytes = 0;
+  SocketChannel unbatched(sockets.fd(0), options);
+  ASSERT_TRUE(unbatched.Send(Note{1, "now"}));
+  EXPECT_FALSE(unbatched.has_pending_frames());
+
+  options.batch_bytes = 1 << 20;
+  options.max_flush_delay = std::chrono::milliseconds(1);
+  SocketChannel delayed(sockets.fd(0), options);
+  ASSERT_TRUE(delayed.Send(Note{2, "soon"}));
+  ASSERT_TRUE(delayed.FlushIfDue());
+  EXPECT_TRUE(delayed.has_pending_frames());
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  EXPECT_LE(delayed.flush_deadline(), SocketChannel::Clock::now());
+  ASSERT_TRUE(delayed.FlushIfDue());
+  EXPECT_FALSE(delayed.has_pending_frames());
+
+  SocketChannel receiver(sockets.fd(1));
+  const std::vector<Note> notes = ReceiveNotes(receiver, 2);
+  ASSERT_EQ(2u, notes.size());
+  EXPECT_EQ("now", notes[0].text);
+  EXPECT_EQ("soon", notes[1].text);
+}
+
+INSTANTIATE_TEST_SUITE_P(AllSocketTypes,
+                         SocketChannelTest,
+                         ::testing::Values(SOCK_STREAM,
+                                           SOCK_SEQPACKET,
+                                           SOCK_DGRAM));
+
+TEST(SocketChannelStreamTest, ReassemblesFramesLargerThanTheReceiveBuffer) {
+  SocketPair sockets(SOCK_STREAM);
+  SocketChannel::Options options;
+  options.chunk_bytes = 64;
+  options.receive_bytes = 64;
+  SocketChannel receiver(sockets.fd(1), options);
+
+  // Send from another thread, since the frames exceed the socket buffer.
+  std::thread sender_thread([&] {
+    SocketChannel sender(sockets.fd(0), options);
+    EXPECT_TRUE(sender.Send(Note{1, "small"}));
+    EXPECT_TRUE(sender.Send(Note{2, std::string(1 << 20, 'y')}));
+    EXPECT_TRUE(sender.Send(Note{3, "small again"}));
+    EXPECT_TRUE(sender.Flush());
+  });
+  const std::vector<Note> notes = ReceiveNotes(receiver, 3);
+  sender_thread.join();
+  ASSERT_EQ(3u, notes.size());
+  EXPECT_EQ(1u << 20, notes[1].text.size());
+  EXPECT_EQ("small again", notes[2].text);
+}
+
+TEST(SocketChannelStreamTest, FailsOnTruncatedOrOversizedFrames) {
+  {
+    SocketPair sockets(SOCK_STREAM);
+    const uint8_t truncated[] = {0x05, 0x08, 0x01};
+    ASSERT_EQ(3, write(sockets.fd(0), truncated, sizeof(truncated)));
+    sockets.Close(0);
+    SocketChannel receiver(sockets.fd(1));
+    int total = 0;
+    int result;
+    while ((result = receiver.Receive(
+                [&](const uint8_t*, const uint8_t*) { ++total; })) == 0 &&
+           !receiver.is_closed()) {
+    }
+    EXPECT_EQ(-1, result);
+    EXPECT_EQ(0, total);
+  }
+  {
+    SocketPair sockets(SOCK_STREAM);
+    const uint8_t oversized[] = {0x80, 0x80, 0x80, 0x40};
+    ASSERT_EQ(4, write(sockets.fd(0), oversized, sizeof(oversized)));
+    SocketChannel receiver(sockets.fd(1));
+    EXPECT_EQ(-1, receiver.Receive([](const uint8_t*, const uint8_t*) {}));
+  }
+  {
+    // A clean close between frames is not an error.
+    SocketPair sockets(SOCK_STREAM);
+    sockets.Close(0);
+    SocketChannel receiver(sockets.fd(1));
+    EXPECT_EQ(0, receiver.Receive([](const uint8_t*, const uint8_t*) {}));
+    EXPECT_TRUE(receiver.is_closed());
+  }
+}
+
+TEST(SocketChannelDatagramTest, RejectsFramesLargerThanAChunk) {
+  SocketPair sockets(SOCK_SEQPACKET);
+  SocketChannel::Options options;
+  options.chunk_bytes = 64;
+  SocketChannel sender(sockets.fd(0), options);
+  EXPECT_TRUE(sender.Send(Note{1, std::string(32, 'z')}));
+  EXPECT_FALSE(sender.Send(Note{2, std::string(64, 'z')}));
+  const uint8_t bytes[] = {1, 2, 3};
+  EXPECT_TRUE(sender.SendBytes(bytes, bytes + sizeof(bytes)));
+  ASSERT_TRUE(sender.Flush());
+
+  SocketChannel receiver(sockets.fd(1), options);
+  std::vector<std::string> frames;
+  EXPECT_EQ(2, receiver.Receive([&](const uint8_t* begin, const uint8_t* end) {
+    frames.emplace_back(begin, end);
+  }));
+  ASSERT_EQ(2u, frames.size());
+  EXPECT_EQ(std::string("\x01\x02\x03"), frames[1]);
+}
+
+}  // namespace
+}  // namespace pb
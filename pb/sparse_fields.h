@@ -0,0 +1,272 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "pb/field_list.h"
+
+namespace pb {
+
+template <class Schema>
+class SparseFields;
+
+namespace internal {
+
+// Describes one field of a pb::SparseFields<Schema> to the codec: It has the
+// same Member type, field number, and name as |TheField| in the |Schema|, but
+// its member lives in a SparseFields entry instead of a |Schema| instance.
+template <class Schema, typename TheField>
+struct SparseField {
+  using Member = typename TheField::Member;
+  using Entry = typename SparseFields<Schema>::Entry;
+
+  // Used when serializing, where each present entry is visited as if it were
+  // a message having only this one field.
+  [[nodiscard]] static const Member& GetMemberReferenceIn(const Entry& entry) {
+    return *std::get_if<Member>(&entry.value);
+  }
+
+  // Used when parsing, and adds the entry if it is not already present.
+  [[nodiscard]] static Member& GetMutableMemberReferenceIn(
+      SparseFields<Schema>& message) {
+    return message.template mutable_get<TheField::GetMemberPointer()>();
+  }
+
+  [[nodiscard]] static constexpr int32_t GetFieldNumber() {
+    return TheField::GetFieldNumber();
+  }
+
+  [[nodiscard]] static constexpr std::string_view GetName() {
+    return TheField::GetName();
+  }
+};
+
+template <class Schema, typename Fields>
+struct SparseFieldListBase;
+
+template <class Schema, typename... Fields>
+struct SparseFieldListBase<Schema, FieldList<Fields...>> {
+  using type = FieldList<SparseField<Schema, Fields>...>;
+};
+
+// Builds a std::variant<std::monostate, ...> having each of the |Ts| as an
+// alternative exactly once.
+template <typename Variant, typename... Ts>
+struct UniqueVariant {
+  using type = Variant;
+};
+
+template <typename... Alternatives, typename T, typename... Ts>
+struct UniqueVariant<std::variant<Alternatives...>, T, Ts...>
+    : std::conditional_t<
+          (std::is_same_v<T, Alternatives> || ...),
+          UniqueVariant<std::variant<Alternatives...>, Ts...>,
+          UniqueVariant<std::variant<Alternatives..., T>, Ts...>> {};
+
+template <typename Fields>
+struct SparseValueVariant;
+
+template <typename... Fields>
+struct SparseValueVariant<FieldList<Fields...>>
+    : UniqueVariant<std::variant<std::monostate>, typename Fields::Member...> {
+};
+
+// Returns the index of the field bound to |kMemberPointer| within the
+// |Schema|'s ProtobufFields, failing compilation if there is none.
+template <class Schema, auto kMemberPointer>
+[[nodiscard]] constexpr uint32_t GetSparseFieldIndex() {
+  constexpr std::size_t kIndex =
+      FindFieldIndex<kMemberPointer>(typename Schema::ProtobufFields{});
+  static_assert(kIndex < Schema::ProtobufFields::kFieldCount,
+                "The member is not one of the Schema's ProtobufFields.");
+  return static_cast<uint32_t>(kIndex);
+}
+
+}  // namespace internal
+
+// The ProtobufFields of a pb::SparseFields<Schema>: the same field numbers and
+// types as the |Schema|'s.
+template <class Schema>
+struct SparseFieldList : internal::SparseFieldListBase<
+                             Schema,
+                             typename Schema::ProtobufFields>::type {};
+
+// Storage for a message type having many fields, of which only a few are
+// usually set. Instead of one member per field, it holds a small vector of the
+// fields that are present, sorted by field number. Thus, its memory footprint,
+// and the cost of serializing it, depend only on the number of fields present.
+//
+// The fields are declared by a |Schema| struct, just like a regular message.
+// The |Schema| is never instantiated, and only serves to give each field a
+// member pointer for the accessors, and a C++ type. Example:
+//
+//   struct TelemetrySchema {
+//     std::optional<int32_t> cpu_temp;
+//     std::optional<std::string> fan_mode;
+//     std::vector<int32_t> errors;
+//     ... hundreds more ...
+//
+//     using ProtobufFields = pb::FieldList<
+//         pb::Field<&TelemetrySchema::cpu_temp, 1>,
+//         pb::Field<&TelemetrySchema::fan_mode, 2>,
+//         pb::Field<&TelemetrySchema::errors, 3>,
+//         ...>;
+//   };
+//   using Telemetry = pb::SparseFields<TelemetrySchema>;
+//
+//   Telemetry telemetry;
+//   telemetry.set<&TelemetrySchema::cpu_temp>(72);
+//   telemetry.mutable_get<&TelemetrySchema::errors>().push_back(3);
+//   if (const auto* fan_mode = telemetry.get<&TelemetrySchema::fan_mode>()) {
+//     ...
+//   }
+//
+// A SparseFields can be parsed and serialized anywhere a message can, both at
+// the top level and as a nested message field. A field is "present" once it
+// has been accessed for mutation or parsed, and it then serializes exactly as
+// the same member of a |Schema| instance would. Using a member pointer that
+// does not belong to the |Schema|'s ProtobufFields is a compile-time error.
+//
+// Note: JSON encoding (pb/json.h) is not supported.
+template <class Schema>
+class SparseFields {
+  static_assert(Schema::ProtobufFields::kFieldCount > 0);
+
+ public:
+  using ProtobufFields = SparseFieldList<Schema>;
+
+  // Each field's Member type appears once; and std::monostate is never stored.
+  using Value =
+      typename internal::SparseValueVariant<typename Schema::ProtobufFields>::
+          type;
+
+  struct Entry {
+    // The index of the field in the |Schema|'s ProtobufFields.
+    uint32_t field_index;
+    Value value;
+  };
+
+  // The C++ type of the field bound to |kMemberPointer|.
+  template <auto kMemberPointer>
+  using MemberType = typename Schema::ProtobufFields::template FieldAt<
+      internal::GetSparseFieldIndex<Schema, kMemberPointer>()>::Member;
+
+  // Returns true if the field is present.
+  template <auto kMemberPointer>
+  [[nodiscard]] bool has() const {
+    return FindEntry(GetFieldIndex<kMemberPointer>()) != entries_.end();
+  }
+
+  // Returns a pointer to the field's member, or null if it is not present.
+  template <auto kMemberPointer>
+  [[nodiscard]] const MemberType<kMemberPointer>* get() const {
+    const auto it = FindEntry(GetFieldIndex<kMemberPointer>());
+    return (it == entries_.end())
+               ? nullptr
+               : std::get_if<MemberType<kMemberPointer>>(&it->value);
+  }
+
+  // Returns a reference to the field's member, first adding it
+  // (default-constructed) if it is not present.
+  template <auto kMemberPointer>
+  MemberType<kMemberPointer>& mutable_get() {
+    using Member = MemberType<kMemberPointer>;
+    constexpr uint32_t kIndex = GetFieldIndex<kMemberPointer>();
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), kIndex,
+                               &IsBefore);
+    if (it == entries_.end() || it->field_index != kIndex) {
+      it = entries_.insert(it,
+                           Entry{kIndex, Value(std::in_place_type<Member>)});
+    }
+    return *std::get_if<Member>(&it->value);
+  }
+
+  // Assigns |value| to the field's member, adding the field if it is not
+  // present, and returns a reference to the member.
+  template <auto kMemberPointer, typename T>
+  MemberType<kMemberPointer>& set(T&& value) {
+    auto& member = mutable_get<kMemberPointer>();
+    member = std::forward<T>(value);
+    return member;
+  }
+
+  // Removes the field, if present.
+  template <auto kMemberPointer>
+  void clear() {
+    const auto it = FindEntry(GetFieldIndex<kMemberPointer>());
+    if (it != entries_.end()) {
+      entries_.erase(it);
+    }
+  }
+
+  // Removes all fields.
+  void clear() { entries_.clear(); }
+
+  // Returns the number of fields present.
+  [[nodiscard]] std::size_t size() const { return entries_.size(); }
+  [[nodiscard]] bool empty() const { return entries_.empty(); }
+
+  // The present fields, in field number order.
+  [[nodiscard]] const std::vector<Entry>& entries() const { return entries_; }
+
+  // Calls |visitor|(entry, FieldList<F>{}), where F describes the |entry|'s
+  // field to the codec (see internal::SparseField), and returns its result.
+  template <typename Visitor>
+  static decltype(auto) VisitEntry(const Entry& entry, Visitor&& visitor) {
+    return VisitEntryImpl(
+        entry, visitor,
+        std::make_index_sequence<Schema::ProtobufFields::kFieldCount>());
+  }
+
+ private:
+  template <auto kMemberPointer>
+  [[nodiscard]] static constexpr uint32_t GetFieldIndex() {
+    return internal::GetSparseFieldIndex<Schema, kMemberPointer>();
+  }
+
+  [[nodiscard]] static bool IsBefore(const Entry& entry, uint32_t index) {
+    return entry.field_index < index;
+  }
+
+  [[nodiscard]] typename std::vector<Entry>::const_iterator FindEntry(
+      uint32_t index) const {
+    const auto it =
+        std::lower_bound(entries_.begin(), entries_.end(), index, &IsBefore);
+    return (it != entries_.end() && it->field_index == index) ? it
+                                                              : entries_.end();
+  }
+
+  template <std::size_t kIndex>
+  using EntryField = internal::SparseField<
+      Schema,
+      typename Schema::ProtobufFields::template FieldAt<kIndex>>;
+
+  // Dispatches on the |entry|'s field index through a table of one function
+  // per field.
+  template <typename Visitor, std::size_t... kIndices>
+  static decltype(auto) VisitEntryImpl(const Entry& entry,
+                                       Visitor& visitor,
+                                       std::index_sequence<kIndices...>) {
+    using Result = decltype(visitor(entry, FieldList<EntryField<0>>{}));
+    using Dispatcher = Result (*)(const Entry&, Visitor&);
+    static constexpr Dispatcher kDispatchers[] = {
+        [](const Entry& entry, Visitor& visitor) -> Result {
+          return visitor(entry, FieldList<EntryField<kIndices>>{});
+        }...};
+    return kDispatchers[entry.field_index](entry, visitor);
+  }
+
+  std::vector<Entry> entries_;
+};
+
+}  // namespace pb
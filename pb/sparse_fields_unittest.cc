@@ -0,0 +1,229 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/sparse_fields.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/checksum.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Point {
+  int32_t x = 0;
+  int32_t y = 0;
+
+  using ProtobufFields = FieldList<Field<&Point::x, 1>, Field<&Point::y, 2>>;
+};
+
+// A regular message, and the same fields as a SparseFields schema.
+struct Dense {
+  std::optional<int32_t> a;
+  std::optional<std::string> b;
+  std::optional<int32_t> c;
+  std::vector<sint64_t> d;
+  std::unique_ptr<Point> e;
+  std::vector<std::string> f;
+  std::map<int32_t, std::string> g;
+  double h = 0.0;
+
+  using ProtobufFields = FieldList<Field<&Dense::a, 1>,
+                                   Field<&Dense::b, 2>,
+                                   Field<&Dense::c, 40>,
+                                   Field<&Dense::d, 41>,
+                                   Field<&Dense::e, 100>,
+                                   Field<&Dense::f, 101>,
+                                   Field<&Dense::g, 500>,
+                                   Field<&Dense::h, 501>>;
+};
+
+using Sparse = SparseFields<Dense>;
+
+// A message containing SparseFields.
+struct Outer {
+  int32_t id = 0;
+  std::optional<Sparse> sparse;
+  std::vector<Sparse> more;
+
+  using ProtobufFields = FieldList<Field<&Outer::id, 1>,
+                                   Field<&Outer::sparse, 2>,
+                                   Field<&Outer::more, 3>>;
+};
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  const int32_t size = ComputeSerializedSize(message);
+  EXPECT_GE(size, 0);
+  std::vector<uint8_t> buffer(static_cast<std::size_t>(size));
+  Serialize(message, buffer.data());
+
+  // The upper bound path must produce the same bytes.
+  const int32_t upper_bound = EstimateSerializedSizeUpperBound(message);
+  EXPECT_GE(upper_bound, size);
+  std::vector<uint8_t> other(static_cast<std::size_t>(upper_bound));
+  other.resize(static_cast<std::size_t>(
+      SerializeWithinUpperBound(message, other.data()) - other.data()));
+  EXPECT_EQ(buffer, other);
+  return buffer;
+}
+
+TEST(SparseFieldsTest, AccessorsAddAndRemoveFields) {
+  Sparse sparse;
+  EXPECT_TRUE(sparse.empty());
+  EXPECT_FALSE(sparse.has<&Dense::b>());
+  EXPECT_EQ(nullptr, sparse.get<&Dense::b>());
+
+  sparse.set<&Dense::g>(std::map<int32_t, std::string>{{1, "one"}});
+  sparse.set<&Dense::b>("hello");
+  sparse.mutable_get<&Dense::d>().push_back(sint64_t{-5});
+  sparse.set<&Dense::a>(7);
+  EXPECT_EQ(4u, sparse.size());
+
+  ASSERT_TRUE(sparse.get<&Dense::a>());
+  EXPECT_EQ(std::optional<int32_t>(7), *sparse.get<&Dense::a>());
+  ASSERT_TRUE(sparse.get<&Dense::b>());
+  EXPECT_EQ("hello", sparse.get<&Dense::b>()->value());
+  EXPECT_FALSE(sparse.has<&Dense::c>());
+  EXPECT_EQ(1u, sparse.get<&Dense::d>()->size());
+  EXPECT_EQ("one", sparse.get<&Dense::g>()->at(1));
+
+  // Entries are kept in field number order.
+  std::vector<uint32_t> indices;
+  for (const auto& entry : sparse.entries()) {
+    indices.push_back(entry.field_index);
+  }
+  EXPECT_EQ((std::vector<uint32_t>{0, 1, 3, 6}), indices);
+
+  // Fields of the same C++ type stay separate.
+  sparse.set<&Dense::c>(9);
+  EXPECT_EQ(std::optional<int32_t>(7), *sparse.get<&Dense::a>());
+  EXPECT_EQ(std::optional<int32_t>(9), *sparse.get<&Dense::c>());
+
+  sparse.clear<&Dense::a>();
+  EXPECT_FALSE(sparse.has<&Dense::a>());
+  EXPECT_TRUE(sparse.has<&Dense::c>());
+  sparse.clear<&Dense::a>();  // No-op.
+  EXPECT_EQ(4u, sparse.size());
+  sparse.clear();
+  EXPECT_TRUE(sparse.empty());
+}
+
+TEST(SparseFieldsTest, SerializesTheSameAsTheDenseMessage) {
+  Dense dense;
+  Sparse sparse;
+  EXPECT_EQ(0, ComputeSerializedSize(sparse));
+
+  dense.b = "text";
+  sparse.set<&Dense::b>("text");
+  dense.d = {sint64_t{1}, sint64_t{-1}, sint64_t{1000000}};
+  sparse.set<&Dense::d>(dense.d);
+  dense.e = std::make_unique<Point>(Point{3, -4});
+  sparse.set<&Dense::e>(std::make_unique<Point>(Point{3, -4}));
+  dense.f = {"x", "", "zzz"};
+  sparse.set<&Dense::f>(dense.f);
+  dense.g = {{1, "one"}, {2, "two"}};
+  sparse.set<&Dense::g>(dense.g);
+  dense.h = 2.5;
+  sparse.set<&Dense::h>(2.5);
+  EXPECT_EQ(SerializeToVector(dense), SerializeToVector(sparse));
+
+  // Present fields that hold no value serialize to nothing, just like the
+  // dense message's members.
+  sparse.set<&Dense::a>(std::nullopt);
+  sparse.set<&Dense::h>(0.0);
+  dense.h = 0.0;
+  EXPECT_EQ(SerializeToVector(dense), SerializeToVector(sparse));
+}
+
+TEST(SparseFieldsTest, ParsesOnlyThePresentFields) {
+  Dense dense;
+  dense.a = 1;
+  dense.d = {sint64_t{5}, sint64_t{-6}};
+  dense.e = std::make_unique<Point>(Point{1, 2});
+  dense.g = {{7, "seven"}};
+  const std::vector<uint8_t> wire_bytes = SerializeToVector(dense);
+
+  // Note: |h| is not optional, and so always serialized.
+  Sparse sparse;
+  ASSERT_TRUE(MergeFromBuffer(wire_bytes.data(),
+                              wire_bytes.data() + wire_bytes.size(), sparse));
+  EXPECT_EQ(5u, sparse.size());
+  EXPECT_EQ(std::optional<int32_t>(1), *sparse.get<&Dense::a>());
+  EXPECT_EQ(dense.d, *sparse.get<&Dense::d>());
+  ASSERT_TRUE(*sparse.get<&Dense::e>());
+  EXPECT_EQ(2, (*sparse.get<&Dense::e>())->y);
+  EXPECT_EQ(dense.g, *sparse.get<&Dense::g>());
+  EXPECT_EQ(0.0, *sparse.get<&Dense::h>());
+  EXPECT_FALSE(sparse.has<&Dense::b>());
+
+  // Merging appends to repeated fields, and replaces the others.
+  ASSERT_TRUE(MergeFromPaddedBuffer(
+      wire_bytes.data(), wire_bytes.data() + wire_bytes.size(), sparse));
+  EXPECT_EQ(4u, sparse.get<&Dense::d>()->size());
+  EXPECT_EQ(std::optional<int32_t>(1), *sparse.get<&Dense::a>());
+
+  // Unknown fields are skipped, as usual.
+  const uint8_t kUnknownField[] = {0x18, 0x01};  // Field 3, varint 1.
+  Sparse other;
+  ASSERT_TRUE(MergeFromBuffer(kUnknownField, kUnknownField + 2, other));
+  EXPECT_TRUE(other.empty());
+}
+
+TEST(SparseFieldsTest, NestsWithinRegularMessages) {
+  Outer outer;
+  outer.id = 5;
+  outer.sparse.emplace().set<&Dense::c>(123);
+  outer.more.emplace_back().set<&Dense::b>("first");
+  outer.more.emplace_back();
+  outer.more.emplace_back().set<&Dense::h>(-1.0);
+
+  const std::vector<uint8_t> wire_bytes = SerializeToVector(outer);
+  Outer parsed;
+  ASSERT_TRUE(MergeFromBuffer(wire_bytes.data(),
+                              wire_bytes.data() + wire_bytes.size(), parsed));
+  EXPECT_EQ(5, parsed.id);
+  ASSERT_TRUE(parsed.sparse);
+  EXPECT_EQ(std::optional<int32_t>(123), *parsed.sparse->get<&Dense::c>());
+  ASSERT_EQ(3u, parsed.more.size());
+  EXPECT_EQ("first", parsed.more[0].get<&Dense::b>()->value());
+  EXPECT_TRUE(parsed.more[1].empty());
+  EXPECT_EQ(-1.0, *parsed.more[2].get<&Dense::h>());
+
+  // With a checksum trailer too.
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(ComputeSerializedSizeWithChecksum(outer)));
+  SerializeWithChecksum(outer, buffer.data());
+  Outer verified;
+  ASSERT_TRUE(MergeFromBufferVerified(buffer.data(),
+                                      buffer.data() + buffer.size(), verified));
+  EXPECT_EQ(3u, verified.more.size());
+
+  Sparse sparse;
+  sparse.set<&Dense::f>(std::vector<std::string>{"a", "b"});
+  buffer.resize(
+      static_cast<std::size_t>(ComputeSerializedSizeWithChecksum(sparse)));
+  SerializeWithChecksum(sparse, buffer.data());
+  Sparse verified_sparse;
+  ASSERT_TRUE(MergeFromBufferVerified(
+      buffer.data(), buffer.data() + buffer.size(), verified_sparse));
+  EXPECT_EQ(2u, verified_sparse.get<&Dense::f>()->size());
+}
+
+TEST(SparseFieldsTest, IsSmallRegardlessOfSchemaSize) {
+  EXPECT_EQ(sizeof(std::vector<Sparse::Entry>), sizeof(Sparse));
+}
+
+}  // namespace
+}  // namespace pb
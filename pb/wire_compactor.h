@@ -0,0 +1,495 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/iterable_util.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/parse.h"
+#include "pb/codec/serialize.h"
+#include "pb/codec/tag.h"
+#include "pb/codec/wire_type.h"
+#include "pb/field_list.h"
+#include "pb/packed_fixed_view.h"
+#include "pb/wire_writer.h"
+
+namespace pb {
+
+namespace internal {
+
+// One tag+value of a known field, found in the input.
+struct CompactorOccurrence {
+  uint32_t field_index;
+  codec::WireType wire_type;
+  const uint8_t* value;  // Just after the tag.
+  const uint8_t* value_end;
+};
+
+// The bytes of one message's fields. A singular nested message may be split
+// across several of these, which are merged.
+struct CompactorSpan {
+  const uint8_t* begin;
+  const uint8_t* end;
+};
+
+template <typename... Fields>
+[[nodiscard]] constexpr std::array<int32_t, sizeof...(Fields)>
+GetCompactorFieldNumbers(FieldList<Fields...>) {
+  return {Fields::GetFieldNumber()...};
+}
+
+// The wire type of one value of |TheField|: one element, if it is repeated.
+template <typename TheField>
+[[nodiscard]] constexpr codec::WireType GetCompactorValueWireType() {
+  if constexpr (codec::IsRepeatedField<TheField>()) {
+    return codec::GetWireType<
+        codec::IterableValueType<typename TheField::Member>>();
+  } else {
+    return codec::GetWireType<typename TheField::Member>();
+  }
+}
+
+template <typename... Fields>
+[[nodiscard]] constexpr std::array<codec::WireType, sizeof...(Fields)>
+GetCompactorValueWireTypes(FieldList<Fields...>) {
+  return {GetCompactorValueWireType<Fields>()...};
+}
+
+template <typename... Fields>
+[[nodiscard]] constexpr std::array<bool, sizeof...(Fields)>
+GetCompactorPackableFlags(FieldList<Fields...>) {
+  return {codec::CanEncodeAsAPackedRepeatedField<Fields>()...};
+}
+
+// Returns true if a scalar or string |value| is its type's default: zero,
+// false, or empty. Floating-point values must be +0.0, since -0.0 is
+// serialized.
+template <typename Value>
+[[nodiscard]] bool IsDefaultCompactorValue(const Value& value) {
+  if constexpr (std::is_same_v<Value, std::string_view>) {
+    return value.empty();
+  } else if constexpr (std::is_floating_point_v<Value>) {
+    const Value zero{};
+    return std::memcmp(&value, &zero, sizeof(Value)) == 0;
+  } else if constexpr (std::is_arithmetic_v<Value> || std::is_enum_v<Value>) {
+    return value == Value{};
+  } else {
+    return value.value() == 0;  // The IntegerWrapper types.
+  }
+}
+
+template <typename T>
+struct IsPackedFixedView : std::false_type {};
+
+template <typename T>
+struct IsPackedFixedView<PackedFixedView<T>> : std::true_type {};
+
+}  // namespace internal
+
+// Rewrites the wire bytes of a |Message| into the minimal encoding that this
+// library would produce for it, without populating a |Message|. This shrinks
+// the output of foreign producers (e.g., stored logs) at a fraction of the cost
+// of parsing and re-serializing each message. Example:
+//
+//   pb::WireCompactor<LogEvent> compactor;
+//   std::vector<uint8_t> compacted;
+//   for (const Record& record : records) {
+//     compacted.clear();
+//     if (!compactor.Compact(record.begin, record.end, compacted)) { ... }
+//     ...
+//   }
+//
+// The output parses into exactly the same |Message| as the input. To get
+// there:
+//
+//   - The fields are written in the order of the |Message|'s ProtobufFields.
+//   - Varints are re-encoded with the fewest bytes (except that negative
+//     int32/int64/enum values remain 10 bytes, as the wire format requires).
+//   - Repeated scalar fields are packed into one run, or dropped if empty.
+//   - PackedFixedView fields keep only their last packed run, which is the one
+//     a parse would view.
+//   - Singular fields that occur more than once keep only the last value; or,
+//     for nested messages, the merge of all of them.
+//   - Fields not held in a std::optional, std::unique_ptr or std::shared_ptr
+//     (i.e., that have implicit presence) are dropped if zero or empty, since
+//     a parse produces the same default anyway.
+//   - Unknown fields are dropped, since a parse would skip them.
+//
+// Map fields are copied as-is. Compact() fails on the same invalid inputs that
+// a parse would. A WireCompactor reuses its scratch memory from one call to the
+// next, and so should be kept around for compacting many messages (on one
+// thread at a time).
+template <class Message>
+class WireCompactor {
+ public:
+  WireCompactor()
+      : occurrences_(codec::kMaxMessageNestingDepth + 1),
+        spans_(codec::kMaxMessageNestingDepth + 1) {}
+
+  WireCompactor(const WireCompactor&) = delete;
+  WireCompactor& operator=(const WireCompactor&) = delete;
+
+  // Appends the compaction of the wire bytes from |begin| to |end| to the
+  // |output|. Returns false, leaving the |output| as it was, if the input is
+  // not a valid |Message|.
+  [[nodiscard]] bool Compact(const uint8_t* begin,
+                             const uint8_t* end,
+                             std::vector<uint8_t>& output) {
+    assert((begin && (begin < end)) || (begin == end));
+    const std::size_t output_start = output.size();
+    output_ = &output;
+    output_size_ = output_start;
+    spans_[0].assign(1, internal::CompactorSpan{begin, end});
+    const bool success = CompactFields<Message>(0);
+    output_ = nullptr;
+    if (!success || (output_size_ - output_start) >
+                        static_cast<std::size_t>(codec::kMaxSerializedSize)) {
+      output.resize(output_start);
+      return false;
+    }
+    output.resize(output_size_);
+    return true;
+  }
+
+ private:
+  using Occurrence = internal::CompactorOccurrence;
+
+  // The most bytes a tag, or a length prefix, takes on the wire.
+  static constexpr std::size_t kMaxVarint32Size = 5;
+
+  // Compacts the fields of an |M| in spans_[nesting_level].
+  template <class M>
+  [[nodiscard]] bool CompactFields(int nesting_level) {
+    using Fields = typename M::ProtobufFields;
+    static_assert(Fields::AreFieldNumbersMonotonicallyIncreasing());
+    static constexpr auto kFieldNumbers =
+        internal::GetCompactorFieldNumbers(Fields{});
+    static constexpr auto kValueWireTypes =
+        internal::GetCompactorValueWireTypes(Fields{});
+    static constexpr auto kIsPackable =
+        internal::GetCompactorPackableFlags(Fields{});
+
+    // Find the values of each known field, checking that they are valid.
+    std::vector<Occurrence>& occurrences =
+        occurrences_[static_cast<std::size_t>(nesting_level)];
+    occurrences.clear();
+    bool is_sorted = true;
+    for (const internal::CompactorSpan& span :
+         spans_[static_cast<std::size_t>(nesting_level)]) {
+      const uint8_t* buffer = span.begin;
+      while (buffer != span.end) {
+        codec::Tag tag;
+        buffer = codec::ParseValue(buffer, span.end, nesting_level, tag);
+        if (!buffer) {
+          return false;
+        }
+        const codec::WireType wire_type = codec::GetWireTypeFromTag(tag);
+        const uint8_t* const value = buffer;
+        buffer = codec::SkipValueAfterTag(buffer, span.end, nesting_level,
+                                          wire_type);
+        if (!buffer) {
+          return false;
+        }
+
+        const int32_t field_number = codec::GetFieldNumberFromTag(tag);
+        const auto* const it = std::lower_bound(
+            kFieldNumbers.begin(), kFieldNumbers.end(), field_number);
+        if (it == kFieldNumbers.end() || *it != field_number) {
+          continue;  // Unknown fields are dropped.
+        }
+        const auto field_index =
+            static_cast<std::size_t>(it - kFieldNumbers.begin());
+        if (wire_type != kValueWireTypes[field_index] &&
+            !(kIsPackable[field_index] &&
+              wire_type == codec::WireType::kLengthDelimited)) {
+          return false;
+        }
+        if (!occurrences.empty() &&
+            occurrences.back().field_index > field_index) {
+          is_sorted = false;
+        }
+        occurrences.push_back(Occurrence{static_cast<uint32_t>(field_index),
+                                         wire_type, value, buffer});
+      }
+    }
+    if (!is_sorted) {
+      std::stable_sort(occurrences.begin(), occurrences.end(),
+                       [](const Occurrence& a, const Occurrence& b) {
+                         return a.field_index < b.field_index;
+                       });
+    }
+
+    // Then, write them out field by field.
+    const Occurrence* cursor = occurrences.data();
+    return CompactEachField<M>(
+        cursor, occurrences.data() + occurrences.size(), nesting_level,
+        std::make_index_sequence<Fields::kFieldCount>{});
+  }
+
+  template <class M, std::size_t... kIndices>
+  [[nodiscard]] bool CompactEachField(const Occurrence*& cursor,
+                                      const Occurrence* end,
+                                      int nesting_level,
+                                      std::index_sequence<kIndices...>) {
+    return (CompactField<
+                typename M::ProtobufFields::template FieldAt<kIndices>>(
+                kIndices, cursor, end, nesting_level) &&
+            ...);
+  }
+
+  // Writes out the occurrences of one field, which are next at the |cursor|.
+  template <typename TheField>
+  [[nodiscard]] bool CompactField(std::size_t field_index,
+                                  const Occurrence*& cursor,
+                                  const Occurrence* end,
+                                  int nesting_level) {
+    const Occurrence* const first = cursor;
+    while (cursor != end && cursor->field_index == field_index) {
+      ++cursor;
+    }
+    const Occurrence* const last = cursor;
+    if (first == last) {
+      return true;
+    }
+
+    using Member = typename TheField::Member;
+    constexpr int32_t kFieldNumber = TheField::GetFieldNumber();
+
+    if constexpr (internal::IsPackedFixedView<Member>::value) {
+      // As in a parse, each packed run replaces the one before it, and any
+      // unpacked element is invalid (see pb/codec/parse.h). So, only the last
+      // packed run is written.
+      using Element = codec::IterableValueType<Member>;
+      for (const Occurrence* occurrence = first; occurrence != last;
+           ++occurrence) {
+        if (occurrence->wire_type != codec::WireType::kLengthDelimited) {
+          return false;
+        }
+        uint32_t byte_count;
+        if (!codec::ParseValue(occurrence->value, occurrence->value_end,
+                               nesting_level, byte_count) ||
+            (byte_count % sizeof(Element)) != 0) {
+          return false;
+        }
+        if (occurrence + 1 == last && byte_count > 0 &&
+            !CopyScalar<std::string_view>(
+                occurrence->value, occurrence->value_end,
+                codec::MakeTag(kFieldNumber,
+                               codec::WireType::kLengthDelimited))) {
+          return false;
+        }
+      }
+    } else if constexpr (codec::CanEncodeAsAPackedRepeatedField<TheField>()) {
+      // All of the elements, packed or not, go into one packed run.
+      using Element = codec::IterableValueType<Member>;
+      constexpr auto kElementWireType = codec::GetWireType<Element>();
+      const std::size_t field_start = output_size_;
+      WriteTag(codec::MakeTag(kFieldNumber, codec::WireType::kLengthDelimited));
+      const std::size_t payload_start = BeginLengthDelimited();
+      for (const Occurrence* occurrence = first; occurrence != last;
+           ++occurrence) {
+        if (occurrence->wire_type == kElementWireType) {
+          if (!CopyScalar<Element>(occurrence->value, occurrence->value_end)) {
+            return false;
+          }
+          continue;
+        }
+        uint32_t byte_count;
+        const uint8_t* element =
+            codec::ParseValue(occurrence->value, occurrence->value_end,
+                              nesting_level, byte_count);
+        while (element != occurrence->value_end) {
+          element = CopyScalar<Element>(element, occurrence->value_end);
+          if (!element) {
+            return false;
+          }
+        }
+      }
+      if (output_size_ == payload_start) {
+        output_size_ = field_start;  // Empty, as serialized by this library.
+      } else {
+        EndLengthDelimited(payload_start);
+      }
+    } else if constexpr (codec::IsRepeatedField<TheField>()) {
+      // Each element is its own tag+value, in order.
+      using Element = typename internal::OneValueTypeDetector<
+          codec::IterableValueType<Member>>::Type;
+      for (const Occurrence* occurrence = first; occurrence != last;
+           ++occurrence) {
+        if constexpr (codec::IsMessage<Element>()) {
+          if (!CompactNestedMessage<Element>(kFieldNumber, occurrence,
+                                             occurrence + 1, nesting_level,
+                                             true)) {
+            return false;
+          }
+        } else {
+          // Strings, bytes and map entries.
+          if (!CopyScalar<std::string_view>(
+                  occurrence->value, occurrence->value_end,
+                  codec::MakeTag(kFieldNumber,
+                                 codec::WireType::kLengthDelimited))) {
+            return false;
+          }
+        }
+      }
+    } else {
+      using Value = typename internal::OneValueTypeDetector<Member>::Type;
+      constexpr bool kHasExplicitPresence = !std::is_same_v<Value, Member>;
+      if constexpr (codec::IsMessage<Value>()) {
+        return CompactNestedMessage<Value>(kFieldNumber, first, last,
+                                           nesting_level,
+                                           kHasExplicitPresence);
+      } else {
+        // The last value wins, as in a parse.
+        using Parsed = std::conditional_t<std::is_same_v<Value, std::string>,
+                                          std::string_view, Value>;
+        const Occurrence& occurrence = *(last - 1);
+        Parsed value{};
+        if (!codec::ParseValue(occurrence.value, occurrence.value_end,
+                               nesting_level, value)) {
+          return false;
+        }
+        if (!kHasExplicitPresence &&
+            internal::IsDefaultCompactorValue(value)) {
+          return true;
+        }
+        WriteTag(codec::MakeTag(kFieldNumber, codec::GetWireType<Value>()));
+        WriteValue(value);
+      }
+    }
+    return true;
+  }
+
+  // Writes one nested message field, merged from the payloads of the
+  // occurrences from |first| to |last|. Unless |keep_if_empty|, nothing is
+  // written if the result has no fields.
+  template <class Nested>
+  [[nodiscard]] bool CompactNestedMessage(int32_t field_number,
+                                          const Occurrence* first,
+                                          const Occurrence* last,
+                                          int nesting_level,
+                                          bool keep_if_empty) {
+    if (nesting_level >= codec::kMaxMessageNestingDepth) {
+      return false;
+    }
+    std::vector<internal::CompactorSpan>& spans =
+        spans_[static_cast<std::size_t>(nesting_level) + 1];
+    spans.clear();
+    for (const Occurrence* occurrence = first; occurrence != last;
+         ++occurrence) {
+      uint32_t byte_count;
+      const uint8_t* const payload =
+          codec::ParseValue(occurrence->value, occurrence->value_end,
+                            nesting_level, byte_count);
+      spans.push_back(internal::CompactorSpan{payload, occurrence->value_end});
+    }
+
+    const std::size_t field_start = output_size_;
+    WriteTag(codec::MakeTag(field_number, codec::WireType::kLengthDelimited));
+    const std::size_t payload_start = BeginLengthDelimited();
+    if (!CompactFields<Nested>(nesting_level + 1)) {
+      return false;
+    }
+    if (!keep_if_empty && output_size_ == payload_start) {
+      output_size_ = field_start;
+    } else {
+      EndLengthDelimited(payload_start);
+    }
+    return true;
+  }
+
+  // Re-encodes one value of type |T| from |buffer|, preceded by the |tag| if
+  // it is not zero. Returns the position after the value, or null if it is
+  // invalid.
+  template <typename T>
+  [[nodiscard]] const uint8_t* CopyScalar(const uint8_t* buffer,
+                                          const uint8_t* buffer_end,
+                                          codec::Tag tag = 0) {
+    T value{};
+    buffer = codec::ParseValue(buffer, buffer_end, 0, value);
+    if (buffer) {
+      if (tag != 0) {
+        WriteTag(tag);
+      }
+      WriteValue(value);
+    }
+    return buffer;
+  }
+
+  void WriteTag(codec::Tag tag) {
+    Commit(codec::SerializeValue(tag, Reserve(kMaxVarint32Size)));
+  }
+
+  template <typename Value>
+  void WriteValue(const Value& value) {
+    if constexpr (std::is_same_v<Value, std::string_view>) {
+      Commit(codec::SerializeValue(
+          value, Reserve(kMaxVarint32Size + value.size())));
+    } else {
+      // No scalar takes more than 10 bytes.
+      Commit(codec::SerializeValue(value, Reserve(10)));
+    }
+  }
+
+  // Leaves room for the length prefix of a value to be written next, and
+  // returns where the value starts.
+  [[nodiscard]] std::size_t BeginLengthDelimited() {
+    Commit(Reserve(kMaxVarint32Size) + kMaxVarint32Size);
+    return output_size_;
+  }
+
+  // Writes the length prefix of the value written since BeginLengthDelimited()
+  // returned |payload_start|, and moves the value down to meet it.
+  void EndLengthDelimited(std::size_t payload_start) {
+    const std::size_t byte_count = output_size_ - payload_start;
+    uint8_t prefix[kMaxVarint32Size];
+    const auto prefix_size = static_cast<std::size_t>(
+        codec::SerializeValue(static_cast<uint32_t>(byte_count), prefix) -
+        prefix);
+    uint8_t* const gap = output_->data() + payload_start - kMaxVarint32Size;
+    if (prefix_size != kMaxVarint32Size) {
+      std::memmove(gap + prefix_size, gap + kMaxVarint32Size, byte_count);
+    }
+    std::memcpy(gap, prefix, prefix_size);
+    output_size_ -= kMaxVarint32Size - prefix_size;
+  }
+
+  // Returns where the next bytes are to be written, making room for at least
+  // |byte_count| of them. The output vector is grown geometrically, and only
+  // trimmed to |output_size_| at the end of Compact().
+  [[nodiscard]] uint8_t* Reserve(std::size_t byte_count) {
+    if (output_->size() - output_size_ < byte_count) {
+      output_->resize(
+          std::max(output_->size() * 2, output_size_ + byte_count + 256));
+    }
+    return output_->data() + output_size_;
+  }
+
+  // Marks the bytes written before |end| as part of the output.
+  void Commit(const uint8_t* end) {
+    output_size_ = static_cast<std::size_t>(end - output_->data());
+  }
+
+  // The known fields found at each nesting level, and the spans of input to be
+  // compacted at each. These are reused by the next Compact().
+  std::vector<std::vector<Occurrence>> occurrences_;
+  std::vector<std::vector<internal::CompactorSpan>> spans_;
+
+  std::vector<uint8_t>* output_ = nullptr;
+  std::size_t output_size_ = 0;  // The bytes of |output_| written so far.
+};
+
+}  // namespace pb
@@ -0,0 +1,234 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/wire_compactor.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/packed_fixed_view.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Point {
+  int32_t x = 0;
+  int32_t y = 0;
+
+  using ProtobufFields = FieldList<Field<&Point::x, 1>, Field<&Point::y, 2>>;
+};
+
+struct Shape {
+  int32_t id = 0;
+  std::optional<int32_t> layer;
+  std::vector<int32_t> values;
+  std::string name;
+  std::optional<std::string> label;
+  Point origin;
+  std::unique_ptr<Point> anchor;
+  std::vector<Point> points;
+  std::vector<std::string> tags;
+  std::vector<sint32_t> deltas;
+  double scale = 0.0;
+  std::map<int32_t, std::string> names;
+
+  using ProtobufFields = FieldList<Field<&Shape::id, 1>,
+                                   Field<&Shape::layer, 2>,
+                                   Field<&Shape::values, 3>,
+                                   Field<&Shape::name, 4>,
+                                   Field<&Shape::label, 5>,
+                                   Field<&Shape::origin, 6>,
+                                   Field<&Shape::anchor, 7>,
+                                   Field<&Shape::points, 8>,
+                                   Field<&Shape::tags, 9>,
+                                   Field<&Shape::deltas, 10>,
+                                   Field<&Shape::scale, 11>,
+                                   Field<&Shape::names, 12>>;
+};
+
+template <typename Message>
+std::vector<uint8_t> SerializeToVector(const Message& message) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(ComputeSerializedSize(message)));
+  Serialize(message, buffer.data());
+  return buffer;
+}
+
+std::optional<std::vector<uint8_t>> Compact(const std::vector<uint8_t>& input) {
+  WireCompactor<Shape> compactor;
+  std::vector<uint8_t> output;
+  if (!compactor.Compact(input.data(), input.data() + input.size(), output)) {
+    EXPECT_TRUE(output.empty());
+    return std::nullopt;
+  }
+  return output;
+}
+
+// Expects that the |input| compacts to the |expected| bytes, and that both
+// parse into the same Shape.
+void ExpectCompactsTo(const std::vector<uint8_t>& input,
+                      const std::vector<uint8_t>& expected) {
+  const auto output = Compact(input);
+  ASSERT_TRUE(output);
+  EXPECT_EQ(expected, *output);
+
+  Shape from_input;
+  ASSERT_TRUE(MergeFromBuffer(input.data(), input.data() + input.size(),
+                              from_input));
+  Shape from_output;
+  ASSERT_TRUE(MergeFromBuffer(output->data(), output->data() + output->size(),
+                              from_output));
+  EXPECT_EQ(SerializeToVector(from_input), SerializeToVector(from_output));
+}
+
+TEST(WireCompactor, LeavesMinimalEncodingsAsTheyAre) {
+  Shape shape;
+  shape.id = -1;
+  shape.layer = 0;
+  shape.values = {1, 2, 300};
+  shape.name = "square";
+  shape.label = "";
+  shape.origin = {1, 2};
+  shape.anchor = std::make_unique<Point>(Point{7, 8});
+  shape.points = {{3, 4}, {5, 6}};
+  shape.tags = {"a", "b"};
+  shape.deltas = {-1, 1};
+  shape.scale = -0.0;
+  shape.names = {{1, "one"}, {2, "two"}};
+  const std::vector<uint8_t> bytes = SerializeToVector(shape);
+  ExpectCompactsTo(bytes, bytes);
+}
+
+TEST(WireCompactor, PacksRepeatedScalars) {
+  // Field 3 as separate varints, with a packed run in between; and field 10
+  // as one unpacked zigzag varint.
+  ExpectCompactsTo({0x18, 0x01, 0x1a, 0x02, 0x02, 0x03, 0x18, 0x04, 0x50, 0x03},
+                   {0x1a, 0x04, 0x01, 0x02, 0x03, 0x04, 0x52, 0x01, 0x03});
+  // Empty packed runs are dropped.
+  ExpectCompactsTo({0x1a, 0x00}, {});
+}
+
+TEST(WireCompactor, MinimizesVarints) {
+  // Field 1 = 1 as a 5-byte varint, and a string whose length is overlong.
+  ExpectCompactsTo({0x08, 0x81, 0x80, 0x80, 0x80, 0x00, 0x22, 0x81, 0x00, 'x'},
+                   {0x08, 0x01, 0x22, 0x01, 'x'});
+  // A negative int32 as 5 bytes (not sign-extended) becomes the 10 bytes the
+  // wire format requires.
+  ExpectCompactsTo({0x08, 0xff, 0xff, 0xff, 0xff, 0x0f},
+                   {0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                    0x01});
+}
+
+TEST(WireCompactor, DropsDefaultsOnlyWithImplicitPresence) {
+  // id = 0, layer = 0, name = "", label = "", origin = {}, anchor = {},
+  // scale = 0.0.
+  ExpectCompactsTo({0x08, 0x00, 0x10, 0x00, 0x22, 0x00, 0x2a, 0x00, 0x32, 0x00,
+                    0x3a, 0x00, 0x59, 0, 0, 0, 0, 0, 0, 0, 0},
+                   {0x10, 0x00, 0x2a, 0x00, 0x3a, 0x00});
+  // But not negative zero.
+  ExpectCompactsTo({0x59, 0, 0, 0, 0, 0, 0, 0, 0x80},
+                   {0x59, 0, 0, 0, 0, 0, 0, 0, 0x80});
+}
+
+TEST(WireCompactor, ReordersFieldsAndKeepsTheLastSingularValue) {
+  // name = "a", id = 5, name = "b", tags "x" and "y" on either side.
+  ExpectCompactsTo({0x4a, 0x01, 'x', 0x22, 0x01, 'a', 0x08, 0x05, 0x22, 0x01,
+                    'b', 0x4a, 0x01, 'y'},
+                   {0x08, 0x05, 0x22, 0x01, 'b', 0x4a, 0x01, 'x', 0x4a, 0x01,
+                    'y'});
+}
+
+TEST(WireCompactor, MergesAndCompactsNestedMessages) {
+  // origin {x = 1}, then origin {y = 0, x = 2}, then points {y = 0x80 overlong}
+  // and points {}.
+  ExpectCompactsTo({0x32, 0x02, 0x08, 0x01, 0x32, 0x04, 0x10, 0x00, 0x08, 0x02,
+                    0x42, 0x03, 0x10, 0x80, 0x00, 0x42, 0x00},
+                   {0x32, 0x02, 0x08, 0x02, 0x42, 0x00, 0x42, 0x00});
+}
+
+TEST(WireCompactor, DropsUnknownFields) {
+  // Field 100 (varint) and field 13 (length-delimited), around id = 7.
+  ExpectCompactsTo({0xa0, 0x06, 0x01, 0x08, 0x07, 0x6a, 0x01, 'z'},
+                   {0x08, 0x07});
+}
+
+TEST(WireCompactor, FailsWhereAParseWould) {
+  // id as a fixed32.
+  EXPECT_FALSE(Compact({0x0d, 0x01, 0x00, 0x00, 0x00}));
+  // Truncated varint.
+  EXPECT_FALSE(Compact({0x08, 0x80}));
+  // Nested message longer than its parent.
+  EXPECT_FALSE(Compact({0x32, 0x05, 0x08, 0x01}));
+  // A nested message with a truncated field.
+  EXPECT_FALSE(Compact({0x32, 0x01, 0x08}));
+}
+
+TEST(WireCompactor, KeepsOnlyTheLastPackedRunOfAPackedFixedView) {
+  struct Samples {
+    int32_t id = 0;
+    PackedFixedView<fixed32_t> values;
+
+    using ProtobufFields =
+        FieldList<Field<&Samples::id, 1>, Field<&Samples::values, 2>>;
+  };
+  WireCompactor<Samples> compactor;
+  std::vector<uint8_t> output;
+
+  // Two packed runs, around id = 7: A parse views only the last one, which has
+  // one element.
+  const std::vector<uint8_t> two_runs = {0x12, 0x08, 1, 0, 0, 0, 2, 0, 0, 0,
+                                         0x08, 0x07, 0x12, 0x04, 3, 0, 0, 0};
+  ASSERT_TRUE(compactor.Compact(two_runs.data(),
+                                two_runs.data() + two_runs.size(), output));
+  EXPECT_EQ((std::vector<uint8_t>{0x08, 0x07, 0x12, 0x04, 3, 0, 0, 0}),
+            output);
+  Samples samples;
+  ASSERT_TRUE(MergeFromBuffer(output.data(), output.data() + output.size(),
+                              samples));
+  ASSERT_EQ(1u, samples.values.size());
+  EXPECT_EQ(3u, samples.values[0].value());
+
+  // An unpacked element, which a parse rejects.
+  const std::vector<uint8_t> unpacked = {0x12, 0x04, 1, 0, 0, 0,
+                                         0x15, 2,    0, 0, 0};
+  EXPECT_FALSE(MergeFromBuffer(unpacked.data(),
+                               unpacked.data() + unpacked.size(), samples));
+  output.clear();
+  EXPECT_FALSE(compactor.Compact(unpacked.data(),
+                                 unpacked.data() + unpacked.size(), output));
+  EXPECT_TRUE(output.empty());
+}
+
+TEST(WireCompactor, ReusesItsScratchMemoryAcrossCalls) {
+  WireCompactor<Shape> compactor;
+  std::vector<uint8_t> output;
+  const std::vector<uint8_t> first = {0x18, 0x01, 0x18, 0x02};
+  const std::vector<uint8_t> second = {0x42, 0x02, 0x08, 0x01};
+  ASSERT_TRUE(
+      compactor.Compact(first.data(), first.data() + first.size(), output));
+  ASSERT_TRUE(
+      compactor.Compact(second.data(), second.data() + second.size(), output));
+  EXPECT_EQ((std::vector<uint8_t>{0x1a, 0x02, 0x01, 0x02, 0x42, 0x02, 0x08,
+                                  0x01}),
+            output);
+
+  // A failure leaves the earlier output in place.
+  const std::vector<uint8_t> invalid = {0x08};
+  EXPECT_FALSE(
+      compactor.Compact(invalid.data(), invalid.data() + invalid.size(),
+                        output));
+  EXPECT_EQ(8u, output.size());
+}
+
+}  // namespace
+}  // namespace pb
@@ -0,0 +1,355 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "pb/codec/field_rules.h"
+#include "pb/codec/iterable_util.h"
+#include "pb/codec/limits.h"
+#include "pb/codec/serialize.h"
+#include "pb/codec/tag.h"
+#include "pb/field_list.h"
+
+namespace pb {
+
+namespace internal {
+
+// Strips std::optional, std::unique_ptr and std::shared_ptr from |T|.
+template <typename T>
+struct OneValueTypeDetector {
+  using Type = T;
+};
+
+template <typename T>
+struct OneValueTypeDetector<std::optional<T>> {
+  using Type = T;
+};
+
+template <typename T>
+struct OneValueTypeDetector<std::unique_ptr<T>> {
+  using Type = T;
+};
+
+template <typename T>
+struct OneValueTypeDetector<std::shared_ptr<T>> {
+  using Type = std::remove_const_t<T>;
+};
+
+// The type of one value of |TheField|: one element, if it is a repeated field.
+template <typename TheField,
+          bool kIsRepeated = codec::IsRepeatedField<TheField>()>
+struct WireWriterValueTypeDetector {
+  using Type = typename OneValueTypeDetector<typename TheField::Member>::Type;
+};
+
+template <typename TheField>
+struct WireWriterValueTypeDetector<TheField, true> {
+  using Type = typename OneValueTypeDetector<
+      codec::IterableValueType<typename TheField::Member>>::Type;
+};
+
+template <typename TheField>
+using WireWriterValueType =
+    typename WireWriterValueTypeDetector<TheField>::Type;
+
+// The type taken by WireWriter::Set() and Add() for a |Value|: Strings are
+// taken as std::string_view, other classes by const reference, and scalars by
+// value.
+template <typename Value>
+using WireWriterArgument = std::conditional_t<
+    std::is_same_v<Value, std::string> ||
+        std::is_same_v<Value, std::string_view>,
+    std::string_view,
+    std::conditional_t<std::is_class_v<Value>, const Value&, Value>>;
+
+// The field of |Message| bound to |kMemberPointer|, failing compilation if
+// there is none.
+template <class Message, auto kMemberPointer>
+[[nodiscard]] constexpr std::size_t GetWireWriterFieldIndex() {
+  constexpr std::size_t kIndex =
+      FindFieldIndex<kMemberPointer>(typename Message::ProtobufFields{});
+  static_assert(kIndex < Message::ProtobufFields::kFieldCount,
+                "The member is not one of the Message's ProtobufFields.");
+  return kIndex;
+}
+
+template <class Message, auto kMemberPointer>
+using WireWriterField = typename Message::ProtobufFields::template FieldAt<
+    GetWireWriterFieldIndex<Message, kMemberPointer>()>;
+
+// Describes a value of |TheField| to the codec, where the value is held by
+// itself rather than in an instance of the message.
+template <typename TheField, typename Value>
+struct WireWriterValuesField {
+  using Member = Value;
+
+  [[nodiscard]] static constexpr const Value& GetMemberReferenceIn(
+      const Value& value) {
+    return value;
+  }
+
+  [[nodiscard]] static constexpr int32_t GetFieldNumber() {
+    return TheField::GetFieldNumber();
+  }
+};
+
+}  // namespace internal
+
+// Writes the wire format of a |Message| directly into a buffer, one field at a
+// time, without first populating an instance of the |Message|. This avoids the
+// string copies and container allocations of building a struct that is only
+// going to be serialized once. Example:
+//
+//   uint8_t buffer[1024];
+//   pb::WireWriter<LogEvent> writer(buffer, buffer + sizeof(buffer));
+//   writer.Set<&LogEvent::id>(42)
+//       .Add<&LogEvent::tags>(tag_view)
+//       .Nested<&LogEvent::header>([&](pb::WireWriter<Header>& header) {
+//         header.Set<&Header::host>(host_name);
+//       });
+//   uint8_t* const end = writer.Finish();
+//   if (!end) {
+//     ... the buffer was too small ...
+//   }
+//
+// Each member pointer must be one of the |Message|'s ProtobufFields, and each
+// value must be convertible to the field's type; or it fails to compile. String
+// fields take std::string_view. The value of a std::optional, std::unique_ptr
+// or std::shared_ptr field is given directly.
+//
+// The output is identical to pb::Serialize() of the equivalent |Message|, as
+// long as the fields are written in the order of the |Message|'s
+// ProtobufFields, and the elements of each repeated field are written
+// together. Note that pb::Serialize() always writes the fields that are not
+// optional, pointers or repeated, even when they hold zero. Consecutive Add()s
+// to a packed repeated field are coalesced into one packed run.
+//
+// The length of a nested message is back-patched: Space for the largest
+// possible length prefix is set aside before its fields, and then the fields
+// are slid down to follow the actual length prefix.
+//
+// If the buffer runs out of space, the writer stops writing and Finish()
+// returns null. Checks are made before each value is written, assuming the
+// maximum possible encoded size of scalars.
+template <class Message>
+class WireWriter {
+ public:
+  // The argument type of Set() and Add() for the field bound to
+  // |kMemberPointer|.
+  template <auto kMemberPointer>
+  using Argument = internal::WireWriterArgument<internal::WireWriterValueType<
+      internal::WireWriterField<Message, kMemberPointer>>>;
+
+  // Writes to the buffer given by the range |begin| to |end|.
+  WireWriter(uint8_t* begin, uint8_t* end)
+      : position_(begin),
+        end_((end - begin) > codec::kMaxSerializedSize
+                 ? begin + codec::kMaxSerializedSize
+                 : end) {
+    assert((begin && (begin < end)) || (begin == end));
+  }
+
+  WireWriter(const WireWriter&) = delete;
+  WireWriter& operator=(const WireWriter&) = delete;
+
+  // Writes the |value| of a field that is not repeated.
+  template <auto kMemberPointer>
+  WireWriter& Set(Argument<kMemberPointer> value) {
+    using TheField = FieldFor<kMemberPointer>;
+    static_assert(!codec::IsRepeatedField<TheField>(),
+                  "Use Add() or AddAll() for repeated fields.");
+    BeginField<GetFieldIndex<kMemberPointer>()>();
+    WriteTagAndValue<TheField>(value);
+    return *this;
+  }
+
+  // Writes one element of a repeated field.
+  template <auto kMemberPointer>
+  WireWriter& Add(Argument<kMemberPointer> value) {
+    using TheField = FieldFor<kMemberPointer>;
+    static_assert(codec::IsRepeatedField<TheField>(),
+                  "Use Set() for fields that are not repeated.");
+    constexpr auto kIndex = GetFieldIndex<kMemberPointer>();
+    if constexpr (codec::CanEncodeAsAPackedRepeatedField<TheField>()) {
+      if (packed_field_index_ != static_cast<int32_t>(kIndex)) {
+        BeginField<kIndex>();
+        OpenPackedRun<TheField, kIndex>();
+      }
+      if (Reserve(codec::EstimateSerializedValueSizeUpperBound(value))) {
+        position_ = codec::SerializeValue(value, position_);
+      }
+    } else {
+      BeginField<kIndex>();
+      WriteTagAndValue<TheField>(value);
+    }
+    return *this;
+  }
+
+  // Writes all the elements of a repeated field, from any container whose
+  // elements are the same type as the field's.
+  template <auto kMemberPointer, typename Container>
+  WireWriter& AddAll(const Container& values) {
+    using TheField = FieldFor<kMemberPointer>;
+    static_assert(codec::IsRepeatedField<TheField>(),
+                  "AddAll() is only for repeated fields.");
+    static_assert(
+        std::is_same_v<codec::IterableValueType<Container>,
+                       codec::IterableValueType<typename TheField::Member>>,
+        "The elements must be the same type as the field's.");
+    using ValuesField = internal::WireWriterValuesField<TheField, Container>;
+    BeginField<GetFieldIndex<kMemberPointer>()>();
+    if (Reserve(codec::EstimateSerializedSizeOfFieldsUpperBound(
+            values, FieldList<ValuesField>{}))) {
+      position_ = codec::SerializeFields<codec::OutputBounds::kUpperBound>(
+          values, FieldList<ValuesField>{}, position_);
+    }
+    return *this;
+  }
+
+  // Writes a nested message field (or one element, if the field is repeated)
+  // by calling |build| with a WireWriter for the nested message.
+  template <auto kMemberPointer, typename Builder>
+  WireWriter& Nested(Builder&& build) {
+    using TheField = FieldFor<kMemberPointer>;
+    using NestedMessage = internal::WireWriterValueType<TheField>;
+    static_assert(codec::IsMessage<NestedMessage>(),
+                  "Nested() is only for message fields.");
+    constexpr codec::Tag kTag = codec::GetTagForSerialization<TheField>();
+    BeginField<GetFieldIndex<kMemberPointer>()>();
+    if (!Reserve(codec::ComputeSerializedValueSize(kTag) +
+                 codec::kMaxLengthPrefixSize)) {
+      return *this;
+    }
+    position_ = codec::SerializeValue(kTag, position_);
+
+    uint8_t* const fields_begin = position_ + codec::kMaxLengthPrefixSize;
+    WireWriter<NestedMessage> nested(fields_begin, end_);
+    build(nested);
+    uint8_t* const fields_end = nested.Finish();
+    if (!fields_end) {
+      end_ = nullptr;
+      return *this;
+    }
+    const auto payload_size = static_cast<uint32_t>(fields_end - fields_begin);
+    position_ = codec::SerializeValue(payload_size, position_);
+    std::memmove(position_, fields_begin, payload_size);
+    position_ += payload_size;
+    return *this;
+  }
+
+  // Returns false if the buffer ran out of space.
+  [[nodiscard]] bool ok() const { return end_ != nullptr; }
+
+  // Completes the output, and returns a pointer to the byte just after the
+  // last one written; or null if the buffer ran out of space.
+  [[nodiscard]] uint8_t* Finish() {
+    ClosePackedRun();
+    return ok() ? position_ : nullptr;
+  }
+
+ private:
+  template <auto kMemberPointer>
+  [[nodiscard]] static constexpr std::size_t GetFieldIndex() {
+    return internal::GetWireWriterFieldIndex<Message, kMemberPointer>();
+  }
+
+  template <auto kMemberPointer>
+  using FieldFor = internal::WireWriterField<Message, kMemberPointer>;
+
+  // Returns false, and stops all further writing, if fewer than |byte_count|
+  // bytes remain in the buffer.
+  [[nodiscard]] bool Reserve(int64_t byte_count) {
+    if (!ok() || (end_ - position_) < byte_count) {
+      end_ = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // Ends any packed run of another field. In debug builds, also checks that
+  // the fields are written in order, so that the output matches Serialize().
+  template <std::size_t kIndex>
+  void BeginField() {
+    if (packed_field_index_ >= 0) {
+      ClosePackedRun();
+    }
+#ifndef NDEBUG
+    using TheField = typename Message::ProtobufFields::template FieldAt<kIndex>;
+    assert(static_cast<int32_t>(kIndex) > last_field_index_ ||
+           (codec::IsRepeatedField<TheField>() &&
+            static_cast<int32_t>(kIndex) == last_field_index_));
+    last_field_index_ = static_cast<int32_t>(kIndex);
+#endif
+  }
+
+  template <typename TheField, typename Value>
+  void WriteTagAndValue(const Value& value) {
+    constexpr codec::Tag kTag = codec::GetTagForSerialization<TheField>();
+    if (Reserve(codec::ComputeSerializedValueSize(kTag) +
+                codec::EstimateSerializedValueSizeUpperBound(value))) {
+      position_ = codec::SerializeValue(kTag, position_);
+      position_ =
+          codec::SerializeValue<codec::OutputBounds::kUpperBound>(value,
+                                                                  position_);
+    }
+  }
+
+  // Writes the tag of a packed repeated field and sets aside space for its
+  // length, which is back-patched by ClosePackedRun().
+  template <typename TheField, std::size_t kIndex>
+  void OpenPackedRun() {
+    constexpr codec::Tag kTag = codec::GetTagForSerialization<TheField>();
+    if (Reserve(codec::ComputeSerializedValueSize(kTag) +
+                codec::kMaxLengthPrefixSize)) {
+      position_ = codec::SerializeValue(kTag, position_);
+      packed_length_begin_ = position_;
+      position_ += codec::kMaxLengthPrefixSize;
+      packed_field_index_ = static_cast<int32_t>(kIndex);
+    }
+  }
+
+  void ClosePackedRun() {
+    if (packed_field_index_ < 0) {
+      return;
+    }
+    packed_field_index_ = -1;
+    if (!ok()) {
+      return;
+    }
+    uint8_t* const payload_begin =
+        packed_length_begin_ + codec::kMaxLengthPrefixSize;
+    const auto payload_size = static_cast<uint32_t>(position_ - payload_begin);
+    position_ = codec::SerializeValue(payload_size, packed_length_begin_);
+    std::memmove(position_, payload_begin, payload_size);
+    position_ += payload_size;
+  }
+
+  template <class>
+  friend class WireWriter;
+
+  uint8_t* position_;
+
+  // Null once the buffer has run out of space.
+  uint8_t* end_;
+
+  // The index of the packed repeated field being appended to by Add(), or -1.
+  int32_t packed_field_index_ = -1;
+  uint8_t* packed_length_begin_ = nullptr;
+
+#ifndef NDEBUG
+  int32_t last_field_index_ = -1;
+#endif
+};
+
+}  // namespace pb
@@ -0,0 +1,166 @@
+// Copyright 2022 Yuri Wiitala. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pb/wire_writer.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "pb/field_list.h"
+#include "pb/integer_wrapper.h"
+#include "pb/parse.h"
+#include "pb/serialize.h"
+
+namespace pb {
+namespace {
+
+struct Header {
+  std::string host;
+  uint64_t timestamp = 0;
+
+  using ProtobufFields =
+      FieldList<Field<&Header::host, 1>, Field<&Header::timestamp, 2>>;
+};
+
+struct LogEvent {
+  enum Level : int32_t { kInfo = 0, kWarning = 1, kError = 2 };
+
+  int32_t id = 0;
+  std::optional<Level> level;
+  std::vector<std::string> tags;
+  std::unique_ptr<Header> header;
+  std::vector<sint32_t> deltas;
+  std::vector<Header> hops;
+  std::map<std::string, int32_t> counters;
+  std::optional<std::string> message;
+  fixed64_t checksum;
+
+  using ProtobufFields = FieldList<Field<&LogEvent::id, 1>,
+                                   Field<&LogEvent::level, 2>,
+                                   Field<&LogEvent::tags, 3>,
+                                   Field<&LogEvent::header, 4>,
+                                   Field<&LogEvent::deltas, 5>,
+                                   Field<&LogEvent::hops, 6>,
+                                   Field<&LogEvent::counters, 7>,
+                                   Field<&LogEvent::message, 8>,
+                                   Field<&LogEvent::checksum, 9>>;
+};
+
+std::vector<uint8_t> SerializeToVector(const LogEvent& event) {
+  std::vector<uint8_t> buffer(
+      static_cast<std::size_t>(ComputeSerializedSize(event)));
+  Serialize(event, buffer.data());
+  return buffer;
+}
+
+TEST(WireWriterTest, MatchesSerializeOfTheEquivalentStruct) {
+  LogEvent event;
+  event.id = 42;
+  event.level = LogEvent::kWarning;
+  event.tags = {"disk", "", "quota"};
+  event.header = std::make_unique<Header>(Header{"host-1", 1650000000000});
+  event.deltas = {1, -1, 300, -70000};
+  event.hops = {Header{"a", 1}, Header{"b", 2}};
+  event.counters = {{"reads", 10}, {"writes", -3}};
+  event.message = std::string(300, 'x');
+  event.checksum = 0x0123456789abcdef;
+
+  std::vector<uint8_t> buffer(1024);
+  WireWriter<LogEvent> writer(buffer.data(), buffer.data() + buffer.size());
+  writer.Set<&LogEvent::id>(42)
+      .Set<&LogEvent::level>(LogEvent::kWarning)
+      .Add<&LogEvent::tags>("disk")
+      .Add<&LogEvent::tags>(std::string_view())
+      .Add<&LogEvent::tags>(std::string("quota"))
+      .Nested<&LogEvent::header>([](WireWriter<Header>& header) {
+        header.Set<&Header::host>("host-1").Set<&Header::timestamp>(
+            1650000000000);
+      });
+  for (const int32_t delta : {1, -1, 300, -70000}) {
+    writer.Add<&LogEvent::deltas>(delta);
+  }
+  writer.Add<&LogEvent::hops>(Header{"a", 1})
+      .Nested<&LogEvent::hops>([](WireWriter<Header>& hop) {
+        hop.Set<&Header::host>("b").Set<&Header::timestamp>(2);
+      })
+      .AddAll<&LogEvent::counters>(event.counters)
+      .Set<&LogEvent::message>(*event.message)
+      .Set<&LogEvent::checksum>(0x0123456789abcdef);
+  uint8_t* const end = writer.Finish();
+  ASSERT_TRUE(end);
+  buffer.resize(static_cast<std::size_t>(end - buffer.data()));
+  EXPECT_EQ(SerializeToVector(event), buffer);
+
+  LogEvent parsed;
+  ASSERT_TRUE(MergeFromBuffer(buffer.data(), end, parsed));
+  EXPECT_EQ(event.deltas, parsed.deltas);
+  EXPECT_EQ("b", parsed.hops[1].host);
+}
+
+TEST(WireWriterTest, PackedFieldsAreCoalescedUntilAnotherFieldIsWritten) {
+  LogEvent event;
+  event.deltas.assign(100, sint32_t{-5});
+  event.checksum = 7;
+
+  std::vector<uint8_t> buffer(1024);
+  WireWriter<LogEvent> writer(buffer.data(), buffer.data() + buffer.size());
+  writer.Set<&LogEvent::id>(0);
+  for (int i = 0; i < 100; ++i) {
+    writer.Add<&LogEvent::deltas>(-5);
+  }
+  writer.Set<&LogEvent::checksum>(7);
+  uint8_t* const end = writer.Finish();
+  ASSERT_TRUE(end);
+  buffer.resize(static_cast<std::size_t>(end - buffer.data()));
+  EXPECT_EQ(SerializeToVector(event), buffer);
+
+  // The same, with AddAll().
+  std::vector<uint8_t> other(1024);
+  WireWriter<LogEvent> other_writer(other.data(), other.data() + other.size());
+  other_writer.Set<&LogEvent::id>(0)
+      .AddAll<&LogEvent::deltas>(event.deltas)
+      .Set<&LogEvent::checksum>(7);
+  other.resize(static_cast<std::size_t>(other_writer.Finish() - other.data()));
+  EXPECT_EQ(buffer, other);
+}
+
+TEST(WireWriterTest, FailsWhenTheBufferIsTooSmall) {
+  LogEvent event;
+  event.id = 1;
+  event.header = std::make_unique<Header>(Header{"some-host", 99});
+  event.message = "hello";
+  event.checksum = 0;
+  const std::vector<uint8_t> expected = SerializeToVector(event);
+
+  // Since space is reserved for the maximum size of each value, the writer
+  // needs some slack beyond the final size.
+  const auto write = [](uint8_t* begin, uint8_t* end) {
+    WireWriter<LogEvent> writer(begin, end);
+    writer.Set<&LogEvent::id>(1)
+        .Nested<&LogEvent::header>([](WireWriter<Header>& header) {
+          header.Set<&Header::host>("some-host").Set<&Header::timestamp>(99);
+        })
+        .Set<&LogEvent::message>("hello")
+        .Set<&LogEvent::checksum>(0);
+    return writer.Finish();
+  };
+  std::vector<uint8_t> buffer(expected.size() + 16);
+  uint8_t* const end = write(buffer.data(), buffer.data() + buffer.size());
+  ASSERT_TRUE(end);
+  EXPECT_EQ(expected, std::vector<uint8_t>(buffer.data(), end));
+
+  for (std::size_t size = 0; size < expected.size(); ++size) {
+    std::vector<uint8_t> small(size);
+    EXPECT_EQ(nullptr, write(small.data(), small.data() + small.size()));
+  }
+}
+
+}  // namespace
+}  // namespace pb